@@ -0,0 +1,14 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_COMPOSITOR_TEST_H_
+#define VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_COMPOSITOR_TEST_H_
+
+struct sl_host_surface;
+
+// Acts as if the host sent wl_buffer.release for every output buffer |host|
+// is waiting on, since there is no host compositor to do so in tests.
+void sl_host_surface_release_busy_buffers(struct sl_host_surface* host);
+
+#endif  // VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_COMPOSITOR_TEST_H_
@@ -9,9 +9,17 @@
 #include "../sommelier-transform.h"  // NOLINT(build/include_directory)
 #include "../sommelier-window.h"     // NOLINT(build/include_directory)
 #include "../sommelier-xshape.h"     // NOLINT(build/include_directory)
+#include "sommelier-copy.h"          // NOLINT(build/include_directory)
 #include "sommelier-dmabuf-sync.h"   // NOLINT(build/include_directory)
 #include "sommelier-formats.h"       // NOLINT(build/include_directory)
+#include "sommelier-linux-dmabuf.h"  // NOLINT(build/include_directory)
+#include "sommelier-tile-hash.h"     // NOLINT(build/include_directory)
 #include "viewporter-shim.h"         // NOLINT(build/include_directory)
+
+#if WITH_TESTS
+#include "sommelier-compositor-test.h"  // NOLINT(build/include_directory)
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <libdrm/drm_fourcc.h>
@@ -23,6 +31,11 @@
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-util.h>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include "drm-server-protocol.h"  // NOLINT(build/include_directory)
 #include "linux-dmabuf-unstable-v1-client-protocol.h"  // NOLINT(build/include_directory)
@@ -30,6 +43,13 @@
 #include "viewporter-client-protocol.h"  // NOLINT(build/include_directory)
 #include "xdg-shell-client-protocol.h"   // NOLINT(build/include_directory)
 
+// With --adaptive-output-buffers, the commits before the kind of output
+// buffer not in use is tried again, since which is cheaper changes with the
+// surface's size and how it's updated, and for how many commits. The first
+// copies into its buffers aren't measured, so it needs a few.
+#define OUTPUT_BUFFER_PROBE_INTERVAL 300
+#define OUTPUT_BUFFER_PROBE_COMMITS 8
+
 struct sl_host_compositor {
   struct sl_compositor* compositor;
   struct wl_resource* resource;
@@ -38,15 +58,36 @@ struct sl_host_compositor {
 
 struct sl_output_buffer {
   struct wl_list link;
+  // Link in the context's |released_output_buffers| while the buffer is one
+  // of its surface's released buffers.
+  struct wl_list released_link;
   uint32_t width;
   uint32_t height;
   uint32_t format;
   struct wl_buffer* internal;
   struct sl_mmap* mmap;
-  struct pixman_region32 surface_damage;
-  struct pixman_region32 buffer_damage;
-  pixman_image_t* shape_image;
+  // The commit of its surface whose contents it holds, or 0 if all of it
+  // needs copying.
+  uint64_t damage_seq;
+  // Shaped buffers hold ARGB8888 with everything outside |shape| cleared.
+  // Only damage is copied while |shape| matches the window's shape.
+  bool shaped;
+  struct pixman_region32 shape;
+  // Owning surface, or nullptr while the buffer sits in the context-wide
+  // pool or is waiting for the host to release it after its surface died.
   struct sl_host_surface* surface;
+  struct sl_context* ctx;
+  bool dmabuf;
+  // Size of the contents last copied in. Smaller than the buffer itself
+  // when the buffer was rounded up to a size bucket.
+  uint32_t contents_width;
+  uint32_t contents_height;
+  // Hashes of the tiles last copied in, for --tile-damage-filter.
+  TileHashMap tile_hashes;
+  // What the channel allocated the buffer as, so it can be handed back to
+  // the channel for reuse. |allocation.fd| is -1 if nothing was allocated.
+  struct WaylandBufferCreateInfo allocation_info;
+  struct WaylandBufferCreateOutput allocation;
 };
 
 static void sl_virtwl_dmabuf_sync(int fd, __u32 flags, struct sl_context* ctx) {
@@ -64,16 +105,28 @@ static void sl_virtwl_dmabuf_end_write(int fd, struct sl_context* ctx) {
   sl_virtwl_dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE, ctx);
 }
 
+// Called when |buffer| stops being its surface's, which can't keep the
+// cursor image it holds then.
+static void sl_output_buffer_forget_cursor(struct sl_output_buffer* buffer) {
+  if (buffer->surface && buffer->surface->cursor_buffer == buffer)
+    buffer->surface->cursor_buffer = nullptr;
+}
+
 static void sl_output_buffer_destroy(struct sl_output_buffer* buffer) {
+  sl_output_buffer_forget_cursor(buffer);
   wl_buffer_destroy(buffer->internal);
+  if (buffer->allocation.fd >= 0) {
+    // The mapping closes the fd it was created with, so the channel gets
+    // its own.
+    struct WaylandBufferCreateOutput allocation = buffer->allocation;
+    allocation.fd = dup(buffer->mmap->fd);
+    buffer->ctx->channel->free_buffer(buffer->allocation_info, allocation);
+  }
+  buffer->ctx->output_buffer_bytes -= buffer->mmap->size;
   sl_mmap_unref(buffer->mmap);
-  pixman_region32_fini(&buffer->surface_damage);
-  pixman_region32_fini(&buffer->buffer_damage);
+  pixman_region32_fini(&buffer->shape);
   wl_list_remove(&buffer->link);
-
-  if (buffer->shape_image)
-    pixman_image_unref(buffer->shape_image);
-
+  wl_list_remove(&buffer->released_link);
   delete buffer;
 }
 
@@ -81,20 +134,295 @@ static uint32_t try_wl_resource_get_id(wl_resource* resource) {
   return resource ? wl_resource_get_id(resource) : -1;
 }
 
+static void sl_damage_init(struct sl_damage* damage) {
+  pixman_region32_init(&damage->surface);
+  pixman_region32_init(&damage->buffer);
+}
+
+static void sl_damage_fini(struct sl_damage* damage) {
+  pixman_region32_fini(&damage->surface);
+  pixman_region32_fini(&damage->buffer);
+}
+
+static void sl_output_buffer_damage_all(struct sl_output_buffer* buffer) {
+  buffer->damage_seq = 0;
+}
+
+// Rounds an output buffer dimension up to the size bucket selected with
+// --buffer-size-buckets, so that a surface being resized keeps landing on
+// the same few buffers instead of needing a new one every frame.
+static uint32_t sl_output_buffer_bucket_size(struct sl_context* ctx,
+                                             uint32_t size) {
+  if (!size)
+    return size;
+  if (ctx->buffer_size_bucket == SL_BUFFER_SIZE_BUCKET_POW2) {
+    uint32_t bucket = 1;
+    while (bucket < size)
+      bucket <<= 1;
+    return bucket;
+  }
+  if (ctx->buffer_size_bucket > 0) {
+    uint32_t step = ctx->buffer_size_bucket;
+    return (size + step - 1) / step * step;
+  }
+  return size;
+}
+
+// Prefetches what allocating the buckets a surface resized out of its
+// |width|x|height| bucket lands on next would need from the host, so that
+// growing into them doesn't stall the event loop.
+static void sl_output_buffer_prefetch_next_buckets(struct sl_context* ctx,
+                                                   uint32_t width,
+                                                   uint32_t height,
+                                                   uint32_t shm_format,
+                                                   bool dmabuf) {
+  uint32_t next_width = sl_output_buffer_bucket_size(ctx, width + 1);
+  uint32_t next_height = sl_output_buffer_bucket_size(ctx, height + 1);
+  const uint32_t sizes[][2] = {
+      {next_width, height}, {width, next_height}, {next_width, next_height}};
+
+  for (const auto& size : sizes) {
+    struct WaylandBufferCreateInfo create_info = {};
+
+    if (dmabuf) {
+      create_info.dmabuf = true;
+      create_info.width = size[0];
+      create_info.height = size[1];
+      create_info.drm_format = sl_shm_format_to_drm_format(shm_format);
+      create_info.scanout =
+          sl_linux_dmabuf_host_scanout_linear(ctx, create_info.drm_format);
+    } else {
+      // Matches the tightly packed layout bucketed shm buffers get.
+      size_t stride = size[0] * sl_shm_format_bpp(shm_format);
+      size_t bytes = sl_shm_format_size(shm_format, size[1], stride);
+      create_info.drm_format = DRM_FORMAT_R8;
+      create_info.height = 1;
+      create_info.width = bytes;
+      create_info.size = static_cast<__u32>(bytes);
+    }
+    sl_context_prefetch_allocation(ctx, create_info);
+  }
+}
+
+static bool sl_output_buffer_matches(const struct sl_output_buffer* buffer,
+                                     uint32_t width,
+                                     uint32_t height,
+                                     uint32_t shm_format,
+                                     bool shaped,
+                                     bool dmabuf) {
+  return buffer->width == width && buffer->height == height &&
+         buffer->dmabuf == dmabuf &&
+         ((shaped && buffer->shaped &&
+           buffer->format == WL_SHM_FORMAT_ARGB8888) ||
+          (!shaped && buffer->format == shm_format));
+}
+
+static void sl_output_buffer_drop_idle(struct sl_context* ctx);
+
+// Notes that |buffer| just joined its surface's released buffers.
+static void sl_output_buffer_track_released(struct sl_output_buffer* buffer) {
+  struct sl_context* ctx = buffer->ctx;
+
+  wl_list_remove(&buffer->released_link);
+  wl_list_insert(&ctx->released_output_buffers, &buffer->released_link);
+
+  if (ctx->output_buffer_idle_ns &&
+      !ctx->housekeeping[SL_HOUSEKEEPING_OUTPUT_BUFFER_IDLE].deadline_ns) {
+    sl_context_schedule_housekeeping(ctx, SL_HOUSEKEEPING_OUTPUT_BUFFER_IDLE,
+                                     ctx->output_buffer_idle_ns / 1000000,
+                                     sl_output_buffer_drop_idle);
+  }
+}
+
+// Notes that |buffer| left its surface's released buffers.
+static void sl_output_buffer_untrack_released(
+    struct sl_output_buffer* buffer) {
+  wl_list_remove(&buffer->released_link);
+  wl_list_init(&buffer->released_link);
+}
+
+// Destroys released output buffers until all of them fit in the budget set
+// with --buffer-budget again: those in the context-wide pool first, then the
+// least recently released ones of any surface. Buffers the host holds and
+// the ones surfaces are about to commit are kept, so the budget can still
+// be exceeded.
+static void sl_output_buffer_trim_to_budget(struct sl_context* ctx) {
+  struct sl_output_buffer* buffer;
+  struct sl_output_buffer* prev;
+
+  if (!ctx->output_buffer_budget)
+    return;
+
+  while (ctx->output_buffer_bytes > ctx->output_buffer_budget &&
+         !wl_list_empty(&ctx->output_buffer_pool)) {
+    buffer = wl_container_of(ctx->output_buffer_pool.prev, buffer, link);
+    ctx->output_buffer_pool_size -= buffer->mmap->size;
+    sl_output_buffer_destroy(buffer);
+    ctx->metrics.output_buffers_trimmed++;
+  }
+
+  wl_list_for_each_reverse_safe(buffer, prev, &ctx->released_output_buffers,
+                                released_link) {
+    if (ctx->output_buffer_bytes <= ctx->output_buffer_budget)
+      break;
+    if (buffer == buffer->surface->current_buffer)
+      continue;
+    sl_output_buffer_destroy(buffer);
+    ctx->metrics.output_buffers_trimmed++;
+  }
+}
+
+// Drops the released buffers of surfaces that haven't committed for
+// --buffer-idle-timeout, leaving each with only the buffer it shows.
+static void sl_output_buffer_drop_idle(struct sl_context* ctx) {
+  int64_t now = sl_monotonic_time_ns();
+  int64_t next_idle_ns = 0;
+  struct sl_output_buffer* buffer;
+  struct sl_output_buffer* prev;
+
+  wl_list_for_each_reverse_safe(buffer, prev, &ctx->released_output_buffers,
+                                released_link) {
+    struct sl_host_surface* surface = buffer->surface;
+
+    if (buffer == surface->current_buffer)
+      continue;
+    int64_t idle_ns = surface->last_commit_ns + ctx->output_buffer_idle_ns;
+    if (idle_ns > now) {
+      if (!next_idle_ns || idle_ns < next_idle_ns)
+        next_idle_ns = idle_ns;
+      continue;
+    }
+    sl_output_buffer_destroy(buffer);
+    ctx->metrics.output_buffers_trimmed++;
+  }
+
+  // Buffers surfaces show are never dropped, so they don't need the timer.
+  if (next_idle_ns) {
+    sl_context_schedule_housekeeping(ctx, SL_HOUSEKEEPING_OUTPUT_BUFFER_IDLE,
+                                     (next_idle_ns - now + 999999) / 1000000,
+                                     sl_output_buffer_drop_idle);
+  }
+}
+
+// Hands a released buffer its surface no longer wants to the context-wide
+// pool, so another surface can reuse it instead of allocating. The least
+// recently pooled buffers are destroyed to stay within the pool's limit.
+static void sl_output_buffer_recycle(struct sl_output_buffer* buffer) {
+  struct sl_context* ctx = buffer->ctx;
+  size_t size = buffer->mmap->size;
+
+  if (size > ctx->output_buffer_pool_limit) {
+    sl_output_buffer_destroy(buffer);
+    return;
+  }
+
+  sl_output_buffer_untrack_released(buffer);
+  sl_output_buffer_forget_cursor(buffer);
+  wl_list_remove(&buffer->link);
+  wl_list_insert(&ctx->output_buffer_pool, &buffer->link);
+  buffer->surface = nullptr;
+  ctx->output_buffer_pool_size += size;
+
+  while (ctx->output_buffer_pool_size > ctx->output_buffer_pool_limit) {
+    struct sl_output_buffer* oldest;
+    oldest = wl_container_of(ctx->output_buffer_pool.prev, oldest, link);
+    ctx->output_buffer_pool_size -= oldest->mmap->size;
+    sl_output_buffer_destroy(oldest);
+  }
+}
+
+// Takes the most recently pooled buffer matching the given layout out of the
+// context-wide pool and gives it to |host|. Returns nullptr if none match.
+static struct sl_output_buffer* sl_output_buffer_pool_take(
+    struct sl_host_surface* host,
+    uint32_t width,
+    uint32_t height,
+    uint32_t shm_format,
+    bool shaped,
+    bool dmabuf) {
+  struct sl_context* ctx = host->ctx;
+  struct sl_output_buffer* buffer;
+
+  wl_list_for_each(buffer, &ctx->output_buffer_pool, link) {
+    if (sl_output_buffer_matches(buffer, width, height, shm_format, shaped,
+                                 dmabuf)) {
+      TRACE_EVENT("surface", "sl_output_buffer_pool_take", "size",
+                  buffer->mmap->size);
+      ctx->output_buffer_pool_size -= buffer->mmap->size;
+      wl_list_remove(&buffer->link);
+      wl_list_insert(&host->released_buffers, &buffer->link);
+      buffer->surface = host;
+      sl_output_buffer_track_released(buffer);
+
+      // Contents are from another surface, so all of it needs copying.
+      sl_output_buffer_damage_all(buffer);
+      return buffer;
+    }
+  }
+  return nullptr;
+}
+
+// Traces how many output buffers of |host| the host holds on to, and how
+// many are ready to be reused.
+static void sl_trace_output_buffers(struct sl_host_surface* host) {
+  TRACE_COUNTER("surface",
+                perfetto::CounterTrack(
+                    "busy_output_buffers",
+                    perfetto::Track(reinterpret_cast<uintptr_t>(host))),
+                wl_list_length(&host->busy_buffers));
+  TRACE_COUNTER("surface",
+                perfetto::CounterTrack(
+                    "released_output_buffers",
+                    perfetto::Track(reinterpret_cast<uintptr_t>(host))),
+                wl_list_length(&host->released_buffers));
+#ifndef PERFETTO_TRACING
+  UNUSED(host);
+#endif
+}
+
 static void sl_output_buffer_release(void* data, struct wl_buffer* buffer) {
   struct sl_output_buffer* output_buffer =
       static_cast<sl_output_buffer*>(wl_buffer_get_user_data(buffer));
-  TRACE_EVENT("surface", "sl_output_buffer_release", "resource_id",
-              try_wl_resource_get_id(output_buffer->surface->resource));
   struct sl_host_surface* host_surface = output_buffer->surface;
+  TRACE_EVENT("surface", "sl_output_buffer_release", "resource_id",
+              try_wl_resource_get_id(host_surface ? host_surface->resource
+                                                  : nullptr),
+              TRACE_TERMINATING_FLOW(buffer));
+
+  if (!host_surface) {
+    // The surface went away while the host was still using this buffer.
+    sl_output_buffer_recycle(output_buffer);
+    return;
+  }
+
+  // Sommelier hands buffers back itself without |data| when a commit falls
+  // back to the client buffer.
+  if (data && host_surface->ctx->frame_stats != nullptr) {
+    host_surface->ctx->frame_stats->AddRelease(
+        try_wl_resource_get_id(host_surface->resource));
+  }
 
   wl_list_remove(&output_buffer->link);
   wl_list_insert(&host_surface->released_buffers, &output_buffer->link);
+  sl_output_buffer_track_released(output_buffer);
+  sl_output_buffer_trim_to_budget(host_surface->ctx);
+  sl_trace_output_buffers(host_surface);
 }
 
 static const struct wl_buffer_listener sl_output_buffer_listener = {
     sl_output_buffer_release};
 
+#if WITH_TESTS
+void sl_host_surface_release_busy_buffers(struct sl_host_surface* host) {
+  struct sl_output_buffer* buffer;
+  struct sl_output_buffer* next;
+
+  wl_list_for_each_safe(buffer, next, &host->busy_buffers, link) {
+    sl_output_buffer_release(buffer, buffer->internal);
+  }
+}
+#endif
+
 static void sl_host_surface_destroy(struct wl_client* client,
                                     struct wl_resource* resource) {
   TRACE_EVENT("surface", "sl_host_surface_destroy", "resource_id",
@@ -102,6 +430,46 @@ static void sl_host_surface_destroy(struct wl_client* client,
   wl_resource_destroy(resource);
 }
 
+// Returns whether the next output buffer of |host| is a dmabuf, given
+// whether dmabufs are |supported| at all. Each kind is tried until it's
+// been measured, dmabufs first, and then the cheaper one is used.
+static bool sl_host_surface_use_dmabuf(struct sl_host_surface* host,
+                                       bool supported) {
+  const int64_t* cost = host->output_copy_cost;
+
+  if (!supported || !host->ctx->adaptive_output_buffers)
+    return supported;
+  if (!cost[1] || !cost[0])
+    return !cost[1];
+
+  bool dmabuf_cheaper = cost[1] < cost[0];
+  uint32_t commits = ++host->output_probe_commits;
+  if (commits <= OUTPUT_BUFFER_PROBE_INTERVAL) {
+    host->output_probe_dmabuf = !dmabuf_cheaper;
+    return dmabuf_cheaper;
+  }
+  // Cut short once the kind tried turns out cheaper.
+  if (commits >= OUTPUT_BUFFER_PROBE_INTERVAL + OUTPUT_BUFFER_PROBE_COMMITS ||
+      host->output_probe_dmabuf == dmabuf_cheaper) {
+    host->output_probe_commits = 0;
+  }
+  return host->output_probe_dmabuf;
+}
+
+// Folds a copy of |bytes| into |buffer| that took |duration_ns| into the
+// cost measured for its kind of output buffer. Only copies into a buffer
+// that has been copied into before are measured, as the first one copies
+// everything and faults its pages in.
+static void sl_host_surface_record_copy_cost(struct sl_host_surface* host,
+                                             struct sl_output_buffer* buffer,
+                                             size_t bytes,
+                                             int64_t duration_ns) {
+  int64_t* cost = &host->output_copy_cost[buffer->dmabuf];
+  int64_t sample = std::max<int64_t>(duration_ns * (1 << 20) / bytes, 1);
+
+  *cost = *cost ? (3 * *cost + sample) / 4 : sample;
+}
+
 static void sl_host_surface_attach(struct wl_client* client,
                                    struct wl_resource* resource,
                                    struct wl_resource* buffer_resource,
@@ -114,6 +482,16 @@ static void sl_host_surface_attach(struct wl_client* client,
               "buffer_id", buffer_id);
   struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
+  if (sl_host_surface_holds_requests(host)) {
+    // Destroying the buffer before it's attached leaves the contents
+    // undefined, so the attach is just dropped then.
+    sl_host_surface_queue_request(
+        host, buffer_resource ? buffer_resource : resource,
+        [client, resource, buffer_resource, x, y] {
+          sl_host_surface_attach(client, resource, buffer_resource, x, y);
+        });
+    return;
+  }
   if (host->ctx->timing != nullptr) {
     host->ctx->timing->UpdateLastAttach(resource_id, buffer_id);
   }
@@ -131,6 +509,7 @@ static void sl_host_surface_attach(struct wl_client* client,
   if (window && host->ctx->enable_xshape)
     window_shaped = window->shaped;
 
+  sl_host_surface_apply_held_commit(host);
   host->current_buffer = nullptr;
   if (host->contents_shm_mmap) {
     sl_mmap_unref(host->contents_shm_mmap);
@@ -159,6 +538,11 @@ static void sl_host_surface_attach(struct wl_client* client,
     }
   }
 
+  if (host->ctx->frame_stats != nullptr) {
+    host->ctx->frame_stats->AddAttach(
+        resource_id, host->contents_shm_mmap ? kUnknownBufferId : buffer_id);
+  }
+
   // Transfer the flag and shape data over to the surface
   // if we are working on a shaped window
   if (window_shaped) {
@@ -176,56 +560,82 @@ static void sl_host_surface_attach(struct wl_client* client,
   // An output_surface that is shaped will have its format
   // forced to ARGB8888 (hence the changes below)
   if (host->contents_shm_mmap) {
-    while (!wl_list_empty(&host->released_buffers)) {
-      host->current_buffer = wl_container_of(host->released_buffers.next,
-                                             host->current_buffer, link);
-
-      if (host->current_buffer->width == host_buffer->width &&
-          host->current_buffer->height == host_buffer->height &&
-          ((window_shaped && host->current_buffer->shape_image &&
-            host->current_buffer->format == WL_SHM_FORMAT_ARGB8888) ||
-           (!window_shaped &&
-            host->current_buffer->format == host_buffer->shm_format))) {
+    bool use_dmabuf = sl_host_surface_use_dmabuf(
+        host, host->ctx->channel->supports_dmabuf() &&
+                  host->ctx->linux_dmabuf->internal);
+    uint32_t alloc_width = host_buffer->width;
+    uint32_t alloc_height = host_buffer->height;
+
+    // Bucketed buffers are cropped back to the contents size with the
+    // viewport at commit. Shaped contents aren't bucketed.
+    if (host->viewport && !window_shaped) {
+      alloc_width = sl_output_buffer_bucket_size(host->ctx, alloc_width);
+      alloc_height = sl_output_buffer_bucket_size(host->ctx, alloc_height);
+    }
+
+    struct sl_output_buffer* buffer;
+    struct sl_output_buffer* next;
+    wl_list_for_each_safe(buffer, next, &host->released_buffers, link) {
+      if (sl_output_buffer_matches(buffer, alloc_width, alloc_height,
+                                   host_buffer->shm_format, window_shaped,
+                                   use_dmabuf)) {
+        host->current_buffer = buffer;
         break;
       }
 
-      sl_output_buffer_destroy(host->current_buffer);
-      host->current_buffer = nullptr;
+      // Kept while the other kind is tried, so switching back finds them.
+      if (host->ctx->adaptive_output_buffers &&
+          sl_output_buffer_matches(buffer, alloc_width, alloc_height,
+                                   host_buffer->shm_format, window_shaped,
+                                   !use_dmabuf)) {
+        continue;
+      }
+      sl_output_buffer_recycle(buffer);
+    }
+
+    if (!host->current_buffer) {
+      host->current_buffer = sl_output_buffer_pool_take(
+          host, alloc_width, alloc_height, host_buffer->shm_format,
+          window_shaped, use_dmabuf);
+    }
+
+    // Damage only tracks changes within one contents size, so a bucketed
+    // buffer reused at a different size needs a full copy.
+    if (host->current_buffer &&
+        (host->current_buffer->contents_width != host_buffer->width ||
+         host->current_buffer->contents_height != host_buffer->height)) {
+      sl_output_buffer_damage_all(host->current_buffer);
     }
 
     // Allocate new output buffer.
     if (!host->current_buffer) {
       TRACE_EVENT("surface", "sl_host_surface_attach: allocate_buffer",
                   "dmabuf_enabled", host->ctx->channel->supports_dmabuf());
-      size_t width = host_buffer->width;
-      size_t height = host_buffer->height;
+      size_t width = alloc_width;
+      size_t height = alloc_height;
+      bool bucketed =
+          width != host_buffer->width || height != host_buffer->height;
       uint32_t shm_format =
           window_shaped ? WL_SHM_FORMAT_ARGB8888 : host_buffer->shm_format;
       size_t bpp = sl_shm_format_bpp(shm_format);
       size_t num_planes = sl_shm_format_num_planes(shm_format);
 
       host->current_buffer = new sl_output_buffer();
+      host->ctx->metrics.output_buffers_allocated++;
+      host->current_buffer->allocation.fd = -1;
       wl_list_insert(&host->released_buffers, &host->current_buffer->link);
+      wl_list_init(&host->current_buffer->released_link);
       host->current_buffer->width = width;
       host->current_buffer->height = height;
       host->current_buffer->format = shm_format;
       host->current_buffer->surface = host;
-      pixman_region32_init_rect(&host->current_buffer->surface_damage, 0, 0,
-                                MAX_SIZE, MAX_SIZE);
-      pixman_region32_init_rect(&host->current_buffer->buffer_damage, 0, 0,
-                                MAX_SIZE, MAX_SIZE);
-
-      if (window_shaped) {
-        host->current_buffer->shape_image = pixman_image_create_bits_no_clear(
-            PIXMAN_a8r8g8b8, width, height, nullptr, 0);
-
-        assert(host->current_buffer->shape_image);
-      } else {
-        host->current_buffer->shape_image = nullptr;
-      }
+      host->current_buffer->ctx = host->ctx;
+      host->current_buffer->dmabuf = use_dmabuf;
+      host->current_buffer->damage_seq = 0;
+      pixman_region32_init(&host->current_buffer->shape);
+      host->current_buffer->shaped = window_shaped;
 
-      if (host->ctx->channel->supports_dmabuf() &&
-          host->ctx->linux_dmabuf->proxy_v2) {
+      if (use_dmabuf) {
         int rv;
         size_t size;
         struct zwp_linux_buffer_params_v1* buffer_params;
@@ -236,23 +646,29 @@ static void sl_host_surface_attach(struct wl_client* client,
         create_info.width = static_cast<__u32>(width);
         create_info.height = static_cast<__u32>(height);
         create_info.drm_format = sl_shm_format_to_drm_format(shm_format);
+        create_info.scanout = sl_linux_dmabuf_host_scanout_linear(
+            host->ctx, create_info.drm_format);
 
         rv = host->ctx->channel->allocate(create_info, create_output);
         if (rv) {
           LOG(FATAL) << "virtwl dmabuf allocation failed: " << strerror(-rv);
           _exit(EXIT_FAILURE);
         }
+        host->current_buffer->allocation_info = create_info;
+        host->current_buffer->allocation = create_output;
 
         size = create_output.host_size;
         buffer_params = zwp_linux_dmabuf_v1_create_params(
-            host->ctx->linux_dmabuf->proxy_v2);
-        zwp_linux_buffer_params_v1_add(buffer_params, create_output.fd, 0,
-                                       create_output.offsets[0],
-                                       create_output.strides[0], 0, 0);
+            host->ctx->linux_dmabuf->internal);
+        uint32_t modifier_hi = create_output.modifier >> 32;
+        uint32_t modifier_lo = create_output.modifier & 0xFFFFFFFF;
+        zwp_linux_buffer_params_v1_add(
+            buffer_params, create_output.fd, 0, create_output.offsets[0],
+            create_output.strides[0], modifier_hi, modifier_lo);
         if (num_planes > 1) {
-          zwp_linux_buffer_params_v1_add(buffer_params, create_output.fd, 1,
-                                         create_output.offsets[1],
-                                         create_output.strides[1], 0, 0);
+          zwp_linux_buffer_params_v1_add(
+              buffer_params, create_output.fd, 1, create_output.offsets[1],
+              create_output.strides[1], modifier_hi, modifier_lo);
           size = MAX(size, create_output.offsets[1] +
                                create_output.offsets[1] * height /
                                    host->contents_shm_mmap->y_ss[1]);
@@ -271,6 +687,19 @@ static void sl_host_surface_attach(struct wl_client* client,
         host->current_buffer->mmap->end_write = sl_virtwl_dmabuf_end_write;
       } else {
         size_t size = host->contents_shm_mmap->size;
+        size_t stride0 = host->contents_shm_mmap->stride[0];
+        size_t stride1 = host->contents_shm_mmap->stride[1];
+        size_t offset1 = host->contents_shm_mmap->offset[1] -
+                         host->contents_shm_mmap->offset[0];
+        if (bucketed) {
+          // The client's layout doesn't fit, so use a tightly packed one.
+          stride0 = width * bpp;
+          stride1 = num_planes > 1 ? stride0 : 0;
+          offset1 = num_planes > 1 ? sl_shm_format_plane_offset(
+                                         shm_format, 1, height, stride0)
+                                   : 0;
+          size = sl_shm_format_size(shm_format, height, stride0);
+        }
         struct WaylandBufferCreateInfo create_info = {};
         struct WaylandBufferCreateOutput create_output = {};
         struct wl_shm_pool* pool;
@@ -282,31 +711,45 @@ static void sl_host_surface_attach(struct wl_client* client,
         create_info.size = static_cast<__u32>(size);
 
         rv = host->ctx->channel->allocate(create_info, create_output);
-        UNUSED(rv);
+        if (!rv) {
+          host->current_buffer->allocation_info = create_info;
+          host->current_buffer->allocation = create_output;
+        }
 
         pool = wl_shm_create_pool(host->ctx->shm->internal, create_output.fd,
                                   create_output.host_size);
 
         host->current_buffer->internal = wl_shm_pool_create_buffer(
-            pool, 0, width, height, host->contents_shm_mmap->stride[0],
-            shm_format);
+            pool, 0, width, height, stride0, shm_format);
         wl_shm_pool_destroy(pool);
 
         host->current_buffer->mmap = sl_mmap_create(
             create_output.fd, create_output.host_size, bpp, num_planes, 0,
-            host->contents_shm_mmap->stride[0],
-            host->contents_shm_mmap->offset[1] -
-                host->contents_shm_mmap->offset[0],
-            host->contents_shm_mmap->stride[1],
-            host->contents_shm_mmap->y_ss[0], host->contents_shm_mmap->y_ss[1]);
+            stride0, offset1, stride1, host->contents_shm_mmap->y_ss[0],
+            host->contents_shm_mmap->y_ss[1]);
       }
 
       assert(host->current_buffer->internal);
       assert(host->current_buffer->mmap);
+      if (host->ctx->prefault_output_buffers) {
+        sl_mmap_prefault(host->current_buffer->mmap,
+                         host->ctx->huge_page_output_buffers);
+      }
+      host->ctx->output_buffer_bytes += host->current_buffer->mmap->size;
+      sl_output_buffer_track_released(host->current_buffer);
+      sl_output_buffer_trim_to_budget(host->ctx);
 
       wl_buffer_add_listener(host->current_buffer->internal,
                              &sl_output_buffer_listener, host->current_buffer);
+
+      if (bucketed) {
+        sl_output_buffer_prefetch_next_buckets(host->ctx, width, height,
+                                               shm_format, use_dmabuf);
+      }
     }
+
+    host->current_buffer->contents_width = host_buffer->width;
+    host->current_buffer->contents_height = host_buffer->height;
   }
 
   sl_transform_guest_to_host(host->ctx, host, &x, &y);
@@ -316,7 +759,21 @@ static void sl_host_surface_attach(struct wl_client* client,
   host->contents_x_offset = x;
   host->contents_y_offset = y;
 
-  if (host_buffer && host_buffer->sync_point) {
+  host->attach_pending = true;
+
+  // An explicitly synchronized buffer is waited for at commit instead.
+  bool explicit_sync = sl_drm_syncobj_surface_attach(host, host_buffer);
+
+  // Forwarded as it is, a buffer the host's feedback lists for scanout can
+  // skip composition once the window is fullscreen.
+  host->attached_scanout_compatible =
+      host_buffer && host_buffer->is_drm &&
+      std::find(host->scanout_formats.begin(), host->scanout_formats.end(),
+                std::make_pair(host_buffer->drm_format,
+                               host_buffer->modifier)) !=
+          host->scanout_formats.end();
+
+  if (host_buffer && host_buffer->sync_point && !explicit_sync) {
     TRACE_EVENT("surface", "sl_host_surface_attach: sync_point");
 
     bool needs_sync = true;
@@ -343,36 +800,46 @@ static void sl_host_surface_attach(struct wl_client* client,
           // virtio_gpu fences can be translated and forwarded to host.
           zwp_linux_surface_synchronization_v1_set_acquire_fence(
               host->surface_sync, sync_file_fd);
+          close(sync_file_fd);
         } else {
           // TODO(dbehr) b/237014660. Create a host proxy fence for this fence
-          // instead of waiting for rendering to finish here.
+          // instead of holding requests back until rendering finishes.
           TRACE_EVENT("surface", "sl_host_surface_attach: sync_wait",
                       "prime_fd", host_buffer->sync_point->fd);
-          sl_dmabuf_sync_wait(sync_file_fd);
+          sl_context_wait_for_fence(host->ctx, host, sync_file_fd);
         }
         needs_sync = false;
-        close(sync_file_fd);
       }
     }
 
     if (needs_sync)
-      host_buffer->sync_point->sync(host->ctx, host_buffer->sync_point);
+      host_buffer->sync_point->sync(host->ctx, host, host_buffer->sync_point);
   }
 
-  if (host->current_buffer) {
+  host->cursor_attach_pending = false;
+  if (host->current_buffer && host->is_cursor && !host->syncobj_surface) {
+    // Left to sl_host_surface_commit_cursor(), which may keep the image the
+    // host already has instead.
+    host->cursor_attach_pending = true;
+    host->cursor_attach_x = x;
+    host->cursor_attach_y = y;
+  } else if (host->current_buffer) {
     assert(host->current_buffer->internal);
+    TRACE_EVENT("surface", "sl_host_surface_attach: wl_surface_attach",
+                TRACE_FLOW(host->current_buffer->internal));
+    host->cursor_buffer = nullptr;
     wl_surface_attach(host->proxy, host->current_buffer->internal, x, y);
   } else {
+    TRACE_EVENT("surface", "sl_host_surface_attach: wl_surface_attach",
+                TRACE_FLOW(buffer_proxy));
+    host->cursor_buffer = nullptr;
     wl_surface_attach(host->proxy, buffer_proxy, x, y);
   }
 
-  wl_list_for_each(window, &host->ctx->windows, link) {
-    if (window->host_surface_id == try_wl_resource_get_id(resource)) {
-      while (sl_process_pending_configure_acks(window, host))
-        continue;
-
-      break;
-    }
+  window = sl_context_lookup_window_for_surface(host->ctx, resource);
+  if (window) {
+    while (sl_process_pending_configure_acks(window, host))
+      continue;
   }
 }
 
@@ -416,6 +883,52 @@ void compute_buffer_scale_and_offset(const sl_host_surface* host,
   *out_offset_y = offset_y;
 }
 
+// Holds damage in host surface coordinates back until the next commit, see
+// sl_host_surface_flush_damage().
+static void sl_host_surface_add_damage(struct sl_host_surface* host,
+                                       int64_t x1,
+                                       int64_t y1,
+                                       int64_t x2,
+                                       int64_t y2) {
+  // Clients commonly damage everything with INT32_MAX sized rectangles.
+  x1 = std::clamp<int64_t>(x1, -MAX_SIZE, MAX_SIZE);
+  y1 = std::clamp<int64_t>(y1, -MAX_SIZE, MAX_SIZE);
+  x2 = std::clamp<int64_t>(x2, -MAX_SIZE, MAX_SIZE);
+  y2 = std::clamp<int64_t>(y2, -MAX_SIZE, MAX_SIZE);
+  pixman_region32_union_rect(&host->pending_damage, &host->pending_damage, x1,
+                             y1, x2 - x1, y2 - y1);
+}
+
+void sl_host_surface_flush_damage(struct sl_host_surface* host) {
+  int count;
+  pixman_box32_t* rects =
+      pixman_region32_rectangles(&host->pending_damage, &count);
+  if (!count)
+    return;
+
+  // One bounding box costs the host little extra composition when it
+  // mostly covers damage anyway, and beyond --damage-rect-limit rectangles
+  // the requests cost more than the pixels.
+  pixman_box32_t* extents = pixman_region32_extents(&host->pending_damage);
+  int64_t area = 0;
+  for (int i = 0; i < count; ++i) {
+    area += static_cast<int64_t>(rects[i].x2 - rects[i].x1) *
+            (rects[i].y2 - rects[i].y1);
+  }
+  int64_t extents_area = static_cast<int64_t>(extents->x2 - extents->x1) *
+                         (extents->y2 - extents->y1);
+  if (count > host->ctx->damage_rect_limit || extents_area <= 2 * area) {
+    rects = extents;
+    count = 1;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    wl_surface_damage(host->proxy, rects[i].x1, rects[i].y1,
+                      rects[i].x2 - rects[i].x1, rects[i].y2 - rects[i].y1);
+  }
+  pixman_region32_clear(&host->pending_damage);
+}
+
 static void sl_host_surface_damage(struct wl_client* client,
                                    struct wl_resource* resource,
                                    int32_t x,
@@ -424,20 +937,19 @@ static void sl_host_surface_damage(struct wl_client* client,
                                    int32_t height) {
   TRACE_EVENT("surface", "sl_host_surface_damage", "resource_id",
               try_wl_resource_get_id(resource));
-  const struct sl_host_surface* host =
+  struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
 
-  struct sl_output_buffer* buffer;
   int64_t x1, y1, x2, y2;
 
-  wl_list_for_each(buffer, &host->busy_buffers, link) {
-    pixman_region32_union_rect(&buffer->surface_damage, &buffer->surface_damage,
-                               x, y, width, height);
-  }
-  wl_list_for_each(buffer, &host->released_buffers, link) {
-    pixman_region32_union_rect(&buffer->surface_damage, &buffer->surface_damage,
-                               x, y, width, height);
+  if (sl_host_surface_hold_request<sl_host_surface_damage>(
+          host, client, resource, x, y, width, height)) {
+    return;
   }
+  sl_host_surface_apply_held_commit(host);
+  pixman_region32_union_rect(&host->client_damage.surface,
+                             &host->client_damage.surface, x, y, width,
+                             height);
 
   x1 = x;
   y1 = y;
@@ -445,7 +957,7 @@ static void sl_host_surface_damage(struct wl_client* client,
   y2 = y1 + height;
 
   sl_transform_damage_coord(host->ctx, host, 1.0, 1.0, &x1, &y1, &x2, &y2);
-  wl_surface_damage(host->proxy, x1, y1, x2 - x1, y2 - y1);
+  sl_host_surface_add_damage(host, x1, y1, x2, y2);
 }
 
 static void sl_host_surface_damage_buffer(struct wl_client* client,
@@ -456,18 +968,17 @@ static void sl_host_surface_damage_buffer(struct wl_client* client,
                                           int32_t height) {
   TRACE_EVENT("surface", "sl_host_surface_damage_buffer", "resource_id",
               try_wl_resource_get_id(resource));
-  const struct sl_host_surface* host =
+  struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
-  struct sl_output_buffer* buffer;
 
-  wl_list_for_each(buffer, &host->busy_buffers, link) {
-    pixman_region32_union_rect(&buffer->buffer_damage, &buffer->buffer_damage,
-                               x, y, width, height);
-  }
-  wl_list_for_each(buffer, &host->released_buffers, link) {
-    pixman_region32_union_rect(&buffer->buffer_damage, &buffer->buffer_damage,
-                               x, y, width, height);
+  if (sl_host_surface_hold_request<sl_host_surface_damage_buffer>(
+          host, client, resource, x, y, width, height)) {
+    return;
   }
+  sl_host_surface_apply_held_commit(host);
+  pixman_region32_union_rect(&host->client_damage.buffer,
+                             &host->client_damage.buffer, x, y, width,
+                             height);
 
   // Forward wl_surface_damage() call to the host. Since the damage region is
   // given in buffer pixel coordinates, convert to surface coordinates first.
@@ -489,15 +1000,124 @@ static void sl_host_surface_damage_buffer(struct wl_client* client,
 
   sl_transform_damage_coord(host->ctx, host, scale_x, scale_y, &x1, &y1, &x2,
                             &y2);
-  wl_surface_damage(host->proxy, x1, y1, x2 - x1, y2 - y1);
+  sl_host_surface_add_damage(host, x1, y1, x2, y2);
+}
+
+static void sl_host_callback_destroy(struct wl_resource* resource) {
+  TRACE_EVENT("surface", "sl_host_callback_destroy",
+              TRACE_TERMINATING_FLOW(resource));
+  struct sl_host_callback* host =
+      static_cast<sl_host_callback*>(wl_resource_get_user_data(resource));
+
+  if (host->proxy) {
+    wl_callback_destroy(host->proxy);
+    host->ctx->pending_host_callbacks--;
+    TRACE_COUNTER("surface", "pending_host_callbacks",
+                  host->ctx->pending_host_callbacks);
+  } else {
+    wl_list_remove(&host->link);
+  }
+  wl_resource_set_user_data(resource, nullptr);
+  host->ctx->callback_pool.Delete(host);
+}
+
+// Whether frames of |host| are throttled since its window is hidden, see
+// --hidden-frame-interval.
+static bool sl_host_surface_hidden(const struct sl_host_surface* host) {
+  return host->ctx->hidden_frame_interval_ms && host->window &&
+         (host->window->iconified || host->window->host_minimized);
+}
+
+static void sl_host_surface_fire_deferred_callbacks(
+    struct sl_host_surface* host) {
+  struct sl_host_callback* callback;
+  struct sl_host_callback* next;
+  int64_t now = sl_monotonic_time_ns();
+
+  wl_list_for_each_safe(callback, next, &host->deferred_callbacks, link) {
+    // Paced callbacks keep to the host's clock.
+    uint32_t time =
+        callback->held_since_ns
+            ? callback->host_time + (now - callback->held_since_ns) / 1000000
+            : now / 1000000;
+    wl_callback_send_done(callback->resource, time);
+    wl_resource_destroy(callback->resource);
+  }
+}
+
+static int sl_host_surface_deferred_frame_timer(void* data) {
+  sl_host_surface_fire_deferred_callbacks(static_cast<sl_host_surface*>(data));
+  return 0;
 }
 
+// Holds |callback| back until the deferred callbacks of |host| fire, which
+// happens in |delay_ms| if none were held yet.
+static void sl_host_surface_defer_callback(struct sl_host_surface* host,
+                                           struct sl_host_callback* callback,
+                                           int delay_ms) {
+  if (wl_list_empty(&host->deferred_callbacks)) {
+    if (!host->deferred_frame_timer) {
+      host->deferred_frame_timer.reset(wl_event_loop_add_timer(
+          wl_display_get_event_loop(host->ctx->host_display),
+          sl_host_surface_deferred_frame_timer, host));
+    }
+    wl_event_source_timer_update(host->deferred_frame_timer.get(), delay_ms);
+  }
+  wl_list_insert(host->deferred_callbacks.prev, &callback->link);
+}
+
+#ifdef QUIRKS_SUPPORT
+// Returns how long a frame callback the host fired at |now| is held back
+// to keep |host| to the max_fps quirk of its window, or 0 if it goes out
+// now. Callbacks go out in evenly spaced slots while the host fires them
+// faster, and the slots start over once it falls behind.
+static int64_t sl_host_surface_frame_delay_ns(struct sl_host_surface* host,
+                                              int64_t now) {
+  uint32_t max_fps =
+      host->window ? host->ctx->quirks.MaxFps(host->window->steam_game_id)
+                   : 0;
+  if (!max_fps)
+    return 0;
+
+  int64_t interval = 1000000000 / max_fps;
+  int64_t slot = host->next_frame_ns;
+  if (now - slot >= interval)
+    slot = now;
+  host->next_frame_ns = slot + interval;
+  return slot > now ? slot - now : 0;
+}
+#endif
+
 static void sl_frame_callback_done(void* data,
                                    struct wl_callback* callback,
                                    uint32_t time) {
-  TRACE_EVENT("surface", "sl_frame_callback_done");
   struct sl_host_callback* host =
       static_cast<sl_host_callback*>(wl_callback_get_user_data(callback));
+  TRACE_EVENT("surface", "sl_frame_callback_done",
+              TRACE_FLOW(host->resource));
+
+#ifdef QUIRKS_SUPPORT
+  struct sl_host_surface* surface = host->surface.get();
+  if (surface) {
+    // Callbacks already waiting for a slot take those after them along.
+    int64_t now = sl_monotonic_time_ns();
+    int64_t delay_ns = wl_list_empty(&surface->deferred_callbacks)
+                           ? sl_host_surface_frame_delay_ns(surface, now)
+                           : 1;
+    if (delay_ns) {
+      wl_callback_destroy(host->proxy);
+      host->proxy = nullptr;
+      host->ctx->pending_host_callbacks--;
+      TRACE_COUNTER("surface", "pending_host_callbacks",
+                    host->ctx->pending_host_callbacks);
+      host->host_time = time;
+      host->held_since_ns = now;
+      sl_host_surface_defer_callback(surface, host,
+                                     (delay_ns + 999999) / 1000000);
+      return;
+    }
+  }
+#endif
 
   wl_callback_send_done(host->resource, time);
   wl_resource_destroy(host->resource);
@@ -506,41 +1126,267 @@ static void sl_frame_callback_done(void* data,
 static const struct wl_callback_listener sl_frame_callback_listener = {
     sl_frame_callback_done};
 
-static void sl_host_callback_destroy(struct wl_resource* resource) {
-  TRACE_EVENT("surface", "sl_host_callback_destroy");
-  struct sl_host_callback* host =
-      static_cast<sl_host_callback*>(wl_resource_get_user_data(resource));
+// Requests |host_callback| from the host for the next commit of |host|.
+static void sl_host_surface_request_frame(
+    struct sl_host_surface* host, struct sl_host_callback* host_callback) {
+  sl_host_surface_apply_held_commit(host);
+
+  // The host may well keep drawing a minimized window at full rate, so its
+  // frame callbacks are fired here instead, at the hidden window's pace.
+  if (sl_host_surface_hidden(host)) {
+    sl_host_surface_defer_callback(host, host_callback,
+                                   host->ctx->hidden_frame_interval_ms);
+    return;
+  }
 
-  wl_callback_destroy(host->proxy);
-  wl_resource_set_user_data(resource, nullptr);
-  delete host;
+  host_callback->surface = host;
+  host_callback->proxy = wl_surface_frame(host->proxy);
+  wl_callback_add_listener(host_callback->proxy, &sl_frame_callback_listener,
+                           host_callback);
+  host->ctx->pending_host_callbacks++;
+  TRACE_COUNTER("surface", "pending_host_callbacks",
+                host->ctx->pending_host_callbacks);
 }
 
 static void sl_host_surface_frame(struct wl_client* client,
                                   struct wl_resource* resource,
                                   uint32_t callback) {
-  TRACE_EVENT("surface", "sl_host_surface_frame", "resource_id",
-              try_wl_resource_get_id(resource));
   struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
-  struct sl_host_callback* host_callback = new sl_host_callback();
+  struct sl_host_callback* host_callback = host->ctx->callback_pool.New();
 
+  host_callback->ctx = host->ctx;
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, callback);
+  TRACE_EVENT("surface", "sl_host_surface_frame", "resource_id",
+              try_wl_resource_get_id(resource),
+              TRACE_FLOW(host_callback->resource));
   wl_resource_set_implementation(host_callback->resource, nullptr,
                                  host_callback, sl_host_callback_destroy);
-  host_callback->proxy = wl_surface_frame(host->proxy);
-  wl_callback_add_listener(host_callback->proxy, &sl_frame_callback_listener,
-                           host_callback);
+
+  if (sl_host_surface_holds_requests(host)) {
+    // Not in any list until it's requested.
+    wl_list_init(&host_callback->link);
+    sl_host_surface_queue_request(
+        host, host_callback->resource, [host, host_callback] {
+          sl_host_surface_request_frame(host, host_callback);
+        });
+    return;
+  }
+  sl_host_surface_request_frame(host, host_callback);
+}
+
+// Returns the buffer pixel rect enclosing the surface-relative |rect| after
+// applying scale and offset.
+static pixman_box32_t surface_rect_to_buffer(const pixman_box32_t* rect,
+                                             double scale_x,
+                                             double scale_y,
+                                             double offset_x,
+                                             double offset_y) {
+  pixman_box32_t box;
+  box.x1 = rect->x1 * scale_x + offset_x;
+  box.y1 = rect->y1 * scale_y + offset_y;
+  box.x2 = rect->x2 * scale_x + offset_x + 0.5;
+  box.y2 = rect->y2 * scale_y + offset_y + 0.5;
+  return box;
+}
+
+// Area of |box| once clipped to the contents of |host|.
+static int64_t clipped_area(const sl_host_surface* host,
+                            const pixman_box32_t& box) {
+  int64_t width = MIN(static_cast<int32_t>(host->contents_width), box.x2) -
+                  MAX(0, box.x1);
+  int64_t height = MIN(static_cast<int32_t>(host->contents_height), box.y2) -
+                   MAX(0, box.y1);
+  return width > 0 && height > 0 ? width * height : 0;
+}
+
+// Builds the region of the current buffer that needs copying, in buffer
+// pixel coordinates and clipped to the contents, from both the surface and
+// buffer damage of the commits since this buffer was last used. The two are
+// unioned so that pixels damaged both ways are only copied once.
+//
+// |out_overlap| is set to the number of pixels that copying the two damage
+// sources separately would have copied twice.
+static void compute_copy_region(sl_host_surface* host,
+                                double scale_x,
+                                double scale_y,
+                                double offset_x,
+                                double offset_y,
+                                pixman_region32_t* out_region,
+                                int64_t* out_overlap) {
+  uint64_t seq = host->current_buffer->damage_seq;
+  int64_t separate_area = 0;
+  int n;
+
+  if (!seq || host->damage_seq - seq > SL_DAMAGE_HISTORY_SIZE) {
+    pixman_box32_t all = {0, 0, MAX_SIZE, MAX_SIZE};
+    pixman_region32_reset(out_region, &all);
+    separate_area = clipped_area(host, all);
+    seq = host->damage_seq;
+  } else {
+    pixman_region32_clear(out_region);
+  }
+
+  while (seq++ < host->damage_seq) {
+    struct sl_damage* damage =
+        &host->damage_history[seq % SL_DAMAGE_HISTORY_SIZE];
+
+    pixman_region32_union(out_region, out_region, &damage->buffer);
+    pixman_box32_t* rect = pixman_region32_rectangles(&damage->buffer, &n);
+    while (n--)
+      separate_area += clipped_area(host, *rect++);
+
+    rect = pixman_region32_rectangles(&damage->surface, &n);
+    while (n--) {
+      pixman_box32_t box =
+          surface_rect_to_buffer(rect++, scale_x, scale_y, offset_x, offset_y);
+      separate_area += clipped_area(host, box);
+      pixman_region32_union_rect(out_region, out_region, box.x1, box.y1,
+                                 box.x2 - box.x1, box.y2 - box.y1);
+    }
+  }
+
+  pixman_region32_intersect_rect(out_region, out_region, 0, 0,
+                                 host->contents_width, host->contents_height);
+
+  int64_t union_area = 0;
+  pixman_box32_t* rect = pixman_region32_rectangles(out_region, &n);
+  while (n--) {
+    int64_t width = rect->x2 - rect->x1;
+    int64_t height = rect->y2 - rect->y1;
+    union_area += width * height;
+    ++rect;
+  }
+  *out_overlap = separate_area - union_area;
+}
+
+// Drops the tiles of |region| whose contents already match what was last
+// copied into the current output buffer, for --tile-damage-filter. Clients
+// that damage everything every frame then only pay for tiles that changed.
+//
+// Only tiles entirely inside |region| are hashed. Tiles it only partly
+// covers are copied as usual and forgotten, since the buffer then holds a
+// mix of old and new contents.
+static void filter_unchanged_tiles(sl_host_surface* host,
+                                   pixman_region32_t* region) {
+  struct sl_output_buffer* buffer = host->current_buffer;
+  const struct sl_mmap* src = host->contents_shm_mmap;
+  const uint8_t* src_addr = static_cast<const uint8_t*>(src->addr);
+  struct sl_tile_filter_stats* stats = &host->ctx->tile_filter_stats;
+  uint64_t tiles_hashed = 0;
+  uint64_t tiles_skipped = 0;
+
+  buffer->tile_hashes.Resize(host->contents_width, host->contents_height);
+  if (!pixman_region32_not_empty(region))
+    return;
+
+  pixman_region32_t unchanged;
+  pixman_region32_init(&unchanged);
+  const pixman_box32_t* extents = pixman_region32_extents(region);
+  uint32_t tx1 = extents->x1 / kDamageTileSize;
+  uint32_t ty1 = extents->y1 / kDamageTileSize;
+  uint32_t tx2 = (extents->x2 - 1) / kDamageTileSize;
+  uint32_t ty2 = (extents->y2 - 1) / kDamageTileSize;
+
+  for (uint32_t ty = ty1; ty <= ty2; ++ty) {
+    for (uint32_t tx = tx1; tx <= tx2; ++tx) {
+      pixman_box32_t tile;
+      tile.x1 = tx * kDamageTileSize;
+      tile.y1 = ty * kDamageTileSize;
+      tile.x2 = MIN(tile.x1 + kDamageTileSize, host->contents_width);
+      tile.y2 = MIN(tile.y1 + kDamageTileSize, host->contents_height);
+
+      switch (pixman_region32_contains_rectangle(region, &tile)) {
+        case PIXMAN_REGION_OUT:
+          break;
+        case PIXMAN_REGION_PART:
+          buffer->tile_hashes.Invalidate(tx, ty);
+          break;
+        case PIXMAN_REGION_IN: {
+          uint64_t hash = 0;
+          size_t tile_bytes = 0;
+          size_t row_bytes = (tile.x2 - tile.x1) * src->bpp;
+
+          for (size_t i = 0; i < src->num_planes; ++i) {
+            size_t first_row = tile.y1 / src->y_ss[i];
+            size_t rows = (tile.y2 - tile.y1) / src->y_ss[i];
+            hash = sl_tile_hash(src_addr + src->offset[i] +
+                                    first_row * src->stride[i] +
+                                    tile.x1 * src->bpp,
+                                src->stride[i], row_bytes, rows, hash);
+            tile_bytes += row_bytes * rows;
+          }
+
+          ++tiles_hashed;
+          if (!buffer->tile_hashes.Update(tx, ty, hash)) {
+            ++tiles_skipped;
+            stats->bytes_skipped += tile_bytes;
+            pixman_region32_union_rect(&unchanged, &unchanged, tile.x1,
+                                       tile.y1, tile.x2 - tile.x1,
+                                       tile.y2 - tile.y1);
+          }
+          break;
+        }
+      }
+    }
+  }
+
+  TRACE_EVENT("surface", "filter_unchanged_tiles", "tiles_hashed",
+              tiles_hashed, "tiles_skipped", tiles_skipped);
+  stats->tiles_hashed += tiles_hashed;
+  stats->tiles_skipped += tiles_skipped;
+  pixman_region32_subtract(region, region, &unchanged);
+  pixman_region32_fini(&unchanged);
 }
 
+// Appends the copies needed to bring |rect|, in buffer pixel coordinates, up
+// to date in the current output buffer of a shaped surface to |jobs|. Pixels
+// inside the shape are converted to ARGB8888 straight from the client buffer
+// and the rest are cleared, so masking and conversion happen as part of the
+// copy.
+static void copy_shaped_rect(sl_host_surface* host,
+                             const pixman_box32_t* rect,
+                             std::vector<sl_copy_job>* jobs) {
+  const struct sl_mmap* src = host->contents_shm_mmap;
+  const struct sl_mmap* dst = host->current_buffer->mmap;
+  const uint8_t* src_base =
+      static_cast<const uint8_t*>(src->addr) + src->offset[0];
+  uint8_t* dst_base = static_cast<uint8_t*>(dst->addr) + dst->offset[0];
+  pixman_region32_t visible, hidden;
+
+  pixman_region32_init_rect(&visible, rect->x1, rect->y1, rect->x2 - rect->x1,
+                            rect->y2 - rect->y1);
+  pixman_region32_init(&hidden);
+  pixman_region32_subtract(&hidden, &visible, &host->contents_shape);
+  pixman_region32_intersect(&visible, &visible, &host->contents_shape);
+
+  auto append_jobs = [&](pixman_region32_t* region, enum sl_copy_op op) {
+    int n;
+    pixman_box32_t* box = pixman_region32_rectangles(region, &n);
+    for (; n--; ++box) {
+      jobs->push_back(
+          {src_base + box->y1 * src->stride[0] + box->x1 * src->bpp,
+           dst_base + box->y1 * dst->stride[0] + box->x1 * dst->bpp,
+           src->stride[0], dst->stride[0],
+           static_cast<size_t>(box->x2 - box->x1) * dst->bpp,
+           static_cast<size_t>(box->y2 - box->y1), op});
+    }
+  };
+  append_jobs(&visible,
+              sl_xshape_copy_op_for_shm_format(host->contents_shm_format));
+  append_jobs(&hidden, SL_COPY_OP_CLEAR);
+
+  pixman_region32_fini(&hidden);
+  pixman_region32_fini(&visible);
+}
+
+// Appends the copies needed to bring |rect|, in buffer pixel coordinates, up
+// to date in the current output buffer to |jobs|, one per plane.
 static void copy_damaged_rect(sl_host_surface* host,
-                              pixman_box32_t* rect,
+                              const pixman_box32_t* rect,
                               bool shaped,
-                              double scale_x,
-                              double scale_y,
-                              double offset_x,
-                              double offset_y) {
+                              std::vector<sl_copy_job>* jobs) {
   uint8_t* src_addr = static_cast<uint8_t*>(host->contents_shm_mmap->addr);
   uint8_t* dst_addr = static_cast<uint8_t*>(host->current_buffer->mmap->addr);
   size_t* src_offset = host->contents_shm_mmap->offset;
@@ -550,69 +1396,353 @@ static void copy_damaged_rect(sl_host_surface* host,
   size_t* y_ss = host->contents_shm_mmap->y_ss;
   size_t bpp = host->contents_shm_mmap->bpp;
   size_t num_planes = host->contents_shm_mmap->num_planes;
-  int32_t x1, y1, x2, y2;
-  size_t null_set[3] = {0, 0, 0};
-  size_t shape_stride[3] = {0, 0, 0};
+  pixman_box32_t clipped;
+
+  clipped.x1 = MAX(0, rect->x1);
+  clipped.y1 = MAX(0, rect->y1);
+  clipped.x2 = MIN(static_cast<int32_t>(host->contents_width), rect->x2);
+  clipped.y2 = MIN(static_cast<int32_t>(host->contents_height), rect->y2);
+
+  if (clipped.x1 >= clipped.x2 || clipped.y1 >= clipped.y2)
+    return;
 
   if (shaped) {
-    // If we are copying from a shaped window, the actual image data
-    // we want comes from the shape_image. We are making the modifications
-    // here so the source data comes from this buffer.
-    src_addr = reinterpret_cast<uint8_t*>(
-        pixman_image_get_data(host->current_buffer->shape_image));
-    src_offset = null_set;
-    src_stride = shape_stride;
-
-    shape_stride[0] =
-        pixman_image_get_stride(host->current_buffer->shape_image);
-  }
-
-  // Enclosing rect after applying scale and offset.
-  x1 = rect->x1 * scale_x + offset_x;
-  y1 = rect->y1 * scale_y + offset_y;
-  x2 = rect->x2 * scale_x + offset_x + 0.5;
-  y2 = rect->y2 * scale_y + offset_y + 0.5;
-
-  x1 = MAX(0, x1);
-  y1 = MAX(0, y1);
-  x2 = MIN(static_cast<int32_t>(host->contents_width), x2);
-  y2 = MIN(static_cast<int32_t>(host->contents_height), y2);
-
-  if (x1 < x2 && y1 < y2) {
-    size_t i;
-
-    for (i = 0; i < num_planes; ++i) {
-      uint8_t* src_base = src_addr + src_offset[i];
-      uint8_t* dst_base = dst_addr + dst_offset[i];
-      uint8_t* src = src_base + y1 * src_stride[i] + x1 * bpp;
-      uint8_t* dst = dst_base + y1 * dst_stride[i] + x1 * bpp;
-      int32_t width = x2 - x1;
-      int32_t height = (y2 - y1) / y_ss[i];
-      size_t bytes = width * bpp;
-
-      while (height--) {
-        memcpy(dst, src, bytes);
-        dst += dst_stride[i];
-        src += src_stride[i];
+    copy_shaped_rect(host, &clipped, jobs);
+    return;
+  }
+
+  for (size_t i = 0; i < num_planes; ++i) {
+    uint8_t* src_base = src_addr + src_offset[i];
+    uint8_t* dst_base = dst_addr + dst_offset[i];
+    uint8_t* src = src_base + clipped.y1 * src_stride[i] + clipped.x1 * bpp;
+    uint8_t* dst = dst_base + clipped.y1 * dst_stride[i] + clipped.x1 * bpp;
+    int32_t width = clipped.x2 - clipped.x1;
+    int32_t height = (clipped.y2 - clipped.y1) / y_ss[i];
+
+    jobs->push_back({src, dst, src_stride[i], dst_stride[i],
+                     static_cast<size_t>(width) * bpp,
+                     static_cast<size_t>(height)});
+  }
+}
+
+// Releases the client buffer a commit copied from, once the copy is done.
+static void sl_contents_shm_mmap_done(struct sl_mmap* shm_mmap) {
+  if (shm_mmap->buffer_resource) {
+    sl_drm_syncobj_buffer_release(static_cast<sl_host_buffer*>(
+        wl_resource_get_user_data(shm_mmap->buffer_resource)));
+    wl_buffer_send_release(shm_mmap->buffer_resource);
+  }
+  sl_mmap_end_access(shm_mmap);
+  sl_mmap_unref(shm_mmap);
+}
+
+// Attaches the cursor image the client committed to the host, unless it's
+// the one the host already shows. That one is kept instead, without copying
+// the client's buffer into an output buffer again.
+static void sl_host_surface_commit_cursor(struct sl_host_surface* host) {
+  struct sl_mmap* src = host->contents_shm_mmap;
+  bool attach_moves = host->cursor_attach_x || host->cursor_attach_y;
+
+  host->cursor_attach_pending = false;
+  if (src->num_planes != 1) {
+    host->cursor_buffer = nullptr;
+    wl_surface_attach(host->proxy, host->current_buffer->internal,
+                      host->cursor_attach_x, host->cursor_attach_y);
+    return;
+  }
+
+  uint64_t hash = sl_tile_hash(
+      static_cast<const uint8_t*>(src->addr) + src->offset[0], src->stride[0],
+      host->contents_width * src->bpp, host->contents_height,
+      (static_cast<uint64_t>(host->contents_width) << 32 |
+       host->contents_height) ^
+          host->contents_shm_format);
+
+  struct sl_output_buffer* cached = host->cursor_buffer;
+  if (cached && hash == host->cursor_hash && !attach_moves &&
+      cached->width == host->current_buffer->width &&
+      cached->height == host->current_buffer->height) {
+    host->ctx->metrics.cursor_copies_skipped++;
+    cached->damage_seq = host->damage_seq;
+    host->current_buffer = cached;
+    pixman_region32_clear(&host->pending_damage);
+    sl_contents_shm_mmap_done(src);
+    host->contents_shm_mmap = nullptr;
+    return;
+  }
+
+  host->cursor_buffer = host->current_buffer;
+  host->cursor_hash = hash;
+  wl_surface_attach(host->proxy, host->current_buffer->internal,
+                    host->cursor_attach_x, host->cursor_attach_y);
+}
+
+void sl_host_surface_commit_proxy(struct sl_host_surface* host) {
+  if (host->commit_blockers) {
+    host->commit_deferred = true;
+    return;
+  }
+  sl_host_surface_flush_damage(host);
+  wl_surface_commit(host->proxy);
+}
+
+void sl_host_surface_block_commit(struct sl_host_surface* host) {
+  host->commit_blockers++;
+}
+
+void sl_host_surface_unblock_commit(struct sl_host_surface* host) {
+  assert(host->commit_blockers > 0);
+  if (--host->commit_blockers || !host->commit_deferred)
+    return;
+
+  TRACE_EVENT("surface", "sl_host_surface_unblock_commit", "resource_id",
+              try_wl_resource_get_id(host->resource));
+  host->commit_deferred = false;
+  sl_host_surface_commit_proxy(host);
+  struct sl_host_surface* parent = host->deferred_parent;
+  if (parent) {
+    host->deferred_parent = nullptr;
+    wl_list_remove(&host->deferred_link);
+    wl_list_init(&host->deferred_link);
+    sl_host_surface_unblock_commit(parent);
+  }
+}
+
+void sl_host_surface_finish_deferred_commit(struct sl_host_surface* host) {
+  if (!host->commit_deferred)
+    return;
+
+  TRACE_EVENT("surface", "sl_host_surface_finish_deferred_commit",
+              "resource_id", try_wl_resource_get_id(host->resource));
+  while (!wl_list_empty(&host->deferred_children)) {
+    struct sl_host_surface* child;
+    child = wl_container_of(host->deferred_children.next, child,
+                            deferred_link);
+    sl_host_surface_finish_deferred_commit(child);
+  }
+  sl_context_finish_fence_waits(host->ctx, host);
+  // Copies are waited for all together.
+  if (host->commit_deferred)
+    sl_context_drain_commit_pipeline(host->ctx);
+  assert(!host->commit_deferred);
+}
+
+// Applies the held commits of |host|'s synchronized subsurfaces, ahead of
+// its own. Its commit then waits for theirs.
+static void sl_host_surface_apply_held_commits(struct sl_host_surface* host) {
+  while (!wl_list_empty(&host->sync_children)) {
+    struct sl_host_surface* child;
+    child = wl_container_of(host->sync_children.next, child, sync_link);
+    sl_host_surface_apply_held_commit(child);
+    if (child->commit_deferred && !child->deferred_parent) {
+      child->deferred_parent = host;
+      wl_list_insert(host->deferred_children.prev, &child->deferred_link);
+      sl_host_surface_block_commit(host);
+    }
+  }
+}
+
+// Copies the damaged part of the contents of |host| into its current output
+// buffer, which is then busy until the host releases it.
+static void sl_host_surface_copy_contents(struct sl_host_surface* host,
+                                          const struct sl_viewport* viewport,
+                                          uint32_t resource_id) {
+  double contents_scale_x, contents_scale_y;
+  wl_fixed_t contents_offset_x, contents_offset_y;
+  compute_buffer_scale_and_offset(host, viewport, &contents_scale_x,
+                                  &contents_scale_y, &contents_offset_x,
+                                  &contents_offset_y);
+
+  // Shaped contents are only masked within damage, so a shape change
+  // needs everything copied again.
+  if (host->contents_shaped &&
+      !pixman_region32_equal(&host->current_buffer->shape,
+                             &host->contents_shape)) {
+    pixman_region32_copy(&host->current_buffer->shape, &host->contents_shape);
+    sl_output_buffer_damage_all(host->current_buffer);
+  }
+
+  bool first_copy = !host->current_buffer->damage_seq;
+  pixman_region32_t damage;
+  int64_t overlap;
+  pixman_region32_init(&damage);
+  compute_copy_region(host, contents_scale_x, contents_scale_y,
+                      wl_fixed_to_double(contents_offset_x),
+                      wl_fixed_to_double(contents_offset_y), &damage,
+                      &overlap);
+  if (host->contents_shaped) {
+    // Shaped contents are masked on the way in, so the hashes of the
+    // client buffer wouldn't describe the output buffer.
+    host->current_buffer->tile_hashes.Reset();
+  } else if (host->ctx->tile_damage_filter) {
+    filter_unchanged_tiles(host, &damage);
+  }
+
+  std::vector<sl_copy_job>& jobs = host->copy_jobs;
+  int n;
+  jobs.clear();
+  pixman_box32_t* rect = pixman_region32_rectangles(&damage, &n);
+  while (n--)
+    copy_damaged_rect(host, rect++, host->contents_shaped, &jobs);
+  pixman_region32_fini(&damage);
+
+  size_t bytes_copied = 0;
+  for (const auto& job : jobs)
+    bytes_copied += job.row_bytes * job.rows;
+  TRACE_COUNTER("surface", "bytes_copied", bytes_copied);
+  host->ctx->metrics.bytes_copied += bytes_copied;
+  if (host->ctx->tile_damage_filter)
+    host->ctx->tile_filter_stats.bytes_copied += bytes_copied;
+
+  // Only a buffer the CPU actually writes needs its writes synced for the
+  // host.
+  bool cpu_write = !jobs.empty();
+  int64_t write_start_ns = sl_monotonic_time_ns();
+  if (cpu_write && host->current_buffer->mmap->begin_write)
+    host->current_buffer->mmap->begin_write(host->current_buffer->mmap->fd,
+                                            host->ctx);
+
+  {
+    const struct sl_mmap* src = host->contents_shm_mmap;
+    size_t bytes_saved = 0;
+    for (size_t i = 0; i < src->num_planes; ++i)
+      bytes_saved += overlap * src->bpp / src->y_ss[i];
+    TRACE_EVENT("surface", "sl_host_surface_commit: memcpy_loop",
+                "bytes_saved", bytes_saved,
+                TRACE_FLOW(host->current_buffer->internal));
+#ifndef PERFETTO_TRACING
+    UNUSED(bytes_saved);
+#endif
+    // All copies must land before end_write hands the buffer to the host.
+    if (host->ctx->commit_pipeline) {
+      // The rest of the commit goes out as usual, but the commit of the
+      // proxy is deferred until the copy completes. The pipeline owns the
+      // client buffer until then, so it isn't released below. Surfaces
+      // drain the pipeline before they go, so |host| outlives the copy.
+      struct sl_context* ctx = host->ctx;
+      struct sl_mmap* dst = sl_mmap_ref(host->current_buffer->mmap);
+      struct sl_mmap* src = host->contents_shm_mmap;
+      int64_t copy_start_ns = sl_monotonic_time_ns();
+      host->contents_shm_mmap = nullptr;
+      sl_host_surface_block_commit(host);
+      ctx->commit_pipeline->Submit(
+          std::move(jobs),
+          [ctx, host, dst, src, cpu_write, resource_id,
+           copy_start_ns](uint64_t page_faults) {
+            if (ctx->frame_stats != nullptr) {
+              ctx->frame_stats->AddCopy(resource_id,
+                                        sl_monotonic_time_ns() - copy_start_ns,
+                                        page_faults);
+            }
+            if (cpu_write && dst->end_write)
+              dst->end_write(dst->fd, ctx);
+            sl_mmap_unref(dst);
+            sl_contents_shm_mmap_done(src);
+            sl_host_surface_unblock_commit(host);
+          },
+          ctx->frame_stats != nullptr);
+    } else {
+      int64_t copy_start_ns = sl_monotonic_time_ns();
+      uint64_t page_faults = 0;
+      uint64_t* count_faults = host->ctx->frame_stats ? &page_faults : nullptr;
+      if (host->ctx->copy_pool) {
+        host->ctx->copy_pool->Run(jobs, count_faults);
+      } else {
+        uint64_t faults_start =
+            count_faults ? sl_copy_thread_page_faults() : 0;
+        for (const auto& job : jobs)
+          sl_copy_rows(job);
+        if (count_faults)
+          page_faults = sl_copy_thread_page_faults() - faults_start;
+      }
+      if (host->ctx->frame_stats != nullptr) {
+        host->ctx->frame_stats->AddCopy(
+            resource_id, sl_monotonic_time_ns() - copy_start_ns, page_faults);
+      }
+      if (cpu_write && host->current_buffer->mmap->end_write)
+        host->current_buffer->mmap->end_write(host->current_buffer->mmap->fd,
+                                              host->ctx);
+      if (host->ctx->adaptive_output_buffers && bytes_copied && !first_copy) {
+        sl_host_surface_record_copy_cost(
+            host, host->current_buffer, bytes_copied,
+            sl_monotonic_time_ns() - write_start_ns);
       }
     }
   }
+
+  host->current_buffer->damage_seq = host->damage_seq;
+
+  sl_output_buffer_untrack_released(host->current_buffer);
+  wl_list_remove(&host->current_buffer->link);
+  wl_list_insert(&host->busy_buffers, &host->current_buffer->link);
+  sl_trace_output_buffers(host);
 }
 
-void sl_host_surface_commit(struct wl_client* client,
-                            struct wl_resource* resource) {
+static void sl_host_surface_apply_commit(struct sl_host_surface* host) {
+  struct wl_resource* resource = host->resource;
   auto resource_id = try_wl_resource_get_id(resource);
-  TRACE_EVENT(
-      "surface", "sl_host_surface_commit", "resource_id", resource_id,
-      [&](perfetto::EventContext p) { perfetto_annotate_time_sync(p); });
-  struct sl_host_surface* host =
-      static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
+  TRACE_EVENT("surface", "sl_host_surface_commit", "resource_id",
+              resource_id);
+  sl_host_surface_finish_deferred_commit(host);
+  sl_host_surface_apply_held_commits(host);
+  host->state_pending = false;
+  trace_time_sync(host->ctx->trace_time_sync_interval_ms);
+  host->ctx->metrics.commits++;
+  if (host->ctx->frame_stats &&
+      !host->ctx->housekeeping[SL_HOUSEKEEPING_STATS].deadline_ns) {
+    sl_schedule_stats(host->ctx);
+  }
   if (host->ctx->timing != nullptr) {
     host->ctx->timing->UpdateLastCommit(resource_id);
   }
+  if (host->ctx->pointer_motions_per_frame ||
+      host->ctx->output_buffer_idle_ns) {
+    int64_t now = sl_monotonic_time_ns();
+    if (host->ctx->pointer_motions_per_frame && host->last_commit_ns) {
+      // Smoothed, so one late frame doesn't hold pointer motion back.
+      int64_t interval = now - host->last_commit_ns;
+      host->commit_interval_ns =
+          host->commit_interval_ns
+              ? (3 * host->commit_interval_ns + interval) / 4
+              : interval;
+    }
+    host->last_commit_ns = now;
+  }
   struct sl_window* window = host->window;
   struct sl_viewport* viewport = nullptr;
 
+  if (!sl_drm_syncobj_surface_commit(host))
+    return;
+
+  struct sl_damage* damage =
+      &host->damage_history[++host->damage_seq % SL_DAMAGE_HISTORY_SIZE];
+  std::swap(damage->surface, host->client_damage.surface);
+  std::swap(damage->buffer, host->client_damage.buffer);
+  pixman_region32_clear(&host->client_damage.surface);
+  pixman_region32_clear(&host->client_damage.buffer);
+
+  if (window && window->compositor_fullscreen) {
+    host->ctx->metrics.fullscreen_commits++;
+    // Buffers copied into one of sommelier's are composited by the host.
+    if (host->attached_scanout_compatible && !host->contents_shm_mmap)
+      host->ctx->metrics.fullscreen_scanout_compatible_commits++;
+  }
+
+  // A hidden window isn't copied, only its latest buffer kept for when it's
+  // shown again. The output buffer isn't brought up to date, so that the
+  // copy into it then covers the damage of everything that was skipped.
+  struct sl_mmap* hidden_contents = nullptr;
+  if (host->contents_shm_mmap && !host->contents_shaped &&
+      !host->syncobj_surface && sl_host_surface_hidden(host)) {
+    hidden_contents = host->contents_shm_mmap;
+    host->contents_shm_mmap = nullptr;
+    sl_output_buffer_untrack_released(host->current_buffer);
+    wl_list_remove(&host->current_buffer->link);
+    wl_list_insert(&host->busy_buffers, &host->current_buffer->link);
+    host->ctx->metrics.hidden_copies_skipped++;
+  }
+  host->attach_pending = false;
+
   if (!wl_list_empty(&host->contents_viewport))
     viewport = wl_container_of(host->contents_viewport.next, viewport, link);
 
@@ -648,66 +1778,14 @@ void sl_host_surface_commit(struct wl_client* client,
         // clues within error logs that may result from hitting this point.
         assert(mmap_ensured);
       }
-    } else {
-      // In this case, perform the image manipulation if we are dealing
-      // with a shaped surface.
-      if (host->contents_shaped)
-        sl_xshape_generate_argb_image(
-            host->ctx, &host->contents_shape, host->contents_shm_mmap,
-            host->current_buffer->shape_image, host->contents_shm_format);
     }
   }
 
-  if (host->contents_shm_mmap) {
-    double contents_scale_x, contents_scale_y;
-    wl_fixed_t contents_offset_x, contents_offset_y;
-    compute_buffer_scale_and_offset(host, viewport, &contents_scale_x,
-                                    &contents_scale_y, &contents_offset_x,
-                                    &contents_offset_y);
-
-    if (host->current_buffer->mmap->begin_write)
-      host->current_buffer->mmap->begin_write(host->current_buffer->mmap->fd,
-                                              host->ctx);
-
-    // Copy damaged regions (surface-relative coordinates).
-    int n;
-    pixman_box32_t* rect =
-        pixman_region32_rectangles(&host->current_buffer->surface_damage, &n);
-    while (n--) {
-      TRACE_EVENT("surface",
-                  "sl_host_surface_commit: memcpy_loop (surface damage)");
-      copy_damaged_rect(host, rect, host->contents_shaped, contents_scale_x,
-                        contents_scale_y, wl_fixed_to_double(contents_offset_x),
-                        wl_fixed_to_double(contents_offset_y));
-      ++rect;
-    }
+  if (host->contents_shm_mmap && host->cursor_attach_pending)
+    sl_host_surface_commit_cursor(host);
 
-    // Copy damaged regions (buffer-relative coordinates).
-    //
-    // In theory, if we've accumulated both surface damage and buffer damage,
-    // it might be more efficient to first transform and union the regions, so
-    // that we won't ever copy the same pixel twice.
-    // In practice, wl_surface::damage_buffer obsoletes wl_surface::damage, and
-    // it doesn't seem worthwhile to optimize for the edge case in which an app
-    // uses both in the same frame.
-    rect = pixman_region32_rectangles(&host->current_buffer->buffer_damage, &n);
-    while (n--) {
-      TRACE_EVENT("surface",
-                  "sl_host_surface_commit: memcpy_loop (buffer damage)");
-      copy_damaged_rect(host, rect, host->contents_shaped, 1.0, 1.0, 0.0, 0.0);
-      ++rect;
-    }
-
-    if (host->current_buffer->mmap->end_write)
-      host->current_buffer->mmap->end_write(host->current_buffer->mmap->fd,
-                                            host->ctx);
-
-    pixman_region32_clear(&host->current_buffer->surface_damage);
-    pixman_region32_clear(&host->current_buffer->buffer_damage);
-
-    wl_list_remove(&host->current_buffer->link);
-    wl_list_insert(&host->busy_buffers, &host->current_buffer->link);
-  }
+  if (host->contents_shm_mmap)
+    sl_host_surface_copy_contents(host, viewport, resource_id);
 
   if (host->contents_width && host->contents_height) {
     double scale = host->ctx->scale * host->contents_scale;
@@ -716,11 +1794,19 @@ void sl_host_surface_commit(struct wl_client* client,
       int width = host->contents_width;
       int height = host->contents_height;
 
+      // A bucketed output buffer is larger than the contents, so crop it
+      // back unless the client's own source rectangle already does.
+      bool crop_output_buffer =
+          host->current_buffer &&
+          (host->current_buffer->width != host->contents_width ||
+           host->current_buffer->height != host->contents_height);
+
       // We need to take the client's viewport into account while still
       // making sure our scale is accounted for.
       if (viewport) {
         if (viewport->src_x >= 0 && viewport->src_y >= 0 &&
             viewport->src_width >= 0 && viewport->src_height >= 0) {
+          crop_output_buffer = false;
           wp_viewport_set_source(host->viewport, viewport->src_x,
                                  viewport->src_y, viewport->src_width,
                                  viewport->src_height);
@@ -747,6 +1833,12 @@ void sl_host_surface_commit(struct wl_client* client,
                                negative_one, negative_one);
       }
 
+      if (crop_output_buffer) {
+        wp_viewport_set_source(host->viewport, 0, 0,
+                               wl_fixed_from_int(host->contents_width),
+                               wl_fixed_from_int(host->contents_height));
+      }
+
       int32_t vp_width = width;
       int32_t vp_height = height;
       // Consult with the transform function to see if the
@@ -771,8 +1863,10 @@ void sl_host_surface_commit(struct wl_client* client,
   // or shell surface.
   if (host->has_role) {
     TRACE_EVENT("surface", "sl_host_surface_commit: wl_surface_commit",
-                "resource_id", resource_id, "has_role", host->has_role);
-    wl_surface_commit(host->proxy);
+                "resource_id", resource_id, "has_role", host->has_role,
+                TRACE_FLOW(host->current_buffer ? host->current_buffer->internal
+                                                : host->proxy_buffer));
+    sl_host_surface_commit_proxy(host);
 
     // GTK determines the scale based on the output the surface has entered.
     // If the surface has not entered any output, then have it enter the
@@ -789,19 +1883,17 @@ void sl_host_surface_commit(struct wl_client* client,
     }
   } else {
     TRACE_EVENT("surface", "sl_host_surface_commit: wl_surface_commit",
-                "resource_id", resource_id, "has_role", host->has_role);
+                "resource_id", resource_id, "has_role", host->has_role,
+                TRACE_FLOW(host->current_buffer ? host->current_buffer->internal
+                                                : host->proxy_buffer));
     // Commit if surface is associated with a window. Otherwise, defer
     // commit until window is created.
-    struct sl_window* window;
-    wl_list_for_each(window, &host->ctx->windows, link) {
-      if (window->host_surface_id == try_wl_resource_get_id(resource)) {
-        if (window->xdg_surface) {
-          wl_surface_commit(host->proxy);
-          if (host->contents_width && host->contents_height)
-            window->realized = 1;
-        }
-        break;
-      }
+    struct sl_window* window =
+        sl_context_lookup_window_for_surface(host->ctx, resource);
+    if (window && window->xdg_surface) {
+      sl_host_surface_commit_proxy(host);
+      if (host->contents_width && host->contents_height)
+        window->realized = 1;
     }
   }
 
@@ -809,30 +1901,34 @@ void sl_host_surface_commit(struct wl_client* client,
   if (host->ctx->frame_stats != nullptr) {
     // Try and find a matching window to identify steam game id and
     // activation status.
-    // TODO(davidriley): This ideally isn't doing a linear search each frame.
     uint32_t steam_game_id = 0;
     bool activated = false;
-    struct sl_window* window;
-    wl_list_for_each(window, &host->ctx->windows, link) {
-      if (window->host_surface_id == try_wl_resource_get_id(resource)) {
-        steam_game_id = window->steam_game_id;
-        activated = window->activated;
-        break;
-      }
+    struct sl_window* window =
+        sl_context_lookup_window_for_surface(host->ctx, resource);
+    if (window) {
+      steam_game_id = window->steam_game_id;
+      activated = window->activated;
     }
 
     host->ctx->frame_stats->AddFrame(resource_id, steam_game_id, activated);
   }
 
   if (host->contents_shm_mmap) {
-    if (host->contents_shm_mmap->buffer_resource) {
-      wl_buffer_send_release(host->contents_shm_mmap->buffer_resource);
-    }
-    sl_mmap_end_access(host->contents_shm_mmap);
-    sl_mmap_unref(host->contents_shm_mmap);
+    sl_contents_shm_mmap_done(host->contents_shm_mmap);
     host->contents_shm_mmap = nullptr;
   }
 
+  // Whatever was held back is superseded by this commit.
+  if (host->hidden_contents) {
+    if (hidden_contents && hidden_contents->buffer_resource ==
+                               host->hidden_contents->buffer_resource) {
+      sl_mmap_unref(host->hidden_contents);
+    } else {
+      sl_contents_shm_mmap_done(host->hidden_contents);
+    }
+  }
+  host->hidden_contents = hidden_contents;
+
   if (window && sl_window_is_containerized(window)) {
     // Force borderless windows to be fullscreen if
     // window->borderless_window_check - this value is set to true when
@@ -849,24 +1945,296 @@ void sl_host_surface_commit(struct wl_client* client,
   }
 }
 
+static void sl_held_request_handle_resource_destroy(
+    struct wl_listener* listener, void* data) {
+  struct sl_held_request* held =
+      wl_container_of(listener, held, resource_destroy_listener);
+
+  wl_list_remove(&held->resource_destroy_listener.link);
+  held->resource = nullptr;
+}
+
+sl_held_request::~sl_held_request() {
+  if (resource)
+    wl_list_remove(&resource_destroy_listener.link);
+}
+
+void sl_host_surface_queue_request(struct sl_host_surface* host,
+                                   struct wl_resource* resource,
+                                   std::function<void()> request) {
+  auto held = std::make_unique<sl_held_request>();
+  held->resource = resource;
+  held->resource_destroy_listener.notify =
+      sl_held_request_handle_resource_destroy;
+  wl_resource_add_destroy_listener(resource, &held->resource_destroy_listener);
+  held->request = std::make_unique<std::function<void()>>(std::move(request));
+  host->held_requests.push_back(std::move(held));
+}
+
+bool sl_host_surface_holds_requests(struct sl_host_surface* host) {
+  // A point signaled already needn't wait for the event loop to notice.
+  while (sl_drm_syncobj_surface_holds_commit(host)) {
+    if (!sl_drm_syncobj_surface_held_commit_ready(host))
+      return true;
+    sl_host_surface_apply_held_commit(host);
+  }
+  return false;
+}
+
+// Handles the requests held behind the commit just applied, up to the next
+// one held back in turn.
+static void sl_host_surface_replay_held_requests(
+    struct sl_host_surface* host) {
+  std::vector<std::unique_ptr<struct sl_held_request>> held_requests;
+  held_requests.swap(host->held_requests);
+  for (auto it = held_requests.begin(); it != held_requests.end(); ++it) {
+    if (sl_drm_syncobj_surface_holds_commit(host)) {
+      host->held_requests.insert(host->held_requests.begin(),
+                                 std::make_move_iterator(it),
+                                 std::make_move_iterator(held_requests.end()));
+      return;
+    }
+    // One for an object the client destroyed since has nothing to change.
+    if ((*it)->resource)
+      (*(*it)->request)();
+  }
+}
+
+void sl_host_surface_flush_held_requests(struct sl_host_surface* host) {
+  while (sl_drm_syncobj_surface_holds_commit(host))
+    sl_host_surface_apply_held_commit(host);
+}
+
+void sl_host_surface_apply_held_commit(struct sl_host_surface* host) {
+  // Pending state mustn't reach the host before the commit deferred ahead
+  // of it. Clients rarely get here, as they wait for the frame callback
+  // that commit brings.
+  sl_host_surface_finish_deferred_commit(host);
+  if (sl_drm_syncobj_surface_finish_held_commit(host)) {
+    sl_host_surface_apply_commit(host);
+    host->state_pending = true;
+    sl_host_surface_replay_held_requests(host);
+    return;
+  }
+  if (host->sync_commit_pending) {
+    host->sync_commit_pending = false;
+    wl_list_remove(&host->sync_link);
+    wl_list_init(&host->sync_link);
+    sl_host_surface_apply_commit(host);
+  }
+  host->state_pending = true;
+}
+
+void sl_host_surface_commit(struct wl_client* client,
+                            struct wl_resource* resource) {
+  struct sl_host_surface* host =
+      static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
+
+  if (sl_host_surface_hold_request<sl_host_surface_commit>(host, client,
+                                                           resource)) {
+    return;
+  }
+
+  // Explicitly synchronized commits wait on their own acquire points.
+  if (host->sync_parent && !host->syncobj_surface) {
+    if (host->sync_commit_pending) {
+      host->ctx->metrics.sync_commits_merged++;
+    } else {
+      host->sync_commit_pending = true;
+      wl_list_insert(host->sync_parent->sync_children.prev, &host->sync_link);
+    }
+    return;
+  }
+
+  if (sl_drm_syncobj_surface_hold_commit(host))
+    return;
+
+  sl_host_surface_apply_commit(host);
+}
+
+// Makes the copy skipped for |contents|, the buffer of the last commit while
+// the window of |host| was hidden, and commits it to the host again. Only
+// what that commit applied is used, as the client's pending state may
+// already have been forwarded to the proxy.
+static void sl_host_surface_replay_hidden(struct sl_host_surface* host,
+                                          struct sl_mmap* contents) {
+  const struct sl_output_buffer* committed = host->current_buffer;
+  struct sl_output_buffer* buffer;
+  bool found = false;
+
+  // The buffer committed while hidden may well still be busy, so another
+  // one of the same layout is brought up to date instead.
+  wl_list_for_each(buffer, &host->released_buffers, link) {
+    found = sl_output_buffer_matches(buffer, committed->width,
+                                     committed->height, committed->format,
+                                     false, committed->dmabuf);
+    if (found)
+      break;
+  }
+  if (!found) {
+    buffer = sl_output_buffer_pool_take(host, committed->width,
+                                        committed->height, committed->format,
+                                        false, committed->dmabuf);
+  }
+  if (!buffer) {
+    // Not worth allocating for, the next commit is copied into a new one.
+    sl_contents_shm_mmap_done(contents);
+    return;
+  }
+
+  TRACE_EVENT("surface", "sl_host_surface_replay_hidden", "resource_id",
+              try_wl_resource_get_id(host->resource));
+  if (buffer->contents_width != committed->contents_width ||
+      buffer->contents_height != committed->contents_height) {
+    sl_output_buffer_damage_all(buffer);
+  }
+  buffer->contents_width = committed->contents_width;
+  buffer->contents_height = committed->contents_height;
+  host->current_buffer = buffer;
+
+  struct sl_viewport* viewport = nullptr;
+  if (!wl_list_empty(&host->contents_viewport))
+    viewport = wl_container_of(host->contents_viewport.next, viewport, link);
+  host->contents_shm_mmap = contents;
+  sl_host_surface_copy_contents(host, viewport,
+                                try_wl_resource_get_id(host->resource));
+  if (host->contents_shm_mmap) {
+    sl_contents_shm_mmap_done(host->contents_shm_mmap);
+    host->contents_shm_mmap = nullptr;
+  }
+
+  wl_surface_attach(host->proxy, buffer->internal, 0, 0);
+  wl_surface_damage(host->proxy, 0, 0, MAX_SIZE, MAX_SIZE);
+  sl_host_surface_commit_proxy(host);
+}
+
+void sl_host_surface_release_hidden(struct sl_host_surface* host) {
+  if (sl_host_surface_hidden(host))
+    return;
+
+  struct sl_mmap* contents = host->hidden_contents;
+  if (contents) {
+    host->hidden_contents = nullptr;
+    // The host still shows what was copied before the window was hidden.
+    // Anything the client has pending goes out with its next commit, which
+    // brings the window up to date anyway.
+    if (contents->buffer_resource && !host->state_pending &&
+        !host->commit_deferred && !host->syncobj_surface) {
+      sl_host_surface_replay_hidden(host, contents);
+    } else {
+      sl_contents_shm_mmap_done(contents);
+    }
+  }
+
+  sl_host_surface_fire_deferred_callbacks(host);
+  if (host->deferred_frame_timer)
+    wl_event_source_timer_update(host->deferred_frame_timer.get(), 0);
+}
+
 static void sl_host_surface_set_buffer_scale(struct wl_client* client,
                                              struct wl_resource* resource,
                                              int32_t scale) {
   struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
 
+  if (sl_host_surface_hold_request<sl_host_surface_set_buffer_scale>(
+          host, client, resource, scale)) {
+    return;
+  }
+  sl_host_surface_apply_held_commit(host);
   host->contents_scale = scale;
 }
 
+// Holds setting |region|, or none if null, as a region of |host| with
+// |set_region| back, as sl_host_surface_hold_request() does. The client may
+// change or destroy the region meanwhile, so it's copied.
+static void sl_host_surface_hold_region(
+    struct sl_host_surface* host,
+    struct wl_resource* region,
+    void (*set_region)(struct wl_surface*, struct wl_region*)) {
+  std::shared_ptr<pixman_region32_t> copy;
+  if (region) {
+    struct sl_host_region* host_region =
+        static_cast<sl_host_region*>(wl_resource_get_user_data(region));
+    copy.reset(new pixman_region32_t, [](pixman_region32_t* copy) {
+      pixman_region32_fini(copy);
+      delete copy;
+    });
+    pixman_region32_init(copy.get());
+    pixman_region32_copy(copy.get(), &host_region->region);
+  }
+
+  sl_host_surface_queue_request(host, host->resource, [host, copy,
+                                                       set_region] {
+    struct wl_region* proxy = nullptr;
+    sl_host_surface_apply_held_commit(host);
+    if (copy) {
+      int n;
+      pixman_box32_t* rect = pixman_region32_rectangles(copy.get(), &n);
+      proxy = wl_compositor_create_region(host->ctx->compositor->internal);
+      for (; n--; ++rect)
+        wl_region_add(proxy, rect->x1, rect->y1, rect->x2 - rect->x1,
+                      rect->y2 - rect->y1);
+    }
+    set_region(host->proxy, proxy);
+    if (proxy)
+      wl_region_destroy(proxy);
+  });
+}
+
+static void sl_host_surface_set_opaque_region(struct wl_client* client,
+                                              struct wl_resource* resource,
+                                              struct wl_resource* region) {
+  struct sl_host_surface* host =
+      static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
+
+  if (sl_host_surface_holds_requests(host)) {
+    sl_host_surface_hold_region(host, region, wl_surface_set_opaque_region);
+    return;
+  }
+  sl_host_surface_apply_held_commit(host);
+  ForwardRequest<wl_surface_set_opaque_region, AllowNullResource::kYes>(
+      client, resource, region);
+}
+
+static void sl_host_surface_set_input_region(struct wl_client* client,
+                                             struct wl_resource* resource,
+                                             struct wl_resource* region) {
+  struct sl_host_surface* host =
+      static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
+
+  if (sl_host_surface_holds_requests(host)) {
+    sl_host_surface_hold_region(host, region, wl_surface_set_input_region);
+    return;
+  }
+  sl_host_surface_apply_held_commit(host);
+  ForwardRequest<wl_surface_set_input_region, AllowNullResource::kYes>(
+      client, resource, region);
+}
+
+static void sl_host_surface_set_buffer_transform(struct wl_client* client,
+                                                 struct wl_resource* resource,
+                                                 int32_t transform) {
+  struct sl_host_surface* host =
+      static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
+
+  if (sl_host_surface_hold_request<sl_host_surface_set_buffer_transform>(
+          host, client, resource, transform)) {
+    return;
+  }
+  sl_host_surface_apply_held_commit(host);
+  ForwardRequest<wl_surface_set_buffer_transform>(client, resource, transform);
+}
+
 static const struct wl_surface_interface sl_surface_implementation = {
     sl_host_surface_destroy,
     sl_host_surface_attach,
     sl_host_surface_damage,
     sl_host_surface_frame,
-    ForwardRequest<wl_surface_set_opaque_region, AllowNullResource::kYes>,
-    ForwardRequest<wl_surface_set_input_region, AllowNullResource::kYes>,
+    sl_host_surface_set_opaque_region,
+    sl_host_surface_set_input_region,
     sl_host_surface_commit,
-    ForwardRequest<wl_surface_set_buffer_transform>,
+    sl_host_surface_set_buffer_transform,
     sl_host_surface_set_buffer_scale,
     sl_host_surface_damage_buffer};
 
@@ -875,31 +2243,66 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
               try_wl_resource_get_id(resource));
   struct sl_host_surface* host =
       static_cast<sl_host_surface*>(wl_resource_get_user_data(resource));
-  struct sl_window *window, *surface_window = nullptr;
+  struct sl_window* surface_window =
+      sl_context_lookup_window_for_surface(host->ctx, resource);
   struct sl_output_buffer* buffer;
 
-  wl_list_for_each(window, &host->ctx->windows, link) {
-    if (window->host_surface_id == try_wl_resource_get_id(resource)) {
-      surface_window = window;
-      break;
-    }
-  }
-
   if (surface_window) {
     surface_window->host_surface_id = 0;
     sl_window_update(surface_window);
   }
 
+  // Subsurfaces' held commits go out while their parent still exists. One
+  // held for this surface is dropped with the requests behind it, and so is
+  // a deferred one, which no longer holds the parent back.
+  sl_host_surface_apply_held_commits(host);
+  host->held_requests.clear();
+  if (host->sync_commit_pending)
+    wl_list_remove(&host->sync_link);
+  while (!wl_list_empty(&host->deferred_children)) {
+    struct sl_host_surface* child;
+    child = wl_container_of(host->deferred_children.next, child,
+                            deferred_link);
+    child->deferred_parent = nullptr;
+    wl_list_remove(&child->deferred_link);
+    wl_list_init(&child->deferred_link);
+  }
+  host->commit_deferred = false;
+  if (host->deferred_parent) {
+    struct sl_host_surface* parent = host->deferred_parent;
+    host->deferred_parent = nullptr;
+    wl_list_remove(&host->deferred_link);
+    sl_host_surface_unblock_commit(parent);
+  }
+
+  // Copies in flight may still be writing to this surface's buffers.
+  sl_context_drain_commit_pipeline(host->ctx);
+
   if (host->contents_shm_mmap)
     sl_mmap_unref(host->contents_shm_mmap);
+  if (host->hidden_contents)
+    sl_contents_shm_mmap_done(host->hidden_contents);
+  // Frame callbacks of a destroyed surface never fire.
+  while (!wl_list_empty(&host->deferred_callbacks)) {
+    struct wl_list* link = host->deferred_callbacks.next;
+    wl_list_remove(link);
+    wl_list_init(link);
+  }
 
   while (!wl_list_empty(&host->released_buffers)) {
     buffer = wl_container_of(host->released_buffers.next, buffer, link);
-    sl_output_buffer_destroy(buffer);
+    sl_output_buffer_recycle(buffer);
   }
   while (!wl_list_empty(&host->busy_buffers)) {
     buffer = wl_container_of(host->busy_buffers.next, buffer, link);
-    sl_output_buffer_destroy(buffer);
+    if (host->ctx->output_buffer_pool_limit) {
+      // Pooled once the host releases it.
+      wl_list_remove(&buffer->link);
+      wl_list_insert(&host->ctx->orphaned_output_buffers, &buffer->link);
+      buffer->surface = nullptr;
+    } else {
+      sl_output_buffer_destroy(buffer);
+    }
   }
   while (!wl_list_empty(&host->contents_viewport))
     wl_list_remove(host->contents_viewport.next);
@@ -914,6 +2317,10 @@ static void sl_destroy_host_surface(struct wl_resource* resource) {
   }
 
   pixman_region32_fini(&host->contents_shape);
+  pixman_region32_fini(&host->pending_damage);
+  sl_damage_fini(&host->client_damage);
+  for (auto& damage : host->damage_history)
+    sl_damage_fini(&damage);
   delete host;
 }
 
@@ -935,6 +2342,8 @@ static void sl_surface_enter(void* data,
   if (window) {
     sl_transform_try_window_scale(host->ctx, host, window->width,
                                   window->height);
+    // Size hints and offsets from the parent are scaled for the output.
+    window->dirty |= SL_WINDOW_DIRTY_SIZE_HINTS | SL_WINDOW_DIRTY_PARENT;
     sl_window_update(window);
   }
 }
@@ -985,6 +2394,8 @@ static void sl_region_add(struct wl_client* client,
   sl_transform_guest_to_host(host->ctx, nullptr, &x1, &y1);
   sl_transform_guest_to_host(host->ctx, nullptr, &x2, &y2);
 
+  pixman_region32_union_rect(&host->region, &host->region, x1, y1, x2 - x1,
+                             y2 - y1);
   wl_region_add(host->proxy, x1, y1, x2 - x1, y2 - y1);
 }
 
@@ -1004,6 +2415,10 @@ static void sl_region_subtract(struct wl_client* client,
   sl_transform_guest_to_host(host->ctx, nullptr, &x1, &y1);
   sl_transform_guest_to_host(host->ctx, nullptr, &x2, &y2);
 
+  pixman_region32_t rect;
+  pixman_region32_init_rect(&rect, x1, y1, x2 - x1, y2 - y1);
+  pixman_region32_subtract(&host->region, &host->region, &rect);
+  pixman_region32_fini(&rect);
   wl_region_subtract(host->proxy, x1, y1, x2 - x1, y2 - y1);
 }
 
@@ -1015,8 +2430,9 @@ static void sl_destroy_host_region(struct wl_resource* resource) {
       static_cast<sl_host_region*>(wl_resource_get_user_data(resource));
 
   wl_region_destroy(host->proxy);
+  pixman_region32_fini(&host->region);
   wl_resource_set_user_data(resource, nullptr);
-  delete host;
+  host->ctx->region_pool.Delete(host);
 }
 
 static void sl_compositor_create_host_surface(struct wl_client* client,
@@ -1050,8 +2466,17 @@ static void sl_compositor_create_host_surface(struct wl_client* client,
   host_surface->contents_shaped = false;
   host_surface->output = nullptr;
   pixman_region32_init(&host_surface->contents_shape);
+  pixman_region32_init(&host_surface->pending_damage);
+  sl_damage_init(&host_surface->client_damage);
+  for (auto& damage : host_surface->damage_history)
+    sl_damage_init(&damage);
   wl_list_init(&host_surface->released_buffers);
   wl_list_init(&host_surface->busy_buffers);
+  wl_list_init(&host_surface->deferred_callbacks);
+  wl_list_init(&host_surface->sync_link);
+  wl_list_init(&host_surface->sync_children);
+  wl_list_init(&host_surface->deferred_link);
+  wl_list_init(&host_surface->deferred_children);
   host_surface->resource = wl_resource_create(
       client, &wl_surface_interface, wl_resource_get_version(resource), id);
   wl_resource_set_implementation(host_surface->resource,
@@ -1091,7 +2516,8 @@ static void sl_compositor_create_host_region(struct wl_client* client,
                                              uint32_t id) {
   struct sl_host_compositor* host =
       static_cast<sl_host_compositor*>(wl_resource_get_user_data(resource));
-  struct sl_host_region* host_region = new sl_host_region();
+  struct sl_host_region* host_region =
+      host->compositor->ctx->region_pool.New();
 
   host_region->ctx = host->compositor->ctx;
   host_region->resource = wl_resource_create(
@@ -1101,6 +2527,7 @@ static void sl_compositor_create_host_region(struct wl_client* client,
                                  sl_destroy_host_region);
   host_region->proxy = wl_compositor_create_region(host->proxy);
   wl_region_set_user_data(host_region->proxy, host_region);
+  pixman_region32_init(&host_region->region);
 }
 
 static const struct wl_compositor_interface sl_compositor_implementation = {
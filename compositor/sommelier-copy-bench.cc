@@ -0,0 +1,139 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <benchmark/benchmark.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "sommelier-copy.h"  // NOLINT(build/include_directory)
+
+namespace vm_tools {
+namespace sommelier {
+
+namespace {
+
+const size_t kWidth = 1920;
+const size_t kHeight = 1080;
+
+// How the damage of a frame is spread over the surface.
+enum DamagePattern {
+  kDamageFull,      // One rect covering everything
+  kDamageTiles,     // 32x32 tiles on every other row and column
+  kDamageScanline,  // Every 8th row, full width, such as a terminal redraw
+};
+
+// A client buffer and an output buffer. Strides are padded like a GPU
+// allocation would unless |tight| is set.
+struct Buffers {
+  Buffers(size_t bpp, bool tight)
+      : bpp(bpp),
+        src_stride(kWidth * bpp + (tight ? 0 : 64)),
+        dst_stride(kWidth * 4 + (tight ? 0 : 256)),
+        src(src_stride * kHeight, 0x5a),
+        dst(dst_stride * kHeight) {}
+
+  // The jobs copy_damaged_rect() builds for the rect (x, y, width, height),
+  // in pixels.
+  sl_copy_job Job(size_t x,
+                  size_t y,
+                  size_t width,
+                  size_t height,
+                  enum sl_copy_op op) {
+    return {src.data() + y * src_stride + x * bpp,
+            dst.data() + y * dst_stride + x * 4,
+            src_stride,
+            dst_stride,
+            width * 4,
+            height,
+            op};
+  }
+
+  std::vector<sl_copy_job> Damage(enum DamagePattern pattern,
+                                  enum sl_copy_op op) {
+    std::vector<sl_copy_job> jobs;
+    switch (pattern) {
+      case kDamageFull:
+        jobs.push_back(Job(0, 0, kWidth, kHeight, op));
+        break;
+      case kDamageTiles:
+        for (size_t y = 0; y + 32 <= kHeight; y += 64) {
+          for (size_t x = 0; x + 32 <= kWidth; x += 64)
+            jobs.push_back(Job(x, y, 32, 32, op));
+        }
+        break;
+      case kDamageScanline:
+        for (size_t y = 0; y < kHeight; y += 8)
+          jobs.push_back(Job(0, y, kWidth, 1, op));
+        break;
+    }
+    return jobs;
+  }
+
+  size_t bpp;
+  size_t src_stride;
+  size_t dst_stride;
+  std::vector<uint8_t> src;
+  std::vector<uint8_t> dst;
+};
+
+size_t JobBytes(const std::vector<sl_copy_job>& jobs) {
+  size_t bytes = 0;
+  for (const auto& job : jobs)
+    bytes += job.row_bytes * job.rows;
+  return bytes;
+}
+
+// Args: kernel, op, damage pattern, tight strides.
+void BM_CopyRows(benchmark::State& state) {
+  auto kernel = static_cast<enum sl_copy_kernel>(state.range(0));
+  auto op = static_cast<enum sl_copy_op>(state.range(1));
+  auto pattern = static_cast<enum DamagePattern>(state.range(2));
+
+  if (!sl_copy_kernel_supported(kernel)) {
+    state.SkipWithError("kernel not supported on this CPU");
+    return;
+  }
+  state.SetLabel(sl_copy_kernel_name(kernel));
+
+  Buffers buffers(op == SL_COPY_OP_RGB565_TO_ARGB ? 2 : 4, state.range(3));
+  std::vector<sl_copy_job> jobs = buffers.Damage(pattern, op);
+  for (auto _ : state) {
+    for (const auto& job : jobs)
+      sl_copy_rows_using(kernel, job);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * JobBytes(jobs));
+}
+BENCHMARK(BM_CopyRows)
+    ->ArgNames({"kernel", "op", "damage", "tight"})
+    ->ArgsProduct({{SL_COPY_KERNEL_MEMCPY, SL_COPY_KERNEL_SSE41,
+                    SL_COPY_KERNEL_AVX2, SL_COPY_KERNEL_NEON},
+                   {SL_COPY_OP_COPY, SL_COPY_OP_XRGB_TO_ARGB,
+                    SL_COPY_OP_RGB565_TO_ARGB},
+                   {kDamageFull, kDamageTiles, kDamageScanline},
+                   {0, 1}});
+
+// Args: worker threads, damage pattern.
+void BM_CopyWorkerPool(benchmark::State& state) {
+  auto pattern = static_cast<enum DamagePattern>(state.range(1));
+  CopyWorkerPool pool(state.range(0), kDefaultCopyParallelThreshold);
+
+  Buffers buffers(4, false);
+  std::vector<sl_copy_job> jobs = buffers.Damage(pattern, SL_COPY_OP_COPY);
+  for (auto _ : state) {
+    pool.Run(jobs);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * JobBytes(jobs));
+}
+BENCHMARK(BM_CopyWorkerPool)
+    ->ArgNames({"threads", "damage"})
+    ->ArgsProduct({{0, 1, 3}, {kDamageFull, kDamageTiles, kDamageScanline}})
+    ->UseRealTime();
+
+}  // namespace
+
+}  // namespace sommelier
+}  // namespace vm_tools
@@ -0,0 +1,267 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-copy.h"  // NOLINT(build/include_directory)
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+
+#include <poll.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace vm_tools {
+namespace sommelier {
+
+namespace {
+
+const size_t kWidthBytes = 1024 * 4;
+const size_t kHeight = 768;
+const size_t kSrcStride = kWidthBytes + 64;
+const size_t kDstStride = kWidthBytes + 128;
+
+class CopyWorkerPoolTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    src_.resize(kSrcStride * kHeight);
+    for (size_t i = 0; i < src_.size(); ++i)
+      src_[i] = static_cast<uint8_t>(i * 31 + i / 7);
+    dst_.assign(kDstStride * kHeight, 0);
+    expected_.assign(kDstStride * kHeight, 0);
+  }
+
+ protected:
+  // Describes copying the rect (x, y, width, height), measured in bytes and
+  // rows, from |src| to |dst|.
+  sl_copy_job Job(std::vector<uint8_t>* dst,
+                  size_t x,
+                  size_t y,
+                  size_t width,
+                  size_t height) {
+    return {src_.data() + y * kSrcStride + x, dst->data() + y * kDstStride + x,
+            kSrcStride, kDstStride, width, height};
+  }
+
+  std::vector<uint8_t> src_;
+  std::vector<uint8_t> dst_;
+  std::vector<uint8_t> expected_;
+};
+
+}  // namespace
+
+TEST_F(CopyWorkerPoolTest, ParallelCopyMatchesSerialCopy) {
+  CopyWorkerPool pool(3, 0);
+  std::vector<sl_copy_job> jobs = {Job(&dst_, 0, 0, kWidthBytes, kHeight / 2),
+                                   Job(&dst_, 128, 400, 256, 300),
+                                   Job(&dst_, 4, 700, 12, 1)};
+
+  pool.Run(jobs);
+
+  sl_copy_rows(Job(&expected_, 0, 0, kWidthBytes, kHeight / 2));
+  sl_copy_rows(Job(&expected_, 128, 400, 256, 300));
+  sl_copy_rows(Job(&expected_, 4, 700, 12, 1));
+  EXPECT_EQ(dst_, expected_);
+}
+
+TEST_F(CopyWorkerPoolTest, SmallCopiesRunBelowThreshold) {
+  CopyWorkerPool pool(2, kWidthBytes * kHeight * 2);
+
+  pool.Run({Job(&dst_, 0, 0, kWidthBytes, kHeight)});
+
+  sl_copy_rows(Job(&expected_, 0, 0, kWidthBytes, kHeight));
+  EXPECT_EQ(dst_, expected_);
+}
+
+TEST_F(CopyWorkerPoolTest, PoolIsReusableAcrossBatches) {
+  CopyWorkerPool pool(2, 0);
+
+  for (size_t y = 0; y < kHeight; y += 64) {
+    pool.Run({Job(&dst_, 0, y, kWidthBytes, 64)});
+    sl_copy_rows(Job(&expected_, 0, y, kWidthBytes, 64));
+  }
+  EXPECT_EQ(dst_, expected_);
+}
+
+TEST_F(CopyWorkerPoolTest, CountsPageFaultsOfEveryCopyingThread) {
+  CopyWorkerPool pool(2, 0);
+  size_t size = kDstStride * kHeight;
+  void* fresh =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+           -1, 0);
+  ASSERT_NE(fresh, MAP_FAILED);
+  sl_copy_job job = Job(&dst_, 0, 0, kWidthBytes, kHeight);
+  job.dst = static_cast<uint8_t*>(fresh);
+  uint64_t page_faults = 0;
+
+  // Every page of the destination is first touched by the copy, on
+  // whichever threads it ran.
+  pool.Run({job}, &page_faults);
+
+  EXPECT_GT(page_faults, 0u);
+  munmap(fresh, size);
+}
+
+TEST_F(CopyWorkerPoolTest, EmptyBatchReturns) {
+  CopyWorkerPool pool(2, 0);
+
+  pool.Run({});
+  pool.Run({Job(&dst_, 0, 0, 0, 10), Job(&dst_, 0, 0, 10, 0)});
+
+  EXPECT_EQ(dst_, expected_);
+}
+
+class CopyKernelTest : public CopyWorkerPoolTest,
+                       public ::testing::WithParamInterface<sl_copy_kernel> {
+};
+
+TEST_P(CopyKernelTest, MatchesMemcpyAtAnyAlignment) {
+  if (!sl_copy_kernel_supported(GetParam()))
+    GTEST_SKIP() << sl_copy_kernel_name(GetParam()) << " not supported";
+
+  // Cover every destination alignment, plus widths either side of the
+  // streaming threshold and with ragged tails.
+  size_t y = 0;
+  for (size_t x = 0; x < 64; ++x) {
+    for (size_t width : {1, 255, 256, 257, 1000, 4000}) {
+      if (x + width > kWidthBytes)
+        continue;
+      sl_copy_rows_using(GetParam(), Job(&dst_, x, y, width, 2));
+      sl_copy_rows_using(SL_COPY_KERNEL_MEMCPY,
+                         Job(&expected_, x, y, width, 2));
+      y = (y + 2) % (kHeight - 2);
+    }
+  }
+  EXPECT_EQ(dst_, expected_);
+}
+
+TEST_P(CopyKernelTest, PackedRowsCopyAsOneRange) {
+  if (!sl_copy_kernel_supported(GetParam()))
+    GTEST_SKIP() << sl_copy_kernel_name(GetParam()) << " not supported";
+
+  std::vector<uint8_t> packed_dst(kWidthBytes * kHeight, 0);
+  sl_copy_job job = {src_.data() + 3, packed_dst.data(), kWidthBytes,
+                     kWidthBytes, kWidthBytes, kHeight - 1};
+
+  sl_copy_rows_using(GetParam(), job);
+
+  EXPECT_TRUE(std::equal(packed_dst.begin(),
+                         packed_dst.begin() + kWidthBytes * (kHeight - 1),
+                         src_.begin() + 3));
+  EXPECT_EQ(packed_dst.back(), 0);
+}
+
+TEST_P(CopyKernelTest, ConversionsMatchScalarAtAnyAlignment) {
+  if (!sl_copy_kernel_supported(GetParam()))
+    GTEST_SKIP() << sl_copy_kernel_name(GetParam()) << " not supported";
+
+  size_t y = 0;
+  for (sl_copy_op op :
+       {SL_COPY_OP_CLEAR, SL_COPY_OP_XRGB_TO_ARGB, SL_COPY_OP_ABGR_TO_ARGB,
+        SL_COPY_OP_XBGR_TO_ARGB, SL_COPY_OP_RGB565_TO_ARGB}) {
+    for (size_t x = 0; x < 64; x += 4) {
+      for (size_t width : {4, 252, 256, 260, 1000, 4000}) {
+        if (x + width > kWidthBytes)
+          continue;
+        sl_copy_job job = Job(&dst_, x, y, width, 2);
+        sl_copy_job expected = Job(&expected_, x, y, width, 2);
+        job.op = expected.op = op;
+        sl_copy_rows_using(GetParam(), job);
+        sl_copy_rows_using(SL_COPY_KERNEL_MEMCPY, expected);
+        y = (y + 2) % (kHeight - 2);
+      }
+    }
+  }
+  EXPECT_EQ(dst_, expected_);
+}
+
+INSTANTIATE_TEST_SUITE_P(AllKernels,
+                         CopyKernelTest,
+                         ::testing::Values(SL_COPY_KERNEL_MEMCPY,
+                                           SL_COPY_KERNEL_SSE41,
+                                           SL_COPY_KERNEL_AVX2,
+                                           SL_COPY_KERNEL_NEON));
+
+TEST(CopyKernel, ActiveKernelIsSupported) {
+  EXPECT_TRUE(sl_copy_kernel_supported(sl_copy_active_kernel()));
+}
+
+TEST(CopyKernel, ConvertsToArgb8888) {
+  // Little-endian 32-bit words, so bytes are B, G, R, A for ARGB8888.
+  const uint32_t argb = 0x80112233;
+  const uint32_t abgr = 0x80332211;
+  const uint16_t rgb565[] = {0xf800, 0x07e0, 0x001f, 0x8410};
+  uint32_t dst[4];
+
+  auto convert = [&dst](const void* src, size_t pixels, sl_copy_op op) {
+    sl_copy_job job = {static_cast<const uint8_t*>(src),
+                       reinterpret_cast<uint8_t*>(dst),
+                       0,
+                       0,
+                       pixels * sizeof(uint32_t),
+                       1,
+                       op};
+    sl_copy_rows(job);
+  };
+
+  convert(&argb, 1, SL_COPY_OP_XRGB_TO_ARGB);
+  EXPECT_EQ(dst[0], 0xff112233u);
+  convert(&abgr, 1, SL_COPY_OP_ABGR_TO_ARGB);
+  EXPECT_EQ(dst[0], 0x80112233u);
+  convert(&abgr, 1, SL_COPY_OP_XBGR_TO_ARGB);
+  EXPECT_EQ(dst[0], 0xff112233u);
+  convert(&argb, 1, SL_COPY_OP_CLEAR);
+  EXPECT_EQ(dst[0], 0u);
+
+  convert(rgb565, 4, SL_COPY_OP_RGB565_TO_ARGB);
+  EXPECT_EQ(dst[0], 0xffff0000u);
+  EXPECT_EQ(dst[1], 0xff00ff00u);
+  EXPECT_EQ(dst[2], 0xff0000ffu);
+  EXPECT_EQ(dst[3], 0xff848284u);
+}
+
+TEST_F(CopyWorkerPoolTest, PipelineCompletesBatchesInOrder) {
+  CopyWorkerPool pool(2, 0);
+  CopyPipeline pipeline(&pool);
+  std::vector<int> completed;
+
+  for (int i = 0; i < 8; ++i) {
+    size_t y = i * (kHeight / 8);
+    pipeline.Submit({Job(&dst_, 0, y, kWidthBytes, kHeight / 8)},
+                    [&completed, i](uint64_t) { completed.push_back(i); });
+  }
+  EXPECT_FALSE(pipeline.idle());
+
+  // Wait for the event loop wakeup rather than draining, like the event loop
+  // does.
+  while (!pipeline.Reap()) {
+    struct pollfd pfd = {pipeline.event_fd(), POLLIN, 0};
+    ASSERT_EQ(poll(&pfd, 1, 5000), 1);
+  }
+
+  sl_copy_rows(Job(&expected_, 0, 0, kWidthBytes, kHeight));
+  EXPECT_EQ(dst_, expected_);
+  EXPECT_EQ(completed, std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7}));
+}
+
+TEST_F(CopyWorkerPoolTest, PipelineDrainRunsCallbacks) {
+  CopyPipeline pipeline(nullptr);
+  bool done = false;
+
+  pipeline.Submit({Job(&dst_, 0, 0, kWidthBytes, kHeight)},
+                  [this, &done](uint64_t) {
+                    // The copy must have landed before the callback runs.
+                    sl_copy_rows(Job(&expected_, 0, 0, kWidthBytes, kHeight));
+                    EXPECT_EQ(dst_, expected_);
+                    done = true;
+                  });
+  pipeline.Drain();
+
+  EXPECT_TRUE(done);
+  EXPECT_TRUE(pipeline.idle());
+}
+
+}  // namespace sommelier
+}  // namespace vm_tools
@@ -0,0 +1,661 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-copy.h"  // NOLINT(build/include_directory)
+
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SL_COPY_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SL_COPY_NEON 1
+#endif
+
+#include "../sommelier-tracing.h"  // NOLINT(build/include_directory)
+
+namespace {
+
+// Bands smaller than this aren't worth handing to another thread.
+const size_t kMinBandBytes = 64 * 1024;
+
+// Number of bands to aim for per participating thread. More than one lets
+// threads that finish early pick up slack from slower ones.
+const size_t kBandsPerThread = 2;
+
+// Rows narrower than this go through memcpy even with a streaming kernel
+// selected; aligning the destination costs more than it saves.
+const size_t kMinStreamingBytes = 256;
+
+typedef void (*sl_copy_row_func_t)(uint8_t* dst,
+                                   const uint8_t* src,
+                                   size_t bytes);
+
+void sl_copy_row_memcpy(uint8_t* dst, const uint8_t* src, size_t bytes) {
+  memcpy(dst, src, bytes);
+}
+
+// Copies up to the first |alignment| boundary of |dst| with memcpy, returning
+// the number of bytes copied.
+size_t sl_copy_align_head(uint8_t* dst,
+                          const uint8_t* src,
+                          size_t bytes,
+                          size_t alignment) {
+  size_t head = (alignment - (reinterpret_cast<uintptr_t>(dst) &
+                              (alignment - 1))) &
+                (alignment - 1);
+  head = std::min(head, bytes);
+  memcpy(dst, src, head);
+  return head;
+}
+
+#if defined(SL_COPY_X86)
+// The output buffers are write-combined or uncached guest memory read by the
+// host, so bypass the cache with streaming stores.
+__attribute__((target("avx2"))) void sl_copy_row_avx2(uint8_t* dst,
+                                                      const uint8_t* src,
+                                                      size_t bytes) {
+  size_t i = sl_copy_align_head(dst, src, bytes, 32);
+
+  for (; i + 128 <= bytes; i += 128) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    __m256i b =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32));
+    __m256i c =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 64));
+    __m256i d =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 96));
+    _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i), a);
+    _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i + 32), b);
+    _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i + 64), c);
+    _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i + 96), d);
+  }
+  for (; i + 32 <= bytes; i += 32) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i), a);
+  }
+  memcpy(dst + i, src + i, bytes - i);
+}
+
+__attribute__((target("sse4.1"))) void sl_copy_row_sse41(uint8_t* dst,
+                                                         const uint8_t* src,
+                                                         size_t bytes) {
+  size_t i = sl_copy_align_head(dst, src, bytes, 16);
+
+  if ((reinterpret_cast<uintptr_t>(src + i) & 15) == 0) {
+    // Source and destination share alignment, so streaming loads can be
+    // used as well. These only help when the source is write-combined (e.g.
+    // a mapped DRM PRIME buffer) but are no slower otherwise.
+    for (; i + 64 <= bytes; i += 64) {
+      __m128i* s = reinterpret_cast<__m128i*>(const_cast<uint8_t*>(src + i));
+      __m128i a = _mm_stream_load_si128(s);
+      __m128i b = _mm_stream_load_si128(s + 1);
+      __m128i c = _mm_stream_load_si128(s + 2);
+      __m128i d = _mm_stream_load_si128(s + 3);
+      __m128i* t = reinterpret_cast<__m128i*>(dst + i);
+      _mm_stream_si128(t, a);
+      _mm_stream_si128(t + 1, b);
+      _mm_stream_si128(t + 2, c);
+      _mm_stream_si128(t + 3, d);
+    }
+  } else {
+    for (; i + 64 <= bytes; i += 64) {
+      const __m128i* s = reinterpret_cast<const __m128i*>(src + i);
+      __m128i a = _mm_loadu_si128(s);
+      __m128i b = _mm_loadu_si128(s + 1);
+      __m128i c = _mm_loadu_si128(s + 2);
+      __m128i d = _mm_loadu_si128(s + 3);
+      __m128i* t = reinterpret_cast<__m128i*>(dst + i);
+      _mm_stream_si128(t, a);
+      _mm_stream_si128(t + 1, b);
+      _mm_stream_si128(t + 2, c);
+      _mm_stream_si128(t + 3, d);
+    }
+  }
+  for (; i + 16 <= bytes; i += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i), a);
+  }
+  memcpy(dst + i, src + i, bytes - i);
+}
+#endif
+
+#if defined(SL_COPY_NEON)
+void sl_copy_row_neon(uint8_t* dst, const uint8_t* src, size_t bytes) {
+  size_t i = sl_copy_align_head(dst, src, bytes, 16);
+
+  for (; i + 64 <= bytes; i += 64) {
+    uint8x16_t a = vld1q_u8(src + i);
+    uint8x16_t b = vld1q_u8(src + i + 16);
+    uint8x16_t c = vld1q_u8(src + i + 32);
+    uint8x16_t d = vld1q_u8(src + i + 48);
+    // STNP is a store hint telling the core not to keep the lines cached.
+    asm volatile("stnp %q0, %q1, [%2]" ::"w"(a), "w"(b), "r"(dst + i)
+                 : "memory");
+    asm volatile("stnp %q0, %q1, [%2]" ::"w"(c), "w"(d), "r"(dst + i + 32)
+                 : "memory");
+  }
+  memcpy(dst + i, src + i, bytes - i);
+}
+#endif
+
+// Pixel conversions for shaped windows, whose output buffers are always
+// ARGB8888. Four byte source pixels are converted in place with a byte
+// shuffle and an OR; RGB565 is rare enough to stay scalar. Rows are measured
+// in destination bytes, as everywhere else.
+const uint32_t kOpaqueAlpha = 0xff000000;
+
+constexpr bool sl_copy_op_swaps_red_blue(enum sl_copy_op op) {
+  return op == SL_COPY_OP_ABGR_TO_ARGB || op == SL_COPY_OP_XBGR_TO_ARGB;
+}
+
+constexpr bool sl_copy_op_sets_alpha(enum sl_copy_op op) {
+  return op == SL_COPY_OP_XRGB_TO_ARGB || op == SL_COPY_OP_XBGR_TO_ARGB;
+}
+
+template <enum sl_copy_op op>
+inline uint32_t sl_convert_pixel(uint32_t pixel) {
+  if (sl_copy_op_swaps_red_blue(op)) {
+    pixel = (pixel & 0xff00ff00) | ((pixel >> 16) & 0xff) |
+            ((pixel & 0xff) << 16);
+  }
+  if (sl_copy_op_sets_alpha(op))
+    pixel |= kOpaqueAlpha;
+  return pixel;
+}
+
+template <enum sl_copy_op op>
+void sl_convert_row_scalar(uint8_t* dst, const uint8_t* src, size_t bytes) {
+  size_t pixels = bytes / sizeof(uint32_t);
+
+  if (op == SL_COPY_OP_CLEAR) {
+    memset(dst, 0, bytes);
+  } else if (op == SL_COPY_OP_RGB565_TO_ARGB) {
+    for (size_t i = 0; i < pixels; ++i) {
+      uint16_t value;
+      memcpy(&value, src + i * sizeof(value), sizeof(value));
+      uint32_t r = (value >> 11) & 0x1f;
+      uint32_t g = (value >> 5) & 0x3f;
+      uint32_t b = value & 0x1f;
+      // Replicate the top bits into the bottom so that full intensity
+      // stays full intensity.
+      uint32_t pixel = kOpaqueAlpha | ((r << 3 | r >> 2) << 16) |
+                       ((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2);
+      memcpy(dst + i * sizeof(pixel), &pixel, sizeof(pixel));
+    }
+  } else {
+    for (size_t i = 0; i < pixels; ++i) {
+      uint32_t pixel;
+      memcpy(&pixel, src + i * sizeof(pixel), sizeof(pixel));
+      pixel = sl_convert_pixel<op>(pixel);
+      memcpy(dst + i * sizeof(pixel), &pixel, sizeof(pixel));
+    }
+  }
+}
+
+// Converts pixels one at a time up to the first |alignment| boundary of
+// |dst|, returning the number of bytes written. Returns |bytes| if |dst|
+// isn't pixel aligned, leaving the whole row to the scalar path.
+template <enum sl_copy_op op>
+size_t sl_convert_align_head(uint8_t* dst,
+                             const uint8_t* src,
+                             size_t bytes,
+                             size_t alignment) {
+  uintptr_t misalignment = reinterpret_cast<uintptr_t>(dst) & (alignment - 1);
+  size_t head = misalignment ? alignment - misalignment : 0;
+  if (misalignment % sizeof(uint32_t))
+    head = bytes;
+  head = std::min(head, bytes);
+  sl_convert_row_scalar<op>(dst, src, head);
+  return head;
+}
+
+#if defined(SL_COPY_X86)
+template <enum sl_copy_op op>
+__attribute__((target("avx2"))) void sl_convert_row_avx2(uint8_t* dst,
+                                                         const uint8_t* src,
+                                                         size_t bytes) {
+  const __m256i swap = _mm256_setr_epi8(
+      2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15, 2, 1, 0, 3, 6, 5,
+      4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  const __m256i alpha = _mm256_set1_epi32(kOpaqueAlpha);
+  size_t i = sl_convert_align_head<op>(dst, src, bytes, 32);
+
+  for (; i + 32 <= bytes; i += 32) {
+    __m256i value = _mm256_setzero_si256();
+    if (op != SL_COPY_OP_CLEAR)
+      value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+    if (sl_copy_op_swaps_red_blue(op))
+      value = _mm256_shuffle_epi8(value, swap);
+    if (sl_copy_op_sets_alpha(op))
+      value = _mm256_or_si256(value, alpha);
+    _mm256_stream_si256(reinterpret_cast<__m256i*>(dst + i), value);
+  }
+  sl_convert_row_scalar<op>(dst + i, src + i, bytes - i);
+}
+
+template <enum sl_copy_op op>
+__attribute__((target("sse4.1"))) void sl_convert_row_sse41(
+    uint8_t* dst,
+    const uint8_t* src,
+    size_t bytes) {
+  const __m128i swap =
+      _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+  const __m128i alpha = _mm_set1_epi32(kOpaqueAlpha);
+  size_t i = sl_convert_align_head<op>(dst, src, bytes, 16);
+
+  for (; i + 16 <= bytes; i += 16) {
+    __m128i value = _mm_setzero_si128();
+    if (op != SL_COPY_OP_CLEAR)
+      value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    if (sl_copy_op_swaps_red_blue(op))
+      value = _mm_shuffle_epi8(value, swap);
+    if (sl_copy_op_sets_alpha(op))
+      value = _mm_or_si128(value, alpha);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(dst + i), value);
+  }
+  sl_convert_row_scalar<op>(dst + i, src + i, bytes - i);
+}
+#endif
+
+#if defined(SL_COPY_NEON)
+template <enum sl_copy_op op>
+void sl_convert_row_neon(uint8_t* dst, const uint8_t* src, size_t bytes) {
+  static const uint8_t kSwap[16] = {2,  1, 0,  3,  6,  5,  4,  7,
+                                    10, 9, 8, 11, 14, 13, 12, 15};
+  const uint8x16_t swap = vld1q_u8(kSwap);
+  const uint32x4_t alpha = vdupq_n_u32(kOpaqueAlpha);
+  size_t i = sl_convert_align_head<op>(dst, src, bytes, 16);
+
+  for (; i + 32 <= bytes; i += 32) {
+    uint8x16_t a = vdupq_n_u8(0);
+    uint8x16_t b = vdupq_n_u8(0);
+    if (op != SL_COPY_OP_CLEAR) {
+      a = vld1q_u8(src + i);
+      b = vld1q_u8(src + i + 16);
+    }
+    if (sl_copy_op_swaps_red_blue(op)) {
+      a = vqtbl1q_u8(a, swap);
+      b = vqtbl1q_u8(b, swap);
+    }
+    if (sl_copy_op_sets_alpha(op)) {
+      a = vreinterpretq_u8_u32(vorrq_u32(vreinterpretq_u32_u8(a), alpha));
+      b = vreinterpretq_u8_u32(vorrq_u32(vreinterpretq_u32_u8(b), alpha));
+    }
+    asm volatile("stnp %q0, %q1, [%2]" ::"w"(a), "w"(b), "r"(dst + i)
+                 : "memory");
+  }
+  sl_convert_row_scalar<op>(dst + i, src + i, bytes - i);
+}
+#endif
+
+template <enum sl_copy_op op>
+sl_copy_row_func_t sl_convert_row_func_for(enum sl_copy_kernel kernel) {
+  switch (kernel) {
+#if defined(SL_COPY_X86)
+    case SL_COPY_KERNEL_AVX2:
+      return sl_convert_row_avx2<op>;
+    case SL_COPY_KERNEL_SSE41:
+      return sl_convert_row_sse41<op>;
+#endif
+#if defined(SL_COPY_NEON)
+    case SL_COPY_KERNEL_NEON:
+      return sl_convert_row_neon<op>;
+#endif
+    default:
+      return sl_convert_row_scalar<op>;
+  }
+}
+
+sl_copy_row_func_t sl_convert_row_func(enum sl_copy_kernel kernel,
+                                       enum sl_copy_op op) {
+  switch (op) {
+    case SL_COPY_OP_CLEAR:
+      return sl_convert_row_func_for<SL_COPY_OP_CLEAR>(kernel);
+    case SL_COPY_OP_XRGB_TO_ARGB:
+      return sl_convert_row_func_for<SL_COPY_OP_XRGB_TO_ARGB>(kernel);
+    case SL_COPY_OP_ABGR_TO_ARGB:
+      return sl_convert_row_func_for<SL_COPY_OP_ABGR_TO_ARGB>(kernel);
+    case SL_COPY_OP_XBGR_TO_ARGB:
+      return sl_convert_row_func_for<SL_COPY_OP_XBGR_TO_ARGB>(kernel);
+    case SL_COPY_OP_RGB565_TO_ARGB:
+      return sl_convert_row_scalar<SL_COPY_OP_RGB565_TO_ARGB>;
+    case SL_COPY_OP_COPY:
+      break;
+  }
+  return sl_copy_row_memcpy;
+}
+
+sl_copy_row_func_t sl_copy_row_func(enum sl_copy_kernel kernel) {
+  switch (kernel) {
+#if defined(SL_COPY_X86)
+    case SL_COPY_KERNEL_AVX2:
+      return sl_copy_row_avx2;
+    case SL_COPY_KERNEL_SSE41:
+      return sl_copy_row_sse41;
+#endif
+#if defined(SL_COPY_NEON)
+    case SL_COPY_KERNEL_NEON:
+      return sl_copy_row_neon;
+#endif
+    default:
+      return sl_copy_row_memcpy;
+  }
+}
+
+// Orders streaming stores ahead of whatever tells the host to read them.
+void sl_copy_fence(enum sl_copy_kernel kernel) {
+#if defined(SL_COPY_X86)
+  if (kernel != SL_COPY_KERNEL_MEMCPY)
+    _mm_sfence();
+#elif defined(SL_COPY_NEON)
+  if (kernel != SL_COPY_KERNEL_MEMCPY)
+    asm volatile("dmb ishst" ::: "memory");
+#endif
+}
+
+enum sl_copy_kernel sl_copy_detect_kernel() {
+  enum sl_copy_kernel kernel = SL_COPY_KERNEL_MEMCPY;
+  if (sl_copy_kernel_supported(SL_COPY_KERNEL_AVX2))
+    kernel = SL_COPY_KERNEL_AVX2;
+  else if (sl_copy_kernel_supported(SL_COPY_KERNEL_SSE41))
+    kernel = SL_COPY_KERNEL_SSE41;
+  else if (sl_copy_kernel_supported(SL_COPY_KERNEL_NEON))
+    kernel = SL_COPY_KERNEL_NEON;
+  return kernel;
+}
+
+}  // namespace
+
+bool sl_copy_kernel_supported(enum sl_copy_kernel kernel) {
+  switch (kernel) {
+    case SL_COPY_KERNEL_MEMCPY:
+      return true;
+#if defined(SL_COPY_X86)
+    case SL_COPY_KERNEL_AVX2:
+      return __builtin_cpu_supports("avx2");
+    case SL_COPY_KERNEL_SSE41:
+      return __builtin_cpu_supports("sse4.1");
+#endif
+#if defined(SL_COPY_NEON)
+    case SL_COPY_KERNEL_NEON:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+const char* sl_copy_kernel_name(enum sl_copy_kernel kernel) {
+  switch (kernel) {
+    case SL_COPY_KERNEL_MEMCPY:
+      return "memcpy";
+    case SL_COPY_KERNEL_SSE41:
+      return "sse4.1";
+    case SL_COPY_KERNEL_AVX2:
+      return "avx2";
+    case SL_COPY_KERNEL_NEON:
+      return "neon";
+  }
+  return "unknown";
+}
+
+enum sl_copy_kernel sl_copy_active_kernel() {
+  // Picked once; CPU features can't change under us.
+  static const enum sl_copy_kernel kernel = sl_copy_detect_kernel();
+  return kernel;
+}
+
+void sl_copy_rows_using(enum sl_copy_kernel kernel,
+                        const struct sl_copy_job& job) {
+  const uint8_t* src = job.src;
+  uint8_t* dst = job.dst;
+  size_t rows = job.rows;
+  size_t row_bytes = job.row_bytes;
+
+  // Tightly packed rows (e.g. full-width damage on a buffer without padding)
+  // are one contiguous range in both buffers. RGB565 rows are narrower in
+  // the source, so never look packed.
+  bool src_packed = job.op == SL_COPY_OP_CLEAR || job.src_stride == row_bytes;
+  if (src_packed && job.dst_stride == row_bytes &&
+      job.op != SL_COPY_OP_RGB565_TO_ARGB) {
+    row_bytes *= rows;
+    rows = 1;
+  }
+
+  if (row_bytes < kMinStreamingBytes)
+    kernel = SL_COPY_KERNEL_MEMCPY;
+
+  sl_copy_row_func_t copy_row = job.op == SL_COPY_OP_COPY
+                                    ? sl_copy_row_func(kernel)
+                                    : sl_convert_row_func(kernel, job.op);
+  while (rows--) {
+    copy_row(dst, src, row_bytes);
+    dst += job.dst_stride;
+    src += job.src_stride;
+  }
+  sl_copy_fence(kernel);
+}
+
+void sl_copy_rows(const struct sl_copy_job& job) {
+  sl_copy_rows_using(sl_copy_active_kernel(), job);
+}
+
+uint64_t sl_copy_thread_page_faults() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_THREAD, &usage))
+    return 0;
+  return usage.ru_minflt + usage.ru_majflt;
+}
+
+CopyWorkerPool::CopyWorkerPool(size_t num_threads, size_t parallel_threshold)
+    : parallel_threshold_(parallel_threshold) {
+  threads_.reserve(num_threads);
+  for (size_t i = 0; i < num_threads; ++i)
+    threads_.emplace_back(&CopyWorkerPool::WorkerMain, this);
+}
+
+CopyWorkerPool::~CopyWorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  work_cv_.notify_all();
+  for (auto& thread : threads_)
+    thread.join();
+}
+
+void CopyWorkerPool::Run(const std::vector<sl_copy_job>& jobs,
+                         uint64_t* page_faults) {
+  size_t total_bytes = 0;
+  for (const auto& job : jobs)
+    total_bytes += job.row_bytes * job.rows;
+
+  if (threads_.empty() || !total_bytes || total_bytes < parallel_threshold_) {
+    uint64_t faults_start = page_faults ? sl_copy_thread_page_faults() : 0;
+    for (const auto& job : jobs)
+      sl_copy_rows(job);
+    if (page_faults)
+      *page_faults += sl_copy_thread_page_faults() - faults_start;
+    return;
+  }
+
+  TRACE_EVENT("surface", "CopyWorkerPool::Run", "bytes", total_bytes);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Partition(jobs, total_bytes);
+    next_task_ = 0;
+    tasks_remaining_ = tasks_.size();
+    count_page_faults_ = page_faults != nullptr;
+    page_faults_ = 0;
+    ++generation_;
+  }
+  work_cv_.notify_all();
+
+  // The calling thread works on the batch too rather than sitting idle.
+  Drain();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this] { return tasks_remaining_ == 0; });
+  tasks_.clear();
+  if (page_faults)
+    *page_faults += page_faults_;
+}
+
+void CopyWorkerPool::Partition(const std::vector<sl_copy_job>& jobs,
+                               size_t total_bytes) {
+  size_t num_bands = (threads_.size() + 1) * kBandsPerThread;
+  size_t band_bytes = std::max(kMinBandBytes, total_bytes / num_bands);
+
+  tasks_.clear();
+  for (const auto& job : jobs) {
+    if (!job.rows || !job.row_bytes)
+      continue;
+
+    size_t band_rows = std::max<size_t>(1, band_bytes / job.row_bytes);
+    for (size_t row = 0; row < job.rows; row += band_rows) {
+      sl_copy_job band = job;
+      band.src = job.src + row * job.src_stride;
+      band.dst = job.dst + row * job.dst_stride;
+      band.rows = std::min(band_rows, job.rows - row);
+      tasks_.push_back(band);
+    }
+  }
+}
+
+void CopyWorkerPool::Drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (next_task_ < tasks_.size()) {
+    sl_copy_job task = tasks_[next_task_++];
+    bool count_page_faults = count_page_faults_;
+    lock.unlock();
+    uint64_t faults_start =
+        count_page_faults ? sl_copy_thread_page_faults() : 0;
+    sl_copy_rows(task);
+    uint64_t faults =
+        count_page_faults ? sl_copy_thread_page_faults() - faults_start : 0;
+    lock.lock();
+    page_faults_ += faults;
+    if (--tasks_remaining_ == 0)
+      done_cv_.notify_one();
+  }
+}
+
+void CopyWorkerPool::WorkerMain() {
+  uint64_t seen_generation = 0;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_cv_.wait(lock, [this, seen_generation] {
+        return shutdown_ || generation_ != seen_generation;
+      });
+      if (shutdown_)
+        return;
+      seen_generation = generation_;
+    }
+    Drain();
+  }
+}
+
+CopyPipeline::CopyPipeline(CopyWorkerPool* pool)
+    : pool_(pool),
+      event_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+      thread_(&CopyPipeline::ThreadMain, this) {}
+
+CopyPipeline::~CopyPipeline() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  work_cv_.notify_one();
+  thread_.join();
+  if (event_fd_ >= 0)
+    close(event_fd_);
+}
+
+void CopyPipeline::Submit(std::vector<sl_copy_job> jobs,
+                          std::function<void(uint64_t page_faults)> done,
+                          bool count_page_faults) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_.push_back(
+        {std::move(jobs), std::move(done), count_page_faults, 0});
+  }
+  ++in_flight_;
+  work_cv_.notify_one();
+}
+
+bool CopyPipeline::Reap() {
+  uint64_t count;
+  std::deque<Batch> completed;
+
+  // Clear the wakeup before taking the batches, so a batch that completes
+  // in between signals again rather than being missed.
+  if (read(event_fd_, &count, sizeof(count)) < 0) {
+    // EAGAIN: nothing new since the last reap.
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    completed.swap(completed_);
+  }
+  for (auto& batch : completed) {
+    --in_flight_;
+    if (batch.done)
+      batch.done(batch.page_faults);
+  }
+  return idle();
+}
+
+void CopyPipeline::Drain() {
+  TRACE_EVENT("surface", "CopyPipeline::Drain", "in_flight", in_flight_);
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cv_.wait(lock, [this] { return completed_.size() == in_flight_; });
+  }
+  Reap();
+}
+
+void CopyPipeline::ThreadMain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (true) {
+    work_cv_.wait(lock, [this] { return shutdown_ || !pending_.empty(); });
+    if (pending_.empty())
+      return;
+
+    Batch batch = std::move(pending_.front());
+    pending_.pop_front();
+    lock.unlock();
+    {
+      TRACE_EVENT("surface", "CopyPipeline::Copy", "jobs", batch.jobs.size());
+      uint64_t* page_faults =
+          batch.count_page_faults ? &batch.page_faults : nullptr;
+      if (pool_) {
+        pool_->Run(batch.jobs, page_faults);
+      } else {
+        uint64_t faults_start = page_faults ? sl_copy_thread_page_faults() : 0;
+        for (const auto& job : batch.jobs)
+          sl_copy_rows(job);
+        if (page_faults)
+          *page_faults = sl_copy_thread_page_faults() - faults_start;
+      }
+    }
+    lock.lock();
+
+    completed_.push_back(std::move(batch));
+    done_cv_.notify_one();
+    uint64_t one = 1;
+    if (write(event_fd_, &one, sizeof(one)) < 0) {
+      // Only fails if the counter would overflow, in which case the fd is
+      // already readable.
+    }
+  }
+}
@@ -0,0 +1,192 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_COPY_H_
+#define VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_COPY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Damage copies smaller than this many bytes run inline on the calling
+// thread, since waking the workers costs more than the copy itself.
+const size_t kDefaultCopyParallelThreshold = 1024 * 1024;
+
+// What a copy job does to each row. The conversions produce the ARGB8888
+// that shaped windows are forwarded as, straight from the client's format.
+enum sl_copy_op {
+  SL_COPY_OP_COPY,            // Copy bytes unchanged
+  SL_COPY_OP_CLEAR,           // Write transparent black; |src| is unused
+  SL_COPY_OP_XRGB_TO_ARGB,    // Make every pixel opaque
+  SL_COPY_OP_ABGR_TO_ARGB,    // Swap red and blue
+  SL_COPY_OP_XBGR_TO_ARGB,    // Swap red and blue, make opaque
+  SL_COPY_OP_RGB565_TO_ARGB,  // Widen each channel to 8 bits, make opaque
+};
+
+// A run of |rows| rows, each |row_bytes| wide, to copy from a client buffer
+// into an output buffer. One job covers a single plane of a damage rect.
+// |row_bytes| counts destination bytes, which only differs from the source
+// when converting from RGB565.
+struct sl_copy_job {
+  const uint8_t* src;
+  uint8_t* dst;
+  size_t src_stride;
+  size_t dst_stride;
+  size_t row_bytes;
+  size_t rows;
+  enum sl_copy_op op = SL_COPY_OP_COPY;
+};
+
+// Row copy implementations. Everything other than memcpy uses non-temporal
+// stores, since output buffers are write-combined or uncached memory that the
+// host reads back and caching them only evicts useful data.
+enum sl_copy_kernel {
+  SL_COPY_KERNEL_MEMCPY,  // Plain memcpy
+  SL_COPY_KERNEL_SSE41,   // x86 SSE4.1
+  SL_COPY_KERNEL_AVX2,    // x86 AVX2
+  SL_COPY_KERNEL_NEON     // ARMv8 NEON
+};
+
+bool sl_copy_kernel_supported(enum sl_copy_kernel kernel);
+
+const char* sl_copy_kernel_name(enum sl_copy_kernel kernel);
+
+// Returns the fastest kernel supported by this CPU. Detection runs once, on
+// the first call.
+enum sl_copy_kernel sl_copy_active_kernel();
+
+// Copies the rows described by |job| with the given kernel, which must be
+// supported by this CPU. Conversions the kernel has no vector version of
+// run one pixel at a time.
+void sl_copy_rows_using(enum sl_copy_kernel kernel,
+                        const struct sl_copy_job& job);
+
+// Copies the rows described by |job| with the active kernel.
+void sl_copy_rows(const struct sl_copy_job& job);
+
+// Page faults the calling thread has taken so far.
+uint64_t sl_copy_thread_page_faults();
+
+// Pool of worker threads used to split large damage copies across cores.
+//
+// The pool only ever runs one batch at a time, and Run() does not return
+// until every job in the batch has been copied, so callers can treat it as
+// a drop-in replacement for running the jobs serially.
+class CopyWorkerPool {
+ public:
+  // |num_threads| worker threads are started in addition to the calling
+  // thread, which also participates in copying. Batches totaling fewer than
+  // |parallel_threshold| bytes are copied on the calling thread alone.
+  CopyWorkerPool(size_t num_threads, size_t parallel_threshold);
+  CopyWorkerPool(const CopyWorkerPool&) = delete;
+  CopyWorkerPool& operator=(const CopyWorkerPool&) = delete;
+  ~CopyWorkerPool();
+
+  // Copies all |jobs|, returning once every row has been written. If
+  // |page_faults| is non-null, the page faults each thread took while
+  // copying are added to it.
+  void Run(const std::vector<sl_copy_job>& jobs,
+           uint64_t* page_faults = nullptr);
+
+  size_t num_threads() const { return threads_.size(); }
+
+ private:
+  // Splits |jobs| into row bands of roughly equal size in |tasks_|.
+  void Partition(const std::vector<sl_copy_job>& jobs, size_t total_bytes);
+  // Claims and copies tasks from the current batch until none are left.
+  void Drain();
+  void WorkerMain();
+
+  const size_t parallel_threshold_;
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  // Incremented for every batch so sleeping workers can tell a new batch
+  // from a spurious wakeup.
+  uint64_t generation_ = 0;
+  bool shutdown_ = false;
+
+  // The current batch. Guarded by |mutex_|.
+  std::vector<sl_copy_job> tasks_;
+  size_t next_task_ = 0;
+  size_t tasks_remaining_ = 0;
+  bool count_page_faults_ = false;
+  uint64_t page_faults_ = 0;
+};
+
+// Runs batches of damage copies on a background thread so commits don't
+// block the event loop, then hands each batch back to the event loop to
+// finish the commit that depends on it.
+//
+// Batches are copied and completed strictly in submission order. Submit(),
+// Reap(), Drain() and idle() must all be called from the same thread.
+class CopyPipeline {
+ public:
+  // Batches are split across |pool| if non-null, and copied on the pipeline
+  // thread alone otherwise. |pool| must outlive the pipeline and mustn't be
+  // used by anything else.
+  explicit CopyPipeline(CopyWorkerPool* pool);
+  CopyPipeline(const CopyPipeline&) = delete;
+  CopyPipeline& operator=(const CopyPipeline&) = delete;
+  // Waits for outstanding copies, but doesn't run their callbacks.
+  ~CopyPipeline();
+
+  // Becomes readable whenever a batch has finished copying and Reap() has
+  // work to do.
+  int event_fd() const { return event_fd_; }
+
+  // Queues |jobs| for copying. |done| runs from Reap() or Drain() after every
+  // job has been written, with the page faults the copying threads took if
+  // |count_page_faults|, and 0 otherwise.
+  void Submit(std::vector<sl_copy_job> jobs,
+              std::function<void(uint64_t page_faults)> done,
+              bool count_page_faults = false);
+
+  // Runs the callback of every batch that has finished copying, in
+  // submission order. Returns true if nothing is left in flight.
+  bool Reap();
+
+  // Waits for every submitted batch to finish copying, then reaps them.
+  void Drain();
+
+  // True if every submitted batch has been reaped.
+  bool idle() const { return in_flight_ == 0; }
+
+ private:
+  struct Batch {
+    std::vector<sl_copy_job> jobs;
+    std::function<void(uint64_t page_faults)> done;
+    bool count_page_faults;
+    uint64_t page_faults;
+  };
+
+  void ThreadMain();
+
+  CopyWorkerPool* const pool_;
+  int event_fd_;
+  // Batches submitted but not yet reaped. Only touched by the submitting
+  // thread.
+  size_t in_flight_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  bool shutdown_ = false;
+  // Guarded by |mutex_|.
+  std::deque<Batch> pending_;
+  std::deque<Batch> completed_;
+
+  // Started last, since it uses everything above.
+  std::thread thread_;
+};
+
+#endif  // VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_COPY_H_
@@ -112,22 +112,25 @@ int sl_dmabuf_get_read_sync_file(int dmabuf_fd, int& sync_file_fd) {
   return errno;
 }
 
-void sl_dmabuf_sync(struct sl_context* ctx, struct sl_sync_point* sync_point) {
+void sl_dmabuf_sync(struct sl_context* ctx,
+                    struct sl_host_surface* host,
+                    struct sl_sync_point* sync_point) {
   int drm_fd = gbm_device_get_fd(ctx->gbm);
   struct drm_prime_handle prime_handle;
   int sync_file_fd;
   int ret;
 
-  // Attempt to export a sync_file from prime buffer and wait explicitly.
+  // Attempt to export a sync_file from prime buffer and wait for it without
+  // blocking the event loop.
   ret = sl_dmabuf_get_read_sync_file(sync_point->fd, sync_file_fd);
   if (!ret) {
     TRACE_EVENT("drm", "sl_dmabuf_sync: sync_wait", "prime_fd", sync_point->fd);
-    sl_dmabuf_sync_wait(sync_file_fd);
-    close(sync_file_fd);
+    sl_context_wait_for_fence(ctx, host, sync_file_fd);
     return;
   }
 
-  // Fallback to waiting on a virtgpu buffer's implicit fence.
+  // Fallback to waiting on a virtgpu buffer's implicit fence. There is no fd
+  // to watch for this one, so it blocks.
   //
   // First imports the prime fd to a gem handle. This will fail if this
   // function was not passed a prime handle that can be imported by the drm
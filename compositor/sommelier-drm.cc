@@ -99,7 +99,7 @@ static void sl_drm_create_prime_buffer(struct wl_client* client,
   bool is_virtgpu_buffer = false;
   if (ctx->gbm) {
     is_virtgpu_buffer = sl_linux_dmabuf_fixup_plane0_params(
-        ctx->gbm, name, &host_stride0, &host_modifier_hi, &host_modifier_lo);
+        ctx, name, &host_stride0, &host_modifier_hi, &host_modifier_lo);
   }
 
   zwp_linux_buffer_params_v1_add(buffer_params, name, 0, offset0, host_stride0,
@@ -113,6 +113,8 @@ static void sl_drm_create_prime_buffer(struct wl_client* client,
       .height = (uint32_t)height,
       .stride = host_stride0,
       .format = format,
+      .modifier = (static_cast<uint64_t>(host_modifier_hi) << 32) |
+                  host_modifier_lo,
       .dmabuf_fd = name,
       .is_virtgpu_buffer = is_virtgpu_buffer,
   };
@@ -13,6 +13,10 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 #include <libdrm/drm_fourcc.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <memory>
 #include <vector>
 
@@ -312,4 +316,164 @@ TEST_F(LinuxDmabufTest, BindVersion4_DoesntSendBindEvents) {
   ASSERT_EQ(callback_data.modifiers.size(), 0);
 }
 
+TEST_F(LinuxDmabufTest, FeedbackSharesFormatTableMappings) {
+  zwp_linux_dmabuf_v1* linux_dmabuf = BindClientToLinuxDmabuf(4);
+  const uint32_t size = 64;
+  const uint32_t format = DRM_FORMAT_XRGB8888;
+  int table_fd = memfd_create("sommelier-format-table", MFD_CLOEXEC);
+  int copy_fd = memfd_create("sommelier-format-table", MFD_CLOEXEC);
+  int other_table_fd = memfd_create("sommelier-format-table", MFD_CLOEXEC);
+  ASSERT_EQ(ftruncate(table_fd, size), 0);
+  ASSERT_EQ(ftruncate(copy_fd, size), 0);
+  ASSERT_EQ(ftruncate(other_table_fd, size), 0);
+  ASSERT_EQ(write(other_table_fd, &format, sizeof(format)),
+            static_cast<ssize_t>(sizeof(format)));
+
+  // Sends |fd| as the format table of a new feedback object.
+  auto send_format_table = [&](int fd) {
+    zwp_linux_dmabuf_v1_get_default_feedback(linux_dmabuf);
+    client->Flush();
+    Pump();
+    zwp_linux_dmabuf_feedback_v1* proxy =
+        get_linux_dmabuf_test_fixture().feedback_proxy;
+    HostEventHandler(proxy)->format_table(
+        wl_proxy_get_user_data(reinterpret_cast<wl_proxy*>(proxy)), proxy,
+        dup(fd), size);
+  };
+
+  send_format_table(table_fd);
+  send_format_table(table_fd);
+  EXPECT_EQ(ctx.linux_dmabuf_format_tables.size(), 1u);
+
+  // Hosts may well send every feedback object a file of its own.
+  send_format_table(copy_fd);
+  EXPECT_EQ(ctx.linux_dmabuf_format_tables.size(), 1u);
+
+  send_format_table(other_table_fd);
+  EXPECT_EQ(ctx.linux_dmabuf_format_tables.size(), 2u);
+
+  close(table_fd);
+  close(copy_fd);
+  close(other_table_fd);
+}
+
+TEST_F(LinuxDmabufTest, HostFeedbackSelectsScanoutFormats) {
+  struct PackedFormat {
+    uint32_t format;
+    uint32_t padding;
+    uint64_t modifier;
+  };
+  const PackedFormat entries[] = {
+      {DRM_FORMAT_XRGB8888, 0, DRM_FORMAT_MOD_LINEAR},
+      {DRM_FORMAT_ARGB8888, 0, I915_FORMAT_MOD_X_TILED},
+  };
+  int table_fd = memfd_create("sommelier-format-table", MFD_CLOEXEC);
+  ASSERT_EQ(write(table_fd, entries, sizeof(entries)),
+            static_cast<ssize_t>(sizeof(entries)));
+
+  zwp_linux_dmabuf_feedback_v1* proxy =
+      get_linux_dmabuf_test_fixture().host_feedback_proxy;
+  void* data = wl_proxy_get_user_data(reinterpret_cast<wl_proxy*>(proxy));
+  const zwp_linux_dmabuf_feedback_v1_listener* listener =
+      HostEventHandler(proxy);
+  uint16_t indices[] = {0, 1};
+  struct wl_array tranche;
+  wl_array_init(&tranche);
+  memcpy(wl_array_add(&tranche, sizeof(indices)), indices, sizeof(indices));
+
+  listener->format_table(data, proxy, table_fd, sizeof(entries));
+  listener->tranche_formats(data, proxy, &tranche);
+  listener->tranche_flags(data, proxy,
+                          ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT);
+  listener->tranche_done(data, proxy);
+  wl_array_release(&tranche);
+
+  // Nothing changes until the feedback is done.
+  EXPECT_TRUE(sl_linux_dmabuf_host_scanout_linear(&ctx, DRM_FORMAT_ARGB8888));
+
+  listener->done(data, proxy);
+  EXPECT_TRUE(sl_linux_dmabuf_host_scanout_linear(&ctx, DRM_FORMAT_XRGB8888));
+  EXPECT_FALSE(sl_linux_dmabuf_host_scanout_linear(&ctx, DRM_FORMAT_ARGB8888));
+}
+
+TEST_F(LinuxDmabufTest, SurfaceFeedbackRecordsScanoutFormats) {
+  struct PackedFormat {
+    uint32_t format;
+    uint32_t padding;
+    uint64_t modifier;
+  };
+  const PackedFormat entries[] = {
+      {DRM_FORMAT_XRGB8888, 0, DRM_FORMAT_MOD_LINEAR},
+      {DRM_FORMAT_XRGB2101010, 0, DRM_FORMAT_MOD_LINEAR},
+  };
+  int table_fd = memfd_create("sommelier-format-table", MFD_CLOEXEC);
+  ASSERT_EQ(write(table_fd, entries, sizeof(entries)),
+            static_cast<ssize_t>(sizeof(entries)));
+
+  zwp_linux_dmabuf_v1* linux_dmabuf = BindClientToLinuxDmabuf(4);
+  struct wl_surface* surface = client->CreateSurface();
+  zwp_linux_dmabuf_v1_get_surface_feedback(linux_dmabuf, surface);
+  client->Flush();
+  Pump();
+  struct wl_resource* surface_resource = wl_client_get_object(
+      client->client, wl_proxy_get_id(reinterpret_cast<wl_proxy*>(surface)));
+  struct sl_host_surface* host_surface = static_cast<sl_host_surface*>(
+      wl_resource_get_user_data(surface_resource));
+
+  zwp_linux_dmabuf_feedback_v1* proxy =
+      get_linux_dmabuf_test_fixture().feedback_proxy;
+  void* data = wl_proxy_get_user_data(reinterpret_cast<wl_proxy*>(proxy));
+  const zwp_linux_dmabuf_feedback_v1_listener* listener =
+      HostEventHandler(proxy);
+  uint16_t indices[] = {0, 1};
+  struct wl_array tranche;
+  wl_array_init(&tranche);
+  memcpy(wl_array_add(&tranche, sizeof(indices)), indices, sizeof(indices));
+
+  listener->format_table(data, proxy, table_fd, sizeof(entries));
+  listener->tranche_formats(data, proxy, &tranche);
+  listener->tranche_flags(data, proxy,
+                          ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT);
+  listener->tranche_done(data, proxy);
+  wl_array_release(&tranche);
+  EXPECT_TRUE(host_surface->scanout_formats.empty());
+
+  // Only formats sommelier supports are recorded, once the feedback is done.
+  listener->done(data, proxy);
+  ASSERT_EQ(host_surface->scanout_formats.size(), 1u);
+  EXPECT_EQ(host_surface->scanout_formats[0].first, DRM_FORMAT_XRGB8888);
+  EXPECT_EQ(host_surface->scanout_formats[0].second, DRM_FORMAT_MOD_LINEAR);
+}
+
+TEST_F(LinuxDmabufTest, DestroyingBufferDropsPlane0Fixup) {
+  int dmabuf_fd = memfd_create("sommelier-dmabuf", MFD_CLOEXEC);
+  int other_fd = memfd_create("sommelier-other-dmabuf", MFD_CLOEXEC);
+  struct stat dmabuf_stat, other_stat;
+  ASSERT_EQ(fstat(dmabuf_fd, &dmabuf_stat), 0);
+  ASSERT_EQ(fstat(other_fd, &other_stat), 0);
+  ctx.plane0_fixup_cache.push_back(
+      {dmabuf_stat.st_dev, dmabuf_stat.st_ino, true, 256, 0, 0});
+  ctx.plane0_fixup_cache.push_back(
+      {other_stat.st_dev, other_stat.st_ino, true, 512, 0, 0});
+
+  const struct sl_linux_dmabuf_host_buffer_create_info create_info = {
+      .width = 64,
+      .height = 64,
+      .stride = 256,
+      .format = DRM_FORMAT_XRGB8888,
+      .modifier = DRM_FORMAT_MOD_LINEAR,
+      .dmabuf_fd = dmabuf_fd,
+      .is_virtgpu_buffer = false,
+  };
+  struct sl_host_buffer* host_buffer = sl_linux_dmabuf_create_host_buffer(
+      &ctx, client->client, nullptr, 0, &create_info);
+  EXPECT_EQ(ctx.plane0_fixup_cache.size(), 2u);
+
+  // Only the entry of the destroyed buffer's dmabuf goes.
+  wl_resource_destroy(host_buffer->resource);
+  ASSERT_EQ(ctx.plane0_fixup_cache.size(), 1u);
+  EXPECT_EQ(ctx.plane0_fixup_cache[0].ino, other_stat.st_ino);
+  close(other_fd);
+}
+
 }  // namespace vm_tools::sommelier
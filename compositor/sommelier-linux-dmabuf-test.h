@@ -13,6 +13,10 @@ struct linux_dmabuf_test_fixture {
   struct zwp_linux_dmabuf_v1* proxy;
   void* user_data;
   wl_callback* bind_callback_proxy;
+  // The host end of the feedback object created last.
+  struct zwp_linux_dmabuf_feedback_v1* feedback_proxy;
+  // The host end of sommelier's own default feedback.
+  struct zwp_linux_dmabuf_feedback_v1* host_feedback_proxy;
 };
 
 struct linux_dmabuf_test_fixture get_linux_dmabuf_test_fixture();
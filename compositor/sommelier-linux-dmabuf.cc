@@ -2,12 +2,16 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <algorithm>
+#include <fcntl.h>
 #include <gbm.h>
 #include <libdrm/drm_fourcc.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 #include <wayland-server-protocol.h>
 #include <xf86drm.h>
@@ -58,13 +62,34 @@ struct sl_linux_dmabuf_packed_format {
   uint64_t modifier;
 };
 
+// A mapping of a host format table, shared by every feedback object of the
+// same host global the host sent the same table to.
+struct sl_linux_dmabuf_format_table {
+  struct sl_context* ctx;
+  struct sl_linux_dmabuf* linux_dmabuf;
+  uint32_t map_size;
+  const struct sl_linux_dmabuf_packed_format* entries;
+  // Whether each entry passes the format filtering of tranches.
+  std::vector<bool> supported;
+  int refcount;
+};
+
 struct sl_host_linux_dmabuf_feedback {
   sl_host_linux_dmabuf* host_linux_dmabuf;
   struct wl_resource* resource;
   struct zwp_linux_dmabuf_feedback_v1* proxy;
-
-  uint32_t map_size;
-  struct sl_linux_dmabuf_packed_format* mapped_format_table;
+  // The surface of surface feedback.
+  WeakResourcePtr<sl_host_surface> surface;
+
+  struct sl_linux_dmabuf_format_table* format_table;
+
+  // The tranche being received. It's forwarded whole once done, unless
+  // format filtering left nothing in it.
+  struct wl_array tranche_device;
+  std::vector<uint16_t> tranche_indices;
+  uint32_t tranche_flags;
+  // What the scanout tranches received so far hold.
+  std::vector<std::pair<uint32_t, uint64_t>> scanout_formats;
 };
 
 struct sl_host_linux_buffer_params {
@@ -79,6 +104,7 @@ struct sl_host_linux_buffer_params {
   bool is_virtgpu_buffer;
   struct {
     uint32_t stride;
+    uint64_t modifier;
     int dmabuf_fd;
   } plane0;
 };
@@ -94,6 +120,13 @@ struct sl_host_buffer* sl_linux_dmabuf_create_host_buffer(
   struct sl_host_buffer* host_buffer =
       sl_create_host_buffer(ctx, client, buffer_id, buffer_proxy,
                             create_info->width, create_info->height, true);
+  host_buffer->drm_format = create_info->format;
+  host_buffer->modifier = create_info->modifier;
+  struct stat buf;
+  if (create_info->dmabuf_fd >= 0 && !fstat(create_info->dmabuf_fd, &buf)) {
+    host_buffer->dmabuf_dev = buf.st_dev;
+    host_buffer->dmabuf_ino = buf.st_ino;
+  }
 
   if (create_info->is_virtgpu_buffer) {
     host_buffer->sync_point = sl_sync_point_create(create_info->dmabuf_fd);
@@ -115,8 +148,11 @@ struct sl_host_buffer* sl_linux_dmabuf_create_host_buffer(
     // is currently only defined for single plane format buffers.
 
     if (sl_shm_format_num_planes(host_buffer->shm_format) == 1) {
+      // The mapping takes its own reference to the dma-buf, since it keeps
+      // the BO imported until its last reference goes away, which can be
+      // after the sync point has closed the original fd.
       host_buffer->shm_mmap = sl_drm_prime_mmap_create(
-          ctx->gbm, create_info->dmabuf_fd,
+          ctx->gbm, fcntl(create_info->dmabuf_fd, F_DUPFD_CLOEXEC, 0),
           sl_shm_format_bpp(host_buffer->shm_format),
           sl_shm_format_num_planes(host_buffer->shm_format),
           create_info->stride, create_info->width, create_info->height,
@@ -142,7 +178,11 @@ struct sl_host_buffer* sl_linux_dmabuf_create_host_buffer(
   return host_buffer;
 }
 
-bool sl_linux_dmabuf_fixup_plane0_params(gbm_device* gbm,
+// Distinct dmabufs whose fixups are kept, enough for the swapchains of a
+// few surfaces.
+#define PLANE0_FIXUP_CACHE_SIZE 32
+
+bool sl_linux_dmabuf_fixup_plane0_params(struct sl_context* ctx,
                                          int32_t fd,
                                          uint32_t* out_stride,
                                          uint32_t* out_modifier_hi,
@@ -152,44 +192,90 @@ bool sl_linux_dmabuf_fixup_plane0_params(gbm_device* gbm,
    * and may have different stride for host buffer and shadow/guest buffer.
    * For context, see: crbug.com/892242 and b/230510320.
    */
-  int drm_fd = gbm_device_get_fd(gbm);
+  int drm_fd = gbm_device_get_fd(ctx->gbm);
   struct drm_prime_handle prime_handle;
+  struct sl_plane0_fixup fixup = {};
+  struct stat buf;
   int ret;
-  bool is_virtgpu_buffer = false;
-
-  // First imports the prime fd to a gem handle. This will fail if this
-  // function was not passed a prime handle that can be imported by the drm
-  // device given to sommelier.
-  memset(&prime_handle, 0, sizeof(prime_handle));
-  prime_handle.fd = fd;
-  ret = drmIoctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
-  if (!ret) {
-    struct drm_virtgpu_resource_info_cros info_arg;
-    struct drm_gem_close gem_close;
-
-    // Then attempts to get resource information. This will fail silently if
-    // the drm device passed to sommelier is not a virtio-gpu device.
-    memset(&info_arg, 0, sizeof(info_arg));
-    info_arg.bo_handle = prime_handle.handle;
-    info_arg.type = VIRTGPU_RESOURCE_INFO_TYPE_EXTENDED;
-    ret = drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO_CROS, &info_arg);
-    // Correct stride if we are able to get proper resource info.
-    if (!ret) {
-      is_virtgpu_buffer = true;
-      if (info_arg.stride) {
-        *out_stride = info_arg.stride;
-        *out_modifier_hi = info_arg.format_modifier >> 32;
-        *out_modifier_lo = info_arg.format_modifier & 0xFFFFFFFF;
+
+  // Clients wrap the same dmabuf in several wl_buffers, or recreate them
+  // before destroying the old ones, so what an import found is kept by
+  // dmabuf until a buffer of it is destroyed.
+  std::vector<struct sl_plane0_fixup>& cache = ctx->plane0_fixup_cache;
+  bool cacheable = !fstat(fd, &buf);
+  bool cached = false;
+  if (cacheable) {
+    for (auto it = cache.begin(); it != cache.end(); ++it) {
+      if (it->dev == buf.st_dev && it->ino == buf.st_ino) {
+        std::rotate(cache.begin(), it, it + 1);
+        fixup = cache.front();
+        cached = true;
+        break;
       }
     }
+  }
+
+  if (!cached) {
+    // First imports the prime fd to a gem handle. This will fail if this
+    // function was not passed a prime handle that can be imported by the drm
+    // device given to sommelier.
+    memset(&prime_handle, 0, sizeof(prime_handle));
+    prime_handle.fd = fd;
+    ret = drmIoctl(drm_fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
+    bool imported = !ret;
+    if (imported) {
+      struct drm_virtgpu_resource_info_cros info_arg;
+      struct drm_gem_close gem_close;
+
+      // Then attempts to get resource information. This will fail silently
+      // if the drm device passed to sommelier is not a virtio-gpu device.
+      memset(&info_arg, 0, sizeof(info_arg));
+      info_arg.bo_handle = prime_handle.handle;
+      info_arg.type = VIRTGPU_RESOURCE_INFO_TYPE_EXTENDED;
+      ret = drmIoctl(drm_fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO_CROS, &info_arg);
+      if (!ret) {
+        fixup.is_virtgpu_buffer = true;
+        fixup.stride = info_arg.stride;
+        fixup.modifier_hi = info_arg.format_modifier >> 32;
+        fixup.modifier_lo = info_arg.format_modifier & 0xFFFFFFFF;
+      }
+
+      // Always close the handle we imported.
+      memset(&gem_close, 0, sizeof(gem_close));
+      gem_close.handle = prime_handle.handle;
+      drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+    }
+
+    // A failed import may be transient, so only dmabufs imported are kept.
+    if (cacheable && imported) {
+      fixup.dev = buf.st_dev;
+      fixup.ino = buf.st_ino;
+      if (cache.size() == PLANE0_FIXUP_CACHE_SIZE)
+        cache.pop_back();
+      cache.insert(cache.begin(), fixup);
+    }
+  }
 
-    // Always close the handle we imported.
-    memset(&gem_close, 0, sizeof(gem_close));
-    gem_close.handle = prime_handle.handle;
-    drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+  // Correct stride if we are able to get proper resource info.
+  if (fixup.is_virtgpu_buffer && fixup.stride) {
+    *out_stride = fixup.stride;
+    *out_modifier_hi = fixup.modifier_hi;
+    *out_modifier_lo = fixup.modifier_lo;
   }
 
-  return is_virtgpu_buffer;
+  return fixup.is_virtgpu_buffer;
+}
+
+void sl_linux_dmabuf_drop_plane0_fixup(struct sl_host_buffer* host_buffer) {
+  std::vector<struct sl_plane0_fixup>& cache =
+      host_buffer->ctx->plane0_fixup_cache;
+
+  cache.erase(std::remove_if(cache.begin(), cache.end(),
+                             [host_buffer](const sl_plane0_fixup& fixup) {
+                               return fixup.dev == host_buffer->dmabuf_dev &&
+                                      fixup.ino == host_buffer->dmabuf_ino;
+                             }),
+              cache.end());
 }
 
 /*
@@ -200,9 +286,69 @@ static void sl_linux_dmabuf_feedback_done(
   struct sl_host_linux_dmabuf_feedback* host_feedback =
       static_cast<struct sl_host_linux_dmabuf_feedback*>(data);
 
+  if (host_feedback->surface) {
+    host_feedback->surface->scanout_formats.swap(
+        host_feedback->scanout_formats);
+  }
+  host_feedback->scanout_formats.clear();
   zwp_linux_dmabuf_feedback_v1_send_done(host_feedback->resource);
 }
 
+static void sl_linux_dmabuf_format_table_unref(
+    struct sl_linux_dmabuf_format_table* table) {
+  if (--table->refcount)
+    return;
+
+  std::vector<sl_linux_dmabuf_format_table*>& tables =
+      table->ctx->linux_dmabuf_format_tables;
+  tables.erase(std::find(tables.begin(), tables.end(), table));
+  int ret = munmap(const_cast<sl_linux_dmabuf_packed_format*>(table->entries),
+                   table->map_size);
+  assert(!ret);
+  UNUSED(ret);
+  delete table;
+}
+
+// Returns a reference to the mapping of the table in |fd|, sent by feedback
+// of |linux_dmabuf|. A table with the same entries sent before is shared,
+// whichever file it came in, and the one in |fd| is only mapped to compare
+// it. Returns nullptr if it can't be mapped.
+static struct sl_linux_dmabuf_format_table* sl_linux_dmabuf_format_table_get(
+    struct sl_linux_dmabuf* linux_dmabuf, int fd, uint32_t size) {
+  struct sl_context* ctx = linux_dmabuf->ctx;
+
+  void* map_addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map_addr == MAP_FAILED)
+    return nullptr;
+
+  for (auto table : ctx->linux_dmabuf_format_tables) {
+    if (table->linux_dmabuf == linux_dmabuf && table->map_size == size &&
+        !memcmp(table->entries, map_addr, size)) {
+      munmap(map_addr, size);
+      table->refcount++;
+      return table;
+    }
+  }
+
+  struct sl_linux_dmabuf_format_table* table =
+      new sl_linux_dmabuf_format_table();
+  table->ctx = ctx;
+  table->linux_dmabuf = linux_dmabuf;
+  table->map_size = size;
+  table->entries = static_cast<sl_linux_dmabuf_packed_format*>(map_addr);
+  table->refcount = 1;
+
+  // TODO(b/309012293): format filtering added to match wl_drm behavior while
+  // sommelier+virgl depend on a known list of supported formats.
+  size_t count = size / sizeof(sl_linux_dmabuf_packed_format);
+  table->supported.resize(count);
+  for (size_t i = 0; i < count; ++i)
+    table->supported[i] = sl_drm_format_is_supported(table->entries[i].format);
+
+  ctx->linux_dmabuf_format_tables.push_back(table);
+  return table;
+}
+
 static void sl_linux_dmabuf_feedback_format_table(
     void* data,
     struct zwp_linux_dmabuf_feedback_v1* feedback,
@@ -210,16 +356,19 @@ static void sl_linux_dmabuf_feedback_format_table(
     uint32_t size) {
   struct sl_host_linux_dmabuf_feedback* host_feedback =
       static_cast<struct sl_host_linux_dmabuf_feedback*>(data);
-  struct sl_context* ctx = host_feedback->host_linux_dmabuf->linux_dmabuf->ctx;
+  struct sl_linux_dmabuf* linux_dmabuf =
+      host_feedback->host_linux_dmabuf->linux_dmabuf;
+  struct sl_context* ctx = linux_dmabuf->ctx;
 
-  void* map_addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (map_addr == MAP_FAILED) {
+  struct sl_linux_dmabuf_format_table* table =
+      sl_linux_dmabuf_format_table_get(linux_dmabuf, fd, size);
+  if (!table) {
     wl_client_post_implementation_error(
         ctx->client, "failed to map format table with error %d", errno);
   } else {
-    host_feedback->map_size = size;
-    host_feedback->mapped_format_table =
-        static_cast<struct sl_linux_dmabuf_packed_format*>(map_addr);
+    if (host_feedback->format_table)
+      sl_linux_dmabuf_format_table_unref(host_feedback->format_table);
+    host_feedback->format_table = table;
 
     zwp_linux_dmabuf_feedback_v1_send_format_table(host_feedback->resource, fd,
                                                    size);
@@ -288,8 +437,38 @@ static void sl_linux_dmabuf_feedback_tranche_done(
     void* data, struct zwp_linux_dmabuf_feedback_v1* feedback) {
   struct sl_host_linux_dmabuf_feedback* host_feedback =
       static_cast<struct sl_host_linux_dmabuf_feedback*>(data);
+  const struct sl_linux_dmabuf_format_table* table =
+      host_feedback->format_table;
+  std::vector<uint16_t>& indices = host_feedback->tranche_indices;
+
+  if (!indices.empty()) {
+    // A scanout tranche's formats are what the host can put straight on a
+    // plane, and so what fullscreen surfaces should be using.
+    if (table && (host_feedback->tranche_flags &
+                  ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT)) {
+      for (uint16_t index : indices) {
+        host_feedback->scanout_formats.emplace_back(
+            table->entries[index].format, table->entries[index].modifier);
+      }
+    }
 
-  zwp_linux_dmabuf_feedback_v1_send_tranche_done(host_feedback->resource);
+    struct wl_array formats = {};
+    formats.size = formats.alloc = indices.size() * sizeof(uint16_t);
+    formats.data = indices.data();
+    if (host_feedback->tranche_device.size) {
+      zwp_linux_dmabuf_feedback_v1_send_tranche_target_device(
+          host_feedback->resource, &host_feedback->tranche_device);
+    }
+    zwp_linux_dmabuf_feedback_v1_send_tranche_formats(host_feedback->resource,
+                                                      &formats);
+    zwp_linux_dmabuf_feedback_v1_send_tranche_flags(
+        host_feedback->resource, host_feedback->tranche_flags);
+    zwp_linux_dmabuf_feedback_v1_send_tranche_done(host_feedback->resource);
+  }
+
+  indices.clear();
+  host_feedback->tranche_device.size = 0;
+  host_feedback->tranche_flags = 0;
 }
 
 static void sl_linux_dmabuf_feedback_tranche_target_device(
@@ -300,14 +479,16 @@ static void sl_linux_dmabuf_feedback_tranche_target_device(
       static_cast<struct sl_host_linux_dmabuf_feedback*>(data);
   struct sl_context* ctx = host_feedback->host_linux_dmabuf->linux_dmabuf->ctx;
 
+  // Guest buffers reach the host's scanout device through virtgpu blobs too,
+  // so every target device is the gbm device here.
   wl_array local_device;
   device = fixup_drm_device(ctx, device, &local_device);
   if (!device) {
     return;
   }
 
-  zwp_linux_dmabuf_feedback_v1_send_tranche_target_device(
-      host_feedback->resource, device);
+  if (wl_array_copy(&host_feedback->tranche_device, device) < 0)
+    wl_client_post_no_memory(ctx->client);
 
   if (device == &local_device) {
     wl_array_release(&local_device);
@@ -320,32 +501,16 @@ static void sl_linux_dmabuf_feedback_tranche_formats(
     struct wl_array* indices) {
   struct sl_host_linux_dmabuf_feedback* host_feedback =
       static_cast<struct sl_host_linux_dmabuf_feedback*>(data);
-  struct sl_context* ctx = host_feedback->host_linux_dmabuf->linux_dmabuf->ctx;
+  const struct sl_linux_dmabuf_format_table* table =
+      host_feedback->format_table;
 
-  wl_array filtered;
-  wl_array_init(&filtered);
-
-  // TODO(b/309012293): format filtering added to match wl_drm behavior while
-  // sommelier+virgl depend on a known list of supported formats.
   uint16_t* index;
   sl_array_for_each(index, indices) {
-    const sl_linux_dmabuf_packed_format* packed =
-        &host_feedback->mapped_format_table[*index];
-    if (sl_drm_format_is_supported(packed->format)) {
-      uint16_t* dst =
-          static_cast<uint16_t*>(wl_array_add(&filtered, sizeof(uint16_t)));
-      if (!dst) {
-        wl_array_release(&filtered);
-        wl_client_post_no_memory(ctx->client);
-        return;
-      }
-      *dst = *index;
+    if (table && *index < table->supported.size() &&
+        table->supported[*index]) {
+      host_feedback->tranche_indices.push_back(*index);
     }
   }
-
-  zwp_linux_dmabuf_feedback_v1_send_tranche_formats(host_feedback->resource,
-                                                    &filtered);
-  wl_array_release(&filtered);
 }
 
 static void sl_linux_dmabuf_feedback_tranche_flags(
@@ -353,8 +518,7 @@ static void sl_linux_dmabuf_feedback_tranche_flags(
   struct sl_host_linux_dmabuf_feedback* host_feedback =
       static_cast<struct sl_host_linux_dmabuf_feedback*>(data);
 
-  zwp_linux_dmabuf_feedback_v1_send_tranche_flags(host_feedback->resource,
-                                                  flags);
+  host_feedback->tranche_flags = flags;
 }
 
 static struct zwp_linux_dmabuf_feedback_v1_listener
@@ -377,13 +541,10 @@ static void sl_linux_dmabuf_feedback_resource_destroy(
       static_cast<struct sl_host_linux_dmabuf_feedback*>(
           wl_resource_get_user_data(resource));
 
-  if (host_feedback->mapped_format_table) {
-    int ret =
-        munmap(host_feedback->mapped_format_table, host_feedback->map_size);
-    assert(!ret);
-    UNUSED(ret);
-  }
+  if (host_feedback->format_table)
+    sl_linux_dmabuf_format_table_unref(host_feedback->format_table);
 
+  wl_array_release(&host_feedback->tranche_device);
   zwp_linux_dmabuf_feedback_v1_destroy(host_feedback->proxy);
   delete host_feedback;
 }
@@ -416,6 +577,7 @@ static void sl_linux_buffer_params_created(
       .height = host_params->height,
       .stride = host_params->plane0.stride,
       .format = host_params->format,
+      .modifier = host_params->plane0.modifier,
       .dmabuf_fd = host_params->plane0.dmabuf_fd,
       .is_virtgpu_buffer = host_params->is_virtgpu_buffer,
   };
@@ -490,7 +652,7 @@ static void sl_linux_buffer_params_add(struct wl_client* client,
      * 3d resource (virgl), or silently leave unmodified.
      */
     bool is_virtgpu_buffer = sl_linux_dmabuf_fixup_plane0_params(
-        ctx->gbm, fd, &stride, &modifier_hi, &modifier_lo);
+        ctx, fd, &stride, &modifier_hi, &modifier_lo);
 
     if (stride == 0) {
       wl_resource_post_error(resource,
@@ -501,6 +663,8 @@ static void sl_linux_buffer_params_add(struct wl_client* client,
     }
 
     host_params->plane0.stride = stride;
+    host_params->plane0.modifier =
+        (static_cast<uint64_t>(modifier_hi) << 32) | modifier_lo;
     host_params->plane0.dmabuf_fd = dup(fd);
     host_params->is_virtgpu_buffer = is_virtgpu_buffer;
   }
@@ -563,6 +727,7 @@ static void sl_linux_buffer_params_create_immed(struct wl_client* client,
       .height = static_cast<uint32_t>(height),
       .stride = host_params->plane0.stride,
       .format = format,
+      .modifier = host_params->plane0.modifier,
       .dmabuf_fd = host_params->plane0.dmabuf_fd,
       .is_virtgpu_buffer = host_params->is_virtgpu_buffer,
   };
@@ -639,6 +804,7 @@ static struct sl_host_linux_dmabuf_feedback* sl_create_host_feedback(
       new sl_host_linux_dmabuf_feedback{};
   host_feedback->host_linux_dmabuf = host_linux_dmabuf;
   host_feedback->proxy = proxy;
+  wl_array_init(&host_feedback->tranche_device);
 
   zwp_linux_dmabuf_feedback_v1_add_listener(proxy,
                                             &sl_linux_dmabuf_feedback_listener,
@@ -652,6 +818,9 @@ static struct sl_host_linux_dmabuf_feedback* sl_create_host_feedback(
                                  static_cast<void*>(host_feedback),
                                  sl_linux_dmabuf_feedback_resource_destroy);
 
+#if WITH_TESTS
+  linux_dmabuf_fixture.feedback_proxy = proxy;
+#endif
   return host_feedback;
 }
 
@@ -680,7 +849,9 @@ static void sl_linux_dmabuf_get_surface_feedback(struct wl_client* client,
       zwp_linux_dmabuf_v1_get_surface_feedback(host_linux_dmabuf->proxy,
                                                host_surface->proxy);
 
-  sl_create_host_feedback(client, id, host_linux_dmabuf, proxy);
+  struct sl_host_linux_dmabuf_feedback* host_feedback =
+      sl_create_host_feedback(client, id, host_linux_dmabuf, proxy);
+  host_feedback->surface = host_surface;
 }
 
 static struct zwp_linux_dmabuf_v1_interface sl_linux_dmabuf_implementation {
@@ -856,3 +1027,153 @@ struct sl_global* sl_linux_dmabuf_global_create(
       ctx, &zwp_linux_dmabuf_v1_interface, linux_dmabuf->version,
       static_cast<void*>(linux_dmabuf), sl_bind_host_linux_dmabuf);
 }
+
+// Sommelier's own view of the host's default feedback, for what its output
+// buffers should be allocated as.
+struct sl_linux_dmabuf_host_feedback {
+  struct sl_linux_dmabuf* linux_dmabuf;
+  struct zwp_linux_dmabuf_feedback_v1* proxy;
+  struct sl_linux_dmabuf_format_table* format_table;
+
+  // The tranche being received.
+  std::vector<uint16_t> tranche_indices;
+  uint32_t tranche_flags;
+
+  // Formats the host can scan out linear buffers of, once the first done
+  // event came, and for the feedback still being received.
+  bool received;
+  std::vector<uint32_t> scanout_formats;
+  std::vector<uint32_t> pending_scanout_formats;
+};
+
+static void sl_linux_dmabuf_host_feedback_done(
+    void* data, struct zwp_linux_dmabuf_feedback_v1* feedback) {
+  struct sl_linux_dmabuf_host_feedback* host_feedback =
+      static_cast<struct sl_linux_dmabuf_host_feedback*>(data);
+
+  host_feedback->scanout_formats.swap(host_feedback->pending_scanout_formats);
+  host_feedback->pending_scanout_formats.clear();
+  host_feedback->received = true;
+}
+
+static void sl_linux_dmabuf_host_feedback_format_table(
+    void* data,
+    struct zwp_linux_dmabuf_feedback_v1* feedback,
+    int32_t fd,
+    uint32_t size) {
+  struct sl_linux_dmabuf_host_feedback* host_feedback =
+      static_cast<struct sl_linux_dmabuf_host_feedback*>(data);
+
+  struct sl_linux_dmabuf_format_table* table =
+      sl_linux_dmabuf_format_table_get(host_feedback->linux_dmabuf, fd, size);
+  if (table) {
+    if (host_feedback->format_table)
+      sl_linux_dmabuf_format_table_unref(host_feedback->format_table);
+    host_feedback->format_table = table;
+  }
+  close(fd);
+}
+
+static void sl_linux_dmabuf_host_feedback_tranche_done(
+    void* data, struct zwp_linux_dmabuf_feedback_v1* feedback) {
+  struct sl_linux_dmabuf_host_feedback* host_feedback =
+      static_cast<struct sl_linux_dmabuf_host_feedback*>(data);
+  const struct sl_linux_dmabuf_format_table* table =
+      host_feedback->format_table;
+  std::vector<uint32_t>& formats = host_feedback->pending_scanout_formats;
+
+  if (table && (host_feedback->tranche_flags &
+                ZWP_LINUX_DMABUF_FEEDBACK_V1_TRANCHE_FLAGS_SCANOUT)) {
+    for (uint16_t index : host_feedback->tranche_indices) {
+      if (index >= table->supported.size() ||
+          table->entries[index].modifier != DRM_FORMAT_MOD_LINEAR) {
+        continue;
+      }
+      uint32_t format = table->entries[index].format;
+      if (std::find(formats.begin(), formats.end(), format) == formats.end())
+        formats.push_back(format);
+    }
+  }
+  host_feedback->tranche_indices.clear();
+  host_feedback->tranche_flags = 0;
+}
+
+static void sl_linux_dmabuf_host_feedback_tranche_formats(
+    void* data,
+    struct zwp_linux_dmabuf_feedback_v1* feedback,
+    struct wl_array* indices) {
+  struct sl_linux_dmabuf_host_feedback* host_feedback =
+      static_cast<struct sl_linux_dmabuf_host_feedback*>(data);
+
+  uint16_t* index;
+  sl_array_for_each(index, indices) {
+    host_feedback->tranche_indices.push_back(*index);
+  }
+}
+
+static void sl_linux_dmabuf_host_feedback_tranche_flags(
+    void* data, struct zwp_linux_dmabuf_feedback_v1* feedback, uint32_t flags) {
+  struct sl_linux_dmabuf_host_feedback* host_feedback =
+      static_cast<struct sl_linux_dmabuf_host_feedback*>(data);
+
+  host_feedback->tranche_flags = flags;
+}
+
+static void sl_linux_dmabuf_host_feedback_device(
+    void* data,
+    struct zwp_linux_dmabuf_feedback_v1* feedback,
+    struct wl_array* device) {}
+
+static const struct zwp_linux_dmabuf_feedback_v1_listener
+    sl_linux_dmabuf_host_feedback_listener = {
+        .done = sl_linux_dmabuf_host_feedback_done,
+        .format_table = sl_linux_dmabuf_host_feedback_format_table,
+        .main_device = sl_linux_dmabuf_host_feedback_device,
+        .tranche_done = sl_linux_dmabuf_host_feedback_tranche_done,
+        .tranche_target_device = sl_linux_dmabuf_host_feedback_device,
+        .tranche_formats = sl_linux_dmabuf_host_feedback_tranche_formats,
+        .tranche_flags = sl_linux_dmabuf_host_feedback_tranche_flags,
+};
+
+void sl_linux_dmabuf_watch_host_feedback(struct sl_linux_dmabuf* linux_dmabuf) {
+  struct sl_linux_dmabuf_host_feedback* host_feedback =
+      new sl_linux_dmabuf_host_feedback();
+
+  host_feedback->linux_dmabuf = linux_dmabuf;
+  host_feedback->proxy =
+      zwp_linux_dmabuf_v1_get_default_feedback(linux_dmabuf->internal);
+  zwp_linux_dmabuf_feedback_v1_add_listener(
+      host_feedback->proxy, &sl_linux_dmabuf_host_feedback_listener,
+      host_feedback);
+  linux_dmabuf->host_feedback = host_feedback;
+#if WITH_TESTS
+  linux_dmabuf_fixture.host_feedback_proxy = host_feedback->proxy;
+#endif
+}
+
+void sl_linux_dmabuf_unwatch_host_feedback(
+    struct sl_linux_dmabuf* linux_dmabuf) {
+  struct sl_linux_dmabuf_host_feedback* host_feedback =
+      linux_dmabuf->host_feedback;
+
+  if (!host_feedback)
+    return;
+  if (host_feedback->format_table)
+    sl_linux_dmabuf_format_table_unref(host_feedback->format_table);
+  zwp_linux_dmabuf_feedback_v1_destroy(host_feedback->proxy);
+  delete host_feedback;
+  linux_dmabuf->host_feedback = nullptr;
+}
+
+bool sl_linux_dmabuf_host_scanout_linear(struct sl_context* ctx,
+                                         uint32_t drm_format) {
+  const struct sl_linux_dmabuf_host_feedback* host_feedback =
+      ctx->linux_dmabuf ? ctx->linux_dmabuf->host_feedback : nullptr;
+
+  if (!host_feedback || !host_feedback->received)
+    return true;
+
+  const std::vector<uint32_t>& formats = host_feedback->scanout_formats;
+  return std::find(formats.begin(), formats.end(), drm_format) !=
+         formats.end();
+}
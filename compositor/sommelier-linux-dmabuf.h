@@ -11,18 +11,25 @@
 
 #define SL_LINUX_DMABUF_MAX_VERSION 4u
 
-struct gbm_device;
-bool sl_linux_dmabuf_fixup_plane0_params(gbm_device* gbm,
+// Corrects the stride and modifier of plane 0 to the host's for virtgpu
+// buffers, and returns whether |fd| is one.
+bool sl_linux_dmabuf_fixup_plane0_params(struct sl_context* ctx,
                                          int32_t fd,
                                          uint32_t* out_stride,
                                          uint32_t* out_modifier_hi,
                                          uint32_t* out_modifier_lo);
 
+// Forgets what sl_linux_dmabuf_fixup_plane0_params() found out about the
+// dmabuf of |host_buffer|, which is being destroyed.
+void sl_linux_dmabuf_drop_plane0_fixup(
+    struct sl_host_buffer* host_buffer);  // NOLINT(build/class)
+
 struct sl_linux_dmabuf_host_buffer_create_info {
   uint32_t width;
   uint32_t height;
   uint32_t stride;
   uint32_t format;
+  uint64_t modifier;
   int dmabuf_fd;
   bool is_virtgpu_buffer;
 };
@@ -35,4 +42,17 @@ struct sl_host_buffer* sl_linux_dmabuf_create_host_buffer(
     uint32_t buffer_id,
     const struct sl_linux_dmabuf_host_buffer_create_info* info);
 
+// Follows the host's default feedback on sommelier's own binding, which
+// needs version 4.
+void sl_linux_dmabuf_watch_host_feedback(
+    struct sl_linux_dmabuf* linux_dmabuf);  // NOLINT(build/class)
+void sl_linux_dmabuf_unwatch_host_feedback(
+    struct sl_linux_dmabuf* linux_dmabuf);  // NOLINT(build/class)
+
+// Returns whether the host lists linear |drm_format| buffers for direct
+// scanout, or hasn't sent feedback to say otherwise.
+bool sl_linux_dmabuf_host_scanout_linear(
+    struct sl_context* ctx,  // NOLINT(build/class)
+    uint32_t drm_format);
+
 #endif  // VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_LINUX_DMABUF_H_
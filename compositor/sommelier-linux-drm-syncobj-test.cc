@@ -0,0 +1,72 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "../sommelier.h"                 // NOLINT(build/include_directory)
+#include "sommelier-linux-drm-syncobj.h"  // NOLINT(build/include_directory)
+
+#include "linux-drm-syncobj-v1-server-protocol.h"  // NOLINT(build/include_directory)
+
+#include <gtest/gtest.h>
+
+namespace vm_tools {
+namespace sommelier {
+
+class DrmSyncobjPointsTest : public ::testing::Test {
+ protected:
+  // Only ever compared, never dereferenced.
+  struct sl_drm_syncobj_timeline* timeline =
+      reinterpret_cast<struct sl_drm_syncobj_timeline*>(0x1000);
+  struct sl_drm_syncobj_timeline* other_timeline =
+      reinterpret_cast<struct sl_drm_syncobj_timeline*>(0x2000);
+  struct sl_host_buffer buffer = {};
+
+  void SetUp() override { buffer.is_drm = true; }
+};
+
+TEST_F(DrmSyncobjPointsTest, AcceptsPointsAroundABuffer) {
+  EXPECT_EQ(sl_drm_syncobj_check_points(&buffer, {timeline, 1},
+                                        {timeline, 2}),
+            0u);
+  // Points on different timelines aren't ordered.
+  EXPECT_EQ(sl_drm_syncobj_check_points(&buffer, {timeline, 5},
+                                        {other_timeline, 1}),
+            0u);
+}
+
+TEST_F(DrmSyncobjPointsTest, AcceptsNoPointsWithoutABuffer) {
+  EXPECT_EQ(sl_drm_syncobj_check_points(nullptr, {}, {}), 0u);
+}
+
+TEST_F(DrmSyncobjPointsTest, RejectsPointsWithoutABuffer) {
+  EXPECT_EQ(sl_drm_syncobj_check_points(nullptr, {timeline, 1}, {}),
+            WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_BUFFER);
+  EXPECT_EQ(sl_drm_syncobj_check_points(nullptr, {}, {timeline, 1}),
+            WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_BUFFER);
+}
+
+TEST_F(DrmSyncobjPointsTest, RejectsABufferMissingAPoint) {
+  EXPECT_EQ(sl_drm_syncobj_check_points(&buffer, {}, {timeline, 1}),
+            WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_ACQUIRE_POINT);
+  EXPECT_EQ(sl_drm_syncobj_check_points(&buffer, {timeline, 1}, {}),
+            WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_RELEASE_POINT);
+}
+
+TEST_F(DrmSyncobjPointsTest, RejectsShmBuffers) {
+  buffer.is_drm = false;
+  EXPECT_EQ(sl_drm_syncobj_check_points(&buffer, {timeline, 1},
+                                        {timeline, 2}),
+            WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_UNSUPPORTED_BUFFER);
+}
+
+TEST_F(DrmSyncobjPointsTest, RejectsReleaseNotAfterAcquire) {
+  EXPECT_EQ(sl_drm_syncobj_check_points(&buffer, {timeline, 2},
+                                        {timeline, 2}),
+            WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_CONFLICTING_POINTS);
+  EXPECT_EQ(sl_drm_syncobj_check_points(&buffer, {timeline, 3},
+                                        {timeline, 2}),
+            WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_CONFLICTING_POINTS);
+}
+
+}  // namespace sommelier
+}  // namespace vm_tools
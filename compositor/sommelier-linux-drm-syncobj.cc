@@ -0,0 +1,537 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-linux-drm-syncobj.h"  // NOLINT(build/include_directory)
+
+#include <gbm.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <wayland-server-core.h>
+#include <xf86drm.h>
+
+#include <memory>
+
+#include "../sommelier.h"          // NOLINT(build/include_directory)
+#include "../sommelier-global.h"   // NOLINT(build/include_directory)
+#include "../sommelier-logging.h"  // NOLINT(build/include_directory)
+#include "../sommelier-tracing.h"  // NOLINT(build/include_directory)
+#include "../sommelier-util.h"     // NOLINT(build/include_directory)
+#include "sommelier-dmabuf-sync.h"  // NOLINT(build/include_directory)
+
+#include "linux-drm-syncobj-v1-server-protocol.h"  // NOLINT(build/include_directory)
+#include "linux-explicit-synchronization-unstable-v1-client-protocol.h"  // NOLINT(build/include_directory)
+
+// How long a commit copying its buffer is held for its acquire point.
+#define ACQUIRE_WAIT_TIMEOUT_MS 1000
+
+struct sl_drm_syncobj_timeline {
+  struct sl_context* ctx;
+  struct wl_resource* resource;
+  uint32_t handle;
+  // Held by the resource and by every point on the timeline not yet
+  // signaled.
+  int refcount;
+};
+
+struct sl_drm_syncobj_surface {
+  struct sl_context* ctx;
+  struct wl_resource* resource;
+  struct sl_host_surface* host_surface;
+  struct wl_listener surface_destroy_listener;
+
+  // Pending state, applied on the next commit.
+  struct sl_drm_syncobj_point acquire;
+  struct sl_drm_syncobj_point release;
+  struct sl_host_buffer* buffer;
+  struct wl_listener buffer_destroy_listener;
+
+  // Turns readable once the acquire point of the commit held back signals,
+  // or -1 if none is. See sl_drm_syncobj_surface_hold_commit().
+  int held_fd = -1;
+  std::unique_ptr<struct wl_event_source> held_fd_event_source;
+  std::unique_ptr<struct wl_event_source> held_timer_event_source;
+};
+
+static int sl_drm_syncobj_fd(struct sl_context* ctx) {
+  return gbm_device_get_fd(ctx->gbm);
+}
+
+static struct sl_drm_syncobj_timeline* sl_drm_syncobj_timeline_ref(
+    struct sl_drm_syncobj_timeline* timeline) {
+  timeline->refcount++;
+  return timeline;
+}
+
+static void sl_drm_syncobj_timeline_unref(
+    struct sl_drm_syncobj_timeline* timeline) {
+  if (--timeline->refcount)
+    return;
+  drmSyncobjDestroy(sl_drm_syncobj_fd(timeline->ctx), timeline->handle);
+  delete timeline;
+}
+
+static void sl_drm_syncobj_point_reset(struct sl_drm_syncobj_point* point) {
+  if (point->timeline)
+    sl_drm_syncobj_timeline_unref(point->timeline);
+  point->timeline = nullptr;
+  point->point = 0;
+}
+
+// Returns an fd that turns readable once |point| has signaled, or -1 if
+// none can be had. That's the fence behind it if the client has submitted
+// it, which it almost always has, and an eventfd signaled along with the
+// point otherwise.
+static int sl_drm_syncobj_point_wait_fd(
+    struct sl_context* ctx, const struct sl_drm_syncobj_point* point) {
+  int drm_fd = sl_drm_syncobj_fd(ctx);
+  uint32_t handle;
+  int fd = -1;
+
+  // Only a fence the client has submitted can be moved to a binary syncobj.
+  if (!drmSyncobjCreate(drm_fd, 0, &handle)) {
+    if (!drmSyncobjTransfer(drm_fd, handle, 0, point->timeline->handle,
+                            point->point, 0) &&
+        drmSyncobjExportSyncFile(drm_fd, handle, &fd)) {
+      fd = -1;
+    }
+    drmSyncobjDestroy(drm_fd, handle);
+  }
+  if (fd < 0) {
+    TRACE_EVENT("drm", "sl_drm_syncobj_point_wait_fd: eventfd");
+    fd = eventfd(0, EFD_CLOEXEC);
+    if (fd >= 0 && drmSyncobjEventfd(drm_fd, point->timeline->handle,
+                                     point->point, fd, 0)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd < 0) {
+    LOG(WARNING) << "couldn't wait for acquire point " << point->point
+                 << ", presenting without it";
+  }
+  return fd;
+}
+
+static void sl_drm_syncobj_surface_drop_held_commit(
+    struct sl_drm_syncobj_surface* surface) {
+  if (surface->held_fd < 0)
+    return;
+  surface->held_fd_event_source.reset();
+  surface->held_timer_event_source.reset();
+  close(surface->held_fd);
+  surface->held_fd = -1;
+}
+
+static int sl_drm_syncobj_handle_held_commit_event(int fd,
+                                                   uint32_t mask,
+                                                   void* data) {
+  struct sl_drm_syncobj_surface* surface =
+      static_cast<sl_drm_syncobj_surface*>(data);
+
+  TRACE_EVENT("drm", "sl_drm_syncobj_handle_held_commit_event");
+  sl_host_surface_apply_held_commit(surface->host_surface);
+  return 0;
+}
+
+static int sl_drm_syncobj_handle_held_commit_timeout(void* data) {
+  struct sl_drm_syncobj_surface* surface =
+      static_cast<sl_drm_syncobj_surface*>(data);
+
+  // Applying it gives up on the point.
+  LOG(WARNING) << "acquire point wait timeout, copying the buffer anyway";
+  sl_host_surface_apply_held_commit(surface->host_surface);
+  return 0;
+}
+
+static void sl_drm_syncobj_timeline_destroy(struct wl_client* client,
+                                            struct wl_resource* resource) {
+  wl_resource_destroy(resource);
+}
+
+static const struct wp_linux_drm_syncobj_timeline_v1_interface
+    sl_drm_syncobj_timeline_implementation = {
+        sl_drm_syncobj_timeline_destroy,
+};
+
+static void sl_destroy_drm_syncobj_timeline(struct wl_resource* resource) {
+  struct sl_drm_syncobj_timeline* timeline =
+      static_cast<sl_drm_syncobj_timeline*>(
+          wl_resource_get_user_data(resource));
+
+  timeline->resource = nullptr;
+  wl_resource_set_user_data(resource, nullptr);
+  sl_drm_syncobj_timeline_unref(timeline);
+}
+
+static void sl_drm_syncobj_surface_clear_buffer(
+    struct sl_drm_syncobj_surface* surface) {
+  if (surface->buffer)
+    wl_list_remove(&surface->buffer_destroy_listener.link);
+  surface->buffer = nullptr;
+}
+
+static void sl_drm_syncobj_surface_handle_buffer_destroy(
+    struct wl_listener* listener, void* data) {
+  struct sl_drm_syncobj_surface* surface =
+      wl_container_of(listener, surface, buffer_destroy_listener);
+
+  wl_list_remove(&surface->buffer_destroy_listener.link);
+  surface->buffer = nullptr;
+}
+
+static void sl_drm_syncobj_surface_handle_surface_destroy(
+    struct wl_listener* listener, void* data) {
+  struct sl_drm_syncobj_surface* surface =
+      wl_container_of(listener, surface, surface_destroy_listener);
+
+  wl_list_remove(&surface->surface_destroy_listener.link);
+  sl_drm_syncobj_surface_drop_held_commit(surface);
+  surface->host_surface->syncobj_surface = nullptr;
+  surface->host_surface = nullptr;
+}
+
+static void sl_drm_syncobj_surface_destroy(struct wl_client* client,
+                                           struct wl_resource* resource) {
+  wl_resource_destroy(resource);
+}
+
+static void sl_drm_syncobj_surface_replace_point(
+    struct sl_drm_syncobj_surface* surface,
+    struct sl_drm_syncobj_point* point,
+    struct sl_drm_syncobj_timeline* timeline,
+    uint64_t value) {
+  sl_host_surface_apply_held_commit(surface->host_surface);
+  sl_drm_syncobj_point_reset(point);
+  point->timeline = sl_drm_syncobj_timeline_ref(timeline);
+  point->point = value;
+}
+
+static void sl_drm_syncobj_surface_set_point(struct wl_resource* resource,
+                                             struct sl_drm_syncobj_point* point,
+                                             struct wl_resource* timeline,
+                                             uint32_t point_hi,
+                                             uint32_t point_lo) {
+  struct sl_drm_syncobj_surface* surface =
+      static_cast<sl_drm_syncobj_surface*>(wl_resource_get_user_data(resource));
+
+  if (!surface->host_surface) {
+    wl_resource_post_error(resource,
+                           WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_SURFACE,
+                           "the surface was destroyed");
+    return;
+  }
+
+  struct sl_drm_syncobj_timeline* host_timeline =
+      static_cast<sl_drm_syncobj_timeline*>(
+          wl_resource_get_user_data(timeline));
+  uint64_t value = (static_cast<uint64_t>(point_hi) << 32) | point_lo;
+  if (sl_host_surface_holds_requests(surface->host_surface)) {
+    // The client may destroy the timeline before this is handled.
+    std::shared_ptr<sl_drm_syncobj_timeline> held_timeline(
+        sl_drm_syncobj_timeline_ref(host_timeline),
+        sl_drm_syncobj_timeline_unref);
+    sl_host_surface_queue_request(
+        surface->host_surface, resource,
+        [surface, point, held_timeline, value] {
+          sl_drm_syncobj_surface_replace_point(surface, point,
+                                               held_timeline.get(), value);
+        });
+    return;
+  }
+  sl_drm_syncobj_surface_replace_point(surface, point, host_timeline, value);
+}
+
+static void sl_drm_syncobj_surface_set_acquire_point(
+    struct wl_client* client,
+    struct wl_resource* resource,
+    struct wl_resource* timeline,
+    uint32_t point_hi,
+    uint32_t point_lo) {
+  struct sl_drm_syncobj_surface* surface =
+      static_cast<sl_drm_syncobj_surface*>(wl_resource_get_user_data(resource));
+  sl_drm_syncobj_surface_set_point(resource, &surface->acquire, timeline,
+                                   point_hi, point_lo);
+}
+
+static void sl_drm_syncobj_surface_set_release_point(
+    struct wl_client* client,
+    struct wl_resource* resource,
+    struct wl_resource* timeline,
+    uint32_t point_hi,
+    uint32_t point_lo) {
+  struct sl_drm_syncobj_surface* surface =
+      static_cast<sl_drm_syncobj_surface*>(wl_resource_get_user_data(resource));
+  sl_drm_syncobj_surface_set_point(resource, &surface->release, timeline,
+                                   point_hi, point_lo);
+}
+
+static const struct wp_linux_drm_syncobj_surface_v1_interface
+    sl_drm_syncobj_surface_implementation = {
+        sl_drm_syncobj_surface_destroy,
+        sl_drm_syncobj_surface_set_acquire_point,
+        sl_drm_syncobj_surface_set_release_point,
+};
+
+static void sl_destroy_drm_syncobj_surface(struct wl_resource* resource) {
+  struct sl_drm_syncobj_surface* surface =
+      static_cast<sl_drm_syncobj_surface*>(wl_resource_get_user_data(resource));
+
+  if (surface->host_surface) {
+    // Commits held back still take in the points they were made with.
+    sl_host_surface_flush_held_requests(surface->host_surface);
+    wl_list_remove(&surface->surface_destroy_listener.link);
+    surface->host_surface->syncobj_surface = nullptr;
+  }
+  sl_drm_syncobj_surface_clear_buffer(surface);
+  sl_drm_syncobj_point_reset(&surface->acquire);
+  sl_drm_syncobj_point_reset(&surface->release);
+  wl_resource_set_user_data(resource, nullptr);
+  delete surface;
+}
+
+static void sl_drm_syncobj_manager_destroy(struct wl_client* client,
+                                           struct wl_resource* resource) {
+  wl_resource_destroy(resource);
+}
+
+static void sl_drm_syncobj_manager_get_surface(struct wl_client* client,
+                                               struct wl_resource* resource,
+                                               uint32_t id,
+                                               struct wl_resource* surface) {
+  struct sl_context* ctx =
+      static_cast<sl_context*>(wl_resource_get_user_data(resource));
+  struct sl_host_surface* host_surface =
+      static_cast<sl_host_surface*>(wl_resource_get_user_data(surface));
+
+  if (host_surface->syncobj_surface) {
+    wl_resource_post_error(resource,
+                           WP_LINUX_DRM_SYNCOBJ_MANAGER_V1_ERROR_SURFACE_EXISTS,
+                           "the surface already has a syncobj surface");
+    return;
+  }
+
+  struct sl_drm_syncobj_surface* syncobj_surface =
+      new sl_drm_syncobj_surface();
+  syncobj_surface->ctx = ctx;
+  syncobj_surface->resource =
+      wl_resource_create(client, &wp_linux_drm_syncobj_surface_v1_interface,
+                         wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(syncobj_surface->resource,
+                                 &sl_drm_syncobj_surface_implementation,
+                                 syncobj_surface,
+                                 sl_destroy_drm_syncobj_surface);
+  syncobj_surface->host_surface = host_surface;
+  syncobj_surface->surface_destroy_listener.notify =
+      sl_drm_syncobj_surface_handle_surface_destroy;
+  wl_resource_add_destroy_listener(surface,
+                                   &syncobj_surface->surface_destroy_listener);
+  syncobj_surface->buffer_destroy_listener.notify =
+      sl_drm_syncobj_surface_handle_buffer_destroy;
+  host_surface->syncobj_surface = syncobj_surface;
+}
+
+static void sl_drm_syncobj_manager_import_timeline(struct wl_client* client,
+                                                   struct wl_resource* resource,
+                                                   uint32_t id,
+                                                   int32_t fd) {
+  struct sl_context* ctx =
+      static_cast<sl_context*>(wl_resource_get_user_data(resource));
+  uint32_t handle;
+
+  int ret = drmSyncobjFDToHandle(sl_drm_syncobj_fd(ctx), fd, &handle);
+  close(fd);
+  if (ret) {
+    wl_resource_post_error(
+        resource, WP_LINUX_DRM_SYNCOBJ_MANAGER_V1_ERROR_INVALID_TIMELINE,
+        "couldn't import the syncobj");
+    return;
+  }
+
+  struct sl_drm_syncobj_timeline* timeline = new sl_drm_syncobj_timeline();
+  timeline->ctx = ctx;
+  timeline->handle = handle;
+  timeline->refcount = 1;
+  timeline->resource =
+      wl_resource_create(client, &wp_linux_drm_syncobj_timeline_v1_interface,
+                         wl_resource_get_version(resource), id);
+  wl_resource_set_implementation(timeline->resource,
+                                 &sl_drm_syncobj_timeline_implementation,
+                                 timeline, sl_destroy_drm_syncobj_timeline);
+}
+
+static const struct wp_linux_drm_syncobj_manager_v1_interface
+    sl_drm_syncobj_manager_implementation = {
+        sl_drm_syncobj_manager_destroy,
+        sl_drm_syncobj_manager_get_surface,
+        sl_drm_syncobj_manager_import_timeline,
+};
+
+static void sl_bind_host_drm_syncobj_manager(struct wl_client* client,
+                                             void* data,
+                                             uint32_t version,
+                                             uint32_t id) {
+  struct sl_context* ctx = static_cast<sl_context*>(data);
+  struct wl_resource* resource = wl_resource_create(
+      client, &wp_linux_drm_syncobj_manager_v1_interface, 1, id);
+  wl_resource_set_implementation(resource,
+                                 &sl_drm_syncobj_manager_implementation, ctx,
+                                 nullptr);
+}
+
+struct sl_global* sl_drm_syncobj_manager_global_create(struct sl_context* ctx) {
+  uint64_t timeline = 0;
+
+  if (!ctx->gbm ||
+      drmGetCap(sl_drm_syncobj_fd(ctx), DRM_CAP_SYNCOBJ_TIMELINE, &timeline) ||
+      !timeline) {
+    return nullptr;
+  }
+  return sl_global_create(ctx, &wp_linux_drm_syncobj_manager_v1_interface, 1,
+                          ctx, sl_bind_host_drm_syncobj_manager);
+}
+
+bool sl_drm_syncobj_surface_attach(struct sl_host_surface* host,
+                                   struct sl_host_buffer* buffer) {
+  struct sl_drm_syncobj_surface* surface = host->syncobj_surface;
+
+  if (!surface)
+    return false;
+
+  sl_drm_syncobj_surface_clear_buffer(surface);
+  surface->buffer = buffer;
+  if (buffer) {
+    wl_resource_add_destroy_listener(buffer->resource,
+                                     &surface->buffer_destroy_listener);
+  }
+  return true;
+}
+
+bool sl_drm_syncobj_surface_hold_commit(struct sl_host_surface* host) {
+  struct sl_drm_syncobj_surface* surface = host->syncobj_surface;
+
+  if (!surface || !surface->buffer || !surface->acquire.timeline ||
+      !host->contents_shm_mmap) {
+    return false;
+  }
+
+  int fd = sl_drm_syncobj_point_wait_fd(host->ctx, &surface->acquire);
+  if (fd < 0)
+    return false;
+  struct pollfd signaled = {fd, POLLIN, 0};
+  if (poll(&signaled, 1, 0) != 0) {
+    close(fd);
+    return false;
+  }
+
+  TRACE_EVENT("drm", "sl_drm_syncobj_surface_hold_commit");
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(host->ctx->host_display);
+  surface->held_fd = fd;
+  surface->held_fd_event_source.reset(
+      wl_event_loop_add_fd(event_loop, fd, WL_EVENT_READABLE,
+                           sl_drm_syncobj_handle_held_commit_event, surface));
+  surface->held_timer_event_source.reset(wl_event_loop_add_timer(
+      event_loop, sl_drm_syncobj_handle_held_commit_timeout, surface));
+  wl_event_source_timer_update(surface->held_timer_event_source.get(),
+                               ACQUIRE_WAIT_TIMEOUT_MS);
+  return true;
+}
+
+bool sl_drm_syncobj_surface_holds_commit(struct sl_host_surface* host) {
+  return host->syncobj_surface && host->syncobj_surface->held_fd >= 0;
+}
+
+bool sl_drm_syncobj_surface_held_commit_ready(struct sl_host_surface* host) {
+  struct pollfd signaled = {host->syncobj_surface->held_fd, POLLIN, 0};
+  return poll(&signaled, 1, 0) != 0;
+}
+
+bool sl_drm_syncobj_surface_finish_held_commit(struct sl_host_surface* host) {
+  if (!sl_drm_syncobj_surface_holds_commit(host))
+    return false;
+
+  sl_drm_syncobj_surface_drop_held_commit(host->syncobj_surface);
+  return true;
+}
+
+uint32_t sl_drm_syncobj_check_points(
+    const struct sl_host_buffer* buffer,
+    const struct sl_drm_syncobj_point& acquire,
+    const struct sl_drm_syncobj_point& release) {
+  if (!buffer) {
+    return acquire.timeline || release.timeline
+               ? WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_BUFFER
+               : 0;
+  }
+  if (!acquire.timeline)
+    return WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_ACQUIRE_POINT;
+  if (!release.timeline)
+    return WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_RELEASE_POINT;
+  if (!buffer->is_drm)
+    return WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_UNSUPPORTED_BUFFER;
+  if (acquire.timeline == release.timeline && acquire.point >= release.point)
+    return WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_CONFLICTING_POINTS;
+  return 0;
+}
+
+bool sl_drm_syncobj_surface_commit(struct sl_host_surface* host) {
+  struct sl_drm_syncobj_surface* surface = host->syncobj_surface;
+
+  if (!surface)
+    return true;
+
+  TRACE_EVENT("drm", "sl_drm_syncobj_surface_commit");
+  struct sl_host_buffer* buffer = surface->buffer;
+  struct sl_drm_syncobj_point acquire = surface->acquire;
+  struct sl_drm_syncobj_point release = surface->release;
+  surface->acquire = {};
+  surface->release = {};
+  sl_drm_syncobj_surface_clear_buffer(surface);
+
+  uint32_t error = sl_drm_syncobj_check_points(buffer, acquire, release);
+
+  if (error || !buffer) {
+    if (error) {
+      wl_resource_post_error(surface->resource, error,
+                             "invalid timeline points for the commit");
+    }
+    sl_drm_syncobj_point_reset(&acquire);
+    sl_drm_syncobj_point_reset(&release);
+    return !error;
+  }
+
+  // A commit copying the buffer was held until the point signaled already.
+  int sync_file_fd = host->contents_shm_mmap
+                         ? -1
+                         : sl_drm_syncobj_point_wait_fd(host->ctx, &acquire);
+  sl_drm_syncobj_point_reset(&acquire);
+  if (sync_file_fd >= 0) {
+    if (host->surface_sync && sl_dmabuf_sync_is_virtgpu(sync_file_fd)) {
+      zwp_linux_surface_synchronization_v1_set_acquire_fence(
+          host->surface_sync, sync_file_fd);
+      close(sync_file_fd);
+    } else {
+      sl_context_wait_for_fence(host->ctx, host, sync_file_fd);
+    }
+  }
+
+  // Signaled once the buffer is released to the client, whether the host
+  // read it or sommelier copied it.
+  buffer->release_points.push_back(release);
+  return true;
+}
+
+void sl_drm_syncobj_buffer_release(struct sl_host_buffer* buffer) {
+  for (auto& release : buffer->release_points) {
+    if (drmSyncobjTimelineSignal(sl_drm_syncobj_fd(buffer->ctx),
+                                 &release.timeline->handle, &release.point,
+                                 1)) {
+      LOG(WARNING) << "couldn't signal release point " << release.point;
+    }
+    sl_drm_syncobj_point_reset(&release);
+  }
+  buffer->release_points.clear();
+}
@@ -0,0 +1,60 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_LINUX_DRM_SYNCOBJ_H_
+#define VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_LINUX_DRM_SYNCOBJ_H_
+
+#include <stdint.h>
+
+struct sl_host_buffer;
+struct sl_host_surface;
+struct sl_drm_syncobj_timeline;
+
+// A point on a client's timeline. Holds a reference to the timeline, which
+// the client may destroy before the point is signaled.
+struct sl_drm_syncobj_point {
+  struct sl_drm_syncobj_timeline* timeline;
+  uint64_t point;
+};
+
+// Called as |buffer| (or no buffer) is attached to |host|. Returns true if
+// the surface is explicitly synchronized, so the buffer's implicit fences
+// aren't waited for.
+bool sl_drm_syncobj_surface_attach(struct sl_host_surface* host,
+                                   struct sl_host_buffer* buffer);
+
+// Holds the commit being handled back until its acquire point signals, if
+// sommelier copies the buffer, as the copy can't wait on a fence otherwise.
+// Returns true if it's held, and sl_host_surface_apply_held_commit() applies
+// it once the point signals.
+bool sl_drm_syncobj_surface_hold_commit(struct sl_host_surface* host);
+
+// Whether a commit is held back for |host|, and whether the acquire point
+// it's held for has signaled, if it is.
+bool sl_drm_syncobj_surface_holds_commit(struct sl_host_surface* host);
+bool sl_drm_syncobj_surface_held_commit_ready(struct sl_host_surface* host);
+
+// Stops holding back the commit held for |host|, if there is one, whether
+// or not its acquire point has signaled. Returns true if there was one,
+// which is then due to be applied.
+bool sl_drm_syncobj_surface_finish_held_commit(struct sl_host_surface* host);
+
+// Returns the protocol error of committing |buffer| with these points, or 0
+// if there is none. Exposed for testing.
+uint32_t sl_drm_syncobj_check_points(
+    const struct sl_host_buffer* buffer,
+    const struct sl_drm_syncobj_point& acquire,
+    const struct sl_drm_syncobj_point& release);
+
+// Applies the acquire and release points set for the commit being handled.
+// The acquire point is forwarded to the host as a fence where it can be, and
+// otherwise defers the commit of the surface to the host until it signals.
+// Returns false if a protocol error was posted and the commit shouldn't go
+// on.
+bool sl_drm_syncobj_surface_commit(struct sl_host_surface* host);
+
+// Signals the release points of the commits |buffer| was released from.
+void sl_drm_syncobj_buffer_release(struct sl_host_buffer* buffer);
+
+#endif  // VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_LINUX_DRM_SYNCOBJ_H_
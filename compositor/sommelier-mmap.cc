@@ -5,6 +5,10 @@
 #include "sommelier-mmap.h"  // NOLINT(build/include_directory)
 
 #include <assert.h>
+#include <errno.h>
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "../sommelier.h"          // NOLINT(build/include_directory)
@@ -39,6 +43,7 @@ struct sl_mmap* sl_mmap_create(int fd,
   map->begin_write = nullptr;
   map->end_write = nullptr;
   map->buffer_resource = nullptr;
+  map->parent = nullptr;
   map->addr =
       mmap(nullptr, size + offset0, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   errno_assert(map->addr != MAP_FAILED);
@@ -46,6 +51,81 @@ struct sl_mmap* sl_mmap_create(int fd,
   return map;
 }
 
+struct sl_mmap* sl_mmap_create_view(struct sl_mmap* parent,
+                                    size_t size,
+                                    size_t bpp,
+                                    size_t num_planes,
+                                    size_t offset0,
+                                    size_t stride0,
+                                    size_t offset1,
+                                    size_t stride1,
+                                    size_t y_ss0,
+                                    size_t y_ss1) {
+  TRACE_EVENT("shm", "sl_mmap_create_view");
+  assert(parent->map_type == SL_MMAP_SHM);
+  struct sl_mmap* map = new sl_mmap();
+  map->refcount = 1;
+  map->fd = -1;
+  map->size = size;
+  map->map_type = SL_MMAP_SHM;
+  map->gbm_map_data = nullptr;
+  map->gbmbo = nullptr;
+  map->num_planes = num_planes;
+  map->bpp = bpp;
+  map->offset[0] = offset0;
+  map->stride[0] = stride0;
+  map->offset[1] = offset1;
+  map->stride[1] = stride1;
+  map->y_ss[0] = y_ss0;
+  map->y_ss[1] = y_ss1;
+  map->begin_write = nullptr;
+  map->end_write = nullptr;
+  map->buffer_resource = nullptr;
+  map->parent = sl_mmap_ref(parent);
+  map->addr = parent->addr;
+
+  return map;
+}
+
+// Linux 5.14 and later.
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+void sl_mmap_prefault(struct sl_mmap* map, bool huge_pages) {
+  TRACE_EVENT("shm", "sl_mmap_prefault", "size", map->size);
+  assert(map->map_type == SL_MMAP_SHM && !map->parent);
+  size_t length = map->size + map->offset[0];
+
+  // Only a hint, and only effective before the pages are faulted in.
+  if (huge_pages)
+    madvise(map->addr, length, MADV_HUGEPAGE);
+  if (!madvise(map->addr, length, MADV_POPULATE_WRITE) || errno != EINVAL)
+    return;
+
+  // Older kernels can only populate a mapping as it is created, so map the
+  // buffer again in place.
+  void* addr = mmap(map->addr, length, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED | MAP_POPULATE, map->fd, 0);
+  errno_assert(addr != MAP_FAILED);
+}
+
+bool sl_mmap_resize(struct sl_mmap* map, size_t size) {
+  TRACE_EVENT("shm", "sl_mmap_resize", "size", size);
+  assert(map->map_type == SL_MMAP_SHM && !map->parent);
+
+  if (size == map->size)
+    return true;
+
+  void* addr = mremap(map->addr, map->size + map->offset[0],
+                      size + map->offset[0], MREMAP_MAYMOVE);
+  if (addr == MAP_FAILED)
+    return false;
+  map->addr = addr;
+  map->size = size;
+  return true;
+}
+
 struct sl_mmap* sl_drm_prime_mmap_create(gbm_device* device,
                                          int fd,
                                          size_t bpp,
@@ -71,6 +151,7 @@ struct sl_mmap* sl_drm_prime_mmap_create(gbm_device* device,
   map->begin_write = nullptr;
   map->end_write = nullptr;
   map->buffer_resource = nullptr;
+  map->parent = nullptr;
   map->map_type = SL_MMAP_DRM_PRIME;
   map->gbm_map_data = nullptr;
   map->addr = nullptr;
@@ -94,6 +175,30 @@ struct sl_mmap* sl_mmap_ref(struct sl_mmap* map) {
   return map;
 }
 
+// Brackets CPU reads of a DRM PRIME mapping, so caches are kept coherent
+// with the GPU while the mapping is kept around between commits.
+static void sl_mmap_sync_read(struct sl_mmap* map, uint64_t flags) {
+  struct dma_buf_sync sync = {};
+
+  sync.flags = flags | DMA_BUF_SYNC_READ;
+  // Not every exporter implements this, and the mapping is usable without.
+  ioctl(map->fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+// Unmaps and releases the imported GBM BO of a DRM PRIME mapping.
+static void sl_mmap_release_bo(struct sl_mmap* map) {
+  if (map->addr && map->gbm_map_data) {
+    gbm_bo_unmap(map->gbmbo, map->gbm_map_data);
+    map->addr = nullptr;
+    map->gbm_map_data = nullptr;
+  }
+
+  if (map->gbmbo) {
+    gbm_bo_destroy(map->gbmbo);
+    map->gbmbo = nullptr;
+  }
+}
+
 bool sl_mmap_begin_access(struct sl_mmap* map) {
   uint32_t ret_stride;
 
@@ -103,12 +208,24 @@ bool sl_mmap_begin_access(struct sl_mmap* map) {
   // If we have any other mmap type, we should simply return true
   // under the assumption that they do not need to perform this extra
   // check
-  if (map->map_type != SL_MMAP_DRM_PRIME)
+  if (map->map_type != SL_MMAP_DRM_PRIME) {
+    if (map->parent)
+      map->addr = map->parent->addr;
+    return true;
+  }
+
+  // The BO and its mapping are imported on first access and kept until the
+  // last reference goes away. They stay valid that long since |fd| holds the
+  // dma-buf open.
+  if (map->gbmbo && map->addr) {
+    sl_mmap_sync_read(map, DMA_BUF_SYNC_START);
     return true;
+  }
 
   // Attempt to import (and map) the GBM BO
   // If we cannot do so, return false so the upper layers
   // can respond appropriately.
+  TRACE_EVENT("drm", "sl_mmap_begin_access: import");
   map->gbmbo = gbm_bo_import(map->gbm_device_object, GBM_BO_IMPORT_FD,
                              reinterpret_cast<void*>(&map->gbm_import_data),
                              GBM_BO_USE_LINEAR);
@@ -121,12 +238,14 @@ bool sl_mmap_begin_access(struct sl_mmap* map) {
                          map->gbm_import_data.height, GBM_BO_TRANSFER_READ,
                          &ret_stride, &map->gbm_map_data);
   if (!map->addr) {
-    gbm_bo_destroy(map->gbmbo);
+    // Try the whole import again on the next access.
+    sl_mmap_release_bo(map);
     return false;
   }
 
   map->stride[0] = ret_stride;
   map->size = ret_stride * map->gbm_import_data.height;
+  sl_mmap_sync_read(map, DMA_BUF_SYNC_START);
 
   return true;
 }
@@ -135,16 +254,10 @@ void sl_mmap_end_access(struct sl_mmap* map) {
   if (map->map_type != SL_MMAP_DRM_PRIME)
     return;
 
-  if (map->addr && map->gbm_map_data) {
-    gbm_bo_unmap(map->gbmbo, map->gbm_map_data);
-    map->addr = nullptr;
-    map->gbm_map_data = nullptr;
-  }
-
-  if (map->gbmbo) {
-    gbm_bo_destroy(map->gbmbo);
-    map->gbmbo = nullptr;
-  }
+  // Keep the BO mapped for the next commit. It's released in
+  // sl_mmap_unref().
+  if (map->addr)
+    sl_mmap_sync_read(map, DMA_BUF_SYNC_END);
 }
 
 void sl_mmap_unref(struct sl_mmap* map) {
@@ -156,15 +269,17 @@ void sl_mmap_unref(struct sl_mmap* map) {
   if (map->refcount == 0) {
     switch (map->map_type) {
       case SL_MMAP_SHM:
-        munmap(map->addr, map->size + map->offset[0]);
+        if (map->parent)
+          sl_mmap_unref(map->parent);
+        else
+          munmap(map->addr, map->size + map->offset[0]);
         if (map->fd != -1)
           close(map->fd);
         delete map;
         break;
 
       case SL_MMAP_DRM_PRIME:
-        // Invoke end_access just in case
-        sl_mmap_end_access(map);
+        sl_mmap_release_bo(map);
         if (map->fd != -1)
           close(map->fd);
         delete map;
@@ -34,6 +34,10 @@ struct sl_mmap {
   slMmapType map_type;
   struct gbm_import_fd_data gbm_import_data;
   struct wl_resource* buffer_resource;
+  // Mapping this is a view into, or nullptr if it owns its own mapping.
+  // |addr| is refreshed from the parent in sl_mmap_begin_access() since the
+  // parent may move when resized.
+  struct sl_mmap* parent;
 };
 
 struct sl_mmap* sl_drm_prime_mmap_create(gbm_device* device,
@@ -56,6 +60,30 @@ struct sl_mmap* sl_mmap_create(int fd,
                                size_t y_ss0,
                                size_t y_ss1);
 
+// Creates a view of the given layout into an existing SHM mapping, sharing
+// its pages instead of mapping them again. The view holds a reference to
+// |parent|.
+struct sl_mmap* sl_mmap_create_view(struct sl_mmap* parent,
+                                    size_t size,
+                                    size_t bpp,
+                                    size_t num_planes,
+                                    size_t offset0,
+                                    size_t stride0,
+                                    size_t offset1,
+                                    size_t stride1,
+                                    size_t y_ss0,
+                                    size_t y_ss1);
+
+// Faults in every page of an SHM mapping for writing, so the first write
+// to each doesn't take a fault. With |huge_pages| the kernel is asked to
+// back the mapping with transparent huge pages, which it does only for
+// memory and alignments that allow it.
+void sl_mmap_prefault(struct sl_mmap* map, bool huge_pages);
+
+// Grows or shrinks an SHM mapping in place, moving it if needed. Returns
+// false with errno set, and the mapping as it was, if it can't.
+bool sl_mmap_resize(struct sl_mmap* map, size_t size);
+
 bool sl_mmap_begin_access(struct sl_mmap* map);
 void sl_mmap_end_access(struct sl_mmap* map);
 
@@ -0,0 +1,235 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "../sommelier.h"                  // NOLINT(build/include_directory)
+#include "../sommelier-ctx.h"              // NOLINT(build/include_directory)
+#include "../sommelier-util.h"             // NOLINT(build/include_directory)
+#include "../testing/sommelier-perf-counters.h"  // NOLINT(build/include_directory)
+#include "../testing/wayland-test-base.h"  // NOLINT(build/include_directory)
+#include "sommelier-compositor-test.h"     // NOLINT(build/include_directory)
+
+#include <benchmark/benchmark.h>
+#include <gmock/gmock.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+namespace vm_tools {
+namespace sommelier {
+
+namespace {
+
+using ::testing::Invoke;
+
+const int32_t kWidth = 1024;
+const int32_t kHeight = 768;
+const int32_t kStride = kWidth * 4;
+// Side of the square each frame damages, like a cursor or spinner.
+const int32_t kDamageSize = 128;
+
+// A client drawing into two shm buffers in turn.
+class ShmClient : public FakeWaylandClient {
+ public:
+  explicit ShmClient(struct sl_context* ctx) : FakeWaylandClient(ctx) {
+    shm = static_cast<wl_shm*>(
+        wl_registry_bind(client_registry, GlobalName(ctx, &wl_shm_interface),
+                         &wl_shm_interface, 1));
+    size_t size = kStride * kHeight * 2;
+    fd = memfd_create("sommelier-bench", MFD_CLOEXEC);
+    errno_assert(fd >= 0 && !ftruncate(fd, size));
+    pixels = static_cast<uint8_t*>(
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    errno_assert(pixels != MAP_FAILED);
+    memset(pixels, 0x80, size);
+
+    struct wl_shm_pool* pool = wl_shm_create_pool(shm, fd, size);
+    for (int i = 0; i < 2; ++i) {
+      buffers[i] =
+          wl_shm_pool_create_buffer(pool, i * kStride * kHeight, kWidth,
+                                    kHeight, kStride, WL_SHM_FORMAT_XRGB8888);
+    }
+    wl_shm_pool_destroy(pool);
+    surface = CreateSurface();
+  }
+
+  ~ShmClient() {
+    munmap(pixels, kStride * kHeight * 2);
+    close(fd);
+  }
+
+  // Draws, attaches and commits frame |n|. The first frame damages
+  // everything.
+  void Commit(int64_t n) {
+    int i = n % 2;
+    int32_t x = (n * 16) % (kWidth - kDamageSize);
+    int32_t y = (n * 8) % (kHeight - kDamageSize);
+
+    for (int32_t row = y; row < y + kDamageSize; ++row) {
+      memset(pixels + (i * kHeight + row) * kStride + x * 4, n & 0xff,
+             kDamageSize * 4);
+    }
+    wl_surface_attach(surface, buffers[i], 0, 0);
+    if (n == 0)
+      wl_surface_damage(surface, 0, 0, kWidth, kHeight);
+    else
+      wl_surface_damage(surface, x, y, kDamageSize, kDamageSize);
+    wl_surface_commit(surface);
+    Flush();
+  }
+
+  // Handles the buffer releases sent so far, without blocking.
+  void DispatchPendingEvents() {
+    while (wl_display_prepare_read(client_display) != 0)
+      wl_display_dispatch_pending(client_display);
+    wl_display_read_events(client_display);
+    wl_display_dispatch_pending(client_display);
+  }
+
+  bool failed() { return wl_display_get_error(client_display) != 0; }
+
+  struct wl_surface* surface = nullptr;
+
+ private:
+  struct wl_shm* shm = nullptr;
+  struct wl_buffer* buffers[2] = {};
+  int fd = -1;
+  uint8_t* pixels = nullptr;
+};
+
+// Runs sommelier's attach/commit path against a mock host that immediately
+// releases every buffer it is sent.
+class PipelineHarness : public WaylandTestBase {
+ public:
+  explicit PipelineHarness(int num_clients) : num_clients_(num_clients) {
+    ON_CALL(mock_wayland_channel_, send(_))
+        .WillByDefault(Invoke([this](const struct WaylandSendReceive& data) {
+          messages_sent++;
+          bytes_sent += data.data_size;
+          return 0;
+        }));
+    ON_CALL(mock_wayland_channel_, allocate(_, _))
+        .WillByDefault(Invoke([this](const WaylandBufferCreateInfo& info,
+                                     WaylandBufferCreateOutput& output) {
+          buffers_allocated++;
+          output.fd = memfd_create("sommelier-bench-output", MFD_CLOEXEC);
+          errno_assert(output.fd >= 0 && !ftruncate(output.fd, info.size));
+          output.host_size = info.size;
+          return 0;
+        }));
+    ON_CALL(mock_wayland_channel_, free_buffer(_, _))
+        .WillByDefault(Invoke([](const WaylandBufferCreateInfo&,
+                                 const WaylandBufferCreateOutput& output) {
+          close(output.fd);
+        }));
+    SetUp();
+    for (int i = 0; i < num_clients_; ++i)
+      clients_.push_back(std::make_unique<ShmClient>(&ctx));
+    Pump();
+  }
+
+  ~PipelineHarness() override {
+    clients_.clear();
+    TearDown();
+  }
+
+  void TestBody() override {}
+
+  // Commits frame |n| on every client, and lets the host release it.
+  bool Frame(int64_t n) {
+    for (auto& client : clients_)
+      client->Commit(n);
+    // Once for the client requests, once for what they were forwarded as.
+    Pump();
+    Pump();
+    for (auto& client : clients_) {
+      struct wl_resource* resource =
+          wl_client_get_object(client->client, SurfaceId(client->surface));
+      sl_host_surface_release_busy_buffers(static_cast<sl_host_surface*>(
+          wl_resource_get_user_data(resource)));
+      client->DispatchPendingEvents();
+      if (client->failed())
+        return false;
+    }
+    return true;
+  }
+
+  uint64_t messages_sent = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t buffers_allocated = 0;
+
+ protected:
+  void Connect() override {
+    WaylandTestBase::Connect();
+    sl_registry_handler(&ctx, wl_display_get_registry(ctx.display),
+                        next_server_id++, "wl_shm", 1);
+  }
+
+ private:
+  int num_clients_;
+  std::vector<std::unique_ptr<ShmClient>> clients_;
+};
+
+// Args: clients, target frames per second (0 to run flat out).
+void BM_FramePipeline(benchmark::State& state) {
+  int num_clients = state.range(0);
+  int64_t frame_interval_ns = state.range(1) ? 1000000000 / state.range(1) : 0;
+  PipelineHarness harness(num_clients);
+
+  // Warm up the output buffers, so the first full copy isn't counted.
+  harness.Frame(0);
+  harness.Frame(1);
+
+  uint64_t messages = harness.messages_sent;
+  uint64_t bytes = harness.bytes_sent;
+  uint64_t buffers = harness.buffers_allocated;
+  uint64_t allocs = PerfAllocationCount();
+  int64_t cpu_ns = PerfCpuTimeNs();
+  int64_t next_frame_ns = sl_monotonic_time_ns();
+  int64_t n = 2;
+
+  for (auto _ : state) {
+    if (!harness.Frame(n++)) {
+      state.SkipWithError("client was disconnected");
+      break;
+    }
+    if (frame_interval_ns) {
+      next_frame_ns += frame_interval_ns;
+      int64_t delay_ns = next_frame_ns - sl_monotonic_time_ns();
+      if (delay_ns > 0) {
+        struct timespec ts = {delay_ns / 1000000000, delay_ns % 1000000000};
+        nanosleep(&ts, nullptr);
+      }
+    }
+  }
+
+  if (state.error_occurred())
+    return;
+
+  double frames = static_cast<double>(state.iterations()) * num_clients;
+  state.counters["frames_per_second"] =
+      benchmark::Counter(frames, benchmark::Counter::kIsRate);
+  state.counters["cpu_us_per_frame"] =
+      (PerfCpuTimeNs() - cpu_ns) / 1000.0 / frames;
+  state.counters["allocs_per_frame"] =
+      (PerfAllocationCount() - allocs) / frames;
+  state.counters["buffer_allocs_per_frame"] =
+      (harness.buffers_allocated - buffers) / frames;
+  state.counters["messages_per_frame"] =
+      (harness.messages_sent - messages) / frames;
+  state.counters["bytes_per_frame"] = (harness.bytes_sent - bytes) / frames;
+}
+BENCHMARK(BM_FramePipeline)
+    ->ArgNames({"clients", "fps"})
+    ->ArgsProduct({{1, 4, 16}, {0, 60}})
+    ->UseRealTime()
+    ->Unit(benchmark::kMicrosecond);
+
+}  // namespace
+
+}  // namespace sommelier
+}  // namespace vm_tools
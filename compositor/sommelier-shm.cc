@@ -3,12 +3,15 @@
 // found in the LICENSE file.
 
 #include "../sommelier.h"          // NOLINT(build/include_directory)
+#include "../sommelier-logging.h"  // NOLINT(build/include_directory)
 #include "../sommelier-tracing.h"  // NOLINT(build/include_directory)
 #include "../sommelier-util.h"     // NOLINT(build/include_directory)
 #include "sommelier-formats.h"     // NOLINT(build/include_directory)
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <wayland-client.h>
 
@@ -20,6 +23,12 @@ struct sl_host_shm_pool {
   struct wl_resource* resource;
   struct wl_shm_pool* proxy;
   int fd;
+  // Mapping of the whole pool, shared by every buffer created from it.
+  struct sl_mmap* mmap;
+  // dma-buf wrapping the first |dmabuf_size| bytes of the pool, shared with
+  // the host by --zero-copy-shm, or -1 if the pool is copied.
+  int dmabuf_fd;
+  size_t dmabuf_size;
 };
 
 struct sl_host_shm {
@@ -29,6 +38,76 @@ struct sl_host_shm {
   struct zwp_linux_dmabuf_v1* linux_dmabuf_proxy;
 };
 
+// Shares the first |size| bytes of the pool with the host for
+// --zero-copy-shm, replacing any previous dma-buf. Buffers already created
+// from the old dma-buf keep their own reference to it. The pool stays on the
+// copy path if sharing fails, or if it's below --zero-copy-shm-threshold
+// until it grows past it.
+static void sl_host_shm_pool_import(struct sl_host_shm_pool* host,
+                                    int32_t size) {
+  struct sl_context* ctx = host->shm->ctx;
+
+  if (host->dmabuf_fd >= 0) {
+    close(host->dmabuf_fd);
+    host->dmabuf_fd = -1;
+    host->dmabuf_size = 0;
+  }
+
+  if (!ctx->zero_copy_shm || !ctx->channel->supports_dmabuf() ||
+      !ctx->linux_dmabuf || !ctx->linux_dmabuf->internal)
+    return;
+
+  // Only whole pages can be shared. Buffers that reach into a trailing
+  // partial page are still copied.
+  size_t page_size = getpagesize();
+  size_t import_size = size / page_size * page_size;
+  if (!import_size || import_size < ctx->zero_copy_shm_threshold)
+    return;
+
+  int dmabuf_fd = -1;
+  int rv = ctx->channel->import_shm(host->fd, import_size, dmabuf_fd);
+  if (rv == -EOPNOTSUPP) {
+    // Nothing will change for later pools, so stop trying.
+    LOG(WARNING) << "zero-copy shm unsupported, falling back to copies";
+    ctx->zero_copy_shm = false;
+    return;
+  }
+  if (rv)
+    return;
+
+  host->dmabuf_fd = dmabuf_fd;
+  host->dmabuf_size = import_size;
+}
+
+// Creates a host buffer reading directly from the pool's dma-buf, or returns
+// nullptr if the buffer has to be copied.
+static struct wl_buffer* sl_host_shm_pool_create_shared_buffer(
+    struct sl_host_shm_pool* host,
+    int32_t offset,
+    int32_t width,
+    int32_t height,
+    int32_t stride,
+    uint32_t format) {
+  if (host->dmabuf_fd < 0 ||
+      offset + sl_shm_format_size(format, height, stride) > host->dmabuf_size)
+    return nullptr;
+
+  struct zwp_linux_buffer_params_v1* buffer_params =
+      zwp_linux_dmabuf_v1_create_params(host->shm->ctx->linux_dmabuf->internal);
+  zwp_linux_buffer_params_v1_add(buffer_params, host->dmabuf_fd, 0, offset,
+                                 stride, 0, 0);
+  if (sl_shm_format_num_planes(format) > 1) {
+    zwp_linux_buffer_params_v1_add(
+        buffer_params, host->dmabuf_fd, 1,
+        offset + sl_shm_format_plane_offset(format, 1, height, stride), stride,
+        0, 0);
+  }
+  struct wl_buffer* buffer = zwp_linux_buffer_params_v1_create_immed(
+      buffer_params, width, height, sl_shm_format_to_drm_format(format), 0);
+  zwp_linux_buffer_params_v1_destroy(buffer_params);
+  return buffer;
+}
+
 static void sl_host_shm_pool_create_host_buffer(struct wl_client* client,
                                                 struct wl_resource* resource,
                                                 uint32_t id,
@@ -50,23 +129,36 @@ static void sl_host_shm_pool_create_host_buffer(struct wl_client* client,
     return;
   }
 
-  struct sl_host_buffer* host_buffer = sl_create_host_buffer(
-      host->shm->ctx, client, id, nullptr, width, height, /*is_drm=*/false);
+  if (!host->mmap)
+    return;
+
+  // Buffers must lie within the pool, or they'd read past its mapping.
+  size_t buffer_size = sl_shm_format_size(format, height, stride);
+  if (offset < 0 || width <= 0 || height <= 0 || stride <= 0 ||
+      offset + buffer_size > host->mmap->size) {
+    wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_STRIDE,
+                           "invalid width, height or stride (%dx%d, %d)",
+                           width, height, stride);
+    return;
+  }
+
+  // Shared buffers are attached as-is, like DRM buffers. They keep the pool
+  // mapping too, for shaped windows which are always copied.
+  struct wl_buffer* shared_buffer = sl_host_shm_pool_create_shared_buffer(
+      host, offset, width, height, stride, format);
+  struct sl_host_buffer* host_buffer =
+      sl_create_host_buffer(host->shm->ctx, client, id, shared_buffer, width,
+                            height, /*is_drm=*/shared_buffer != nullptr);
 
   host_buffer->shm_format = format;
-  host_buffer->shm_mmap = sl_mmap_create(
-      host->fd, sl_shm_format_size(format, height, stride),
-      sl_shm_format_bpp(format), sl_shm_format_num_planes(format), offset,
-      stride, offset + sl_shm_format_plane_offset(format, 1, height, stride),
-      stride, sl_shm_format_plane_y_subsampling(format, 0),
+  // Buffers share the pool's mapping rather than each mapping the pool fd,
+  // which clients like Chromium carve dozens of buffers out of.
+  host_buffer->shm_mmap = sl_mmap_create_view(
+      host->mmap, buffer_size, sl_shm_format_bpp(format),
+      sl_shm_format_num_planes(format), offset, stride,
+      offset + sl_shm_format_plane_offset(format, 1, height, stride), stride,
+      sl_shm_format_plane_y_subsampling(format, 0),
       sl_shm_format_plane_y_subsampling(format, 1));
-  // In the case of mmaps created from the client buffer, we want to be able
-  // to close the FD when the client releases the shm pool (i.e. when it's
-  // done transferring) as opposed to when the pool is freed (i.e. when we're
-  // done drawing).
-  // We do this by removing the handle to the FD after it has been mmapped,
-  // which prevents a double-close.
-  host_buffer->shm_mmap->fd = -1;
   host_buffer->shm_mmap->buffer_resource = host_buffer->resource;
 }
 
@@ -83,6 +175,23 @@ static void sl_host_shm_pool_resize(struct wl_client* client,
 
   if (host->proxy)
     wl_shm_pool_resize(host->proxy, size);
+  if (host->mmap) {
+    // Pools only grow, buffers may still lie in what a shrink would cut.
+    if (size <= 0 || static_cast<size_t>(size) < host->mmap->size) {
+      wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_FD,
+                             "invalid size (%d)", size);
+      return;
+    }
+    // Resizing can move the mapping out from under in-flight copies.
+    sl_context_drain_commit_pipeline(host->shm->ctx);
+    if (!sl_mmap_resize(host->mmap, size)) {
+      wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_FD,
+                             "failed to resize pool to %d: %s", size,
+                             strerror(errno));
+      return;
+    }
+    sl_host_shm_pool_import(host, size);
+  }
 }
 
 static const struct wl_shm_pool_interface sl_shm_pool_implementation = {
@@ -93,6 +202,10 @@ static void sl_destroy_host_shm_pool(struct wl_resource* resource) {
   struct sl_host_shm_pool* host =
       static_cast<sl_host_shm_pool*>(wl_resource_get_user_data(resource));
 
+  if (host->mmap)
+    sl_mmap_unref(host->mmap);
+  if (host->dmabuf_fd >= 0)
+    close(host->dmabuf_fd);
   if (host->fd >= 0)
     close(host->fd);
   if (host->proxy)
@@ -113,6 +226,9 @@ static void sl_shm_create_host_pool(struct wl_client* client,
   host_shm_pool->shm = host->shm;
   host_shm_pool->fd = -1;
   host_shm_pool->proxy = nullptr;
+  host_shm_pool->mmap = nullptr;
+  host_shm_pool->dmabuf_fd = -1;
+  host_shm_pool->dmabuf_size = 0;
   host_shm_pool->resource =
       wl_resource_create(client, &wl_shm_pool_interface, 1, id);
   wl_resource_set_implementation(host_shm_pool->resource,
@@ -124,8 +240,17 @@ static void sl_shm_create_host_pool(struct wl_client* client,
     host_shm_pool->proxy = wl_shm_create_pool(host->shm_proxy, fd, size);
     wl_shm_pool_set_user_data(host_shm_pool->proxy, host_shm_pool);
     close(fd);
+  } else if (size <= 0) {
+    wl_resource_post_error(resource, WL_SHM_ERROR_INVALID_STRIDE,
+                           "invalid size (%d)", size);
+    close(fd);
   } else {
     host_shm_pool->fd = fd;
+    host_shm_pool->mmap =
+        sl_mmap_create(fd, size, /*bpp=*/1, /*num_planes=*/1, 0, 0, 0, 0, 1, 1);
+    // The pool closes the fd itself when destroyed.
+    host_shm_pool->mmap->fd = -1;
+    sl_host_shm_pool_import(host_shm_pool, size);
   }
 }
 
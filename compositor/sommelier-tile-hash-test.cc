@@ -0,0 +1,108 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-tile-hash.h"  // NOLINT(build/include_directory)
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace vm_tools {
+namespace sommelier {
+
+namespace {
+
+const size_t kStride = 1024;
+const size_t kRows = 64;
+
+class TileHashTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    pixels_.resize(kStride * kRows);
+    for (size_t i = 0; i < pixels_.size(); ++i)
+      pixels_[i] = static_cast<uint8_t>(i * 131 + i / 251);
+  }
+
+ protected:
+  uint64_t Hash(size_t row_bytes, size_t rows) {
+    return sl_tile_hash(pixels_.data(), kStride, row_bytes, rows, 0);
+  }
+
+  std::vector<uint8_t> pixels_;
+};
+
+}  // namespace
+
+TEST_F(TileHashTest, MatchesScalarImplementation) {
+  for (size_t row_bytes : {1, 63, 64, 65, 200, 256, 1000}) {
+    for (uint64_t seed : {0ULL, 0x1234ULL}) {
+      EXPECT_EQ(sl_tile_hash(pixels_.data() + 3, kStride, row_bytes, kRows,
+                             seed),
+                sl_tile_hash_scalar(pixels_.data() + 3, kStride, row_bytes,
+                                    kRows, seed))
+          << "row_bytes " << row_bytes << " seed " << seed;
+    }
+  }
+}
+
+TEST_F(TileHashTest, DetectsSingleByteChange) {
+  uint64_t before = Hash(256, kRows);
+
+  pixels_[kStride * 40 + 255] ^= 1;
+  EXPECT_NE(Hash(256, kRows), before);
+  pixels_[kStride * 40 + 255] ^= 1;
+  EXPECT_EQ(Hash(256, kRows), before);
+}
+
+TEST_F(TileHashTest, DetectsSwappedRowsAndStripes) {
+  uint64_t before = Hash(256, kRows);
+
+  std::swap_ranges(pixels_.begin(), pixels_.begin() + 256,
+                   pixels_.begin() + kStride);
+  EXPECT_NE(Hash(256, kRows), before);
+  std::swap_ranges(pixels_.begin(), pixels_.begin() + 256,
+                   pixels_.begin() + kStride);
+
+  std::swap_ranges(pixels_.begin(), pixels_.begin() + 64,
+                   pixels_.begin() + 64);
+  std::swap_ranges(pixels_.begin(), pixels_.begin() + 64,
+                   pixels_.begin() + 128);
+  EXPECT_NE(Hash(256, kRows), before);
+}
+
+TEST_F(TileHashTest, IgnoresBytesOutsideTheTile) {
+  uint64_t before = Hash(256, 32);
+
+  pixels_[256] ^= 0xff;
+  pixels_[kStride * 32] ^= 0xff;
+  EXPECT_EQ(Hash(256, 32), before);
+}
+
+TEST(TileHashMapTest, SkipsUnchangedTiles) {
+  TileHashMap map;
+  map.Resize(100, 200);
+
+  EXPECT_EQ(map.tiles_x(), 2u);
+  EXPECT_EQ(map.tiles_y(), 4u);
+  EXPECT_TRUE(map.Update(1, 3, 42));
+  EXPECT_FALSE(map.Update(1, 3, 42));
+  EXPECT_TRUE(map.Update(1, 3, 43));
+
+  map.Invalidate(1, 3);
+  EXPECT_TRUE(map.Update(1, 3, 43));
+
+  map.Reset();
+  EXPECT_TRUE(map.Update(1, 3, 43));
+
+  // Resizing forgets everything, but resizing to the same size doesn't.
+  map.Resize(100, 200);
+  EXPECT_FALSE(map.Update(1, 3, 43));
+  map.Resize(128, 200);
+  EXPECT_TRUE(map.Update(1, 3, 43));
+}
+
+}  // namespace sommelier
+}  // namespace vm_tools
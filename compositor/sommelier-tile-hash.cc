@@ -0,0 +1,237 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-tile-hash.h"  // NOLINT(build/include_directory)
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SL_TILE_HASH_X86 1
+#endif
+
+namespace {
+
+// The hash follows the structure of XXH3: each 64-byte stripe of a row is
+// mixed into eight 64-bit accumulators with a 32x32->64 multiply, keyed by
+// the stripe's position in the row, and the accumulators are scrambled
+// after every row so that row order matters too. That vectorizes well and
+// is far cheaper than copying the tile it guards.
+const size_t kStripeBytes = 64;
+const size_t kLanes = kStripeBytes / sizeof(uint64_t);
+
+const uint64_t kPrime32_1 = 0x9E3779B1ULL;
+const uint64_t kPrime64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t kPrime64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t kPrime64_3 = 0x165667B19E3779F9ULL;
+const uint64_t kStripeKeyStep = 0x9FB21C651E98DF25ULL;
+
+const uint64_t kLaneKeys[kLanes] = {
+    0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL,
+    0x1F67B3B7A4A44072ULL, 0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL,
+    0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL,
+};
+
+inline uint64_t load64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline uint64_t rotl64(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+void init_accumulators(uint64_t* acc, uint64_t seed) {
+  for (size_t i = 0; i < kLanes; ++i)
+    acc[i] = seed ^ kLaneKeys[(i + 1) % kLanes];
+}
+
+uint64_t finalize(const uint64_t* acc,
+                  size_t row_bytes,
+                  size_t rows,
+                  uint64_t seed) {
+  uint64_t hash = seed + rows * kPrime64_1 + row_bytes * kPrime64_2;
+  for (size_t i = 0; i < kLanes; ++i)
+    hash = rotl64(hash ^ (acc[i] * kPrime64_2), 27) * kPrime64_1 + kPrime64_3;
+
+  hash ^= hash >> 33;
+  hash *= kPrime64_2;
+  hash ^= hash >> 29;
+  hash *= kPrime64_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+void accumulate_stripe(uint64_t* acc, const uint8_t* src, const uint64_t* key) {
+  for (size_t i = 0; i < kLanes; ++i) {
+    uint64_t data = load64(src + i * sizeof(uint64_t));
+    uint64_t data_key = data ^ key[i];
+    acc[i ^ 1] += data;
+    acc[i] += (data_key & 0xFFFFFFFF) * (data_key >> 32);
+  }
+}
+
+void scramble(uint64_t* acc) {
+  for (size_t i = 0; i < kLanes; ++i) {
+    uint64_t value = acc[i];
+    value ^= value >> 47;
+    value ^= kLaneKeys[i];
+    acc[i] = value * kPrime32_1;
+  }
+}
+
+#if SL_TILE_HASH_X86
+__attribute__((target("avx2"))) inline void accumulate_stripe_avx2(
+    __m256i* acc_lo,
+    __m256i* acc_hi,
+    const uint8_t* src,
+    __m256i key_lo,
+    __m256i key_hi) {
+  __m256i data_lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+  __m256i data_hi =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32));
+  __m256i data_key_lo = _mm256_xor_si256(data_lo, key_lo);
+  __m256i data_key_hi = _mm256_xor_si256(data_hi, key_hi);
+  __m256i product_lo =
+      _mm256_mul_epu32(data_key_lo, _mm256_srli_epi64(data_key_lo, 32));
+  __m256i product_hi =
+      _mm256_mul_epu32(data_key_hi, _mm256_srli_epi64(data_key_hi, 32));
+  // Swapping neighbouring lanes matches acc[i ^ 1] += data.
+  __m256i swapped_lo = _mm256_shuffle_epi32(data_lo, _MM_SHUFFLE(1, 0, 3, 2));
+  __m256i swapped_hi = _mm256_shuffle_epi32(data_hi, _MM_SHUFFLE(1, 0, 3, 2));
+  *acc_lo = _mm256_add_epi64(*acc_lo, _mm256_add_epi64(product_lo, swapped_lo));
+  *acc_hi = _mm256_add_epi64(*acc_hi, _mm256_add_epi64(product_hi, swapped_hi));
+}
+
+__attribute__((target("avx2"))) inline void scramble_avx2(__m256i* acc,
+                                                          __m256i key) {
+  const __m256i prime = _mm256_set1_epi64x(kPrime32_1);
+  __m256i value = _mm256_xor_si256(*acc, _mm256_srli_epi64(*acc, 47));
+  value = _mm256_xor_si256(value, key);
+  __m256i low = _mm256_mul_epu32(value, prime);
+  __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(value, 32), prime);
+  *acc = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+}
+
+__attribute__((target("avx2"))) uint64_t tile_hash_avx2(const uint8_t* src,
+                                                        size_t stride,
+                                                        size_t row_bytes,
+                                                        size_t rows,
+                                                        uint64_t seed) {
+  alignas(32) uint64_t acc[kLanes];
+  init_accumulators(acc, seed);
+
+  __m256i acc_lo = _mm256_load_si256(reinterpret_cast<const __m256i*>(acc));
+  __m256i acc_hi =
+      _mm256_load_si256(reinterpret_cast<const __m256i*>(acc + kLanes / 2));
+  const __m256i lane_keys_lo =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(kLaneKeys));
+  const __m256i lane_keys_hi = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i*>(kLaneKeys + kLanes / 2));
+  const __m256i key_step = _mm256_set1_epi64x(kStripeKeyStep);
+  size_t full_stripes = row_bytes / kStripeBytes;
+  size_t tail = row_bytes % kStripeBytes;
+
+  for (size_t row = 0; row < rows; ++row) {
+    const uint8_t* p = src + row * stride;
+    __m256i key_lo = lane_keys_lo;
+    __m256i key_hi = lane_keys_hi;
+
+    for (size_t i = 0; i < full_stripes; ++i, p += kStripeBytes) {
+      accumulate_stripe_avx2(&acc_lo, &acc_hi, p, key_lo, key_hi);
+      key_lo = _mm256_add_epi64(key_lo, key_step);
+      key_hi = _mm256_add_epi64(key_hi, key_step);
+    }
+    if (tail) {
+      uint8_t last[kStripeBytes] = {};
+      memcpy(last, p, tail);
+      accumulate_stripe_avx2(&acc_lo, &acc_hi, last, key_lo, key_hi);
+    }
+
+    scramble_avx2(&acc_lo, lane_keys_lo);
+    scramble_avx2(&acc_hi, lane_keys_hi);
+  }
+
+  _mm256_store_si256(reinterpret_cast<__m256i*>(acc), acc_lo);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(acc + kLanes / 2), acc_hi);
+  return finalize(acc, row_bytes, rows, seed);
+}
+#endif
+
+}  // namespace
+
+uint64_t sl_tile_hash_scalar(const uint8_t* src,
+                             size_t stride,
+                             size_t row_bytes,
+                             size_t rows,
+                             uint64_t seed) {
+  uint64_t acc[kLanes];
+  size_t full_stripes = row_bytes / kStripeBytes;
+  size_t tail = row_bytes % kStripeBytes;
+
+  init_accumulators(acc, seed);
+  for (size_t row = 0; row < rows; ++row) {
+    const uint8_t* p = src + row * stride;
+    uint64_t key[kLanes];
+    memcpy(key, kLaneKeys, sizeof(key));
+
+    for (size_t i = 0; i < full_stripes; ++i, p += kStripeBytes) {
+      accumulate_stripe(acc, p, key);
+      for (size_t lane = 0; lane < kLanes; ++lane)
+        key[lane] += kStripeKeyStep;
+    }
+    if (tail) {
+      uint8_t last[kStripeBytes] = {};
+      memcpy(last, p, tail);
+      accumulate_stripe(acc, last, key);
+    }
+
+    scramble(acc);
+  }
+  return finalize(acc, row_bytes, rows, seed);
+}
+
+uint64_t sl_tile_hash(const uint8_t* src,
+                      size_t stride,
+                      size_t row_bytes,
+                      size_t rows,
+                      uint64_t seed) {
+#if SL_TILE_HASH_X86
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2)
+    return tile_hash_avx2(src, stride, row_bytes, rows, seed);
+#endif
+  return sl_tile_hash_scalar(src, stride, row_bytes, rows, seed);
+}
+
+void TileHashMap::Resize(uint32_t width, uint32_t height) {
+  if (width == width_ && height == height_)
+    return;
+
+  width_ = width;
+  height_ = height;
+  tiles_x_ = (width + kDamageTileSize - 1) / kDamageTileSize;
+  tiles_y_ = (height + kDamageTileSize - 1) / kDamageTileSize;
+  hashes_.assign(static_cast<size_t>(tiles_x_) * tiles_y_, 0);
+  valid_.assign(hashes_.size(), false);
+}
+
+void TileHashMap::Reset() {
+  valid_.assign(valid_.size(), false);
+}
+
+bool TileHashMap::Update(uint32_t tx, uint32_t ty, uint64_t hash) {
+  size_t index = static_cast<size_t>(ty) * tiles_x_ + tx;
+  if (valid_[index] && hashes_[index] == hash)
+    return false;
+
+  hashes_[index] = hash;
+  valid_[index] = true;
+  return true;
+}
+
+void TileHashMap::Invalidate(uint32_t tx, uint32_t ty) {
+  valid_[static_cast<size_t>(ty) * tiles_x_ + tx] = false;
+}
@@ -0,0 +1,62 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_TILE_HASH_H_
+#define VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_TILE_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Width and height in pixels of the tiles damage is filtered in.
+const uint32_t kDamageTileSize = 64;
+
+// Hashes |rows| rows of |row_bytes| bytes each, |stride| bytes apart,
+// continuing from |seed| so several planes can be folded into one hash.
+// Uses AVX2 where available; every implementation gives the same result.
+uint64_t sl_tile_hash(const uint8_t* src,
+                      size_t stride,
+                      size_t row_bytes,
+                      size_t rows,
+                      uint64_t seed);
+
+// Portable implementation of sl_tile_hash(), exposed for testing.
+uint64_t sl_tile_hash_scalar(const uint8_t* src,
+                             size_t stride,
+                             size_t row_bytes,
+                             size_t rows,
+                             uint64_t seed);
+
+// Remembers the hash of every tile last copied into an output buffer, so
+// tiles the client damaged without changing can be left alone.
+class TileHashMap {
+ public:
+  // Sizes the map for a |width|x|height| pixel buffer. Forgets every tile
+  // if the size changed.
+  void Resize(uint32_t width, uint32_t height);
+
+  // Forgets every tile, e.g. when the buffer is written some other way.
+  void Reset();
+
+  // Records that tile (|tx|, |ty|) now holds contents hashing to |hash|.
+  // Returns false if it already did, meaning the copy can be skipped.
+  bool Update(uint32_t tx, uint32_t ty, uint64_t hash);
+
+  // Forgets tile (|tx|, |ty|), after only part of it was copied.
+  void Invalidate(uint32_t tx, uint32_t ty);
+
+  uint32_t tiles_x() const { return tiles_x_; }
+  uint32_t tiles_y() const { return tiles_y_; }
+
+ private:
+  uint32_t width_ = 0;
+  uint32_t height_ = 0;
+  uint32_t tiles_x_ = 0;
+  uint32_t tiles_y_ = 0;
+  std::vector<uint64_t> hashes_;
+  std::vector<bool> valid_;
+};
+
+#endif  // VM_TOOLS_SOMMELIER_COMPOSITOR_SOMMELIER_TILE_HASH_H_
@@ -4,6 +4,9 @@
 
 #include "libevdev-shim.h"  // NOLINT(build/include_directory)
 
+#include <errno.h>
+#include <unistd.h>
+
 struct libevdev* LibevdevShim::new_evdev(void) {
   return libevdev_new();
 }
@@ -44,6 +47,20 @@ int LibevdevShim::uinput_write_event(const struct libevdev_uinput* uinput_dev,
                                      int value) {
   return libevdev_uinput_write_event(uinput_dev, type, code, value);
 }
+int LibevdevShim::uinput_write_events(const struct libevdev_uinput* uinput_dev,
+                                      const struct input_event* events,
+                                      size_t count) {
+  // Like libevdev_uinput_write_event, leave the timestamps for the kernel.
+  ssize_t size = count * sizeof(*events);
+  int fd = libevdev_uinput_get_fd(uinput_dev);
+  ssize_t ret;
+  do {
+    ret = write(fd, events, size);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0)
+    return -errno;
+  return ret == size ? 0 : -EIO;
+}
 void LibevdevShim::uinput_destroy(struct libevdev_uinput* uinput_dev) {
   libevdev_uinput_destroy(uinput_dev);
 }
@@ -5,6 +5,8 @@
 #ifndef VM_TOOLS_SOMMELIER_LIBEVDEV_LIBEVDEV_SHIM_H_
 #define VM_TOOLS_SOMMELIER_LIBEVDEV_LIBEVDEV_SHIM_H_
 
+#include <stddef.h>
+
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
 
@@ -35,6 +37,11 @@ class LibevdevShim {
                                  unsigned int type,
                                  unsigned int code,
                                  int value);
+  // Writes |count| events with a single write(), so that readers never see
+  // part of them.
+  virtual int uinput_write_events(const struct libevdev_uinput* uinput_dev,
+                                  const struct input_event* events,
+                                  size_t count);
   virtual void uinput_destroy(struct libevdev_uinput* uinput_dev);
 };
 
@@ -63,6 +63,13 @@ class MockLibevdevShim : public LibevdevShim {
                int value),
               (override));
 
+  MOCK_METHOD(int,
+              uinput_write_events,
+              (const struct libevdev_uinput* uinput_dev,
+               const struct input_event* events,
+               size_t count),
+              (override));
+
   MOCK_METHOD(void,
               uinput_destroy,
               (struct libevdev_uinput * uinput_dev),
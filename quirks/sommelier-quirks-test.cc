@@ -49,6 +49,43 @@ TEST_F(QuirksTest, LoadsFilesFromCommandLine) {
   unlink(filename2);
 }
 
+TEST_F(QuirksTest, ReloadsFilesAsTheyChange) {
+  sl_window* game123 = CreateToplevelWindow();
+  game123->steam_game_id = 123;
+  char filename[L_tmpnam];
+  {
+    std::ofstream file(std::tmpnam(filename), std::ofstream::out);
+    file << "sommelier { \n"
+            "  condition { steam_game_id: 123 }\n"
+            "  enable: FEATURE_X11_MOVE_WINDOWS\n"
+            "}";
+  }
+  ctx.quirks.LoadFromCommaSeparatedFiles(filename);
+  ASSERT_GE(ctx.quirks.Watch(), 0);
+  EXPECT_TRUE(ctx.quirks.IsEnabled(game123, quirks::FEATURE_X11_MOVE_WINDOWS));
+
+  {
+    std::ofstream file(filename, std::ofstream::out | std::ofstream::trunc);
+    file << "sommelier { \n"
+            "  condition { steam_game_id: 123 }\n"
+            "  disable: FEATURE_X11_MOVE_WINDOWS\n"
+            "}";
+  }
+  EXPECT_TRUE(ctx.quirks.HandleWatchEvents());
+  EXPECT_FALSE(
+      ctx.quirks.IsEnabled(game123, quirks::FEATURE_X11_MOVE_WINDOWS));
+
+  // A config that doesn't parse leaves the previous one in place.
+  {
+    std::ofstream file(filename, std::ofstream::out | std::ofstream::trunc);
+    file << "sommelier { \n";
+  }
+  EXPECT_FALSE(ctx.quirks.HandleWatchEvents());
+  EXPECT_FALSE(
+      ctx.quirks.IsEnabled(game123, quirks::FEATURE_X11_MOVE_WINDOWS));
+  unlink(filename);
+}
+
 TEST_F(QuirksTest, ShouldSelectivelyEnableFeatures) {
   sl_window* game123 = CreateToplevelWindow();
   game123->steam_game_id = 123;
@@ -332,4 +369,35 @@ TEST_F(QuirksTest, ConditionAlwaysMultipleLastDefinedHasPriority2) {
   EXPECT_TRUE(ctx.quirks.IsEnabled(game123, quirks::FEATURE_X11_MOVE_WINDOWS));
 }
 
+TEST_F(QuirksTest, MaxFpsAppliesToMatchingGames) {
+  ctx.quirks.Load(
+      "sommelier { \n"
+      "  condition { always: true }\n"
+      "  max_fps: 60\n"
+      "}\n"
+      "sommelier { \n"
+      "  condition { steam_game_id: 123 }\n"
+      "  max_fps: 30\n"
+      "}\n"
+      "sommelier { \n"
+      "  condition { steam_game_id: 456 }\n"
+      "  max_fps: 0\n"
+      "}");
+  EXPECT_EQ(ctx.quirks.MaxFps(123), 30u);
+  EXPECT_EQ(ctx.quirks.MaxFps(456), 0u);
+  EXPECT_EQ(ctx.quirks.MaxFps(789), 60u);
+}
+
+TEST_F(QuirksTest, RenderScaleAppliesToMatchingGames) {
+  ctx.quirks.Load(
+      "sommelier { \n"
+      "  condition { steam_game_id: 123 }\n"
+      "  render_scale_percent: 50\n"
+      "  max_fps: 30\n"
+      "}");
+  EXPECT_EQ(ctx.quirks.RenderScalePercent(123), 50u);
+  EXPECT_EQ(ctx.quirks.MaxFps(123), 30u);
+  EXPECT_EQ(ctx.quirks.RenderScalePercent(789), 0u);
+}
+
 }  // namespace vm_tools::sommelier
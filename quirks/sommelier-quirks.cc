@@ -5,6 +5,9 @@
 #include <fcntl.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <google/protobuf/text_format.h>
+#include <libgen.h>
+#include <string.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 #include <xcb/xproto.h>
 #include <map>
@@ -16,6 +19,28 @@
 #include "sommelier-window.h"   // NOLINT(build/include_directory)
 #include "xcb/xcb-shim.h"
 
+// One bit per Feature in GameQuirks::features.
+static_assert(quirks::Feature_ARRAYSIZE <= 64, "too many quirks features");
+
+// Merge the Config textproto at `path` into `config`.
+static bool MergeFromFile(const std::string& path, quirks::Config* config) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    const char* e = strerror(errno);
+    LOG(ERROR) << "failed to open quirks config: " << path << ": " << e;
+    return false;
+  }
+  google::protobuf::io::FileInputStream f(fd);
+  bool merged = google::protobuf::TextFormat::Merge(&f, config);
+  close(fd);
+  return merged;
+}
+
+Quirks::~Quirks() {
+  if (watch_fd_ >= 0)
+    close(watch_fd_);
+}
+
 void Quirks::Load(std::string textproto) {
   google::protobuf::TextFormat::MergeFromString(textproto, &active_config_);
   Update();
@@ -37,17 +62,65 @@ void Quirks::LoadFromCommaSeparatedFiles(const char* paths) {
 }
 
 void Quirks::LoadFromFile(std::string path) {
-  int fd = open(path.c_str(), O_RDONLY);
-  if (fd < 0) {
-    const char* e = strerror(errno);
-    LOG(ERROR) << "failed to open quirks config: " << path << ": " << e;
-    return;
-  }
-  google::protobuf::io::FileInputStream f(fd);
-  if (google::protobuf::TextFormat::Merge(&f, &active_config_)) {
+  paths_.push_back(path);
+  if (MergeFromFile(path, &active_config_)) {
     Update();
   }
-  close(fd);
+}
+
+int Quirks::Watch() {
+  if (watch_fd_ >= 0 || paths_.empty())
+    return watch_fd_;
+
+  watch_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch_fd_ < 0)
+    return -1;
+  // Editors tend to replace files rather than write them in place, so the
+  // directories are watched for files landing in them.
+  for (const std::string& path : paths_) {
+    std::string dir = path;
+    if (inotify_add_watch(watch_fd_, dirname(dir.data()),
+                          IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+      const char* e = strerror(errno);
+      LOG(ERROR) << "failed to watch quirks config: " << path << ": " << e;
+    }
+  }
+  return watch_fd_;
+}
+
+bool Quirks::HandleWatchEvents() {
+  alignas(struct inotify_event) char buffer[4096];
+  bool changed = false;
+  ssize_t length;
+
+  while ((length = read(watch_fd_, buffer, sizeof(buffer))) > 0) {
+    for (char* p = buffer; p < buffer + length;) {
+      const struct inotify_event* event =
+          reinterpret_cast<const struct inotify_event*>(p);
+      for (const std::string& path : paths_) {
+        std::string base = path;
+        if (event->len && strcmp(event->name, basename(base.data())) == 0)
+          changed = true;
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  if (!changed)
+    return false;
+
+  // The new config only replaces the active one once all of it is read, so
+  // a half-written file leaves the rules as they were.
+  quirks::Config config;
+  for (const std::string& path : paths_) {
+    if (!MergeFromFile(path, &config)) {
+      LOG(ERROR) << "keeping previous quirks config";
+      return false;
+    }
+  }
+  active_config_.Swap(&config);
+  Update();
+  LOG(INFO) << "reloaded quirks config";
+  return true;
 }
 
 void Quirks::PrintFeaturesEnabled(uint32_t steam_game_id) {
@@ -62,35 +135,33 @@ void Quirks::PrintFeaturesEnabled(uint32_t steam_game_id) {
   }
 }
 
+const Quirks::GameQuirks& Quirks::ForGame(uint32_t steam_game_id) {
+  auto iter = games_.find(steam_game_id);
+  return iter != games_.end() ? iter->second : always_;
+}
+
 bool Quirks::IsEnabled(uint32_t steam_game_id, int feature) {
-  bool is_enabled = false;
-
-  // Check if feature is enabled while minimizing map looks ups as much as
-  // possible. |feature_to_steam_id_[feature][steam_id]| takes priority over
-  // |always_features_[feature]|. This allows rule ordering to take priority
-  // as we delete |feature_to_steam_id_[feature]| when
-  // |always_features_[feature]| is popoulated.
-  bool steam_id_override = false;
-  auto steam_id_iter = feature_to_steam_id_.find(feature);
-  if (steam_id_iter != feature_to_steam_id_.end()) {
-    auto enabled_iter = steam_id_iter->second.find(steam_game_id);
-    if (enabled_iter != steam_id_iter->second.end()) {
-      steam_id_override = true;
-      is_enabled = enabled_iter->second;
-    }
-  }
-  if (!steam_id_override) {
-    auto always_iter = always_features_.find(feature);
-    if (always_iter != always_features_.end()) {
-      is_enabled = always_iter->second;
-    }
-  }
+  return feature >= 0 && feature < 64 &&
+         (ForGame(steam_game_id).features >> feature & 1);
+}
 
-  return is_enabled;
+uint32_t Quirks::MaxFps(uint32_t steam_game_id) {
+  return ForGame(steam_game_id).max_fps;
+}
+
+uint32_t Quirks::RenderScalePercent(uint32_t steam_game_id) {
+  return ForGame(steam_game_id).render_scale_percent;
 }
 
 bool Quirks::IsEnabled(struct sl_window* window, int feature) {
-  bool is_enabled = IsEnabled(window->steam_game_id, feature);
+  if (window->quirk_generation != generation_ ||
+      window->quirk_steam_game_id != window->steam_game_id) {
+    window->quirk_features = ForGame(window->steam_game_id).features;
+    window->quirk_steam_game_id = window->steam_game_id;
+    window->quirk_generation = generation_;
+  }
+  bool is_enabled = feature >= 0 && feature < 64 &&
+                    (window->quirk_features >> feature & 1);
 
   if (is_enabled && sl_window_should_log_quirk(window, feature)) {
     LOG(INFO) << "Quirk " << quirks::Feature_Name(feature) << " applied to "
@@ -118,8 +189,14 @@ bool Quirks::IsEnabled(struct sl_window* window, int feature) {
 }
 
 void Quirks::Update() {
-  feature_to_steam_id_.clear();
-  always_features_.clear();
+  // Map of Feature ID (see quirks.proto) to Steam game ID to enabled
+  // boolean, where false explicitly disables the Feature for the game.
+  std::map<int, std::map<uint32_t, bool>> feature_to_steam_id;
+  std::map<int, bool> always_features;
+  std::map<uint32_t, uint32_t> steam_id_to_max_fps;
+  uint32_t always_max_fps = 0;
+  std::map<uint32_t, uint32_t> steam_id_to_render_scale;
+  uint32_t always_render_scale = 0;
 
   for (quirks::SommelierRule rule : active_config_.sommelier()) {
     // For now, only support a single instance of a single condition.
@@ -130,25 +207,68 @@ void Quirks::Update() {
       uint32_t id = rule.condition()[0].steam_game_id();
 
       for (int feature : rule.enable()) {
-        feature_to_steam_id_[feature][id] = true;
+        feature_to_steam_id[feature][id] = true;
       }
       for (int feature : rule.disable()) {
-        feature_to_steam_id_[feature][id] = false;
+        feature_to_steam_id[feature][id] = false;
+      }
+      if (rule.has_max_fps()) {
+        steam_id_to_max_fps[id] = rule.max_fps();
+      }
+      if (rule.has_render_scale_percent()) {
+        steam_id_to_render_scale[id] = rule.render_scale_percent();
       }
     } else if (rule.condition()[0].has_always() &&
                rule.condition()[0].always()) {
       for (int feature : rule.enable()) {
-        always_features_[feature] = true;
+        always_features[feature] = true;
         // Clear Steam ID definitions defined so far, so that this always rule
         // takes priority since it is defined later.
-        feature_to_steam_id_.erase(feature);
+        feature_to_steam_id.erase(feature);
       }
       for (int feature : rule.disable()) {
-        always_features_[feature] = false;
+        always_features[feature] = false;
         // Clear Steam ID definitions defined so far, so that this always rule
         // takes priority since it is defined later.
-        feature_to_steam_id_.erase(feature);
+        feature_to_steam_id.erase(feature);
       }
+      if (rule.has_max_fps()) {
+        always_max_fps = rule.max_fps();
+        steam_id_to_max_fps.clear();
+      }
+      if (rule.has_render_scale_percent()) {
+        always_render_scale = rule.render_scale_percent();
+        steam_id_to_render_scale.clear();
+      }
+    }
+  }
+
+  // Steam game ID definitions take priority over always rules left standing.
+  always_ = GameQuirks();
+  for (const auto& [feature, enabled] : always_features) {
+    if (enabled)
+      always_.features |= uint64_t{1} << feature;
+  }
+  always_.max_fps = always_max_fps;
+  always_.render_scale_percent = always_render_scale;
+
+  games_.clear();
+  for (const auto& [feature, games] : feature_to_steam_id) {
+    for (const auto& [id, enabled] : games) {
+      GameQuirks& game = games_.try_emplace(id, always_).first->second;
+      if (enabled)
+        game.features |= uint64_t{1} << feature;
+      else
+        game.features &= ~(uint64_t{1} << feature);
     }
   }
+  for (const auto& [id, max_fps] : steam_id_to_max_fps) {
+    games_.try_emplace(id, always_).first->second.max_fps = max_fps;
+  }
+  for (const auto& [id, percent] : steam_id_to_render_scale) {
+    games_.try_emplace(id, always_).first->second.render_scale_percent =
+        percent;
+  }
+
+  generation_++;
 }
@@ -5,15 +5,21 @@
 #ifndef VM_TOOLS_SOMMELIER_QUIRKS_SOMMELIER_QUIRKS_H_
 #define VM_TOOLS_SOMMELIER_QUIRKS_SOMMELIER_QUIRKS_H_
 
-#include <map>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <google/protobuf/message.h>
 #include "quirks/quirks.pb.h"
 
 class Quirks {
  public:
+  Quirks() = default;
+  Quirks(const Quirks&) = delete;
+  Quirks& operator=(const Quirks&) = delete;
+  ~Quirks();
+
   // Parse `textproto` as a Config proto, and merge it into the active config.
   void Load(std::string textproto);
 
@@ -23,6 +29,14 @@ class Quirks {
   // Load a Config textproto from `path`, and merge it into the active config.
   void LoadFromFile(std::string path);
 
+  // Watch the files loaded so far for changes. Returns a file descriptor to
+  // poll for them, or -1 if they can't be watched.
+  int Watch();
+
+  // Reload the watched files if any of them changed. Returns true if the
+  // active config was replaced.
+  bool HandleWatchEvents();
+
   // Whether the given Feature (from quirks.proto) is enabled for the given
   // `window`, according to the active config.
   bool IsEnabled(struct sl_window* window, int feature);
@@ -31,24 +45,48 @@ class Quirks {
   // game, according to the active config.
   bool IsEnabled(uint32_t steam_game_id, int feature);
 
+  // The frame rate the given game is limited to, or 0 if it isn't.
+  uint32_t MaxFps(uint32_t steam_game_id);
+
+  // The percentage of the host's size the given game's fullscreen windows
+  // are rendered at, or 0 if they're rendered at full size.
+  uint32_t RenderScalePercent(uint32_t steam_game_id);
+
   // Print all the features enabled for the game.
   void PrintFeaturesEnabled(uint32_t steam_game_id);
 
  private:
-  // Repopulate `enabled_features_` from the rules in `active_config_`.
+  // The effects of the active config on one game.
+  struct GameQuirks {
+    // Bit N is set if Feature N is enabled.
+    uint64_t features = 0;
+    uint32_t max_fps = 0;
+    uint32_t render_scale_percent = 0;
+  };
+
+  // The effects of the active config on the given game.
+  const GameQuirks& ForGame(uint32_t steam_game_id);
+
+  // Recompile `games_` and `always_` from the rules in `active_config_`.
   void Update();
 
   // The active rules in protobuf form, accumulated from calls to `Load()`.
   quirks::Config active_config_;
 
-  // The active config in a more easily queryable form.
-  // This is a map of Feature ID (see quirks.proto) to Steam game ID to
-  // enabled boolean. The boolean represents if the Feature is enabled for
-  // the windows with that STEAM_GAME property - note that false explicitly
-  // disables the property.
-  std::map<int, std::map<uint32_t, bool>> feature_to_steam_id_;
+  // The active config compiled for lookups: the games named by rules, with
+  // the always rules they don't override folded in, and `always_` for every
+  // other game.
+  std::unordered_map<uint32_t, GameQuirks> games_;
+  GameQuirks always_;
+
+  // Bumped by every Update(), so that windows know to resolve their quirks
+  // again.
+  uint64_t generation_ = 1;
 
-  std::map<int, bool> always_features_;
+  // The files loaded so far, and the inotify descriptor watching their
+  // directories.
+  std::vector<std::string> paths_;
+  int watch_fd_ = -1;
 };
 
 #endif  // VM_TOOLS_SOMMELIER_QUIRKS_SOMMELIER_QUIRKS_H_
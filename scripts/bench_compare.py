@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+# Copyright 2024 The ChromiumOS Authors
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+"""Compare sommelier_bench results against a baseline.
+
+Record a baseline with the previous release, on the device being measured:
+  sommelier_bench --benchmark_out=baseline.json --benchmark_repetitions=5
+
+Then record the new build the same way and compare:
+  bench_compare.py baseline.json new.json
+
+Benchmarks whose median time grew by more than the threshold are
+reported, and the exit status is 1 if there were any.
+"""
+
+import argparse
+import json
+import statistics
+import sys
+
+
+def read_results(filename):
+    """Read google-benchmark JSON output.
+
+    Args:
+        filename (string): The path to a --benchmark_out file.
+
+    Returns:
+        A dict from benchmark name to its median time in ns. Errored and
+        skipped benchmarks are left out.
+    """
+
+    with open(filename, encoding="utf-8") as f:
+        data = json.load(f)
+
+    times = {}
+    for run in data["benchmarks"]:
+        # Only use the individual repetitions, not the aggregates
+        # google-benchmark adds after them.
+        if run.get("run_type", "iteration") != "iteration":
+            continue
+        if run.get("error_occurred") or run.get("skipped"):
+            continue
+        # Multithreaded benchmarks are measured in wall time, since the
+        # CPU time only covers the calling thread.
+        name = run["run_name"]
+        key = "real_time" if name.endswith("/real_time") else "cpu_time"
+        scale = {"ns": 1, "us": 1e3, "ms": 1e6, "s": 1e9}[run["time_unit"]]
+        times.setdefault(name, []).append(run[key] * scale)
+    return {name: statistics.median(t) for name, t in times.items()}
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("baseline", help="results of the previous release")
+    parser.add_argument("current", help="results of the build under test")
+    parser.add_argument(
+        "--threshold",
+        type=float,
+        default=10,
+        help="slowdown in percent counted as a regression (default: 10)",
+    )
+    args = parser.parse_args(argv)
+
+    baseline = read_results(args.baseline)
+    current = read_results(args.current)
+
+    regressions = 0
+    for name in sorted(baseline.keys() & current.keys()):
+        change = (current[name] / baseline[name] - 1) * 100
+        mark = ""
+        if change > args.threshold:
+            mark = "  REGRESSION"
+            regressions += 1
+        print(
+            f"{name:70} {baseline[name]:12.0f} {current[name]:12.0f} "
+            f"{change:+6.1f}%{mark}"
+        )
+    for name in sorted(baseline.keys() - current.keys()):
+        print(f"{name:70} missing from {args.current}")
+
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
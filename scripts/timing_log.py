@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+# Copyright 2024 The ChromiumOS Authors
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+"""Convert a sommelier binary timing log to text or a trace.
+
+Run sommelier with the timing-filename option to record the log, and send
+it SIGUSR1 to have it written back to disk:
+  sommelier -X --timing-filename=timing.bin glxgears &
+
+Then convert it with:
+  timing_log.py timing.bin > timing.txt
+  timing_log.py --format=json timing.bin > timing.json
+
+The json output is in the Chrome trace event format, which Perfetto UI
+opens directly.
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+
+# Keep these in sync with TimingLogHeader and TimingLogRecord in
+# sommelier-timing.h.
+MAGIC = 0x474C4D54
+VERSION = 1
+HEADER = struct.Struct("<IIIIqQ32x")
+RECORD = struct.Struct("<qiiB")
+TYPES = {1: ("a", "attach"), 2: ("c", "commit"), 3: ("r", "release")}
+
+
+def read_log(filename):
+    """Read a timing log.
+
+    Args:
+        filename (string): The path to the binary timing log.
+
+    Returns:
+        The start time in ns and a list of (time_ns, surface_id, buffer_id,
+        type) tuples, oldest first.
+    """
+
+    with open(filename, "rb") as f:
+        data = f.read()
+
+    (magic, version, capacity, record_size, start_ns, count) = (
+        HEADER.unpack_from(data)
+    )
+    if magic != MAGIC or version != VERSION or record_size != RECORD.size:
+        sys.exit(f"{filename}: not a version {VERSION} timing log")
+
+    first = 0
+    if count > capacity:
+        # The oldest record may have been mid-overwrite.
+        first = count - capacity + 1
+
+    records = []
+    for i in range(first, count):
+        offset = HEADER.size + (i % capacity) * RECORD.size
+        records.append(RECORD.unpack_from(data, offset))
+    return start_ns, records
+
+
+def write_text(start_ns, records, out):
+    """Write the records in the text format buffer_stats.py reads."""
+
+    out.write("Type Surface_ID Buffer_ID Delta_Time\n")
+    last_ns = start_ns
+    for time_ns, sid, bid, action_type in records:
+        name = TYPES.get(action_type, ("?",))[0]
+        out.write(f"{name} {sid} {bid} {(time_ns - last_ns) / 1000:g}\n")
+        last_ns = time_ns
+    sec, nsec = divmod(last_ns, 1000000000)
+    out.write(f"EndTime {len(records) - 1} {sec}.{nsec:09d}\n")
+
+
+def write_json(records, out):
+    """Write the records as instant events, one track per surface."""
+
+    events = []
+    for time_ns, sid, bid, action_type in records:
+        name = TYPES.get(action_type, ("?", "unknown"))[1]
+        events.append(
+            {
+                "name": name,
+                "ph": "i",
+                "s": "t",
+                "ts": time_ns / 1000,
+                "pid": 0,
+                "tid": sid,
+                "args": {"surface_id": sid, "buffer_id": bid},
+            }
+        )
+    json.dump({"traceEvents": events}, out)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("filename", help="binary timing log to convert")
+    parser.add_argument(
+        "--format",
+        choices=("text", "json"),
+        default="text",
+        help="output format (default: text)",
+    )
+    args = parser.parse_args(argv)
+
+    start_ns, records = read_log(args.filename)
+    if args.format == "json":
+        write_json(records, sys.stdout)
+    else:
+        write_text(start_ns, records, sys.stdout)
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
@@ -0,0 +1,474 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "compositor/sommelier-compositor-test.h"  // NOLINT(build/include_directory)
+#include "sommelier.h"                  // NOLINT(build/include_directory)
+#include "sommelier-window.h"           // NOLINT(build/include_directory)
+#include "testing/sommelier-perf-counters.h"  // NOLINT(build/include_directory)
+#include "testing/wayland-test-base.h"  // NOLINT(build/include_directory)
+
+// Handling the same input or frame for the hundredth time shouldn't touch the
+// heap. These tests catch allocations creeping into those paths.
+
+namespace vm_tools {
+namespace sommelier {
+
+namespace {
+
+const int32_t kWidth = 256;
+const int32_t kHeight = 256;
+const int32_t kStride = kWidth * 4;
+const int kWarmUpIterations = 4;
+const int kIterations = 32;
+
+// A client with a single shm buffer, a surface, and the seat's devices.
+class AllocationTestClient : public FakeWaylandClient {
+ public:
+  explicit AllocationTestClient(struct sl_context* ctx)
+      : FakeWaylandClient(ctx) {
+    shm = static_cast<wl_shm*>(
+        wl_registry_bind(client_registry, GlobalName(ctx, &wl_shm_interface),
+                         &wl_shm_interface, 1));
+    seat = static_cast<wl_seat*>(wl_registry_bind(
+        client_registry, GlobalName(ctx, &wl_seat_interface),
+        &wl_seat_interface, WL_SEAT_RELEASE_SINCE_VERSION));
+    pointer = wl_seat_get_pointer(seat);
+    keyboard = wl_seat_get_keyboard(seat);
+    subcompositor = static_cast<wl_subcompositor*>(wl_registry_bind(
+        client_registry, GlobalName(ctx, &wl_subcompositor_interface),
+        &wl_subcompositor_interface, 1));
+
+    fd = memfd_create("sommelier-allocation-test", MFD_CLOEXEC);
+    errno_assert(fd >= 0 && !ftruncate(fd, kStride * kHeight));
+    struct wl_shm_pool* pool = wl_shm_create_pool(shm, fd, kStride * kHeight);
+    buffer = wl_shm_pool_create_buffer(pool, 0, kWidth, kHeight, kStride,
+                                       WL_SHM_FORMAT_XRGB8888);
+    wl_shm_pool_destroy(pool);
+    surface = CreateSurface();
+  }
+
+  ~AllocationTestClient() { close(fd); }
+
+  // Makes the surface a subsurface of a new surface, which is returned.
+  // Subsurfaces start out synchronized.
+  struct wl_surface* CreateParent() {
+    struct wl_surface* parent = CreateSurface();
+    subsurface =
+        wl_subcompositor_get_subsurface(subcompositor, surface, parent);
+    Flush();
+    return parent;
+  }
+
+  // Attaches the buffer again, damages part of it and commits.
+  void Commit(int n) {
+    wl_surface_attach(surface, buffer, 0, 0);
+    wl_surface_damage(surface, n % (kWidth - 16), n % (kHeight - 16), 16, 16);
+    wl_surface_commit(surface);
+    Flush();
+  }
+
+  struct wl_surface* surface = nullptr;
+  struct wl_subsurface* subsurface = nullptr;
+  struct wl_pointer* pointer = nullptr;
+  struct wl_keyboard* keyboard = nullptr;
+
+ private:
+  struct wl_shm* shm = nullptr;
+  struct wl_seat* seat = nullptr;
+  struct wl_subcompositor* subcompositor = nullptr;
+  struct wl_buffer* buffer = nullptr;
+  int fd = -1;
+};
+
+// The host end of the channel, without gmock, whose bookkeeping allocates
+// on every call.
+class HostChannel : public WaylandChannel {
+ public:
+  int32_t init() override { return 0; }
+  bool supports_dmabuf() override { return false; }
+  int32_t create_context(int& out_channel_fd) override { return -EINVAL; }
+  int32_t create_pipe(int& out_pipe_fd) override { return -EINVAL; }
+  int32_t send(const struct WaylandSendReceive& send) override { return 0; }
+  int32_t flush() override { return 0; }
+  int32_t handle_channel_event(enum WaylandChannelEvent& event_type,
+                               struct WaylandSendReceive& receive,
+                               int& out_read_pipe) override {
+    return -EINVAL;
+  }
+  int32_t release_receive(struct WaylandSendReceive& receive) override {
+    return 0;
+  }
+  bool has_pending_event() override { return false; }
+  size_t max_receive_batch() override { return 1; }
+
+  int32_t allocate(const struct WaylandBufferCreateInfo& create_info,
+                   struct WaylandBufferCreateOutput& create_output) override {
+    create_output.fd =
+        memfd_create("sommelier-allocation-test-output", MFD_CLOEXEC);
+    errno_assert(create_output.fd >= 0 &&
+                 !ftruncate(create_output.fd, create_info.size));
+    create_output.host_size = create_info.size;
+    return 0;
+  }
+  void free_buffer(
+      const struct WaylandBufferCreateInfo& create_info,
+      const struct WaylandBufferCreateOutput& create_output) override {
+    close(create_output.fd);
+  }
+
+  int32_t prefetch_allocation(const struct WaylandBufferCreateInfo& create_info,
+                              int& out_fence_fd) override {
+    out_fence_fd = -1;
+    return 0;
+  }
+  int32_t handle_fence(int fence_fd, int& out_fence_fd) override {
+    return -EINVAL;
+  }
+  int32_t sync(int dmabuf_fd, uint64_t flags) override { return 0; }
+  int32_t import_shm(int shm_fd, size_t size, int& out_dmabuf_fd) override {
+    return -EOPNOTSUPP;
+  }
+  int32_t handle_pipe(int read_fd, bool readable, bool& hang_up) override {
+    return 0;
+  }
+  size_t max_send_size() override { return DEFAULT_BUFFER_SIZE; }
+};
+
+class AllocationTest : public WaylandTestBase {
+ public:
+  void SetUp() override {
+    WaylandTestBase::SetUp();
+    // Everything sommelier sends the host from here on skips the mock.
+    ctx.channel = &host_channel;
+
+    client = std::make_unique<AllocationTestClient>(&ctx);
+    Pump();
+    host_surface = Server<sl_host_surface>(client->surface);
+  }
+
+  void TearDown() override {
+    client.reset();
+    WaylandTestBase::TearDown();
+  }
+
+ protected:
+  void Connect() override {
+    WaylandTestBase::Connect();
+    sl_registry_handler(&ctx, wl_display_get_registry(ctx.display),
+                        next_server_id++, "wl_shm", 1);
+    sl_registry_handler(&ctx, wl_display_get_registry(ctx.display),
+                        next_server_id++, "wl_subcompositor", 1);
+  }
+
+  // Returns sommelier's object for a proxy of the client.
+  template <typename T, typename Proxy>
+  T* Server(Proxy* proxy) {
+    struct wl_resource* resource = wl_client_get_object(
+        client->client, wl_proxy_get_id(reinterpret_cast<wl_proxy*>(proxy)));
+    return static_cast<T*>(wl_resource_get_user_data(resource));
+  }
+
+  // Handles the requests the client sent and forwards them to the host,
+  // counting the heap allocations that took.
+  uint64_t CountPumpAllocations() {
+    uint64_t before = PerfAllocationCount();
+    Pump();
+    return PerfAllocationCount() - before;
+  }
+
+  HostChannel host_channel;
+  std::unique_ptr<AllocationTestClient> client;
+  struct sl_host_surface* host_surface = nullptr;
+};
+
+}  // namespace
+
+TEST_F(AllocationTest, SteadyStateCommitDoesNotAllocate) {
+  uint64_t allocations = 0;
+
+  // The first frames allocate the output buffer and the copy list.
+  for (int n = 0; n < kWarmUpIterations + kIterations; ++n) {
+    client->Commit(n);
+    uint64_t frame_allocations = CountPumpAllocations();
+    if (n >= kWarmUpIterations)
+      allocations += frame_allocations;
+    sl_host_surface_release_busy_buffers(host_surface);
+  }
+
+  EXPECT_EQ(ctx.metrics.output_buffers_allocated, 1u);
+  EXPECT_EQ(allocations, 0u);
+}
+
+TEST_F(AllocationTest, ReleasedOutputBuffersAreTrimmedToBudget) {
+  const size_t kBufferSize = kStride * kHeight;
+  ctx.output_buffer_budget = 2 * kBufferSize;
+
+  // The host holds on to every buffer, so each commit needs a new one.
+  for (int n = 0; n < 3; ++n) {
+    client->Commit(n);
+    Pump();
+  }
+  EXPECT_EQ(ctx.output_buffer_bytes, 3 * kBufferSize);
+  EXPECT_EQ(ctx.metrics.output_buffers_trimmed, 0u);
+
+  // Once released, the oldest is dropped. The one on screen stays.
+  sl_host_surface_release_busy_buffers(host_surface);
+  EXPECT_EQ(ctx.output_buffer_bytes, 2 * kBufferSize);
+  EXPECT_EQ(ctx.metrics.output_buffers_trimmed, 1u);
+  EXPECT_NE(host_surface->current_buffer, nullptr);
+}
+
+TEST_F(AllocationTest, UnchangedCursorIsNotCopiedAgain) {
+  // Like toolkits do, the same cursor is set again with every update.
+  for (int n = 0; n < 3; ++n) {
+    wl_pointer_set_cursor(client->pointer, 1, client->surface, 0, 0);
+    client->Commit(n);
+    Pump();
+  }
+
+  EXPECT_EQ(ctx.metrics.cursor_sets_dropped, 2u);
+  EXPECT_EQ(ctx.metrics.cursor_copies_skipped, 2u);
+  EXPECT_EQ(ctx.metrics.bytes_copied, static_cast<uint64_t>(kStride) * kHeight);
+}
+
+TEST_F(AllocationTest, SynchronizedSubsurfaceCommitsWaitForTheParent) {
+  struct wl_surface* parent = client->CreateParent();
+  Pump();
+
+  client->Commit(0);
+  wl_surface_commit(client->surface);
+  client->Flush();
+  Pump();
+  EXPECT_EQ(ctx.metrics.commits, 0u);
+  EXPECT_EQ(ctx.metrics.sync_commits_merged, 1u);
+
+  // The parent's commit applies the held one first, with a single copy.
+  wl_surface_commit(parent);
+  client->Flush();
+  Pump();
+  EXPECT_EQ(ctx.metrics.commits, 2u);
+  EXPECT_EQ(ctx.metrics.bytes_copied, static_cast<uint64_t>(kStride) * kHeight);
+}
+
+TEST_F(AllocationTest, PendingStateGoesOutAfterTheHeldCommit) {
+  client->CreateParent();
+  Pump();
+
+  client->Commit(0);
+  Pump();
+  EXPECT_EQ(ctx.metrics.commits, 0u);
+
+  // The next frame's scale mustn't be taken in by the held commit.
+  wl_surface_set_buffer_scale(client->surface, 2);
+  client->Flush();
+  Pump();
+  EXPECT_EQ(ctx.metrics.commits, 1u);
+  EXPECT_FALSE(host_surface->sync_commit_pending);
+  EXPECT_EQ(host_surface->contents_scale, 2);
+}
+
+TEST_F(AllocationTest, FencedCommitIsDeferredUntilTheFenceSignals) {
+  int fence[2];
+  ASSERT_EQ(pipe(fence), 0);
+  // A role, so that commits go to the host right away.
+  client->CreateParent();
+  wl_subsurface_set_desync(client->subsurface);
+  client->Flush();
+  Pump();
+
+  // The fence is unsignaled while the pipe is empty.
+  sl_context_wait_for_fence(&ctx, host_surface, fence[0]);
+  client->Commit(0);
+  Pump();
+  EXPECT_EQ(ctx.metrics.commits, 1u);
+  EXPECT_TRUE(host_surface->commit_deferred);
+
+  ASSERT_EQ(write(fence[1], "", 1), 1);
+  Pump();
+  EXPECT_FALSE(host_surface->commit_deferred);
+  EXPECT_EQ(host_surface->commit_blockers, 0);
+  close(fence[1]);
+}
+
+TEST_F(AllocationTest, PendingStateWaitsForTheDeferredCommit) {
+  int fence[2];
+  ASSERT_EQ(pipe(fence), 0);
+  client->CreateParent();
+  wl_subsurface_set_desync(client->subsurface);
+  client->Flush();
+  Pump();
+
+  sl_context_wait_for_fence(&ctx, host_surface, fence[0]);
+  client->Commit(0);
+  Pump();
+  EXPECT_TRUE(host_surface->commit_deferred);
+
+  // Signaled, but the scale for the next frame is handled before the
+  // fence's event, so it finishes the wait itself.
+  ASSERT_EQ(write(fence[1], "", 1), 1);
+  sl_host_surface_apply_held_commit(host_surface);
+  EXPECT_FALSE(host_surface->commit_deferred);
+  EXPECT_TRUE(wl_list_empty(&ctx.fence_waits));
+  close(fence[1]);
+}
+
+TEST_F(AllocationTest, RoleStateWaitsForTheDeferredCopy) {
+  sl_context_init_commit_pipeline(&ctx, event_loop);
+  struct xdg_surface* xdg_surface =
+      xdg_wm_base_get_xdg_surface(client->GetXdgWmBase(), client->surface);
+  client->Flush();
+  Pump();
+
+  client->Commit(0);
+  Pump();
+  EXPECT_TRUE(host_surface->commit_deferred);
+
+  // Without the pipeline's event, only the geometry for the next frame
+  // can send the commit waiting on the copy.
+  ctx.commit_pipeline_event_source.reset();
+  xdg_surface_set_window_geometry(xdg_surface, 0, 0, kWidth, kHeight);
+  client->Flush();
+  Pump();
+  EXPECT_FALSE(host_surface->commit_deferred);
+  EXPECT_TRUE(ctx.commit_pipeline->idle());
+
+  delete ctx.commit_pipeline;
+  ctx.commit_pipeline = nullptr;
+}
+
+TEST_F(AllocationTest, DeferredSubsurfaceCommitHoldsTheParentBack) {
+  int fence[2];
+  ASSERT_EQ(pipe(fence), 0);
+  struct wl_surface* parent = client->CreateParent();
+  Pump();
+  struct sl_host_surface* parent_host = Server<sl_host_surface>(parent);
+
+  sl_context_wait_for_fence(&ctx, host_surface, fence[0]);
+  client->Commit(0);
+  wl_surface_commit(parent);
+  client->Flush();
+  Pump();
+  EXPECT_TRUE(host_surface->commit_deferred);
+  EXPECT_EQ(parent_host->commit_blockers, 1);
+
+  ASSERT_EQ(write(fence[1], "", 1), 1);
+  Pump();
+  EXPECT_FALSE(host_surface->commit_deferred);
+  EXPECT_EQ(parent_host->commit_blockers, 0);
+  EXPECT_TRUE(wl_list_empty(&parent_host->deferred_children));
+  close(fence[1]);
+}
+
+TEST_F(AllocationTest, HiddenWindowIsCopiedAgainOnceShown) {
+  ctx.hidden_frame_interval_ms = 1000;
+  client->CreateParent();
+  wl_subsurface_set_desync(client->subsurface);
+  client->Flush();
+  Pump();
+  struct sl_window window(&ctx, 1, 0, 0, kWidth, kHeight, 0);
+  host_surface->window = &window;
+  client->Commit(0);
+  Pump();
+  uint64_t bytes_copied = ctx.metrics.bytes_copied;
+
+  // Minimized, the window's commits aren't copied.
+  window.host_minimized = true;
+  client->Commit(1);
+  Pump();
+  EXPECT_EQ(ctx.metrics.hidden_copies_skipped, 1u);
+  EXPECT_EQ(ctx.metrics.bytes_copied, bytes_copied);
+  EXPECT_NE(host_surface->hidden_contents, nullptr);
+
+  // Shown again, the skipped copy is made into a buffer the host released
+  // and committed, without another commit from the client.
+  sl_host_surface_release_busy_buffers(host_surface);
+  uint64_t allocated = ctx.metrics.output_buffers_allocated;
+  window.host_minimized = false;
+  sl_host_surface_release_hidden(host_surface);
+  EXPECT_EQ(host_surface->hidden_contents, nullptr);
+  EXPECT_GT(ctx.metrics.bytes_copied, bytes_copied);
+  EXPECT_EQ(ctx.metrics.output_buffers_allocated, allocated);
+  EXPECT_FALSE(wl_list_empty(&host_surface->busy_buffers));
+  EXPECT_EQ(ctx.metrics.commits, 2u);
+  host_surface->window = nullptr;
+}
+
+TEST_F(AllocationTest, PendingStateLeavesTheHiddenCopyToTheNextCommit) {
+  ctx.hidden_frame_interval_ms = 1000;
+  struct sl_window window(&ctx, 1, 0, 0, kWidth, kHeight, 0);
+  host_surface->window = &window;
+  client->Commit(0);
+  Pump();
+  window.host_minimized = true;
+  client->Commit(1);
+  Pump();
+  uint64_t bytes_copied = ctx.metrics.bytes_copied;
+
+  // The client has started on its next frame, which mustn't go out along
+  // with the old buffer.
+  wl_surface_damage(client->surface, 0, 0, 16, 16);
+  client->Flush();
+  Pump();
+  sl_host_surface_release_busy_buffers(host_surface);
+  window.host_minimized = false;
+  sl_host_surface_release_hidden(host_surface);
+  EXPECT_EQ(host_surface->hidden_contents, nullptr);
+  EXPECT_EQ(ctx.metrics.bytes_copied, bytes_copied);
+  host_surface->window = nullptr;
+}
+
+TEST_F(AllocationTest, SteadyStatePointerMotionDoesNotAllocate) {
+  struct sl_host_pointer* host_pointer =
+      Server<sl_host_pointer>(client->pointer);
+  const wl_pointer_listener* listener = HostEventHandler(host_pointer->proxy);
+  listener->enter(nullptr, host_pointer->proxy, 1, host_surface->proxy, 0, 0);
+  listener->frame(nullptr, host_pointer->proxy);
+
+  uint64_t before = PerfAllocationCount();
+  for (int i = 0; i < kIterations; ++i) {
+    listener->motion(nullptr, host_pointer->proxy, i, wl_fixed_from_int(i),
+                     wl_fixed_from_int(kIterations - i));
+    listener->frame(nullptr, host_pointer->proxy);
+  }
+
+  EXPECT_EQ(PerfAllocationCount() - before, 0u);
+}
+
+TEST_F(AllocationTest, SteadyStateKeyboardEventsDoNotAllocate) {
+  struct sl_host_keyboard* host_keyboard =
+      Server<sl_host_keyboard>(client->keyboard);
+  const wl_keyboard_listener* listener =
+      HostEventHandler(host_keyboard->proxy);
+  struct wl_array keys;
+  wl_array_init(&keys);
+  listener->enter(nullptr, host_keyboard->proxy, 1, host_surface->proxy,
+                  &keys);
+  wl_array_release(&keys);
+
+  // The first press grows the set of pressed keys.
+  uint32_t serial = 2;
+  listener->key(nullptr, host_keyboard->proxy, serial++, 0, KEY_A,
+                WL_KEYBOARD_KEY_STATE_PRESSED);
+  listener->key(nullptr, host_keyboard->proxy, serial++, 0, KEY_A,
+                WL_KEYBOARD_KEY_STATE_RELEASED);
+
+  uint64_t before = PerfAllocationCount();
+  for (int i = 0; i < kIterations; ++i) {
+    listener->key(nullptr, host_keyboard->proxy, serial++, i, KEY_A,
+                  WL_KEYBOARD_KEY_STATE_PRESSED);
+    listener->modifiers(nullptr, host_keyboard->proxy, serial++, 0, 0, 0, 0);
+    listener->key(nullptr, host_keyboard->proxy, serial++, i, KEY_A,
+                  WL_KEYBOARD_KEY_STATE_RELEASED);
+  }
+
+  EXPECT_EQ(PerfAllocationCount() - before, 0u);
+}
+
+}  // namespace sommelier
+}  // namespace vm_tools
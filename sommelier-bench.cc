@@ -0,0 +1,119 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+#include "sommelier.h"            // NOLINT(build/include_directory)
+#include "sommelier-ctx.h"        // NOLINT(build/include_directory)
+#include "sommelier-transform.h"  // NOLINT(build/include_directory)
+#include "sommelier-window.h"     // NOLINT(build/include_directory)
+
+#ifdef QUIRKS_SUPPORT
+#include "quirks/quirks.pb.h"
+#endif
+
+namespace vm_tools {
+namespace sommelier {
+
+namespace {
+
+// Args: direct scale, scale in percent.
+void BM_TransformRoundTrip(benchmark::State& state) {
+  sl_context ctx;
+  sl_host_surface surface;
+  sl_context_init_default(&ctx);
+  ctx.stable_scaling = true;
+  ctx.use_direct_scale = state.range(0);
+  ctx.scale = state.range(1) / 100.0;
+  sl_transform_reset_surface_scale(&ctx, &surface);
+
+  int32_t x = 0;
+  int32_t y = 0;
+  wl_fixed_t fx = 0;
+  wl_fixed_t fy = 0;
+  for (auto _ : state) {
+    x = 1234;
+    y = 567;
+    fx = wl_fixed_from_int(1234);
+    fy = wl_fixed_from_int(567);
+    sl_transform_host_to_guest(&ctx, &surface, &x, &y);
+    sl_transform_guest_to_host(&ctx, &surface, &x, &y);
+    sl_transform_pointer(&ctx, &surface, &fx, &fy);
+    benchmark::DoNotOptimize(x);
+    benchmark::DoNotOptimize(y);
+    benchmark::DoNotOptimize(fx);
+    benchmark::DoNotOptimize(fy);
+  }
+}
+BENCHMARK(BM_TransformRoundTrip)
+    ->ArgNames({"direct", "scale"})
+    ->ArgsProduct({{0, 1}, {100, 125, 200}});
+
+void BM_TransformDamageCoord(benchmark::State& state) {
+  sl_context ctx;
+  sl_host_surface surface;
+  sl_context_init_default(&ctx);
+  ctx.stable_scaling = true;
+  ctx.use_direct_scale = state.range(0);
+  ctx.scale = 1.25;
+  sl_transform_reset_surface_scale(&ctx, &surface);
+
+  for (auto _ : state) {
+    int64_t x1 = 16, y1 = 16, x2 = 640, y2 = 480;
+    sl_transform_damage_coord(&ctx, &surface, 1.6, 1.6, &x1, &y1, &x2, &y2);
+    benchmark::DoNotOptimize(x1);
+    benchmark::DoNotOptimize(y2);
+  }
+}
+BENCHMARK(BM_TransformDamageCoord)->ArgName("direct")->Arg(0)->Arg(1);
+
+// Looks up every window in turn, with |state.range(0)| windows mapped.
+void BM_LookupWindow(benchmark::State& state) {
+  sl_context ctx;
+  sl_context_init_default(&ctx);
+
+  std::vector<sl_window*> windows;
+  for (int64_t i = 0; i < state.range(0); ++i)
+    windows.push_back(new sl_window(&ctx, 0x200000 + i, 0, 0, 1, 1, 0));
+
+  size_t next = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(sl_lookup_window(&ctx, windows[next]->id));
+    if (++next == windows.size())
+      next = 0;
+  }
+
+  for (sl_window* window : windows)
+    delete window;
+}
+BENCHMARK(BM_LookupWindow)->RangeMultiplier(8)->Range(8, 4096);
+
+#ifdef QUIRKS_SUPPORT
+void BM_QuirksIsEnabled(benchmark::State& state) {
+  Quirks quirks;
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    quirks.Load("sommelier {\n  condition { steam_game_id: " +
+                std::to_string(1000 + i) +
+                " }\n  enable: FEATURE_X11_MOVE_WINDOWS\n}");
+  }
+
+  uint32_t game = 1000;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        quirks.IsEnabled(game, quirks::FEATURE_X11_MOVE_WINDOWS));
+    game = game + 1 < 1000 + state.range(0) ? game + 1 : 1000;
+  }
+}
+BENCHMARK(BM_QuirksIsEnabled)->RangeMultiplier(8)->Range(1, 512);
+#endif  // QUIRKS_SUPPORT
+
+}  // namespace
+
+}  // namespace sommelier
+}  // namespace vm_tools
+
+BENCHMARK_MAIN();
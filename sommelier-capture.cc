@@ -0,0 +1,221 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-capture.h"  // NOLINT(build/include_directory)
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wayland-server.h>
+
+#include <memory>
+
+#include "sommelier-logging.h"               // NOLINT(build/include_directory)
+#include "sommelier-util.h"                  // NOLINT(build/include_directory)
+#include "virtualization/wayland_channel.h"  // NOLINT(build/include_directory)
+
+struct sl_capture {
+  FILE* file;
+  int64_t start_time_ns;
+  // Whether the contents of files are saved, not just their checksums.
+  bool file_contents;
+
+  // The client connection, and our end of the one libwayland serves, while
+  // proxying a client.
+  int client_fd;
+  int proxy_fd;
+  std::unique_ptr<struct wl_event_source> client_event_source;
+  std::unique_ptr<struct wl_event_source> proxy_event_source;
+};
+
+static uint64_t sl_capture_checksum(const uint8_t* data, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static void sl_capture_write_fd(struct sl_capture* capture, int fd) {
+  struct sl_capture_fd entry = {};
+  struct stat st;
+  void* contents = MAP_FAILED;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    entry.kind = SL_CAPTURE_FD_FILE;
+    entry.size = st.st_size;
+    if (entry.size)
+      contents = mmap(nullptr, entry.size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+
+  if (contents != MAP_FAILED) {
+    entry.checksum =
+        sl_capture_checksum(static_cast<uint8_t*>(contents), entry.size);
+    entry.has_contents = capture->file_contents;
+  }
+  fwrite(&entry, sizeof(entry), 1, capture->file);
+
+  if (contents != MAP_FAILED) {
+    if (entry.has_contents)
+      fwrite(contents, 1, entry.size, capture->file);
+    munmap(contents, entry.size);
+  }
+}
+
+struct sl_capture* sl_capture_open(const char* path, bool file_contents) {
+  FILE* file = fopen(path, "we");
+  if (!file) {
+    LOG(ERROR) << "failed to create capture file " << path << ": "
+               << strerror(errno);
+    return nullptr;
+  }
+
+  struct sl_capture* capture = new sl_capture();
+  capture->file = file;
+  capture->start_time_ns = sl_monotonic_time_ns();
+  capture->file_contents = file_contents;
+  capture->client_fd = -1;
+  capture->proxy_fd = -1;
+
+  struct sl_capture_header header = {SL_CAPTURE_MAGIC, SL_CAPTURE_VERSION,
+                                     capture->start_time_ns};
+  fwrite(&header, sizeof(header), 1, file);
+  return capture;
+}
+
+void sl_capture_record(struct sl_capture* capture,
+                       enum sl_capture_source source,
+                       const uint8_t* data,
+                       size_t size,
+                       const int* fds,
+                       size_t num_fds) {
+  struct sl_capture_record record = {};
+
+  record.time_ns = sl_monotonic_time_ns() - capture->start_time_ns;
+  record.size = size;
+  record.source = source;
+  record.num_fds = num_fds;
+  fwrite(&record, sizeof(record), 1, capture->file);
+  fwrite(data, 1, size, capture->file);
+  for (size_t i = 0; i < num_fds; ++i)
+    sl_capture_write_fd(capture, fds[i]);
+}
+
+static void sl_capture_stop_proxy(struct sl_capture* capture) {
+  capture->client_event_source.reset();
+  capture->proxy_event_source.reset();
+  if (capture->client_fd >= 0)
+    close(capture->client_fd);
+  if (capture->proxy_fd >= 0)
+    close(capture->proxy_fd);
+  capture->client_fd = -1;
+  capture->proxy_fd = -1;
+}
+
+// Moves one message, and any fds, from |from| to |to|. Returns false once
+// either end is gone.
+static bool sl_capture_relay(struct sl_capture* capture,
+                             int from,
+                             int to,
+                             bool record) {
+  uint8_t data[DEFAULT_BUFFER_SIZE];
+  char fd_buffer[CMSG_LEN(sizeof(int) * WAYLAND_MAX_FDs)];
+  struct iovec iov = {data, sizeof(data)};
+  struct msghdr msg = {};
+  int fds[WAYLAND_MAX_FDs];
+  size_t num_fds = 0;
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = fd_buffer;
+  msg.msg_controllen = sizeof(fd_buffer);
+
+  ssize_t bytes = recvmsg(from, &msg, MSG_CMSG_CLOEXEC);
+  if (bytes <= 0)
+    return false;
+
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(&fds[num_fds], CMSG_DATA(cmsg), count * sizeof(int));
+    num_fds += count;
+  }
+
+  if (record) {
+    sl_capture_record(capture, SL_CAPTURE_CLIENT, data, bytes, fds, num_fds);
+  }
+
+  // Pass the message on as it was received.
+  iov.iov_len = bytes;
+  msg.msg_controllen = 0;
+  if (num_fds) {
+    msg.msg_controllen = CMSG_LEN(num_fds * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = msg.msg_controllen;
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+  }
+  bool sent = sendmsg(to, &msg, MSG_NOSIGNAL) == bytes;
+
+  while (num_fds--)
+    close(fds[num_fds]);
+  return sent;
+}
+
+static int sl_handle_capture_client_event(int fd, uint32_t mask, void* data) {
+  struct sl_capture* capture = static_cast<struct sl_capture*>(data);
+
+  if (!(mask & WL_EVENT_READABLE) ||
+      !sl_capture_relay(capture, fd, capture->proxy_fd, /*record=*/true)) {
+    sl_capture_stop_proxy(capture);
+    return 0;
+  }
+  return 1;
+}
+
+static int sl_handle_capture_proxy_event(int fd, uint32_t mask, void* data) {
+  struct sl_capture* capture = static_cast<struct sl_capture*>(data);
+
+  if (!(mask & WL_EVENT_READABLE) ||
+      !sl_capture_relay(capture, fd, capture->client_fd, /*record=*/false)) {
+    sl_capture_stop_proxy(capture);
+    return 0;
+  }
+  return 1;
+}
+
+int sl_capture_proxy_client(struct sl_capture* capture,
+                            struct wl_event_loop* event_loop,
+                            int client_fd) {
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+    LOG(ERROR) << "failed to create capture socket: " << strerror(errno);
+    return -1;
+  }
+
+  capture->client_fd = client_fd;
+  capture->proxy_fd = sv[1];
+  capture->client_event_source.reset(
+      wl_event_loop_add_fd(event_loop, client_fd, WL_EVENT_READABLE,
+                           sl_handle_capture_client_event, capture));
+  capture->proxy_event_source.reset(
+      wl_event_loop_add_fd(event_loop, sv[1], WL_EVENT_READABLE,
+                           sl_handle_capture_proxy_event, capture));
+  return sv[0];
+}
+
+void sl_capture_close(struct sl_capture* capture) {
+  sl_capture_stop_proxy(capture);
+  fclose(capture->file);
+  delete capture;
+}
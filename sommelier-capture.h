@@ -0,0 +1,84 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_SOMMELIER_CAPTURE_H_
+#define VM_TOOLS_SOMMELIER_SOMMELIER_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct sl_capture;
+struct wl_event_loop;
+
+// A capture file is a sl_capture_header followed by records, each one a
+// sl_capture_record, its message bytes, and a sl_capture_fd for each fd
+// passed along with it. Every field is little-endian.
+#define SL_CAPTURE_MAGIC 0x50414353  // "SCAP"
+#define SL_CAPTURE_VERSION 1
+
+struct sl_capture_header {
+  uint32_t magic;
+  uint32_t version;
+  // CLOCK_MONOTONIC time the capture started at.
+  int64_t start_time_ns;
+};
+
+// Where a captured message was headed. Only messages into sommelier are
+// recorded, since the rest follow from them.
+enum sl_capture_source : uint8_t {
+  SL_CAPTURE_CLIENT = 1,  // From the Wayland client
+  SL_CAPTURE_HOST = 2,    // From the host compositor
+};
+
+struct sl_capture_record {
+  // Time since the capture started.
+  int64_t time_ns;
+  uint32_t size;
+  uint8_t source;
+  uint8_t num_fds;
+  uint8_t pad[2];
+};
+
+enum sl_capture_fd_kind : uint8_t {
+  // Pipes and sockets, which are replayed as a pipe at end of file.
+  SL_CAPTURE_FD_OTHER = 0,
+  // Regular files and shared memory, which are replayed as a memfd of the
+  // same size.
+  SL_CAPTURE_FD_FILE = 1,
+};
+
+// Followed by |size| bytes of file contents if |has_contents| is set.
+struct sl_capture_fd {
+  uint64_t size;
+  // FNV-1a hash of the contents when they were sent, or 0 if they couldn't
+  // be read.
+  uint64_t checksum;
+  uint8_t kind;
+  uint8_t has_contents;
+  uint8_t pad[6];
+};
+
+// Starts a capture into |path|, replacing it. Returns nullptr if the file
+// couldn't be created.
+struct sl_capture* sl_capture_open(const char* path, bool file_contents);
+
+// Records a message and the fds sent along with it. The fds stay open.
+void sl_capture_record(struct sl_capture* capture,
+                       enum sl_capture_source source,
+                       const uint8_t* data,
+                       size_t size,
+                       const int* fds,
+                       size_t num_fds);
+
+// Relays everything between |client_fd| and a new socket, recording what the
+// client sends. Returns the new socket for libwayland to serve the client
+// on, or -1 on failure.
+int sl_capture_proxy_client(struct sl_capture* capture,
+                            struct wl_event_loop* event_loop,
+                            int client_fd);
+
+// Finishes the capture file and stops proxying.
+void sl_capture_close(struct sl_capture* capture);
+
+#endif  // VM_TOOLS_SOMMELIER_SOMMELIER_CAPTURE_H_
@@ -4,22 +4,41 @@
 
 #include "sommelier-ctx.h"  // NOLINT(build/include_directory)
 
+#include <algorithm>
 #include <assert.h>
 #include <cerrno>
 #include <cstdlib>
+#include <gbm.h>
+#include <poll.h>
 #include <string>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <wayland-client.h>
 #include <wayland-util.h>
 
 #include "aura-shell-client-protocol.h"  // NOLINT(build/include_directory)
+#include "compositor/sommelier-copy.h"   // NOLINT(build/include_directory)
 #include "sommelier.h"                   // NOLINT(build/include_directory)
+#include "sommelier-capture.h"           // NOLINT(build/include_directory)
+#include "sommelier-io-uring.h"          // NOLINT(build/include_directory)
 #include "sommelier-logging.h"           // NOLINT(build/include_directory)
 #include "sommelier-tracing.h"           // NOLINT(build/include_directory)
 
 // TODO(b/173147612): Use container_token rather than this name.
 #define DEFAULT_VM_NAME "termina"
 
+// Enough for a handful of typical menus and popups.
+#define DEFAULT_OUTPUT_BUFFER_POOL_LIMIT (32 * 1024 * 1024)
+#define DEFAULT_DAMAGE_RECT_LIMIT 32
+
+// How long forwarding to the host waits on a fence before assuming the GPU
+// hung.
+#define FENCE_WAIT_TIMEOUT_MS 1000
+
+// Housekeeping tasks run at the next multiple of this after they are due,
+// so that one wakeup serves all the tasks due within the same stretch.
+#define HOUSEKEEPING_SLACK_NS 1000000000
+
 // Returns the string mapped to the given ATOM_ enum value.
 //
 // Note this is NOT the atom value sent via the X protocol, despite both being
@@ -100,6 +119,14 @@ const char* sl_context_atom_name(int atom_enum) {
       return "INCR";
     case ATOM_WL_SELECTION:
       return "_WL_SELECTION";
+    case ATOM_WL_SELECTION_SEND_0:
+      return "_WL_SELECTION_SEND_0";
+    case ATOM_WL_SELECTION_SEND_1:
+      return "_WL_SELECTION_SEND_1";
+    case ATOM_WL_SELECTION_SEND_2:
+      return "_WL_SELECTION_SEND_2";
+    case ATOM_WL_SELECTION_SEND_3:
+      return "_WL_SELECTION_SEND_3";
     case ATOM_GTK_THEME_VARIANT:
       return "_GTK_THEME_VARIANT";
     case ATOM_STEAM_GAME:
@@ -116,8 +143,11 @@ void sl_context_init_default(struct sl_context* ctx) {
   *ctx = {0};
   ctx->runprog = nullptr;
   ctx->display = nullptr;
+  ctx->registry = nullptr;
   ctx->host_display = nullptr;
   ctx->client = nullptr;
+  ctx->client_thread = false;
+  ctx->client_destroyed = false;
   ctx->compositor = nullptr;
   ctx->subcompositor = nullptr;
   ctx->shm = nullptr;
@@ -132,6 +162,7 @@ void sl_context_init_default(struct sl_context* ctx) {
   ctx->text_input_extension = nullptr;
   ctx->xdg_output_manager = nullptr;
   ctx->fractional_scale_manager = nullptr;
+  ctx->presentation = nullptr;
 #ifdef GAMEPAD_SUPPORT
   ctx->gaming_input_manager = nullptr;
   ctx->gaming_seat = nullptr;
@@ -146,11 +177,17 @@ void sl_context_init_default(struct sl_context* ctx) {
   ctx->virtwl_display_fd = -1;
   ctx->wayland_channel_event_source = nullptr;
   ctx->virtwl_socket_event_source = nullptr;
+  ctx->use_io_uring = false;
+  ctx->virtwl_socket_ring = nullptr;
+  ctx->host_flushes = 0;
+  ctx->host_flush_pending = false;
+  ctx->pending_host_callbacks = 0;
   ctx->vm_id = DEFAULT_VM_NAME;
   ctx->drm_device = nullptr;
   ctx->gbm = nullptr;
   ctx->xwayland = 0;
   ctx->xwayland_pid = -1;
+  ctx->lazy_xwayland = nullptr;
   ctx->child_pid = -1;
   ctx->peer_pid = -1;
   ctx->xkb_context = nullptr;
@@ -162,6 +199,8 @@ void sl_context_init_default(struct sl_context* ctx) {
   ctx->window = 0;
   ctx->host_focus_window = nullptr;
   ctx->needs_set_input_focus = 0;
+  ctx->restack_pending = false;
+  ctx->restack_sequence = 0;
   ctx->desired_scale = 1.0;
   ctx->scale = 1.0;
   ctx->virt_scale_x = 1.0;
@@ -172,6 +211,7 @@ void sl_context_init_default(struct sl_context* ctx) {
   ctx->application_id_property_name = nullptr;
   ctx->exit_with_child = 1;
   ctx->sd_notify = nullptr;
+  ctx->startup_report = nullptr;
   ctx->clipboard_manager = 0;
   ctx->frame_color = 0xffffffff;
   ctx->dark_frame_color = 0xff000000;
@@ -190,11 +230,10 @@ void sl_context_init_default(struct sl_context* ctx) {
   ctx->selection_data_device = nullptr;
   ctx->selection_data_offer = nullptr;
   ctx->selection_data_source = nullptr;
-  ctx->selection_data_source_send_fd = -1;
-  ctx->selection_send_event_source = nullptr;
-  ctx->selection_property_reply = nullptr;
-  ctx->selection_property_offset = 0;
+  ctx->selection_targets_owner = XCB_WINDOW_NONE;
+  ctx->selection_targets_timestamp = XCB_CURRENT_TIME;
   ctx->selection_event_source = nullptr;
+  ctx->selection_chunk_size = 0;
   ctx->selection_data_offer_receive_fd = -1;
   ctx->selection_data_ack_pending = 0;
   for (unsigned i = 0; i < ARRAY_SIZE(ctx->atoms); i++) {
@@ -210,10 +249,41 @@ void sl_context_init_default(struct sl_context* ctx) {
   ctx->enable_xshape = false;
   ctx->enable_x11_move_windows = false;
   ctx->trace_system = false;
+  ctx->trace_time_sync_interval_ms = 100;
   ctx->use_direct_scale = false;
   ctx->stable_scaling = false;
   ctx->frame_stats = nullptr;
+  ctx->metrics = {};
+  ctx->stall_budget_ns = 8000000;
+  ctx->last_stall_logged_ns = 0;
+  ctx->metrics_fd = -1;
+  wl_list_init(&ctx->metrics_clients);
+  ctx->capture = nullptr;
   ctx->stats_timer_delay = 60 * 1000;
+  ctx->stats_output_commits = 0;
+  for (struct sl_housekeeping& task : ctx->housekeeping)
+    task = {};
+  ctx->housekeeping_timer_ns = 0;
+  ctx->copy_pool = nullptr;
+  ctx->commit_pipeline = nullptr;
+  ctx->zero_copy_shm = false;
+  ctx->zero_copy_shm_threshold = 0;
+  ctx->prefault_output_buffers = false;
+  ctx->huge_page_output_buffers = false;
+  ctx->adaptive_output_buffers = false;
+  ctx->tile_damage_filter = false;
+  ctx->coalesce_pointer_motion = false;
+  ctx->pointer_motions_per_frame = 0;
+  ctx->stylus_max_rate = 0;
+  ctx->hidden_frame_interval_ms = 0;
+  ctx->damage_rect_limit = DEFAULT_DAMAGE_RECT_LIMIT;
+  ctx->tile_filter_stats = {};
+  ctx->output_buffer_pool_size = 0;
+  ctx->output_buffer_pool_limit = DEFAULT_OUTPUT_BUFFER_POOL_LIMIT;
+  ctx->buffer_size_bucket = 0;
+  ctx->output_buffer_bytes = 0;
+  ctx->output_buffer_budget = 0;
+  ctx->output_buffer_idle_ns = 0;
   ctx->viewport_resize = false;
 
   wl_list_init(&ctx->registries);
@@ -222,7 +292,12 @@ void sl_context_init_default(struct sl_context* ctx) {
   wl_list_init(&ctx->seats);
   wl_list_init(&ctx->windows);
   wl_list_init(&ctx->unpaired_windows);
+  wl_list_init(&ctx->selection_sends);
   wl_list_init(&ctx->selection_data_source_send_pending);
+  wl_list_init(&ctx->output_buffer_pool);
+  wl_list_init(&ctx->fence_waits);
+  wl_list_init(&ctx->orphaned_output_buffers);
+  wl_list_init(&ctx->released_output_buffers);
 #ifdef GAMEPAD_SUPPORT
   wl_list_init(&ctx->gamepads);
 #endif
@@ -233,6 +308,7 @@ static int sl_handle_clipboard_event(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = (struct sl_context*)data;
   bool readable = false;
   bool hang_up = false;
+  ScopedDispatchTimer dispatch_timer(ctx, SL_METRICS_HANDLER_CLIPBOARD);
 
   if (mask & WL_EVENT_READABLE)
     readable = true;
@@ -253,95 +329,213 @@ static int sl_handle_clipboard_event(int fd, uint32_t mask, void* data) {
   return 1;
 }
 
+// Closes the fds of the first |count| |receives|, which were forwarded or
+// are being dropped.
+static void sl_close_received_fds(struct WaylandSendReceive* receives,
+                                  size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    for (uint32_t j = 0; j < receives[i].num_fds; j++)
+      close(receives[i].fds[j]);
+    receives[i].num_fds = 0;
+  }
+}
+
+// Handles events from the host, forwarding those that are messages to the
+// client. Handles one event, and then as many more the host has pending as
+// up to |max_messages| messages can be gathered from, forwarding all of them
+// with one sendmmsg. Sets |*full| if it stopped because |max_messages| were
+// gathered rather than because nothing more was pending. Returns 0 if the
+// channel failed.
+static int sl_forward_wayland_channel_events(struct sl_context* ctx,
+                                             int fd,
+                                             size_t max_messages,
+                                             bool* full) {
+  struct WaylandSendReceive receives[WAYLAND_MAX_RECEIVE_BATCH];
+  struct mmsghdr msgs[WAYLAND_MAX_RECEIVE_BATCH];
+  struct iovec buffer_iovs[WAYLAND_MAX_RECEIVE_BATCH];
+  char fd_buffers[WAYLAND_MAX_RECEIVE_BATCH]
+                 [CMSG_LEN(sizeof(int) * WAYLAND_MAX_FDs)];
+  size_t count = 0;
+  bool first = true;
+  int rv;
+
+  max_messages = std::min<size_t>(max_messages, WAYLAND_MAX_RECEIVE_BATCH);
+  *full = false;
+  while (first || ctx->channel->has_pending_event()) {
+    struct WaylandSendReceive& receive = receives[count];
+    struct msghdr* msg = &msgs[count].msg_hdr;
+    int pipe_read_fd = -1;
+    enum WaylandChannelEvent event_type = WaylandChannelEvent::None;
+
+    first = false;
+    receive = {0};
+    receive.channel_fd = fd;
+    rv = ctx->channel->handle_channel_event(event_type, receive, pipe_read_fd);
+    if (rv) {
+      sl_close_received_fds(receives, count);
+      close(ctx->virtwl_socket_fd);
+      ctx->virtwl_socket_fd = -1;
+      return 0;
+    }
+
+    if (event_type == WaylandChannelEvent::ReceiveAndProxy) {
+      struct wl_event_loop* event_loop =
+          wl_display_get_event_loop(ctx->host_display);
+
+      ctx->clipboard_event_source.reset(
+          wl_event_loop_add_fd(event_loop, pipe_read_fd, WL_EVENT_READABLE,
+                               sl_handle_clipboard_event, ctx));
+    } else if (event_type != WaylandChannelEvent::Receive) {
+      continue;
+    }
+
+    if (ctx->capture) {
+      sl_capture_record(ctx->capture, SL_CAPTURE_HOST, receive.data,
+                        receive.data_size, receive.fds, receive.num_fds);
+    }
+
+    buffer_iovs[count].iov_base = receive.data;
+    buffer_iovs[count].iov_len = receive.data_size;
+    ctx->metrics.channel_messages_received++;
+    ctx->metrics.channel_bytes_received += receive.data_size;
+
+    *msg = {0};
+    msg->msg_iov = &buffer_iovs[count];
+    msg->msg_iovlen = 1;
+    msg->msg_control = fd_buffers[count];
+
+    if (receive.num_fds) {
+      struct cmsghdr* cmsg;
+
+      // Need to set msg_controllen so CMSG_FIRSTHDR will return the first
+      // cmsghdr. We copy every fd we just received from the ioctl into this
+      // cmsghdr.
+      msg->msg_controllen = sizeof(fd_buffers[count]);
+      cmsg = CMSG_FIRSTHDR(msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(receive.num_fds * sizeof(int));
+      memcpy(CMSG_DATA(cmsg), receive.fds, receive.num_fds * sizeof(int));
+      msg->msg_controllen = cmsg->cmsg_len;
+    }
+
+    // Only a batch with room left is worth polling for more.
+    if (++count == max_messages) {
+      *full = true;
+      break;
+    }
+  }
+
+  for (size_t sent = 0; sent < count;) {
+    int n = sendmmsg(ctx->virtwl_socket_fd, &msgs[sent], count - sent,
+                     MSG_NOSIGNAL);
+    errno_assert(n > 0);
+    for (size_t i = sent; i < sent + n; i++)
+      errno_assert(msgs[i].msg_len == receives[i].data_size);
+    sent += n;
+  }
+
+  sl_close_received_fds(receives, count);
+  for (size_t i = 0; i < count; i++) {
+    rv = ctx->channel->release_receive(receives[i]);
+    if (rv) {
+      close(ctx->virtwl_socket_fd);
+      ctx->virtwl_socket_fd = -1;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
 static int sl_handle_wayland_channel_event(int fd, uint32_t mask, void* data) {
   TRACE_EVENT("surface", "sl_handle_wayland_channel_event");
   struct sl_context* ctx = (struct sl_context*)data;
-  struct WaylandSendReceive receive = {0};
-  int pipe_read_fd = -1;
-  enum WaylandChannelEvent event_type = WaylandChannelEvent::None;
-
-  char fd_buffer[CMSG_LEN(sizeof(int) * WAYLAND_MAX_FDs)];
-  struct msghdr msg = {0};
-  struct iovec buffer_iov;
-  ssize_t bytes;
-  int rv;
+  ScopedDispatchTimer dispatch_timer(ctx, SL_METRICS_HANDLER_CHANNEL);
+  size_t max_messages = ctx->channel->max_receive_batch();
+  bool full;
 
   if (!(mask & WL_EVENT_READABLE)) {
     LOG(FATAL) << "Got error or hangup on virtwl ctx fd (mask " << mask
                << "), exiting";
-    exit(EXIT_FAILURE);
+    sl_context_exit(ctx, EXIT_FAILURE);
+    return 0;
   }
 
-  receive.channel_fd = fd;
-  rv = ctx->channel->handle_channel_event(event_type, receive, pipe_read_fd);
-  if (rv) {
+  if (ctx->channel->handle_channel_wakeup()) {
     close(ctx->virtwl_socket_fd);
     ctx->virtwl_socket_fd = -1;
     return 0;
   }
 
-  if (event_type == WaylandChannelEvent::ReceiveAndProxy) {
-    struct wl_event_loop* event_loop =
-        wl_display_get_event_loop(ctx->host_display);
+  // The host may have queued several events behind a single wakeup. A batch
+  // that stopped short already found nothing more pending.
+  do {
+    if (!sl_forward_wayland_channel_events(ctx, fd, max_messages, &full))
+      return 0;
+  } while (full && ctx->channel->has_pending_event());
 
-    ctx->clipboard_event_source.reset(
-        wl_event_loop_add_fd(event_loop, pipe_read_fd, WL_EVENT_READABLE,
-                             sl_handle_clipboard_event, ctx));
-  } else if (event_type != WaylandChannelEvent::Receive) {
-    return 1;
-  }
+  return 1;
+}
 
-  buffer_iov.iov_base = receive.data;
-  buffer_iov.iov_len = receive.data_size;
+// Forwards |size| bytes at |data| received from the virtwl socket to the
+// host, along with the fds in the control messages of |msg|, and closes them.
+static void sl_forward_to_host(struct sl_context* ctx,
+                               struct msghdr* msg,
+                               uint8_t* data,
+                               size_t size) {
+  struct WaylandSendReceive send = {0};
+  struct cmsghdr* cmsg;
+  int rv;
 
-  msg.msg_iov = &buffer_iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = fd_buffer;
+  // If there were any FDs recv'd by recvmsg, there will be some data in the
+  // msg_control buffer. To get the FDs out we iterate all cmsghdr's within and
+  // unpack the FDs if the cmsghdr type is SCM_RIGHTS.
+  for (cmsg = msg->msg_controllen != 0 ? CMSG_FIRSTHDR(msg) : nullptr; cmsg;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    size_t cmsg_fd_count;
 
-  if (receive.num_fds) {
-    struct cmsghdr* cmsg;
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
 
-    // Need to set msg_controllen so CMSG_FIRSTHDR will return the first
-    // cmsghdr. We copy every fd we just received from the ioctl into this
-    // cmsghdr.
-    msg.msg_controllen = sizeof(fd_buffer);
-    cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(receive.num_fds * sizeof(int));
-    memcpy(CMSG_DATA(cmsg), receive.fds, receive.num_fds * sizeof(int));
-    msg.msg_controllen = cmsg->cmsg_len;
-  }
+    cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
 
-  bytes = sendmsg(ctx->virtwl_socket_fd, &msg, MSG_NOSIGNAL);
-  errno_assert(bytes == static_cast<ssize_t>(receive.data_size));
+    // fd_count will never exceed WAYLAND_MAX_FDs because the
+    // control message buffer only allocates enough space for that many FDs.
+    memcpy(&send.fds[send.num_fds], CMSG_DATA(cmsg),
+           cmsg_fd_count * sizeof(int));
+    send.num_fds += cmsg_fd_count;
+  }
 
-  while (receive.num_fds--)
-    close(receive.fds[receive.num_fds]);
+  send.channel_fd = ctx->wayland_channel_fd;
+  send.data = data;
+  send.data_size = size;
 
-  if (receive.data)
-    free(receive.data);
+  rv = ctx->channel->send(send);
+  errno_assert(!rv);
+  ctx->metrics.channel_messages_sent++;
+  ctx->metrics.channel_bytes_sent += size;
 
-  return 1;
+  while (send.num_fds--)
+    close(send.fds[send.num_fds]);
 }
 
 static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
   TRACE_EVENT("surface", "sl_handle_virtwl_socket_event");
   struct sl_context* ctx = (struct sl_context*)data;
-  struct WaylandSendReceive send = {0};
+  ScopedDispatchTimer dispatch_timer(ctx, SL_METRICS_HANDLER_CHANNEL);
   char fd_buffer[CMSG_LEN(sizeof(int) * WAYLAND_MAX_FDs)];
   uint8_t data_buffer[DEFAULT_BUFFER_SIZE];
 
   struct iovec buffer_iov;
   struct msghdr msg = {0};
-  struct cmsghdr* cmsg;
   ssize_t bytes;
-  int rv;
 
   if (!(mask & WL_EVENT_READABLE)) {
     LOG(FATAL) << "Got error or hangup on virtwl socket (mask " << mask
                << "), exiting";
-    exit(EXIT_FAILURE);
+    sl_context_exit(ctx, EXIT_FAILURE);
+    return 0;
   }
 
   buffer_iov.iov_base = data_buffer;
@@ -353,38 +547,386 @@ static int sl_handle_virtwl_socket_event(int fd, uint32_t mask, void* data) {
   msg.msg_controllen = sizeof(fd_buffer);
 
   bytes = recvmsg(ctx->virtwl_socket_fd, &msg, 0);
-  errno_assert(bytes > 0);
+  if (bytes <= 0) {
+    LOG(FATAL) << "failed to receive from virtwl socket: "
+               << (bytes ? strerror(errno) : "closed");
+    sl_context_exit(ctx, EXIT_FAILURE);
+    return 0;
+  }
 
-  // If there were any FDs recv'd by recvmsg, there will be some data in the
-  // msg_control buffer. To get the FDs out we iterate all cmsghdr's within and
-  // unpack the FDs if the cmsghdr type is SCM_RIGHTS.
-  for (cmsg = msg.msg_controllen != 0 ? CMSG_FIRSTHDR(&msg) : nullptr; cmsg;
-       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-    size_t cmsg_fd_count;
+  sl_forward_to_host(ctx, &msg, data_buffer, bytes);
+  return 1;
+}
 
-    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+// Forwards everything the io_uring receive has completed, waiting for at
+// least one receive first if |wait| is true.
+static void sl_reap_virtwl_socket_ring(struct sl_context* ctx, bool wait) {
+  int32_t ret = ctx->virtwl_socket_ring->Reap(
+      wait, [ctx](struct msghdr& msg, uint8_t* data, size_t size) {
+        sl_forward_to_host(ctx, &msg, data, size);
+      });
+  if (ret < 0) {
+    LOG(FATAL) << "failed to receive from virtwl socket: " << strerror(-ret);
+    sl_context_exit(ctx, EXIT_FAILURE);
+  }
+}
+
+static int sl_handle_virtwl_socket_ring_event(int fd,
+                                              uint32_t mask,
+                                              void* data) {
+  TRACE_EVENT("surface", "sl_handle_virtwl_socket_ring_event");
+  struct sl_context* ctx = (struct sl_context*)data;
+  ScopedDispatchTimer dispatch_timer(ctx, SL_METRICS_HANDLER_CHANNEL);
+
+  if (!(mask & WL_EVENT_READABLE)) {
+    LOG(FATAL) << "Got error or hangup on virtwl socket ring (mask " << mask
+               << "), exiting";
+    sl_context_exit(ctx, EXIT_FAILURE);
+    return 0;
+  }
+
+  sl_reap_virtwl_socket_ring(ctx, false);
+  return 1;
+}
+
+static int sl_handle_commit_pipeline_event(int fd,
+                                           uint32_t mask,
+                                           void* data) {
+  TRACE_EVENT("surface", "sl_handle_commit_pipeline_event");
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  ctx->commit_pipeline->Reap();
+  return 1;
+}
+
+void sl_context_init_commit_pipeline(struct sl_context* ctx,
+                                     struct wl_event_loop* event_loop) {
+  ctx->commit_pipeline = new CopyPipeline(ctx->copy_pool);
+  ctx->commit_pipeline_event_source.reset(wl_event_loop_add_fd(
+      event_loop, ctx->commit_pipeline->event_fd(), WL_EVENT_READABLE,
+      sl_handle_commit_pipeline_event, ctx));
+}
+
+// A fence the next commit of |surface| to the host waits on.
+struct sl_fence_wait {
+  struct sl_context* ctx;
+  int fd;
+  int64_t deadline_ns;
+  WeakResourcePtr<sl_host_surface> surface;
+  std::unique_ptr<struct wl_event_source> fd_event_source;
+  std::unique_ptr<struct wl_event_source> timer_event_source;
+  struct wl_list link;
+};
+
+static void sl_fence_wait_destroy(struct sl_fence_wait* wait) {
+  wait->fd_event_source.reset();
+  wait->timer_event_source.reset();
+  close(wait->fd);
+  wl_list_remove(&wait->link);
+  delete wait;
+}
+
+static void sl_fence_wait_done(struct sl_fence_wait* wait) {
+  struct sl_host_surface* surface = wait->surface.get();
+
+  sl_fence_wait_destroy(wait);
+  if (surface)
+    sl_host_surface_unblock_commit(surface);
+}
+
+static int sl_handle_fence_wait_event(int fd, uint32_t mask, void* data) {
+  TRACE_EVENT("surface", "sl_handle_fence_wait_event");
+  sl_fence_wait_done(static_cast<struct sl_fence_wait*>(data));
+  return 0;
+}
+
+static int sl_handle_fence_wait_timeout(void* data) {
+  struct sl_fence_wait* wait = static_cast<struct sl_fence_wait*>(data);
+
+  LOG(WARNING) << "Fence wait timeout. Possible GPU hang! fd:" << wait->fd;
+  sl_fence_wait_done(wait);
+  return 0;
+}
+
+void sl_context_wait_for_fence(struct sl_context* ctx,
+                               struct sl_host_surface* surface,
+                               int fence_fd) {
+  struct pollfd signaled = {fence_fd, POLLIN, 0};
+
+  // Most fences have signaled by the time their buffer is attached.
+  if (poll(&signaled, 1, 0) != 0) {
+    close(fence_fd);
+    return;
+  }
+
+  struct wl_event_loop* event_loop =
+      wl_display_get_event_loop(ctx->host_display);
+  struct sl_fence_wait* wait = new sl_fence_wait();
+  wait->ctx = ctx;
+  wait->fd = fence_fd;
+  wait->deadline_ns =
+      sl_monotonic_time_ns() + FENCE_WAIT_TIMEOUT_MS * 1000000LL;
+  wait->surface = surface;
+  wait->fd_event_source.reset(wl_event_loop_add_fd(
+      event_loop, fence_fd, WL_EVENT_READABLE, sl_handle_fence_wait_event,
+      wait));
+  wait->timer_event_source.reset(
+      wl_event_loop_add_timer(event_loop, sl_handle_fence_wait_timeout, wait));
+  wl_event_source_timer_update(wait->timer_event_source.get(),
+                               FENCE_WAIT_TIMEOUT_MS);
+  wl_list_insert(ctx->fence_waits.prev, &wait->link);
+  sl_host_surface_block_commit(surface);
+  TRACE_EVENT("surface", "sl_context_wait_for_fence", "fence_fd", fence_fd);
+}
+
+void sl_context_finish_fence_waits(struct sl_context* ctx,
+                                   struct sl_host_surface* surface) {
+  struct sl_fence_wait* wait;
+  struct sl_fence_wait* next;
+
+  wl_list_for_each_safe(wait, next, &ctx->fence_waits, link) {
+    if (wait->surface.get() != surface)
       continue;
 
-    cmsg_fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    TRACE_EVENT("surface", "sl_context_finish_fence_waits", "fence_fd",
+                wait->fd);
+    struct pollfd signaled = {wait->fd, POLLIN, 0};
+    int64_t timeout_ms =
+        std::max<int64_t>(0, (wait->deadline_ns - sl_monotonic_time_ns()) /
+                                 1000000);
+    if (poll(&signaled, 1, timeout_ms) == 0) {
+      LOG(WARNING) << "Fence wait timeout. Possible GPU hang! fd:"
+                   << wait->fd;
+    }
+    sl_fence_wait_done(wait);
+  }
+}
 
-    // fd_count will never exceed WAYLAND_MAX_FDs because the
-    // control message buffer only allocates enough space for that many FDs.
-    memcpy(&send.fds[send.num_fds], CMSG_DATA(cmsg),
-           cmsg_fd_count * sizeof(int));
-    send.num_fds += cmsg_fd_count;
+static int sl_handle_housekeeping_timer(void* data);
+
+static void sl_context_arm_housekeeping(struct sl_context* ctx,
+                                        int64_t now_ns) {
+  int64_t deadline = 0;
+  for (const struct sl_housekeeping& task : ctx->housekeeping) {
+    if (task.deadline_ns && (!deadline || task.deadline_ns < deadline))
+      deadline = task.deadline_ns;
   }
 
-  send.channel_fd = ctx->wayland_channel_fd;
-  send.data = data_buffer;
-  send.data_size = bytes;
+  if (!deadline) {
+    if (ctx->housekeeping_timer_ns)
+      wl_event_source_timer_update(ctx->housekeeping_timer.get(), 0);
+    ctx->housekeeping_timer_ns = 0;
+    return;
+  }
 
-  rv = ctx->channel->send(send);
-  errno_assert(!rv);
+  int64_t fire_ns = (deadline + HOUSEKEEPING_SLACK_NS - 1) /
+                    HOUSEKEEPING_SLACK_NS * HOUSEKEEPING_SLACK_NS;
+  if (fire_ns == ctx->housekeeping_timer_ns)
+    return;
 
-  while (send.num_fds--)
-    close(send.fds[send.num_fds]);
+  if (!ctx->housekeeping_timer) {
+    ctx->housekeeping_timer.reset(wl_event_loop_add_timer(
+        wl_display_get_event_loop(ctx->host_display),
+        sl_handle_housekeeping_timer, ctx));
+  }
+  // A delay of 0 would disarm the timer.
+  wl_event_source_timer_update(
+      ctx->housekeeping_timer.get(),
+      MAX(1, static_cast<int>((fire_ns - now_ns + 999999) / 1000000)));
+  ctx->housekeeping_timer_ns = fire_ns;
+}
 
-  return 1;
+void sl_context_schedule_housekeeping(struct sl_context* ctx,
+                                      enum sl_housekeeping_task task,
+                                      int64_t delay_ms,
+                                      void (*run)(struct sl_context* ctx)) {
+  int64_t now = sl_monotonic_time_ns();
+
+  ctx->housekeeping[task].deadline_ns = now + delay_ms * 1000000;
+  ctx->housekeeping[task].run = run;
+  sl_context_arm_housekeeping(ctx, now);
+}
+
+void sl_context_run_housekeeping(struct sl_context* ctx, int64_t now_ns) {
+  TRACE_EVENT("other", "sl_context_run_housekeeping");
+  ctx->metrics.housekeeping_wakeups++;
+  ctx->housekeeping_timer_ns = 0;
+  for (struct sl_housekeeping& task : ctx->housekeeping) {
+    if (!task.deadline_ns || task.deadline_ns > now_ns)
+      continue;
+    // Tasks that keep going schedule themselves again.
+    task.deadline_ns = 0;
+    task.run(ctx);
+  }
+  sl_context_arm_housekeeping(ctx, now_ns);
+}
+
+static int sl_handle_housekeeping_timer(void* data) {
+  struct sl_context* ctx = static_cast<struct sl_context*>(data);
+
+  sl_context_run_housekeeping(ctx, sl_monotonic_time_ns());
+  return 0;
+}
+
+static int sl_handle_allocation_fence_event(int fd, uint32_t mask, void* data);
+
+static void sl_context_watch_allocation_fence(struct sl_context* ctx,
+                                              int fence_fd) {
+  if (fence_fd < 0) {
+    ctx->allocation_fence_event_source.reset();
+    return;
+  }
+
+  ctx->allocation_fence_event_source.reset(wl_event_loop_add_fd(
+      wl_display_get_event_loop(ctx->host_display), fence_fd,
+      WL_EVENT_READABLE, sl_handle_allocation_fence_event, ctx));
+}
+
+static int sl_handle_allocation_fence_event(int fd, uint32_t mask, void* data) {
+  TRACE_EVENT("surface", "sl_handle_allocation_fence_event");
+  struct sl_context* ctx = (struct sl_context*)data;
+  int next_fence_fd = -1;
+  int rv;
+
+  rv = ctx->channel->handle_fence(fd, next_fence_fd);
+  if (rv)
+    LOG(ERROR) << "allocation prefetch failed with " << strerror(-rv);
+
+  sl_context_watch_allocation_fence(ctx, next_fence_fd);
+  return 0;
+}
+
+void sl_context_prefetch_allocation(
+    struct sl_context* ctx, const struct WaylandBufferCreateInfo& create_info) {
+  int fence_fd = -1;
+  int rv;
+
+  rv = ctx->channel->prefetch_allocation(create_info, fence_fd);
+  if (rv) {
+    LOG(WARNING) << "allocation prefetch failed with " << strerror(-rv);
+    return;
+  }
+
+  if (fence_fd >= 0)
+    sl_context_watch_allocation_fence(ctx, fence_fd);
+}
+
+int sl_context_flush_host(struct sl_context* ctx) {
+  int ret = wl_display_flush(ctx->display);
+  if (ret > 0)
+    ctx->host_flushes++;
+
+  // What didn't fit goes out once the connection is writable again.
+  bool backed_up = ret < 0 && errno == EAGAIN;
+  if (backed_up != ctx->host_flush_pending && ctx->display_event_source) {
+    ctx->host_flush_pending = backed_up;
+    wl_event_source_fd_update(
+        ctx->display_event_source.get(),
+        WL_EVENT_READABLE | (backed_up ? WL_EVENT_WRITABLE : 0));
+  }
+  return ret;
+}
+
+void sl_context_drain_commit_pipeline(struct sl_context* ctx) {
+  if (!ctx->commit_pipeline || ctx->commit_pipeline->idle())
+    return;
+
+  ctx->commit_pipeline->Drain();
+}
+
+void sl_context_release(struct sl_context* ctx) {
+  sl_context_drain_commit_pipeline(ctx);
+
+  // Event sources have to go before the loop they are on.
+  ctx->display_event_source.reset();
+  ctx->display_ready_event_source.reset();
+  ctx->sigchld_event_source.reset();
+  ctx->sigusr1_event_source.reset();
+  ctx->clipboard_event_source.reset();
+  ctx->housekeeping_timer.reset();
+#ifdef QUIRKS_SUPPORT
+  ctx->quirks_event_source.reset();
+#endif
+  sl_metrics_release(ctx);
+  if (ctx->capture) {
+    sl_capture_close(ctx->capture);
+    ctx->capture = nullptr;
+  }
+  ctx->wayland_channel_event_source.reset();
+  ctx->virtwl_socket_event_source.reset();
+  ctx->connection_event_source.reset();
+  ctx->selection_event_source.reset();
+  ctx->commit_pipeline_event_source.reset();
+  ctx->allocation_fence_event_source.reset();
+  struct sl_fence_wait* wait;
+  struct sl_fence_wait* next_wait;
+  wl_list_for_each_safe(wait, next_wait, &ctx->fence_waits, link) {
+    sl_fence_wait_destroy(wait);
+  }
+
+  // Clipboard transfers hold event sources of their own.
+  struct sl_selection_send* send;
+  struct sl_selection_send* next_send;
+  wl_list_for_each_safe(send, next_send, &ctx->selection_sends, link) {
+    wl_list_remove(&send->link);
+    close(send->fd);
+    free(send->property_reply);
+    delete send;
+  }
+  wl_list_for_each_safe(send, next_send,
+                        &ctx->selection_data_source_send_pending, link) {
+    wl_list_remove(&send->link);
+    close(send->fd);
+    delete send;
+  }
+
+  if (ctx->host_display) {
+    wl_display_destroy_clients(ctx->host_display);
+    wl_display_destroy(ctx->host_display);
+    ctx->host_display = nullptr;
+  }
+  // With the clients gone, no registry hears of the globals going.
+  sl_release_globals(ctx);
+  if (ctx->display) {
+    wl_display_disconnect(ctx->display);
+    ctx->display = nullptr;
+  }
+
+  delete ctx->commit_pipeline;
+  ctx->commit_pipeline = nullptr;
+  delete ctx->copy_pool;
+  ctx->copy_pool = nullptr;
+  delete ctx->virtwl_socket_ring;
+  ctx->virtwl_socket_ring = nullptr;
+  delete ctx->channel;
+  ctx->channel = nullptr;
+
+  if (ctx->virtwl_socket_fd >= 0) {
+    close(ctx->virtwl_socket_fd);
+    ctx->virtwl_socket_fd = -1;
+  }
+  if (ctx->gbm) {
+    int drm_fd = gbm_device_get_fd(ctx->gbm);
+    gbm_device_destroy(ctx->gbm);
+    close(drm_fd);
+    ctx->gbm = nullptr;
+  }
+  ctx->plane0_fixup_cache.clear();
+  for (struct sl_cached_keymap& cached : ctx->keymap_cache)
+    xkb_keymap_unref(cached.keymap);
+  ctx->keymap_cache.clear();
+  if (ctx->xkb_context) {
+    xkb_context_unref(ctx->xkb_context);
+    ctx->xkb_context = nullptr;
+  }
+}
+
+void sl_context_exit(struct sl_context* ctx, int status) {
+  if (!ctx->client_thread)
+    exit(status);
+  // The main loop stops before its next wait, and sl_context_release()
+  // disconnects the client.
+  ctx->client_destroyed = true;
 }
 
 wl_event_loop* sl_context_configure_event_loop(sl_context* ctx,
@@ -429,9 +971,28 @@ wl_event_loop* sl_context_configure_event_loop(sl_context* ctx,
     ctx->virtwl_socket_fd = vws[0];
     ctx->virtwl_display_fd = vws[1];
 
-    ctx->virtwl_socket_event_source.reset(wl_event_loop_add_fd(
-        event_loop, ctx->virtwl_socket_fd, WL_EVENT_READABLE,
-        sl_handle_virtwl_socket_event, ctx));
+    if (ctx->use_io_uring) {
+      SocketReceiveRing* ring = new SocketReceiveRing();
+      ret = ring->Init(ctx->virtwl_socket_fd, channel->max_send_size(),
+                       CMSG_LEN(sizeof(int) * WAYLAND_MAX_FDs));
+      if (ret) {
+        LOG(WARNING) << "io_uring unavailable, receiving with recvmsg: "
+                     << strerror(-ret);
+        delete ring;
+      } else {
+        ctx->virtwl_socket_ring = ring;
+      }
+    }
+
+    if (ctx->virtwl_socket_ring) {
+      ctx->virtwl_socket_event_source.reset(wl_event_loop_add_fd(
+          event_loop, ctx->virtwl_socket_ring->fd(), WL_EVENT_READABLE,
+          sl_handle_virtwl_socket_ring_event, ctx));
+    } else {
+      ctx->virtwl_socket_event_source.reset(wl_event_loop_add_fd(
+          event_loop, ctx->virtwl_socket_fd, WL_EVENT_READABLE,
+          sl_handle_virtwl_socket_event, ctx));
+    }
     ctx->wayland_channel_event_source.reset(
         wl_event_loop_add_fd(event_loop, wayland_channel_fd, WL_EVENT_READABLE,
                              sl_handle_wayland_channel_event, ctx));
@@ -445,15 +1006,6 @@ wl_event_loop* sl_context_configure_event_loop(sl_context* ctx,
 
 sl_window* sl_context_lookup_window_for_surface(struct sl_context* ctx,
                                                 wl_resource* resource) {
-  sl_window* surface_window = nullptr;
-  sl_window* window;
-
-  wl_list_for_each(window, &ctx->windows, link) {
-    if (window->host_surface_id == wl_resource_get_id(resource)) {
-      surface_window = window;
-      break;
-    }
-  }
-
-  return surface_window;
+  auto it = ctx->windows_by_surface_id.find(wl_resource_get_id(resource));
+  return it != ctx->windows_by_surface_id.end() ? it->second : nullptr;
 }
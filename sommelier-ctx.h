@@ -6,27 +6,63 @@
 #define VM_TOOLS_SOMMELIER_SOMMELIER_CTX_H_
 
 #include <limits.h>
+#include <sys/types.h>
+#include <map>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <wayland-server.h>
 #include <wayland-util.h>
 #include <xcb/xcb.h>
 
-#include "sommelier-timing.h"  // NOLINT(build/include_directory)
-#include "sommelier-util.h"    // NOLINT(build/include_directory)
+#include "sommelier-metrics.h"      // NOLINT(build/include_directory)
+#include "sommelier-object-pool.h"  // NOLINT(build/include_directory)
+#include "sommelier-timing.h"       // NOLINT(build/include_directory)
+#include "sommelier-util.h"         // NOLINT(build/include_directory)
 #include "virtualization/wayland_channel.h"
 
 #ifdef QUIRKS_SUPPORT
 #include "quirks/sommelier-quirks.h"
 #endif
 
+class CopyPipeline;
+class CopyWorkerPool;
+class SocketReceiveRing;
+struct sl_host_callback;
+struct sl_host_presentation_feedback;
+struct sl_host_region;
+struct sl_host_surface;
+
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
+// sl_context::buffer_size_bucket value rounding output buffers up to the
+// next power of two.
+#define SL_BUFFER_SIZE_BUCKET_POW2 -1
+
 #define MIN_SIZE (INT_MIN / 10)
 #define MAX_SIZE (INT_MAX / 10)
 
+// X11 clipboard transfers to Wayland clients that can run at once, one per
+// ATOM_WL_SELECTION_SEND_* property.
+#define SL_MAX_SELECTION_SENDS 4
+
+// Periodic work that can wait a little, run by the shared housekeeping
+// timer, see sl_context_schedule_housekeeping().
+enum sl_housekeeping_task {
+  SL_HOUSEKEEPING_STATS,
+  SL_HOUSEKEEPING_OUTPUT_BUFFER_IDLE,
+  SL_HOUSEKEEPING_COUNT,
+};
+
+struct sl_housekeeping {
+  // When the task is due, or 0 while it isn't scheduled.
+  int64_t deadline_ns;
+  void (*run)(struct sl_context* ctx);
+};
+
 // A list of atoms to intern (create/fetch) when connecting to the X server.
 //
 // To add an atom, declare it here and define it in |sl_context_atom_name|.
@@ -60,6 +96,10 @@ enum {
   ATOM_TEXT,
   ATOM_INCR,
   ATOM_WL_SELECTION,
+  ATOM_WL_SELECTION_SEND_0,
+  ATOM_WL_SELECTION_SEND_1,
+  ATOM_WL_SELECTION_SEND_2,
+  ATOM_WL_SELECTION_SEND_3,
   ATOM_GTK_THEME_VARIANT,
   ATOM_STEAM_GAME,
   ATOM_XWAYLAND_RANDR_EMU_MONITOR_RECTS,
@@ -73,6 +113,49 @@ enum {
   ATOM_LAST = ATOM_NET_WM_PID,
 };
 
+// Counters for --tile-damage-filter, logged along with the frame stats.
+struct sl_tile_filter_stats {
+  // Fully damaged tiles hashed, and those found unchanged and skipped.
+  uint64_t tiles_hashed;
+  uint64_t tiles_skipped;
+  // Bytes copied after filtering, and bytes the filter saved copying.
+  uint64_t bytes_copied;
+  uint64_t bytes_skipped;
+};
+
+// A keymap compiled from the text the host sent, see sl_keymap_cache_get().
+struct sl_cached_keymap {
+  size_t hash;
+  std::string text;
+  struct xkb_keymap* keymap;
+};
+
+// What sl_linux_dmabuf_fixup_plane0_params() found out about a dmabuf.
+struct sl_plane0_fixup {
+  dev_t dev;
+  ino_t ino;
+  bool is_virtgpu_buffer;
+  uint32_t stride;
+  uint32_t modifier_hi;
+  uint32_t modifier_lo;
+};
+
+// What the containerization check made of a process, shared by its windows.
+struct sl_process_class {
+  bool containerize;
+  // Windows that were classified from this entry and still exist.
+  int windows;
+};
+
+// A property request sent ahead of the PropertyNotify handler that wants it.
+struct sl_property_prefetch {
+  xcb_window_t window;
+  xcb_atom_t atom;
+  xcb_atom_t type;
+  uint32_t long_length;
+  xcb_get_property_cookie_t cookie;
+};
+
 // A series of configurations and objects shared globally.
 struct sl_context {
   char** runprog;
@@ -80,12 +163,19 @@ struct sl_context {
   // wl_display object used with the Wayland client API,
   // to communicate with the host compositor.
   struct wl_display* display;
+  // The registry of |display|, which the host globals are bound through.
+  struct wl_registry* registry;
 
   // wl_display object used with the Wayland server API,
   // to communicate with clients of Sommelier.
   struct wl_display* host_display;
 
   struct wl_client* client;
+  struct wl_listener client_destroy_listener;
+  // Set for contexts run on a thread of a --client-threads parent, which
+  // must not exit the process once |client| goes away.
+  bool client_thread;
+  bool client_destroyed;
   struct sl_compositor* compositor;
   struct sl_subcompositor* subcompositor;
   struct sl_shm* shm;
@@ -95,6 +185,11 @@ struct sl_context {
   struct sl_aura_shell* aura_shell;
   struct sl_viewporter* viewporter;
   struct sl_linux_dmabuf* linux_dmabuf;
+  // The host's dmabuf format tables, mapped once however many feedback
+  // objects share them.
+  std::vector<struct sl_linux_dmabuf_format_table*> linux_dmabuf_format_tables;
+  // Recently imported dmabufs, most recently used first.
+  std::vector<struct sl_plane0_fixup> plane0_fixup_cache;
   struct sl_linux_explicit_synchronization* linux_explicit_synchronization;
   struct sl_keyboard_extension* keyboard_extension;
   struct sl_text_input_manager* text_input_manager;
@@ -109,6 +204,7 @@ struct sl_context {
   struct sl_pointer_constraints* pointer_constraints;
   struct sl_fractional_scale_manager* fractional_scale_manager;
   struct sl_idle_inhibit_manager* idle_inhibit_manager;
+  struct sl_presentation* presentation;
   struct wl_list outputs;
   struct wl_list seats;
   std::unique_ptr<struct wl_event_source> display_event_source;
@@ -116,7 +212,11 @@ struct sl_context {
   std::unique_ptr<struct wl_event_source> sigchld_event_source;
   std::unique_ptr<struct wl_event_source> sigusr1_event_source;
   std::unique_ptr<struct wl_event_source> clipboard_event_source;
-  std::unique_ptr<struct wl_event_source> stats_timer_event_source;
+  // One timer for all of |housekeeping|, and when it fires, or 0 while it
+  // is disarmed.
+  struct sl_housekeeping housekeeping[SL_HOUSEKEEPING_COUNT];
+  std::unique_ptr<struct wl_event_source> housekeeping_timer;
+  int64_t housekeeping_timer_ns;
   struct wl_array dpi;
   int wm_fd;
   int wayland_channel_fd;
@@ -124,6 +224,23 @@ struct sl_context {
   int virtwl_display_fd;
   std::unique_ptr<struct wl_event_source> wayland_channel_event_source;
   std::unique_ptr<struct wl_event_source> virtwl_socket_event_source;
+  // Receives from |virtwl_socket_fd| through io_uring for --io-uring, in
+  // which case |virtwl_socket_event_source| polls its fd instead.
+  bool use_io_uring;
+  SocketReceiveRing* virtwl_socket_ring;
+  // Writes to the host connection in this event loop iteration, for
+  // tracing.
+  int host_flushes;
+  // Set while requests that didn't fit in the host connection wait for it
+  // to become writable.
+  bool host_flush_pending;
+  // Frame and sync callbacks forwarded to the host that haven't been
+  // destroyed yet, for tracing.
+  int pending_host_callbacks;
+  // Memory for the proxies clients create and destroy every frame.
+  ObjectPool<sl_host_callback> callback_pool;
+  ObjectPool<sl_host_presentation_feedback> presentation_feedback_pool;
+  ObjectPool<sl_host_region> region_pool;
   const char* drm_device;
   struct gbm_device* gbm;
   int xwayland;
@@ -131,11 +248,16 @@ struct sl_context {
   // XWayland-hosting sommelier instances allow additional connections for IME
   // support.
   wl_listener extra_client_created_listener;
+  // Set while --lazy-xwayland owns the X11 sockets.
+  struct sl_lazy_xwayland* lazy_xwayland;
   pid_t child_pid;
   pid_t peer_pid;
   struct xkb_context* xkb_context;
-  std::vector<struct sl_accelerator*> accelerators;
-  std::vector<struct sl_accelerator*> windowed_accelerators;
+  // Keymaps compiled for any keyboard, most recently used first.
+  std::vector<struct sl_cached_keymap> keymap_cache;
+  // Accelerators, by sl_accelerator_key().
+  std::unordered_set<uint64_t> accelerators;
+  std::unordered_set<uint64_t> windowed_accelerators;
   struct wl_list registries;
   struct wl_list globals;
   std::vector<struct sl_host_output*> host_outputs;
@@ -146,9 +268,26 @@ struct sl_context {
   const xcb_query_extension_reply_t* xshape_extension;
   xcb_screen_t* screen;
   xcb_window_t window;
+  // Requests sent for the PropertyNotify events of the batch being handled.
+  std::vector<struct sl_property_prefetch> property_prefetches;
   struct wl_list windows, unpaired_windows;
+  // Every window by its id and frame id, and paired windows by the id of
+  // their host surface.
+  std::unordered_map<xcb_window_t, struct sl_window*> windows_by_xid;
+  std::unordered_map<uint32_t, struct sl_window*> windows_by_surface_id;
+  // Processes with windows by PID and start time, so a process's comm is
+  // read and scanned once rather than for each of its windows. The start
+  // time tells a later process reusing the PID apart, as windows can outlive
+  // their process. An entry goes with the last window classified from it.
+  std::map<std::pair<uint32_t, uint64_t>, struct sl_process_class>
+      process_classes;
   struct sl_window* host_focus_window;
   int needs_set_input_focus;
+  // Set while input that needs the windows restacked is held back from the
+  // X client until Xwayland answers the request with this sequence number,
+  // sent after the restack.
+  bool restack_pending;
+  unsigned int restack_sequence;
 #ifdef GAMEPAD_SUPPORT
   struct wl_list gamepads;
 #endif
@@ -180,6 +319,10 @@ struct sl_context {
 
   int exit_with_child;
   const char* sd_notify;
+  // Where to write the startup profile once ready, see ScopeTimer::Report().
+  const char* startup_report;
+  // When Xwayland was started, for the startup profile.
+  timespec xwayland_spawn_time;
   int clipboard_manager;
   uint32_t frame_color;
   uint32_t dark_frame_color;
@@ -194,14 +337,26 @@ struct sl_context {
   struct wl_data_device* selection_data_device;
   struct sl_data_offer* selection_data_offer;
   struct sl_data_source* selection_data_source;
-  int selection_data_source_send_fd;
+  // Owner and timestamp of the X11 selection whose TARGETS
+  // |selection_data_source| offers.
+  xcb_window_t selection_targets_owner;
+  xcb_timestamp_t selection_targets_timestamp;
+  // Names of the atoms interned at startup, and of those seen as selection
+  // targets, MIME types or in traces, both ways. Atoms live as long as the X
+  // server, so these never go stale.
+  std::unordered_map<xcb_atom_t, std::string> atom_names;
+  std::unordered_map<std::string, xcb_atom_t> atoms_by_name;
+  // Sequence numbers of the atom names sl_request_atom_name() is waiting for.
+  std::unordered_map<xcb_atom_t, unsigned int> atom_name_requests;
+  // Transfers of the X11 clipboard to Wayland clients in flight, and those
+  // waiting for a free property.
+  struct wl_list selection_sends;
   struct wl_list selection_data_source_send_pending;
-  std::unique_ptr<struct wl_event_source> selection_send_event_source;
-  xcb_get_property_reply_t* selection_property_reply;
-  int selection_property_offset;
   std::unique_ptr<struct wl_event_source> selection_event_source;
   xcb_atom_t selection_data_type;
   struct wl_array selection_data;
+  // Bytes of |selection_data| buffered before they are sent.
+  uint32_t selection_chunk_size;
   int selection_data_offer_receive_fd;
   int selection_data_ack_pending;
   union {
@@ -215,12 +370,110 @@ struct sl_context {
   const char* trace_filename;
 #ifdef QUIRKS_SUPPORT
   Quirks quirks;
+  std::unique_ptr<struct wl_event_source> quirks_event_source;
 #endif
   std::unique_ptr<FrameStats> frame_stats;
+  struct sl_metrics metrics;
+  // Event handler dispatches taking longer than this are logged, at most
+  // once a second, see --stall-budget-ms.
+  int64_t stall_budget_ns;
+  int64_t last_stall_logged_ns;
+  // --metrics-socket listening socket and the scrapers connected to it.
+  int metrics_fd;
+  std::unique_ptr<struct wl_event_source> metrics_event_source;
+  struct wl_list metrics_clients;
+  // --capture recording, or nullptr.
+  struct sl_capture* capture;
   int stats_timer_delay;
+  // Commits there had been when the stats were last output.
+  uint64_t stats_output_commits;
+
+  // Released output buffers available to any surface, most recently released
+  // first, and the total bytes they hold. Buffers are evicted from the back
+  // to keep |output_buffer_pool_size| within |output_buffer_pool_limit|;
+  // a limit of 0 disables pooling.
+  struct wl_list output_buffer_pool;
+  size_t output_buffer_pool_size;
+  size_t output_buffer_pool_limit;
+  // Step in pixels that output buffer dimensions are rounded up to, 0 to
+  // allocate at the exact contents size, or SL_BUFFER_SIZE_BUCKET_POW2.
+  int32_t buffer_size_bucket;
+  // Output buffers whose surface was destroyed while the host still held
+  // them. They join |output_buffer_pool| once released.
+  struct wl_list orphaned_output_buffers;
+  // Bytes held in output buffers of any kind, and the --buffer-budget that
+  // released ones are trimmed to keep them within, or 0 for no budget.
+  size_t output_buffer_bytes;
+  size_t output_buffer_budget;
+  // Released buffers still owned by their surfaces, most recently released
+  // first. Those of surfaces that haven't committed for
+  // |output_buffer_idle_ns| are dropped by SL_HOUSEKEEPING_OUTPUT_BUFFER_IDLE.
+  struct wl_list released_output_buffers;
+  int64_t output_buffer_idle_ns;
+
+  // Worker pool for large damage copies, or nullptr to copy on the main
+  // thread. Created by --copy-threads.
+  CopyWorkerPool* copy_pool;
+
+  // Background copier for --async-commit, or nullptr to copy on commit.
+  // A surface's commit is deferred while its copy is in flight, so the host
+  // never sees a commit before its buffer has been written. State for the
+  // next commit, the role's included, waits for the copy first, see
+  // sl_host_surface_finish_deferred_commit().
+  CopyPipeline* commit_pipeline;
+  std::unique_ptr<struct wl_event_source> commit_pipeline_event_source;
+
+  // sl_fence_wait::link of the fences surfaces' commits wait on, see
+  // sl_context_wait_for_fence().
+  struct wl_list fence_waits;
+
+  // Fence of the allocation work the channel has in flight for
+  // sl_context_prefetch_allocation(), if any.
+  std::unique_ptr<struct wl_event_source> allocation_fence_event_source;
+
+  // Skip copying damaged tiles whose contents didn't change.
+  bool tile_damage_filter;
+  struct sl_tile_filter_stats tile_filter_stats;
+
+  // Share wl_shm pools with the host as dma-bufs instead of copying each
+  // frame into an output buffer, where the channel supports it.
+  bool zero_copy_shm;
+  // Smaller pools are still copied, since sharing them costs the host more
+  // than copying their little damage does.
+  size_t zero_copy_shm_threshold;
+
+  // Fault in the pages of new output buffers up front, rather than on the
+  // first copy into them, asking for transparent huge pages if set.
+  bool prefault_output_buffers;
+  bool huge_page_output_buffers;
+
+  // Pick between dmabuf and shm output buffers for each surface by what
+  // copying into them has been measured to cost.
+  bool adaptive_output_buffers;
+
+  // Forward only the latest pointer position of each wl_pointer.frame, and
+  // with |pointer_motions_per_frame| set, at most that many positions per
+  // frame the focused surface commits.
+  bool coalesce_pointer_motion;
+  int pointer_motions_per_frame;
+
+  // Forward tablet tool frames of nothing but axis changes at most this many
+  // times per second, merging those in between. 0 forwards each one.
+  int stylus_max_rate;
+
+  // With this set, windows the host has minimized get a frame callback at
+  // most once per interval, and their contents aren't copied until shown.
+  int hidden_frame_interval_ms;
+
+  // Most damage rectangles forwarded per commit before the bounding box is
+  // sent instead.
+  int damage_rect_limit;
 
   // Command-line configurable options.
   bool trace_system;
+  // Minimum time between clock sync events on the commit path, or
+  // negative to never emit them.
+  int trace_time_sync_interval_ms;
   bool use_explicit_fence;
   bool use_direct_scale;
   bool viewport_resize;
@@ -234,8 +487,7 @@ struct sl_context {
   bool enable_linux_dmabuf;      // TODO(b/234899270): enable by default
   bool stable_scaling;           // TODO(b/275623126): Clean this up.
 
-  // Never freed after allocation due the fact sommelier doesn't have a
-  // shutdown function yet.
+  // Only freed by sl_context_release(), the process exits with it otherwise.
   WaylandChannel* channel;
 };
 
@@ -255,6 +507,64 @@ wl_event_loop* sl_context_configure_event_loop(sl_context* ctx,
                                                WaylandChannel* channel,
                                                bool use_virtual_context);
 
+// Starts the --async-commit pipeline on |event_loop|.
+void sl_context_init_commit_pipeline(struct sl_context* ctx,
+                                     struct wl_event_loop* event_loop);
+
+// Waits for any copies in flight on the commit pipeline and finishes their
+// commits. Must be called before freeing or moving memory a copy may use.
+void sl_context_drain_commit_pipeline(struct sl_context* ctx);
+
+// Frees everything the main loop of a client thread set up, including
+// |ctx->host_display| and its event loop, the host globals and windows it
+// tracked and the proxies bound to them.
+void sl_context_release(struct sl_context* ctx);
+
+// Gives up on the client after an error it can't recover from. A client
+// thread shares the process with every other client, so only its own main
+// loop stops and the client is disconnected; otherwise this exits with
+// |status|. Callers return to the event loop afterwards.
+void sl_context_exit(struct sl_context* ctx, int status);
+
+// Flushes requests queued for the host compositor, returning the result of
+// wl_display_flush(). The main loop calls this once per event loop
+// iteration, so everything else should leave requests queued unless they
+// must reach the host right away; bursts then go out in as few writes as
+// possible. If the connection is full, the rest is flushed once it's
+// writable again.
+int sl_context_flush_host(struct sl_context* ctx);
+
+// Defers the next commit of |surface| to the host until |fence_fd|
+// signals, without blocking the event loop or other surfaces, so that the
+// host doesn't use a buffer before rendering to it has finished. Gives up
+// after a second, like a blocking wait would. Takes ownership of
+// |fence_fd|.
+void sl_context_wait_for_fence(struct sl_context* ctx,
+                               struct sl_host_surface* surface,
+                               int fence_fd);
+
+// Blocks until the fences |surface| waits on have signaled or timed out,
+// for when a request can't go to the host before its deferred commit.
+void sl_context_finish_fence_waits(struct sl_context* ctx,
+                                   struct sl_host_surface* surface);
+
+// Has |run| called for |task| in |delay_ms|, replacing when it was due
+// before. Tasks are run on whole seconds of the monotonic clock, so that
+// those due around the same time share a wakeup.
+void sl_context_schedule_housekeeping(struct sl_context* ctx,
+                                      enum sl_housekeeping_task task,
+                                      int64_t delay_ms,
+                                      void (*run)(struct sl_context* ctx));
+
+// Runs the housekeeping tasks due by |now_ns|, and arms the timer for the
+// next one. The timer calls this when it fires.
+void sl_context_run_housekeeping(struct sl_context* ctx, int64_t now_ns);
+
+// Gets the channel started on allocating a buffer like |create_info| in the
+// background, so that allocating it later doesn't block the event loop.
+void sl_context_prefetch_allocation(
+    struct sl_context* ctx, const struct WaylandBufferCreateInfo& create_info);
+
 sl_window* sl_context_lookup_window_for_surface(struct sl_context* ctx,
                                                 wl_resource* resource);
 
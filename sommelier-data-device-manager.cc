@@ -14,6 +14,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
+#include <memory>
 #include <wayland-client.h>
 
 struct sl_host_data_device_manager {
@@ -27,9 +28,20 @@ struct sl_host_data_device {
   struct wl_resource* resource;
   struct wl_data_device* proxy;
   struct sl_host_surface* focus_surface;
+  // Drag motion held back until the focus surface's next frame.
+  bool motion_pending;
+  uint32_t motion_time;
+  wl_fixed_t motion_x;
+  wl_fixed_t motion_y;
+  int64_t last_motion_forwarded_ns;
+  std::unique_ptr<struct wl_event_source> motion_timer;
 };
 MAP_STRUCTS(wl_data_device, sl_host_data_device);
 
+// Surfaces that haven't committed for this long get every drag motion, since
+// they may only draw in response to it.
+#define DATA_DEVICE_MOTION_IDLE_SURFACE_NS 100000000
+
 struct sl_host_data_source {
   struct wl_resource* resource;
   struct wl_data_source* proxy;
@@ -43,12 +55,19 @@ struct sl_host_data_offer {
 };
 MAP_STRUCTS(wl_data_offer, sl_host_data_offer);
 
+// Bytes moved per read or splice, the default capacity of a pipe.
+#define DATA_TRANSFER_CHUNK_SIZE (64 * 1024)
+
 struct sl_data_transfer {
   int read_fd;
   int write_fd;
+  // Pipe the data is spliced through, so that it never gets copied to us.
+  // Both are -1 once we fall back to copying it through |data|, for fds that
+  // don't support splice().
+  int splice_fds[2];
   size_t offset;
   size_t bytes_left;
-  uint8_t data[DEFAULT_BUFFER_SIZE];
+  std::vector<uint8_t> data;
   // Flag to temporarily track if we've just finished writing. This is used to
   // ignore the first WL_EVENT_HANGUP after a write since we seem to spuriously
   // get WL_EVENT_HANGUP when the socket isn't closed and can still be used
@@ -66,12 +85,62 @@ static void sl_data_transfer_destroy(struct sl_data_transfer* transfer) {
   // associated wl_event_loop, but we still want to close the fd. Ordered this
   // way because we don't want any additional events associated with the close()
   // calls to end up a the wl_event_loop.
+  if (transfer->splice_fds[0] >= 0) {
+    close(transfer->splice_fds[0]);
+    close(transfer->splice_fds[1]);
+  }
   delete transfer;
 
   close(read_fd);
   close(write_fd);
 }
 
+// Switches |transfer| over to copying, taking whatever is in the splice pipe
+// along.
+static bool sl_data_transfer_stop_splicing(struct sl_data_transfer* transfer) {
+  ssize_t rv = 0;
+
+  transfer->data.resize(DATA_TRANSFER_CHUNK_SIZE);
+  if (transfer->bytes_left) {
+    rv = read(transfer->splice_fds[0], transfer->data.data(),
+              transfer->bytes_left);
+  }
+  close(transfer->splice_fds[0]);
+  close(transfer->splice_fds[1]);
+  transfer->splice_fds[0] = -1;
+  transfer->splice_fds[1] = -1;
+  transfer->offset = 0;
+  return rv == static_cast<ssize_t>(transfer->bytes_left);
+}
+
+static ssize_t sl_data_transfer_fill(struct sl_data_transfer* transfer) {
+  if (transfer->splice_fds[1] >= 0) {
+    ssize_t rv = splice(transfer->read_fd, nullptr, transfer->splice_fds[1],
+                        nullptr, DATA_TRANSFER_CHUNK_SIZE,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rv >= 0 || errno != EINVAL)
+      return rv;
+    sl_data_transfer_stop_splicing(transfer);
+  }
+
+  return read(transfer->read_fd, transfer->data.data(), transfer->data.size());
+}
+
+static ssize_t sl_data_transfer_drain(struct sl_data_transfer* transfer) {
+  if (transfer->splice_fds[0] >= 0) {
+    ssize_t rv = splice(transfer->splice_fds[0], nullptr, transfer->write_fd,
+                        nullptr, transfer->bytes_left,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rv >= 0 || errno != EINVAL)
+      return rv;
+    if (!sl_data_transfer_stop_splicing(transfer))
+      return -1;
+  }
+
+  return write(transfer->write_fd, transfer->data.data() + transfer->offset,
+               transfer->bytes_left);
+}
+
 static int sl_handle_data_transfer_read(int fd, uint32_t mask, void* data) {
   struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
   if ((mask & WL_EVENT_READABLE) == 0) {
@@ -98,9 +167,12 @@ static int sl_handle_data_transfer_read(int fd, uint32_t mask, void* data) {
   // At this point we must be in the reading state.
   assert(!transfer->bytes_left);
 
-  transfer->bytes_left =
-      read(transfer->read_fd, transfer->data, sizeof(transfer->data));
-  if (transfer->bytes_left > 0) {
+  ssize_t rv = sl_data_transfer_fill(transfer);
+  if (rv < 0 && errno == EAGAIN)
+    return 0;
+
+  if (rv > 0) {
+    transfer->bytes_left = rv;
     transfer->offset = 0;
     // There may still be data to read from the event source, but we have no
     // room in our buffer so move to the writing state.
@@ -118,7 +190,7 @@ static int sl_handle_data_transfer_read(int fd, uint32_t mask, void* data) {
 
 static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
   struct sl_data_transfer* transfer = (struct sl_data_transfer*)data;
-  int rv;
+  ssize_t rv;
 
   // If we receive a HANGUP or ERROR event on the write source then there is no
   // point in continuing the transfer. We could still read more data, but we
@@ -132,14 +204,16 @@ static int sl_handle_data_transfer_write(int fd, uint32_t mask, void* data) {
   // At this point we must be in the writing state.
   assert(transfer->bytes_left);
 
-  rv = write(transfer->write_fd, transfer->data + transfer->offset,
-             transfer->bytes_left);
+  rv = sl_data_transfer_drain(transfer);
+  if (rv < 0 && errno == EAGAIN)
+    return 0;
 
   if (rv < 0) {
     // On a write error, end the transfer.
     sl_data_transfer_destroy(transfer);
+    return 0;
   } else {
-    assert(rv <= static_cast<int>(transfer->bytes_left));
+    assert(rv <= static_cast<ssize_t>(transfer->bytes_left));
     transfer->bytes_left -= rv;
     transfer->offset += rv;
   }
@@ -175,7 +249,11 @@ static void sl_data_transfer_create(struct wl_event_loop* event_loop,
   transfer->offset = 0;
   transfer->bytes_left = 0;
   transfer->written = false;
-  memset(transfer->data, 0, DEFAULT_BUFFER_SIZE);
+  if (pipe2(transfer->splice_fds, O_CLOEXEC | O_NONBLOCK)) {
+    transfer->splice_fds[0] = -1;
+    transfer->splice_fds[1] = -1;
+    transfer->data.resize(DATA_TRANSFER_CHUNK_SIZE);
+  }
   transfer->read_event_source.reset(
       wl_event_loop_add_fd(event_loop, read_fd, WL_EVENT_READABLE,
                            sl_handle_data_transfer_read, transfer));
@@ -395,6 +473,44 @@ static void sl_data_device_data_offer(void* data,
   wl_data_device_send_data_offer(host->resource, host_data_offer->resource);
 }
 
+static void sl_data_device_forward_held_motion(
+    struct sl_host_data_device* host) {
+  if (!host->motion_pending)
+    return;
+
+  wl_data_device_send_motion(host->resource, host->motion_time,
+                             host->motion_x, host->motion_y);
+  host->motion_pending = false;
+  host->last_motion_forwarded_ns = sl_monotonic_time_ns();
+  if (host->motion_timer)
+    wl_event_source_timer_update(host->motion_timer.get(), 0);
+}
+
+static int sl_data_device_motion_timer(void* data) {
+  struct sl_host_data_device* host = static_cast<sl_host_data_device*>(data);
+
+  sl_data_device_forward_held_motion(host);
+  return 0;
+}
+
+// Returns how many milliseconds drag motion has to be held back so that the
+// focus surface gets at most one position per frame, or 0 to forward it now.
+static int sl_data_device_motion_delay_ms(struct sl_host_data_device* host) {
+  struct sl_host_surface* surface = host->focus_surface;
+
+  if (!surface || !surface->commit_interval_ns)
+    return 0;
+
+  int64_t now = sl_monotonic_time_ns();
+  if (now - surface->last_commit_ns > DATA_DEVICE_MOTION_IDLE_SURFACE_NS)
+    return 0;
+
+  int64_t next = host->last_motion_forwarded_ns + surface->commit_interval_ns;
+  if (next <= now)
+    return 0;
+  return (next - now + 999999) / 1000000;
+}
+
 static void sl_data_device_enter(void* data,
                                  struct wl_data_device* data_device,
                                  uint32_t serial,
@@ -412,6 +528,7 @@ static void sl_data_device_enter(void* data,
 
   sl_transform_host_to_guest_fixed(host->ctx, host_surface, &ix, &iy);
 
+  sl_data_device_forward_held_motion(host);
   host->focus_surface = host_surface;
 
   wl_data_device_send_enter(host->resource, serial, host_surface->resource, ix,
@@ -423,6 +540,7 @@ static void sl_data_device_leave(void* data,
   struct sl_host_data_device* host = static_cast<sl_host_data_device*>(
       wl_data_device_get_user_data(data_device));
 
+  sl_data_device_forward_held_motion(host);
   host->focus_surface = nullptr;
   wl_data_device_send_leave(host->resource);
 }
@@ -438,7 +556,27 @@ static void sl_data_device_motion(void* data,
 
   sl_transform_host_to_guest_fixed(host->ctx, host->focus_surface, &ix, &iy);
 
-  wl_data_device_send_motion(host->resource, time, ix, iy);
+  // Only the latest position matters to a drag, so positions that arrive
+  // faster than the focus surface draws replace each other.
+  bool timer_armed = host->motion_pending;
+  host->motion_pending = true;
+  host->motion_time = time;
+  host->motion_x = ix;
+  host->motion_y = iy;
+
+  int delay_ms = sl_data_device_motion_delay_ms(host);
+  if (!delay_ms) {
+    sl_data_device_forward_held_motion(host);
+    return;
+  }
+  if (timer_armed)
+    return;
+  if (!host->motion_timer) {
+    host->motion_timer.reset(wl_event_loop_add_timer(
+        wl_display_get_event_loop(host->ctx->host_display),
+        sl_data_device_motion_timer, host));
+  }
+  wl_event_source_timer_update(host->motion_timer.get(), delay_ms);
 }
 
 static void sl_data_device_drop(void* data,
@@ -446,6 +584,7 @@ static void sl_data_device_drop(void* data,
   struct sl_host_data_device* host = static_cast<sl_host_data_device*>(
       wl_data_device_get_user_data(data_device));
 
+  sl_data_device_forward_held_motion(host);
   host->focus_surface = nullptr;
   wl_data_device_send_drop(host->resource);
 }
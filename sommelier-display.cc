@@ -81,7 +81,10 @@ static void sl_host_callback_destroy(struct wl_resource* resource) {
 
   wl_callback_destroy(host->proxy);
   wl_resource_set_user_data(resource, nullptr);
-  delete host;
+  host->ctx->pending_host_callbacks--;
+  TRACE_COUNTER("display", "pending_host_callbacks",
+                host->ctx->pending_host_callbacks);
+  host->ctx->callback_pool.Delete(host);
 }
 
 static void sl_display_sync(struct wl_client* client,
@@ -89,8 +92,9 @@ static void sl_display_sync(struct wl_client* client,
                             uint32_t id) {
   struct sl_context* ctx =
       static_cast<sl_context*>(wl_resource_get_user_data(resource));
-  struct sl_host_callback* host_callback = new sl_host_callback();
+  struct sl_host_callback* host_callback = ctx->callback_pool.New();
 
+  host_callback->ctx = ctx;
   host_callback->resource =
       wl_resource_create(client, &wl_callback_interface, 1, id);
   wl_resource_set_implementation(host_callback->resource, nullptr,
@@ -98,6 +102,9 @@ static void sl_display_sync(struct wl_client* client,
   host_callback->proxy = wl_display_sync(ctx->display);
   wl_callback_add_listener(host_callback->proxy, &sl_sync_callback_listener,
                            host_callback);
+  ctx->pending_host_callbacks++;
+  TRACE_COUNTER("display", "pending_host_callbacks",
+                ctx->pending_host_callbacks);
 }
 
 static void sl_destroy_host_registry(struct wl_resource* resource) {
@@ -83,8 +83,8 @@ static void sl_fractional_scale_manager_get_fractional_scale(
   host_fractional_scale->resource =
       wl_resource_create(client, &wp_fractional_scale_v1_interface, 1, id);
   host_fractional_scale->proxy =
-      wp_fractional_scale_manager_v1_get_fractional_scale(
-          host->fractional_scale_manager->internal, host_surface->proxy);
+      wp_fractional_scale_manager_v1_get_fractional_scale(host->proxy,
+                                                          host_surface->proxy);
   wp_fractional_scale_v1_add_listener(host_fractional_scale->proxy,
                                       &fractional_scale_listener,
                                       host_fractional_scale);
@@ -18,6 +18,13 @@
 namespace vm_tools {
 namespace sommelier {
 
+using ::testing::ElementsAre;
+
+MATCHER_P3(IsEvent, type, code, value, "") {
+  return arg.type == type && arg.code == code &&
+         arg.value == static_cast<int32_t>(value);
+}
+
 class GamepadTest : public X11TestBase {
  public:
   void Connect() override {
@@ -83,7 +90,20 @@ class GamepadTest : public X11TestBase {
                                          bus, vendor_id, product_id, version);
   }
 
+  // Keeps a copy of every frame written to a uinput device in |frames|.
+  void RecordFrames() {
+    EXPECT_CALL(libevdevshim,
+                uinput_write_events(::testing::_, ::testing::_, ::testing::_))
+        .WillRepeatedly([this](const struct libevdev_uinput* uinput_dev,
+                               const struct input_event* events,
+                               size_t count) {
+          frames.emplace_back(events, events + count);
+          return 0;
+        });
+  }
+
   testing::StrictMock<MockLibevdevShim> libevdevshim;
+  std::vector<std::vector<struct input_event>> frames;
 };
 
 TEST_F(GamepadTest, GamingSeatCreatedOnWLSeatBind) {
@@ -232,10 +252,34 @@ TEST_F(GamepadTest, FrameSuccess) {
   std::vector<struct sl_host_gamepad*> host_gamepads = GetHostGamepads(&ctx);
   host_gamepads[0]->state = kStateActivated;
 
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_SYN, SYN_REPORT, 0));
+  RecordFrames();
+
+  HostEventHandler(gamepad)->frame(host_gamepads[0], gamepad, 1);
+
+  EXPECT_THAT(frames,
+              ElementsAre(ElementsAre(IsEvent(EV_SYN, SYN_REPORT, 0))));
+}
+
+TEST_F(GamepadTest, FrameWritesQueuedEventsAtOnce) {
+  struct zcr_gamepad_v2* gamepad;
+  struct libevdev* ev_dev;
+  SetupGamepad(&ctx, gamepad, ev_dev, "Xbox", 1, 2, 3, 4);
+  std::vector<struct sl_host_gamepad*> host_gamepads = GetHostGamepads(&ctx);
+  host_gamepads[0]->state = kStateActivated;
+  RecordFrames();
+
+  HostEventHandler(gamepad)->axis(host_gamepads[0], gamepad, 1, ABS_X,
+                                  wl_fixed_from_int(7));
+  HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_A,
+                                    ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_TRUE(frames.empty());
 
   HostEventHandler(gamepad)->frame(host_gamepads[0], gamepad, 1);
+
+  EXPECT_THAT(frames, ElementsAre(ElementsAre(
+                          IsEvent(EV_ABS, ABS_X, 7), IsEvent(EV_KEY, BTN_A, 1),
+                          IsEvent(EV_SYN, SYN_REPORT, 0))));
+  EXPECT_TRUE(host_gamepads[0]->pending_events.empty());
 }
 
 TEST_F(GamepadTest, ButtonDoesNothingIfGamepadNotActive) {
@@ -256,11 +300,11 @@ TEST_F(GamepadTest, ButtonSuccess) {
   std::vector<struct sl_host_gamepad*> host_gamepads = GetHostGamepads(&ctx);
   host_gamepads[0]->state = kStateActivated;
 
-  EXPECT_CALL(libevdevshim,
-              uinput_write_event(host_gamepads[0]->uinput_dev, EV_KEY, 2, 0));
-
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, 2,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_RELEASED, 0);
+
+  EXPECT_THAT(host_gamepads[0]->pending_events,
+              ElementsAre(IsEvent(EV_KEY, 2, 0)));
 }
 
 TEST_F(GamepadTest, AxisDoesNothingIfGamepadNotActive) {
@@ -280,11 +324,10 @@ TEST_F(GamepadTest, AxisSuccess) {
   std::vector<struct sl_host_gamepad*> host_gamepads = GetHostGamepads(&ctx);
   host_gamepads[0]->state = kStateActivated;
 
-  EXPECT_CALL(libevdevshim,
-              uinput_write_event(host_gamepads[0]->uinput_dev, EV_ABS, 2,
-                                 wl_fixed_to_double(250)));
-
   HostEventHandler(gamepad)->axis(host_gamepads[0], gamepad, 1, 2, 250);
+
+  EXPECT_THAT(host_gamepads[0]->pending_events,
+              ElementsAre(IsEvent(EV_ABS, 2, wl_fixed_to_double(250))));
 }
 
 TEST_F(GamepadTest, RemovedSuccess) {
@@ -333,17 +376,17 @@ TEST_F(GamepadTest, MappingsWorkCorrectly) {
     host_gamepads[0]->state = kStateActivated;
 
     for (auto& input : it.second->mapping) {
-      EXPECT_CALL(libevdevshim,
-                  uinput_write_event(host_gamepads[0]->uinput_dev, EV_ABS,
-                                     input.second, wl_fixed_to_double(250)));
-      EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                                   EV_KEY, input.second, 0));
-
       HostEventHandler(gamepad)->axis(host_gamepads[0], gamepad, 1, input.first,
                                       250);
       HostEventHandler(gamepad)->button(
           host_gamepads[0], gamepad, 1, input.first,
           ZCR_GAMEPAD_V2_BUTTON_STATE_RELEASED, 0);
+
+      EXPECT_THAT(
+          host_gamepads[0]->pending_events,
+          ElementsAre(IsEvent(EV_ABS, input.second, wl_fixed_to_double(250)),
+                      IsEvent(EV_KEY, input.second, 0)));
+      host_gamepads[0]->pending_events.clear();
     }
 
     EXPECT_EQ(host_gamepads[0]->input_mapping, it.second);
@@ -416,110 +459,104 @@ TEST_F(GamepadTest, DualShock3MappingWorksCorrectly) {
   host_gamepads[0]->state = kStateActivated;
 
   // Handle axis events.
-  EXPECT_CALL(libevdevshim,
-              uinput_write_event(host_gamepads[0]->uinput_dev, EV_ABS, ABS_X,
-                                 wl_fixed_to_double(250)));
   HostEventHandler(gamepad)->axis(host_gamepads[0], gamepad, 1, ABS_X, 250);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_ABS, ABS_X, wl_fixed_to_double(250)));
 
-  EXPECT_CALL(libevdevshim,
-              uinput_write_event(host_gamepads[0]->uinput_dev, EV_ABS, ABS_Y,
-                                 wl_fixed_to_double(250)));
   HostEventHandler(gamepad)->axis(host_gamepads[0], gamepad, 1, ABS_Y, 250);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_ABS, ABS_Y, wl_fixed_to_double(250)));
 
-  EXPECT_CALL(libevdevshim,
-              uinput_write_event(host_gamepads[0]->uinput_dev, EV_ABS, ABS_RX,
-                                 wl_fixed_to_double(250)));
   HostEventHandler(gamepad)->axis(host_gamepads[0], gamepad, 1, ABS_RX, 250);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_ABS, ABS_RX, wl_fixed_to_double(250)));
 
-  EXPECT_CALL(libevdevshim,
-              uinput_write_event(host_gamepads[0]->uinput_dev, EV_ABS, ABS_RY,
-                                 wl_fixed_to_double(250)));
   HostEventHandler(gamepad)->axis(host_gamepads[0], gamepad, 1, ABS_RY, 250);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_ABS, ABS_RY, wl_fixed_to_double(250)));
 
-  EXPECT_CALL(libevdevshim,
-              uinput_write_event(host_gamepads[0]->uinput_dev, EV_ABS, ABS_Z,
-                                 wl_fixed_to_double(250)));
   HostEventHandler(gamepad)->axis(host_gamepads[0], gamepad, 1, ABS_Z, 250);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_ABS, ABS_Z, wl_fixed_to_double(250)));
 
-  EXPECT_CALL(libevdevshim,
-              uinput_write_event(host_gamepads[0]->uinput_dev, EV_ABS, ABS_RZ,
-                                 wl_fixed_to_double(250)));
   HostEventHandler(gamepad)->axis(host_gamepads[0], gamepad, 1, ABS_RZ, 250);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_ABS, ABS_RZ, wl_fixed_to_double(250)));
 
   // Handle buttons
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_KEY, BTN_THUMBL, 1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_THUMBL,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_KEY, BTN_THUMBL, 1));
 
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_KEY, BTN_THUMBR, 1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_THUMBR,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_KEY, BTN_THUMBR, 1));
 
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_KEY, BTN_A, 1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_A,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_KEY, BTN_A, 1));
 
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_KEY, BTN_B, 1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_B,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_KEY, BTN_B, 1));
 
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_KEY, BTN_X, 1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_Y,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_KEY, BTN_X, 1));
 
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_KEY, BTN_Y, 1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_X,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_KEY, BTN_Y, 1));
 
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_KEY, BTN_TL, 1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_TL,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_KEY, BTN_TL, 1));
 
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_KEY, BTN_TR, 1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_TR,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_KEY, BTN_TR, 1));
 
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_KEY, BTN_SELECT, 1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_SELECT,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_KEY, BTN_SELECT, 1));
 
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_KEY, BTN_START, 1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_START,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_KEY, BTN_START, 1));
 
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_KEY, BTN_MODE, 1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_MODE,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_KEY, BTN_MODE, 1));
 
   // These buttons involve converting a button event into an axis event.
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_ABS, ABS_HAT0X, -1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_DPAD_LEFT,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_ABS, ABS_HAT0X, 1));
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_ABS, ABS_HAT0X, -1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1,
                                     BTN_DPAD_RIGHT,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_ABS, ABS_HAT0Y, -1));
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_ABS, ABS_HAT0X, 1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_DPAD_UP,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
-  EXPECT_CALL(libevdevshim, uinput_write_event(host_gamepads[0]->uinput_dev,
-                                               EV_ABS, ABS_HAT0Y, 1));
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_ABS, ABS_HAT0Y, -1));
   HostEventHandler(gamepad)->button(host_gamepads[0], gamepad, 1, BTN_DPAD_DOWN,
                                     ZCR_GAMEPAD_V2_BUTTON_STATE_PRESSED, 0);
+  EXPECT_THAT(host_gamepads[0]->pending_events.back(),
+              IsEvent(EV_ABS, ABS_HAT0Y, 1));
 
   EXPECT_CALL(libevdevshim, free(host_gamepads[0]->ev_dev));
 
@@ -34,11 +34,11 @@
 // 6) Listen for zcr_gamepad_v2.activated to finalize a custom game controller
 //    Calls libevdev_uinput_create_from_device
 // 7) Listen for zcr_gamepad_v2.axis to set frame state for game controller
-//    Calls libevdev_uinput_write_event
+//    Queues an event for the frame
 // 8) Listen for zcr_gamepad_v2.button to set frame state for game controller
-//    Calls libevdev_uinput_write_event
+//    Queues an event for the frame
 // 9) Listen for zcr_gamepad_v2.frame to emit collected frame
-//    Calls libevdev_uinput_write_event(EV_SYN)
+//    Writes the queued events and EV_SYN with one write()
 // 10) Listen for zcr_gamepad_v2.removed to destroy gamepad
 //    Must handle gamepads in all states of construction or error
 
@@ -456,6 +456,50 @@ static bool remap_input(struct sl_host_gamepad* host_gamepad, uint32_t& input) {
   return false;
 }
 
+// Adds an event to the frame being collected for |host_gamepad|.
+static void sl_gamepad_queue_event(struct sl_host_gamepad* host_gamepad,
+                                   uint32_t time,
+                                   uint16_t type,
+                                   uint16_t code,
+                                   int32_t value) {
+  struct input_event event = {};
+
+  if (host_gamepad->pending_events.empty())
+    host_gamepad->pending_time = time;
+
+  // Note: incoming time is ignored, the kernel stamps events as they are
+  // written.
+  event.type = type;
+  event.code = code;
+  event.value = value;
+  host_gamepad->pending_events.push_back(event);
+}
+
+// Records how long the frame just written took from the host to the guest,
+// on a counter track of its own per gamepad.
+static void sl_gamepad_trace_latency(struct sl_host_gamepad* host_gamepad) {
+  uint32_t now_ms = sl_monotonic_time_ns() / 1000000;
+  uint32_t offset = now_ms - host_gamepad->pending_time;
+
+  // The fastest frame seen stands in for zero latency.
+  if (!host_gamepad->has_clock_offset ||
+      static_cast<int32_t>(offset - host_gamepad->min_clock_offset_ms) < 0) {
+    host_gamepad->min_clock_offset_ms = offset;
+    host_gamepad->has_clock_offset = true;
+  }
+
+  TRACE_COUNTER("gaming",
+                perfetto::CounterTrack(
+                    "gamepad_input_latency_ms",
+                    perfetto::Track(reinterpret_cast<uintptr_t>(host_gamepad))),
+                offset - host_gamepad->min_clock_offset_ms);
+  TRACE_COUNTER("gaming",
+                perfetto::CounterTrack(
+                    "gamepad_frame_events",
+                    perfetto::Track(reinterpret_cast<uintptr_t>(host_gamepad))),
+                host_gamepad->pending_events.size());
+}
+
 static void sl_internal_gamepad_axis(void* data,
                                      struct zcr_gamepad_v2* gamepad,
                                      uint32_t time,
@@ -470,9 +514,8 @@ static void sl_internal_gamepad_axis(void* data,
   if (!remap_input(host_gamepad, axis))
     return;
 
-  // Note: incoming time is ignored, it will be regenerated from current time.
-  Libevdev::Get()->uinput_write_event(host_gamepad->uinput_dev, EV_ABS, axis,
-                                      wl_fixed_to_double(value));
+  sl_gamepad_queue_event(host_gamepad, time, EV_ABS, axis,
+                         wl_fixed_to_double(value));
 }
 
 static void sl_internal_gamepad_button(void* data,
@@ -506,15 +549,12 @@ static void sl_internal_gamepad_button(void* data,
       if (value == 1 &&
           (original_button == BTN_DPAD_UP || original_button == BTN_DPAD_LEFT))
         value = -1;
-      Libevdev::Get()->uinput_write_event(host_gamepad->uinput_dev, EV_ABS,
-                                          button, value);
+      sl_gamepad_queue_event(host_gamepad, time, EV_ABS, button, value);
       return;
     }
   }
 
-  // Note: incoming time is ignored, it will be regenerated from current time.
-  Libevdev::Get()->uinput_write_event(host_gamepad->uinput_dev, EV_KEY, button,
-                                      value);
+  sl_gamepad_queue_event(host_gamepad, time, EV_KEY, button, value);
 }
 
 static void sl_internal_gamepad_frame(void* data,
@@ -526,9 +566,15 @@ static void sl_internal_gamepad_frame(void* data,
   if (host_gamepad->state != kStateActivated)
     return;
 
-  // Note: incoming time is ignored, it will be regenerated from current time.
-  Libevdev::Get()->uinput_write_event(host_gamepad->uinput_dev, EV_SYN,
-                                      SYN_REPORT, 0);
+  sl_gamepad_queue_event(host_gamepad, time, EV_SYN, SYN_REPORT, 0);
+
+  // The whole frame goes out in a single write, so the guest sees it at once
+  // and we don't pay a syscall per axis and button.
+  Libevdev::Get()->uinput_write_events(host_gamepad->uinput_dev,
+                                       host_gamepad->pending_events.data(),
+                                       host_gamepad->pending_events.size());
+  sl_gamepad_trace_latency(host_gamepad);
+  host_gamepad->pending_events.clear();
 }
 
 static void sl_internal_gamepad_axis_added(void* data,
@@ -625,6 +671,9 @@ static void sl_internal_gaming_seat_gamepad_added_with_device_info(
   host_gamepad->product_id = product_id;
   host_gamepad->version = version;
   host_gamepad->input_mapping = nullptr;
+  host_gamepad->pending_time = 0;
+  host_gamepad->min_clock_offset_ms = 0;
+  host_gamepad->has_clock_offset = false;
 
   if (host_gamepad->ev_dev == nullptr) {
     LOG(ERROR) << "libevdev_new failed";
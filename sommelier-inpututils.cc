@@ -13,6 +13,14 @@
 #include <wayland-client.h>
 #include <wayland-util.h>
 
+// Events one frame can hold, the last of them reserved for the frame or
+// cancel event itself. Enough for a down, motion and up on each of ten
+// touch points.
+#define TOUCHRECORDER_MAX_EVENTS 32
+
+// Events are recorded in place and the recorder starts over after every
+// frame and cancel, so touch input never allocates once a recorder is
+// attached.
 struct sl_touchrecorder {
   struct wl_touch* proxy;
   sl_touchrecorder_frame_cb* frame_cb;
@@ -20,7 +28,7 @@ struct sl_touchrecorder {
   void* data;
   unsigned events_size;
   unsigned events_alloc;
-  struct sl_touchrecorder_event events[32];
+  struct sl_touchrecorder_event events[TOUCHRECORDER_MAX_EVENTS];
 };
 
 static void sl_touchrecorder_reset(struct sl_touchrecorder* recorder) {
@@ -137,8 +145,7 @@ struct sl_touchrecorder* sl_touchrecorder_attach(
   recorder->cancel_cb = cancel_cb;
   recorder->data = data;
   recorder->events_size = 0;
-  recorder->events_alloc =
-      sizeof(recorder->events) / sizeof(recorder->events[0]);
+  recorder->events_alloc = TOUCHRECORDER_MAX_EVENTS;
   wl_touch_add_listener(proxy, &sl_touchrecorder_listener, recorder);
 
   return recorder;
@@ -0,0 +1,138 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-io-uring.h"  // NOLINT(build/include_directory)
+
+#include <errno.h>
+#include <gtest/gtest.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+
+namespace vm_tools {
+namespace sommelier {
+
+namespace {
+
+const size_t kMaxSize = 64;
+const size_t kControlSize = CMSG_SPACE(sizeof(int) * 4);
+
+class SocketReceiveRingTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets_), 0);
+    int ret = ring_.Init(sockets_[0], kMaxSize, kControlSize);
+    if (ret)
+      GTEST_SKIP() << "io_uring unavailable: " << strerror(-ret);
+  }
+
+  void TearDown() override {
+    close(sockets_[0]);
+    close(sockets_[1]);
+  }
+
+ protected:
+  // Reaps everything received so far into |received_|, returning how many
+  // chunks there were.
+  int32_t Reap(bool wait) {
+    return ring_.Reap(wait, [this](struct msghdr& msg, uint8_t* data,
+                                   size_t size) {
+      received_.append(reinterpret_cast<char*>(data), size);
+      for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+           cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+          int fd;
+          memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+          received_fds_++;
+          close(fd);
+        }
+      }
+    });
+  }
+
+  int sockets_[2] = {-1, -1};
+  SocketReceiveRing ring_;
+  std::string received_;
+  int received_fds_ = 0;
+};
+
+}  // namespace
+
+TEST_F(SocketReceiveRingTest, ReceivesInOrder) {
+  EXPECT_EQ(Reap(false), 0);
+
+  ASSERT_EQ(write(sockets_[1], "hello ", 6), 6);
+  EXPECT_EQ(Reap(true), 1);
+  ASSERT_EQ(write(sockets_[1], "world", 5), 5);
+  EXPECT_EQ(Reap(true), 1);
+  EXPECT_EQ(received_, "hello world");
+}
+
+TEST_F(SocketReceiveRingTest, PollsReadableOnceReceived) {
+  struct pollfd ring_poll = {ring_.fd(), POLLIN, 0};
+
+  EXPECT_EQ(poll(&ring_poll, 1, 0), 0);
+  ASSERT_EQ(write(sockets_[1], "ping", 4), 4);
+  EXPECT_EQ(poll(&ring_poll, 1, 1000), 1);
+  EXPECT_EQ(Reap(false), 1);
+  EXPECT_EQ(received_, "ping");
+  EXPECT_EQ(poll(&ring_poll, 1, 0), 0);
+}
+
+TEST_F(SocketReceiveRingTest, KeepsReceivingPastTheBuffers) {
+  std::string sent;
+
+  // More chunks than there are buffers, reaped only once in a while.
+  for (int i = 0; i < 200; ++i) {
+    std::string chunk(1 + i % kMaxSize, 'a' + i % 26);
+    ASSERT_EQ(write(sockets_[1], chunk.data(), chunk.size()),
+              static_cast<ssize_t>(chunk.size()));
+    sent += chunk;
+    if (i % 50 == 49) {
+      while (received_.size() < sent.size())
+        ASSERT_GE(Reap(true), 0);
+    }
+  }
+  while (received_.size() < sent.size())
+    ASSERT_GE(Reap(true), 0);
+  EXPECT_EQ(received_, sent);
+}
+
+TEST_F(SocketReceiveRingTest, ReceivesFds) {
+  int fds[2];
+  char byte = 'x';
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  struct iovec iov = {&byte, 1};
+  struct msghdr msg = {};
+
+  ASSERT_EQ(pipe(fds), 0);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int));
+  ASSERT_EQ(sendmsg(sockets_[1], &msg, 0), 1);
+  close(fds[0]);
+  close(fds[1]);
+
+  EXPECT_EQ(Reap(true), 1);
+  EXPECT_EQ(received_, "x");
+  EXPECT_EQ(received_fds_, 1);
+}
+
+TEST_F(SocketReceiveRingTest, ReportsHangUp) {
+  close(sockets_[1]);
+  sockets_[1] = -1;
+  EXPECT_EQ(Reap(true), -EPIPE);
+}
+
+}  // namespace sommelier
+}  // namespace vm_tools
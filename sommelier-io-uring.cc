@@ -0,0 +1,237 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-io-uring.h"  // NOLINT(build/include_directory)
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace {
+
+// Room for the receive and a provide for every buffer.
+const unsigned kQueueEntries = 32;
+// Buffers the kernel may fill before a Reap().
+const uint16_t kBufferCount = 16;
+const uint16_t kBufferGroup = 0;
+const uint64_t kReceiveTag = 1;
+const uint64_t kProvideTag = 2;
+
+int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int fd,
+                   unsigned to_submit,
+                   unsigned min_complete,
+                   unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 nullptr, 0);
+}
+
+}  // namespace
+
+SocketReceiveRing::~SocketReceiveRing() {
+  // Closing the ring cancels the receive.
+  if (ring_fd_ >= 0)
+    close(ring_fd_);
+  if (sqes_)
+    munmap(sqes_, sqes_size_);
+  if (rings_)
+    munmap(rings_, rings_size_);
+}
+
+int32_t SocketReceiveRing::Init(int socket_fd,
+                                size_t max_size,
+                                size_t control_size) {
+  struct io_uring_params params = {};
+  void* addr;
+
+  ring_fd_ = io_uring_setup(kQueueEntries, &params);
+  if (ring_fd_ < 0)
+    return -errno;
+
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    return -EOPNOTSUPP;
+
+  rings_size_ = std::max(
+      params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+  addr = mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (addr == MAP_FAILED)
+    return -errno;
+  rings_ = addr;
+
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  addr = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (addr == MAP_FAILED)
+    return -errno;
+  sqes_ = static_cast<struct io_uring_sqe*>(addr);
+
+  uint8_t* base = static_cast<uint8_t*>(rings_);
+  sq_head_ = reinterpret_cast<uint32_t*>(base + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<uint32_t*>(base + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<uint32_t*>(base + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<uint32_t*>(base + params.sq_off.array);
+  cq_head_ = reinterpret_cast<uint32_t*>(base + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<uint32_t*>(base + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<uint32_t*>(base + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+
+  // Each buffer is laid out as io_uring_recvmsg_out, the control messages
+  // and then the data.
+  template_.msg_controllen = control_size;
+  buffer_size_ = sizeof(struct io_uring_recvmsg_out) + control_size + max_size;
+  buffers_.resize(kBufferCount * buffer_size_);
+
+  socket_fd_ = socket_fd;
+  ProvideBuffers(0, kBufferCount);
+  PostReceive();
+  int32_t ret = Submit();
+  if (ret)
+    return ret;
+
+  // Kernels without multishot recvmsg, or without skipping successful
+  // completions, reject them as soon as they are issued.
+  uint32_t head = *cq_head_;
+  if (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+    if (cqe->res < 0 && !(cqe->flags & IORING_CQE_F_MORE))
+      return cqe->res;
+  }
+
+  return 0;
+}
+
+struct io_uring_sqe* SocketReceiveRing::QueueEntry() {
+  uint32_t tail = *sq_tail_;
+  uint32_t index = tail & sq_mask_;
+  struct io_uring_sqe* sqe = &sqes_[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  queued_++;
+  return sqe;
+}
+
+void SocketReceiveRing::ProvideBuffers(uint16_t id, uint16_t count) {
+  struct io_uring_sqe* sqe = QueueEntry();
+
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = count;
+  sqe->addr = reinterpret_cast<uint64_t>(&buffers_[id * buffer_size_]);
+  sqe->len = buffer_size_;
+  sqe->off = id;
+  sqe->buf_group = kBufferGroup;
+  sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+  sqe->user_data = kProvideTag;
+  recycled_ += count;
+}
+
+void SocketReceiveRing::PostReceive() {
+  struct io_uring_sqe* sqe = QueueEntry();
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = socket_fd_;
+  sqe->addr = reinterpret_cast<uint64_t>(&template_);
+  sqe->len = 1;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kBufferGroup;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->user_data = kReceiveTag;
+  receiving_ = true;
+}
+
+int32_t SocketReceiveRing::Submit() {
+  // Queued provides are issued in order, so they land before the receive
+  // needs them.
+  if (io_uring_enter(ring_fd_, queued_, 0, 0) < 0)
+    return -errno;
+
+  queued_ = 0;
+  provided_ += recycled_;
+  recycled_ = 0;
+  return 0;
+}
+
+int32_t SocketReceiveRing::Reap(bool wait, const Handler& handler) {
+  int32_t handled = 0;
+  int32_t ret = 0;
+
+  if (wait && io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+      errno != EINTR) {
+    return -errno;
+  }
+
+  uint32_t head = *cq_head_;
+  uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  for (; head != tail && !ret; ++head) {
+    struct io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+
+    // Only failed provides complete.
+    if (cqe->user_data == kProvideTag) {
+      ret = cqe->res;
+      continue;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      receiving_ = false;
+
+    // Running out of buffers just stops the receive until it is reposted.
+    if (cqe->res == -ENOBUFS)
+      continue;
+    if (cqe->res < 0) {
+      ret = cqe->res;
+      continue;
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+      continue;
+
+    uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    uint8_t* buffer = &buffers_[id * buffer_size_];
+    struct io_uring_recvmsg_out* out =
+        reinterpret_cast<struct io_uring_recvmsg_out*>(buffer);
+    uint8_t* control = buffer + sizeof(*out);
+
+    provided_--;
+    if (out->payloadlen == 0) {
+      ret = -EPIPE;
+    } else {
+      struct msghdr msg = {};
+      msg.msg_control = control;
+      msg.msg_controllen = out->controllen;
+      handler(msg, control + template_.msg_controllen, out->payloadlen);
+      handled++;
+    }
+    ProvideBuffers(id, 1);
+
+    // Always leave room to repost the receive.
+    if (queued_ + 1 == kQueueEntries)
+      ret = Submit();
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+  if (ret)
+    return ret;
+
+  // Hand the buffers back in bulk, unless the receive stopped or the kernel
+  // is about to run out.
+  if (!receiving_)
+    PostReceive();
+  if (!receiving_ || provided_ < kBufferCount / 2) {
+    ret = Submit();
+    if (ret)
+      return ret;
+  }
+
+  return handled;
+}
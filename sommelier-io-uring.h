@@ -0,0 +1,91 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_SOMMELIER_IO_URING_H_
+#define VM_TOOLS_SOMMELIER_SOMMELIER_IO_URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <functional>
+#include <vector>
+
+// Keeps a multishot recvmsg posted on a socket through io_uring, so that
+// everything that arrives is received without a recvmsg call per message,
+// and handed out a whole batch of completions at a time.
+//
+// Needs a kernel with multishot recvmsg (6.0 or later). Init() fails on
+// anything older, and callers fall back to receiving from the socket
+// themselves.
+class SocketReceiveRing {
+ public:
+  // Called with each received chunk, in order. |msg| only carries the
+  // control messages, the data is |size| bytes at |data|. Both are only
+  // valid during the call.
+  using Handler =
+      std::function<void(struct msghdr& msg, uint8_t* data, size_t size)>;
+
+  SocketReceiveRing() = default;
+  SocketReceiveRing(const SocketReceiveRing&) = delete;
+  SocketReceiveRing& operator=(const SocketReceiveRing&) = delete;
+  ~SocketReceiveRing();
+
+  // Starts receiving from |socket_fd| in chunks of up to |max_size| bytes,
+  // each with up to |control_size| bytes of control messages. Returns 0 on
+  // success, -errno on failure.
+  int32_t Init(int socket_fd, size_t max_size, size_t control_size);
+
+  // Polls readable while completions are waiting for Reap().
+  int fd() const { return ring_fd_; }
+
+  // Hands every completed receive to |handler|, waiting for at least one
+  // first if |wait| is true, and re-posts the receive if it stopped.
+  // Returns the number of chunks handled, -EPIPE once the peer hung up, or
+  // -errno on failure.
+  int32_t Reap(bool wait, const Handler& handler);
+
+ private:
+  // Claims the next submission queue entry.
+  struct io_uring_sqe* QueueEntry();
+  // Queues handing the |count| buffers from |id| on to the kernel.
+  void ProvideBuffers(uint16_t id, uint16_t count);
+  // Queues the multishot recvmsg.
+  void PostReceive();
+  // Submits everything queued.
+  int32_t Submit();
+
+  int ring_fd_ = -1;
+  int socket_fd_ = -1;
+
+  // Submission and completion rings, shared with the kernel.
+  void* rings_ = nullptr;
+  size_t rings_size_ = 0;
+  struct io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  uint32_t* sq_head_ = nullptr;
+  uint32_t* sq_tail_ = nullptr;
+  uint32_t sq_mask_ = 0;
+  uint32_t* sq_array_ = nullptr;
+  uint32_t* cq_head_ = nullptr;
+  uint32_t* cq_tail_ = nullptr;
+  uint32_t cq_mask_ = 0;
+  struct io_uring_cqe* cqes_ = nullptr;
+
+  // Entries queued since the last Submit().
+  uint32_t queued_ = 0;
+
+  // Buffers the kernel receives into. |provided_| of them are with the
+  // kernel, and |recycled_| more are queued to go back to it.
+  size_t buffer_size_ = 0;
+  std::vector<uint8_t> buffers_;
+  uint32_t provided_ = 0;
+  uint32_t recycled_ = 0;
+
+  // Template for every recvmsg: only the control buffer size matters.
+  struct msghdr template_ = {};
+  bool receiving_ = false;
+};
+
+#endif  // VM_TOOLS_SOMMELIER_SOMMELIER_IO_URING_H_
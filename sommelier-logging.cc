@@ -4,17 +4,123 @@
 
 #include "sommelier-logging.h"  // NOLINT(build/include_directory)
 
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
 namespace logging {
 
 int64_t min_log_level = LOG_LEVEL;
 
-std::string file_name(std::string file_path) {
-  // Extract file name from file path.
-  auto found = file_path.find_last_of('/');
-  if (found != std::string::npos) {
-    return file_path.substr(found + 1);
+namespace {
+
+// Messages the async sink may have waiting before it drops new ones.
+const size_t kMaxAsyncMessages = 1024;
+
+class AsyncSink {
+ public:
+  AsyncSink() : pid_(getpid()), thread_(&AsyncSink::Run, this) {}
+
+  // Returns false if messages from this process can't go through the sink,
+  // i.e. in a forked child, where the thread doesn't exist.
+  bool Write(std::string message) {
+    if (getpid() != pid_) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (messages_.size() >= kMaxAsyncMessages) {
+      dropped_++;
+      return true;
+    }
+    messages_.push_back(std::move(message));
+    cond_.notify_one();
+    return true;
+  }
+
+  // Waits for everything queued to be written.
+  void Flush() {
+    if (getpid() != pid_) {
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return messages_.empty() && !writing_; });
+  }
+
+ private:
+  void Run() {
+    std::deque<std::string> messages;
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    for (;;) {
+      cond_.wait(lock, [this] { return !messages_.empty() || dropped_; });
+      messages.swap(messages_);
+      size_t dropped = dropped_;
+      dropped_ = 0;
+      writing_ = true;
+      lock.unlock();
+
+      for (const std::string& message : messages) {
+        WriteAll(message);
+      }
+      messages.clear();
+      if (dropped) {
+        WriteAll(std::to_string(dropped) + " log messages dropped\n");
+      }
+
+      lock.lock();
+      writing_ = false;
+      cond_.notify_all();
+    }
   }
-  return file_path;
+
+  static void WriteAll(const std::string& message) {
+    const char* data = message.data();
+    size_t size = message.size();
+    while (size) {
+      ssize_t written = write(STDERR_FILENO, data, size);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+      data += written;
+      size -= written;
+    }
+  }
+
+  pid_t pid_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<std::string> messages_;
+  size_t dropped_ = 0;
+  bool writing_ = false;
+  std::thread thread_;
+};
+
+// Never destroyed, since messages may be logged until the very end.
+std::atomic<AsyncSink*> async_sink;
+
+void flush_async_sink() {
+  async_sink.load(std::memory_order_acquire)->Flush();
+}
+
+}  // namespace
+
+void start_async_sink() {
+  static std::once_flag started;
+  std::call_once(started, [] {
+    async_sink.store(new AsyncSink(), std::memory_order_release);
+    atexit(flush_async_sink);
+  });
 }
 
 std::string log_level_to_string(int level) {
@@ -32,4 +138,20 @@ std::string log_level_to_string(int level) {
   return std::to_string(level);
 }
 
+Log::~Log() {
+  if (this->log_content.tellp() <= 0) {
+    return;
+  }
+
+  std::ostringstream message;
+  message << log_level_to_string(this->log_level) << " <" << this->file << ":"
+          << this->line << "> " << this->function << ": "
+          << this->log_content.str() << "\n";
+  AsyncSink* sink = async_sink.load(std::memory_order_acquire);
+  if (sink && sink->Write(message.str())) {
+    return;
+  }
+  std::cerr << message.str() << std::flush;
+}
+
 }  // namespace logging
@@ -34,13 +34,28 @@ constexpr int LOG_LEVEL_WARNING = 1;
 constexpr int LOG_LEVEL_ERROR = 2;
 constexpr int LOG_LEVEL_FATAL = 3;
 
-#define LOG(level)                                                            \
-  ::logging::Log(LOG_LEVEL_##level, __func__, ::logging::file_name(__FILE__), \
-                 __LINE__)
+// Filtered messages are skipped before anything is constructed or any of
+// the streamed expressions are evaluated.
+#define LOG(level)                                                     \
+  !::logging::is_enabled(LOG_LEVEL_##level)                            \
+      ? (void)0                                                        \
+      : ::logging::LogVoidify() &                                      \
+            ::logging::Log(LOG_LEVEL_##level, __func__,                \
+                           ::logging::file_name(__FILE__), __LINE__)
 
 namespace logging {
 
-std::string file_name(std::string file_path);
+constexpr const char* file_name(const char* file_path) {
+  // Extract file name from file path.
+  const char* name = file_path;
+  for (const char* c = file_path; *c; ++c) {
+    if (*c == '/') {
+      name = c + 1;
+    }
+  }
+  return name;
+}
+
 std::string log_level_to_string(int level);
 
 // not thread-safe
@@ -48,32 +63,31 @@ extern int64_t min_log_level;
 inline void set_min_log_level(int64_t level) {
   min_log_level = level;
 }
+inline bool is_enabled(int level) {
+  return level >= min_log_level;
+}
+
+// Writes messages to stderr from a background thread from now on, so that
+// logging never blocks on it. Messages are dropped, and the number dropped
+// reported later, while more than a bounded number are waiting.
+void start_async_sink();
 
 class Log {
  private:
-  std::stringstream log_content;
+  std::ostringstream log_content;
 
  public:
-  std::string function;
-  std::string file;
+  const char* function;
+  const char* file;
   int line;
   int log_level;
 
-  explicit Log(int log_level,
-               std::string function,
-               std::string file,
-               int line) {
-    this->log_level = log_level;
-    this->function = function;
-    this->file = file;
-    this->line = line;
-  }
+  Log(int log_level, const char* function, const char* file, int line)
+      : function(function), file(file), line(line), log_level(log_level) {}
 
   template <typename T>
   Log& operator<<(T const& value) {
-    if (log_level >= min_log_level) {
-      this->log_content << value;
-    }
+    this->log_content << value;
     return *this;
   }
 
@@ -97,19 +111,17 @@ class Log {
   }
 #endif
 
-  ~Log() {
-    // Example expected usage:
-    //   LOG(INFO) << "hello world ";
-    // Temporary objects are destroyed after the end of the expression, which
-    // means this destructor is called at 'semicolon', resulting in printing to
-    // cerr.
-    if (this->log_content.peek() == EOF) {
-      return;
-    }
-    std::cerr << log_level_to_string(this->log_level) << " <" << this->file
-              << ":" << this->line << "> " << this->function << ": "
-              << this->log_content.rdbuf() << std::endl;
-  }
+  // Example expected usage:
+  //   LOG(INFO) << "hello world ";
+  // Temporary objects are destroyed after the end of the expression, which
+  // means this destructor is called at 'semicolon', resulting in printing to
+  // stderr.
+  ~Log();
+};
+
+// Turns the LOG() expression into void, to match the other branch.
+struct LogVoidify {
+  void operator&(const Log&) {}
 };
 
 }  // namespace logging
@@ -0,0 +1,79 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-metrics.h"  // NOLINT(build/include_directory)
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+namespace vm_tools {
+namespace sommelier {
+
+TEST(MetricsTest, FormatsCounters) {
+  struct sl_metrics metrics = {};
+  metrics.commits = 42;
+  metrics.channel_bytes_sent = 1024;
+  metrics.fullscreen_scanout_compatible_commits = 7;
+
+  std::string text = sl_metrics_format(&metrics);
+  EXPECT_NE(text.find("# TYPE sommelier_commits_total counter\n"
+                      "sommelier_commits_total 42\n"),
+            std::string::npos);
+  EXPECT_NE(text.find("\nsommelier_channel_sent_bytes_total 1024\n"),
+            std::string::npos);
+  EXPECT_NE(
+      text.find("\nsommelier_fullscreen_scanout_compatible_commits_total 7\n"),
+      std::string::npos);
+}
+
+TEST(MetricsTest, BucketsLoopIterationsCumulatively) {
+  struct sl_metrics metrics = {};
+  sl_metrics_record_loop_iteration(&metrics, 50000);      // 50us
+  sl_metrics_record_loop_iteration(&metrics, 3000000);    // 3ms
+  sl_metrics_record_loop_iteration(&metrics, 500000000);  // 500ms
+
+  EXPECT_EQ(metrics.loop_iterations, 3u);
+  EXPECT_EQ(metrics.loop_busy_buckets[0], 1u);
+  EXPECT_EQ(metrics.loop_busy_buckets[SL_METRICS_LOOP_BUCKETS], 1u);
+
+  std::string text = sl_metrics_format(&metrics);
+  const char* loop = "sommelier_event_loop_busy_seconds";
+  EXPECT_NE(text.find(std::string(loop) + "_bucket{le=\"0.0001\"} 1\n"),
+            std::string::npos);
+  EXPECT_NE(text.find(std::string(loop) + "_bucket{le=\"0.005\"} 2\n"),
+            std::string::npos);
+  EXPECT_NE(text.find(std::string(loop) + "_bucket{le=\"0.1\"} 2\n"),
+            std::string::npos);
+  EXPECT_NE(text.find(std::string(loop) + "_bucket{le=\"+Inf\"} 3\n"),
+            std::string::npos);
+  EXPECT_NE(text.find(std::string(loop) + "_count 3\n"), std::string::npos);
+}
+
+TEST(MetricsTest, TimesDispatchesPerHandler) {
+  struct sl_metrics metrics = {};
+  sl_metrics_record_dispatch(&metrics, SL_METRICS_HANDLER_X, 50000);  // 50us
+  sl_metrics_record_dispatch(&metrics, SL_METRICS_HANDLER_X,
+                             20000000);  // 20ms
+
+  EXPECT_EQ(metrics.handler_dispatches[SL_METRICS_HANDLER_X], 2u);
+  EXPECT_EQ(metrics.handler_dispatches[SL_METRICS_HANDLER_HOST], 0u);
+
+  std::string text = sl_metrics_format(&metrics);
+  const char* dispatch = "sommelier_event_dispatch_seconds";
+  EXPECT_NE(text.find(std::string(dispatch) +
+                      "_bucket{handler=\"x\",le=\"0.0001\"} 1\n"),
+            std::string::npos);
+  EXPECT_NE(text.find(std::string(dispatch) +
+                      "_bucket{handler=\"x\",le=\"0.016\"} 1\n"),
+            std::string::npos);
+  EXPECT_NE(text.find(std::string(dispatch) + "_count{handler=\"x\"} 2\n"),
+            std::string::npos);
+  EXPECT_NE(
+      text.find(std::string(dispatch) + "_count{handler=\"host\"} 0\n"),
+      std::string::npos);
+}
+
+}  // namespace sommelier
+}  // namespace vm_tools
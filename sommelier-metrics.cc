@@ -0,0 +1,300 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-metrics.h"  // NOLINT(build/include_directory)
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include "sommelier-ctx.h"      // NOLINT(build/include_directory)
+#include "sommelier-logging.h"  // NOLINT(build/include_directory)
+
+// Scrapers that haven't hung up yet. Older ones are dropped beyond this.
+#define SL_METRICS_MAX_CLIENTS 8
+
+// Stalls are logged at most this often, so that a loop that keeps stalling
+// doesn't make it worse.
+#define SL_METRICS_STALL_LOG_INTERVAL_NS 1000000000
+
+const int64_t sl_metrics_loop_bucket_us[SL_METRICS_LOOP_BUCKETS] = {
+    100, 500, 1000, 2000, 5000, 10000, 16000, 50000, 100000};
+
+const char* const sl_metrics_handler_names[SL_METRICS_HANDLER_COUNT] = {
+    "host", "x", "channel", "clipboard"};
+
+// A connection that was sent the metrics, kept until the scraper hangs up
+// so that closing it doesn't discard the request it sent.
+struct sl_metrics_client {
+  int fd;
+  std::unique_ptr<struct wl_event_source> event_source;
+  struct wl_list link;
+};
+
+static int sl_metrics_loop_bucket(int64_t busy_ns) {
+  int bucket = 0;
+  while (bucket < SL_METRICS_LOOP_BUCKETS &&
+         busy_ns > sl_metrics_loop_bucket_us[bucket] * 1000) {
+    bucket++;
+  }
+  return bucket;
+}
+
+void sl_metrics_record_loop_iteration(struct sl_metrics* metrics,
+                                      int64_t busy_ns) {
+  metrics->loop_busy_buckets[sl_metrics_loop_bucket(busy_ns)]++;
+  metrics->loop_busy_ns += busy_ns;
+  metrics->loop_iterations++;
+}
+
+void sl_metrics_record_dispatch(struct sl_metrics* metrics,
+                                enum sl_metrics_handler handler,
+                                int64_t busy_ns) {
+  metrics->handler_busy_buckets[handler][sl_metrics_loop_bucket(busy_ns)]++;
+  metrics->handler_busy_ns[handler] += busy_ns;
+  metrics->handler_dispatches[handler]++;
+}
+
+ScopedDispatchTimer::ScopedDispatchTimer(struct sl_context* ctx,
+                                         enum sl_metrics_handler handler)
+    : ctx_(ctx), handler_(handler), start_ns_(sl_monotonic_time_ns()) {}
+
+ScopedDispatchTimer::~ScopedDispatchTimer() {
+  int64_t now = sl_monotonic_time_ns();
+  int64_t busy_ns = now - start_ns_;
+
+  sl_metrics_record_dispatch(&ctx_->metrics, handler_, busy_ns);
+  if (busy_ns <= ctx_->stall_budget_ns)
+    return;
+
+  ctx_->metrics.handler_stalls[handler_]++;
+  if (now - ctx_->last_stall_logged_ns < SL_METRICS_STALL_LOG_INTERVAL_NS)
+    return;
+  ctx_->last_stall_logged_ns = now;
+
+  const struct sl_metrics* metrics = &ctx_->metrics;
+  LOG(WARNING) << "event loop stalled for " << busy_ns / 1000000
+               << "ms handling " << sl_metrics_handler_names[handler_]
+               << " events (" << metrics->handler_stalls[handler_] << " of "
+               << metrics->handler_dispatches[handler_]
+               << " dispatches over budget, "
+               << metrics->handler_busy_ns[handler_] / 1000 /
+                      metrics->handler_dispatches[handler_]
+               << "us on average)";
+}
+
+static void sl_metrics_format_counter(std::ostringstream& out,
+                                      const char* name,
+                                      const char* help,
+                                      uint64_t value) {
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " counter\n";
+  out << name << " " << value << "\n";
+}
+
+std::string sl_metrics_format(const struct sl_metrics* metrics) {
+  std::ostringstream out;
+
+  sl_metrics_format_counter(out, "sommelier_commits_total",
+                            "Surface commits from clients.", metrics->commits);
+  sl_metrics_format_counter(out, "sommelier_copied_bytes_total",
+                            "Bytes copied into output buffers.",
+                            metrics->bytes_copied);
+  sl_metrics_format_counter(out, "sommelier_output_buffer_allocations_total",
+                            "Output buffers allocated.",
+                            metrics->output_buffers_allocated);
+  sl_metrics_format_counter(out, "sommelier_output_buffer_trims_total",
+                            "Released output buffers destroyed to save memory.",
+                            metrics->output_buffers_trimmed);
+  sl_metrics_format_counter(out, "sommelier_channel_sent_messages_total",
+                            "Messages sent to the host.",
+                            metrics->channel_messages_sent);
+  sl_metrics_format_counter(out, "sommelier_channel_sent_bytes_total",
+                            "Bytes sent to the host.",
+                            metrics->channel_bytes_sent);
+  sl_metrics_format_counter(out, "sommelier_channel_received_messages_total",
+                            "Messages received from the host.",
+                            metrics->channel_messages_received);
+  sl_metrics_format_counter(out, "sommelier_channel_received_bytes_total",
+                            "Bytes received from the host.",
+                            metrics->channel_bytes_received);
+  sl_metrics_format_counter(out, "sommelier_x_round_trips_total",
+                            "Replies waited for from the X server.",
+                            metrics->x_round_trips);
+  sl_metrics_format_counter(out, "sommelier_fullscreen_commits_total",
+                            "Surface commits to fullscreen windows.",
+                            metrics->fullscreen_commits);
+  sl_metrics_format_counter(
+      out, "sommelier_fullscreen_scanout_compatible_commits_total",
+      "Fullscreen commits of buffers the host can scan out directly.",
+      metrics->fullscreen_scanout_compatible_commits);
+  sl_metrics_format_counter(out, "sommelier_hidden_copies_skipped_total",
+                            "Commits to minimized windows left uncopied.",
+                            metrics->hidden_copies_skipped);
+  sl_metrics_format_counter(out, "sommelier_cursor_copies_skipped_total",
+                            "Cursor commits of an unchanged image.",
+                            metrics->cursor_copies_skipped);
+  sl_metrics_format_counter(out, "sommelier_cursor_sets_dropped_total",
+                            "Redundant set_cursor requests not forwarded.",
+                            metrics->cursor_sets_dropped);
+  sl_metrics_format_counter(out, "sommelier_sync_commits_merged_total",
+                            "Subsurface commits merged before the parent's.",
+                            metrics->sync_commits_merged);
+  sl_metrics_format_counter(out, "sommelier_configures_superseded_total",
+                            "Host configures dropped for newer ones.",
+                            metrics->configures_superseded);
+  sl_metrics_format_counter(out, "sommelier_housekeeping_wakeups_total",
+                            "Wakeups for periodic work.",
+                            metrics->housekeeping_wakeups);
+
+  const char* loop = "sommelier_event_loop_busy_seconds";
+  out << "# HELP " << loop << " Time spent handling each event loop wakeup.\n";
+  out << "# TYPE " << loop << " histogram\n";
+  uint64_t count = 0;
+  for (int i = 0; i < SL_METRICS_LOOP_BUCKETS; ++i) {
+    count += metrics->loop_busy_buckets[i];
+    out << loop << "_bucket{le=\"" << sl_metrics_loop_bucket_us[i] / 1e6
+        << "\"} " << count << "\n";
+  }
+  out << loop << "_bucket{le=\"+Inf\"} " << metrics->loop_iterations << "\n";
+  out << loop << "_sum " << metrics->loop_busy_ns / 1e9 << "\n";
+  out << loop << "_count " << metrics->loop_iterations << "\n";
+
+  const char* dispatch = "sommelier_event_dispatch_seconds";
+  out << "# HELP " << dispatch << " Time spent in each event handler.\n";
+  out << "# TYPE " << dispatch << " histogram\n";
+  for (int h = 0; h < SL_METRICS_HANDLER_COUNT; ++h) {
+    const char* handler = sl_metrics_handler_names[h];
+    count = 0;
+    for (int i = 0; i < SL_METRICS_LOOP_BUCKETS; ++i) {
+      count += metrics->handler_busy_buckets[h][i];
+      out << dispatch << "_bucket{handler=\"" << handler << "\",le=\""
+          << sl_metrics_loop_bucket_us[i] / 1e6 << "\"} " << count << "\n";
+    }
+    out << dispatch << "_bucket{handler=\"" << handler << "\",le=\"+Inf\"} "
+        << metrics->handler_dispatches[h] << "\n";
+    out << dispatch << "_sum{handler=\"" << handler << "\"} "
+        << metrics->handler_busy_ns[h] / 1e9 << "\n";
+    out << dispatch << "_count{handler=\"" << handler << "\"} "
+        << metrics->handler_dispatches[h] << "\n";
+  }
+
+  const char* stalls = "sommelier_event_dispatch_stalls_total";
+  out << "# HELP " << stalls << " Event handler dispatches over budget.\n";
+  out << "# TYPE " << stalls << " counter\n";
+  for (int h = 0; h < SL_METRICS_HANDLER_COUNT; ++h) {
+    out << stalls << "{handler=\"" << sl_metrics_handler_names[h] << "\"} "
+        << metrics->handler_stalls[h] << "\n";
+  }
+
+  return out.str();
+}
+
+static void sl_metrics_client_destroy(struct sl_metrics_client* client) {
+  wl_list_remove(&client->link);
+  client->event_source.reset();
+  close(client->fd);
+  delete client;
+}
+
+static int sl_handle_metrics_client_event(int fd, uint32_t mask, void* data) {
+  struct sl_metrics_client* client =
+      static_cast<struct sl_metrics_client*>(data);
+  char buffer[256];
+
+  // Throw the request away, and wait for the scraper to hang up.
+  ssize_t bytes = read(fd, buffer, sizeof(buffer));
+  if (bytes > 0 || (bytes < 0 && errno == EAGAIN))
+    return 1;
+
+  sl_metrics_client_destroy(client);
+  return 0;
+}
+
+static int sl_handle_metrics_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = static_cast<struct sl_context*>(data);
+
+  int client_fd = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (client_fd < 0)
+    return 1;
+
+  // Answer like an HTTP server, so that scrapers can simply GET the socket.
+  // The whole response fits in the socket buffer.
+  std::string response =
+      "HTTP/1.0 200 OK\r\n"
+      "Content-Type: text/plain; version=0.0.4\r\n"
+      "Connection: close\r\n\r\n" +
+      sl_metrics_format(&ctx->metrics);
+  if (send(client_fd, response.data(), response.size(), MSG_NOSIGNAL) < 0 ||
+      shutdown(client_fd, SHUT_WR) < 0) {
+    close(client_fd);
+    return 1;
+  }
+
+  if (wl_list_length(&ctx->metrics_clients) >= SL_METRICS_MAX_CLIENTS) {
+    struct sl_metrics_client* oldest;
+    oldest = wl_container_of(ctx->metrics_clients.prev, oldest, link);
+    sl_metrics_client_destroy(oldest);
+  }
+
+  struct sl_metrics_client* client = new sl_metrics_client();
+  client->fd = client_fd;
+  client->event_source.reset(wl_event_loop_add_fd(
+      wl_display_get_event_loop(ctx->host_display), client_fd,
+      WL_EVENT_READABLE, sl_handle_metrics_client_event, client));
+  wl_list_insert(&ctx->metrics_clients, &client->link);
+  return 1;
+}
+
+bool sl_metrics_listen(struct sl_context* ctx, const char* path) {
+  struct sockaddr_un addr = {};
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    LOG(ERROR) << "metrics socket path too long: " << path;
+    return false;
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    LOG(ERROR) << "failed to create metrics socket: " << strerror(errno);
+    return false;
+  }
+
+  unlink(path);
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(fd, SL_METRICS_MAX_CLIENTS) < 0) {
+    LOG(ERROR) << "failed to listen on metrics socket " << path << ": "
+               << strerror(errno);
+    close(fd);
+    return false;
+  }
+
+  ctx->metrics_fd = fd;
+  ctx->metrics_event_source.reset(
+      wl_event_loop_add_fd(wl_display_get_event_loop(ctx->host_display), fd,
+                           WL_EVENT_READABLE, sl_handle_metrics_event, ctx));
+  return true;
+}
+
+void sl_metrics_release(struct sl_context* ctx) {
+  struct sl_metrics_client* client;
+  struct sl_metrics_client* next;
+
+  wl_list_for_each_safe(client, next, &ctx->metrics_clients, link) {
+    sl_metrics_client_destroy(client);
+  }
+
+  ctx->metrics_event_source.reset();
+  if (ctx->metrics_fd >= 0) {
+    close(ctx->metrics_fd);
+    ctx->metrics_fd = -1;
+  }
+}
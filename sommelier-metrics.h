@@ -0,0 +1,112 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_SOMMELIER_METRICS_H_
+#define VM_TOOLS_SOMMELIER_SOMMELIER_METRICS_H_
+
+#include <stdint.h>
+
+#include <string>
+
+struct sl_context;
+
+// Upper bounds of the event loop busy time histogram, in microseconds. One
+// more bucket counts everything slower.
+#define SL_METRICS_LOOP_BUCKETS 9
+extern const int64_t sl_metrics_loop_bucket_us[SL_METRICS_LOOP_BUCKETS];
+
+// Event sources whose dispatches are timed separately, so that a stalled
+// event loop can be traced back to what stalled it.
+enum sl_metrics_handler {
+  SL_METRICS_HANDLER_HOST,
+  SL_METRICS_HANDLER_X,
+  SL_METRICS_HANDLER_CHANNEL,
+  SL_METRICS_HANDLER_CLIPBOARD,
+  SL_METRICS_HANDLER_COUNT,
+};
+extern const char* const sl_metrics_handler_names[SL_METRICS_HANDLER_COUNT];
+
+// Running totals served by --metrics-socket. Updating one is an increment,
+// so they are kept whether or not anything scrapes them.
+struct sl_metrics {
+  uint64_t commits;
+  uint64_t bytes_copied;
+  uint64_t output_buffers_allocated;
+  // Released output buffers destroyed by --buffer-budget or
+  // --buffer-idle-timeout.
+  uint64_t output_buffers_trimmed;
+  uint64_t channel_messages_sent;
+  uint64_t channel_bytes_sent;
+  uint64_t channel_messages_received;
+  uint64_t channel_bytes_received;
+  // Replies sommelier blocked on while running.
+  uint64_t x_round_trips;
+  // Commits to fullscreen surfaces, and those of them whose buffer the host
+  // could put straight on a scanout plane.
+  uint64_t fullscreen_commits;
+  uint64_t fullscreen_scanout_compatible_commits;
+  // Commits to hidden windows that weren't copied, see
+  // --hidden-frame-interval.
+  uint64_t hidden_copies_skipped;
+  // Cursor commits of the image the host already shows, which weren't
+  // copied, and wl_pointer.set_cursor requests that changed nothing.
+  uint64_t cursor_copies_skipped;
+  uint64_t cursor_sets_dropped;
+  // Commits of synchronized subsurfaces merged into a later one before their
+  // parent committed.
+  uint64_t sync_commits_merged;
+  // Host configures replaced by newer ones before the X client was handed
+  // them, while it caught up with an earlier one.
+  uint64_t configures_superseded;
+  // Wakeups of the timer shared by periodic work.
+  uint64_t housekeeping_wakeups;
+  // Event loop wakeups, and the time spent handling them.
+  uint64_t loop_iterations;
+  uint64_t loop_busy_ns;
+  uint64_t loop_busy_buckets[SL_METRICS_LOOP_BUCKETS + 1];
+  // Dispatches of each handler, the time they took, and how many of them
+  // took longer than --stall-budget-ms.
+  uint64_t handler_dispatches[SL_METRICS_HANDLER_COUNT];
+  uint64_t handler_busy_ns[SL_METRICS_HANDLER_COUNT];
+  uint64_t handler_busy_buckets[SL_METRICS_HANDLER_COUNT]
+                               [SL_METRICS_LOOP_BUCKETS + 1];
+  uint64_t handler_stalls[SL_METRICS_HANDLER_COUNT];
+};
+
+// Counts an event loop wakeup that took |busy_ns| to handle.
+void sl_metrics_record_loop_iteration(struct sl_metrics* metrics,
+                                      int64_t busy_ns);
+
+// Counts a dispatch of |handler| that took |busy_ns|.
+void sl_metrics_record_dispatch(struct sl_metrics* metrics,
+                                enum sl_metrics_handler handler,
+                                int64_t busy_ns);
+
+// Times the dispatch of |handler| it is alive for, and logs it if it takes
+// longer than the context's stall budget.
+class ScopedDispatchTimer {
+ public:
+  ScopedDispatchTimer(struct sl_context* ctx, enum sl_metrics_handler handler);
+  ScopedDispatchTimer(const ScopedDispatchTimer&) = delete;
+  ScopedDispatchTimer& operator=(const ScopedDispatchTimer&) = delete;
+  ~ScopedDispatchTimer();
+
+ private:
+  struct sl_context* ctx_;
+  enum sl_metrics_handler handler_;
+  int64_t start_ns_;
+};
+
+// Returns |metrics| in the Prometheus text exposition format.
+std::string sl_metrics_format(const struct sl_metrics* metrics);
+
+// Serves the metrics to every connection to a Unix socket at |path|,
+// replacing whatever was there. Returns false if the socket couldn't be
+// created.
+bool sl_metrics_listen(struct sl_context* ctx, const char* path);
+
+// Closes the socket and any connections still open.
+void sl_metrics_release(struct sl_context* ctx);
+
+#endif  // VM_TOOLS_SOMMELIER_SOMMELIER_METRICS_H_
@@ -0,0 +1,63 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_SOMMELIER_OBJECT_POOL_H_
+#define VM_TOOLS_SOMMELIER_SOMMELIER_OBJECT_POOL_H_
+
+#include <stddef.h>
+
+#include <new>
+#include <utility>
+#include <vector>
+
+// Keeps the memory of destroyed |T|s for the next ones to be created, for
+// objects that come and go with every frame. Once as many exist as at the
+// busiest point so far, creating and destroying them doesn't touch the heap.
+//
+// At most |max_free| objects' worth of memory is kept.
+template <typename T>
+class ObjectPool {
+ public:
+  explicit ObjectPool(size_t max_free = 64) : max_free_(max_free) {
+    free_.reserve(max_free_);
+  }
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  ~ObjectPool() {
+    for (void* memory : free_)
+      ::operator delete(memory);
+  }
+
+  // Value-initializes a new T, like `new T()`.
+  template <typename... Args>
+  T* New(Args&&... args) {
+    void* memory;
+    if (free_.empty()) {
+      memory = ::operator new(sizeof(T));
+    } else {
+      memory = free_.back();
+      free_.pop_back();
+    }
+    return new (memory) T(std::forward<Args>(args)...);
+  }
+
+  // Destroys an object from New(), like `delete object`.
+  void Delete(T* object) {
+    if (!object)
+      return;
+    object->~T();
+    if (free_.size() < max_free_) {
+      free_.push_back(object);
+    } else {
+      ::operator delete(object);
+    }
+  }
+
+ private:
+  size_t max_free_;
+  std::vector<void*> free_;
+};
+
+#endif  // VM_TOOLS_SOMMELIER_SOMMELIER_OBJECT_POOL_H_
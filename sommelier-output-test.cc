@@ -232,6 +232,27 @@ TEST_F(X11Test, RotatingOutputsShiftsNeighbouringOutputs) {
   EXPECT_EQ(output->virt_x, 1080);
 }
 
+TEST_F(X11Test, ShiftedOutputsAreSentWithTheOutputThatMoved) {
+  // Arrange
+  std::vector<OutputConfig> configs = {
+      {.x = 0, .y = 0, .width_pixels = 1920, .height_pixels = 1080},
+      {.x = 1920},
+  };
+  AdvertiseOutputs(xwayland.get(), configs);
+  struct sl_host_output* output = ctx.host_outputs[1];
+  EXPECT_EQ(output->sent_state.x, 1920);
+
+  // Act: Rotate the first output, which shifts the second one.
+  output = ctx.host_outputs[0];
+  ConfigureOutput(output, {.transform = WL_OUTPUT_TRANSFORM_270});
+
+  // Assert: Both outputs were sent in their new positions.
+  EXPECT_EQ(output->sent_state.transform, WL_OUTPUT_TRANSFORM_270);
+  output = ctx.host_outputs[1];
+  EXPECT_FALSE(output->needs_update);
+  EXPECT_EQ(output->sent_state.x, 1080);
+}
+
 TEST_F(X11Test, MovingOutputsShiftsOutputs) {
   // Arrange
   std::vector<OutputConfig> configs = {
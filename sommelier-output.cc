@@ -10,6 +10,8 @@
 #include <cstdint>
 #include <stdlib.h>
 #include <string.h>
+#include <tuple>
+#include <utility>
 #include <vector>
 #include <wayland-client.h>
 
@@ -395,18 +397,57 @@ void sl_output_send_host_output_state(struct sl_host_output* host) {
   // Could be more granular, but the current implementation means that if one
   // value changes, everything should be impacted.
   if (host->needs_update) {
-    wl_output_send_geometry(host->resource, host->virt_x, 0,
-                            host->virt_physical_width,
-                            host->virt_physical_height, host->subpixel,
-                            host->make, host->model, host->transform);
-    wl_output_send_mode(host->resource, host->flags | WL_OUTPUT_MODE_CURRENT,
-                        host->virt_width, host->virt_height, host->refresh);
+    struct sl_output_state state;
+    state.x = host->virt_x;
+    state.physical_width = host->virt_physical_width;
+    state.physical_height = host->virt_physical_height;
+    state.subpixel = host->subpixel;
+    state.make = host->make;
+    state.model = host->model;
+    state.transform = host->transform;
+    state.flags = host->flags | WL_OUTPUT_MODE_CURRENT;
+    state.width = host->virt_width;
+    state.height = host->virt_height;
+    state.refresh = host->refresh;
+    state.scale = host->scale_factor;
+    host->needs_update = false;
+
+    // Recalculating often ends up where it started, e.g. when only another
+    // output changed. Clients like Xwayland redo their whole screen layout
+    // for every update, so skip those that wouldn't change anything.
+    const struct sl_output_state& sent = host->sent_state;
+    if (host->has_sent_state &&
+        std::tie(state.x, state.physical_width, state.physical_height,
+                 state.subpixel, state.make, state.model, state.transform,
+                 state.flags, state.width, state.height, state.refresh,
+                 state.scale) ==
+            std::tie(sent.x, sent.physical_width, sent.physical_height,
+                     sent.subpixel, sent.make, sent.model, sent.transform,
+                     sent.flags, sent.width, sent.height, sent.refresh,
+                     sent.scale)) {
+      return;
+    }
+
+    wl_output_send_geometry(host->resource, state.x, 0, state.physical_width,
+                            state.physical_height, state.subpixel,
+                            state.make.c_str(), state.model.c_str(),
+                            state.transform);
+    wl_output_send_mode(host->resource, state.flags, state.width, state.height,
+                        state.refresh);
     if (wl_resource_get_version(host->resource) >=
         WL_OUTPUT_SCALE_SINCE_VERSION)
-      wl_output_send_scale(host->resource, host->scale_factor);
+      wl_output_send_scale(host->resource, state.scale);
     if (wl_resource_get_version(host->resource) >= WL_OUTPUT_DONE_SINCE_VERSION)
       wl_output_send_done(host->resource);
-    host->needs_update = false;
+    host->sent_state = std::move(state);
+    host->has_sent_state = true;
+  }
+}
+
+void sl_output_send_updates(struct sl_context* ctx) {
+  for (auto output : ctx->host_outputs) {
+    if (!output->changes_pending)
+      sl_output_send_host_output_state(output);
   }
 }
 
@@ -423,6 +464,7 @@ static void sl_output_geometry(void* data,
   void* result = wl_output_get_user_data(output);
   sl_host_output* host = static_cast<sl_host_output*>(result);
 
+  host->changes_pending = true;
   host->x = x;
   host->y = y;
   host->physical_width = physical_width;
@@ -461,6 +503,7 @@ static void sl_output_mode(void* data,
   struct sl_host_output* host =
       static_cast<sl_host_output*>(wl_output_get_user_data(output));
 
+  host->changes_pending = true;
   host->flags = flags;
   host->width = width;
   host->height = height;
@@ -478,9 +521,12 @@ static void sl_output_done(void* data, struct wl_output* output) {
 
   // Recalculate according to any information that's been modified.
   sl_output_calculate_virtual_dimensions(host);
+  host->changes_pending = false;
   // Shift all outputs that are to the right of host to the right if needed.
   sl_output_update_output_x(host->ctx);
-  sl_output_send_host_output_state(host);
+  // Send the outputs that moved along with this one, so that clients see
+  // the new layout in one go.
+  sl_output_send_updates(host->ctx);
 
   // Expect scale if aura output exists.
   if (host->aura_output)
@@ -493,6 +539,7 @@ static void sl_output_scale(void* data,
   struct sl_host_output* host =
       static_cast<sl_host_output*>(wl_output_get_user_data(output));
 
+  host->changes_pending = true;
   host->scale_factor = scale_factor;
 }
 
@@ -506,6 +553,7 @@ static void sl_aura_output_scale(void* data,
   struct sl_host_output* host =
       static_cast<sl_host_output*>(zaura_output_get_user_data(output));
 
+  host->changes_pending = true;
   if (flags & ZAURA_OUTPUT_SCALE_PROPERTY_CURRENT)
     host->current_scale = scale;
   if (flags & ZAURA_OUTPUT_SCALE_PROPERTY_PREFERRED)
@@ -557,6 +605,7 @@ static void sl_destroy_host_output(struct wl_resource* resource) {
   free(host->model);
   // Shift all outputs to the right of the deleted output to the left.
   sl_output_update_output_x(host->ctx);
+  sl_output_send_updates(host->ctx);
   delete host;
 }
 
@@ -575,6 +624,7 @@ static void sl_xdg_output_logical_size(void* data,
   struct sl_host_output* host = static_cast<sl_host_output*>(
       zxdg_output_v1_get_user_data(zxdg_output_v1));
 
+  host->changes_pending = true;
   host->logical_width = width;
   host->logical_height = height;
 
@@ -606,8 +656,11 @@ static void sl_bind_host_output(struct wl_client* client,
   host->aura_output = nullptr;
   // We assume that first output is internal by default.
   host->internal = ctx->host_outputs.empty();
-  // We'll always need to forward this information.
+  // We'll always need to forward this information, once the host has sent
+  // it.
   host->needs_update = true;
+  host->changes_pending = true;
+  host->has_sent_state = false;
   host->x = 0;
   host->y = 0;
   host->virt_x = 0;
@@ -0,0 +1,217 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier.h"          // NOLINT(build/include_directory)
+#include "sommelier-tracing.h"  // NOLINT(build/include_directory)
+
+#include <assert.h>
+#include <time.h>
+#include <wayland-client.h>
+#include <wayland-server-core.h>
+
+#include "presentation-time-client-protocol.h"  // NOLINT(build/include_directory)
+#include "presentation-time-server-protocol.h"  // NOLINT(build/include_directory)
+#include "sommelier-util.h"  // NOLINT(build/include_directory)
+
+// Presentation times are translated from the host's presentation clock to
+// our CLOCK_MONOTONIC. The host compositor may run in another kernel, so
+// the difference between the two clocks is estimated from how soon after
+// the host's timestamps the events reach us. The smallest difference of a
+// window of events stands for the next window, so the estimate follows the
+// clocks drifting apart as well as together.
+#define PRESENTATION_CLOCK_OFFSET_WINDOW 120
+
+struct sl_host_presentation {
+  struct sl_context* ctx;
+  struct wl_resource* resource;
+  struct wp_presentation* proxy;
+};
+
+struct sl_host_presentation_feedback {
+  struct sl_context* ctx;
+  struct wl_resource* resource;
+  struct wp_presentation_feedback* proxy;
+};
+
+int64_t sl_presentation_guest_time_ns(struct sl_presentation* presentation,
+                                      int64_t host_ns,
+                                      int64_t now_ns) {
+  int64_t offset = now_ns - host_ns;
+
+  if (!presentation->has_clock_offset ||
+      offset < presentation->clock_offset_ns) {
+    presentation->clock_offset_ns = offset;
+    presentation->has_clock_offset = true;
+  }
+  if (!presentation->window_samples ||
+      offset < presentation->window_offset_ns) {
+    presentation->window_offset_ns = offset;
+  }
+  if (++presentation->window_samples == PRESENTATION_CLOCK_OFFSET_WINDOW) {
+    presentation->clock_offset_ns = presentation->window_offset_ns;
+    presentation->window_samples = 0;
+  }
+
+  return host_ns + presentation->clock_offset_ns;
+}
+
+static void sl_presentation_feedback_sync_output(
+    void* data,
+    struct wp_presentation_feedback* feedback,
+    struct wl_output* output) {
+  struct sl_host_presentation_feedback* host =
+      static_cast<sl_host_presentation_feedback*>(
+          wp_presentation_feedback_get_user_data(feedback));
+  // The output arrives as null if its proxy is already gone.
+  struct sl_host_output* host_output =
+      output ? static_cast<sl_host_output*>(wl_output_get_user_data(output))
+             : nullptr;
+
+  if (host_output && host_output->resource &&
+      wl_resource_get_client(host_output->resource) ==
+      wl_resource_get_client(host->resource)) {
+    wp_presentation_feedback_send_sync_output(host->resource,
+                                              host_output->resource);
+  }
+}
+
+static void sl_presentation_feedback_presented(
+    void* data,
+    struct wp_presentation_feedback* feedback,
+    uint32_t tv_sec_hi,
+    uint32_t tv_sec_lo,
+    uint32_t tv_nsec,
+    uint32_t refresh,
+    uint32_t seq_hi,
+    uint32_t seq_lo,
+    uint32_t flags) {
+  TRACE_EVENT("surface", "sl_presentation_feedback_presented");
+  struct sl_host_presentation_feedback* host =
+      static_cast<sl_host_presentation_feedback*>(
+          wp_presentation_feedback_get_user_data(feedback));
+  int64_t host_ns =
+      static_cast<int64_t>((static_cast<uint64_t>(tv_sec_hi) << 32) |
+                           tv_sec_lo) *
+          1000000000 +
+      tv_nsec;
+  // The host may have withdrawn the global since the feedback was requested.
+  int64_t guest_ns = host->ctx->presentation
+                         ? sl_presentation_guest_time_ns(
+                               host->ctx->presentation, host_ns,
+                               sl_monotonic_time_ns())
+                         : host_ns;
+  uint64_t tv_sec = guest_ns > 0 ? guest_ns / 1000000000 : 0;
+
+  wp_presentation_feedback_send_presented(
+      host->resource, tv_sec >> 32, tv_sec & 0xffffffff,
+      guest_ns > 0 ? guest_ns % 1000000000 : 0, refresh, seq_hi, seq_lo,
+      flags);
+  wl_resource_destroy(host->resource);
+}
+
+static void sl_presentation_feedback_discarded(
+    void* data, struct wp_presentation_feedback* feedback) {
+  struct sl_host_presentation_feedback* host =
+      static_cast<sl_host_presentation_feedback*>(
+          wp_presentation_feedback_get_user_data(feedback));
+
+  wp_presentation_feedback_send_discarded(host->resource);
+  wl_resource_destroy(host->resource);
+}
+
+static const struct wp_presentation_feedback_listener
+    sl_presentation_feedback_listener = {
+        sl_presentation_feedback_sync_output,
+        sl_presentation_feedback_presented,
+        sl_presentation_feedback_discarded,
+};
+
+static void sl_destroy_host_presentation_feedback(
+    struct wl_resource* resource) {
+  struct sl_host_presentation_feedback* host =
+      static_cast<sl_host_presentation_feedback*>(
+          wl_resource_get_user_data(resource));
+
+  wp_presentation_feedback_destroy(host->proxy);
+  wl_resource_set_user_data(resource, nullptr);
+  host->ctx->presentation_feedback_pool.Delete(host);
+}
+
+static void sl_presentation_destroy(struct wl_client* client,
+                                    struct wl_resource* resource) {
+  wl_resource_destroy(resource);
+}
+
+static void sl_presentation_feedback(struct wl_client* client,
+                                     struct wl_resource* resource,
+                                     struct wl_resource* surface_resource,
+                                     uint32_t id) {
+  struct sl_host_presentation* host =
+      static_cast<sl_host_presentation*>(wl_resource_get_user_data(resource));
+  struct sl_host_surface* host_surface = static_cast<sl_host_surface*>(
+      wl_resource_get_user_data(surface_resource));
+  struct sl_host_presentation_feedback* host_feedback =
+      host->ctx->presentation_feedback_pool.New();
+
+  host_feedback->ctx = host->ctx;
+  host_feedback->resource =
+      wl_resource_create(client, &wp_presentation_feedback_interface, 1, id);
+  wl_resource_set_implementation(host_feedback->resource, nullptr,
+                                 host_feedback,
+                                 sl_destroy_host_presentation_feedback);
+  host_feedback->proxy =
+      wp_presentation_feedback(host->proxy, host_surface->proxy);
+  wp_presentation_feedback_add_listener(
+      host_feedback->proxy, &sl_presentation_feedback_listener, host_feedback);
+}
+
+static const struct wp_presentation_interface sl_presentation_implementation =
+    {
+        sl_presentation_destroy,
+        sl_presentation_feedback,
+};
+
+// The host's clock is translated to ours, whichever it is.
+static void sl_presentation_clock_id(void* data,
+                                     struct wp_presentation* presentation,
+                                     uint32_t clk_id) {}
+
+static const struct wp_presentation_listener sl_presentation_listener = {
+    sl_presentation_clock_id,
+};
+
+static void sl_destroy_host_presentation(struct wl_resource* resource) {
+  struct sl_host_presentation* host =
+      static_cast<sl_host_presentation*>(wl_resource_get_user_data(resource));
+
+  wp_presentation_destroy(host->proxy);
+  wl_resource_set_user_data(resource, nullptr);
+  delete host;
+}
+
+static void sl_bind_host_presentation(struct wl_client* client,
+                                      void* data,
+                                      uint32_t version,
+                                      uint32_t id) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  struct sl_presentation* presentation = ctx->presentation;
+  struct sl_host_presentation* host = new sl_host_presentation();
+  host->ctx = ctx;
+  host->resource =
+      wl_resource_create(client, &wp_presentation_interface, 1, id);
+  wl_resource_set_implementation(host->resource,
+                                 &sl_presentation_implementation, host,
+                                 sl_destroy_host_presentation);
+  host->proxy = static_cast<wp_presentation*>(
+      wl_registry_bind(wl_display_get_registry(ctx->display), presentation->id,
+                       &wp_presentation_interface, 1));
+  wp_presentation_add_listener(host->proxy, &sl_presentation_listener, host);
+
+  wp_presentation_send_clock_id(host->resource, CLOCK_MONOTONIC);
+}
+
+struct sl_global* sl_presentation_global_create(struct sl_context* ctx) {
+  return sl_global_create(ctx, &wp_presentation_interface, 1, ctx,
+                          sl_bind_host_presentation);
+}
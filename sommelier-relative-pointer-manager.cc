@@ -27,6 +27,18 @@ struct sl_host_relative_pointer {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct zwp_relative_pointer_v1* proxy;
+  // The pointer this was created for, until it goes away.
+  struct sl_host_pointer* pointer;
+  struct wl_list link;
+  struct wl_listener pointer_destroy_listener;
+  // Motion summed up while --coalesce-pointer-motion holds it back.
+  bool motion_pending;
+  uint32_t utime_hi;
+  uint32_t utime_lo;
+  wl_fixed_t dx;
+  wl_fixed_t dy;
+  wl_fixed_t dx_unaccel;
+  wl_fixed_t dy_unaccel;
 };
 
 // Like ceil(), but strictly increases the magnitude of the input value (i.e.
@@ -58,16 +70,61 @@ static void sl_relative_pointer_relative_motion(
     dy_unaccel = magnitude_ceil(dy_unaccel);
   }
 
+  // Held back with the pointer's motion. Dropping any of it would lose
+  // distance moved, so it is summed up instead.
+  if (host->pointer && host->pointer->coalesce_motion) {
+    if (!host->motion_pending) {
+      host->motion_pending = true;
+      host->dx = host->dy = host->dx_unaccel = host->dy_unaccel = 0;
+    }
+    host->utime_hi = utime_hi;
+    host->utime_lo = utime_lo;
+    host->dx += dx;
+    host->dy += dy;
+    host->dx_unaccel += dx_unaccel;
+    host->dy_unaccel += dy_unaccel;
+    host->pointer->relative_motion_pending = true;
+    return;
+  }
+
   zwp_relative_pointer_v1_send_relative_motion(
       host->resource, utime_hi, utime_lo, dx, dy, dx_unaccel, dy_unaccel);
 }
 
+void sl_relative_pointer_forward_held_motion(struct sl_host_pointer* pointer) {
+  struct sl_host_relative_pointer* host;
+
+  wl_list_for_each(host, &pointer->relative_pointers, link) {
+    if (!host->motion_pending)
+      continue;
+
+    zwp_relative_pointer_v1_send_relative_motion(
+        host->resource, host->utime_hi, host->utime_lo, host->dx, host->dy,
+        host->dx_unaccel, host->dy_unaccel);
+    host->motion_pending = false;
+  }
+}
+
+static void sl_relative_pointer_pointer_destroyed(struct wl_listener* listener,
+                                                  void* data) {
+  struct sl_host_relative_pointer* host;
+
+  host = wl_container_of(listener, host, pointer_destroy_listener);
+  wl_list_remove(&host->link);
+  wl_list_init(&host->link);
+  wl_list_remove(&host->pointer_destroy_listener.link);
+  wl_list_init(&host->pointer_destroy_listener.link);
+  host->pointer = nullptr;
+}
+
 static void sl_destroy_host_relative_pointer(struct wl_resource* resource) {
   struct sl_host_relative_pointer* host =
       static_cast<sl_host_relative_pointer*>(
           wl_resource_get_user_data(resource));
 
   zwp_relative_pointer_v1_destroy(host->proxy);
+  wl_list_remove(&host->link);
+  wl_list_remove(&host->pointer_destroy_listener.link);
   wl_resource_set_user_data(resource, nullptr);
   delete host;
 }
@@ -118,6 +175,13 @@ static void sl_relative_pointer_manager_get_relative_pointer(
       new sl_host_relative_pointer();
   relative_pointer_host->resource = relative_pointer_resource;
   relative_pointer_host->ctx = host->ctx;
+  relative_pointer_host->pointer = host_pointer;
+  wl_list_insert(&host_pointer->relative_pointers,
+                 &relative_pointer_host->link);
+  relative_pointer_host->pointer_destroy_listener.notify =
+      sl_relative_pointer_pointer_destroyed;
+  wl_resource_add_destroy_listener(
+      pointer, &relative_pointer_host->pointer_destroy_listener);
   relative_pointer_host->proxy =
       zwp_relative_pointer_manager_v1_get_relative_pointer(host->proxy,
                                                            host_pointer->proxy);
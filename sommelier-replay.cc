@@ -0,0 +1,428 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Replays a file recorded with --capture into sommelier, with the host
+// compositor simulated the same way as the Wayland fuzzer does, so that a
+// workload can be benchmarked offline.
+//
+//   sommelier_replay [--speed=max] capture.bin
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <vector>
+
+#include <wayland-client.h>
+
+#include "sommelier.h"                       // NOLINT(build/include_directory)
+#include "sommelier-capture.h"               // NOLINT(build/include_directory)
+#include "sommelier-ctx.h"                   // NOLINT(build/include_directory)
+#include "sommelier-logging.h"               // NOLINT(build/include_directory)
+#include "sommelier-util.h"                  // NOLINT(build/include_directory)
+#include "virtualization/wayland_channel.h"  // NOLINT(build/include_directory)
+
+namespace {
+
+struct ReplayFd {
+  uint8_t kind;
+  uint64_t size;
+  // Points into the capture, or nullptr if only the size was recorded.
+  const uint8_t* contents;
+};
+
+struct ReplayRecord {
+  int64_t time_ns;
+  uint8_t source;
+  const uint8_t* data;
+  uint32_t size;
+  std::vector<ReplayFd> fds;
+};
+
+// Parses |capture| into |records|, which point into it. Returns false if it
+// isn't a capture file or is cut short.
+bool ParseCapture(const std::vector<uint8_t>& capture,
+                  std::vector<ReplayRecord>* records) {
+  struct sl_capture_header header;
+  size_t offset = sizeof(header);
+
+  if (capture.size() < sizeof(header))
+    return false;
+  memcpy(&header, capture.data(), sizeof(header));
+  if (header.magic != SL_CAPTURE_MAGIC || header.version != SL_CAPTURE_VERSION)
+    return false;
+
+  while (offset < capture.size()) {
+    struct sl_capture_record record;
+    if (capture.size() - offset < sizeof(record))
+      return false;
+    memcpy(&record, capture.data() + offset, sizeof(record));
+    offset += sizeof(record);
+    if (capture.size() - offset < record.size)
+      return false;
+
+    ReplayRecord replay = {record.time_ns, record.source,
+                           capture.data() + offset, record.size, {}};
+    offset += record.size;
+
+    for (int i = 0; i < record.num_fds; ++i) {
+      struct sl_capture_fd fd;
+      if (capture.size() - offset < sizeof(fd))
+        return false;
+      memcpy(&fd, capture.data() + offset, sizeof(fd));
+      offset += sizeof(fd);
+
+      ReplayFd replay_fd = {fd.kind, fd.size, nullptr};
+      if (fd.has_contents) {
+        if (capture.size() - offset < fd.size)
+          return false;
+        replay_fd.contents = capture.data() + offset;
+        offset += fd.size;
+      }
+      replay.fds.push_back(replay_fd);
+    }
+    records->push_back(replay);
+  }
+  return true;
+}
+
+// Recreates a recorded fd. Files come back with their recorded contents, or
+// zeroed if only their checksum was recorded.
+int CreateFd(const ReplayFd& fd) {
+  if (fd.kind != SL_CAPTURE_FD_FILE) {
+    int pipe_fds[2];
+    errno_assert(!pipe2(pipe_fds, O_CLOEXEC));
+    close(pipe_fds[1]);
+    return pipe_fds[0];
+  }
+
+  int memfd = memfd_create("sommelier-replay", MFD_CLOEXEC);
+  errno_assert(memfd >= 0);
+  errno_assert(!ftruncate(memfd, fd.size));
+  if (fd.contents) {
+    errno_assert(pwrite(memfd, fd.contents, fd.size, 0) ==
+                 static_cast<ssize_t>(fd.size));
+  }
+  return memfd;
+}
+
+// Stands in for the host compositor, handing sommelier the recorded host
+// messages and discarding whatever it sends.
+class ReplayChannel : public WaylandChannel {
+ public:
+  ~ReplayChannel() {
+    if (wake_fd_ != -1)
+      close(wake_fd_);
+  }
+
+  int32_t init() override { return 0; }
+
+  bool supports_dmabuf() override { return false; }
+
+  int32_t create_context(int& out_channel_fd) override {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+      return -errno;
+
+    wake_fd_ = sv[0];
+    out_channel_fd = sv[1];
+    return 0;
+  }
+
+  int32_t create_pipe(int& out_pipe_fd) override { return -1; }
+
+  int32_t send(const struct WaylandSendReceive& send) override {
+    messages_sent++;
+    bytes_sent += send.data_size;
+    return 0;
+  }
+
+  // Queues a message for sommelier to receive, taking ownership of |fds|.
+  void Queue(const ReplayRecord& record, const std::vector<int>& fds) {
+    pending_.push_back({record.data, record.size, fds});
+    char wake = 0;
+    errno_assert(write(wake_fd_, &wake, 1) == 1);
+  }
+
+  int32_t handle_channel_event(enum WaylandChannelEvent& event_type,
+                               struct WaylandSendReceive& receive,
+                               int& out_read_pipe) override {
+    char wake;
+    if (read(receive.channel_fd, &wake, 1) != 1)
+      return -EPIPE;
+
+    const Message& message = pending_.front();
+    receive.data = static_cast<uint8_t*>(malloc(message.size));
+    memcpy(receive.data, message.data, message.size);
+    receive.data_size = message.size;
+    receive.num_fds = message.fds.size();
+    memcpy(receive.fds, message.fds.data(), message.fds.size() * sizeof(int));
+    pending_.pop_front();
+
+    event_type = WaylandChannelEvent::Receive;
+    return 0;
+  }
+
+  int32_t flush() override { return 0; }
+
+  int32_t release_receive(struct WaylandSendReceive& receive) override {
+    free(receive.data);
+    return 0;
+  }
+
+  bool has_pending_event() override { return false; }
+  size_t max_receive_batch() override { return 1; }
+
+  int32_t allocate(const struct WaylandBufferCreateInfo& create_info,
+                   struct WaylandBufferCreateOutput& create_output) override {
+    create_output.fd = memfd_create("sommelier-replay-output", MFD_CLOEXEC);
+    if (create_output.fd < 0)
+      return -errno;
+    if (ftruncate(create_output.fd, create_info.size)) {
+      close(create_output.fd);
+      return -errno;
+    }
+    create_output.host_size = create_info.size;
+    buffers_allocated++;
+    return 0;
+  }
+
+  void free_buffer(
+      const struct WaylandBufferCreateInfo& create_info,
+      const struct WaylandBufferCreateOutput& create_output) override {
+    if (create_output.fd >= 0)
+      close(create_output.fd);
+  }
+
+  int32_t prefetch_allocation(const struct WaylandBufferCreateInfo& create_info,
+                              int& out_fence_fd) override {
+    out_fence_fd = -1;
+    return 0;
+  }
+  int32_t handle_fence(int fence_fd, int& out_fence_fd) override {
+    out_fence_fd = -1;
+    return -EINVAL;
+  }
+
+  int32_t sync(int dmabuf_fd, uint64_t flags) override { return 0; }
+  int32_t import_shm(int shm_fd, size_t size, int& out_dmabuf_fd) override {
+    return -EOPNOTSUPP;
+  }
+  int32_t handle_pipe(int read_fd, bool readable, bool& hang_up) override {
+    return 0;
+  }
+
+  size_t max_send_size(void) override { return DEFAULT_BUFFER_SIZE; }
+
+  uint64_t messages_sent = 0;
+  uint64_t bytes_sent = 0;
+  uint64_t buffers_allocated = 0;
+
+ private:
+  struct Message {
+    const uint8_t* data;
+    uint32_t size;
+    std::vector<int> fds;
+  };
+
+  int wake_fd_ = -1;
+  std::deque<Message> pending_;
+};
+
+int handle_host_to_sommelier_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+  int count = 0;
+
+  if ((mask & WL_EVENT_HANGUP) || (mask & WL_EVENT_ERROR))
+    return 0;
+
+  if (mask & WL_EVENT_READABLE)
+    count = wl_display_dispatch(ctx->display);
+  if (mask & WL_EVENT_WRITABLE)
+    wl_display_flush(ctx->display);
+
+  if (mask == 0) {
+    count = wl_display_dispatch_pending(ctx->display);
+    wl_display_flush(ctx->display);
+  }
+
+  return count;
+}
+
+// Throws away what sommelier sends the client. Any fds are closed along
+// with the message.
+int drain_socket(int fd, uint32_t mask, void* data) {
+  uint8_t buffer[DEFAULT_BUFFER_SIZE];
+  return recv(fd, buffer, DEFAULT_BUFFER_SIZE, 0) > 0;
+}
+
+// Handles everything sommelier has to do before it would wait again.
+void DispatchAll(struct sl_context* ctx, struct wl_event_loop* event_loop) {
+  struct pollfd pfd = {wl_event_loop_get_fd(event_loop), POLLIN, 0};
+  do {
+    wl_display_flush_clients(ctx->host_display);
+    wl_event_loop_dispatch(event_loop, 0);
+  } while (poll(&pfd, 1, 0) > 0);
+}
+
+void SendToSommelier(int fd, const ReplayRecord& record,
+                     const std::vector<int>& fds) {
+  char fd_buffer[CMSG_LEN(sizeof(int) * WAYLAND_MAX_FDs)];
+  struct iovec iov = {const_cast<uint8_t*>(record.data), record.size};
+  struct msghdr msg = {};
+
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (!fds.empty()) {
+    msg.msg_control = fd_buffer;
+    msg.msg_controllen = CMSG_LEN(fds.size() * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = msg.msg_controllen;
+    memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+  }
+  errno_assert(sendmsg(fd, &msg, MSG_NOSIGNAL) ==
+               static_cast<ssize_t>(record.size));
+  for (int sent_fd : fds)
+    close(sent_fd);
+}
+
+int64_t CpuTimeNs() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000LL +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000LL;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  bool recorded_speed = true;
+  const char* filename = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--speed=max") == 0) {
+      recorded_speed = false;
+    } else if (strcmp(argv[i], "--speed=recorded") == 0) {
+      recorded_speed = true;
+    } else if (argv[i][0] != '-' && !filename) {
+      filename = argv[i];
+    } else {
+      fprintf(stderr, "usage: %s [--speed=max|recorded] CAPTURE\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (!filename) {
+    fprintf(stderr, "usage: %s [--speed=max|recorded] CAPTURE\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<uint8_t> capture;
+  FILE* file = fopen(filename, "re");
+  if (!file) {
+    LOG(ERROR) << "failed to open " << filename << ": " << strerror(errno);
+    return EXIT_FAILURE;
+  }
+  uint8_t chunk[65536];
+  size_t bytes;
+  while ((bytes = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    capture.insert(capture.end(), chunk, chunk + bytes);
+  fclose(file);
+
+  std::vector<ReplayRecord> records;
+  if (!ParseCapture(capture, &records)) {
+    LOG(ERROR) << filename << " is not a complete capture file";
+    return EXIT_FAILURE;
+  }
+
+  struct sl_context ctx;
+  ReplayChannel channel;
+  sl_context_init_default(&ctx);
+  errno_assert(!channel.init());
+
+  struct wl_event_loop* event_loop =
+      sl_context_configure_event_loop(&ctx, &channel,
+                                      /*use_virtual_context=*/true);
+
+  // `display` takes ownership of `virtwl_display_fd`
+  ctx.display = wl_display_connect_to_fd(ctx.virtwl_display_fd);
+
+  int sv[2];
+  errno_assert(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv));
+  // wl_client takes ownership of its file descriptor
+  ctx.client = wl_client_create(ctx.host_display, sv[0]);
+  sl_set_display_implementation(&ctx, ctx.client);
+  std::unique_ptr<struct wl_event_source> drain_event(wl_event_loop_add_fd(
+      event_loop, sv[1], WL_EVENT_READABLE, drain_socket, nullptr));
+
+  std::unique_ptr<struct wl_event_source> display_event(
+      wl_event_loop_add_fd(event_loop, wl_display_get_fd(ctx.display),
+                           WL_EVENT_READABLE | WL_EVENT_WRITABLE,
+                           handle_host_to_sommelier_event, &ctx));
+
+  auto* registry = wl_display_get_registry(ctx.display);
+  wl_registry_add_listener(registry, &sl_registry_listener, &ctx);
+  DispatchAll(&ctx, event_loop);
+
+  uint64_t client_records = 0;
+  uint64_t host_records = 0;
+  int64_t start_ns = sl_monotonic_time_ns();
+  int64_t start_cpu_ns = CpuTimeNs();
+
+  for (const ReplayRecord& record : records) {
+    if (wl_list_empty(wl_display_get_client_list(ctx.host_display)) ||
+        wl_display_get_error(ctx.display)) {
+      LOG(ERROR) << "replay diverged after " << client_records + host_records
+                 << " records";
+      break;
+    }
+
+    if (recorded_speed) {
+      int64_t delay_ns = start_ns + record.time_ns - sl_monotonic_time_ns();
+      if (delay_ns > 0) {
+        struct timespec ts = {delay_ns / 1000000000, delay_ns % 1000000000};
+        nanosleep(&ts, nullptr);
+      }
+    }
+
+    std::vector<int> fds;
+    for (const ReplayFd& fd : record.fds)
+      fds.push_back(CreateFd(fd));
+
+    if (record.source == SL_CAPTURE_CLIENT) {
+      SendToSommelier(sv[1], record, fds);
+      client_records++;
+    } else {
+      channel.Queue(record, fds);
+      host_records++;
+    }
+    DispatchAll(&ctx, event_loop);
+  }
+
+  double elapsed_s = (sl_monotonic_time_ns() - start_ns) / 1e9;
+  printf("replayed %" PRIu64 " client and %" PRIu64
+         " host messages in %.3f s\n",
+         client_records, host_records, elapsed_s);
+  printf("cpu time: %.3f s\n", (CpuTimeNs() - start_cpu_ns) / 1e9);
+  printf("sent to host: %" PRIu64 " messages, %" PRIu64 " bytes\n",
+         channel.messages_sent, channel.bytes_sent);
+  printf("output buffers allocated: %" PRIu64 "\n", channel.buffers_allocated);
+
+  wl_registry_destroy(registry);
+  close(sv[1]);
+  drain_event.reset();
+  display_event.reset();
+  wl_display_destroy_clients(ctx.host_display);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,49 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-sched.h"  // NOLINT(build/include_directory)
+
+#include <gtest/gtest.h>
+
+namespace vm_tools {
+namespace sommelier {
+
+TEST(SchedTest, ParsesPolicies) {
+  struct sl_sched_config config;
+
+  EXPECT_TRUE(sl_sched_parse_policy("fifo:10", &config));
+  EXPECT_EQ(config.policy, SCHED_FIFO);
+  EXPECT_EQ(config.priority, 10);
+
+  EXPECT_TRUE(sl_sched_parse_policy("nice:-5", &config));
+  EXPECT_EQ(config.policy, SCHED_OTHER);
+  EXPECT_TRUE(config.has_nice);
+  EXPECT_EQ(config.nice, -5);
+
+  EXPECT_TRUE(sl_sched_parse_policy("rr:1", &config));
+  EXPECT_EQ(config.policy, SCHED_RR);
+  EXPECT_FALSE(config.has_nice);
+
+  EXPECT_FALSE(sl_sched_parse_policy("fifo:0", &config));
+  EXPECT_FALSE(sl_sched_parse_policy("nice:20", &config));
+  EXPECT_FALSE(sl_sched_parse_policy("idle:1", &config));
+  EXPECT_FALSE(sl_sched_parse_policy("rr", &config));
+}
+
+TEST(SchedTest, ParsesCpuLists) {
+  struct sl_sched_config config;
+
+  EXPECT_TRUE(sl_sched_parse_affinity("0-2,5", &config));
+  EXPECT_TRUE(config.has_affinity);
+  EXPECT_EQ(CPU_COUNT(&config.affinity), 4);
+  EXPECT_TRUE(CPU_ISSET(5, &config.affinity));
+  EXPECT_FALSE(CPU_ISSET(3, &config.affinity));
+
+  EXPECT_FALSE(sl_sched_parse_affinity("", &config));
+  EXPECT_FALSE(sl_sched_parse_affinity("3-1", &config));
+  EXPECT_FALSE(sl_sched_parse_affinity("1,x", &config));
+}
+
+}  // namespace sommelier
+}  // namespace vm_tools
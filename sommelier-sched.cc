@@ -0,0 +1,218 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-sched.h"    // NOLINT(build/include_directory)
+#include "sommelier-logging.h"  // NOLINT(build/include_directory)
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+namespace {
+
+// What the process ran with before sl_sched_apply(), for forked children.
+// Client threads each apply the config to themselves, so it is saved by the
+// first one.
+std::once_flag original_once;
+struct {
+  bool saved;
+  int policy;
+  struct sched_param param;
+  int nice;
+  cpu_set_t affinity;
+} original;
+
+bool parse_int(const char* value, int min, int max, int* result) {
+  char* end;
+
+  errno = 0;
+  long parsed = strtol(value, &end, 10);
+  if (errno || end == value || *end || parsed < min || parsed > max)
+    return false;
+  *result = static_cast<int>(parsed);
+  return true;
+}
+
+// Lets the soft |resource| limit up to |wanted|, as far as the hard limit
+// allows. Privileged processes aren't held to either.
+void raise_soft_limit(int resource, rlim_t wanted) {
+  struct rlimit limit;
+
+  if (getrlimit(resource, &limit) || limit.rlim_cur >= wanted ||
+      limit.rlim_cur == limit.rlim_max) {
+    return;
+  }
+  limit.rlim_cur = std::min(limit.rlim_max, wanted);
+  setrlimit(resource, &limit);
+}
+
+void save_original() {
+  original.policy = sched_getscheduler(0);
+  sched_getparam(0, &original.param);
+  errno = 0;
+  original.nice = getpriority(PRIO_PROCESS, 0);
+  if (errno)
+    original.nice = 0;
+  if (sched_getaffinity(0, sizeof(original.affinity), &original.affinity))
+    CPU_ZERO(&original.affinity);
+  original.saved = original.policy >= 0;
+}
+
+std::string describe_cpus(const cpu_set_t& cpus) {
+  std::ostringstream out;
+  int first = -1;
+
+  for (int cpu = 0; cpu <= CPU_SETSIZE; ++cpu) {
+    bool set = cpu < CPU_SETSIZE && CPU_ISSET(cpu, &cpus);
+    if (set && first < 0)
+      first = cpu;
+    if (set || first < 0)
+      continue;
+    if (out.tellp() > 0)
+      out << ",";
+    out << first;
+    if (cpu - 1 > first)
+      out << "-" << cpu - 1;
+    first = -1;
+  }
+  return out.str();
+}
+
+// Returns the priority the real-time class was set with, or 0 if it
+// couldn't be.
+int apply_realtime(int policy, int priority) {
+  struct sched_param param = {};
+
+  raise_soft_limit(RLIMIT_RTPRIO, priority);
+  param.sched_priority = priority;
+  if (sched_setscheduler(0, policy, &param) == 0)
+    return priority;
+
+  struct rlimit limit;
+  if (errno == EPERM && getrlimit(RLIMIT_RTPRIO, &limit) == 0 &&
+      limit.rlim_cur > 0 && limit.rlim_cur < static_cast<rlim_t>(priority)) {
+    LOG(WARNING) << "real-time priority " << priority
+                 << " is above RLIMIT_RTPRIO, using " << limit.rlim_cur;
+    param.sched_priority = static_cast<int>(limit.rlim_cur);
+    if (sched_setscheduler(0, policy, &param) == 0)
+      return param.sched_priority;
+  }
+  LOG(WARNING) << "failed to set real-time scheduling: " << strerror(errno);
+  return 0;
+}
+
+}  // namespace
+
+bool sl_sched_parse_policy(const char* value, struct sl_sched_config* config) {
+  const char* colon = strchr(value, ':');
+
+  if (!colon)
+    return false;
+  std::string name(value, colon - value);
+  const char* number = colon + 1;
+  if (name == "fifo" || name == "rr") {
+    int policy = name == "fifo" ? SCHED_FIFO : SCHED_RR;
+    if (!parse_int(number, sched_get_priority_min(policy),
+                   sched_get_priority_max(policy), &config->priority)) {
+      return false;
+    }
+    config->policy = policy;
+    config->has_nice = false;
+    return true;
+  }
+  if (name == "nice") {
+    if (!parse_int(number, -20, 19, &config->nice))
+      return false;
+    config->policy = SCHED_OTHER;
+    config->has_nice = true;
+    return true;
+  }
+  return false;
+}
+
+bool sl_sched_parse_affinity(const char* value,
+                             struct sl_sched_config* config) {
+  cpu_set_t cpus;
+  std::istringstream list(value);
+  std::string range;
+
+  CPU_ZERO(&cpus);
+  while (std::getline(list, range, ',')) {
+    size_t dash = range.find('-');
+    int first, last;
+    if (!parse_int(range.substr(0, dash).c_str(), 0, CPU_SETSIZE - 1,
+                   &first)) {
+      return false;
+    }
+    last = first;
+    if (dash != std::string::npos &&
+        !parse_int(range.substr(dash + 1).c_str(), first, CPU_SETSIZE - 1,
+                   &last)) {
+      return false;
+    }
+    for (int cpu = first; cpu <= last; ++cpu)
+      CPU_SET(cpu, &cpus);
+  }
+  if (!CPU_COUNT(&cpus))
+    return false;
+
+  config->affinity = cpus;
+  config->has_affinity = true;
+  return true;
+}
+
+std::string sl_sched_apply(const struct sl_sched_config& config) {
+  std::ostringstream applied;
+
+  std::call_once(original_once, save_original);
+
+  if (config.policy == SCHED_FIFO || config.policy == SCHED_RR) {
+    int priority = apply_realtime(config.policy, config.priority);
+    if (priority) {
+      applied << (config.policy == SCHED_FIFO ? "fifo:" : "rr:")
+              << priority;
+    }
+  } else if (config.has_nice && config.nice != original.nice) {
+    // RLIMIT_NICE holds the lowest nice value allowed as 20 - nice.
+    raise_soft_limit(RLIMIT_NICE, 20 - config.nice);
+    // On Linux this applies to the calling thread only.
+    if (setpriority(PRIO_PROCESS, 0, config.nice) == 0) {
+      applied << "nice:" << config.nice;
+    } else {
+      LOG(WARNING) << "failed to set nice value " << config.nice << ": "
+                   << strerror(errno);
+    }
+  }
+
+  if (config.has_affinity) {
+    if (sched_setaffinity(0, sizeof(config.affinity), &config.affinity) ==
+        0) {
+      if (applied.tellp() > 0)
+        applied << " ";
+      applied << "cpus:" << describe_cpus(config.affinity);
+    } else {
+      LOG(WARNING) << "failed to set CPU affinity: " << strerror(errno);
+    }
+  }
+
+  std::string result = applied.str();
+  return result.empty() ? "default" : result;
+}
+
+void sl_sched_reset_for_exec() {
+  if (!original.saved)
+    return;
+
+  // Only ever boosted, so going back needs no privileges.
+  sched_setscheduler(0, original.policy, &original.param);
+  setpriority(PRIO_PROCESS, 0, original.nice);
+  if (CPU_COUNT(&original.affinity))
+    sched_setaffinity(0, sizeof(original.affinity), &original.affinity);
+}
@@ -0,0 +1,46 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_SOMMELIER_SCHED_H_
+#define VM_TOOLS_SOMMELIER_SOMMELIER_SCHED_H_
+
+#include <sched.h>
+
+#include <string>
+
+// How sommelier's own threads are scheduled, so that input forwarding and
+// commits keep up while the guest is busy. Set with --sched and
+// --cpu-affinity.
+struct sl_sched_config {
+  // SCHED_OTHER keeps the default class, with |nice| applied if |has_nice|.
+  int policy = SCHED_OTHER;
+  // Real-time priority for SCHED_FIFO and SCHED_RR.
+  int priority = 0;
+  bool has_nice = false;
+  int nice = 0;
+  bool has_affinity = false;
+  cpu_set_t affinity;
+};
+
+// Parses "fifo:PRIORITY", "rr:PRIORITY" or "nice:NICE" into |config|.
+bool sl_sched_parse_policy(const char* value, struct sl_sched_config* config);
+
+// Parses a comma separated list of CPUs and CPU ranges, like "0-3,6", into
+// |config|.
+bool sl_sched_parse_affinity(const char* value,
+                             struct sl_sched_config* config);
+
+// Applies |config| to the calling thread. Threads it starts afterwards
+// inherit it, so this runs before the worker threads are started.
+//
+// A real-time priority above RLIMIT_RTPRIO is lowered to the limit if the
+// kernel refuses it, and anything else refused is logged and left out.
+// Returns what was applied, like "fifo:10 cpus:0-3", or "default".
+std::string sl_sched_apply(const struct sl_sched_config& config);
+
+// Puts a forked child back on the scheduling the process had before
+// sl_sched_apply(), so that the programs it execs don't inherit the boost.
+void sl_sched_reset_for_exec();
+
+#endif  // VM_TOOLS_SOMMELIER_SOMMELIER_SCHED_H_
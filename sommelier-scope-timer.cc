@@ -5,20 +5,81 @@
 #include "sommelier-logging.h"      // NOLINT(build/include_directory)
 #include "sommelier-scope-timer.h"  // NOLINT(build/include_directory)
 
+#include <sys/types.h>
+
+#include <algorithm>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <utility>
+#include <vector>
 
 #define NSEC_PER_SEC 1000000000
+#define NSEC_PER_USEC 1000
+
+namespace {
+
+struct Phase {
+  const char* name;
+  // Index of the enclosing phase, or -1.
+  ssize_t parent;
+  int64_t start;
+  // -1 while the phase is running.
+  int64_t duration;
+};
+
+// Startup runs on one thread per client, so each gets a profile of its own.
+thread_local std::vector<Phase> phases;
+thread_local ssize_t running_phase = -1;
+thread_local std::vector<std::pair<const char*, std::string>> annotations;
+
+int64_t now_ns() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
 
-static inline int64_t timespec_to_ns(timespec* t) {
+void append_phases(std::ostringstream& out,
+                   ssize_t parent,
+                   int64_t origin,
+                   int64_t now) {
+  bool first = true;
+
+  out << "[";
+  for (size_t i = 0; i < phases.size(); ++i) {
+    const Phase& phase = phases[i];
+    if (phase.parent != parent)
+      continue;
+
+    int64_t duration =
+        phase.duration >= 0 ? phase.duration : now - phase.start;
+    if (!first)
+      out << ",";
+    first = false;
+    // Names are string literals, so they need no escaping.
+    out << "{\"name\":\"" << phase.name << "\",\"start_us\":"
+        << (phase.start - origin) / NSEC_PER_USEC
+        << ",\"duration_us\":" << duration / NSEC_PER_USEC << ",\"phases\":";
+    append_phases(out, i, origin, now);
+    out << "}";
+  }
+  out << "]";
+}
+
+}  // namespace
+
+static inline int64_t timespec_to_ns(const timespec* t) {
   return (int64_t)t->tv_sec * NSEC_PER_SEC + t->tv_nsec;
 }
 
-ScopeTimer::ScopeTimer(const char* event_name) : event_name_(event_name) {
+ScopeTimer::ScopeTimer(const char* event_name)
+    : event_name_(event_name), phase_(phases.size()) {
   clock_gettime(CLOCK_MONOTONIC, &start_time_);
+  phases.push_back(
+      {event_name, running_phase, timespec_to_ns(&start_time_), -1});
+  running_phase = phase_;
 }
 
 ScopeTimer::~ScopeTimer() {
@@ -30,4 +91,44 @@ ScopeTimer::~ScopeTimer() {
   LOG(INFO) << event_name_ << ": "
             << static_cast<float>(diff) / static_cast<float>(NSEC_PER_SEC)
             << " seconds";
+
+  phases[phase_].duration = diff;
+  running_phase = phases[phase_].parent;
+}
+
+void ScopeTimer::RecordSince(const char* event_name,
+                             const timespec& start_time) {
+  int64_t start = timespec_to_ns(&start_time);
+  int64_t diff = now_ns() - start;
+  LOG(INFO) << event_name << ": "
+            << static_cast<float>(diff) / static_cast<float>(NSEC_PER_SEC)
+            << " seconds";
+
+  phases.push_back({event_name, running_phase, start, diff});
+}
+
+void ScopeTimer::Annotate(const char* name, const std::string& value) {
+  annotations.emplace_back(name, value);
+}
+
+std::string ScopeTimer::Report() {
+  std::ostringstream out;
+  int64_t now = now_ns();
+  int64_t origin = now;
+
+  for (const Phase& phase : phases)
+    origin = std::min(origin, phase.start);
+
+  out << "{\"total_us\":" << (now - origin) / NSEC_PER_USEC << ",\"phases\":";
+  append_phases(out, -1, origin, now);
+  if (!annotations.empty()) {
+    out << ",\"annotations\":{";
+    for (size_t i = 0; i < annotations.size(); ++i) {
+      out << (i ? "," : "") << "\"" << annotations[i].first << "\":\""
+          << annotations[i].second << "\"";
+    }
+    out << "}";
+  }
+  out << "}";
+  return out.str();
 }
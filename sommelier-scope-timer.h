@@ -5,17 +5,39 @@
 #ifndef VM_TOOLS_SOMMELIER_SOMMELIER_SCOPE_TIMER_H_
 #define VM_TOOLS_SOMMELIER_SOMMELIER_SCOPE_TIMER_H_
 
+#include <stddef.h>
 #include <time.h>
 #include <string>
 
 // This is to time certain tasks sommelier performs at startup, see b/303549040
+//
+// Every timer is also recorded as a phase of the thread's startup profile. A
+// timer that starts while another one is running is a child phase of it.
 class ScopeTimer {
  public:
   explicit ScopeTimer(const char* event_name);
   ~ScopeTimer();
 
+  // Records a phase that started at |start_time| and ends now, for spans
+  // that can't be scoped, like waiting for another process.
+  static void RecordSince(const char* event_name, const timespec& start_time);
+
+  // Adds |value| to this thread's profile as |name|, for settings that
+  // shaped startup. Neither is escaped.
+  static void Annotate(const char* name, const std::string& value);
+
+  // Returns the phases recorded on this thread as JSON:
+  //   {"total_us":N,"phases":[{"name":S,"start_us":N,"duration_us":N,
+  //                            "phases":[...]},...],
+  //    "annotations":{S:S,...}}
+  // Times are relative to the first phase. Phases still running are
+  // reported up to now. "annotations" is left out if there are none.
+  static std::string Report();
+
  private:
   const char* event_name_;
   timespec start_time_;
+  // Index of this timer's phase in the profile.
+  size_t phase_;
 };      // class ScopeTimer
 #endif  // VM_TOOLS_SOMMELIER_SOMMELIER_SCOPE_TIMER_H_
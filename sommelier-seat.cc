@@ -7,10 +7,12 @@
 #include "sommelier-stylus-tablet.h"  // NOLINT(build/include_directory)
 #include "sommelier-transform.h"      // NOLINT(build/include_directory)
 
+#include <algorithm>
 #include <assert.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <string_view>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <wayland-client.h>
@@ -62,13 +64,31 @@ static void sl_host_pointer_set_cursor(struct wl_client* client,
   if (surface_resource) {
     host_surface = static_cast<sl_host_surface*>(
         wl_resource_get_user_data(surface_resource));
-    host_surface->has_role = 1;
-    if (host_surface->contents_width && host_surface->contents_height)
-      wl_surface_commit(host_surface->proxy);
   }
 
   sl_transform_guest_to_host(host->seat->ctx, nullptr, &hsx, &hsy);
 
+  // Toolkits set the same cursor again on every motion. It's still shown,
+  // and changes to its image come in through commits to its surface.
+  if (host->cursor_forwarded && host->cursor_serial == serial &&
+      host->cursor_surface.get() == host_surface &&
+      host->cursor_hotspot_x == hsx && host->cursor_hotspot_y == hsy) {
+    host->seat->ctx->metrics.cursor_sets_dropped++;
+    return;
+  }
+  host->cursor_forwarded = true;
+  host->cursor_serial = serial;
+  host->cursor_surface = host_surface;
+  host->cursor_hotspot_x = hsx;
+  host->cursor_hotspot_y = hsy;
+
+  if (host_surface) {
+    host_surface->has_role = 1;
+    host_surface->is_cursor = true;
+    if (host_surface->contents_width && host_surface->contents_height)
+      sl_host_surface_commit_proxy(host_surface);
+  }
+
   wl_pointer_set_cursor(host->proxy, serial,
                         host_surface ? host_surface->proxy : nullptr, hsx, hsy);
 }
@@ -89,6 +109,70 @@ static void sl_set_last_event_serial(struct wl_resource* surface_resource,
   host_surface->last_event_serial = serial;
 }
 
+// Surfaces that haven't committed for this long don't cap pointer motion,
+// since they may only draw in response to it.
+#define POINTER_MOTION_IDLE_SURFACE_NS 100000000
+
+// Sends the motion held back for --coalesce-pointer-motion, along with the
+// frame it ended if that is still held too.
+static void sl_pointer_forward_held_motion(struct sl_host_pointer* host) {
+  if (host->motion_pending) {
+    wl_pointer_send_motion(host->resource, host->motion_time, host->motion_x,
+                           host->motion_y);
+    host->motion_pending = false;
+  }
+  if (host->relative_motion_pending) {
+    sl_relative_pointer_forward_held_motion(host);
+    host->relative_motion_pending = false;
+  }
+  if (host->frame_pending) {
+    wl_pointer_send_frame(host->resource);
+    host->frame_pending = false;
+    host->last_motion_forwarded_ns = sl_monotonic_time_ns();
+    if (host->motion_timer)
+      wl_event_source_timer_update(host->motion_timer.get(), 0);
+  }
+}
+
+static int sl_pointer_motion_timer(void* data) {
+  struct sl_host_pointer* host = static_cast<sl_host_pointer*>(data);
+
+  sl_pointer_forward_held_motion(host);
+  return 0;
+}
+
+// Returns how many milliseconds a frame of nothing but motion has to be held
+// back for --pointer-motions-per-frame, or 0 to forward it now.
+static int sl_pointer_motion_delay_ms(struct sl_host_pointer* host) {
+  struct sl_context* ctx = host->seat->ctx;
+  struct sl_host_surface* surface = host->focus_surface;
+
+  if (!ctx->pointer_motions_per_frame || !surface ||
+      !surface->commit_interval_ns) {
+    return 0;
+  }
+
+  int64_t now = sl_monotonic_time_ns();
+  if (now - surface->last_commit_ns > POINTER_MOTION_IDLE_SURFACE_NS)
+    return 0;
+
+  int64_t next = host->last_motion_forwarded_ns +
+                 surface->commit_interval_ns / ctx->pointer_motions_per_frame;
+  if (next <= now)
+    return 0;
+  return (next - now + 999999) / 1000000;
+}
+
+// Called before forwarding events other than motion, which mustn't overtake
+// motion held back for --coalesce-pointer-motion.
+static void sl_pointer_forward_other_event(struct sl_host_pointer* host) {
+  if (!host->coalesce_motion)
+    return;
+
+  sl_pointer_forward_held_motion(host);
+  host->frame_has_other_events = true;
+}
+
 static void sl_pointer_set_focus(struct sl_host_pointer* host,
                                  uint32_t serial,
                                  struct sl_host_surface* host_surface,
@@ -102,6 +186,7 @@ static void sl_pointer_set_focus(struct sl_host_pointer* host,
   if (surface_resource == host->focus_resource)
     return;
 
+  sl_pointer_forward_other_event(host);
   if (host->focus_resource)
     wl_pointer_send_leave(host->resource, serial, host->focus_resource);
 
@@ -114,8 +199,8 @@ static void sl_pointer_set_focus(struct sl_host_pointer* host,
   if (surface_resource) {
     if (host->seat->ctx->xwayland) {
       // Make sure focus surface is on top before sending enter event.
-      sl_restack_windows(host->seat->ctx, wl_resource_get_id(surface_resource));
-      sl_roundtrip(host->seat->ctx);
+      sl_restack_windows_for_input(host->seat->ctx,
+                                   wl_resource_get_id(surface_resource));
     }
 
     wl_resource_add_destroy_listener(surface_resource,
@@ -170,6 +255,13 @@ static void sl_pointer_motion(void* data,
   wl_fixed_t my = y;
 
   sl_transform_pointer(host->seat->ctx, host->focus_surface, &mx, &my);
+  if (host->coalesce_motion) {
+    host->motion_pending = true;
+    host->motion_time = time;
+    host->motion_x = mx;
+    host->motion_y = my;
+    return;
+  }
   wl_pointer_send_motion(host->resource, time, mx, my);
 }
 
@@ -182,6 +274,7 @@ static void sl_pointer_button(void* data,
   struct sl_host_pointer* host =
       static_cast<sl_host_pointer*>(wl_pointer_get_user_data(pointer));
 
+  sl_pointer_forward_other_event(host);
   wl_pointer_send_button(host->resource, serial, time, button, state);
 
   if (host->focus_resource)
@@ -200,6 +293,7 @@ static void sl_pointer_axis(void* data,
 
   sl_transform_host_to_guest_fixed(host->seat->ctx, nullptr, &svalue, axis);
 
+  sl_pointer_forward_other_event(host);
   host->time = time;
   host->axis_delta[axis] += svalue;
 }
@@ -220,6 +314,30 @@ static void sl_pointer_frame(void* data, struct wl_pointer* pointer) {
   // we don't want to do this because it would lead to erratic jumps.
   const int kDiscreteScrollUnit = 5;
 
+  if (host->coalesce_motion) {
+    if (!host->frame_has_other_events &&
+        (host->motion_pending || host->relative_motion_pending)) {
+      // Frames of nothing but motion are merged until they are forwarded.
+      host->frame_pending = true;
+      int delay_ms = sl_pointer_motion_delay_ms(host);
+      if (!delay_ms) {
+        sl_pointer_forward_held_motion(host);
+      } else {
+        if (!host->motion_timer) {
+          host->motion_timer.reset(wl_event_loop_add_timer(
+              wl_display_get_event_loop(host->seat->ctx->host_display),
+              sl_pointer_motion_timer, host));
+        }
+        wl_event_source_timer_update(host->motion_timer.get(), delay_ms);
+      }
+      return;
+    }
+
+    // Motion that arrived after the frame's other events goes out first.
+    sl_pointer_forward_held_motion(host);
+    host->frame_has_other_events = false;
+  }
+
   for (int axis = 0; axis < 2; axis++) {
     if (host->axis_discrete[axis] != 0) {
       wl_pointer_send_axis_discrete(host->resource, axis,
@@ -249,6 +367,7 @@ void sl_pointer_axis_source(void* data,
   struct sl_host_pointer* host =
       static_cast<sl_host_pointer*>(wl_pointer_get_user_data(pointer));
 
+  sl_pointer_forward_other_event(host);
   wl_pointer_send_axis_source(host->resource, axis_source);
 }
 
@@ -259,6 +378,7 @@ static void sl_pointer_axis_stop(void* data,
   struct sl_host_pointer* host =
       static_cast<sl_host_pointer*>(wl_pointer_get_user_data(pointer));
 
+  sl_pointer_forward_other_event(host);
   wl_pointer_send_axis_stop(host->resource, time, axis);
 }
 
@@ -269,6 +389,7 @@ static void sl_pointer_axis_discrete(void* data,
   struct sl_host_pointer* host =
       static_cast<sl_host_pointer*>(wl_pointer_get_user_data(pointer));
 
+  sl_pointer_forward_other_event(host);
   host->axis_discrete[axis] += discrete;
 }
 
@@ -285,6 +406,39 @@ static void sl_host_keyboard_release(struct wl_client* client,
 static const struct wl_keyboard_interface sl_keyboard_implementation = {
     sl_host_keyboard_release};
 
+// Distinct keymaps kept compiled, enough to switch between a few layouts.
+#define KEYMAP_CACHE_SIZE 4
+
+// Returns a reference to |text| compiled into a keymap, reusing one that
+// was compiled before for the same text.
+static struct xkb_keymap* sl_keymap_cache_get(struct sl_context* ctx,
+                                              const char* text,
+                                              size_t size) {
+  std::string_view view(text, strnlen(text, size));
+  size_t hash = std::hash<std::string_view>()(view);
+  std::vector<struct sl_cached_keymap>& cache = ctx->keymap_cache;
+
+  for (auto it = cache.begin(); it != cache.end(); ++it) {
+    if (it->hash == hash && it->text == view) {
+      std::rotate(cache.begin(), it, it + 1);
+      return xkb_keymap_ref(cache.front().keymap);
+    }
+  }
+
+  struct xkb_keymap* keymap = xkb_keymap_new_from_string(
+      ctx->xkb_context, std::string(view).c_str(), XKB_KEYMAP_FORMAT_TEXT_V1,
+      static_cast<xkb_keymap_compile_flags>(XKB_KEYMAP_COMPILE_NO_FLAGS));
+  if (!keymap)
+    return nullptr;
+
+  if (cache.size() == KEYMAP_CACHE_SIZE) {
+    xkb_keymap_unref(cache.back().keymap);
+    cache.pop_back();
+  }
+  cache.insert(cache.begin(), {hash, std::string(view), keymap});
+  return xkb_keymap_ref(keymap);
+}
+
 static void sl_keyboard_keymap(void* data,
                                struct wl_keyboard* keyboard,
                                uint32_t format,
@@ -303,10 +457,8 @@ static void sl_keyboard_keymap(void* data,
     if (host->keymap)
       xkb_keymap_unref(host->keymap);
 
-    host->keymap = xkb_keymap_new_from_string(
-        host->seat->ctx->xkb_context, static_cast<char*>(data),
-        XKB_KEYMAP_FORMAT_TEXT_V1,
-        static_cast<xkb_keymap_compile_flags>(XKB_KEYMAP_COMPILE_NO_FLAGS));
+    host->keymap = sl_keymap_cache_get(host->seat->ctx,
+                                       static_cast<char*>(data), size);
     assert(host->keymap);
 
     munmap(data, size);
@@ -433,23 +585,15 @@ static void sl_keyboard_key(void* data,
       if (num_symbols == 1)
         symbol = symbols[0];
 
-      for (auto accelerator : host->seat->ctx->accelerators) {
-        if (host->modifiers == accelerator->modifiers &&
-            xkb_keysym_to_lower(symbol) == accelerator->symbol) {
-          handled = false;
-          break;
-        }
-      }
+      uint64_t accelerator =
+          sl_accelerator_key(host->modifiers, xkb_keysym_to_lower(symbol));
+      if (host->seat->ctx->accelerators.count(accelerator))
+        handled = false;
       if (host->seat->ctx->host_focus_window &&
           !(host->seat->ctx->host_focus_window->fullscreen ||
-            host->seat->ctx->host_focus_window->compositor_fullscreen)) {
-        for (auto accelerator : host->seat->ctx->accelerators) {
-          if (host->modifiers == accelerator->modifiers &&
-              xkb_keysym_to_lower(symbol) == accelerator->symbol) {
-            handled = false;
-            break;
-          }
-        }
+            host->seat->ctx->host_focus_window->compositor_fullscreen) &&
+          host->seat->ctx->accelerators.count(accelerator)) {
+        handled = false;
       }
     }
     // Forward key pressed event if it should be handled and not
@@ -564,9 +708,8 @@ static void sl_host_touch_down(void* data,
 
   if (host->seat->ctx->xwayland) {
     // Make sure focus surface is on top before sending down event.
-    sl_restack_windows(host->seat->ctx,
-                       wl_resource_get_id(host_surface->resource));
-    sl_roundtrip(host->seat->ctx);
+    sl_restack_windows_for_input(host->seat->ctx,
+                                 wl_resource_get_id(host_surface->resource));
   }
 
   sl_transform_host_to_guest_fixed(host->seat->ctx, host_surface, &ix, &iy);
@@ -695,6 +838,12 @@ static void sl_host_seat_get_host_pointer(struct wl_client* client,
   host_pointer->axis_delta[1] = wl_fixed_from_int(0);
   host_pointer->axis_discrete[0] = 0;
   host_pointer->axis_discrete[1] = 0;
+  wl_list_init(&host_pointer->relative_pointers);
+  // Motion can only be held back until the end of a frame if there is one.
+  host_pointer->coalesce_motion =
+      host->seat->ctx->coalesce_pointer_motion &&
+      wl_pointer_get_version(host_pointer->proxy) >=
+          WL_POINTER_FRAME_SINCE_VERSION;
 }
 
 static void sl_destroy_host_keyboard(struct wl_resource* resource) {
@@ -761,11 +910,20 @@ static void sl_host_seat_get_host_keyboard(struct wl_client* client,
   host_keyboard->modifiers = 0;
   wl_array_init(&host_keyboard->pressed_keys);
 
-  if (host->seat->ctx->keyboard_extension) {
+  struct sl_keyboard_extension* keyboard_extension =
+      host->seat->ctx->keyboard_extension;
+  if (keyboard_extension) {
+    // The host's global isn't bound until the first keyboard needs it.
+    if (!keyboard_extension->internal) {
+      keyboard_extension->internal =
+          static_cast<zcr_keyboard_extension_v1*>(wl_registry_bind(
+              wl_display_get_registry(host->seat->ctx->display),
+              keyboard_extension->id, &zcr_keyboard_extension_v1_interface,
+              1));
+    }
     host_keyboard->extended_keyboard_proxy =
         zcr_keyboard_extension_v1_get_extended_keyboard(
-            host->seat->ctx->keyboard_extension->internal,
-            host_keyboard->proxy);
+            keyboard_extension->internal, host_keyboard->proxy);
   } else {
     host_keyboard->extended_keyboard_proxy = nullptr;
   }
@@ -13,6 +13,7 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <memory>
 #include <stdlib.h>
 #include <string.h>
 
@@ -39,6 +40,24 @@ struct sl_host_tablet {
   wl_fixed_t tilt_y;
   uint32_t last_time;
 
+  // The latest motion of the frame being built, sent with the frame's other
+  // axes when it's forwarded. Axis values equal to those last sent aren't
+  // sent again, and frames with nothing in them not at all.
+  bool motion_pending;
+  wl_fixed_t motion_x;
+  wl_fixed_t motion_y;
+  wl_fixed_t sent_x;
+  wl_fixed_t sent_y;
+  uint32_t sent_pressure;
+  wl_fixed_t sent_tilt_x;
+  wl_fixed_t sent_tilt_y;
+  bool frame_events;
+  // Set once the frame is complete, while it's held back for
+  // --stylus-max-rate, and if it has more than axis changes, which aren't.
+  bool frame_pending;
+  bool frame_other_events;
+  int64_t last_frame_ns;
+
   void (*destroy_cb)(void* data);
   void* data;
 };
@@ -53,6 +72,7 @@ struct sl_host_stylus_tablet {
   struct wl_listener focus_resource_listener;
   struct wl_resource* focus_resource;
   struct sl_host_tablet* tablet;
+  std::unique_ptr<struct wl_event_source> frame_timer;
 };
 
 static void sl_host_tablet_destroy(struct sl_host_tablet* tablet);
@@ -195,12 +215,22 @@ static void sl_host_tablet_send_pressure_and_tilt(struct sl_host_tablet* data,
                                                   struct wl_resource* tool) {
   if (data->force) {
     uint32_t pressure = data->force * 65535.0;
-    zwp_tablet_tool_v2_send_pressure(tool, pressure);
+    if (pressure != data->sent_pressure) {
+      zwp_tablet_tool_v2_send_pressure(tool, pressure);
+      data->sent_pressure = pressure;
+      data->frame_events = true;
+    }
     data->force = 0.0;
   }
 
   if (data->tilt_x || data->tilt_y) {
-    zwp_tablet_tool_v2_send_tilt(tool, data->tilt_x, data->tilt_y);
+    if (data->tilt_x != data->sent_tilt_x ||
+        data->tilt_y != data->sent_tilt_y) {
+      zwp_tablet_tool_v2_send_tilt(tool, data->tilt_x, data->tilt_y);
+      data->sent_tilt_x = data->tilt_x;
+      data->sent_tilt_y = data->tilt_y;
+      data->frame_events = true;
+    }
     data->tilt_x = 0;
     data->tilt_y = 0;
   }
@@ -224,6 +254,61 @@ static wl_resource* sl_host_tablet_active_tool(struct sl_host_tablet* tablet) {
   }
 }
 
+// Sends the axes of the frame being built, and the frame itself once it's
+// complete.
+static void sl_host_tablet_forward_frame(
+    struct sl_host_stylus_tablet* stylus_tablet) {
+  struct sl_host_tablet* tablet = stylus_tablet->tablet;
+  struct wl_resource* tool = sl_host_tablet_active_tool(tablet);
+
+  if (!tool)
+    return;
+
+  sl_host_tablet_send_pressure_and_tilt(tablet, tool);
+  if (tablet->motion_pending) {
+    if (tablet->motion_x != tablet->sent_x ||
+        tablet->motion_y != tablet->sent_y) {
+      zwp_tablet_tool_v2_send_motion(tool, tablet->motion_x, tablet->motion_y);
+      tablet->sent_x = tablet->motion_x;
+      tablet->sent_y = tablet->motion_y;
+      tablet->frame_events = true;
+    }
+    tablet->motion_pending = false;
+  }
+  if (tablet->frame_pending) {
+    if (tablet->frame_events) {
+      zwp_tablet_tool_v2_send_frame(tool, tablet->last_time);
+      tablet->last_frame_ns = sl_monotonic_time_ns();
+    }
+    tablet->frame_pending = false;
+    tablet->frame_events = false;
+    tablet->frame_other_events = false;
+    if (stylus_tablet->frame_timer)
+      wl_event_source_timer_update(stylus_tablet->frame_timer.get(), 0);
+  }
+}
+
+static int sl_host_tablet_frame_timer(void* data) {
+  sl_host_tablet_forward_frame(static_cast<sl_host_stylus_tablet*>(data));
+  return 0;
+}
+
+// Returns how many milliseconds a frame of nothing but axis changes has to
+// be held back for --stylus-max-rate, or 0 to forward it now.
+static int sl_host_tablet_frame_delay_ms(
+    struct sl_host_stylus_tablet* stylus_tablet) {
+  int max_rate = stylus_tablet->seat->ctx->stylus_max_rate;
+
+  if (!max_rate || stylus_tablet->tablet->frame_other_events)
+    return 0;
+
+  int64_t now = sl_monotonic_time_ns();
+  int64_t next = stylus_tablet->tablet->last_frame_ns + 1000000000 / max_rate;
+  if (next <= now)
+    return 0;
+  return (next - now + 999999) / 1000000;
+}
+
 static void sl_touch_stylus_touch_down(void* data,
                                        struct wl_touch* wl_touch,
                                        uint32_t serial,
@@ -259,11 +344,13 @@ static void sl_touch_stylus_touch_down(void* data,
 
   if (stylus_tablet->seat->ctx->xwayland) {
     // Make sure focus surface is on top before sending down event.
-    sl_restack_windows(stylus_tablet->seat->ctx,
-                       wl_resource_get_id(host_surface->resource));
-    sl_roundtrip(stylus_tablet->seat->ctx);
+    sl_restack_windows_for_input(stylus_tablet->seat->ctx,
+                                 wl_resource_get_id(host_surface->resource));
   }
 
+  // A frame held back from before goes first.
+  sl_host_tablet_forward_frame(stylus_tablet);
+
   sl_transform_host_to_guest_fixed(stylus_tablet->seat->ctx, host_surface, &ix,
                                    &iy);
   zwp_tablet_tool_v2_send_proximity_in(
@@ -271,6 +358,13 @@ static void sl_touch_stylus_touch_down(void* data,
   zwp_tablet_tool_v2_send_motion(tool, ix, iy);
   zwp_tablet_tool_v2_send_frame(tool, time);
   zwp_tablet_tool_v2_send_down(tool, serial);
+  stylus_tablet->tablet->sent_x = ix;
+  stylus_tablet->tablet->sent_y = iy;
+  stylus_tablet->tablet->sent_pressure = 0;
+  stylus_tablet->tablet->sent_tilt_x = 0;
+  stylus_tablet->tablet->sent_tilt_y = 0;
+  stylus_tablet->tablet->frame_events = true;
+  stylus_tablet->tablet->frame_other_events = true;
   sl_host_tablet_send_pressure_and_tilt(stylus_tablet->tablet, tool);
 
   if (stylus_tablet->focus_resource)
@@ -296,10 +390,12 @@ static void sl_touch_stylus_touch_up(void* data,
   stylus_tablet->focus_resource = nullptr;
   stylus_tablet->focus_surface = nullptr;
 
-  sl_host_tablet_send_pressure_and_tilt(stylus_tablet->tablet, tool);
+  sl_host_tablet_forward_frame(stylus_tablet);
   zwp_tablet_tool_v2_send_up(tool);
   zwp_tablet_tool_v2_send_proximity_out(tool);
   stylus_tablet->tablet->valid = false;
+  stylus_tablet->tablet->frame_events = true;
+  stylus_tablet->tablet->frame_other_events = true;
 
   if (stylus_tablet->focus_resource)
     sl_set_last_event_serial(stylus_tablet->focus_resource, serial);
@@ -315,7 +411,6 @@ static void sl_touch_stylus_touch_motion(void* data,
                                          wl_fixed_t y) {
   struct sl_host_stylus_tablet* stylus_tablet =
       static_cast<sl_host_stylus_tablet*>(data);
-  struct wl_resource* tool = sl_host_tablet_active_tool(stylus_tablet->tablet);
 
   wl_fixed_t ix = x;
   wl_fixed_t iy = y;
@@ -328,8 +423,9 @@ static void sl_touch_stylus_touch_motion(void* data,
 
   sl_transform_host_to_guest_fixed(stylus_tablet->seat->ctx,
                                    stylus_tablet->focus_surface, &ix, &iy);
-  sl_host_tablet_send_pressure_and_tilt(stylus_tablet->tablet, tool);
-  zwp_tablet_tool_v2_send_motion(tool, ix, iy);
+  stylus_tablet->tablet->motion_pending = true;
+  stylus_tablet->tablet->motion_x = ix;
+  stylus_tablet->tablet->motion_y = iy;
 
   stylus_tablet->tablet->last_time = time;
 }
@@ -337,10 +433,21 @@ static void sl_touch_stylus_touch_motion(void* data,
 static void sl_touch_stylus_touch_frame(void* data, struct wl_touch* wl_touch) {
   struct sl_host_stylus_tablet* stylus_tablet =
       static_cast<sl_host_stylus_tablet*>(data);
-  struct wl_resource* tool = sl_host_tablet_active_tool(stylus_tablet->tablet);
 
-  sl_host_tablet_send_pressure_and_tilt(stylus_tablet->tablet, tool);
-  zwp_tablet_tool_v2_send_frame(tool, stylus_tablet->tablet->last_time);
+  // Frames held back are merged, each axis keeping its latest value.
+  stylus_tablet->tablet->frame_pending = true;
+  int delay_ms = sl_host_tablet_frame_delay_ms(stylus_tablet);
+  if (!delay_ms) {
+    sl_host_tablet_forward_frame(stylus_tablet);
+    return;
+  }
+
+  if (!stylus_tablet->frame_timer) {
+    stylus_tablet->frame_timer.reset(wl_event_loop_add_timer(
+        wl_display_get_event_loop(stylus_tablet->seat->ctx->host_display),
+        sl_host_tablet_frame_timer, stylus_tablet));
+  }
+  wl_event_source_timer_update(stylus_tablet->frame_timer.get(), delay_ms);
 }
 
 static void sl_touch_stylus_touch_cancel(void* data,
@@ -349,6 +456,7 @@ static void sl_touch_stylus_touch_cancel(void* data,
       static_cast<sl_host_stylus_tablet*>(data);
   struct wl_resource* tool = sl_host_tablet_active_tool(stylus_tablet->tablet);
 
+  sl_host_tablet_forward_frame(stylus_tablet);
   zwp_tablet_tool_v2_send_frame(tool, stylus_tablet->tablet->last_time);
 }
 
@@ -477,6 +585,19 @@ static struct sl_host_stylus_tablet* sl_host_touch_tablet_create(
   return stylus_tablet;
 }
 
+// Binds the host's stylus global the first time a client needs it.
+static struct zcr_stylus_v2* sl_stylus_input_manager_bind(
+    struct sl_context* ctx) {
+  struct sl_stylus_input_manager* manager = ctx->stylus_input_manager;
+
+  if (!manager->internal) {
+    manager->internal = static_cast<zcr_stylus_v2*>(
+        wl_registry_bind(wl_display_get_registry(ctx->display), manager->id,
+                         &zcr_stylus_v2_interface, 1));
+  }
+  return manager->internal;
+}
+
 static void sl_host_tablet_manager_get_tablet_seat(
     struct wl_client* client,
     struct wl_resource* tablet_manager,
@@ -494,7 +615,7 @@ static void sl_host_tablet_manager_get_tablet_seat(
   if (host_seat->seat->stylus_tablet)
     return;
 
-  if (ctx->stylus_input_manager && ctx->stylus_input_manager->internal) {
+  if (ctx->stylus_input_manager && sl_stylus_input_manager_bind(ctx)) {
     host_seat->seat->stylus_tablet =
         sl_host_touch_tablet_create(ctx, client, host_seat, tablet_seat);
   }
@@ -19,6 +19,8 @@ struct sl_host_subsurface {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_subsurface* proxy;
+  WeakResourcePtr<sl_host_surface> surface;
+  WeakResourcePtr<sl_host_surface> parent;
 };
 MAP_STRUCTS(wl_subsurface, sl_host_subsurface);
 
@@ -40,19 +42,60 @@ static void sl_subsurface_set_position(struct wl_client* client,
   wl_subsurface_set_position(host->proxy, ix, iy);
 }
 
+static void sl_subsurface_set_sync(struct wl_client* client,
+                                   struct wl_resource* resource) {
+  struct sl_host_subsurface* host =
+      static_cast<sl_host_subsurface*>(wl_resource_get_user_data(resource));
+
+  // Commits held back were made desynchronized.
+  if (host->surface &&
+      sl_host_surface_hold_request<sl_subsurface_set_sync>(
+          host->surface.get(), client, resource)) {
+    return;
+  }
+  wl_subsurface_set_sync(host->proxy);
+  if (host->surface)
+    host->surface->sync_parent = host->parent.get();
+}
+
+// Stops holding commits of |host|'s surface, applying one that's held as the
+// host does with its cached state.
+static void sl_subsurface_stop_sync(struct sl_host_subsurface* host) {
+  if (!host->surface)
+    return;
+
+  host->surface->sync_parent.Reset();
+  sl_host_surface_apply_held_commit(host->surface.get());
+}
+
+static void sl_subsurface_set_desync(struct wl_client* client,
+                                     struct wl_resource* resource) {
+  struct sl_host_subsurface* host =
+      static_cast<sl_host_subsurface*>(wl_resource_get_user_data(resource));
+
+  if (host->surface &&
+      sl_host_surface_hold_request<sl_subsurface_set_desync>(
+          host->surface.get(), client, resource)) {
+    return;
+  }
+  sl_subsurface_stop_sync(host);
+  wl_subsurface_set_desync(host->proxy);
+}
+
 static const struct wl_subsurface_interface sl_subsurface_implementation = {
     sl_subsurface_destroy,
     sl_subsurface_set_position,
     ForwardRequest<wl_subsurface_place_above>,
     ForwardRequest<wl_subsurface_place_below>,
-    ForwardRequest<wl_subsurface_set_sync>,
-    ForwardRequest<wl_subsurface_set_desync>,
+    sl_subsurface_set_sync,
+    sl_subsurface_set_desync,
 };
 
 static void sl_destroy_host_subsurface(struct wl_resource* resource) {
   struct sl_host_subsurface* host =
       static_cast<sl_host_subsurface*>(wl_resource_get_user_data(resource));
 
+  sl_subsurface_stop_sync(host);
   wl_subsurface_destroy(host->proxy);
   wl_resource_set_user_data(resource, nullptr);
   delete host;
@@ -87,6 +130,10 @@ static void sl_subcompositor_get_subsurface(
       host->proxy, host_surface->proxy, host_parent->proxy);
   wl_subsurface_set_user_data(host_subsurface->proxy, host_subsurface);
   host_surface->has_role = 1;
+  // Subsurfaces start out synchronized.
+  host_subsurface->surface = host_surface;
+  host_subsurface->parent = host_parent;
+  host_surface->sync_parent = host_parent;
 }
 
 static const struct wl_subcompositor_interface sl_subcompositor_implementation =
@@ -26,5 +26,61 @@ TEST_F(WaylandTest, CanCommitToEmptySurface) {
   wl_surface_commit(surface);
 }
 
+TEST_F(WaylandTest, PresentationTimesFollowHostClockOffset) {
+  struct sl_presentation presentation = {};
+  const int64_t kOffset = 5000000000;
+
+  // The quickest delivery is taken to have had no latency.
+  EXPECT_EQ(sl_presentation_guest_time_ns(&presentation, 1000000,
+                                          1000000 + kOffset + 300000),
+            1000000 + kOffset + 300000);
+  EXPECT_EQ(sl_presentation_guest_time_ns(&presentation, 2000000,
+                                          2000000 + kOffset + 100000),
+            2000000 + kOffset + 100000);
+  EXPECT_EQ(sl_presentation_guest_time_ns(&presentation, 3000000,
+                                          3000000 + kOffset + 200000),
+            3000000 + kOffset + 100000);
+
+  // A larger offset takes over once a whole window has seen it.
+  int64_t host_ns = 4000000;
+  for (int i = 0; i < 240; ++i) {
+    sl_presentation_guest_time_ns(&presentation, host_ns,
+                                  host_ns + 2 * kOffset);
+    host_ns += 16000000;
+  }
+  EXPECT_EQ(sl_presentation_guest_time_ns(&presentation, host_ns,
+                                          host_ns + 2 * kOffset),
+            host_ns + 2 * kOffset);
+}
+
+TEST_F(WaylandTest, HousekeepingTasksDueTogetherShareAWakeup) {
+  static int runs;
+  runs = 0;
+  sl_context_schedule_housekeeping(&ctx, SL_HOUSEKEEPING_STATS, 0,
+                                   [](struct sl_context*) { runs++; });
+  sl_context_schedule_housekeeping(&ctx, SL_HOUSEKEEPING_OUTPUT_BUFFER_IDLE, 0,
+                                   [](struct sl_context*) { runs++; });
+  EXPECT_NE(ctx.housekeeping_timer_ns, 0);
+
+  sl_context_run_housekeeping(&ctx, ctx.housekeeping_timer_ns);
+  EXPECT_EQ(runs, 2);
+  EXPECT_EQ(ctx.metrics.housekeeping_wakeups, 1u);
+  EXPECT_EQ(ctx.housekeeping_timer_ns, 0);
+}
+
+TEST_F(WaylandTest, StatsTimerStopsWhileNothingCommits) {
+  sl_schedule_stats(&ctx);
+  ctx.metrics.commits = 1;
+
+  // Run the timer for as long as it stays armed over ten idle minutes.
+  int64_t end_ns = sl_monotonic_time_ns() + 600 * 1000000000LL;
+  while (ctx.housekeeping_timer_ns && ctx.housekeeping_timer_ns < end_ns)
+    sl_context_run_housekeeping(&ctx, ctx.housekeeping_timer_ns);
+
+  // One wakeup for the stats of the commit, and one to find nothing new.
+  EXPECT_EQ(ctx.metrics.housekeeping_wakeups, 2u);
+  EXPECT_EQ(ctx.housekeeping_timer_ns, 0);
+}
+
 }  // namespace sommelier
 }  // namespace vm_tools
@@ -567,23 +567,20 @@ static void sl_text_input_crostini_activate_x11(wl_client* client,
 
   struct sl_context* ctx = host_text_input->ctx;
 
-  struct sl_window* window;
-  wl_list_for_each(window, &ctx->windows, link) {
-    if (window->id != x11_window_id)
-      continue;
-    if (!window->host_surface_id)
-      return;
-    struct wl_resource* host_window_resource =
-        wl_client_get_object(ctx->client, window->host_surface_id);
-    if (!host_window_resource)
-      return;
-    sl_host_surface* host_surface = static_cast<sl_host_surface*>(
-        wl_resource_get_user_data(host_window_resource));
-    host_text_input->active_surface = host_surface;
-    zwp_text_input_v1_activate(host_text_input->proxy, host_seat->proxy,
-                               host_surface->proxy);
+  struct sl_window* window = sl_lookup_window(ctx, x11_window_id);
+  if (!window || window->id != x11_window_id || window->unpaired)
     return;
-  }
+  if (!window->host_surface_id)
+    return;
+  struct wl_resource* host_window_resource =
+      wl_client_get_object(ctx->client, window->host_surface_id);
+  if (!host_window_resource)
+    return;
+  sl_host_surface* host_surface = static_cast<sl_host_surface*>(
+      wl_resource_get_user_data(host_window_resource));
+  host_text_input->active_surface = host_surface;
+  zwp_text_input_v1_activate(host_text_input->proxy, host_seat->proxy,
+                             host_surface->proxy);
 }
 
 static const struct zcr_text_input_crostini_v1_interface
@@ -3,106 +3,158 @@
 // found in the LICENSE file.
 
 #include "sommelier-timing.h"   // NOLINT(build/include_directory)
+#include "sommelier-logging.h"  // NOLINT(build/include_directory)
 #include "sommelier-tracing.h"  // NOLINT(build/include_directory)
 
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <fstream>
 #include <iomanip>
-#include <iostream>
 #include <sstream>
 #include <string>
 
 #define NSEC_PER_SEC 1000000000
-#define NSEC_PER_USEC 1000
+#define NSEC_PER_MSEC 1000000
 
 static inline int64_t timespec_to_ns(timespec const* t) {
   return (int64_t)t->tv_sec * NSEC_PER_SEC + t->tv_nsec;
 }
 
-// Records start time to calculate first delta.
+Timing::~Timing() {
+  if (log)
+    munmap(log, log_size);
+}
+
+// Creates the log and records the start time to calculate the first delta.
 void Timing::RecordStartTime() {
-  clock_gettime(CLOCK_REALTIME, &last_event);
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    LOG(ERROR) << "failed to create timing log " << filename << ": "
+               << strerror(errno);
+    return;
+  }
+
+  // The file is sparse until records land in it.
+  size_t size =
+      sizeof(TimingLogHeader) + kMaxNumActions * sizeof(TimingLogRecord);
+  void* addr = MAP_FAILED;
+  if (ftruncate(fd, size) == 0) {
+    addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (addr == MAP_FAILED) {
+    LOG(ERROR) << "failed to map timing log " << filename << ": "
+               << strerror(errno);
+    close(fd);
+    return;
+  }
+  close(fd);
+
+  log = static_cast<TimingLogHeader*>(addr);
+  log_size = size;
+  log->magic = TIMING_LOG_MAGIC;
+  log->version = TIMING_LOG_VERSION;
+  log->capacity = kMaxNumActions;
+  log->record_size = sizeof(TimingLogRecord);
+  log->start_time_ns = GetTime();
+  log->count = 0;
 }
 
 int64_t Timing::GetTime() {
   timespec tp;
   clock_gettime(CLOCK_REALTIME, &tp);
-  int64_t now = timespec_to_ns(&tp);
-  int64_t last = timespec_to_ns(&last_event);
-  last_event = tp;
-  return now - last;
+  return timespec_to_ns(&tp);
+}
+
+void Timing::AddRecord(int surface_id, int buffer_id, TimingLogType type) {
+  if (!log)
+    return;
+
+  // Only this thread writes the log, readers just need the count published
+  // after the record.
+  uint64_t count = log->count;
+  TimingLogRecord* records = reinterpret_cast<TimingLogRecord*>(log + 1);
+  TimingLogRecord* record = &records[count % kMaxNumActions];
+  record->time_ns = GetTime();
+  record->surface_id = surface_id;
+  record->buffer_id = buffer_id;
+  record->type = type;
+  __atomic_store_n(&log->count, count + 1, __ATOMIC_RELEASE);
 }
 
 // Create a new action, add info gained from attach call.
 void Timing::UpdateLastAttach(int surface_id, int buffer_id) {
-  actions[event_id % kMaxNumActions] =
-      BufferAction(GetTime(), surface_id, buffer_id, BufferAction::ATTACH);
-  event_id++;
+  AddRecord(surface_id, buffer_id, TIMING_LOG_ATTACH);
 }
 
 // Create a new action, add info gained from commit call.
 void Timing::UpdateLastCommit(int surface_id) {
-  actions[event_id % kMaxNumActions] = BufferAction(
-      GetTime(), surface_id, kUnknownBufferId, BufferAction::COMMIT);
-  event_id++;
+  AddRecord(surface_id, kUnknownBufferId, TIMING_LOG_COMMIT);
 }
 
 // Add a release action with release timing info.
 void Timing::UpdateLastRelease(int buffer_id) {
-  actions[event_id % kMaxNumActions] = BufferAction(
-      GetTime(), kUnknownSurfaceId, buffer_id, BufferAction::RELEASE);
-  event_id++;
+  AddRecord(kUnknownSurfaceId, buffer_id, TIMING_LOG_RELEASE);
 }
 
-// Output the recorded actions to the timing log file.
+// The log already lives in the page cache, so dumping it only has to ask for
+// writeback.
 void Timing::OutputLog() {
   TRACE_EVENT("timing", "Timing::OutputLog");
 
-  if (event_id == 0) {
-    std::cout << "No events in buffer, exiting" << std::endl;
+  if (!log)
+    return;
+
+  if (msync(log, log_size, MS_ASYNC)) {
+    LOG(ERROR) << "failed to sync timing log " << filename << ": "
+               << strerror(errno);
     return;
   }
+  LOG(INFO) << "timing log " << filename << " holds " << log->count
+            << " events";
+}
 
-  std::cout << "Writing buffer activity to the timing log file" << std::endl;
+void LatencyHistogram::Reset() {
+  count = 0;
+  max_ms = 0.0;
+  std::fill(buckets, buckets + kMaxBuckets, 0);
+}
 
-  std::string output_filename =
-      std::string(filename) + "_set_" + std::to_string(saves);
+void LatencyHistogram::Add(int64_t latency_ns) {
+  double ms = static_cast<double>(latency_ns) / NSEC_PER_MSEC;
+  if (ms < 0.0) {
+    return;
+  }
 
-  std::ofstream outfile(output_filename);
+  int bucket = std::min(static_cast<int>(ms / kBucketSizeMs), kMaxBuckets - 1);
+  buckets[bucket]++;
+  max_ms = std::max(ms, max_ms);
+  count++;
+}
 
-  int start = 0;
-  int buf_size = event_id;
-  if (event_id >= kMaxNumActions) {
-    start = event_id % kMaxNumActions;
-    buf_size = kMaxNumActions;
-  }
+double LatencyHistogram::EstimatePercentile(double percentile) const {
+  int samples_to_go = count * percentile / 100.0;
 
-  outfile << "Type Surface_ID Buffer_ID Delta_Time" << std::endl;
-  for (int i = 0; i < buf_size; i++) {
-    int idx = (i + start) % kMaxNumActions;
-    std::string type("?");
-    if (actions[idx].action_type == BufferAction::ATTACH) {
-      type = "a";
-    } else if (actions[idx].action_type == BufferAction::COMMIT) {
-      type = "c";
-    } else if (actions[idx].action_type == BufferAction::RELEASE) {
-      type = "r";
+  for (int i = 0; i < kMaxBuckets; i++) {
+    if (samples_to_go < buckets[i]) {
+      if (i == kMaxBuckets - 1) {
+        return max_ms;
+      }
+      return (i + 0.5) * kBucketSizeMs;
     }
-    outfile << type << " ";
-    outfile << actions[idx].surface_id << " ";
-    outfile << actions[idx].buffer_id << " ";
-    outfile << static_cast<double>(actions[idx].delta_time) / NSEC_PER_USEC
-            << std::endl;
+    samples_to_go -= buckets[i];
   }
+  return 0.0;
+}
 
-  std::stringstream nsec;
-  nsec << std::setw(9) << std::setfill('0') << last_event.tv_nsec;
-  outfile << "EndTime " << event_id - 1 << " " << last_event.tv_sec << "."
-          << nsec.str() << std::endl;
-
-  outfile.close();
-  std::cout << "Finished writing " << output_filename << std::endl;
-  ++saves;
+static int64_t monotonic_time_ns() {
+  timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return timespec_to_ns(&tp);
 }
 
 SurfaceStats::SurfaceStats() : total_frames(0) {
@@ -122,9 +174,36 @@ void SurfaceStats::StartNewWindow() {
   min_fps = 0.0;
   max_fps = 0.0;
   std::fill(buckets, buckets + kMaxBuckets, 0);
+  copy_latency.Reset();
+  commit_to_release_latency.Reset();
+  release_to_attach_latency.Reset();
+  copy_page_faults = 0;
+}
+
+void SurfaceStats::AddAttach() {
+  if (pending_release_ns) {
+    release_to_attach_latency.Add(monotonic_time_ns() - pending_release_ns);
+    pending_release_ns = 0;
+  }
+}
+
+void SurfaceStats::AddCopy(int64_t duration_ns, uint64_t page_faults) {
+  copy_latency.Add(duration_ns);
+  copy_page_faults += page_faults;
+}
+
+void SurfaceStats::AddRelease() {
+  int64_t now = monotonic_time_ns();
+  if (pending_commit_ns) {
+    commit_to_release_latency.Add(now - pending_commit_ns);
+    pending_commit_ns = 0;
+  }
+  pending_release_ns = now;
 }
 
 void SurfaceStats::AddFrame(uint32_t steam_id, bool activated) {
+  pending_commit_ns = monotonic_time_ns();
+
   // Calculate current time and normalize to ns.
   timespec tp;
   clock_gettime(CLOCK_REALTIME, &tp);
@@ -217,6 +296,13 @@ std::string SurfaceStats::Summarize(int surface_id) const {
   log << EstimatePercentile(99.0) << " ";
   log << variance << " ";
   log << CountSlowFrames(slow_frame_threshold) << " ";
+  log << copy_latency.EstimatePercentile(50.0) << " ";
+  log << copy_latency.EstimatePercentile(99.0) << " ";
+  log << copy_page_faults << " ";
+  log << commit_to_release_latency.EstimatePercentile(50.0) << " ";
+  log << commit_to_release_latency.EstimatePercentile(99.0) << " ";
+  log << release_to_attach_latency.EstimatePercentile(50.0) << " ";
+  log << release_to_attach_latency.EstimatePercentile(99.0) << " ";
   // histogram includes a leading space.
   log << kLogBuckets * kBucketSize;
 
@@ -255,6 +341,13 @@ std::string SurfaceStats::GenerateHeader() {
   log << "p99" << " ";
   log << "variance" << " ";
   log << "num_slow_frames" << " ";
+  log << "copy_p50_ms" << " ";
+  log << "copy_p99_ms" << " ";
+  log << "copy_page_faults" << " ";
+  log << "commit_release_p50_ms" << " ";
+  log << "commit_release_p99_ms" << " ";
+  log << "release_attach_p50_ms" << " ";
+  log << "release_attach_p99_ms" << " ";
   log << "bucket_size" << " ";
   log << "histogram...";
 
@@ -306,6 +399,41 @@ void FrameStats::AddFrame(int surface_id,
   surface_stats[surface_id].AddFrame(steam_game_id, activated);
 }
 
+void FrameStats::AddAttach(int surface_id, int buffer_id) {
+  if (buffer_id != kUnknownBufferId) {
+    buffer_surfaces[buffer_id] = surface_id;
+  }
+
+  auto i = surface_stats.find(surface_id);
+  if (i != surface_stats.end()) {
+    i->second.AddAttach();
+  }
+}
+
+void FrameStats::AddCopy(int surface_id,
+                         int64_t duration_ns,
+                         uint64_t page_faults) {
+  auto i = surface_stats.find(surface_id);
+  if (i != surface_stats.end()) {
+    i->second.AddCopy(duration_ns, page_faults);
+  }
+}
+
+void FrameStats::AddRelease(int surface_id) {
+  auto i = surface_stats.find(surface_id);
+  if (i != surface_stats.end()) {
+    i->second.AddRelease();
+  }
+}
+
+void FrameStats::AddBufferRelease(int buffer_id) {
+  auto i = buffer_surfaces.find(buffer_id);
+  if (i != buffer_surfaces.end()) {
+    AddRelease(i->second);
+    buffer_surfaces.erase(i);
+  }
+}
+
 void FrameStats::OutputStats() {
   TRACE_EVENT("timing", "FrameStats::OutputStats");
 
@@ -7,6 +7,7 @@
 
 #include <list>
 #include <map>
+#include <stddef.h>
 #include <stdint.h>
 #include <string>
 #include <time.h>
@@ -14,45 +15,94 @@
 const int kUnknownBufferId = -1;
 const int kUnknownSurfaceId = -1;
 
+// Layout of the --timing-filename log, a ring of records mapped straight
+// from the file so that nothing has to be written out to dump it:
+//
+//   TimingLogHeader
+//   TimingLogRecord[capacity]
+//
+// Record N is at N % capacity, so once the ring wraps only the last
+// capacity records are kept, the oldest of which may be mid-overwrite if
+// sommelier is still running. scripts/timing_log.py converts the file to
+// text or a trace.
+#define TIMING_LOG_MAGIC 0x474c4d54  // "TMLG"
+#define TIMING_LOG_VERSION 1
+
+struct TimingLogHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t record_size;
+  // CLOCK_REALTIME when recording started.
+  int64_t start_time_ns;
+  // Records written so far. Published after each record, so a reader never
+  // sees a partially written one below it.
+  uint64_t count;
+  uint8_t pad[32];
+};
+
+enum TimingLogType : uint8_t {
+  TIMING_LOG_UNKNOWN,
+  TIMING_LOG_ATTACH,
+  TIMING_LOG_COMMIT,
+  TIMING_LOG_RELEASE,
+};
+
+struct __attribute__((packed)) TimingLogRecord {
+  // CLOCK_REALTIME of the action.
+  int64_t time_ns;
+  int32_t surface_id;
+  int32_t buffer_id;
+  uint8_t type;
+};
+
 class Timing {
  public:
   explicit Timing(const char* fname) : filename(fname) {}
+  Timing(const Timing&) = delete;
+  Timing& operator=(const Timing&) = delete;
+  ~Timing();
+  // Creates the log file and starts recording to it.
   void RecordStartTime();
   void UpdateLastAttach(int surface_id, int buffer_id);
   void UpdateLastCommit(int surface_id);
   void UpdateLastRelease(int buffer_id);
+  // Schedules writeback of the log without waiting for it.
   void OutputLog();
 
  private:
   // 10 min * 60 sec/min * 60 frames/sec * 3 actions/frame = 108000 actions
   static const int kMaxNumActions = 10 * 60 * 60 * 3;
 
-  struct BufferAction {
-    enum Type { UNKNOWN, ATTACH, COMMIT, RELEASE };
-    int64_t delta_time;
-    int surface_id;
-    int buffer_id;
-    Type action_type;
-    BufferAction()
-        : surface_id(kUnknownSurfaceId),
-          buffer_id(kUnknownBufferId),
-          action_type(UNKNOWN) {}
-    explicit BufferAction(int64_t dt,
-                          int sid = kUnknownSurfaceId,
-                          int bid = kUnknownBufferId,
-                          Type type = UNKNOWN)
-        : delta_time(dt), surface_id(sid), buffer_id(bid), action_type(type) {}
-  };
-
-  BufferAction actions[kMaxNumActions];
-  int event_id = 0;
-  int saves = 0;
   const char* filename;
-  timespec last_event;
+  // Mapping of the whole log file, or nullptr if it couldn't be created.
+  TimingLogHeader* log = nullptr;
+  size_t log_size = 0;
 
-  int64_t GetTime();
+  void AddRecord(int surface_id, int buffer_id, TimingLogType type);
+  static int64_t GetTime();
 };  // class Timing
 
+// LatencyHistogram buckets latencies within one reporting window, finely
+// enough to estimate percentiles of anything up to kMaxLatencyMs.
+class LatencyHistogram {
+ public:
+  void Reset();
+  void Add(int64_t latency_ns);
+  // Estimated latency in ms, or 0 if nothing was added.
+  double EstimatePercentile(double percentile) const;
+
+ private:
+  static constexpr double kBucketSizeMs = 0.25;
+  static const int kMaxBuckets = 400;
+  static constexpr double kMaxLatencyMs = kBucketSizeMs * kMaxBuckets;
+
+  int count = 0;
+  // Slowest latency seen, reported for percentiles in the overflow bucket.
+  double max_ms = 0.0;
+  int buckets[kMaxBuckets] = {};
+};
+
 // SurfaceStats tracks statistics for a single surface in a number of
 // discrete contiguous windows.  Besides for some very basic accounting
 // and state to track across separate windows, state is reset between
@@ -65,6 +115,9 @@ class SurfaceStats {
   void StartNewWindow();
 
   void AddFrame(uint32_t steam_id, bool activated);
+  void AddAttach();
+  void AddCopy(int64_t duration_ns, uint64_t page_faults);
+  void AddRelease();
   int GetNumFrames() const { return num_frames; }
   std::string Summarize(int surface_id) const;
   static std::string GenerateHeader();
@@ -129,6 +182,22 @@ class SurfaceStats {
   // low fps on a typical reporting period.
   int buckets[kMaxBuckets];
 
+  // Where each frame's time goes: copying client contents in sommelier, the
+  // host holding on to the committed buffer, and the client drawing the next
+  // one after the release.
+  LatencyHistogram copy_latency;
+  LatencyHistogram commit_to_release_latency;
+  LatencyHistogram release_to_attach_latency;
+
+  // Page faults taken while copying client contents, mostly into output
+  // buffers written for the first time.
+  uint64_t copy_page_faults;
+
+  // CLOCK_MONOTONIC of the last commit and release still waiting for the
+  // release or attach that follows them, or 0.
+  int64_t pending_commit_ns = 0;
+  int64_t pending_release_ns = 0;
+
   static double GetBucketValue(int bucket_num);
   double EstimatePercentile(double percentile) const;
   int CountSlowFrames(double threshold) const;
@@ -140,6 +209,15 @@ class FrameStats {
       : filename(stats_name), log_filename(log_name) {}
 
   void AddFrame(int surface_id, uint32_t steam_id, bool activated);
+  // |buffer_id| is the client buffer the host will release directly, or
+  // kUnknownBufferId if sommelier copies from it.
+  void AddAttach(int surface_id, int buffer_id);
+  // |page_faults| is how many the copying threads took while copying.
+  void AddCopy(int surface_id, int64_t duration_ns, uint64_t page_faults);
+  // Release of a buffer sommelier committed for |surface_id|.
+  void AddRelease(int surface_id);
+  // Release of a client buffer passed straight to the host.
+  void AddBufferRelease(int buffer_id);
   void OutputStats();
 
  private:
@@ -149,6 +227,8 @@ class FrameStats {
   const char* filename;
   const char* log_filename;
   std::map<int, SurfaceStats> surface_stats;
+  // Surfaces the host-released client buffers were attached to.
+  std::map<int, int> buffer_surfaces;
 
   std::string header;
   std::list<std::string> recent_logs;
@@ -6,6 +6,7 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <atomic>
 #include <cstring>
 #include <memory>
 #include <sstream>
@@ -262,18 +263,15 @@ void perfetto_annotate_atom(struct sl_context* ctx,
   }
 
   // Failing that, check if we've fetched this atom.
-  for (unsigned i = 0; i < ARRAY_SIZE(ctx->atoms); ++i) {
-    if (atom == ctx->atoms[i].value) {
-      const char* name = sl_context_atom_name(i);
-      if (name != nullptr) {
-        dbg->set_string_value(name, strlen(name));
-        return;
-      }
-    }
+  const std::string* name = sl_lookup_cached_atom_name(ctx, atom);
+  if (name) {
+    dbg->set_string_value(*name);
+    return;
   }
 
-  // If we reach here, we didn't find the atom name.
-  // We could ask the X server but that would require a round-trip.
+  // If we reach here, we didn't find the atom name. Waiting for the X server
+  // would take a round trip, so ask for it to be there next time.
+  sl_request_atom_name(ctx, atom);
   std::string unknown("<unknown atom #");
   unknown += std::to_string(atom);
   unknown += '>';
@@ -473,6 +471,28 @@ void perfetto_annotate_time_sync(const perfetto::EventContext& perfetto) {
   dbg->set_uint_value(cpu_time);
 }
 
+void trace_time_sync(int interval_ms) {
+  // Shared by the client threads, and only the one that moves it on emits
+  // the sync, since the clocks are the same for all of them.
+  static std::atomic<uint64_t> last_time_sync_ns;
+
+  if (interval_ms < 0 || !TRACE_EVENT_CATEGORY_ENABLED("surface"))
+    return;
+
+  uint64_t now = get_timestamp_ns(CLOCK_MONOTONIC);
+  uint64_t last = last_time_sync_ns.load(std::memory_order_relaxed);
+  if (last && now < last + static_cast<uint64_t>(interval_ms) * 1000000)
+    return;
+  if (!last_time_sync_ns.compare_exchange_strong(last, now,
+                                                 std::memory_order_relaxed))
+    return;
+
+  TRACE_EVENT_INSTANT(
+      "surface", "clock_sync",
+      perfetto::Track(reinterpret_cast<uintptr_t>(&last_time_sync_ns)),
+      [](perfetto::EventContext p) { perfetto_annotate_time_sync(p); });
+}
+
 #else
 
 // Stubs.
@@ -483,4 +503,6 @@ void enable_tracing(bool create_session) {}
 
 void dump_trace(const char* trace_filename) {}
 
+void trace_time_sync(int interval_ms) {}
+
 #endif  // PERFETTO_TRACING
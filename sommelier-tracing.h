@@ -44,11 +44,23 @@ void perfetto_annotate_cardinal_list(const perfetto::EventContext& perfetto,
                                      xcb_get_property_reply_t* reply);
 void perfetto_annotate_time_sync(const perfetto::EventContext& perfetto);
 
+// Flows link the trace events of one object, e.g. a buffer from its attach
+// through the copy and host commit to its release, or a frame callback from
+// its request to done. They are only meant as TRACE_EVENT() arguments.
+#define TRACE_FLOW(object) \
+  perfetto::Flow::ProcessScoped(reinterpret_cast<uintptr_t>(object))
+#define TRACE_TERMINATING_FLOW(object) \
+  perfetto::TerminatingFlow::ProcessScoped(reinterpret_cast<uintptr_t>(object))
+
 #else
 #define TRACE_EVENT(category, name, ...)
+#define TRACE_COUNTER(category, track, ...)
 #endif
 
 void initialize_tracing(bool in_process_backend, bool system_backend);
 void enable_tracing(bool create_session);
 void dump_trace(char const* filename);
+// Emits a clock sync event on its own track, unless one went out less than
+// |interval_ms| ago or |interval_ms| is negative.
+void trace_time_sync(int interval_ms);
 #endif  // VM_TOOLS_SOMMELIER_SOMMELIER_TRACING_H_
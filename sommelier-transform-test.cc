@@ -519,5 +519,33 @@ TEST_F(TransformDirectScaleTest, Pointer_WithoutViewportOverride) {
   EXPECT_EQ(x, wl_fixed_from_double(0.9 * 16));
   EXPECT_EQ(y, wl_fixed_from_double(1.6 * 16));
 }
+
+TEST_F(TransformDirectScaleTest, HostPosition_PrefersSurfaceOutput) {
+  std::vector<OutputConfig> configs = {
+      {.x = 0, .y = 0, .width_pixels = 1920, .height_pixels = 1080},
+      {.x = 1920, .y = 0, .width_pixels = 1920, .height_pixels = 1080},
+  };
+  AdvertiseOutputs(xwayland.get(), configs);
+  sl_window* window = CreateToplevelWindow();
+  sl_host_surface* surface = window->paired_surface;
+  surface->output = ctx.host_outputs[1];
+
+  int32_t x = 2000;
+  int32_t y = 50;
+  EXPECT_EQ(
+      sl_transform_host_position_to_guest_position(&ctx, surface, &x, &y),
+      ctx.host_outputs[1]);
+  EXPECT_EQ(x, 2000);
+  EXPECT_EQ(y, 50);
+
+  // Positions off the surface's output still find the output they're on.
+  x = 100;
+  y = 50;
+  EXPECT_EQ(
+      sl_transform_host_position_to_guest_position(&ctx, surface, &x, &y),
+      ctx.host_outputs[0]);
+  EXPECT_EQ(x, 100);
+  EXPECT_EQ(y, 50);
+}
 }  // namespace sommelier
 }  // namespace vm_tools
@@ -45,12 +45,15 @@ static void sl_transform_get_scale_factors(
     const struct sl_host_surface* surface,
     double* scalex,
     double* scaley) {
+  const struct sl_host_output* output =
+      surface ? surface->output.get() : nullptr;
+
   if (ctx->use_direct_scale && surface && surface->has_own_scale) {
     *scalex = surface->xdg_scale_x;
     *scaley = surface->xdg_scale_y;
-  } else if (surface && surface->output) {
-    *scalex = surface->output.get()->xdg_scale_x;
-    *scaley = surface->output.get()->xdg_scale_y;
+  } else if (output) {
+    *scalex = output->xdg_scale_x;
+    *scaley = output->xdg_scale_y;
   } else {
     *scalex = ctx->xdg_scale_x;
     *scaley = ctx->xdg_scale_y;
@@ -260,6 +263,16 @@ void sl_transform_damage_coord(struct sl_context* ctx,
     *x2 = ceil(MIN((*x2) + 1, MAX_SIZE) / sx);
     *y2 = ceil(MIN((*y2) + 1, MAX_SIZE) / sy);
   }
+
+  // The viewport scales the contents of windows rendered at a fraction of
+  // their size up, and their damage with them.
+  if (surface && surface->window && surface->window->render_scale < 1.0) {
+    double render_scale = surface->window->render_scale;
+    *x1 = floor(*x1 / render_scale);
+    *y1 = floor(*y1 / render_scale);
+    *x2 = ceil(*x2 / render_scale);
+    *y2 = ceil(*y2 / render_scale);
+  }
 }
 
 void sl_transform_host_to_guest(struct sl_context* ctx,
@@ -391,9 +404,25 @@ struct sl_host_output* sl_transform_guest_position_to_host_position(
   return output;
 }
 
+// The output |surface| is on, if it contains the host position |x|,|y|.
+// Positions of a window mostly fall on its own output, which saves
+// searching all of them.
+static struct sl_host_output* sl_transform_surface_output_at(
+    struct sl_host_surface* surface, int32_t x, int32_t y) {
+  struct sl_host_output* output = surface ? surface->output.get() : nullptr;
+
+  if (output && x >= output->x && x < output->x + output->width &&
+      y >= output->y && y < output->y + output->height) {
+    return output;
+  }
+  return nullptr;
+}
+
 struct sl_host_output* sl_transform_host_position_to_guest_position(
     sl_context* ctx, sl_host_surface* surface, int32_t* x, int32_t* y) {
-  sl_host_output* output = sl_infer_output_for_host_position(ctx, *x, *y);
+  sl_host_output* output = sl_transform_surface_output_at(surface, *x, *y);
+  if (!output)
+    output = sl_infer_output_for_host_position(ctx, *x, *y);
   assert(output);
 
   // Translate from global to output-local host coordinates
@@ -6,6 +6,7 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <time.h>
 
 // Performs an asprintf operation and checks the result for validity and calls
 // abort() if there's a failure. Returns a newly allocated string rather than
@@ -22,6 +23,12 @@ __attribute__((__format__(__printf__, 1, 0))) char* sl_xasprintf(
   return str;
 }
 
+int64_t sl_monotonic_time_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
 #define DEFAULT_DELETER(TypeName, DeleteFunction)            \
   namespace std {                                            \
   void default_delete<TypeName>::operator()(TypeName* ptr) { \
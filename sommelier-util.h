@@ -7,6 +7,7 @@
 
 #include <assert.h>
 #include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <memory>
@@ -31,6 +32,9 @@
 __attribute__((__format__(__printf__, 1, 0))) char* sl_xasprintf(
     const char* fmt, ...);
 
+// Returns the CLOCK_MONOTONIC time in nanoseconds.
+int64_t sl_monotonic_time_ns();
+
 #define DEFAULT_DELETER_FDECL(TypeName) \
   namespace std {                       \
   template <>                           \
@@ -21,8 +21,16 @@ struct sl_host_viewporter {
 struct sl_host_viewport {
   struct wl_resource* resource;
   struct sl_viewport viewport;
+  WeakResourcePtr<sl_host_surface> surface;
 };
 
+// Viewport state is taken in by the surface's next commit, so one held
+// for it goes out first.
+static void sl_viewport_apply_held_commit(struct sl_host_viewport* host) {
+  if (host->surface)
+    sl_host_surface_apply_held_commit(host->surface.get());
+}
+
 static void sl_viewport_destroy(struct wl_client* client,
                                 struct wl_resource* resource) {
   wl_resource_destroy(resource);
@@ -37,6 +45,12 @@ static void sl_viewport_set_source(struct wl_client* client,
   struct sl_host_viewport* host =
       static_cast<sl_host_viewport*>(wl_resource_get_user_data(resource));
 
+  if (host->surface &&
+      sl_host_surface_hold_request<sl_viewport_set_source>(
+          host->surface.get(), client, resource, x, y, width, height)) {
+    return;
+  }
+  sl_viewport_apply_held_commit(host);
   host->viewport.src_x = x;
   host->viewport.src_y = y;
   host->viewport.src_width = width;
@@ -55,6 +69,12 @@ static void sl_viewport_set_destination(struct wl_client* client,
   struct sl_host_viewport* host =
       static_cast<sl_host_viewport*>(wl_resource_get_user_data(resource));
 
+  if (host->surface &&
+      sl_host_surface_hold_request<sl_viewport_set_destination>(
+          host->surface.get(), client, resource, width, height)) {
+    return;
+  }
+  sl_viewport_apply_held_commit(host);
   host->viewport.dst_width = width;
   host->viewport.dst_height = height;
   LOG(VERBOSE) << "viewport dst set " << width << "x" << height;
@@ -67,6 +87,10 @@ static void sl_destroy_host_viewport(struct wl_resource* resource) {
   struct sl_host_viewport* host =
       static_cast<sl_host_viewport*>(wl_resource_get_user_data(resource));
 
+  // Commits held back were made with the viewport.
+  if (host->surface)
+    sl_host_surface_flush_held_requests(host->surface.get());
+  sl_viewport_apply_held_commit(host);
   wl_resource_set_user_data(resource, nullptr);
   wl_list_remove(&host->viewport.link);
   delete host;
@@ -91,6 +115,7 @@ static void sl_viewporter_get_viewport(struct wl_client* client,
   host_viewport->viewport.src_height = -1;
   host_viewport->viewport.dst_width = -1;
   host_viewport->viewport.dst_height = -1;
+  host_viewport->surface = host_surface;
   wl_list_insert(&host_surface->contents_viewport,
                  &host_viewport->viewport.link);
   host_viewport->resource =
@@ -5,6 +5,12 @@
 #include <cstddef>
 #include <cstdint>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -15,6 +21,7 @@
 #include "sommelier.h"                       // NOLINT(build/include_directory)
 #include "sommelier-ctx.h"                   // NOLINT(build/include_directory)
 #include "sommelier-logging.h"               // NOLINT(build/include_directory)
+#include "testing/sommelier-perf-counters.h"  // NOLINT(build/include_directory)
 #include "virtualization/wayland_channel.h"  // NOLINT(build/include_directory)
 
 class FuzzChannel : public WaylandChannel {
@@ -72,12 +79,42 @@ class FuzzChannel : public WaylandChannel {
     return 0;
   }
 
+  int32_t flush() override { return 0; }
+
+  int32_t release_receive(struct WaylandSendReceive& receive) override {
+    free(receive.data);
+    return 0;
+  }
+
+  bool has_pending_event() override { return false; }
+  size_t max_receive_batch() override { return 1; }
+
   int32_t allocate(const struct WaylandBufferCreateInfo& create_info,
                    struct WaylandBufferCreateOutput& create_output) override {
     return -1;
   }
 
+  void free_buffer(
+      const struct WaylandBufferCreateInfo& create_info,
+      const struct WaylandBufferCreateOutput& create_output) override {
+    if (create_output.fd >= 0)
+      close(create_output.fd);
+  }
+
+  int32_t prefetch_allocation(const struct WaylandBufferCreateInfo& create_info,
+                              int& out_fence_fd) override {
+    out_fence_fd = -1;
+    return 0;
+  }
+  int32_t handle_fence(int fence_fd, int& out_fence_fd) override {
+    out_fence_fd = -1;
+    return -EINVAL;
+  }
+
   int32_t sync(int dmabuf_fd, uint64_t flags) override { return 0; }
+  int32_t import_shm(int shm_fd, size_t size, int& out_dmabuf_fd) override {
+    return -EOPNOTSUPP;
+  }
   int32_t handle_pipe(int read_fd, bool readable, bool& hang_up) override {
     return 0;
   }
@@ -151,6 +188,78 @@ int count_fds() {
   return count;
 }
 
+// Performance mode, enabled by setting SOMMELIER_FUZZER_PERF, gives each input
+// a budget of CPU time and allocations that grows with its size, to find the
+// inputs that take sommelier down superlinear paths, like huge damage rect
+// counts, deep subsurface trees or large region unions.
+//
+// Inputs over budget are saved to the directory SOMMELIER_FUZZER_SLOW_CORPUS
+// names. Without one they abort like a crash, so libFuzzer keeps them.
+struct PerfBudget {
+  bool enabled = false;
+  // Allowance for setting up the context, which every input pays.
+  int64_t base_cpu_ns = 20000000;
+  uint64_t base_allocations = 20000;
+  // SOMMELIER_FUZZER_CPU_US_PER_BYTE and SOMMELIER_FUZZER_ALLOCS_PER_BYTE.
+  int64_t cpu_ns_per_byte = 20000;
+  uint64_t allocations_per_byte = 64;
+  const char* slow_corpus = nullptr;
+};
+
+const PerfBudget& GetPerfBudget() {
+  static const PerfBudget budget = [] {
+    PerfBudget result;
+    result.enabled = getenv("SOMMELIER_FUZZER_PERF") != nullptr;
+    if (const char* value = getenv("SOMMELIER_FUZZER_CPU_US_PER_BYTE"))
+      result.cpu_ns_per_byte = strtoll(value, nullptr, 10) * 1000;
+    if (const char* value = getenv("SOMMELIER_FUZZER_ALLOCS_PER_BYTE"))
+      result.allocations_per_byte = strtoull(value, nullptr, 10);
+    result.slow_corpus = getenv("SOMMELIER_FUZZER_SLOW_CORPUS");
+    return result;
+  }();
+  return budget;
+}
+
+// Writes |data| to |dir|, named after its FNV-1a hash so that an input
+// found again replaces itself.
+void SaveSlowInput(const char* dir, const uint8_t* data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; ++i)
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/slow-%016" PRIx64, dir, hash);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0 || write(fd, data, size) != static_cast<ssize_t>(size)) {
+    LOG(ERROR) << "failed to save slow input to " << path << ": "
+               << strerror(errno);
+    abort();
+  }
+  close(fd);
+  LOG(ERROR) << "saved slow input to " << path;
+}
+
+void CheckPerfBudget(const PerfBudget& budget,
+                     const uint8_t* data,
+                     size_t size,
+                     int64_t cpu_ns,
+                     uint64_t allocations) {
+  int64_t cpu_budget_ns =
+      budget.base_cpu_ns + static_cast<int64_t>(size) * budget.cpu_ns_per_byte;
+  uint64_t allocation_budget =
+      budget.base_allocations + size * budget.allocations_per_byte;
+  if (cpu_ns <= cpu_budget_ns && allocations <= allocation_budget)
+    return;
+
+  LOG(ERROR) << "slow input: " << size << " bytes took " << cpu_ns / 1000
+             << " us of CPU time (budget " << cpu_budget_ns / 1000
+             << ") and " << allocations << " allocations (budget "
+             << allocation_budget << ")";
+  if (!budget.slow_corpus)
+    abort();
+  SaveSlowInput(budget.slow_corpus, data, size);
+}
+
 int LLVMFuzzerTestOneInput_real(const uint8_t* data, size_t size) {
   int ret;
   static Environment env;
@@ -244,10 +353,19 @@ int LLVMFuzzerTestOneInput_real(const uint8_t* data, size_t size) {
 }
 
 extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  const PerfBudget& budget = GetPerfBudget();
   int start_fds = count_fds();
+  int64_t start_cpu_ns = vm_tools::sommelier::PerfCpuTimeNs();
+  uint64_t start_allocations = vm_tools::sommelier::PerfAllocationCount();
 
   int ret = LLVMFuzzerTestOneInput_real(data, size);
 
+  if (budget.enabled) {
+    CheckPerfBudget(
+        budget, data, size, vm_tools::sommelier::PerfCpuTimeNs() - start_cpu_ns,
+        vm_tools::sommelier::PerfAllocationCount() - start_allocations);
+  }
+
   int end_fds = count_fds();
   if (start_fds != end_fds) {
     LOG(ERROR) << "leaked " << end_fds - start_fds << " file descriptors!";
@@ -7,6 +7,7 @@
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <unistd.h>
 #include <wayland-client-protocol.h>
 #include <wayland-client.h>
 #include <wayland-server-core.h>
@@ -26,6 +27,7 @@ namespace sommelier {
 using ::testing::_;
 using ::testing::AllOf;
 using ::testing::PrintToString;
+using ::testing::Return;
 
 using X11Test = X11TestBase;
 
@@ -464,6 +466,93 @@ TEST_F(X11Test, UpdatesApplicationIdFromXid) {
   Pump();
 }
 
+TEST_F(X11Test, LooksUpWindowsByIdAndFrameId) {
+  sl_window* window = CreateToplevelWindow();
+  xcb_window_t id = window->id;
+  xcb_window_t frame_id = window->frame_id;
+
+  EXPECT_EQ(sl_lookup_window(&ctx, id), window);
+  EXPECT_EQ(sl_lookup_window(&ctx, frame_id), window);
+
+  sl_window_set_frame_id(window, XCB_WINDOW_NONE);
+  EXPECT_EQ(sl_lookup_window(&ctx, frame_id), nullptr);
+
+  xcb_destroy_notify_event_t event;
+  event.window = id;
+  sl_handle_destroy_notify(&ctx, &event);
+  EXPECT_EQ(sl_lookup_window(&ctx, id), nullptr);
+}
+
+TEST_F(X11Test, LooksUpPairedWindowsBySurface) {
+  sl_window* window = CreateToplevelWindow();
+  wl_resource* surface = window->paired_surface->resource;
+
+  EXPECT_EQ(sl_context_lookup_window_for_surface(&ctx, surface), window);
+
+  window->host_surface_id = 0;
+  sl_window_update(window);
+  EXPECT_EQ(sl_context_lookup_window_for_surface(&ctx, surface), nullptr);
+}
+
+TEST_F(X11Test, WindowUpdatesDontWaitForGeometry) {
+  // Pairing the window with its surface doesn't wait for the geometry
+  // requested when the window was created.
+  EXPECT_CALL(xcb, get_geometry_reply(_, _, _)).Times(0);
+  sl_window* window = CreateToplevelWindow();
+  EXPECT_TRUE(window->geometry_pending);
+  testing::Mock::VerifyAndClearExpectations(&xcb);
+
+  // X event handling collects it.
+  xcb_get_geometry_reply_t* reply = static_cast<xcb_get_geometry_reply_t*>(
+      calloc(1, sizeof(xcb_get_geometry_reply_t)));
+  reply->depth = 32;
+  EXPECT_CALL(xcb, get_geometry_reply(_, _, _)).WillOnce(Return(reply));
+  sl_window_resolve_geometry(window);
+  EXPECT_FALSE(window->geometry_pending);
+  EXPECT_EQ(window->depth, 32);
+}
+
+TEST_F(X11Test, WindowUpdatesResendOnlyDirtyState) {
+  // Arrange: A fullscreen window with a title and a minimum size.
+  sl_window* window = CreateToplevelWindow();
+  uint32_t xdg_toplevel_id = XdgToplevelId(window);
+  window->name = strdup("title");
+  window->fullscreen = 1;
+  window->size_flags |= P_MIN_SIZE;
+  window->min_width = 100;
+  window->min_height = 100;
+  Pump();
+
+  // Act: Only the window's position relative to its parent changes.
+  window->dirty |= SL_WINDOW_DIRTY_PARENT;
+  sl_window_update(window);
+
+  // Assert: Nothing else is sent again.
+  EXPECT_CALL(mock_wayland_channel_,
+              send(AtLeastOneMessage(xdg_toplevel_id, XDG_TOPLEVEL_SET_TITLE)))
+      .Times(0);
+  EXPECT_CALL(
+      mock_wayland_channel_,
+      send(AtLeastOneMessage(xdg_toplevel_id, XDG_TOPLEVEL_SET_FULLSCREEN)))
+      .Times(0);
+  EXPECT_CALL(
+      mock_wayland_channel_,
+      send(AtLeastOneMessage(xdg_toplevel_id, XDG_TOPLEVEL_SET_MIN_SIZE)))
+      .Times(0);
+  Pump();
+
+  // Act: The size hints have to be sent again, e.g. for a new scale.
+  window->dirty |= SL_WINDOW_DIRTY_SIZE_HINTS;
+  sl_window_update(window);
+
+  // Assert: Only those are.
+  EXPECT_CALL(
+      mock_wayland_channel_,
+      send(AtLeastOneMessage(xdg_toplevel_id, XDG_TOPLEVEL_SET_MIN_SIZE)))
+      .RetiresOnSaturation();
+  Pump();
+}
+
 TEST_F(X11Test, NonExistentWindowDoesNotCrash) {
   // This test is testing cases where sl_lookup_window returns nullptr
 
@@ -669,6 +758,84 @@ TEST_F(X11Test, IconifySuppressesUnmaximize) {
       .Times(1);
   Pump();
 }
+
+TEST_F(X11Test, WindowsOfAProcessShareItsClassification) {
+  // Arrange
+  sl_window* first = CreateToplevelWindow();
+  sl_window* second = CreateToplevelWindow();
+  ctx.quirks.Load(
+      "sommelier { \n"
+      "  condition { always: true }\n"
+      "  enable: FEATURE_CONTAINERIZE_WINDOWS\n"
+      "}");
+  first->pid = getpid();
+  second->pid = getpid();
+
+  // Act: Both windows are classified, reading /proc once.
+  sl_window_update_should_be_containerized_from_pid(first);
+  sl_window_update_should_be_containerized_from_pid(second);
+
+  // Assert
+  ASSERT_EQ(ctx.process_classes.size(), 1u);
+  EXPECT_EQ(ctx.process_classes.begin()->first.first,
+            static_cast<uint32_t>(getpid()));
+  EXPECT_EQ(ctx.process_classes.begin()->second.windows, 2);
+  EXPECT_NE(first->classified_start_time, 0u);
+  EXPECT_EQ(second->classified_start_time, first->classified_start_time);
+  EXPECT_TRUE(second->should_be_containerized_from_pid);
+
+  // Act: The entry goes with the last window.
+  sl_window_forget_process_class(first);
+  EXPECT_EQ(ctx.process_classes.begin()->second.windows, 1);
+  sl_window_forget_process_class(second);
+
+  // Assert
+  EXPECT_TRUE(ctx.process_classes.empty());
+}
+
+TEST_F(X11Test, RenderScaleQuirkShrinksFullscreenWindows) {
+  // Arrange: A fullscreen window of a game that renders at half size.
+  AdvertiseOutputs(xwayland.get(), {OutputConfig()});
+  sl_window* window = CreateToplevelWindow();
+  window->managed = 1;
+  window->size_flags = 0;
+  window->fullscreen = 1;
+  window->steam_game_id = 123;
+  ctx.quirks.Load(
+      "sommelier { \n"
+      "  condition { steam_game_id: 123 }\n"
+      "  render_scale_percent: 50\n"
+      "}");
+  wl_array states;
+  wl_array_init(&states);
+
+  // Act: The host gives it the whole output.
+  HostEventHandler(window->xdg_toplevel)
+      ->configure(nullptr, window->xdg_toplevel, 1920, 1080, &states);
+  HostEventHandler(window->xdg_surface)
+      ->configure(nullptr, window->xdg_surface, 123);
+
+  // Assert: The window is half the size, and the viewport fills the output.
+  EXPECT_EQ(window->width, 960);
+  EXPECT_EQ(window->height, 540);
+  EXPECT_TRUE(window->viewport_override);
+  EXPECT_EQ(window->viewport_width, 1920);
+  EXPECT_EQ(window->viewport_height, 1080);
+  EXPECT_DOUBLE_EQ(window->viewport_pointer_scale, 0.5);
+
+  // Act: The window leaves fullscreen.
+  window->fullscreen = 0;
+  HostEventHandler(window->xdg_toplevel)
+      ->configure(nullptr, window->xdg_toplevel, 1024, 768, &states);
+  HostEventHandler(window->xdg_surface)
+      ->configure(nullptr, window->xdg_surface, 124);
+
+  // Assert: It's rendered at full size again.
+  EXPECT_EQ(window->width, 1024);
+  EXPECT_EQ(window->height, 768);
+  EXPECT_FALSE(window->viewport_override);
+  EXPECT_DOUBLE_EQ(window->render_scale, 1.0);
+}
 #endif  // QUIRKS_SUPPORT
 
 // Matcher for the value_list argument of an X11 ConfigureWindow request,
@@ -1167,5 +1334,128 @@ TEST_F(X11Test, X11NextConfigFullscreenStateConsumedCorrectly) {
   Pump();
 }
 
+TEST_F(X11Test, UnchangedNetWmStateIsNotRewritten) {
+  sl_window* window = CreateToplevelWindow();
+  window->managed = 1;  // pretend window is mapped
+
+  // Assert: Configures leaving the state as it was don't write it again.
+  EXPECT_CALL(xcb, change_property(testing::_, XCB_PROP_MODE_REPLACE,
+                                   window->id,
+                                   ctx.atoms[ATOM_NET_WM_STATE].value,
+                                   testing::_, testing::_, testing::_,
+                                   testing::_))
+      .Times(1);
+
+  // Act: The host configures the window fullscreen twice.
+  for (uint32_t serial = 100; serial < 102; ++serial) {
+    window->next_config.serial = serial;
+    window->next_config.states_length = 1;
+    window->next_config.states[0] =
+        ctx.atoms[ATOM_NET_WM_STATE_FULLSCREEN].value;
+    sl_configure_window(window);
+    window->pending_config.serial = 0;
+  }
+}
+
+TEST_F(X11Test, DamageIsForwardedWithTheCommit) {
+  sl_window* window = CreateWindowWithoutRole();
+  sl_window_set_frame_id(window, xcb.generate_id(ctx.connection));
+  struct wl_surface* surface = xwayland->CreateSurface();
+  window->host_surface_id = SurfaceId(surface);
+  sl_window_update(window);
+  Pump();
+  struct sl_host_surface* host_surface = window->paired_surface;
+  ASSERT_NE(host_surface, nullptr);
+  uint32_t proxy_id =
+      wl_proxy_get_id(reinterpret_cast<wl_proxy*>(host_surface->proxy));
+
+  // Act: The client damages many small, scattered rectangles.
+  for (int i = 0; i < 40; ++i)
+    wl_surface_damage(surface, i * 20, i * 20, 2, 2);
+  xwayland->Flush();
+
+  // Assert: None of it goes to the host yet.
+  EXPECT_CALL(mock_wayland_channel_,
+              send(AtLeastOneMessage(proxy_id, WL_SURFACE_DAMAGE)))
+      .Times(0);
+  Pump();
+  EXPECT_EQ(pixman_region32_n_rects(&host_surface->pending_damage), 40);
+  testing::Mock::VerifyAndClearExpectations(&mock_wayland_channel_);
+
+  // Act: The client commits.
+  wl_surface_commit(surface);
+  xwayland->Flush();
+
+  // Assert: The damage goes out with it.
+  EXPECT_CALL(mock_wayland_channel_,
+              send(AtLeastOneMessage(proxy_id, WL_SURFACE_DAMAGE)))
+      .Times(1);
+  Pump();
+  EXPECT_FALSE(pixman_region32_not_empty(&host_surface->pending_damage));
+}
+
+TEST_F(X11Test, CommitsKeepTheirDamageInTheHistory) {
+  sl_window* window = CreateWindowWithoutRole();
+  sl_window_set_frame_id(window, xcb.generate_id(ctx.connection));
+  struct wl_surface* surface = xwayland->CreateSurface();
+  window->host_surface_id = SurfaceId(surface);
+  sl_window_update(window);
+  Pump();
+  struct sl_host_surface* host_surface = window->paired_surface;
+  ASSERT_NE(host_surface, nullptr);
+
+  // Act: The client damages a rectangle in each of more commits than the
+  // history holds.
+  for (int i = 0; i < SL_DAMAGE_HISTORY_SIZE + 2; ++i) {
+    wl_surface_damage(surface, i * 10, 0, 5, 5);
+    wl_surface_damage_buffer(surface, 0, i * 10, 5, 5);
+    wl_surface_commit(surface);
+  }
+  xwayland->Flush();
+  Pump();
+
+  // Assert: The latest commits' damage is kept apart, one commit each, and
+  // nothing is left over for the next one.
+  ASSERT_EQ(host_surface->damage_seq, SL_DAMAGE_HISTORY_SIZE + 2u);
+  for (int i = 2; i < SL_DAMAGE_HISTORY_SIZE + 2; ++i) {
+    struct sl_damage* damage =
+        &host_surface->damage_history[(i + 1) % SL_DAMAGE_HISTORY_SIZE];
+    EXPECT_EQ(pixman_region32_extents(&damage->surface)->x1, i * 10);
+    EXPECT_EQ(pixman_region32_extents(&damage->buffer)->y1, i * 10);
+  }
+  EXPECT_FALSE(pixman_region32_not_empty(&host_surface->client_damage.surface));
+  EXPECT_FALSE(pixman_region32_not_empty(&host_surface->client_damage.buffer));
+}
+
+TEST_F(X11Test, MinimizedWindowFrameCallbacksAreHeldBack) {
+  ctx.hidden_frame_interval_ms = 1000;
+  sl_window* window = CreateWindowWithoutRole();
+  sl_window_set_frame_id(window, xcb.generate_id(ctx.connection));
+  struct wl_surface* surface = xwayland->CreateSurface();
+  window->host_surface_id = SurfaceId(surface);
+  sl_window_update(window);
+  Pump();
+  struct sl_host_surface* host_surface = window->paired_surface;
+  ASSERT_NE(host_surface, nullptr);
+  int pending_host_callbacks = ctx.pending_host_callbacks;
+
+  // Act: The host minimizes the window, and the client asks for a frame.
+  window->host_minimized = true;
+  wl_surface_frame(surface);
+  xwayland->Flush();
+  Pump();
+
+  // Assert: The callback wasn't forwarded to the host.
+  EXPECT_EQ(ctx.pending_host_callbacks, pending_host_callbacks);
+  EXPECT_FALSE(wl_list_empty(&host_surface->deferred_callbacks));
+
+  // Act: The window is shown again.
+  window->host_minimized = false;
+  sl_host_surface_release_hidden(host_surface);
+
+  // Assert: The held back callback has fired.
+  EXPECT_TRUE(wl_list_empty(&host_surface->deferred_callbacks));
+}
+
 }  // namespace sommelier
 }  // namespace vm_tools
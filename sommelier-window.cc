@@ -7,6 +7,8 @@
 #include <algorithm>
 #include <climits>
 #include <fstream>
+#include <sstream>
+#include <unordered_map>
 #include <assert.h>
 #include <cstdint>
 #include <wayland-client-protocol.h>
@@ -48,22 +50,49 @@ sl_window::sl_window(struct sl_context* ctx,
       height(height),
       border_width(border_width) {
   wl_list_insert(&ctx->unpaired_windows, &link);
+  ctx->windows_by_xid[id] = this;
   pixman_region32_init(&shape_rectangles);
 }
 
+// Removes |key| from |index| if it maps to |window|.
+template <typename Key>
+static void sl_window_unindex(std::unordered_map<Key, sl_window*>& index,
+                              Key key,
+                              sl_window* window) {
+  auto it = index.find(key);
+  if (it != index.end() && it->second == window)
+    index.erase(it);
+}
+
 sl_window::~sl_window() {
   if (this == ctx->host_focus_window) {
     ctx->host_focus_window = nullptr;
     ctx->needs_set_input_focus = 1;
   }
 
+  sl_window_forget_process_class(this);
   free(name);
   free(clazz);
   free(startup_id);
   wl_list_remove(&link);
+  sl_window_unindex(ctx->windows_by_xid, id, this);
+  if (frame_id != XCB_WINDOW_NONE)
+    sl_window_unindex(ctx->windows_by_xid, frame_id, this);
+  if (!unpaired)
+    sl_window_unindex(ctx->windows_by_surface_id, indexed_surface_id, this);
   pixman_region32_fini(&shape_rectangles);
 }
 
+void sl_window_set_frame_id(struct sl_window* window, xcb_window_t frame_id) {
+  struct sl_context* ctx = window->ctx;
+
+  if (window->frame_id != XCB_WINDOW_NONE)
+    sl_window_unindex(ctx->windows_by_xid, window->frame_id, window);
+  window->frame_id = frame_id;
+  if (frame_id != XCB_WINDOW_NONE)
+    ctx->windows_by_xid[frame_id] = window;
+}
+
 void sl_configure_window(struct sl_window* window) {
   TRACE_EVENT("surface", "sl_configure_window", "id", window->id);
   assert(!window->pending_config.serial);
@@ -115,11 +144,22 @@ void sl_configure_window(struct sl_window* window) {
     }
   }
 
-  if (window->managed) {
+  if (window->managed &&
+      (!window->net_wm_state_written ||
+       !std::equal(window->next_config.states,
+                   window->next_config.states +
+                       window->next_config.states_length,
+                   window->net_wm_states,
+                   window->net_wm_states + window->net_wm_states_length))) {
     xcb()->change_property(
         window->ctx->connection, XCB_PROP_MODE_REPLACE, window->id,
         window->ctx->atoms[ATOM_NET_WM_STATE].value, XCB_ATOM_ATOM, 32,
         window->next_config.states_length, window->next_config.states);
+    std::copy(window->next_config.states,
+              window->next_config.states + window->next_config.states_length,
+              window->net_wm_states);
+    window->net_wm_states_length = window->next_config.states_length;
+    window->net_wm_state_written = true;
   }
 
   window->pending_config = window->next_config;
@@ -192,6 +232,8 @@ int sl_process_pending_configure_acks(struct sl_window* window,
   }
 
   if (window->xdg_surface) {
+    if (host_surface)
+      sl_host_surface_finish_deferred_commit(host_surface);
     xdg_surface_ack_configure(window->xdg_surface,
                               window->pending_config.serial);
   }
@@ -206,7 +248,7 @@ int sl_process_pending_configure_acks(struct sl_window* window,
 void sl_commit(struct sl_window* window, struct sl_host_surface* host_surface) {
   if (sl_process_pending_configure_acks(window, host_surface)) {
     if (host_surface)
-      wl_surface_commit(host_surface->proxy);
+      sl_host_surface_commit_proxy(host_surface);
   }
 }
 
@@ -220,6 +262,10 @@ static void sl_internal_xdg_surface_configure(void* data,
   struct sl_window* window =
       static_cast<sl_window*>(xdg_surface_get_user_data(xdg_surface));
 
+  // Only the newest configure is handed on once the client has caught up
+  // with the pending one.
+  if (window->pending_config.serial && window->next_config.serial)
+    window->ctx->metrics.configures_superseded++;
   window->next_config.serial = serial;
 
   if (window->configure_event_barrier) {
@@ -263,6 +309,41 @@ static void sl_internal_xdg_surface_configure_barrier_done(
 
 static const int32_t kUnspecifiedCoord = INT32_MIN;
 
+void sl_window_forget_process_class(struct sl_window* window) {
+  if (!window->classified_pid)
+    return;
+
+  auto it = window->ctx->process_classes.find(
+      {window->classified_pid, window->classified_start_time});
+  if (it != window->ctx->process_classes.end() && !--it->second.windows)
+    window->ctx->process_classes.erase(it);
+  window->classified_pid = 0;
+  window->classified_start_time = 0;
+}
+
+// Reads when process |pid| started, in clock ticks after boot, which with
+// the PID identifies the process. Returns false if it's gone.
+static bool sl_process_start_time(uint32_t pid, uint64_t* start_time) {
+  char stat_file_path[50];
+  snprintf(stat_file_path, sizeof(stat_file_path), "/proc/%d/stat", pid);
+  std::ifstream proc_stat_file(stat_file_path);
+  std::string stat;
+  if (!proc_stat_file.is_open() || !getline(proc_stat_file, stat))
+    return false;
+
+  // The command name in parentheses may hold spaces and parentheses itself,
+  // so fields are counted after the last ')'. The start time is the 22nd,
+  // the 20th after it.
+  size_t pos = stat.rfind(')');
+  if (pos == std::string::npos)
+    return false;
+  std::istringstream fields(stat.substr(pos + 1));
+  std::string field;
+  for (int i = 0; i < 19; i++)
+    fields >> field;
+  return static_cast<bool>(fields >> *start_time);
+}
+
 void sl_window_update_should_be_containerized_from_pid(
     struct sl_window* window) {
   bool quirk_enabled = false;
@@ -273,27 +354,42 @@ void sl_window_update_should_be_containerized_from_pid(
   if (!quirk_enabled || !window->pid) {
     return;
   }
+  if (window->classified_pid == window->pid)
+    return;
+  sl_window_forget_process_class(window);
 
-  // If the binary name contains certain keywords, it is probably not actually a
-  // game.
-  char comm_file_path[50];
-  snprintf(comm_file_path, sizeof(comm_file_path), "/proc/%d/comm",
-           window->pid);
-  std::ifstream proc_comm_file(comm_file_path);
-  if (proc_comm_file.is_open()) {
+  uint64_t start_time;
+  if (!sl_process_start_time(window->pid, &start_time))
+    return;
+  auto it = window->ctx->process_classes.find({window->pid, start_time});
+  if (it == window->ctx->process_classes.end()) {
+    // If the binary name contains certain keywords, it is probably not
+    // actually a game.
+    char comm_file_path[50];
+    snprintf(comm_file_path, sizeof(comm_file_path), "/proc/%d/comm",
+             window->pid);
+    std::ifstream proc_comm_file(comm_file_path);
     std::string process_name;
-    if (getline(proc_comm_file, process_name)) {
-      std::transform(process_name.begin(), process_name.end(),
-                     process_name.begin(), tolower);
-      window->should_be_containerized_from_pid =
-          (process_name.find("launcher") == std::string::npos &&
-           process_name.find("easyanticheat") == std::string::npos &&
-           process_name.find("battleeye") == std::string::npos &&
-           process_name.find("nprotect") == std::string::npos);
-    }
-    proc_comm_file.close();
+    if (!proc_comm_file.is_open() || !getline(proc_comm_file, process_name))
+      return;
+    std::transform(process_name.begin(), process_name.end(),
+                   process_name.begin(), tolower);
+    bool containerize =
+        (process_name.find("launcher") == std::string::npos &&
+         process_name.find("easyanticheat") == std::string::npos &&
+         process_name.find("battleeye") == std::string::npos &&
+         process_name.find("nprotect") == std::string::npos);
+    it = window->ctx->process_classes
+             .emplace(std::make_pair(window->pid, start_time),
+                      sl_process_class{containerize, 0})
+             .first;
   }
 
+  it->second.windows++;
+  window->classified_pid = window->pid;
+  window->classified_start_time = start_time;
+  window->should_be_containerized_from_pid = it->second.containerize;
+
   // TODO(endlesspring): Consider other aspects of the process - memory
   // usage, library usage, etc to determine.
 }
@@ -330,9 +426,25 @@ void sl_window_reset_viewport(struct sl_window* window) {
   window->viewport_width = -1;
   window->viewport_height = -1;
   window->viewport_override = false;
+  window->render_scale = 1.0;
   // Note that viewport destination is reset during surface_commit.
 }
 
+// The fraction of the host's size |window| should be rendered at, from the
+// render_scale_percent quirk of its game. Only fullscreen windows are
+// scaled, as the host decides their size rather than the client.
+static double sl_window_render_scale(struct sl_window* window) {
+#ifdef QUIRKS_SUPPORT
+  uint32_t percent =
+      window->ctx->quirks.RenderScalePercent(window->steam_game_id);
+  if (window->fullscreen && !window->use_emulated_rects && percent > 0 &&
+      percent < 100) {
+    return percent / 100.0;
+  }
+#endif
+  return 1.0;
+}
+
 // Handle a configure event on a toplevel object from the compositor.
 //
 // window: The window being configured.
@@ -356,6 +468,19 @@ void sl_internal_toplevel_configure(struct sl_window* window,
     return;
   }
 
+  // Minimized is one of aura shell's states supplemental to xdg's.
+  bool minimized = false;
+  uint32_t* state;
+  sl_array_for_each(state, states) {
+    if (*state == ZAURA_TOPLEVEL_STATE_MINIMIZED)
+      minimized = true;
+  }
+  if (minimized != window->host_minimized) {
+    window->host_minimized = minimized;
+    if (window->paired_surface)
+      sl_host_surface_release_hidden(window->paired_surface);
+  }
+
   bool window_containerized = sl_window_is_containerized(window);
 
   if (window_containerized) {
@@ -607,6 +732,32 @@ void sl_internal_toplevel_configure_size(struct sl_window* window,
                                          int32_t width_in_pixels,
                                          int32_t height_in_pixels,
                                          int& mut_config_idx) {
+  // Render at a fraction of the host's size, and have the viewport scale the
+  // contents up to fill it. Pointer events are scaled down to match.
+  double render_scale = sl_window_render_scale(window);
+  if (render_scale < 1.0) {
+    window->render_scale = render_scale;
+    window->viewport_override = true;
+    window->viewport_width = host_width;
+    window->viewport_height = host_height;
+    window->viewport_pointer_scale = render_scale;
+    int32_t width = std::max(
+        static_cast<int32_t>(width_in_pixels * render_scale), 1);
+    int32_t height = std::max(
+        static_cast<int32_t>(height_in_pixels * render_scale), 1);
+    LOG(VERBOSE) << window << " render scale " << render_scale
+                 << ", size set to " << width << "x" << height;
+    window->next_config.mask |= XCB_CONFIG_WINDOW_WIDTH |
+                                XCB_CONFIG_WINDOW_HEIGHT |
+                                XCB_CONFIG_WINDOW_BORDER_WIDTH;
+    window->next_config.values[mut_config_idx++] = width;
+    window->next_config.values[mut_config_idx++] = height;
+    window->next_config.values[mut_config_idx++] = 0;
+    return;
+  } else if (window->render_scale < 1.0) {
+    sl_window_reset_viewport(window);
+  }
+
   // For games with issues with incorrect viewport destination when using randr
   // emulation, this will override the viewport destination with the screen size
   // when in fullscreen mode.
@@ -1079,6 +1230,24 @@ void sl_update_application_id(struct sl_context* ctx,
   }
 }
 
+void sl_window_resolve_geometry(struct sl_window* window) {
+  if (!window->geometry_pending)
+    return;
+
+  window->geometry_pending = false;
+  window->ctx->metrics.x_round_trips++;
+  xcb_get_geometry_reply_t* geometry_reply = xcb()->get_geometry_reply(
+      window->ctx->connection, window->creation_geometry_cookie, nullptr);
+  if (geometry_reply) {
+    window->x = geometry_reply->x;
+    window->y = geometry_reply->y;
+    window->width = geometry_reply->width;
+    window->height = geometry_reply->height;
+    window->depth = geometry_reply->depth;
+    free(geometry_reply);
+  }
+}
+
 void sl_window_update(struct sl_window* window) {
   TRACE_EVENT("surface", "sl_window_update", "id", window->id);
   struct wl_resource* host_resource = nullptr;
@@ -1092,11 +1261,16 @@ void sl_window_update(struct sl_window* window) {
       wl_list_remove(&window->link);
       wl_list_insert(&ctx->windows, &window->link);
       window->unpaired = 0;
+      window->indexed_surface_id = window->host_surface_id;
+      ctx->windows_by_surface_id[window->indexed_surface_id] = window;
     }
   } else if (!window->unpaired) {
     wl_list_remove(&window->link);
     wl_list_insert(&ctx->unpaired_windows, &window->link);
     window->unpaired = 1;
+    sl_window_unindex(ctx->windows_by_surface_id, window->indexed_surface_id,
+                      window);
+    window->indexed_surface_id = 0;
     window->paired_surface->window = nullptr;
     window->paired_surface = nullptr;
   }
@@ -1137,16 +1311,30 @@ void sl_window_update(struct sl_window* window) {
   assert(ctx->xdg_shell);
   assert(ctx->xdg_shell->internal);
 
-  if (window->managed) {
-    if (window->transient_for != XCB_WINDOW_NONE) {
-      struct sl_window* sibling;
+  // Role objects made from scratch need all of the window's state.
+  if (!window->xdg_surface || (ctx->aura_shell && !window->aura_surface))
+    window->dirty = SL_WINDOW_DIRTY_ALL;
+  uint32_t dirty = window->dirty;
+  window->dirty = 0;
+  if (!dirty) {
+    if (host_surface->contents_width && host_surface->contents_height)
+      window->realized = 1;
+    return;
+  }
+
+  // The role state below is for the commit after one still deferred.
+  sl_host_surface_finish_deferred_commit(host_surface);
 
-      wl_list_for_each(sibling, &ctx->windows, link) {
-        if (sibling->id == window->transient_for) {
-          if (sibling->xdg_toplevel)
-            parent = sibling;
-          break;
-        }
+  // The parent is only looked for when it has to be sent.
+  if ((dirty & SL_WINDOW_DIRTY_PARENT) && window->managed &&
+      window->transient_for != XCB_WINDOW_NONE) {
+    struct sl_window* sibling;
+
+    wl_list_for_each(sibling, &ctx->windows, link) {
+      if (sibling->id == window->transient_for) {
+        if (sibling->xdg_toplevel)
+          parent = sibling;
+        break;
       }
     }
   }
@@ -1156,8 +1344,9 @@ void sl_window_update(struct sl_window* window) {
   // parent.  We update this again when we gain focus, so if we picked the wrong
   // one it can get corrected at that point (but it's also possible the parent
   // will never be realized, which is why selecting one here is important).
-  if (!window->managed ||
-      (!parent && window->transient_for != XCB_WINDOW_NONE)) {
+  if ((dirty & SL_WINDOW_DIRTY_PARENT) &&
+      (!window->managed ||
+       (!parent && window->transient_for != XCB_WINDOW_NONE))) {
     struct sl_window* sibling;
     uint32_t parent_last_event_serial = 0;
 
@@ -1188,16 +1377,6 @@ void sl_window_update(struct sl_window* window) {
     }
   }
 
-  if (!window->depth) {
-    xcb_get_geometry_reply_t* geometry_reply = xcb()->get_geometry_reply(
-        ctx->connection, xcb()->get_geometry(ctx->connection, window->id),
-        nullptr);
-    if (geometry_reply) {
-      window->depth = geometry_reply->depth;
-      free(geometry_reply);
-    }
-  }
-
   if (!window->xdg_surface) {
     window->xdg_surface = xdg_wm_base_get_xdg_surface(ctx->xdg_shell->internal,
                                                       host_surface->proxy);
@@ -1213,20 +1392,26 @@ void sl_window_update(struct sl_window* window) {
           ctx->aura_shell->internal, host_surface->proxy);
     }
 
-    zaura_surface_set_frame(window->aura_surface,
-                            window->decorated ? ZAURA_SURFACE_FRAME_TYPE_NORMAL
-                            : window->depth == 32
-                                ? ZAURA_SURFACE_FRAME_TYPE_NONE
+    if (dirty & SL_WINDOW_DIRTY_FRAME) {
+      zaura_surface_set_frame(
+          window->aura_surface,
+          window->decorated     ? ZAURA_SURFACE_FRAME_TYPE_NORMAL
+          : window->depth == 32 ? ZAURA_SURFACE_FRAME_TYPE_NONE
                                 : ZAURA_SURFACE_FRAME_TYPE_SHADOW);
 
-    frame_color = window->dark_frame ? ctx->dark_frame_color : ctx->frame_color;
-    zaura_surface_set_frame_colors(window->aura_surface, frame_color,
-                                   frame_color);
-    zaura_surface_set_startup_id(window->aura_surface, window->startup_id);
-    sl_update_application_id(ctx, window);
+      frame_color =
+          window->dark_frame ? ctx->dark_frame_color : ctx->frame_color;
+      zaura_surface_set_frame_colors(window->aura_surface, frame_color,
+                                     frame_color);
+    }
+    if (dirty & SL_WINDOW_DIRTY_APP_ID) {
+      zaura_surface_set_startup_id(window->aura_surface, window->startup_id);
+      sl_update_application_id(ctx, window);
+    }
 
-    if (ctx->aura_shell->version >=
-        ZAURA_SURFACE_SET_FULLSCREEN_MODE_SINCE_VERSION) {
+    if ((dirty & SL_WINDOW_DIRTY_STATE) &&
+        ctx->aura_shell->version >=
+            ZAURA_SURFACE_SET_FULLSCREEN_MODE_SINCE_VERSION) {
       zaura_surface_set_fullscreen_mode(window->aura_surface,
                                         ctx->fullscreen_mode);
     }
@@ -1234,7 +1419,7 @@ void sl_window_update(struct sl_window* window) {
 
   // Always use top-level surface for X11 windows as we can't control when the
   // window is closed.
-  if (ctx->xwayland || !parent) {
+  if (ctx->xwayland || (!parent && !window->xdg_popup)) {
     if (!window->xdg_toplevel) {
       window->xdg_toplevel = xdg_surface_get_toplevel(window->xdg_surface);
       xdg_toplevel_add_listener(window->xdg_toplevel,
@@ -1268,9 +1453,10 @@ void sl_window_update(struct sl_window* window) {
 
     if (parent)
       xdg_toplevel_set_parent(window->xdg_toplevel, parent->xdg_toplevel);
-    if (window->name)
+    if ((dirty & SL_WINDOW_DIRTY_TITLE) && window->name)
       xdg_toplevel_set_title(window->xdg_toplevel, window->name);
-    if (window->size_flags & P_MIN_SIZE) {
+    if ((dirty & SL_WINDOW_DIRTY_SIZE_HINTS) &&
+        (window->size_flags & P_MIN_SIZE)) {
       int32_t minw = window->min_width;
       int32_t minh = window->min_height;
 
@@ -1278,7 +1464,8 @@ void sl_window_update(struct sl_window* window) {
                                  &minh);
       xdg_toplevel_set_min_size(window->xdg_toplevel, minw, minh);
     }
-    if (window->size_flags & P_MAX_SIZE) {
+    if ((dirty & SL_WINDOW_DIRTY_SIZE_HINTS) &&
+        (window->size_flags & P_MAX_SIZE)) {
       int32_t maxw = window->max_width;
       int32_t maxh = window->max_height;
 
@@ -1286,10 +1473,10 @@ void sl_window_update(struct sl_window* window) {
                                  &maxh);
       xdg_toplevel_set_max_size(window->xdg_toplevel, maxw, maxh);
     }
-    if (window->maximized) {
+    if ((dirty & SL_WINDOW_DIRTY_STATE) && window->maximized) {
       xdg_toplevel_set_maximized(window->xdg_toplevel);
     }
-    if (window->fullscreen) {
+    if ((dirty & SL_WINDOW_DIRTY_STATE) && window->fullscreen) {
       xdg_toplevel_set_fullscreen(window->xdg_toplevel, nullptr);
     }
   } else if (!window->xdg_popup) {
@@ -1328,7 +1515,7 @@ void sl_window_update(struct sl_window* window) {
 #ifdef COMMIT_LOOP_FIX
   sl_commit(window, host_surface);
 #else
-  wl_surface_commit(host_surface->proxy);
+  sl_host_surface_commit_proxy(host_surface);
 #endif
 
   if (host_surface->contents_width && host_surface->contents_height)
@@ -24,6 +24,18 @@
 #define P_BASE_SIZE (1L << 8)
 #define P_WIN_GRAVITY (1L << 9)
 
+// Parts of a window's state sl_window_update has yet to send to the host.
+// Property handlers send changes themselves once the window has its role
+// objects, so these only cover what has to be redone on updates.
+#define SL_WINDOW_DIRTY_TITLE (1 << 0)
+#define SL_WINDOW_DIRTY_APP_ID (1 << 1)
+#define SL_WINDOW_DIRTY_FRAME (1 << 2)
+#define SL_WINDOW_DIRTY_SIZE_HINTS (1 << 3)
+#define SL_WINDOW_DIRTY_STATE (1 << 4)
+// The transient parent, and position relative to it.
+#define SL_WINDOW_DIRTY_PARENT (1 << 5)
+#define SL_WINDOW_DIRTY_ALL ((1 << 6) - 1)
+
 struct sl_config {
   uint32_t serial = 0;
   uint32_t mask = 0;
@@ -50,8 +62,13 @@ struct sl_window {
   xcb_window_t id = XCB_WINDOW_NONE;
   xcb_window_t frame_id = XCB_WINDOW_NONE;
   uint32_t host_surface_id = 0;
+  // |host_surface_id| as of pairing, which keys this window in
+  // sl_context::windows_by_surface_id.
+  uint32_t indexed_surface_id = 0;
   int unpaired = 1;
   bool shaped = false;
+  // SL_WINDOW_DIRTY_* bits.
+  uint32_t dirty = SL_WINDOW_DIRTY_ALL;
 
   // Window position and size are specified in X11's coordinate space
   // (Virtual Coordinate Space, as defined in sommelier-transform.h).
@@ -72,6 +89,11 @@ struct sl_window {
 
   int border_width = 0;
   int depth = 0;
+  // Geometry requested when the window was created, collected by
+  // sl_window_resolve_geometry() while handling X events so that updates
+  // driven from the Wayland side never wait on the X server.
+  xcb_get_geometry_cookie_t creation_geometry_cookie = {};
+  bool geometry_pending = false;
   int managed = 0;
   int realized = 0;
   int activated = 0;
@@ -79,6 +101,8 @@ struct sl_window {
   int compositor_fullscreen = 0;
   int maximized = 0;
   int iconified = 0;
+  // Set while the host reports the window minimized.
+  bool host_minimized = false;
   // True if there has been changes to the fullscreen/maximized state
   // while this window is iconified.
   bool pending_fullscreen_change = false;
@@ -109,6 +133,10 @@ struct sl_window {
   // Currently we assume X and Y axis have the same factor) will result in
   // pointer offset.
   double viewport_pointer_scale = 0;
+  // Fraction of the host's size the window is rendered at while the viewport
+  // scales it up to fill that size (see the render_scale_percent quirk).
+  // Below 1 only while viewport_override is true.
+  double render_scale = 1.0;
   // Configured viewport destination width and height, usually done during
   // xdg_toplevel_configure. Only utilized if viewport_override is true.
   int viewport_width = -1;
@@ -132,11 +160,20 @@ struct sl_window {
   // If true, this window is probably a real game window based on derived
   // information from PID.
   bool should_be_containerized_from_pid = true;
+  // The PID and start time of the entry in ctx->process_classes this window
+  // counts for, or 0.
+  uint32_t classified_pid = 0;
+  uint64_t classified_start_time = 0;
 
 #ifdef QUIRKS_SUPPORT
   // Quirk feature flags previously applied to this window, for which log
   // messages have already been written.
   std::set<int> logged_quirks;
+  // The quirks features enabled for |quirk_steam_game_id|, one bit per
+  // Feature, resolved as of quirks generation |quirk_generation|.
+  uint64_t quirk_features = 0;
+  uint32_t quirk_steam_game_id = 0;
+  uint64_t quirk_generation = 0;
 #endif
 
   // Window rect and state from the most recent xdg_toplevel/aura_toplevel
@@ -157,6 +194,12 @@ struct sl_window {
   // Most recent config received while the |configure_event_barrier| was active.
   struct sl_config coalesced_next_config;
 
+  // The _NET_WM_STATE last written to the window, so that configures which
+  // leave it as it was don't make the client handle it again.
+  bool net_wm_state_written = false;
+  uint32_t net_wm_states_length = 0;
+  uint32_t net_wm_states[3];
+
   struct xdg_surface* xdg_surface = nullptr;
   struct xdg_toplevel* xdg_toplevel = nullptr;
   struct xdg_popup* xdg_popup = nullptr;
@@ -267,6 +310,13 @@ struct sl_mwm_hints {
 #define WM_STATE_ICONIC 3
 
 void sl_window_update(struct sl_window* window);
+// Takes the position, size and |depth| from the reply to the geometry
+// requested at creation, waiting for it if needed. Due before configure
+// events update them, so the reply doesn't override those. Only for X event
+// handlers.
+void sl_window_resolve_geometry(struct sl_window* window);
+// Sets the frame of |window|, keeping the lookup by frame id up to date.
+void sl_window_set_frame_id(struct sl_window* window, xcb_window_t frame_id);
 void sl_toplevel_send_window_bounds_to_host(struct sl_window* window);
 void sl_update_application_id(struct sl_context* ctx, struct sl_window* window);
 void sl_configure_window(struct sl_window* window);
@@ -334,6 +384,8 @@ void sl_window_get_width_height(struct sl_window* window,
                                 uint32_t* w,
                                 uint32_t* h);
 
+// Drops |window|'s hold on the classification of its process.
+void sl_window_forget_process_class(struct sl_window* window);
 void sl_window_update_should_be_containerized_from_pid(
     struct sl_window* window);
 bool sl_window_is_containerized(struct sl_window* window);
@@ -6,6 +6,8 @@
 #include <gtest/gtest.h>
 #include <xcb/xproto.h>
 
+#include <vector>
+
 #include "testing/x11-test-base.h"
 #include "xcb/fake-xcb-shim.h"
 
@@ -40,6 +42,25 @@ TEST_F(X11EventTest, MapRequestIssuesMapWindow) {
   sl_handle_map_request(&ctx, &event);
 }
 
+TEST_F(X11EventTest, MapRequestReusesTheGeometryRequestedAtCreation) {
+  sl_window* window = CreateWindowWithoutRole();
+  xcb_map_request_event_t event;
+  event.response_type = XCB_MAP_REQUEST;
+  event.window = window->id;
+  xcb_get_geometry_reply_t* reply = static_cast<xcb_get_geometry_reply_t*>(
+      calloc(1, sizeof(xcb_get_geometry_reply_t)));
+  reply->width = 640;
+  reply->height = 480;
+
+  EXPECT_CALL(xcb, get_geometry(testing::_, window->id)).Times(0);
+  EXPECT_CALL(xcb, get_geometry_reply(testing::_, testing::_, testing::_))
+      .WillOnce(testing::Return(reply));
+  sl_handle_map_request(&ctx, &event);
+
+  EXPECT_EQ(window->width, 640);
+  EXPECT_EQ(window->height, 480);
+}
+
 TEST_F(X11EventTest, MapRequestGetsWmName) {
   std::string windowName("Fred");
   xcb.DelegateToFake();
@@ -60,6 +81,33 @@ TEST_F(X11EventTest, MapRequestGetsWmName) {
   EXPECT_EQ(window->name, windowName);
 }
 
+TEST_F(X11EventTest, MapRequestGetsStartupIdFromClientLeader) {
+  std::string startupId("startup");
+  xcb.DelegateToFake();
+  sl_window* window = CreateWindowWithoutRole();
+  xcb_window_t leader = window->id + 1;
+  xcb.create_window(nullptr, 32, window->id, XCB_WINDOW_NONE, 0, 0, 800, 600, 0,
+                    XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT, 0,
+                    nullptr);
+  xcb.create_window(nullptr, 32, leader, XCB_WINDOW_NONE, 0, 0, 800, 600, 0,
+                    XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT, 0,
+                    nullptr);
+  xcb.change_property(nullptr, XCB_PROP_MODE_REPLACE, window->id,
+                      ctx.atoms[ATOM_WM_CLIENT_LEADER].value, XCB_ATOM_WINDOW,
+                      32, 1, &leader);
+  xcb.change_property(nullptr, XCB_PROP_MODE_REPLACE, leader,
+                      ctx.atoms[ATOM_NET_STARTUP_ID].value, XCB_ATOM_STRING, 8,
+                      startupId.size(), startupId.c_str());
+
+  xcb_map_request_event_t event;
+  event.response_type = XCB_MAP_REQUEST;
+  event.window = window->id;
+  sl_handle_map_request(&ctx, &event);
+
+  EXPECT_EQ(window->client_leader, leader);
+  EXPECT_EQ(window->startup_id, startupId);
+}
+
 TEST_F(X11EventTest, ListensToWmNameChanges) {
   std::string windowName("Fred");
   xcb.DelegateToFake();
@@ -231,5 +279,67 @@ TEST_F(X11EventTest, PropertyNotifyParsesSteamIdFromClassAsFallback) {
   EXPECT_EQ(window->steam_game_id, steam_game_id);
 }
 
+static xcb_generic_event_t* NewConfigureNotify(xcb_window_t window) {
+  xcb_configure_notify_event_t* event =
+      static_cast<xcb_configure_notify_event_t*>(calloc(1, sizeof(*event)));
+  event->response_type = XCB_CONFIGURE_NOTIFY;
+  event->window = window;
+  return reinterpret_cast<xcb_generic_event_t*>(event);
+}
+
+static xcb_generic_event_t* NewPropertyNotify(xcb_window_t window,
+                                              xcb_atom_t atom) {
+  xcb_property_notify_event_t* event =
+      static_cast<xcb_property_notify_event_t*>(calloc(1, sizeof(*event)));
+  event->response_type = XCB_PROPERTY_NOTIFY;
+  event->window = window;
+  event->atom = atom;
+  return reinterpret_cast<xcb_generic_event_t*>(event);
+}
+
+TEST_F(X11EventTest, CoalescesSupersededConfigureAndPropertyNotifies) {
+  std::vector<xcb_generic_event_t*> events = {
+      NewPropertyNotify(1, XCB_ATOM_WM_NAME),
+      NewConfigureNotify(2),
+      NewPropertyNotify(1, XCB_ATOM_WM_CLASS),
+      NewPropertyNotify(1, XCB_ATOM_WM_NAME),
+      NewConfigureNotify(2),
+  };
+  xcb_generic_event_t* class_notify = events[2];
+  xcb_generic_event_t* name_notify = events[3];
+  xcb_generic_event_t* configure_notify = events[4];
+
+  sl_coalesce_x_events(events);
+
+  EXPECT_THAT(events, testing::ElementsAre(class_notify, name_notify,
+                                           configure_notify));
+  for (xcb_generic_event_t* event : events)
+    free(event);
+}
+
+TEST_F(X11EventTest, CoalescingKeepsOrderAcrossOtherEvents) {
+  xcb_unmap_notify_event_t* unmap =
+      static_cast<xcb_unmap_notify_event_t*>(calloc(1, sizeof(*unmap)));
+  unmap->response_type = XCB_UNMAP_NOTIFY;
+  unmap->window = 3;
+  std::vector<xcb_generic_event_t*> events = {
+      // Not coalesced across the unmap, even for another window.
+      NewConfigureNotify(1),
+      reinterpret_cast<xcb_generic_event_t*>(unmap),
+      NewConfigureNotify(1),
+      // Not coalesced across a configure of the same window.
+      NewPropertyNotify(2, XCB_ATOM_WM_NAME),
+      NewConfigureNotify(2),
+      NewPropertyNotify(2, XCB_ATOM_WM_NAME),
+  };
+  std::vector<xcb_generic_event_t*> expected = events;
+
+  sl_coalesce_x_events(events);
+
+  EXPECT_EQ(events, expected);
+  for (xcb_generic_event_t* event : events)
+    free(event);
+}
+
 }  // namespace sommelier
 }  // namespace vm_tools
@@ -4,6 +4,7 @@
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <unistd.h>
 
 #include "testing/sommelier-test-util.h"
 #include "testing/wayland-test-base.h"
@@ -256,12 +257,16 @@ class XdgSurfaceTest : public XdgShellTest {
 
     WaylandTestBase::SetUp();
 
-    client_xdg_surface = client->CreateXdgSurface();
+    client_surface = client->CreateSurface();
+    client_xdg_surface =
+        xdg_wm_base_get_xdg_surface(client->GetXdgWmBase(), client_surface);
+    client->Flush();
     Pump();
   }
 
  protected:
   struct sl_host_xdg_surface* sommelier_xdg_surface = nullptr;
+  struct wl_surface* client_surface = nullptr;
   struct xdg_surface* client_xdg_surface = nullptr;
 };
 
@@ -332,6 +337,33 @@ TEST_F(XdgSurfaceTest, SetWindowGeometry_AppliesXdgScaleWithDirectScale) {
   xdg_surface_set_window_geometry(client_xdg_surface, 100, 100, 100, 100);
 }
 
+TEST_F(XdgSurfaceTest, SetWindowGeometry_SentAfterTheDeferredCommit) {
+  struct sl_host_surface* host_surface = sommelier_xdg_surface->originator;
+  int fence[2];
+  ASSERT_EQ(pipe(fence), 0);
+  sl_context_wait_for_fence(&ctx, host_surface, fence[0]);
+  wl_surface_commit(client_surface);
+  client->Flush();
+  Pump();
+  ASSERT_TRUE(host_surface->commit_deferred);
+
+  // The geometry is handled ahead of the fence's event, so it has to send
+  // the commit itself first.
+  EXPECT_CALL(
+      mock_xdg_surface_shim_,
+      set_window_geometry(sommelier_xdg_surface->proxy, 0, 0, 100, 100))
+      .WillOnce([host_surface](struct xdg_surface* xdg_surface, int32_t x,
+                               int32_t y, int32_t width, int32_t height) {
+        EXPECT_FALSE(host_surface->commit_deferred);
+      });
+  xdg_surface_set_window_geometry(client_xdg_surface, 0, 0, 100, 100);
+  client->Flush();
+  ASSERT_EQ(write(fence[1], "", 1), 1);
+  Pump();
+  EXPECT_FALSE(host_surface->commit_deferred);
+  close(fence[1]);
+}
+
 TEST_F(XdgSurfaceTest, AckConfigure_ForwardsCorrectly) {
   EXPECT_CALL(mock_xdg_surface_shim_, ack_configure(_, kFakeSerial));
   xdg_surface_ack_configure(client_xdg_surface, kFakeSerial);
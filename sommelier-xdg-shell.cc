@@ -183,6 +183,42 @@ static void sl_xdg_toplevel_show_window_menu(struct wl_client* client,
       host->proxy, host_seat ? host_seat->proxy : nullptr, serial, x, y);
 }
 
+static void sl_xdg_toplevel_set_max_size(struct wl_client* client,
+                                         struct wl_resource* resource,
+                                         int32_t width,
+                                         int32_t height) {
+  struct sl_host_xdg_toplevel* host =
+      static_cast<sl_host_xdg_toplevel*>(wl_resource_get_user_data(resource));
+  struct sl_host_surface* host_surface = get_host_surface(host->originator);
+
+  if (host_surface) {
+    if (sl_host_surface_hold_request<sl_xdg_toplevel_set_max_size>(
+            host_surface, client, resource, width, height)) {
+      return;
+    }
+    sl_host_surface_apply_held_commit(host_surface);
+  }
+  xdg_toplevel_shim()->set_max_size(host->proxy, width, height);
+}
+
+static void sl_xdg_toplevel_set_min_size(struct wl_client* client,
+                                         struct wl_resource* resource,
+                                         int32_t width,
+                                         int32_t height) {
+  struct sl_host_xdg_toplevel* host =
+      static_cast<sl_host_xdg_toplevel*>(wl_resource_get_user_data(resource));
+  struct sl_host_surface* host_surface = get_host_surface(host->originator);
+
+  if (host_surface) {
+    if (sl_host_surface_hold_request<sl_xdg_toplevel_set_min_size>(
+            host_surface, client, resource, width, height)) {
+      return;
+    }
+    sl_host_surface_apply_held_commit(host_surface);
+  }
+  xdg_toplevel_shim()->set_min_size(host->proxy, width, height);
+}
+
 static void sl_xdg_toplevel_set_app_id(struct wl_client* client,
                                        struct wl_resource* resource,
                                        const char* app_id) {
@@ -207,8 +243,8 @@ static const struct xdg_toplevel_interface sl_xdg_toplevel_implementation = {
     ForwardRequestToShim<xdg_toplevel_shim,
                          &XdgToplevelShim::resize,
                          AllowNullResource::kYes>,
-    ForwardRequestToShim<xdg_toplevel_shim, &XdgToplevelShim::set_max_size>,
-    ForwardRequestToShim<xdg_toplevel_shim, &XdgToplevelShim::set_min_size>,
+    sl_xdg_toplevel_set_max_size,
+    sl_xdg_toplevel_set_min_size,
     ForwardRequestToShim<xdg_toplevel_shim, &XdgToplevelShim::set_maximized>,
     ForwardRequestToShim<xdg_toplevel_shim, &XdgToplevelShim::unset_maximized>,
     ForwardRequestToShim<xdg_toplevel_shim,
@@ -324,17 +360,41 @@ static void sl_xdg_surface_set_window_geometry(struct wl_client* client,
   int32_t x2 = x + width;
   int32_t y2 = y + height;
 
+  // Like the surface's own pending state, the geometry is for the commit
+  // after any the surface still holds back.
+  if (host->originator) {
+    if (sl_host_surface_hold_request<sl_xdg_surface_set_window_geometry>(
+            host->originator, client, resource, x, y, width, height)) {
+      return;
+    }
+    sl_host_surface_apply_held_commit(host->originator);
+  }
   sl_transform_guest_to_host(host->ctx, host->originator, &x1, &y1);
   sl_transform_guest_to_host(host->ctx, host->originator, &x2, &y2);
-
   xdg_surface_shim()->set_window_geometry(host->proxy, x1, y1, x2 - x1,
                                           y2 - y1);
 }
 
+static void sl_xdg_surface_ack_configure(struct wl_client* client,
+                                         struct wl_resource* resource,
+                                         uint32_t serial) {
+  struct sl_host_xdg_surface* host =
+      static_cast<sl_host_xdg_surface*>(wl_resource_get_user_data(resource));
+
+  if (host->originator) {
+    if (sl_host_surface_hold_request<sl_xdg_surface_ack_configure>(
+            host->originator, client, resource, serial)) {
+      return;
+    }
+    sl_host_surface_apply_held_commit(host->originator);
+  }
+  xdg_surface_shim()->ack_configure(host->proxy, serial);
+}
+
 static const struct xdg_surface_interface sl_xdg_surface_implementation = {
     sl_xdg_surface_destroy, sl_xdg_surface_get_toplevel,
     sl_xdg_surface_get_popup, sl_xdg_surface_set_window_geometry,
-    ForwardRequestToShim<xdg_surface_shim, &XdgSurfaceShim::ack_configure>};
+    sl_xdg_surface_ack_configure};
 
 static void sl_xdg_surface_configure(void* data,
                                      struct xdg_surface* xdg_surface,
@@ -3,7 +3,6 @@
 // found in the LICENSE file.
 
 #include <assert.h>
-#include <pixman.h>
 
 #include "compositor/sommelier-formats.h"  // NOLINT(build/include_directory)
 #include "sommelier.h"                     // NOLINT(build/include_directory)
@@ -101,29 +100,29 @@ void sl_shape_query(struct sl_context* ctx, xcb_window_t xwindow) {
   }
 }
 
-pixman_format_code_t sl_pixman_format_for_shm_format(uint32_t shm_format) {
+enum sl_copy_op sl_xshape_copy_op_for_shm_format(uint32_t shm_format) {
   assert(sl_shm_format_is_supported(shm_format));
-  pixman_format_code_t fmt = PIXMAN_a1;
+  enum sl_copy_op op = SL_COPY_OP_COPY;
 
   switch (shm_format) {
     case WL_SHM_FORMAT_ARGB8888:
-      fmt = PIXMAN_a8r8g8b8;
+      op = SL_COPY_OP_COPY;
       break;
 
     case WL_SHM_FORMAT_XRGB8888:
-      fmt = PIXMAN_x8r8g8b8;
+      op = SL_COPY_OP_XRGB_TO_ARGB;
       break;
 
     case WL_SHM_FORMAT_ABGR8888:
-      fmt = PIXMAN_a8b8g8r8;
+      op = SL_COPY_OP_ABGR_TO_ARGB;
       break;
 
     case WL_SHM_FORMAT_XBGR8888:
-      fmt = PIXMAN_x8b8g8r8;
+      op = SL_COPY_OP_XBGR_TO_ARGB;
       break;
 
     case WL_SHM_FORMAT_RGB565:
-      fmt = PIXMAN_r5g6b5;
+      op = SL_COPY_OP_RGB565_TO_ARGB;
       break;
 
     default:
@@ -131,69 +130,5 @@ pixman_format_code_t sl_pixman_format_for_shm_format(uint32_t shm_format) {
       break;
   }
 
-  return fmt;
-}
-
-void sl_xshape_generate_argb_image(struct sl_context* ctx,
-                                   pixman_region32_t* shape,
-                                   struct sl_mmap* src_mmap,
-                                   pixman_image_t* dst_image,
-                                   uint32_t src_shm_format) {
-  int buf_width, buf_height, nrects;
-  pixman_region32_t intersect_rects;
-  pixman_image_t* src;
-
-  assert(ctx);
-  assert(shape);
-  assert(src_mmap);
-  assert(dst_image);
-
-  buf_width = pixman_image_get_width(dst_image);
-  buf_height = pixman_image_get_height(dst_image);
-
-  if (buf_width <= 0 || buf_height <= 0)
-    return;
-
-  // Intersect with the pixmap bounds to ensure we do not perform
-  // any OOB accesses
-  // In addition, we can assume the dimensions of the dst_image is
-  // the same size as the input image
-
-  pixman_region32_init(&intersect_rects);
-  pixman_region32_intersect_rect(&intersect_rects, shape, 0, 0, buf_width,
-                                 buf_height);
-
-  // With the blank destination image, we will take the source image and the
-  // shape rectangles and generate the "stamped out" ARGB image.
-  //
-  // This is accomplished by clearing out the destination image to be
-  // completely transparent as a first step. Then for each rectangular
-  // region within the shape data, we will use pixman_image_composite to
-  // copy that portion of the image from the source to the ARGB stamp out
-  // buffer.
-  //
-  // pixman_image_composite is used as it will automatically perform pixel
-  // format conversion for us.
-
-  src = pixman_image_create_bits_no_clear(
-      sl_pixman_format_for_shm_format(src_shm_format), buf_width, buf_height,
-      reinterpret_cast<uint32_t*>(src_mmap->addr), src_mmap->stride[0]);
-
-  pixman_box32_t* rects = pixman_region32_rectangles(&intersect_rects, &nrects);
-
-  pixman_color_t clear = {.red = 0, .green = 0, .blue = 0, .alpha = 0};
-  pixman_box32_t dstbox = {.x1 = 0, .y1 = 0, .x2 = buf_width, .y2 = buf_height};
-
-  pixman_image_fill_boxes(PIXMAN_OP_SRC, dst_image, &clear, 1, &dstbox);
-
-  for (int i = 0; i < nrects; i++) {
-    pixman_image_composite(PIXMAN_OP_SRC, src, nullptr, dst_image, rects[i].x1,
-                           rects[i].y1, 0, 0, rects[i].x1, rects[i].y1,
-                           (rects[i].x2 - rects[i].x1),
-                           (rects[i].y2 - rects[i].y1));
-  }
-
-  // Release the memory associated with the above
-  pixman_image_unref(src);
-  pixman_region32_fini(&intersect_rects);
+  return op;
 }
@@ -7,17 +7,17 @@
 
 #include <xcb/shape.h>
 #include <xcb/xcb.h>
-#include "sommelier-ctx.h"  // NOLINT(build/include_directory)
+
+#include "compositor/sommelier-copy.h"  // NOLINT(build/include_directory)
+#include "sommelier-ctx.h"              // NOLINT(build/include_directory)
 
 void sl_handle_shape_notify(struct sl_context* ctx,
                             struct xcb_shape_notify_event_t* event);
 
 void sl_shape_query(struct sl_context* ctx, xcb_window_t xwindow);
 
-void sl_xshape_generate_argb_image(struct sl_context* ctx,
-                                   pixman_region32_t* shape,
-                                   struct sl_mmap* src_mmap,
-                                   pixman_image_t* dst_image,
-                                   uint32_t src_shm_format);
+// Returns the copy op that converts |shm_format| pixels to the ARGB8888 that
+// shaped windows are forwarded as.
+enum sl_copy_op sl_xshape_copy_op_for_shm_format(uint32_t shm_format);
 
 #endif  // VM_TOOLS_SOMMELIER_SOMMELIER_XSHAPE_H_
@@ -2,11 +2,14 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include "compositor/sommelier-copy.h"  // NOLINT(build/include_directory)
 #include "compositor/sommelier-linux-dmabuf.h"  // NOLINT(build/include_directory)
 #include "sommelier.h"  // NOLINT(build/include_directory)
 #include <cstdint>
 #include <cstring>
+#include "sommelier-capture.h"      // NOLINT(build/include_directory)
 #include "sommelier-logging.h"      // NOLINT(build/include_directory)
+#include "sommelier-sched.h"        // NOLINT(build/include_directory)
 #include "sommelier-scope-timer.h"  // NOLINT(build/include_directory)
 #include "sommelier-tracing.h"      // NOLINT(build/include_directory)
 #include "sommelier-transform.h"    // NOLINT(build/include_directory)
@@ -19,6 +22,7 @@
 #include "viewporter-shim.h"  // NOLINT(build/include_directory)
 #include "xcb/xcb-shim.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <cstdlib>
 #include <errno.h>
@@ -27,9 +31,11 @@
 #include <libgen.h>
 #include <limits>
 #include <math.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <string.h>
 #include <sys/file.h>
@@ -39,7 +45,10 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <wayland-client.h>
 #include <xcb/composite.h>
@@ -117,6 +126,7 @@ int sl_open_wayland_socket(const char* socket_name,
                            struct sockaddr_un* addr,
                            int* lock_fd,
                            int* sock_fd);
+static void sl_restart_idle_xwayland(struct sl_context* ctx);
 
 const char* net_wm_state_to_string(int i) {
   switch (i) {
@@ -232,10 +242,51 @@ void sl_restack_windows(struct sl_context* ctx, uint32_t focus_resource_id) {
 void sl_roundtrip(struct sl_context* ctx) {
   TRACE_EVENT("other", "sl_roundtrip", "id",
               ctx->application_id != nullptr ? ctx->application_id : "<null>");
+  ctx->metrics.x_round_trips++;
   free(xcb_get_input_focus_reply(
       ctx->connection, xcb_get_input_focus(ctx->connection), nullptr));
 }
 
+void sl_restack_windows_for_input(struct sl_context* ctx,
+                                  uint32_t focus_resource_id) {
+  TRACE_EVENT("other", "sl_restack_windows_for_input");
+  sl_restack_windows(ctx, focus_resource_id);
+
+  // Xwayland reads the X and Wayland connections independently, so the
+  // event that needs the new stacking could otherwise overtake it. Once the
+  // reply to a request sent after the restack is in, the restack has been
+  // handled.
+  if (ctx->restack_pending)
+    xcb_discard_reply(ctx->connection, ctx->restack_sequence);
+  ctx->restack_sequence = xcb_get_input_focus(ctx->connection).sequence;
+  ctx->restack_pending = true;
+  xcb_flush(ctx->connection);
+}
+
+void sl_flush_clients(struct sl_context* ctx) {
+  if (ctx->restack_pending) {
+    void* reply = nullptr;
+    xcb_generic_error_t* error = nullptr;
+    if (xcb_poll_for_reply(ctx->connection, ctx->restack_sequence, &reply,
+                           &error)) {
+      free(reply);
+      free(error);
+      ctx->restack_pending = false;
+    }
+  }
+
+  if (!ctx->restack_pending) {
+    wl_display_flush_clients(ctx->host_display);
+    return;
+  }
+
+  struct wl_client* client;
+  wl_client_for_each(client, wl_display_get_client_list(ctx->host_display)) {
+    if (client != ctx->client)
+      wl_client_flush(client);
+  }
+}
+
 static void sl_window_set_wm_state(struct sl_window* window, int state) {
   TRACE_EVENT("surface", "sl_window_set_wm_state", "id", window->id);
   struct sl_context* ctx = window->ctx;
@@ -263,10 +314,15 @@ static void sl_buffer_release(void* data, struct wl_buffer* buffer) {
       static_cast<sl_host_buffer*>(wl_buffer_get_user_data(buffer));
 
   auto resource_id = host->resource ? wl_resource_get_id(host->resource) : -1;
-  TRACE_EVENT("surface", "sl_buffer_release", "resource_id", resource_id);
+  TRACE_EVENT("surface", "sl_buffer_release", "resource_id", resource_id,
+              TRACE_TERMINATING_FLOW(buffer));
   if (host->ctx->timing != nullptr) {
     host->ctx->timing->UpdateLastRelease(resource_id);
   }
+  if (host->ctx->frame_stats != nullptr) {
+    host->ctx->frame_stats->AddBufferRelease(resource_id);
+  }
+  sl_drm_syncobj_buffer_release(host);
   wl_buffer_send_release(host->resource);
 }
 
@@ -287,6 +343,9 @@ static void sl_destroy_host_buffer(struct wl_resource* resource) {
   if (host->sync_point) {
     sl_sync_point_destroy(host->sync_point);
   }
+  sl_drm_syncobj_buffer_release(host);
+  if (host->dmabuf_ino)
+    sl_linux_dmabuf_drop_plane0_fixup(host);
   wl_resource_set_user_data(resource, nullptr);
   delete host;
 }
@@ -322,6 +381,34 @@ struct sl_host_buffer* sl_create_host_buffer(struct sl_context* ctx,
   return host_buffer;
 }
 
+// Remembers that |atom| is named |name|.
+static void sl_cache_atom_name(struct sl_context* ctx,
+                               xcb_atom_t atom,
+                               const std::string& name) {
+  ctx->atom_names[atom] = name;
+  ctx->atoms_by_name[name] = atom;
+}
+
+// Returns the atom named |name| if it is cached, or XCB_ATOM_NONE.
+static xcb_atom_t sl_lookup_cached_atom(struct sl_context* ctx,
+                                        const char* name) {
+  auto it = ctx->atoms_by_name.find(name);
+  return it == ctx->atoms_by_name.end() ? XCB_ATOM_NONE : it->second;
+}
+
+const std::string* sl_lookup_cached_atom_name(struct sl_context* ctx,
+                                              xcb_atom_t atom) {
+  auto it = ctx->atom_names.find(atom);
+  return it == ctx->atom_names.end() ? nullptr : &it->second;
+}
+
+void sl_request_atom_name(struct sl_context* ctx, xcb_atom_t atom) {
+  if (ctx->atom_name_requests.count(atom))
+    return;
+  ctx->atom_name_requests[atom] =
+      xcb_get_atom_name(ctx->connection, atom).sequence;
+}
+
 static void sl_internal_data_offer_destroy(struct sl_data_offer* host) {
   TRACE_EVENT("other", "sl_internal_data_offer_destroy");
   wl_data_offer_destroy(host->internal);
@@ -347,21 +434,25 @@ static void sl_set_selection(struct sl_context* ctx,
       return;
     }
 
+    // |atoms| already holds the types whose atoms were cached. The order
+    // of TARGETS doesn't matter.
     int atoms = data_offer->cookies.size / sizeof(xcb_intern_atom_cookie_t);
-    wl_array_add(&data_offer->atoms, sizeof(xcb_atom_t) * (atoms + 2));
-    (reinterpret_cast<xcb_atom_t*>(data_offer->atoms.data))[0] =
-        ctx->atoms[ATOM_TARGETS].value;
-    (reinterpret_cast<xcb_atom_t*>(data_offer->atoms.data))[1] =
-        ctx->atoms[ATOM_TIMESTAMP].value;
+    xcb_atom_t* targets = static_cast<xcb_atom_t*>(
+        wl_array_add(&data_offer->atoms, sizeof(xcb_atom_t) * 2));
+    targets[0] = ctx->atoms[ATOM_TARGETS].value;
+    targets[1] = ctx->atoms[ATOM_TIMESTAMP].value;
     for (int i = 0; i < atoms; i++) {
       xcb_intern_atom_cookie_t cookie =
           (reinterpret_cast<xcb_intern_atom_cookie_t*>(
               data_offer->cookies.data))[i];
+      ctx->metrics.x_round_trips++;
       xcb_intern_atom_reply_t* reply =
           xcb_intern_atom_reply(ctx->connection, cookie, nullptr);
       if (reply) {
-        (reinterpret_cast<xcb_atom_t*>(data_offer->atoms.data))[i + 2] =
+        *static_cast<xcb_atom_t*>(
+            wl_array_add(&data_offer->atoms, sizeof(xcb_atom_t))) =
             reply->atom;
+        sl_cache_atom_name(ctx, reply->atom, data_offer->cookie_names[i]);
         free(reply);
       }
     }
@@ -378,9 +469,18 @@ static void sl_internal_data_offer_offer(void* data,
                                          const char* type) {
   TRACE_EVENT("other", "sl_internal_data_offer_offer");
   struct sl_data_offer* host = static_cast<sl_data_offer*>(data);
+  xcb_atom_t atom = sl_lookup_cached_atom(host->ctx, type);
+
+  if (atom != XCB_ATOM_NONE) {
+    *static_cast<xcb_atom_t*>(wl_array_add(&host->atoms, sizeof(xcb_atom_t))) =
+        atom;
+    return;
+  }
+
   xcb_intern_atom_cookie_t* cookie = static_cast<xcb_intern_atom_cookie_t*>(
       wl_array_add(&host->cookies, sizeof(xcb_intern_atom_cookie_t)));
   *cookie = xcb_intern_atom(host->ctx->connection, 0, strlen(type), type);
+  host->cookie_names.push_back(type);
 }
 
 static void sl_internal_data_offer_source_actions(
@@ -664,9 +764,19 @@ void sl_registry_handler(void* data,
           sl_linux_dmabuf_global_create(ctx, linux_dmabuf);
     }
 
+    linux_dmabuf->host_drm_syncobj_global =
+        sl_drm_syncobj_manager_global_create(ctx);
+
+    linux_dmabuf->internal = nullptr;
+    linux_dmabuf->host_feedback = nullptr;
     if (linux_dmabuf->version >= 2) {
-      linux_dmabuf->proxy_v2 = static_cast<zwp_linux_dmabuf_v1*>(
-          wl_registry_bind(registry, id, &zwp_linux_dmabuf_v1_interface, 2));
+      // Version 4 brings the feedback output buffers are allocated by.
+      linux_dmabuf->internal =
+          static_cast<zwp_linux_dmabuf_v1*>(wl_registry_bind(
+              registry, id, &zwp_linux_dmabuf_v1_interface,
+              MIN(linux_dmabuf->version, 4)));
+      if (linux_dmabuf->version >= 4)
+        sl_linux_dmabuf_watch_host_feedback(linux_dmabuf);
     }
 
     ctx->linux_dmabuf = linux_dmabuf;
@@ -689,9 +799,8 @@ void sl_registry_handler(void* data,
     assert(keyboard_extension);
     keyboard_extension->ctx = ctx;
     keyboard_extension->id = id;
-    keyboard_extension->internal =
-        static_cast<zcr_keyboard_extension_v1*>(wl_registry_bind(
-            registry, id, &zcr_keyboard_extension_v1_interface, 1));
+    // Bound once the first keyboard is created.
+    keyboard_extension->internal = nullptr;
     assert(!ctx->keyboard_extension);
     ctx->keyboard_extension = keyboard_extension;
   } else if (strcmp(interface, "zwp_text_input_manager_v1") == 0) {
@@ -739,8 +848,8 @@ void sl_registry_handler(void* data,
     assert(stylus_input_manager);
     stylus_input_manager->ctx = ctx;
     stylus_input_manager->id = id;
-    stylus_input_manager->internal = static_cast<zcr_stylus_v2*>(
-        wl_registry_bind(registry, id, &zcr_stylus_v2_interface, 1));
+    // Bound once the first client asks for a tablet seat.
+    stylus_input_manager->internal = nullptr;
 
     // Note: This does not forward the stylus-unstable-v2 protcol to the
     // clients. Instead, it exposes tablet-unstable-v2 protocol to the clients.
@@ -776,9 +885,6 @@ void sl_registry_handler(void* data,
     fractional_scale_manager->ctx = ctx;
     fractional_scale_manager->id = id;
     fractional_scale_manager->host_fractional_scale_manager_global = nullptr;
-    fractional_scale_manager->internal =
-        static_cast<wp_fractional_scale_manager_v1*>(wl_registry_bind(
-            registry, id, &wp_fractional_scale_manager_v1_interface, 1));
     assert(!ctx->fractional_scale_manager);
     ctx->fractional_scale_manager = fractional_scale_manager;
     fractional_scale_manager->host_fractional_scale_manager_global =
@@ -793,6 +899,19 @@ void sl_registry_handler(void* data,
     assert(!ctx->idle_inhibit_manager);
     ctx->idle_inhibit_manager = idle_inhibit;
     idle_inhibit->host_global = sl_idle_inhibit_manager_global_create(ctx);
+  } else if (strcmp(interface, "wp_presentation") == 0) {
+    struct sl_presentation* presentation =
+        static_cast<sl_presentation*>(malloc(sizeof(struct sl_presentation)));
+    assert(presentation);
+    presentation->ctx = ctx;
+    presentation->id = id;
+    presentation->clock_offset_ns = 0;
+    presentation->has_clock_offset = false;
+    presentation->window_offset_ns = 0;
+    presentation->window_samples = 0;
+    assert(!ctx->presentation);
+    ctx->presentation = presentation;
+    presentation->host_global = sl_presentation_global_create(ctx);
   }
 }
 
@@ -813,13 +932,13 @@ void sl_registry_remover(void* data,
   }
   if (ctx->subcompositor && ctx->subcompositor->id == id) {
     sl_global_destroy(ctx->subcompositor->host_global);
-    wl_shm_destroy(ctx->shm->internal);
     free(ctx->subcompositor);
     ctx->subcompositor = nullptr;
     return;
   }
   if (ctx->shm && ctx->shm->id == id) {
     sl_global_destroy(ctx->shm->host_global);
+    wl_shm_destroy(ctx->shm->internal);
     free(ctx->shm);
     ctx->shm = nullptr;
     return;
@@ -867,10 +986,13 @@ void sl_registry_remover(void* data,
   if (ctx->linux_dmabuf && ctx->linux_dmabuf->id == id) {
     if (ctx->linux_dmabuf->host_drm_global)
       sl_global_destroy(ctx->linux_dmabuf->host_drm_global);
-    if (ctx->linux_dmabuf->proxy_v2)
-      zwp_linux_dmabuf_v1_destroy(ctx->linux_dmabuf->proxy_v2);
+    sl_linux_dmabuf_unwatch_host_feedback(ctx->linux_dmabuf);
+    if (ctx->linux_dmabuf->internal)
+      zwp_linux_dmabuf_v1_destroy(ctx->linux_dmabuf->internal);
     if (ctx->linux_dmabuf->host_linux_dmabuf_global)
       sl_global_destroy(ctx->linux_dmabuf->host_linux_dmabuf_global);
+    if (ctx->linux_dmabuf->host_drm_syncobj_global)
+      sl_global_destroy(ctx->linux_dmabuf->host_drm_syncobj_global);
     free(ctx->linux_dmabuf);
     ctx->linux_dmabuf = nullptr;
     return;
@@ -884,7 +1006,8 @@ void sl_registry_remover(void* data,
     return;
   }
   if (ctx->keyboard_extension && ctx->keyboard_extension->id == id) {
-    zcr_keyboard_extension_v1_destroy(ctx->keyboard_extension->internal);
+    if (ctx->keyboard_extension->internal)
+      zcr_keyboard_extension_v1_destroy(ctx->keyboard_extension->internal);
     free(ctx->keyboard_extension);
     ctx->keyboard_extension = nullptr;
     return;
@@ -911,6 +1034,8 @@ void sl_registry_remover(void* data,
 #endif
   if (ctx->stylus_input_manager && ctx->stylus_input_manager->id == id) {
     sl_global_destroy(ctx->stylus_input_manager->tablet_host_global);
+    if (ctx->stylus_input_manager->internal)
+      zcr_stylus_v2_destroy(ctx->stylus_input_manager->internal);
     free(ctx->stylus_input_manager);
     ctx->stylus_input_manager = nullptr;
   }
@@ -933,6 +1058,12 @@ void sl_registry_remover(void* data,
     ctx->idle_inhibit_manager = nullptr;
     return;
   }
+  if (ctx->presentation && ctx->presentation->id == id) {
+    sl_global_destroy(ctx->presentation->host_global);
+    free(ctx->presentation);
+    ctx->presentation = nullptr;
+    return;
+  }
   wl_list_for_each(output, &ctx->outputs, link) {
     if (output->id == id) {
       sl_global_destroy(output->host_global);
@@ -959,25 +1090,130 @@ void sl_registry_remover(void* data,
 const struct wl_registry_listener sl_registry_listener = {sl_registry_handler,
                                                           sl_registry_remover};
 
+static void sl_destroy_window(struct sl_window* window);
+
+void sl_release_globals(struct sl_context* ctx) {
+  struct sl_window* window;
+  struct sl_window* next_window;
+  struct sl_output* output;
+  struct sl_output* next_output;
+  struct sl_seat* seat;
+  struct sl_seat* next_seat;
+  std::vector<uint32_t> ids;
+
+  wl_list_for_each_safe(window, next_window, &ctx->windows, link) {
+    sl_destroy_window(window);
+  }
+  wl_list_for_each_safe(window, next_window, &ctx->unpaired_windows, link) {
+    sl_destroy_window(window);
+  }
+
+  // Each global goes the way it would if the host removed it.
+  // sl_destroy_host_output() doesn't clear |output->host_output|, and the
+  // clients' outputs are gone already.
+  wl_list_for_each_safe(output, next_output, &ctx->outputs, link) {
+    output->host_output = nullptr;
+    sl_registry_remover(ctx, ctx->registry, output->id);
+  }
+  wl_list_for_each_safe(seat, next_seat, &ctx->seats, link) {
+    sl_registry_remover(ctx, ctx->registry, seat->id);
+  }
+  if (ctx->compositor)
+    ids.push_back(ctx->compositor->id);
+  if (ctx->subcompositor)
+    ids.push_back(ctx->subcompositor->id);
+  if (ctx->shm)
+    ids.push_back(ctx->shm->id);
+  if (ctx->shell)
+    ids.push_back(ctx->shell->id);
+  if (ctx->data_device_manager)
+    ids.push_back(ctx->data_device_manager->id);
+  if (ctx->xdg_shell)
+    ids.push_back(ctx->xdg_shell->id);
+  if (ctx->aura_shell)
+    ids.push_back(ctx->aura_shell->id);
+  if (ctx->viewporter)
+    ids.push_back(ctx->viewporter->id);
+  if (ctx->linux_dmabuf)
+    ids.push_back(ctx->linux_dmabuf->id);
+  if (ctx->linux_explicit_synchronization)
+    ids.push_back(ctx->linux_explicit_synchronization->id);
+  if (ctx->keyboard_extension)
+    ids.push_back(ctx->keyboard_extension->id);
+  if (ctx->text_input_manager)
+    ids.push_back(ctx->text_input_manager->id);
+  if (ctx->text_input_extension)
+    ids.push_back(ctx->text_input_extension->id);
+#ifdef GAMEPAD_SUPPORT
+  if (ctx->gaming_input_manager)
+    ids.push_back(ctx->gaming_input_manager->id);
+#endif
+  if (ctx->stylus_input_manager)
+    ids.push_back(ctx->stylus_input_manager->id);
+  if (ctx->relative_pointer_manager)
+    ids.push_back(ctx->relative_pointer_manager->id);
+  if (ctx->pointer_constraints)
+    ids.push_back(ctx->pointer_constraints->id);
+  if (ctx->idle_inhibit_manager)
+    ids.push_back(ctx->idle_inhibit_manager->id);
+  if (ctx->presentation)
+    ids.push_back(ctx->presentation->id);
+  for (uint32_t id : ids)
+    sl_registry_remover(ctx, ctx->registry, id);
+
+  // These two aren't removed when the host removes them.
+  if (ctx->xdg_output_manager) {
+    zxdg_output_manager_v1_destroy(ctx->xdg_output_manager->internal);
+    free(ctx->xdg_output_manager);
+    ctx->xdg_output_manager = nullptr;
+  }
+  free(ctx->fractional_scale_manager);
+  ctx->fractional_scale_manager = nullptr;
+
+  // Globals created alongside the ones above.
+  struct sl_global* global;
+  struct sl_global* next_global;
+  wl_list_for_each_safe(global, next_global, &ctx->globals, link) {
+    wl_list_remove(&global->link);
+    free(global);
+  }
+
+  if (ctx->registry) {
+    wl_registry_destroy(ctx->registry);
+    ctx->registry = nullptr;
+  }
+  wl_array_release(&ctx->dpi);
+  wl_array_init(&ctx->dpi);
+}
+
 static int sl_handle_event(int fd, uint32_t mask, void* data) {
   TRACE_EVENT("other", "sl_handle_event");
   struct sl_context* ctx = (struct sl_context*)data;
+  ScopedDispatchTimer dispatch_timer(ctx, SL_METRICS_HANDLER_HOST);
   int count = 0;
 
   if ((mask & WL_EVENT_HANGUP) || (mask & WL_EVENT_ERROR)) {
-    wl_client_flush(ctx->client);
-    exit(EXIT_SUCCESS);
+    // Warm children may not have a client yet.
+    if (ctx->client)
+      wl_client_flush(ctx->client);
+    sl_context_exit(ctx, EXIT_SUCCESS);
+    return 0;
   }
 
-  if (mask & WL_EVENT_READABLE)
-    count = wl_display_dispatch(ctx->display);
+  // Unlike wl_display_dispatch(), this doesn't flush before reading, and
+  // nothing here flushes after dispatching either: requests the events
+  // trigger go out with the main loop's flush at the end of the iteration.
+  if (mask & WL_EVENT_READABLE) {
+    if (wl_display_prepare_read(ctx->display) == 0 &&
+        wl_display_read_events(ctx->display) < 0 && errno != EAGAIN) {
+      return -1;
+    }
+  }
   if (mask & WL_EVENT_WRITABLE)
-    wl_display_flush(ctx->display);
+    sl_context_flush_host(ctx);
 
-  if (mask == 0) {
+  if ((mask & WL_EVENT_READABLE) || mask == 0)
     count = wl_display_dispatch_pending(ctx->display);
-    wl_display_flush(ctx->display);
-  }
 
   return count;
 }
@@ -995,6 +1231,9 @@ void sl_create_window(struct sl_context* ctx,
   values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_FOCUS_CHANGE;
   xcb()->change_window_attributes(ctx->connection, window->id,
                                   XCB_CW_EVENT_MASK, values);
+  window->creation_geometry_cookie =
+      xcb()->get_geometry(ctx->connection, window->id);
+  window->geometry_pending = true;
 
   // Also enable shape events for this window to come in if the xshape
   // flag has been enabled
@@ -1015,34 +1254,17 @@ static void sl_destroy_window(struct sl_window* window) {
     xdg_surface_destroy(window->xdg_surface);
   if (window->aura_surface)
     zaura_surface_destroy(window->aura_surface);
-
-  delete window;
-}
-
-static int sl_is_window(struct sl_window* window, xcb_window_t id) {
-  if (window->id == id)
-    return 1;
-
-  if (window->frame_id != XCB_WINDOW_NONE) {
-    if (window->frame_id == id)
-      return 1;
+  if (window->geometry_pending) {
+    xcb()->discard_reply(window->ctx->connection,
+                         window->creation_geometry_cookie.sequence);
   }
 
-  return 0;
+  delete window;
 }
 
 struct sl_window* sl_lookup_window(struct sl_context* ctx, xcb_window_t id) {
-  struct sl_window* window;
-
-  wl_list_for_each(window, &ctx->windows, link) {
-    if (sl_is_window(window, id))
-      return window;
-  }
-  wl_list_for_each(window, &ctx->unpaired_windows, link) {
-    if (sl_is_window(window, id))
-      return window;
-  }
-  return nullptr;
+  auto it = ctx->windows_by_xid.find(id);
+  return it != ctx->windows_by_xid.end() ? it->second : nullptr;
 }
 
 int sl_is_our_window(struct sl_context* ctx, xcb_window_t id) {
@@ -1089,6 +1311,7 @@ void sl_handle_reparent_notify(struct sl_context* ctx,
     if (window)
       return;
 
+    ctx->metrics.x_round_trips++;
     xcb_get_geometry_reply_t* geometry_reply = xcb_get_geometry_reply(
         ctx->connection, xcb_get_geometry(ctx->connection, event->window),
         nullptr);
@@ -1190,8 +1413,9 @@ void sl_handle_map_request(struct sl_context* ctx,
       {PROPERTY_NET_WM_WINDOW_TYPE, ctx->atoms[ATOM_NET_WM_WINDOW_TYPE].value},
       {PROPERTY_NET_WM_PID, ctx->atoms[ATOM_NET_WM_PID].value},
   };
-  xcb_get_geometry_cookie_t geometry_cookie;
   xcb_get_property_cookie_t property_cookies[ARRAY_SIZE(properties)];
+  xcb_get_property_cookie_t leader_startup_id_cookie;
+  bool leader_startup_id_requested = false;
   struct sl_wm_size_hints size_hints = {0};
   struct sl_mwm_hints mwm_hints = {0};
   bool maximize_h = false, maximize_v = false, fullscreen = false;
@@ -1204,8 +1428,9 @@ void sl_handle_map_request(struct sl_context* ctx,
     return;
 
   window->managed = 1;
-  if (window->frame_id == XCB_WINDOW_NONE)
-    geometry_cookie = xcb()->get_geometry(ctx->connection, window->id);
+  // The geometry requested at creation and kept up to date by configure
+  // notifications since is still current while the window is unmapped.
+  sl_window_resolve_geometry(window);
 
   for (unsigned i = 0; i < ARRAY_SIZE(properties); ++i) {
     property_cookies[i] =
@@ -1213,19 +1438,6 @@ void sl_handle_map_request(struct sl_context* ctx,
                             XCB_ATOM_ANY, 0, 2048);
   }
 
-  if (window->frame_id == XCB_WINDOW_NONE) {
-    xcb_get_geometry_reply_t* geometry_reply =
-        xcb()->get_geometry_reply(ctx->connection, geometry_cookie, nullptr);
-    if (geometry_reply) {
-      window->x = geometry_reply->x;
-      window->y = geometry_reply->y;
-      window->width = geometry_reply->width;
-      window->height = geometry_reply->height;
-      window->depth = geometry_reply->depth;
-      free(geometry_reply);
-    }
-  }
-
   free(window->name);
   window->name = nullptr;
   free(window->clazz);
@@ -1237,8 +1449,11 @@ void sl_handle_map_request(struct sl_context* ctx,
   window->decorated = 1;
   window->size_flags = 0;
   window->dark_frame = 0;
+  // The client may have set its own state while unmapped.
+  window->net_wm_state_written = false;
 
   for (unsigned i = 0; i < ARRAY_SIZE(properties); ++i) {
+    ctx->metrics.x_round_trips++;
     xcb_get_property_reply_t* reply = xcb()->get_property_reply(
         ctx->connection, property_cookies[i], nullptr);
 
@@ -1301,6 +1516,12 @@ void sl_handle_map_request(struct sl_context* ctx,
           window->client_leader =
               *(reinterpret_cast<uint32_t*>(xcb()->get_property_value(reply)));
           value_int = window->client_leader;
+          // The startup ID may have to come from the client leader. Ask for
+          // it now, so the reply arrives with the ones still outstanding.
+          leader_startup_id_cookie = xcb()->get_property(
+              ctx->connection, 0, window->client_leader,
+              ctx->atoms[ATOM_NET_STARTUP_ID].value, XCB_ATOM_ANY, 0, 2048);
+          leader_startup_id_requested = true;
         }
         break;
       case PROPERTY_WM_PROTOCOLS:
@@ -1438,15 +1659,12 @@ void sl_handle_map_request(struct sl_context* ctx,
     window->size_flags |= size_hints.flags & (US_POSITION | P_POSITION);
 
   // If startup ID is not set, then try the client leader window.
-  if (!window->startup_id && window->client_leader) {
+  if (leader_startup_id_requested) {
+    ctx->metrics.x_round_trips++;
     xcb_get_property_reply_t* reply = xcb()->get_property_reply(
-        ctx->connection,
-        xcb()->get_property(ctx->connection, 0, window->client_leader,
-                            ctx->atoms[ATOM_NET_STARTUP_ID].value, XCB_ATOM_ANY,
-                            0, 2048),
-        nullptr);
+        ctx->connection, leader_startup_id_cookie, nullptr);
     if (reply) {
-      if (reply->type != XCB_ATOM_NONE) {
+      if (!window->startup_id && reply->type != XCB_ATOM_NONE) {
         window->startup_id =
             strndup(static_cast<char*>(xcb()->get_property_value(reply)),
                     xcb()->get_property_value_length(reply));
@@ -1512,7 +1730,7 @@ void sl_handle_map_request(struct sl_context* ctx,
                 XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT;
     values[2] = ctx->colormaps[depth];
 
-    window->frame_id = xcb()->generate_id(ctx->connection);
+    sl_window_set_frame_id(window, xcb()->generate_id(ctx->connection));
     xcb()->create_window(
         ctx->connection, depth, window->frame_id, ctx->screen->root, window->x,
         window->y, window->width, window->height, 0,
@@ -1542,7 +1760,13 @@ void sl_handle_map_request(struct sl_context* ctx,
 }
 
 static void sl_handle_map_notify(struct sl_context* ctx,
-                                 xcb_map_notify_event_t* event) {}
+                                 xcb_map_notify_event_t* event) {
+  struct sl_window* window = sl_lookup_window(ctx, event->window);
+
+  // Override-redirect windows get no map request.
+  if (window)
+    sl_window_resolve_geometry(window);
+}
 
 void sl_handle_unmap_notify(struct sl_context* ctx,
                             xcb_unmap_notify_event_t* event) {
@@ -1575,7 +1799,7 @@ void sl_handle_unmap_notify(struct sl_context* ctx,
     xcb_reparent_window(ctx->connection, window->id, ctx->screen->root,
                         window->x, window->y);
     xcb_destroy_window(ctx->connection, window->frame_id);
-    window->frame_id = XCB_WINDOW_NONE;
+    sl_window_set_frame_id(window, XCB_WINDOW_NONE);
   }
 
   // Reset properties to unmanaged state in case the window transitions to
@@ -1652,10 +1876,12 @@ void sl_handle_configure_request(struct sl_context* ctx,
   }
 
   sl_adjust_window_size_for_screen_size(window);
-  if (window->size_flags & (US_POSITION | P_POSITION))
+  if (window->size_flags & (US_POSITION | P_POSITION)) {
+    window->dirty |= SL_WINDOW_DIRTY_PARENT;
     sl_window_update(window);
-  else
+  } else {
     sl_adjust_window_position_for_screen_size(window);
+  }
 
   // Populate values[0~3] with x,y,w,h
   sl_window_get_x_y(window, &values[0], &values[1]);
@@ -1702,6 +1928,7 @@ static void sl_handle_configure_notify(struct sl_context* ctx,
     return;
 
   if (event->window == ctx->screen->root) {
+    ctx->metrics.x_round_trips++;
     xcb_get_geometry_reply_t* geometry_reply = xcb_get_geometry_reply(
         ctx->connection, xcb_get_geometry(ctx->connection, event->window),
         nullptr);
@@ -1752,12 +1979,14 @@ static void sl_handle_configure_notify(struct sl_context* ctx,
   if (window->managed)
     return;
 
+  sl_window_resolve_geometry(window);
   window->width = event->width;
   window->height = event->height;
   window->border_width = event->border_width;
   if (event->x != window->x || event->y != window->y) {
     window->x = event->x;
     window->y = event->y;
+    window->dirty |= SL_WINDOW_DIRTY_PARENT;
     sl_window_update(window);
   }
 }
@@ -1805,16 +2034,9 @@ void sl_handle_client_message(struct sl_context* ctx,
     perfetto_annotate_window(ctx, p, "event->window", event->window);
   });
   if (event->type == ctx->atoms[ATOM_WL_SURFACE_ID].value) {
-    struct sl_window *window, *unpaired_window = nullptr;
-
-    wl_list_for_each(window, &ctx->unpaired_windows, link) {
-      if (sl_is_window(window, event->window)) {
-        unpaired_window = window;
-        break;
-      }
-    }
+    struct sl_window* unpaired_window = sl_lookup_window(ctx, event->window);
 
-    if (unpaired_window) {
+    if (unpaired_window && unpaired_window->unpaired) {
       unpaired_window->host_surface_id = event->data.data32[0];
       sl_window_update(unpaired_window);
     }
@@ -2006,6 +2228,8 @@ void sl_handle_focus_in(struct sl_context* ctx, xcb_focus_in_event_t* event) {
       xcb_flush(window->ctx->connection);
 
       window->iconified = 0;
+      if (window->paired_surface)
+        sl_host_surface_release_hidden(window->paired_surface);
     }
   }
 }
@@ -2013,102 +2237,141 @@ void sl_handle_focus_in(struct sl_context* ctx, xcb_focus_in_event_t* event) {
 static void sl_handle_focus_out(struct sl_context* ctx,
                                 xcb_focus_out_event_t* event) {}
 
-int sl_begin_data_source_send(struct sl_context* ctx,
-                              int fd,
-                              xcb_intern_atom_cookie_t cookie,
-                              struct sl_data_source* data_source) {
-  xcb_intern_atom_reply_t* reply =
-      xcb_intern_atom_reply(ctx->connection, cookie, nullptr);
+// Returns the transfer delivered in |property|, if any.
+static struct sl_selection_send* sl_lookup_selection_send(
+    struct sl_context* ctx, xcb_atom_t property) {
+  struct sl_selection_send* send;
 
-  if (!reply) {
-    close(fd);
-    return 0;
+  wl_list_for_each(send, &ctx->selection_sends, link) {
+    if (send->property == property)
+      return send;
+  }
+  return nullptr;
+}
+
+// Returns a property no transfer is using, or XCB_ATOM_NONE if all are.
+static xcb_atom_t sl_free_selection_send_property(struct sl_context* ctx) {
+  for (int i = 0; i < SL_MAX_SELECTION_SENDS; i++) {
+    xcb_atom_t property = ctx->atoms[ATOM_WL_SELECTION_SEND_0 + i].value;
+
+    if (!sl_lookup_selection_send(ctx, property))
+      return property;
+  }
+  return XCB_ATOM_NONE;
+}
+
+// Asks the X11 selection owner for the data of |send|, on a free property.
+// Takes ownership of |send| and returns false if that fails.
+static bool sl_begin_data_source_send(struct sl_context* ctx,
+                                      struct sl_selection_send* send) {
+  if (send->target == XCB_ATOM_NONE) {
+    ctx->metrics.x_round_trips++;
+    xcb_intern_atom_reply_t* reply =
+        xcb_intern_atom_reply(ctx->connection, send->cookie, nullptr);
+
+    if (!reply) {
+      close(send->fd);
+      delete send;
+      return false;
+    }
+    send->target = reply->atom;
+    sl_cache_atom_name(ctx, send->target, send->mime_type);
+    free(reply);
   }
 
   int flags, rv;
 
+  send->property = sl_free_selection_send_property(ctx);
+  assert(send->property != XCB_ATOM_NONE);
   xcb_convert_selection(ctx->connection, ctx->selection_window,
-                        ctx->atoms[ATOM_CLIPBOARD].value, reply->atom,
-                        ctx->atoms[ATOM_WL_SELECTION].value, XCB_CURRENT_TIME);
+                        ctx->atoms[ATOM_CLIPBOARD].value, send->target,
+                        send->property, XCB_CURRENT_TIME);
 
-  flags = fcntl(fd, F_GETFL, 0);
-  rv = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  flags = fcntl(send->fd, F_GETFL, 0);
+  rv = fcntl(send->fd, F_SETFL, flags | O_NONBLOCK);
   errno_assert(!rv);
 
-  ctx->selection_data_source_send_fd = fd;
-  free(reply);
-  return 1;
+  wl_list_insert(ctx->selection_sends.prev, &send->link);
+  return true;
 }
 
-void sl_process_data_source_send_pending_list(struct sl_context* ctx) {
-  while (!wl_list_empty(&ctx->selection_data_source_send_pending)) {
+static void sl_process_data_source_send_pending_list(struct sl_context* ctx) {
+  while (!wl_list_empty(&ctx->selection_data_source_send_pending) &&
+         sl_free_selection_send_property(ctx) != XCB_ATOM_NONE) {
     struct wl_list* next = ctx->selection_data_source_send_pending.next;
-    struct sl_data_source_send_request* request;
-    request = wl_container_of(next, request, link);
+    struct sl_selection_send* send;
+    send = wl_container_of(next, send, link);
     wl_list_remove(next);
 
-    int rv = sl_begin_data_source_send(ctx, request->fd, request->cookie,
-                                       request->data_source);
-    free(request);
-    if (rv)
-      break;
+    sl_begin_data_source_send(ctx, send);
   }
 }
 
-static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
-  struct sl_context* ctx = static_cast<sl_context*>(data);
+// Ends |send|, closing its fd, and starts the next transfer waiting for a
+// property.
+static void sl_end_data_source_send(struct sl_selection_send* send) {
+  struct sl_context* ctx = send->ctx;
+
+  wl_list_remove(&send->link);
+  close(send->fd);
+  free(send->property_reply);
+  delete send;
+
+  sl_process_data_source_send_pending_list(ctx);
+}
+
+// Writes as much of the property value held by |send| as |send->fd| takes.
+// Returns false if that ended the transfer, which frees |send|.
+static bool sl_write_selection_send(struct sl_selection_send* send) {
+  struct sl_context* ctx = send->ctx;
   int bytes, bytes_left;
 
-  uint8_t* value = static_cast<uint8_t*>(
-      xcb_get_property_value(ctx->selection_property_reply));
-  bytes_left = xcb_get_property_value_length(ctx->selection_property_reply) -
-               ctx->selection_property_offset;
+  uint8_t* value =
+      static_cast<uint8_t*>(xcb_get_property_value(send->property_reply));
+  bytes_left = xcb_get_property_value_length(send->property_reply) -
+               send->property_offset;
 
-  bytes = write(fd, value + ctx->selection_property_offset, bytes_left);
+  bytes = write(send->fd, value + send->property_offset, bytes_left);
   if (bytes == -1) {
     LOG(ERROR) << "write error to target fd: " << strerror(errno);
-    close(fd);
-    fd = -1;
+    sl_end_data_source_send(send);
+    return false;
   } else if (bytes == bytes_left) {
-    if (ctx->selection_incremental_transfer) {
-      xcb_delete_property(ctx->connection, ctx->selection_window,
-                          ctx->atoms[ATOM_WL_SELECTION].value);
-    } else {
-      close(fd);
-      fd = -1;
+    if (!send->incremental) {
+      sl_end_data_source_send(send);
+      return false;
     }
+    // Deleting the property asks the selection owner for the next chunk.
+    xcb_delete_property(ctx->connection, ctx->selection_window,
+                        send->property);
+    free(send->property_reply);
+    send->property_reply = nullptr;
   } else {
-    ctx->selection_property_offset += bytes;
-    return 1;
+    send->property_offset += bytes;
   }
+  return true;
+}
 
-  free(ctx->selection_property_reply);
-  ctx->selection_property_reply = nullptr;
-  if (ctx->selection_send_event_source) {
-    ctx->selection_send_event_source.reset();
-  }
-  if (fd < 0) {
-    ctx->selection_data_source_send_fd = -1;
-    sl_process_data_source_send_pending_list(ctx);
-  }
+static int sl_handle_selection_fd_writable(int fd, uint32_t mask, void* data) {
+  struct sl_selection_send* send = static_cast<sl_selection_send*>(data);
+  ScopedDispatchTimer dispatch_timer(send->ctx, SL_METRICS_HANDLER_CLIPBOARD);
+
+  if (sl_write_selection_send(send) && !send->property_reply)
+    send->event_source.reset();
   return 1;
 }
 
-static void sl_write_selection_property(struct sl_context* ctx,
+static void sl_write_selection_property(struct sl_selection_send* send,
                                         xcb_get_property_reply_t* reply) {
-  ctx->selection_property_offset = 0;
-  ctx->selection_property_reply = reply;
-  sl_handle_selection_fd_writable(ctx->selection_data_source_send_fd,
-                                  WL_EVENT_WRITABLE, ctx);
-
-  if (!ctx->selection_property_reply)
+  send->property_offset = 0;
+  send->property_reply = reply;
+  if (!sl_write_selection_send(send) || !send->property_reply)
     return;
 
-  assert(!ctx->selection_send_event_source);
-  ctx->selection_send_event_source.reset(wl_event_loop_add_fd(
-      wl_display_get_event_loop(ctx->host_display),
-      ctx->selection_data_source_send_fd, WL_EVENT_WRITABLE,
-      sl_handle_selection_fd_writable, ctx));
+  assert(!send->event_source);
+  send->event_source.reset(wl_event_loop_add_fd(
+      wl_display_get_event_loop(send->ctx->host_display), send->fd,
+      WL_EVENT_WRITABLE, sl_handle_selection_fd_writable, send));
 }
 
 static void sl_send_selection_notify(struct sl_context* ctx,
@@ -2139,31 +2402,62 @@ static void sl_send_selection_data(struct sl_context* ctx) {
 }
 
 static const uint32_t sl_incr_chunk_size = 64 * 1024;
+// Incremental transfers that keep the requestor busy grow their chunks up to
+// this, or the largest property change the X server takes if that is less.
+static const uint32_t sl_incr_max_chunk_size = 4 * 1024 * 1024;
+
+// Makes room for |ctx->selection_chunk_size| bytes of selection data.
+static void sl_reserve_selection_data(struct sl_context* ctx) {
+  size_t size = ctx->selection_data.size;
+
+  if (ctx->selection_data.alloc >= ctx->selection_chunk_size)
+    return;
+
+  // wl_array_add is ostensibly failable, but the only failure case comes from
+  // calling malloc, and if that fails we should just die anyway.
+  errno_assert((size_t)wl_array_add(&ctx->selection_data,
+                                    ctx->selection_chunk_size - size));
+
+  // wl_array_add increments |size| as well as |alloc|, but we don't actually
+  // want that yet. Instead we will set |size| later based on the results of
+  // the read call.
+  ctx->selection_data.size = size;
+}
+
+// Doubles the chunk size of an incremental transfer, so that large
+// selections take fewer round trips to the requestor.
+static void sl_grow_selection_chunk(struct sl_context* ctx) {
+  uint32_t max_chunk_size = sl_incr_max_chunk_size;
+  uint64_t max_request_size =
+      uint64_t{xcb_get_maximum_request_length(ctx->connection)} * 4;
+
+  if (max_request_size > sizeof(xcb_change_property_request_t)) {
+    max_chunk_size = std::min<uint64_t>(
+        max_chunk_size,
+        max_request_size - sizeof(xcb_change_property_request_t));
+  }
+  ctx->selection_chunk_size =
+      std::max(ctx->selection_chunk_size,
+               std::min(ctx->selection_chunk_size * 2, max_chunk_size));
+  sl_reserve_selection_data(ctx);
+}
 
 static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
   struct sl_context* ctx = static_cast<sl_context*>(data);
+  ScopedDispatchTimer dispatch_timer(ctx, SL_METRICS_HANDLER_CLIPBOARD);
 
   // When a selection starts, the wl_array in |ctx->selection_data| is
   // initialized with a size of zero. Since we now need to actually write into
-  // it, allocate |sl_incr_chunk_size| bytes to store the selection data in. We
-  // need to buffer this much to decide between a one-shot transfer and an
-  // incremental transfer, as this decision must be made before the first
-  // response is sent.
-  if (ctx->selection_data.alloc == 0) {
-    // wl_array_add is ostensibly failable, but the only failure case comes from
-    // calling malloc, and if that fails we should just die anyway.
-    errno_assert(
-        (size_t)wl_array_add(&ctx->selection_data, sl_incr_chunk_size));
-
-    // wl_array_add increments |size| as well as |alloc|, but we don't actually
-    // want that yet. Instead we will set |size| later based on the results of
-    // the read call.
-    ctx->selection_data.size -= sl_incr_chunk_size;
-  }
+  // it, allocate |ctx->selection_chunk_size| bytes to store the selection data
+  // in. We need to buffer this much to decide between a one-shot transfer and
+  // an incremental transfer, as this decision must be made before the first
+  // response is sent. Reading goes on into the same buffer once a chunk is
+  // sent, while the requestor is still taking it.
+  sl_reserve_selection_data(ctx);
 
   int offset = ctx->selection_data.size;
   void* p = reinterpret_cast<char*>(ctx->selection_data.data) + offset;
-  int bytes_left = ctx->selection_data.alloc - offset;
+  int bytes_left = ctx->selection_chunk_size - offset;
 
   int bytes = read(fd, p, bytes_left);
   if (bytes == -1) {
@@ -2173,7 +2467,7 @@ static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
     close(fd);
   } else {
     ctx->selection_data.size = offset + bytes;
-    if (ctx->selection_data.size >= sl_incr_chunk_size) {
+    if (ctx->selection_data.size >= ctx->selection_chunk_size) {
       if (!ctx->selection_incremental_transfer) {
         ctx->selection_incremental_transfer = 1;
         xcb_change_property(
@@ -2206,6 +2500,129 @@ static int sl_handle_selection_fd_readable(int fd, uint32_t mask, void* data) {
   return 1;
 }
 
+// Works out the property request sl_handle_property_notify() is going to make
+// for |event|. Returns false if it won't make one.
+static bool sl_property_notify_request(struct sl_context* ctx,
+                                       xcb_property_notify_event_t* event,
+                                       xcb_atom_t* atom,
+                                       xcb_atom_t* type,
+                                       uint32_t* long_length) {
+  struct sl_window* window = sl_lookup_window(ctx, event->window);
+  bool deleted = event->state == XCB_PROPERTY_DELETE;
+
+  if (!window)
+    return false;
+
+  *atom = event->atom;
+  *type = XCB_ATOM_ANY;
+  *long_length = 2048;
+
+  if (event->atom == XCB_ATOM_WM_NAME ||
+      event->atom == ctx->atoms[ATOM_NET_WM_NAME].value) {
+    bool atom_is_net_wm_name =
+        event->atom == ctx->atoms[ATOM_NET_WM_NAME].value;
+    if (!atom_is_net_wm_name && window->has_net_wm_name)
+      return false;
+    if (deleted && !atom_is_net_wm_name)
+      return false;
+    if (deleted)
+      *atom = XCB_ATOM_WM_NAME;
+    return true;
+  } else if (event->atom == ctx->atoms[ATOM_STEAM_GAME].value) {
+    *type = XCB_ATOM_CARDINAL;
+    *long_length = 1;
+    return true;
+  } else if (event->atom ==
+             ctx->atoms[ATOM_XWAYLAND_RANDR_EMU_MONITOR_RECTS].value) {
+    *type = XCB_ATOM_CARDINAL;
+    return true;
+  }
+
+  if (deleted)
+    return false;
+
+  if (event->atom == XCB_ATOM_WM_CLASS ||
+      event->atom == ctx->atoms[ATOM_GTK_THEME_VARIANT].value) {
+    return true;
+  } else if (event->atom == ctx->application_id_property_atom) {
+    *type = XCB_ATOM_CARDINAL;
+    *long_length = 1;
+    return true;
+  } else if (event->atom == XCB_ATOM_WM_NORMAL_HINTS) {
+    *long_length = sizeof(struct sl_wm_size_hints);
+    return true;
+  } else if (event->atom == XCB_ATOM_WM_HINTS) {
+    *long_length = sizeof(struct sl_wm_hints);
+    return true;
+  } else if (event->atom == ctx->atoms[ATOM_MOTIF_WM_HINTS].value) {
+    *long_length = sizeof(struct sl_mwm_hints);
+    return true;
+  }
+
+  return false;
+}
+
+// Sends the property requests for a batch of PropertyNotify events up front,
+// so that their handlers share a single round trip instead of making one
+// each. None of the prefetched properties are ones that handlers change
+// themselves, so fetching them before the earlier events are handled gives
+// the same values.
+static void sl_prefetch_properties(
+    struct sl_context* ctx, const std::vector<xcb_generic_event_t*>& events) {
+  for (xcb_generic_event_t* event : events) {
+    if ((event->response_type & ~SEND_EVENT_MASK) != XCB_PROPERTY_NOTIFY)
+      continue;
+
+    xcb_property_notify_event_t* property_event =
+        reinterpret_cast<xcb_property_notify_event_t*>(event);
+    struct sl_property_prefetch prefetch;
+    if (!sl_property_notify_request(ctx, property_event, &prefetch.atom,
+                                    &prefetch.type, &prefetch.long_length)) {
+      continue;
+    }
+
+    prefetch.window = property_event->window;
+    prefetch.cookie = xcb()->get_property(ctx->connection, 0, prefetch.window,
+                                          prefetch.atom, prefetch.type, 0,
+                                          prefetch.long_length);
+    ctx->property_prefetches.push_back(prefetch);
+  }
+}
+
+// Collects the replies to prefetched requests no handler ended up using.
+static void sl_discard_property_prefetches(struct sl_context* ctx) {
+  for (struct sl_property_prefetch& prefetch : ctx->property_prefetches)
+    free(xcb()->get_property_reply(ctx->connection, prefetch.cookie, nullptr));
+  ctx->property_prefetches.clear();
+}
+
+// Gets a property, using the reply to a matching prefetched request if there
+// is one.
+static xcb_get_property_reply_t* sl_get_property_reply(struct sl_context* ctx,
+                                                       xcb_window_t window,
+                                                       xcb_atom_t atom,
+                                                       xcb_atom_t type,
+                                                       uint32_t long_length) {
+  std::vector<struct sl_property_prefetch>& prefetches =
+      ctx->property_prefetches;
+
+  for (auto it = prefetches.begin(); it != prefetches.end(); ++it) {
+    if (it->window == window && it->atom == atom && it->type == type &&
+        it->long_length == long_length) {
+      xcb_get_property_cookie_t cookie = it->cookie;
+      prefetches.erase(it);
+      return xcb()->get_property_reply(ctx->connection, cookie, nullptr);
+    }
+  }
+
+  ctx->metrics.x_round_trips++;
+  return xcb()->get_property_reply(
+      ctx->connection,
+      xcb()->get_property(ctx->connection, 0, window, atom, type, 0,
+                          long_length),
+      nullptr);
+}
+
 void sl_handle_property_notify(struct sl_context* ctx,
                                xcb_property_notify_event_t* event) {
   TRACE_EVENT("x11wm", "XCB_PROPERTY_NOTIFY", [&](perfetto::EventContext p) {
@@ -2240,11 +2657,8 @@ void sl_handle_property_notify(struct sl_context* ctx,
       atom = XCB_ATOM_WM_NAME;
 
     if (atom != XCB_ATOM_NONE) {
-      xcb_get_property_reply_t* reply = xcb()->get_property_reply(
-          ctx->connection,
-          xcb()->get_property(ctx->connection, 0, window->id, atom,
-                              XCB_ATOM_ANY, 0, 2048),
-          nullptr);
+      xcb_get_property_reply_t* reply =
+          sl_get_property_reply(ctx, window->id, atom, XCB_ATOM_ANY, 2048);
       if (reply) {
         window->name =
             strndup(static_cast<char*>(xcb()->get_property_value(reply)),
@@ -2270,11 +2684,8 @@ void sl_handle_property_notify(struct sl_context* ctx,
     if (!window || event->state == XCB_PROPERTY_DELETE)
       return;
 
-    xcb_get_property_cookie_t cookie =
-        xcb()->get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_CLASS,
-                            XCB_ATOM_ANY, 0, 2048);
-    xcb_get_property_reply_t* reply =
-        xcb()->get_property_reply(ctx->connection, cookie, nullptr);
+    xcb_get_property_reply_t* reply = sl_get_property_reply(
+        ctx, window->id, XCB_ATOM_WM_CLASS, XCB_ATOM_ANY, 2048);
     if (reply) {
       sl_decode_wm_class(window, reply);
       free(reply);
@@ -2283,10 +2694,8 @@ void sl_handle_property_notify(struct sl_context* ctx,
   } else if (event->atom == ctx->atoms[ATOM_STEAM_GAME].value) {
     struct sl_window* window = sl_lookup_window(ctx, event->window);
     if (window) {
-      xcb_get_property_cookie_t cookie = xcb()->get_property(
-          ctx->connection, 0, window->id, event->atom, XCB_ATOM_CARDINAL, 0, 1);
-      xcb_get_property_reply_t* reply =
-          xcb()->get_property_reply(ctx->connection, cookie, nullptr);
+      xcb_get_property_reply_t* reply = sl_get_property_reply(
+          ctx, window->id, event->atom, XCB_ATOM_CARDINAL, 1);
       on_steam_game_id_updated(ctx, window, reply);
     }
   } else if (event->atom == ctx->application_id_property_atom) {
@@ -2297,11 +2706,9 @@ void sl_handle_property_notify(struct sl_context* ctx,
     // TODO(cpelling): Support other atom types (e.g. strings) if/when a use
     // case arises. The current use case is for cardinals (uint32) but this
     // is easy enough to extend later.
-    xcb_get_property_cookie_t cookie = xcb()->get_property(
-        ctx->connection, 0, window->id, ctx->application_id_property_atom,
-        XCB_ATOM_CARDINAL, 0, 1);
-    xcb_get_property_reply_t* reply =
-        xcb()->get_property_reply(ctx->connection, cookie, nullptr);
+    xcb_get_property_reply_t* reply = sl_get_property_reply(
+        ctx, window->id, ctx->application_id_property_atom, XCB_ATOM_CARDINAL,
+        1);
     if (reply) {
       sl_set_application_id_from_atom(ctx, window, reply);
       sl_update_application_id(ctx, window);
@@ -2317,12 +2724,9 @@ void sl_handle_property_notify(struct sl_context* ctx,
 
     if (event->state != XCB_PROPERTY_DELETE) {
       struct sl_wm_size_hints size_hints = {0};
-      xcb_get_property_reply_t* reply = xcb()->get_property_reply(
-          ctx->connection,
-          xcb()->get_property(ctx->connection, 0, window->id,
-                              XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_ANY, 0,
-                              sizeof(size_hints)),
-          nullptr);
+      xcb_get_property_reply_t* reply =
+          sl_get_property_reply(ctx, window->id, XCB_ATOM_WM_NORMAL_HINTS,
+                                XCB_ATOM_ANY, sizeof(size_hints));
       if (reply) {
         memcpy(&size_hints, xcb()->get_property_value(reply),
                sizeof(size_hints));
@@ -2388,11 +2792,8 @@ void sl_handle_property_notify(struct sl_context* ctx,
     if (event->state == XCB_PROPERTY_DELETE)
       return;
     struct sl_wm_hints wm_hints = {0};
-    xcb_get_property_reply_t* reply = xcb()->get_property_reply(
-        ctx->connection,
-        xcb()->get_property(ctx->connection, 0, window->id, XCB_ATOM_WM_HINTS,
-                            XCB_ATOM_ANY, 0, sizeof(wm_hints)),
-        nullptr);
+    xcb_get_property_reply_t* reply = sl_get_property_reply(
+        ctx, window->id, XCB_ATOM_WM_HINTS, XCB_ATOM_ANY, sizeof(wm_hints));
 
     if (!reply)
       return;
@@ -2412,12 +2813,9 @@ void sl_handle_property_notify(struct sl_context* ctx,
 
     if (event->state != XCB_PROPERTY_DELETE) {
       struct sl_mwm_hints mwm_hints = {0};
-      xcb_get_property_reply_t* reply = xcb()->get_property_reply(
-          ctx->connection,
-          xcb()->get_property(ctx->connection, 0, window->id,
-                              ctx->atoms[ATOM_MOTIF_WM_HINTS].value,
-                              XCB_ATOM_ANY, 0, sizeof(mwm_hints)),
-          nullptr);
+      xcb_get_property_reply_t* reply = sl_get_property_reply(
+          ctx, window->id, ctx->atoms[ATOM_MOTIF_WM_HINTS].value, XCB_ATOM_ANY,
+          sizeof(mwm_hints));
       if (reply) {
         if (xcb()->get_property_value_length(reply) >=
             static_cast<int>(sizeof(mwm_hints))) {
@@ -2453,12 +2851,9 @@ void sl_handle_property_notify(struct sl_context* ctx,
     window->dark_frame = 0;
 
     if (event->state != XCB_PROPERTY_DELETE) {
-      xcb_get_property_reply_t* reply = xcb()->get_property_reply(
-          ctx->connection,
-          xcb()->get_property(ctx->connection, 0, window->id,
-                              ctx->atoms[ATOM_GTK_THEME_VARIANT].value,
-                              XCB_ATOM_ANY, 0, 2048),
-          nullptr);
+      xcb_get_property_reply_t* reply = sl_get_property_reply(
+          ctx, window->id, ctx->atoms[ATOM_GTK_THEME_VARIANT].value,
+          XCB_ATOM_ANY, 2048);
       if (reply) {
         if (xcb()->get_property_value_length(reply) >= 4)
           window->dark_frame = !strcmp(
@@ -2486,13 +2881,10 @@ void sl_handle_property_notify(struct sl_context* ctx,
       return;
     }
 
-    xcb_get_property_reply_t* reply = xcb()->get_property_reply(
-        ctx->connection,
-        xcb()->get_property(
-            ctx->connection, 0, window->id,
-            ctx->atoms[ATOM_XWAYLAND_RANDR_EMU_MONITOR_RECTS].value,
-            XCB_ATOM_CARDINAL, 0, 2048),
-        nullptr);
+    xcb_get_property_reply_t* reply = sl_get_property_reply(
+        ctx, window->id,
+        ctx->atoms[ATOM_XWAYLAND_RANDR_EMU_MONITOR_RECTS].value,
+        XCB_ATOM_CARDINAL, 2048);
 
     xcb_get_property_reply_t* reply_for_trace =
         static_cast<xcb_get_property_reply_t*>(
@@ -2577,29 +2969,28 @@ void sl_handle_property_notify(struct sl_context* ctx,
     window->use_emulated_rects = false;
     free(reply);
 
-  } else if (event->atom == ctx->atoms[ATOM_WL_SELECTION].value) {
-    if (event->window == ctx->selection_window &&
-        event->state == XCB_PROPERTY_NEW_VALUE &&
-        ctx->selection_incremental_transfer) {
+  } else if (event->window == ctx->selection_window &&
+             sl_lookup_selection_send(ctx, event->atom)) {
+    struct sl_selection_send* send = sl_lookup_selection_send(ctx, event->atom);
+
+    if (event->state == XCB_PROPERTY_NEW_VALUE && send->incremental) {
+      ctx->metrics.x_round_trips++;
       xcb_get_property_reply_t* reply = xcb()->get_property_reply(
           ctx->connection,
           xcb()->get_property(ctx->connection, 0, ctx->selection_window,
-                              ctx->atoms[ATOM_WL_SELECTION].value,
-                              XCB_GET_PROPERTY_TYPE_ANY, 0, 0x1fffffff),
+                              send->property, XCB_GET_PROPERTY_TYPE_ANY, 0,
+                              0x1fffffff),
           nullptr);
 
       if (!reply)
         return;
 
       if (xcb()->get_property_value_length(reply) > 0) {
-        sl_write_selection_property(ctx, reply);
+        sl_write_selection_property(send, reply);
       } else {
-        assert(!ctx->selection_send_event_source);
-        close(ctx->selection_data_source_send_fd);
-        ctx->selection_data_source_send_fd = -1;
+        assert(!send->event_source);
         free(reply);
-
-        sl_process_data_source_send_pending_list(ctx);
+        sl_end_data_source_send(send);
       }
     }
   } else if (event->atom == ctx->selection_request.property) {
@@ -2616,6 +3007,11 @@ void sl_handle_property_notify(struct sl_context* ctx,
         if (data_size)
           sl_send_selection_data(ctx);
 
+        // A full chunk was waiting on the requestor, so the data source
+        // keeps up and bigger chunks save round trips.
+        if (data_size >= ctx->selection_chunk_size)
+          sl_grow_selection_chunk(ctx);
+
         if (!ctx->selection_event_source) {
           ctx->selection_event_source.reset(wl_event_loop_add_fd(
               wl_display_get_event_loop(ctx->host_display),
@@ -2644,20 +3040,28 @@ static void sl_internal_data_source_send(void* data,
   struct sl_data_source* host = static_cast<sl_data_source*>(data);
   struct sl_context* ctx = host->ctx;
 
-  xcb_intern_atom_cookie_t cookie =
-      xcb_intern_atom(ctx->connection, false, strlen(mime_type), mime_type);
-
-  if (ctx->selection_data_source_send_fd < 0) {
-    sl_begin_data_source_send(ctx, fd, cookie, host);
+  struct sl_selection_send* send = new sl_selection_send();
+  send->ctx = ctx;
+  send->fd = fd;
+  send->mime_type = mime_type;
+  send->data_source = host;
+  // Targets offered by X11 clients are cached, so this rarely needs a round
+  // trip.
+  send->target = sl_lookup_cached_atom(ctx, mime_type);
+  if (send->target == XCB_ATOM_NONE) {
+    send->cookie =
+        xcb_intern_atom(ctx->connection, false, strlen(mime_type), mime_type);
+  }
+  send->property = XCB_ATOM_NONE;
+  send->incremental = 0;
+  send->property_reply = nullptr;
+  send->property_offset = 0;
+
+  // Transfers beyond the number of properties we have wait their turn.
+  if (sl_free_selection_send_property(ctx) != XCB_ATOM_NONE) {
+    sl_begin_data_source_send(ctx, send);
   } else {
-    struct sl_data_source_send_request* request =
-        static_cast<sl_data_source_send_request*>(
-            malloc(sizeof(struct sl_data_source_send_request)));
-
-    request->fd = fd;
-    request->cookie = cookie;
-    request->data_source = host;
-    wl_list_insert(&ctx->selection_data_source_send_pending, &request->link);
+    wl_list_insert(ctx->selection_data_source_send_pending.prev, &send->link);
   }
 }
 
@@ -2688,6 +3092,28 @@ char* sl_copy_atom_name(xcb_get_atom_name_reply_t* reply) {
   return name;
 }
 
+// Caches the names sl_request_atom_name() asked for that have arrived.
+static void sl_receive_atom_names(struct sl_context* ctx) {
+  auto it = ctx->atom_name_requests.begin();
+  while (it != ctx->atom_name_requests.end()) {
+    void* reply = nullptr;
+    xcb_generic_error_t* error = nullptr;
+    if (!xcb_poll_for_reply(ctx->connection, it->second, &reply, &error)) {
+      ++it;
+      continue;
+    }
+    if (reply) {
+      char* name =
+          sl_copy_atom_name(static_cast<xcb_get_atom_name_reply_t*>(reply));
+      sl_cache_atom_name(ctx, it->first, name);
+      free(name);
+      free(reply);
+    }
+    free(error);
+    it = ctx->atom_name_requests.erase(it);
+  }
+}
+
 static void sl_get_selection_targets(struct sl_context* ctx) {
   TRACE_EVENT("other", "sl_get_selection_targets");
   struct sl_data_source* data_source = nullptr;
@@ -2695,6 +3121,7 @@ static void sl_get_selection_targets(struct sl_context* ctx) {
   xcb_atom_t* value;
   uint32_t i;
 
+  ctx->metrics.x_round_trips++;
   reply = xcb_get_property_reply(
       ctx->connection,
       xcb_get_property(ctx->connection, 1, ctx->selection_window,
@@ -2726,24 +3153,31 @@ static void sl_get_selection_targets(struct sl_context* ctx) {
     // round trip to the X server, but none of the requests depend on each
     // other. Therefore, we can speed things up by sending out all the requests
     // as a batch with xcb_get_atom_name, and then read all the replies as a
-    // batch with xcb_get_atom_name_reply.
-    xcb_get_atom_name_cookie_t* atom_name_cookies =
-        static_cast<xcb_get_atom_name_cookie_t*>(
-            malloc(sizeof(xcb_get_atom_name_cookie_t) * reply->value_len));
+    // batch with xcb_get_atom_name_reply. Names we already know need no
+    // request at all.
+    std::vector<xcb_get_atom_name_cookie_t> atom_name_cookies(reply->value_len);
     for (i = 0; i < reply->value_len; i++) {
-      atom_name_cookies[i] = xcb_get_atom_name(ctx->connection, value[i]);
+      if (!sl_lookup_cached_atom_name(ctx, value[i]))
+        atom_name_cookies[i] = xcb_get_atom_name(ctx->connection, value[i]);
     }
     for (i = 0; i < reply->value_len; i++) {
+      if (!atom_name_cookies[i].sequence) {
+        const std::string* name = sl_lookup_cached_atom_name(ctx, value[i]);
+        wl_data_source_offer(data_source->internal, name->c_str());
+        continue;
+      }
+
+      ctx->metrics.x_round_trips++;
       xcb_get_atom_name_reply_t* atom_name_reply = xcb_get_atom_name_reply(
           ctx->connection, atom_name_cookies[i], nullptr);
       if (atom_name_reply) {
         char* name = sl_copy_atom_name(atom_name_reply);
         wl_data_source_offer(data_source->internal, name);
+        sl_cache_atom_name(ctx, value[i], name);
         free(atom_name_reply);
         free(name);
       }
     }
-    free(atom_name_cookies);
 
     if (ctx->selection_data_device && ctx->default_seat) {
       wl_data_device_set_selection(ctx->selection_data_device,
@@ -2761,35 +3195,56 @@ static void sl_get_selection_targets(struct sl_context* ctx) {
   free(reply);
 }
 
-static void sl_get_selection_data(struct sl_context* ctx) {
+static void sl_get_selection_data(struct sl_selection_send* send) {
   TRACE_EVENT("other", "sl_get_selection_data");
+  struct sl_context* ctx = send->ctx;
+  ctx->metrics.x_round_trips++;
   xcb_get_property_reply_t* reply = xcb_get_property_reply(
       ctx->connection,
       xcb_get_property(ctx->connection, 1, ctx->selection_window,
-                       ctx->atoms[ATOM_WL_SELECTION].value,
-                       XCB_GET_PROPERTY_TYPE_ANY, 0, 0x1fffffff),
+                       send->property, XCB_GET_PROPERTY_TYPE_ANY, 0,
+                       0x1fffffff),
       nullptr);
-  if (!reply)
+  if (!reply) {
+    sl_end_data_source_send(send);
     return;
+  }
 
   if (reply->type == ctx->atoms[ATOM_INCR].value) {
-    ctx->selection_incremental_transfer = 1;
+    send->incremental = 1;
     free(reply);
   } else {
-    ctx->selection_incremental_transfer = 0;
-    sl_write_selection_property(ctx, reply);
+    send->incremental = 0;
+    sl_write_selection_property(send, reply);
   }
 }
 
 static void sl_handle_selection_notify(struct sl_context* ctx,
                                        xcb_selection_notify_event_t* event) {
-  if (event->property == XCB_ATOM_NONE)
+  struct sl_selection_send* send;
+
+  if (event->target == ctx->atoms[ATOM_TARGETS].value) {
+    if (event->property != XCB_ATOM_NONE)
+      sl_get_selection_targets(ctx);
+    return;
+  }
+
+  if (event->property != XCB_ATOM_NONE) {
+    send = sl_lookup_selection_send(ctx, event->property);
+    if (send)
+      sl_get_selection_data(send);
     return;
+  }
 
-  if (event->target == ctx->atoms[ATOM_TARGETS].value)
-    sl_get_selection_targets(ctx);
-  else
-    sl_get_selection_data(ctx);
+  // The owner refused a conversion, so end the oldest transfer of that
+  // target rather than leave it holding a property forever.
+  wl_list_for_each(send, &ctx->selection_sends, link) {
+    if (send->target == event->target && !send->incremental &&
+        !send->property_reply) {
+      sl_end_data_source_send(send);
+      return;
+    }
+  }
 }
 
 static void sl_send_targets(struct sl_context* ctx) {
@@ -2829,12 +3284,15 @@ static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
   ctx->selection_data_type = data_type;
 
   // We will need the name of this atom later to tell the wayland server what
-  // type of data to send us, so start the request now.
-  xcb_get_atom_name_cookie_t atom_name_cookie =
-      xcb_get_atom_name(ctx->connection, data_type);
+  // type of data to send us, so start the request now unless it's cached.
+  const std::string* cached_name = sl_lookup_cached_atom_name(ctx, data_type);
+  xcb_get_atom_name_cookie_t atom_name_cookie = {};
+  if (!cached_name)
+    atom_name_cookie = xcb_get_atom_name(ctx->connection, data_type);
 
   wl_array_init(&ctx->selection_data);
   ctx->selection_data_ack_pending = 0;
+  ctx->selection_chunk_size = sl_incr_chunk_size;
 
   if (ctx->channel == nullptr) {
     // Running in noop mode, without virtualization.
@@ -2858,17 +3316,24 @@ static void sl_send_data(struct sl_context* ctx, xcb_atom_t data_type) {
     fd_to_wayland = pipe_fd;
   }
 
-  xcb_get_atom_name_reply_t* atom_name_reply =
-      xcb_get_atom_name_reply(ctx->connection, atom_name_cookie, nullptr);
-  if (atom_name_reply) {
+  if (!cached_name) {
+    ctx->metrics.x_round_trips++;
+    xcb_get_atom_name_reply_t* atom_name_reply =
+        xcb_get_atom_name_reply(ctx->connection, atom_name_cookie, nullptr);
+    if (atom_name_reply) {
+      char* name = sl_copy_atom_name(atom_name_reply);
+      sl_cache_atom_name(ctx, data_type, name);
+      cached_name = sl_lookup_cached_atom_name(ctx, data_type);
+      free(atom_name_reply);
+      free(name);
+    }
+  }
+  if (cached_name) {
     // If we got the atom name, then send the request to wayland and add our end
     // of the pipe to the wayland event loop.
     ctx->selection_data_offer_receive_fd = fd_to_receive;
-    char* name = sl_copy_atom_name(atom_name_reply);
-    wl_data_offer_receive(ctx->selection_data_offer->internal, name,
-                          fd_to_wayland);
-    free(atom_name_reply);
-    free(name);
+    wl_data_offer_receive(ctx->selection_data_offer->internal,
+                          cached_name->c_str(), fd_to_wayland);
 
     ctx->selection_event_source.reset(wl_event_loop_add_fd(
         wl_display_get_event_loop(ctx->host_display),
@@ -2943,6 +3408,16 @@ static void sl_handle_xfixes_selection_notify(
     return;
   }
 
+  // The same owner and selection timestamp is the same selection, whose
+  // targets we still offer, so there is nothing to ask the owner again.
+  if (ctx->selection_data_source &&
+      event->owner == ctx->selection_targets_owner &&
+      event->selection_timestamp == ctx->selection_targets_timestamp) {
+    return;
+  }
+  ctx->selection_targets_owner = event->owner;
+  ctx->selection_targets_timestamp = event->selection_timestamp;
+
   ctx->selection_incremental_transfer = 0;
   xcb_convert_selection(ctx->connection, ctx->selection_window,
                         ctx->atoms[ATOM_CLIPBOARD].value,
@@ -2950,103 +3425,192 @@ static void sl_handle_xfixes_selection_notify(
                         ctx->atoms[ATOM_WL_SELECTION].value, event->timestamp);
 }
 
-static int sl_handle_x_connection_event(int fd, uint32_t mask, void* data) {
-  TRACE_EVENT("other", "sl_handle_x_connection_event");
-  struct sl_context* ctx = (struct sl_context*)data;
-  xcb_generic_event_t* event;
-  uint32_t count = 0;
+static void sl_dispatch_x_event(struct sl_context* ctx,
+                                xcb_generic_event_t* event) {
+  switch (event->response_type & ~SEND_EVENT_MASK) {
+    case XCB_CREATE_NOTIFY:
+      sl_handle_create_notify(
+          ctx, reinterpret_cast<xcb_create_notify_event_t*>(event));
+      break;
+    case XCB_DESTROY_NOTIFY:
+      sl_handle_destroy_notify(
+          ctx, reinterpret_cast<xcb_destroy_notify_event_t*>(event));
+      break;
+    case XCB_REPARENT_NOTIFY:
+      sl_handle_reparent_notify(
+          ctx, reinterpret_cast<xcb_reparent_notify_event_t*>(event));
+      break;
+    case XCB_MAP_REQUEST:
+      sl_handle_map_request(
+          ctx, reinterpret_cast<xcb_map_request_event_t*>(event));
+      break;
+    case XCB_MAP_NOTIFY:
+      sl_handle_map_notify(ctx,
+                           reinterpret_cast<xcb_map_notify_event_t*>(event));
+      break;
+    case XCB_UNMAP_NOTIFY:
+      sl_handle_unmap_notify(
+          ctx, reinterpret_cast<xcb_unmap_notify_event_t*>(event));
+      break;
+    case XCB_CONFIGURE_REQUEST:
+      sl_handle_configure_request(
+          ctx, reinterpret_cast<xcb_configure_request_event_t*>(event));
+      break;
+    case XCB_CONFIGURE_NOTIFY:
+      sl_handle_configure_notify(
+          ctx, reinterpret_cast<xcb_configure_notify_event_t*>(event));
+      break;
+    case XCB_CLIENT_MESSAGE:
+      sl_handle_client_message(
+          ctx, reinterpret_cast<xcb_client_message_event_t*>(event));
+      break;
+    case XCB_FOCUS_IN:
+      sl_handle_focus_in(ctx, reinterpret_cast<xcb_focus_in_event_t*>(event));
+      break;
+    case XCB_FOCUS_OUT:
+      sl_handle_focus_out(ctx,
+                          reinterpret_cast<xcb_focus_out_event_t*>(event));
+      break;
+    case XCB_PROPERTY_NOTIFY:
+      sl_handle_property_notify(
+          ctx, reinterpret_cast<xcb_property_notify_event_t*>(event));
+      break;
+    case XCB_SELECTION_NOTIFY:
+      sl_handle_selection_notify(
+          ctx, reinterpret_cast<xcb_selection_notify_event_t*>(event));
+      break;
+    case XCB_SELECTION_REQUEST:
+      sl_handle_selection_request(
+          ctx, reinterpret_cast<xcb_selection_request_event_t*>(event));
+      break;
+  }
 
-  if ((mask & WL_EVENT_HANGUP) || (mask & WL_EVENT_ERROR)) {
-    LOG(FATAL) << "got error or hangup (mask " << mask
-               << ") on X connection, exiting";
-    exit(EXIT_SUCCESS);
+  switch (event->response_type - ctx->xfixes_extension->first_event) {
+    case XCB_XFIXES_SELECTION_NOTIFY:
+      sl_handle_xfixes_selection_notify(
+          ctx, reinterpret_cast<xcb_xfixes_selection_notify_event_t*>(event));
+      break;
   }
 
-  while ((event = xcb_poll_for_event(ctx->connection))) {
-    switch (event->response_type & ~SEND_EVENT_MASK) {
-      case XCB_CREATE_NOTIFY:
-        sl_handle_create_notify(
-            ctx, reinterpret_cast<xcb_create_notify_event_t*>(event));
-        break;
-      case XCB_DESTROY_NOTIFY:
-        sl_handle_destroy_notify(
-            ctx, reinterpret_cast<xcb_destroy_notify_event_t*>(event));
-        break;
-      case XCB_REPARENT_NOTIFY:
-        sl_handle_reparent_notify(
-            ctx, reinterpret_cast<xcb_reparent_notify_event_t*>(event));
+  // Xshape specific events extend the normal event numbers
+  // The first event id is retrieved when querying for xshape
+  // extension information. This can be used to determine
+  // if the event that is received is Xshape specific.
+  if (ctx->enable_xshape) {
+    uint8_t xshape_event_id =
+        event->response_type - ctx->xshape_extension->first_event;
+    switch (xshape_event_id) {
+      case XCB_SHAPE_NOTIFY:
+        sl_handle_shape_notify(
+            ctx, reinterpret_cast<xcb_shape_notify_event_t*>(event));
         break;
-      case XCB_MAP_REQUEST:
-        sl_handle_map_request(
-            ctx, reinterpret_cast<xcb_map_request_event_t*>(event));
-        break;
-      case XCB_MAP_NOTIFY:
-        sl_handle_map_notify(ctx,
-                             reinterpret_cast<xcb_map_notify_event_t*>(event));
-        break;
-      case XCB_UNMAP_NOTIFY:
-        sl_handle_unmap_notify(
-            ctx, reinterpret_cast<xcb_unmap_notify_event_t*>(event));
-        break;
-      case XCB_CONFIGURE_REQUEST:
-        sl_handle_configure_request(
-            ctx, reinterpret_cast<xcb_configure_request_event_t*>(event));
-        break;
-      case XCB_CONFIGURE_NOTIFY:
-        sl_handle_configure_notify(
-            ctx, reinterpret_cast<xcb_configure_notify_event_t*>(event));
-        break;
-      case XCB_CLIENT_MESSAGE:
-        sl_handle_client_message(
-            ctx, reinterpret_cast<xcb_client_message_event_t*>(event));
-        break;
-      case XCB_FOCUS_IN:
-        sl_handle_focus_in(ctx, reinterpret_cast<xcb_focus_in_event_t*>(event));
-        break;
-      case XCB_FOCUS_OUT:
-        sl_handle_focus_out(ctx,
-                            reinterpret_cast<xcb_focus_out_event_t*>(event));
-        break;
-      case XCB_PROPERTY_NOTIFY:
-        sl_handle_property_notify(
-            ctx, reinterpret_cast<xcb_property_notify_event_t*>(event));
+    }
+  }
+}
+
+void sl_coalesce_x_events(std::vector<xcb_generic_event_t*>& events) {
+  // Latest ConfigureNotify and PropertyNotify events per window that a later
+  // one may still supersede.
+  struct PendingEvents {
+    ssize_t configure = -1;
+    std::unordered_map<xcb_atom_t, size_t> properties;
+  };
+  std::unordered_map<xcb_window_t, PendingEvents> pending;
+  size_t dropped = 0;
+
+  for (size_t i = 0; i < events.size(); ++i) {
+    xcb_generic_event_t* event = events[i];
+
+    switch (event->response_type & ~SEND_EVENT_MASK) {
+      case XCB_CONFIGURE_NOTIFY: {
+        PendingEvents& window = pending[reinterpret_cast<
+            xcb_configure_notify_event_t*>(event)->window];
+
+        // Geometry is taken from the event, so only the last one counts.
+        if (window.configure >= 0) {
+          free(events[window.configure]);
+          events[window.configure] = nullptr;
+          ++dropped;
+        }
+        window.configure = i;
+        // Property handlers may look at the geometry, so keep them on the
+        // side of this event they were sent on.
+        window.properties.clear();
         break;
-      case XCB_SELECTION_NOTIFY:
-        sl_handle_selection_notify(
-            ctx, reinterpret_cast<xcb_selection_notify_event_t*>(event));
+      }
+      case XCB_PROPERTY_NOTIFY: {
+        xcb_property_notify_event_t* property =
+            reinterpret_cast<xcb_property_notify_event_t*>(event);
+        PendingEvents& window = pending[property->window];
+
+        // The handler fetches the current value of the property, so earlier
+        // notifications for it have nothing to add.
+        auto it = window.properties.find(property->atom);
+        if (it != window.properties.end()) {
+          free(events[it->second]);
+          events[it->second] = nullptr;
+          ++dropped;
+          it->second = i;
+        } else {
+          window.properties.emplace(property->atom, i);
+        }
+        window.configure = -1;
         break;
-      case XCB_SELECTION_REQUEST:
-        sl_handle_selection_request(
-            ctx, reinterpret_cast<xcb_selection_request_event_t*>(event));
+      }
+      default:
+        // Anything else may depend on what came before it, whatever window
+        // it is for.
+        pending.clear();
         break;
     }
+  }
 
-    switch (event->response_type - ctx->xfixes_extension->first_event) {
-      case XCB_XFIXES_SELECTION_NOTIFY:
-        sl_handle_xfixes_selection_notify(
-            ctx, reinterpret_cast<xcb_xfixes_selection_notify_event_t*>(event));
-        break;
-    }
+  if (dropped) {
+    events.erase(std::remove(events.begin(), events.end(), nullptr),
+                 events.end());
+  }
+}
 
-    // Xshape specific events extend the normal event numbers
-    // The first event id is retrieved when querying for xshape
-    // extension information. This can be used to determine
-    // if the event that is received is Xshape specific.
-    if (ctx->enable_xshape) {
-      uint8_t xshape_event_id =
-          event->response_type - ctx->xshape_extension->first_event;
-      switch (xshape_event_id) {
-        case XCB_SHAPE_NOTIFY:
-          sl_handle_shape_notify(
-              ctx, reinterpret_cast<xcb_shape_notify_event_t*>(event));
-          break;
-      }
-    }
+static int sl_handle_x_connection_event(int fd, uint32_t mask, void* data) {
+  TRACE_EVENT("other", "sl_handle_x_connection_event");
+  struct sl_context* ctx = (struct sl_context*)data;
+  ScopedDispatchTimer dispatch_timer(ctx, SL_METRICS_HANDLER_X);
+  std::vector<xcb_generic_event_t*> events;
+  xcb_generic_event_t* event;
+  uint32_t count = 0;
+  uint32_t coalesced = 0;
 
-    free(event);
-    ++count;
+  if ((mask & WL_EVENT_HANGUP) || (mask & WL_EVENT_ERROR)) {
+    sl_restart_idle_xwayland(ctx);
+    LOG(FATAL) << "got error or hangup (mask " << mask
+               << ") on X connection, exiting";
+    exit(EXIT_SUCCESS);
   }
 
+  // Handlers wait for replies, which reads any events that arrived in the
+  // meantime off the connection, so keep going until it runs dry.
+  do {
+    events.clear();
+    while ((event = xcb_poll_for_event(ctx->connection)))
+      events.push_back(event);
+    count += events.size();
+    coalesced += events.size();
+
+    sl_coalesce_x_events(events);
+    coalesced -= events.size();
+
+    sl_prefetch_properties(ctx, events);
+    for (xcb_generic_event_t* event : events) {
+      sl_dispatch_x_event(ctx, event);
+      free(event);
+    }
+    sl_discard_property_prefetches(ctx);
+  } while (!events.empty());
+  TRACE_COUNTER("other", "x_events_coalesced", coalesced);
+
+  if (!ctx->atom_name_requests.empty())
+    sl_receive_atom_names(ctx);
+
   if ((mask & ~WL_EVENT_WRITABLE) == 0)
     xcb_flush(ctx->connection);
 
@@ -3120,6 +3684,7 @@ static void sl_initialize_cursor(struct sl_context* ctx) {
 
 static void sl_connect(struct sl_context* ctx) {
   TRACE_EVENT("other", "sl_connect");
+  ScopeTimer timer("sl_connect");
   const char wm_name[] = "Sommelier";
   const xcb_setup_t* setup;
   xcb_screen_iterator_t screen_iterator;
@@ -3133,7 +3698,9 @@ static void sl_connect(struct sl_context* ctx) {
   const xcb_query_extension_reply_t* composite_extension;
   unsigned i;
 
+#ifndef DIRECT_SHIMS
   set_xcb_shim(new XcbShim());
+#endif
 
   ctx->connection = xcb_connect_to_fd(ctx->wm_fd, nullptr);
   assert(!xcb_connection_has_error(ctx->connection));
@@ -3222,20 +3789,26 @@ static void sl_connect(struct sl_context* ctx) {
                     1, 0, XCB_WINDOW_CLASS_INPUT_ONLY, XCB_COPY_FROM_PARENT, 0,
                     nullptr);
 
-  // Wait on results for all the atom intern requests we sent above.
-  for (i = 0; i < ARRAY_SIZE(ctx->atoms); ++i) {
-    atom_reply =
-        xcb_intern_atom_reply(ctx->connection, ctx->atoms[i].cookie, &error);
-    assert(!error);
-    ctx->atoms[i].value = atom_reply->atom;
-    free(atom_reply);
-  }
-  if (ctx->application_id_property_name) {
-    atom_reply =
-        xcb_intern_atom_reply(ctx->connection, app_id_atom_cookie, &error);
-    assert(!error);
-    ctx->application_id_property_atom = atom_reply->atom;
-    free(atom_reply);
+  {
+    ScopeTimer atoms_timer("intern atoms");
+    // Wait on results for all the atom intern requests we sent above.
+    for (i = 0; i < ARRAY_SIZE(ctx->atoms); ++i) {
+      atom_reply =
+          xcb_intern_atom_reply(ctx->connection, ctx->atoms[i].cookie, &error);
+      assert(!error);
+      ctx->atoms[i].value = atom_reply->atom;
+      free(atom_reply);
+      const char* name = sl_context_atom_name(i);
+      if (name)
+        sl_cache_atom_name(ctx, ctx->atoms[i].value, name);
+    }
+    if (ctx->application_id_property_name) {
+      atom_reply =
+          xcb_intern_atom_reply(ctx->connection, app_id_atom_cookie, &error);
+      assert(!error);
+      ctx->application_id_property_atom = atom_reply->atom;
+      free(atom_reply);
+    }
   }
 
   depth_iterator = xcb_screen_allowed_depths_iterator(ctx->screen);
@@ -3295,6 +3868,7 @@ static void sl_connect(struct sl_context* ctx) {
                       XCB_CURRENT_TIME);
   xcb_flush(ctx->connection);
 
+  ScopeTimer cursor_timer("cursor init");
   sl_initialize_cursor(ctx);
 }
 
@@ -3334,6 +3908,24 @@ static void sl_sd_notify(const char* state) {
   errno_assert(rv != -1);
 }
 
+// Reports startup as done, to systemd with --sd-notify and in the startup
+// profile with --startup-report.
+static void sl_notify_ready(struct sl_context* ctx) {
+  if (ctx->startup_report) {
+    FILE* file = fopen(ctx->startup_report, "w");
+    if (file) {
+      fprintf(file, "%s\n", ScopeTimer::Report().c_str());
+      fclose(file);
+    } else {
+      LOG(ERROR) << "failed to open " << ctx->startup_report << ": "
+                 << strerror(errno);
+    }
+  }
+
+  if (ctx->sd_notify)
+    sl_sd_notify(ctx->sd_notify);
+}
+
 static int sl_handle_sigchld(int signal_number, void* data) {
   struct sl_context* ctx = (struct sl_context*)data;
   int status;
@@ -3348,11 +3940,12 @@ static int sl_handle_sigchld(int signal_number, void* data) {
       if (ctx->exit_with_child) {
         if (ctx->xwayland_pid >= 0)
           kill(ctx->xwayland_pid, SIGTERM);
+        else if (ctx->lazy_xwayland)
+          exit(EXIT_SUCCESS);
       } else {
         // Notify systemd that we are ready to accept connections now that
         // child process has finished running and all environment is ready.
-        if (ctx->sd_notify)
-          sl_sd_notify(ctx->sd_notify);
+        sl_notify_ready(ctx);
       }
     } else if (pid == ctx->xwayland_pid) {
       ctx->xwayland_pid = -1;
@@ -3376,15 +3969,39 @@ static int sl_handle_sigusr1(int signal_number, void* data) {
   return 1;
 }
 
-static int sl_handle_stats_timer(void* data) {
-  struct sl_context* ctx = (struct sl_context*)data;
+static void sl_output_stats(struct sl_context* ctx) {
+  // Nothing has changed, so the stats wait for the next commit to schedule
+  // them again.
+  if (ctx->metrics.commits == ctx->stats_output_commits)
+    return;
+  ctx->stats_output_commits = ctx->metrics.commits;
+
   if (ctx->frame_stats != nullptr) {
     ctx->frame_stats->OutputStats();
   }
-  wl_event_source_timer_update(ctx->stats_timer_event_source.get(),
-                               ctx->stats_timer_delay);
+  if (ctx->tile_damage_filter) {
+    const struct sl_tile_filter_stats& stats = ctx->tile_filter_stats;
+    uint64_t damaged_bytes = stats.bytes_copied + stats.bytes_skipped;
+    LOG(INFO) << "tile damage filter: skipped " << stats.tiles_skipped
+              << " of " << stats.tiles_hashed << " tiles, copied "
+              << stats.bytes_copied << " of " << damaged_bytes << " bytes";
+  }
+  sl_schedule_stats(ctx);
+}
+
+void sl_schedule_stats(struct sl_context* ctx) {
+  sl_context_schedule_housekeeping(ctx, SL_HOUSEKEEPING_STATS,
+                                   ctx->stats_timer_delay, sl_output_stats);
+}
+
+#ifdef QUIRKS_SUPPORT
+static int sl_handle_quirks_event(int fd, uint32_t mask, void* data) {
+  struct sl_context* ctx = (struct sl_context*)data;
+
+  ctx->quirks.HandleWatchEvents();
   return 1;
 }
+#endif
 
 static void sl_execvp(const char* file,
                       char* const argv[],
@@ -3396,6 +4013,7 @@ static void sl_execvp(const char* file,
   }
 
   setenv("SOMMELIER_VERSION", SOMMELIER_VERSION, 1);
+  sl_sched_reset_for_exec();
 
   execvp(file, argv);
   perror(file);
@@ -3438,8 +4056,7 @@ static void sl_calculate_scale_for_xwayland(struct sl_context* ctx) {
   for (auto output : ctx->host_outputs)
     sl_output_calculate_virtual_dimensions(output);
   sl_output_update_output_x(ctx);
-  for (auto output : ctx->host_outputs)
-    sl_output_send_host_output_state(output);
+  sl_output_send_updates(ctx);
 }
 
 // Extra connections are made to XWayland-hosting instances for IME support.
@@ -3452,12 +4069,35 @@ static void sl_extra_client_created_notify(struct wl_listener* listener,
   sl_set_display_implementation(ctx, client);
 }
 
+// Starts the program sommelier runs against its X11 display, once DISPLAY
+// is set.
+static void sl_spawn_x11_program(struct sl_context* ctx) {
+  putenv(sl_xasprintf("XCURSOR_SIZE=%d",
+                      static_cast<int>(XCURSOR_SIZE_BASE * ctx->scale + 0.5)));
+
+  pid_t pid = fork();
+  errno_assert(pid >= 0);
+  if (pid == 0) {
+    // Set WAYLAND_DISPLAY to a value that is guaranteed to not point to a
+    // valid wayland compositor socket name. Unsetting WAYLAND_DISPLAY is
+    // insufficient as some clients may attempt to connect to wayland-0 as a
+    // default fallback.
+    setenv("WAYLAND_DISPLAY", ".", 1);
+    sl_execvp(ctx->runprog[0], ctx->runprog, -1);
+    _exit(EXIT_FAILURE);
+  }
+
+  ctx->child_pid = pid;
+}
+
 static int sl_handle_display_ready_event(int fd, uint32_t mask, void* data) {
   TRACE_EVENT("surface", "sl_handle_display_ready_event");
   struct sl_context* ctx = (struct sl_context*)data;
   char display_name[9];
   int bytes_read = 0;
-  pid_t pid;
+
+  ScopeTimer::RecordSince("xwayland startup", ctx->xwayland_spawn_time);
+  ScopeTimer timer("display ready");
 
   if (!(mask & WL_EVENT_READABLE)) {
     LOG(FATAL) << "Got error or hangup on display ready connection (mask"
@@ -3513,22 +4153,9 @@ static int sl_handle_display_ready_event(int fd, uint32_t mask, void* data) {
   }
   free(socket_name);
 
-  putenv(sl_xasprintf("XCURSOR_SIZE=%d",
-                      static_cast<int>(XCURSOR_SIZE_BASE * ctx->scale + 0.5)));
-
-  pid = fork();
-  errno_assert(pid >= 0);
-  if (pid == 0) {
-    // Set WAYLAND_DISPLAY to a value that is guaranteed to not point to a
-    // valid wayland compositor socket name. Unsetting WAYLAND_DISPLAY is
-    // insufficient as some clients may attempt to connect to wayland-0 as a
-    // default fallback.
-    setenv("WAYLAND_DISPLAY", ".", 1);
-    sl_execvp(ctx->runprog[0], ctx->runprog, -1);
-    _exit(EXIT_FAILURE);
-  }
-
-  ctx->child_pid = pid;
+  // With --lazy-xwayland, the X11 program is already running.
+  if (!ctx->lazy_xwayland)
+    sl_spawn_x11_program(ctx);
 
   return 1;
 }
@@ -3538,8 +4165,81 @@ static void sl_sigchld_handler(int signal) {
     continue;
 }
 
+struct sl_warm_handoff {
+  struct sl_context* ctx;
+  int client_fd;
+  bool hung_up;
+};
+
+static int sl_handle_warm_handoff(int fd, uint32_t mask, void* data) {
+  struct sl_warm_handoff* handoff = static_cast<struct sl_warm_handoff*>(data);
+  struct msghdr msg = {};
+  struct iovec iov;
+  char control[CMSG_SPACE(sizeof(int))];
+  pid_t peer_pid = -1;
+
+  iov.iov_base = &peer_pid;
+  iov.iov_len = sizeof(peer_pid);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t bytes = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+  if (bytes < 0 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+
+  struct cmsghdr* cmsg =
+      bytes == static_cast<ssize_t>(sizeof(peer_pid)) ? CMSG_FIRSTHDR(&msg)
+                                                      : nullptr;
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+    // The parent exited, or isn't speaking the protocol.
+    handoff->hung_up = true;
+    return 0;
+  }
+
+  memcpy(&handoff->client_fd, CMSG_DATA(cmsg), sizeof(int));
+  handoff->ctx->peer_pid = peer_pid;
+  return 1;
+}
+
+// Runs the event loop, so that the host connection is set up, until the
+// parent hands over a client on |handoff_fd|. Returns the client fd, or -1
+// if the parent went away first.
+static int sl_wait_for_client(struct sl_context* ctx,
+                              struct wl_event_loop* event_loop,
+                              int handoff_fd) {
+  struct sl_warm_handoff handoff = {ctx, -1, false};
+  std::unique_ptr<struct wl_event_source> handoff_event_source(
+      wl_event_loop_add_fd(event_loop, handoff_fd, WL_EVENT_READABLE,
+                           sl_handle_warm_handoff, &handoff));
+
+  while (handoff.client_fd < 0 && !handoff.hung_up) {
+    if (sl_context_flush_host(ctx) < 0 && errno != EAGAIN)
+      break;
+    if (ctx->channel && ctx->channel->flush() < 0)
+      break;
+    wl_event_loop_dispatch(event_loop, -1);
+  }
+
+  handoff_event_source.reset();
+  close(handoff_fd);
+  return handoff.client_fd;
+}
+
 static void sl_client_destroy_notify(struct wl_listener* listener, void* data) {
-  exit(0);
+  sl_context* ctx = wl_container_of(listener, ctx, client_destroy_listener);
+
+  // Other clients share the process with a client thread, so it only stops
+  // its own main loop.
+  if (!ctx->client_thread) {
+    sl_restart_idle_xwayland(ctx);
+    exit(0);
+  }
+  ctx->client = nullptr;
+  ctx->client_destroyed = true;
 }
 
 // Break |str| into a sequence of zero or more nonempty arguments. No more
@@ -3590,12 +4290,17 @@ static void sl_print_usage() {
       "  -X\t\t\t\tEnable X11 forwarding\n"
       "  --log-level=LEVEL\t\tSet minimum log level to be processed\n"
       "\t(allowed range: -1 to 3; lower is more verbose))\n"
+      "  --async-logging\t\tWrite logs to stderr from a background thread\n"
       "  --parent\t\t\tRun as parent and spawn child processes\n"
       "  --socket=SOCKET\t\tName of socket to listen on\n"
       "  --display=DISPLAY\t\tWayland display to connect to\n"
       "  --scale=SCALE\t\t\tScale factor for contents\n"
       "  --dpi=[DPI[,DPI...]]\t\tDPI buckets\n"
       "  --peer-cmd-prefix=PREFIX\tPeer process command line prefix\n"
+      "  --warm-pool=N\t\t\tKeep N child processes started and connected\n"
+      "\tto the host ahead of clients (--parent only)\n"
+      "  --client-threads\t\tServe each client on a thread of the parent\n"
+      "\tinstead of a child process (--parent only)\n"
       "  --accelerators=ACCELERATORS\tList of keyboard accelerators\n"
       "  --windowed_accelerators=ACCELERATORS\tList of keyboard accelerators\n"
       "\tonly while windowed\n"
@@ -3611,6 +4316,10 @@ static void sl_print_usage() {
       "  --xwayland-path=PATH\t\tPath to Xwayland executable\n"
       "  --xwayland-gl-driver-path=PATH\tPath to GL drivers for Xwayland\n"
       "  --xwayland-cmd-prefix=PREFIX\tXwayland command line prefix\n"
+      "  --lazy-xwayland\t\tStart Xwayland when the first X11 client\n"
+      "\tconnects to --x-display\n"
+      "  --xwayland-idle-timeout=SECONDS\tStop a --lazy-xwayland Xwayland\n"
+      "\tonce it has had no X11 clients for SECONDS\n"
       "  --enable-linux-dmabuf\t\tEnable client-facing zwp_linux_dmabuf_v1 "
       "extension support\n"
       "  --enable-xshape\t\tEnable X11 XShape extension support\n"
@@ -3623,12 +4332,16 @@ static void sl_print_usage() {
       "Disable wl_surface::damage_buffer support.\n"
       "  --force-drm-device=DEVICE\tDRM device to use\n"
       "  --glamor\t\t\tUse glamor to accelerate X11 clients\n"
-      "  --timing-filename=PATH\tPath to timing output log\n"
+      "  --timing-filename=PATH\tPath to binary buffer timing log\n"
+      "  --startup-report=PATH\t\tWrite startup phase timings to PATH as\n"
+      "\tJSON once ready to accept connections\n"
       "  --direct-scale\t\tEnable direct scaling mode\n"
       "  --viewport-resize\t\tUse viewport to resize unresizable windows.\n"
 #ifdef PERFETTO_TRACING
       "  --trace-filename=PATH\t\tPath to Perfetto trace filename\n"
       "  --trace-system\t\tPerfetto trace to system daemon\n"
+      "  --trace-time-sync-interval=MS\tMinimum time between clock sync\n"
+      "\tevents, or -1 to disable them (default: 100)\n"
 #endif
 #ifdef QUIRKS_SUPPORT
       "  --quirks-config=PATH[,PATH...]\tOne or more 'quirks' config files.\n"
@@ -3644,10 +4357,72 @@ static void sl_print_usage() {
       "\twhile the log will grow infinitely and is intended for debugging\n"
       "\tor development purposes.\n"
       "  --stats-timer=SECS\t\tNumber of seconds between stats dumps\n"
+      "  --metrics-socket=PATH\t\tServe Prometheus metrics on a Unix "
+      "socket\n"
+      "  --stall-budget-ms=MS\t\tLog event handlers that block the event\n"
+      "\tloop for longer than MS (default: 8)\n"
+      "  --capture=PATH\t\tRecord the messages into sommelier for "
+      "sommelier_replay\n"
+      "\tPeer instances each write PATH.<pid>\n"
+      "  --capture-file-contents\tAlso record the contents of shm pools "
+      "and\n"
+      "\tother files, not just their checksums\n"
+      "  --buffer-pool-size=BYTES\tMemory to keep in released output buffers\n"
+      "\tfor reuse by other surfaces (0 disables)\n"
+      "  --buffer-budget=MIB\t\tTrim released output buffers, least\n"
+      "\trecently released first, to keep all of them within MIB\n"
+      "  --buffer-idle-timeout=SECONDS\tDrop the spare output buffers of\n"
+      "\tsurfaces that haven't committed for SECONDS\n"
+      "  --buffer-size-buckets=STEP\tRound output buffer sizes up to a\n"
+      "\tmultiple of STEP pixels, or to a power of two if STEP is 'pow2',\n"
+      "\tso resizing windows reuse buffers\n"
+      "  --copy-threads=N\t\tNumber of worker threads for damage copies\n"
+      "\t(default: 0, copy on the main thread)\n"
+      "  --sched=POLICY\t\tSchedule the event loop and worker threads\n"
+      "\twith 'fifo:PRIORITY', 'rr:PRIORITY' or 'nice:NICE'\n"
+      "  --cpu-affinity=CPUS\t\tRun the event loop and worker threads on\n"
+      "\tCPUS only, like '0-3,6'\n"
+      "  --copy-threshold=BYTES\tMinimum damage size before copies are\n"
+      "\tsplit across the worker threads\n"
+      "  --tile-damage-filter\tSkip copying damaged 64x64 tiles whose\n"
+      "\tcontents didn't change\n"
+      "  --coalesce-pointer-motion\tForward only the latest pointer motion\n"
+      "\tof each input frame\n"
+      "  --pointer-motions-per-frame=N\tAlso forward pointer motion at most\n"
+      "\tN times per frame of the focused surface\n"
+      "  --stylus-max-rate=HZ\t\tForward stylus motion at most HZ times\n"
+      "\ta second\n"
+      "  --hidden-frame-interval=MS\tFire frame callbacks of minimized\n"
+      "\twindows at most every MS and skip copying their contents\n"
+      "  --damage-rect-limit=N\t\tForward the bounding box of a commit's\n"
+      "\tdamage once it is more than N rectangles (default: 32)\n"
+      "  --async-commit\t\tCopy damage on a background thread and hold\n"
+      "\tback the host commit until the copy completes\n"
+      "  --zero-copy-shm\t\tShare wl_shm pools with the host instead of\n"
+      "\tcopying frames, when the guest kernel supports it\n"
+      "  --zero-copy-shm-threshold=BYTES\tWith --zero-copy-shm, share only\n"
+      "\tpools of at least BYTES and keep copying smaller ones\n"
+      "  --prefault-buffers\t\tFault in new output buffers when they are\n"
+      "\tallocated instead of on the first copy\n"
+      "  --huge-page-buffers\t\tWith --prefault-buffers, back output\n"
+      "\tbuffers with transparent huge pages where the kernel allows\n"
+      "  --adaptive-output-buffers\tMeasure copies into dmabuf and shm\n"
+      "\toutput buffers per surface and use whichever is cheaper\n"
+      "  --batch-sends\t\tSubmit the requests forwarded to the host in one\n"
+      "\tbatch per event loop iteration (--virtgpu-channel only)\n"
+      "  --stream-pipes\t\tProxy clipboard and drag and drop pipes in large\n"
+      "\tchunks (--virtgpu-channel only)\n"
+      "  --drain-receives\t\tForward every message the host has queued in\n"
+      "\tone batch per wakeup (virtwl only)\n"
+      "  --io-uring\t\t\tReceive requests for the host through io_uring,\n"
+      "\twhen the kernel supports it\n"
       "  --fullscreen-mode=MODE\tDefault fullscreen behavior (immersive,"
       " plain)\n"
       "  --virtgpu-channel\t\tUse virtgpu cross-domain context as virtual"
       " wayland channel\n"
+      "  --shm-ring=DEVICE\t\tSend and receive messages without fds through"
+      " rings in\n"
+      "\tmemory shared with the host by the ivshmem UIO device DEVICE\n"
       "  --noop-driver\t\t\tPass through to existing Wayland server"
       " without virtualization\n");
 }
@@ -3699,9 +4474,8 @@ static int64_t sl_arg_parse_int_checked(const char* arg) {
 // XKB key symbol name (E.g Delete).
 // Sommelier will exit with EXIT_FAILURE if this returns false.
 // TODO(b/237946069) Confirm accelerator handling works with i18n.
-static bool sl_parse_accelerators(
-    std::vector<struct sl_accelerator*>& accelerator_list,
-    const char* accelerators) {
+static bool sl_parse_accelerators(std::unordered_set<uint64_t>& accelerator_set,
+                                  const char* accelerators) {
   if (accelerators) {
     uint32_t modifiers = 0;
 
@@ -3726,21 +4500,19 @@ static bool sl_parse_accelerators(
         const char* end = strchrnul(accelerators, ',');
         char* name = strndup(accelerators, end - accelerators);
 
-        struct sl_accelerator* accelerator =
-            static_cast<sl_accelerator*>(malloc(sizeof(*accelerator)));
-        accelerator->modifiers = modifiers;
-        accelerator->symbol =
+        xkb_keysym_t symbol =
             xkb_keysym_from_name(name, XKB_KEYSYM_CASE_INSENSITIVE);
-        if (accelerator->symbol == XKB_KEY_NoSymbol) {
+        free(name);
+        if (symbol == XKB_KEY_NoSymbol) {
           LOG(ERROR) << "invalid key symbol";
           return false;
         }
 
-        accelerator_list.push_back(accelerator);
+        accelerator_set.insert(
+            sl_accelerator_key(modifiers, xkb_keysym_to_lower(symbol)));
 
         modifiers = 0;
         accelerators = end;
-        free(name);
       }
     }
   }
@@ -3801,11 +4573,270 @@ int sl_open_wayland_socket(const char* socket_name,
   return 0;
 }
 
+// Binds the sockets X11 clients connect to for |display|, both the abstract
+// and the filesystem one, after taking the display's lock file the way the
+// X server would. Returns false if the display is in use.
+static bool sl_open_x11_sockets(int display, int fds[2]) {
+  char* lock_path = sl_xasprintf("/tmp/.X%d-lock", display);
+  int lock_fd;
+
+  while ((lock_fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                         0444)) < 0) {
+    char pid_str[16] = {};
+    int fd = open(lock_path, O_RDONLY | O_CLOEXEC);
+    bool stale = false;
+
+    // Lock files left behind by a server that is gone are taken over.
+    if (fd >= 0) {
+      if (read(fd, pid_str, sizeof(pid_str) - 1) > 0) {
+        pid_t pid = atoi(pid_str);
+        stale = pid > 0 && kill(pid, 0) < 0 && errno == ESRCH;
+      }
+      close(fd);
+    }
+    if (!stale || unlink(lock_path) < 0) {
+      LOG(ERROR) << "X11 display :" << display << " is in use";
+      free(lock_path);
+      return false;
+    }
+  }
+
+  char* pid_str = sl_xasprintf("%10d\n", getpid());
+  bool written = write(lock_fd, pid_str, 11) == 11;
+  free(pid_str);
+  close(lock_fd);
+  errno_assert(written);
+
+  mkdir("/tmp/.X11-unix", 01777);
+
+  for (int i = 0; i < 2; ++i) {
+    struct sockaddr_un addr = {};
+    socklen_t size;
+
+    addr.sun_family = AF_LOCAL;
+    // The abstract socket's name starts with a nul byte.
+    const bool abstract = i == 0;
+    int length = snprintf(addr.sun_path + abstract, sizeof(addr.sun_path) - 1,
+                          "/tmp/.X11-unix/X%d", display);
+    size = offsetof(struct sockaddr_un, sun_path) + abstract + length;
+    if (!abstract) {
+      unlink(addr.sun_path);
+      size++;
+    }
+
+    fds[i] = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    errno_assert(fds[i] >= 0);
+    if (bind(fds[i], (struct sockaddr*)&addr, size) < 0 ||
+        listen(fds[i], 128) < 0) {
+      LOG(ERROR) << "failed to listen on X11 display :" << display << ": "
+                 << strerror(errno);
+      close(fds[i]);
+      if (i)
+        close(fds[0]);
+      unlink(lock_path);
+      free(lock_path);
+      return false;
+    }
+  }
+
+  free(lock_path);
+  return true;
+}
+
+// Appends the command line of a child sommelier to |args|: |argv|[0],
+// |peer_args| and the flags forwarded from |argv|. Returns the new number of
+// arguments in |args|, which must have room for 32 more.
+static int sl_append_peer_args(int argc,
+                               char** argv,
+                               char* const* peer_args,
+                               int peer_arg_count,
+                               char const** args,
+                               int i) {
+  args[i++] = argv[0];
+  for (int j = 0; j < peer_arg_count; ++j)
+    args[i++] = peer_args[j];
+
+  // forward some flags.
+  for (int j = 1; j < argc; ++j) {
+    char* arg = argv[j];
+    if (strstr(arg, "--display") == arg || strstr(arg, "--scale") == arg ||
+        strstr(arg, "--direct-scale") == arg ||
+        strstr(arg, "--accelerators") == arg ||
+        strstr(arg, "--windowed-accelerators") == arg ||
+        strstr(arg, "--drm-device") == arg ||
+        strstr(arg, "--support-damage-buffer") == arg ||
+        strstr(arg, "--vm-identififer") == arg ||
+        strstr(arg, "--trace-system") == arg ||
+        strstr(arg, "--trace-time-sync-interval") == arg ||
+        strstr(arg, "--capture") == arg ||
+        strstr(arg, "--buffer-pool-size") == arg ||
+        strstr(arg, "--buffer-budget") == arg ||
+        strstr(arg, "--buffer-idle-timeout") == arg ||
+        strstr(arg, "--buffer-size-buckets") == arg ||
+        strstr(arg, "--copy-threads") == arg ||
+        strstr(arg, "--sched") == arg ||
+        strstr(arg, "--cpu-affinity") == arg ||
+        strstr(arg, "--copy-threshold") == arg ||
+        strstr(arg, "--zero-copy-shm") == arg ||
+        strstr(arg, "--prefault-buffers") == arg ||
+        strstr(arg, "--huge-page-buffers") == arg ||
+        strstr(arg, "--adaptive-output-buffers") == arg ||
+        strstr(arg, "--batch-sends") == arg ||
+        strstr(arg, "--stream-pipes") == arg ||
+        strstr(arg, "--drain-receives") == arg ||
+        strstr(arg, "--shm-ring") == arg ||
+        strstr(arg, "--io-uring") == arg ||
+        strstr(arg, "--async-commit") == arg ||
+        strstr(arg, "--tile-damage-filter") == arg ||
+        strstr(arg, "--coalesce-pointer-motion") == arg ||
+        strstr(arg, "--pointer-motions-per-frame") == arg ||
+        strstr(arg, "--stall-budget-ms") == arg ||
+        strstr(arg, "--stylus-max-rate") == arg ||
+        strstr(arg, "--hidden-frame-interval") == arg ||
+        strstr(arg, "--damage-rect-limit") == arg ||
+        strstr(arg, "--enable-linux-dmabuf") == arg) {
+      args[i++] = arg;
+    }
+  }
+
+  return i;
+}
+
+// Forks and execs a child sommelier with |peer_args| in front of the flags
+// forwarded from |argv|.
+static pid_t sl_spawn_peer(int argc,
+                           char** argv,
+                           int sock_fd,
+                           int lock_fd,
+                           const char* peer_cmd_prefix,
+                           char* const* peer_args,
+                           int peer_arg_count) {
+  int pid = fork();
+  errno_assert(pid != -1);
+  if (pid == 0) {
+    char* peer_cmd_prefix_str;
+    char const* args[64];
+    int i = 0;
+
+    close(sock_fd);
+    close(lock_fd);
+
+    if (peer_cmd_prefix) {
+      peer_cmd_prefix_str = sl_xasprintf("%s", peer_cmd_prefix);
+
+      i = sl_parse_cmd_prefix(peer_cmd_prefix_str, 32, args);
+      if (i > 32) {
+        LOG(ERROR) << "too many arguments in cmd prefix: " << i;
+        i = 0;
+      }
+    }
+
+    i = sl_append_peer_args(argc, argv, peer_args, peer_arg_count, args, i);
+    args[i++] = nullptr;
+
+    execvp(args[0], const_cast<char* const*>(args));
+    _exit(EXIT_FAILURE);
+  }
+  return pid;
+}
+
+// A child started ahead of time, waiting on |handoff_fd| for its client.
+struct sl_warm_peer {
+  pid_t pid;
+  int handoff_fd;
+};
+
+static bool sl_spawn_warm_peer(int argc,
+                               char** argv,
+                               int sock_fd,
+                               int lock_fd,
+                               const char* peer_cmd_prefix,
+                               std::vector<struct sl_warm_peer>* pool) {
+  int sv[2];
+
+  // Only the child's end survives exec, so later children don't inherit the
+  // parent's ends of the others.
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+    LOG(ERROR) << "failed to create warm peer socket: " << strerror(errno);
+    return false;
+  }
+  if (fcntl(sv[1], F_SETFD, 0) < 0) {
+    LOG(ERROR) << "failed to share warm peer socket: " << strerror(errno);
+    close(sv[0]);
+    close(sv[1]);
+    return false;
+  }
+
+  char* handoff_fd_str = sl_xasprintf("--warm-handoff-fd=%d", sv[1]);
+  pid_t pid = sl_spawn_peer(argc, argv, sock_fd, lock_fd, peer_cmd_prefix,
+                            &handoff_fd_str, 1);
+  free(handoff_fd_str);
+  close(sv[1]);
+
+  pool->push_back({pid, sv[0]});
+  return true;
+}
+
+// Passes |client_fd| and the client's pid on to a warm child. Fails if the
+// child has already exited.
+static bool sl_hand_off_client(int handoff_fd, int client_fd, pid_t peer_pid) {
+  struct msghdr msg = {};
+  struct iovec iov;
+  char control[CMSG_SPACE(sizeof(int))] = {};
+
+  iov.iov_base = &peer_pid;
+  iov.iov_len = sizeof(peer_pid);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &client_fd, sizeof(int));
+
+  return sendmsg(handoff_fd, &msg, MSG_NOSIGNAL) ==
+         static_cast<ssize_t>(sizeof(peer_pid));
+}
+
+int real_main(int argc, char** argv);
+
+// Runs a sommelier for the client on |client_fd| on a thread of its own,
+// with the arguments a child process would have been started with.
+static void sl_start_client_thread(int argc,
+                                   char** argv,
+                                   int client_fd,
+                                   pid_t peer_pid) {
+  char* peer_args[3];
+  char const* args[64];
+
+  peer_args[0] = sl_xasprintf("--peer-pid=%d", peer_pid);
+  peer_args[1] = sl_xasprintf("--client-fd=%d", client_fd);
+  peer_args[2] = sl_xasprintf("--client-thread");
+  int n = sl_append_peer_args(argc, argv, peer_args, 3, args, 0);
+  std::vector<std::string> thread_args(args, args + n);
+  for (char* arg : peer_args)
+    free(arg);
+
+  std::thread([thread_args]() mutable {
+    std::vector<char*> thread_argv;
+    for (std::string& arg : thread_args)
+      thread_argv.push_back(&arg[0]);
+    thread_argv.push_back(nullptr);
+    real_main(thread_argv.size() - 1, thread_argv.data());
+  }).detach();
+}
+
 int sl_run_parent(int argc,
                   char** argv,
                   sl_context* ctx,
                   const char* socket_name,
-                  const char* peer_cmd_prefix) {
+                  const char* peer_cmd_prefix,
+                  int warm_pool_size,
+                  bool client_threads) {
+  std::vector<struct sl_warm_peer> warm_pool;
   struct sockaddr_un addr;
   int lock_fd;
   int sock_fd;
@@ -3830,8 +4861,7 @@ int sl_run_parent(int argc,
       continue;
   }
 
-  if (ctx->sd_notify)
-    sl_sd_notify(ctx->sd_notify);
+  sl_notify_ready(ctx);
 
   struct sigaction sa;
   sa.sa_handler = sl_sigchld_handler;
@@ -3839,8 +4869,18 @@ int sl_run_parent(int argc,
   sa.sa_flags = SA_RESTART;
   rv = sigaction(SIGCHLD, &sa, nullptr);
   errno_assert(rv >= 0);
+  // Client threads run in this process, and leave signals to this thread.
+  if (client_threads)
+    signal(SIGPIPE, SIG_IGN);
 
   while (true) {
+    // Top the pool back up while no client is waiting.
+    while (static_cast<int>(warm_pool.size()) < warm_pool_size &&
+           sl_spawn_warm_peer(argc, argv, sock_fd, lock_fd, peer_cmd_prefix,
+                              &warm_pool)) {
+      continue;
+    }
+
     struct ucred ucred;
     socklen_t length = sizeof(addr);
 
@@ -3854,54 +4894,31 @@ int sl_run_parent(int argc,
     length = sizeof(ucred);
     rv = getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &ucred, &length);
 
-    int pid = fork();
-    errno_assert(pid != -1);
-    if (pid == 0) {
-      char* client_fd_str;
-      char* peer_pid_str;
-      char* peer_cmd_prefix_str;
-      char const* args[64];
-      int i = 0;
-
-      close(sock_fd);
-      close(lock_fd);
-
-      if (peer_cmd_prefix) {
-        peer_cmd_prefix_str = sl_xasprintf("%s", peer_cmd_prefix);
-
-        i = sl_parse_cmd_prefix(peer_cmd_prefix_str, 32, args);
-        if (i > 32) {
-          LOG(ERROR) << "too many arguments in cmd prefix: " << i;
-          i = 0;
-        }
-      }
-
-      args[i++] = argv[0];
-      peer_pid_str = sl_xasprintf("--peer-pid=%d", ucred.pid);
-      args[i++] = peer_pid_str;
-      client_fd_str = sl_xasprintf("--client-fd=%d", client_fd);
-      args[i++] = client_fd_str;
-
-      // forward some flags.
-      for (int j = 1; j < argc; ++j) {
-        char* arg = argv[j];
-        if (strstr(arg, "--display") == arg || strstr(arg, "--scale") == arg ||
-            strstr(arg, "--direct-scale") == arg ||
-            strstr(arg, "--accelerators") == arg ||
-            strstr(arg, "--windowed-accelerators") == arg ||
-            strstr(arg, "--drm-device") == arg ||
-            strstr(arg, "--support-damage-buffer") == arg ||
-            strstr(arg, "--vm-identififer") == arg ||
-            strstr(arg, "--trace-system") == arg ||
-            strstr(arg, "--enable-linux-dmabuf") == arg) {
-          args[i++] = arg;
-        }
-      }
+    if (client_threads) {
+      sl_start_client_thread(argc, argv, client_fd, ucred.pid);
+      continue;
+    }
 
-      args[i++] = nullptr;
+    // Hand the client to the longest waiting warm child, which has had the
+    // most time to finish starting up.
+    bool handed_off = false;
+    while (!warm_pool.empty() && !handed_off) {
+      struct sl_warm_peer peer = warm_pool.front();
+      warm_pool.erase(warm_pool.begin());
+      handed_off = sl_hand_off_client(peer.handoff_fd, client_fd, ucred.pid);
+      if (!handed_off)
+        LOG(WARNING) << "warm child " << peer.pid << " is gone";
+      close(peer.handoff_fd);
+    }
 
-      execvp(args[0], const_cast<char* const*>(args));
-      _exit(EXIT_FAILURE);
+    if (!handed_off) {
+      char* peer_args[2];
+      peer_args[0] = sl_xasprintf("--peer-pid=%d", ucred.pid);
+      peer_args[1] = sl_xasprintf("--client-fd=%d", client_fd);
+      sl_spawn_peer(argc, argv, sock_fd, lock_fd, peer_cmd_prefix, peer_args,
+                    2);
+      free(peer_args[0]);
+      free(peer_args[1]);
     }
     close(client_fd);
   }
@@ -3919,7 +4936,9 @@ void sl_spawn_xwayland(sl_context* ctx,
                        const char* xauth_path,
                        const char* xfont_path,
                        const char* xwayland_gl_driver_path,
-                       const char* glamor) {
+                       const char* glamor,
+                       const int* listen_fds,
+                       int idle_timeout) {
   int ds[2];
   int rv;
   // Xwayland display ready socket.
@@ -3937,6 +4956,7 @@ void sl_spawn_xwayland(sl_context* ctx,
 
   ctx->wm_fd = wm[0];
 
+  clock_gettime(CLOCK_MONOTONIC, &ctx->xwayland_spawn_time);
   int pid = fork();
   errno_assert(pid != -1);
   if (pid == 0) {
@@ -3960,9 +4980,20 @@ void sl_spawn_xwayland(sl_context* ctx,
     fd = dup(wm[1]);
     char* wm_fd_str = sl_xasprintf("%d", fd);
 
-    if (xdisplay > 0) {
+    if (xdisplay > 0 || listen_fds) {
       args[i++] = sl_xasprintf(":%d", xdisplay);
     }
+    // Sockets bound by sommelier for --lazy-xwayland, in use by now.
+    if (listen_fds) {
+      for (int j = 0; j < 2; ++j) {
+        args[i++] = "-listenfd";
+        args[i++] = sl_xasprintf("%d", dup(listen_fds[j]));
+      }
+    }
+    if (idle_timeout > 0) {
+      args[i++] = "-terminate";
+      args[i++] = sl_xasprintf("%d", idle_timeout);
+    }
     args[i++] = "-nolisten";
     args[i++] = "tcp";
     args[i++] = "-rootless";
@@ -4002,7 +5033,104 @@ void sl_spawn_xwayland(sl_context* ctx,
   ctx->xwayland_pid = pid;
 }
 
-void create_shims() {
+// Everything needed to start Xwayland once the first X11 client connects,
+// for --lazy-xwayland.
+struct sl_lazy_xwayland {
+  struct sl_context* ctx;
+  struct wl_event_loop* event_loop;
+  int argc;
+  char** argv;
+  // Arguments from |argv| a restart passes on, after the ones it adds.
+  int first_forwarded_arg;
+  int wayland_socket_fd;
+  const char* xwayland_cmd_prefix;
+  const char* xwayland_path;
+  int xdisplay;
+  const char* xauth_path;
+  const char* xfont_path;
+  const char* xwayland_gl_driver_path;
+  const char* glamor;
+  int idle_timeout;
+  int listen_fds[2];
+  std::unique_ptr<struct wl_event_source> listen_event_sources[2];
+};
+
+static int sl_handle_x11_listen_event(int fd, uint32_t mask, void* data) {
+  struct sl_lazy_xwayland* lazy = static_cast<struct sl_lazy_xwayland*>(data);
+
+  // The connection waits in the backlog until Xwayland accepts it.
+  lazy->listen_event_sources[0].reset();
+  lazy->listen_event_sources[1].reset();
+
+  LOG(VERBOSE) << "X11 client connected, starting Xwayland";
+  sl_spawn_xwayland(lazy->ctx, lazy->event_loop, lazy->wayland_socket_fd,
+                    lazy->xwayland_cmd_prefix, lazy->xwayland_path,
+                    lazy->xdisplay, lazy->xauth_path, lazy->xfont_path,
+                    lazy->xwayland_gl_driver_path, lazy->glamor,
+                    lazy->listen_fds, lazy->idle_timeout);
+  close(lazy->wayland_socket_fd);
+  lazy->wayland_socket_fd = -1;
+  return 0;
+}
+
+// Listens on the X11 sockets of |lazy->xdisplay|, unless a restart handed
+// them down already, and starts the X11 program right away. Returns false
+// if the display can't be set up, leaving Xwayland to be started eagerly.
+static bool sl_listen_for_x11_clients(struct sl_lazy_xwayland* lazy,
+                                      bool restarted) {
+  struct sl_context* ctx = lazy->ctx;
+
+  if (!restarted && !sl_open_x11_sockets(lazy->xdisplay, lazy->listen_fds))
+    return false;
+
+  for (int i = 0; i < 2; ++i) {
+    lazy->listen_event_sources[i].reset(
+        wl_event_loop_add_fd(lazy->event_loop, lazy->listen_fds[i],
+                             WL_EVENT_READABLE, sl_handle_x11_listen_event,
+                             lazy));
+  }
+
+  char* display_name = sl_xasprintf(":%d", lazy->xdisplay);
+  setenv("DISPLAY", display_name, 1);
+  free(display_name);
+
+  ctx->lazy_xwayland = lazy;
+  if (!restarted)
+    sl_spawn_x11_program(ctx);
+  return true;
+}
+
+// Called once Xwayland is gone. If it exited because it went idle, replaces
+// this process with a fresh sommelier on the same X11 sockets, which starts
+// Xwayland again for the next X11 client. Returns otherwise.
+static void sl_restart_idle_xwayland(struct sl_context* ctx) {
+  struct sl_lazy_xwayland* lazy = ctx->lazy_xwayland;
+
+  if (!lazy || lazy->idle_timeout <= 0)
+    return;
+  // The X11 program is gone, and sommelier should go with it.
+  if (ctx->exit_with_child && ctx->child_pid < 0)
+    return;
+
+  std::vector<char*> args;
+  args.push_back(lazy->argv[0]);
+  args.push_back(sl_xasprintf("--x-listen-fds=%d,%d", lazy->listen_fds[0],
+                              lazy->listen_fds[1]));
+  args.push_back(sl_xasprintf("--x-child-pid=%d", ctx->child_pid));
+  for (int i = lazy->first_forwarded_arg; i < lazy->argc; ++i)
+    args.push_back(lazy->argv[i]);
+  args.push_back(nullptr);
+
+  for (int fd : lazy->listen_fds)
+    fcntl(fd, F_SETFD, 0);
+
+  LOG(INFO) << "Xwayland exited while idle, restarting";
+  execv("/proc/self/exe", args.data());
+  LOG(ERROR) << "failed to restart: " << strerror(errno);
+}
+
+static void sl_create_shims_once() {
+#ifndef DIRECT_SHIMS
   // xdg-shell shims.
   set_xdg_positioner_shim(new XdgPositionerShim());
   set_xdg_popup_shim(new XdgPopupShim());
@@ -4010,12 +5138,19 @@ void create_shims() {
   set_xdg_surface_shim(new XdgSurfaceShim());
   set_xdg_wm_base_shim(new XdgWmBaseShim());
   set_wp_viewport_shim(new WpViewportShim());
+#endif
 
 #ifdef GAMEPAD_SUPPORT
   Libevdev::Set(new LibevdevShim());
 #endif
 }
 
+void create_shims() {
+  // Client threads share the shims.
+  static std::once_flag created;
+  std::call_once(created, sl_create_shims_once);
+}
+
 static WaylandChannel* try_wayland_channel_init(
     WaylandChannel* channel, const char* channel_description) {
   if (channel) {
@@ -4033,19 +5168,36 @@ static WaylandChannel* try_wayland_channel_init(
   return channel;
 }
 
-WaylandChannel* sl_create_wayland_channel(bool try_virtgpu_channel) {
+WaylandChannel* sl_create_wayland_channel(bool try_virtgpu_channel,
+                                          bool batch_sends,
+                                          bool stream_pipes,
+                                          bool drain_receives,
+                                          const char* shm_ring_device) {
   // defines a preferred channel ordering and attempt early init so we can
   // fallback if necessary.
   WaylandChannel* channel = nullptr;
   if (try_virtgpu_channel) {
-    channel = try_wayland_channel_init(new VirtGpuChannel(), "VirtGpuChannel");
+    channel = try_wayland_channel_init(
+        new VirtGpuChannel(batch_sends, stream_pipes), "VirtGpuChannel");
   }
   if (!channel) {
-    channel = try_wayland_channel_init(new VirtWaylandChannel(),
+    channel = try_wayland_channel_init(new VirtWaylandChannel(drain_receives),
                                        "VirtWaylandChannel");
   }
   if (!channel) {
     LOG(ERROR) << "WaylandChannel init failed for all candidate backends";
+  } else if (shm_ring_device) {
+    ShmRingChannel* ring_channel = new ShmRingChannel(channel, shm_ring_device);
+    int ret = ring_channel->init();
+    if (ret) {
+      // Carry on without the rings; the channel works the same, only slower.
+      LOG(ERROR) << "failed to map shared memory rings from "
+                 << shm_ring_device << ": " << strerror(-ret);
+      ring_channel->release_inner();
+      delete ring_channel;
+    } else {
+      channel = ring_channel;
+    }
   }
   return channel;
 }
@@ -4081,8 +5233,6 @@ int real_main(int argc, char** argv) {
 #endif
   const char* socket_name = "wayland-0";
   bool noop_driver = false;
-  struct wl_listener client_destroy_listener = {};
-  client_destroy_listener.notify = sl_client_destroy_notify;
   int sv[2];
   pid_t pid;
   int xdisplay = -1;
@@ -4090,11 +5240,27 @@ int real_main(int argc, char** argv) {
   int client_fd = -1;
   int i;
   const char* stats_summary = nullptr;
+  const char* metrics_socket = nullptr;
+  const char* capture_filename = nullptr;
+  bool capture_file_contents = false;
   const char* stats_log = nullptr;
   bool use_virtgpu_channel = false;
-
-  // Ignore SIGUSR1 (used for trace dumping) in all child processes.
-  signal(SIGUSR1, SIG_IGN);
+  int64_t copy_threads = 0;
+  struct sl_sched_config sched_config;
+  bool sched_requested = false;
+  int64_t copy_threshold = kDefaultCopyParallelThreshold;
+  bool async_commit = false;
+  bool batch_sends = false;
+  bool stream_pipes = false;
+  bool drain_receives = false;
+  const char* shm_ring_device = nullptr;
+  int64_t warm_pool_size = 0;
+  int warm_handoff_fd = -1;
+  bool client_threads = false;
+  bool lazy_xwayland = false;
+  int64_t xwayland_idle_timeout = 0;
+  int x_listen_fds[2] = {-1, -1};
+  int first_forwarded_arg = 1;
 
   for (i = 1; i < argc; ++i) {
     const char* arg = argv[i];
@@ -4133,6 +5299,8 @@ int real_main(int argc, char** argv) {
     } else if (strstr(arg, "--log-level") == arg) {
       const int64_t log_level = sl_arg_parse_int_checked(arg);
       logging::set_min_log_level(log_level);
+    } else if (strstr(arg, "--async-logging") == arg) {
+      logging::start_async_sink();
     } else if (strstr(arg, "--socket") == arg) {
       socket_name = sl_arg_value(arg);
     } else if (strstr(arg, "--display") == arg) {
@@ -4172,10 +5340,31 @@ int real_main(int argc, char** argv) {
       xwayland_path = sl_arg_value(arg);
     } else if (strstr(arg, "--xwayland-gl-driver-path") == arg) {
       xwayland_gl_driver_path = sl_arg_value(arg);
+    } else if (strstr(arg, "--lazy-xwayland") == arg) {
+      lazy_xwayland = true;
+    } else if (strstr(arg, "--xwayland-idle-timeout") == arg) {
+      xwayland_idle_timeout = sl_arg_parse_int_checked(arg);
+      if (xwayland_idle_timeout < 0 ||
+          xwayland_idle_timeout > std::numeric_limits<int>::max()) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "'";
+        return EXIT_FAILURE;
+      }
+    } else if (strstr(arg, "--x-listen-fds") == arg) {
+      if (sscanf(sl_arg_value(arg), "%d,%d", &x_listen_fds[0],
+                 &x_listen_fds[1]) != 2) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "'";
+        return EXIT_FAILURE;
+      }
+      first_forwarded_arg = i + 1;
+    } else if (strstr(arg, "--x-child-pid") == arg) {
+      ctx.child_pid = atoi(sl_arg_value(arg));
+      first_forwarded_arg = i + 1;
     } else if (strstr(arg, "--no-exit-with-child") == arg) {
       ctx.exit_with_child = 0;
     } else if (strstr(arg, "--sd-notify") == arg) {
       ctx.sd_notify = sl_arg_value(arg);
+    } else if (strstr(arg, "--startup-report") == arg) {
+      ctx.startup_report = sl_arg_value(arg);
     } else if (strstr(arg, "--no-clipboard-manager") == arg) {
       clipboard_manager = "0";
     } else if (strstr(arg, "--frame-color") == arg) {
@@ -4223,6 +5412,8 @@ int real_main(int argc, char** argv) {
       ctx.trace_filename = sl_arg_value(arg);
     } else if (strstr(arg, "--trace-system") == arg) {
       ctx.trace_system = true;
+    } else if (strstr(arg, "--trace-time-sync-interval") == arg) {
+      ctx.trace_time_sync_interval_ms = atoi(sl_arg_value(arg));
 #endif
 #ifdef QUIRKS_SUPPORT
     } else if (strstr(arg, "--quirks-config") == arg) {
@@ -4234,6 +5425,158 @@ int real_main(int argc, char** argv) {
       stats_log = sl_arg_value(arg);
     } else if (strstr(arg, "--stats-timer") == arg) {
       ctx.stats_timer_delay = atoi(sl_arg_value(arg)) * 1000;
+    } else if (strstr(arg, "--metrics-socket") == arg) {
+      metrics_socket = sl_arg_value(arg);
+    } else if (strstr(arg, "--stall-budget-ms") == arg) {
+      int64_t budget = sl_arg_parse_int_checked(arg);
+      if (budget <= 0 || budget > std::numeric_limits<int>::max()) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "'";
+        return EXIT_FAILURE;
+      }
+      ctx.stall_budget_ns = budget * 1000000;
+    } else if (strstr(arg, "--capture-file-contents") == arg) {
+      capture_file_contents = true;
+    } else if (strstr(arg, "--capture") == arg) {
+      capture_filename = sl_arg_value(arg);
+    } else if (strstr(arg, "--buffer-pool-size") == arg) {
+      int64_t pool_size = sl_arg_parse_int_checked(arg);
+      if (pool_size < 0) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "': " << pool_size
+                   << " (expected non-negative integer)";
+        return EXIT_FAILURE;
+      }
+      ctx.output_buffer_pool_limit = pool_size;
+    } else if (strstr(arg, "--buffer-budget") == arg) {
+      int64_t budget = sl_arg_parse_int_checked(arg);
+      if (budget < 0) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "': " << budget
+                   << " (expected non-negative integer)";
+        return EXIT_FAILURE;
+      }
+      ctx.output_buffer_budget = static_cast<size_t>(budget) << 20;
+    } else if (strstr(arg, "--buffer-idle-timeout") == arg) {
+      int64_t timeout = sl_arg_parse_int_checked(arg);
+      if (timeout < 0) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "': " << timeout
+                   << " (expected non-negative integer)";
+        return EXIT_FAILURE;
+      }
+      ctx.output_buffer_idle_ns = timeout * 1000000000;
+    } else if (strstr(arg, "--buffer-size-buckets") == arg) {
+      const char* step = sl_arg_value(arg);
+      if (strcmp(step, "pow2") == 0) {
+        ctx.buffer_size_bucket = SL_BUFFER_SIZE_BUCKET_POW2;
+      } else {
+        int64_t bucket = sl_arg_parse_int_checked(arg);
+        if (bucket < 0 || bucket > MAX_SIZE) {
+          LOG(FATAL) << "invalid value for arg '" << arg << "': " << bucket
+                     << " (expected non-negative integer or 'pow2')";
+          return EXIT_FAILURE;
+        }
+        ctx.buffer_size_bucket = bucket;
+      }
+    } else if (strstr(arg, "--copy-threads") == arg) {
+      copy_threads = sl_arg_parse_int_checked(arg);
+      if (copy_threads < 0) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "': " << copy_threads
+                   << " (expected non-negative integer)";
+        return EXIT_FAILURE;
+      }
+    } else if (strstr(arg, "--sched") == arg) {
+      if (!sl_sched_parse_policy(sl_arg_value(arg), &sched_config)) {
+        LOG(FATAL) << "invalid value for arg '" << arg
+                   << "' (expected fifo:PRIORITY, rr:PRIORITY or nice:NICE)";
+        return EXIT_FAILURE;
+      }
+      sched_requested = true;
+    } else if (strstr(arg, "--cpu-affinity") == arg) {
+      if (!sl_sched_parse_affinity(sl_arg_value(arg), &sched_config)) {
+        LOG(FATAL) << "invalid value for arg '" << arg
+                   << "' (expected a list of CPUs, like 0-3,6)";
+        return EXIT_FAILURE;
+      }
+      sched_requested = true;
+    } else if (strstr(arg, "--copy-threshold") == arg) {
+      copy_threshold = sl_arg_parse_int_checked(arg);
+      if (copy_threshold < 0) {
+        LOG(FATAL) << "invalid value for arg '" << arg
+                   << "': " << copy_threshold
+                   << " (expected non-negative integer)";
+        return EXIT_FAILURE;
+      }
+    } else if (strstr(arg, "--tile-damage-filter") == arg) {
+      ctx.tile_damage_filter = true;
+    } else if (strstr(arg, "--coalesce-pointer-motion") == arg) {
+      ctx.coalesce_pointer_motion = true;
+    } else if (strstr(arg, "--pointer-motions-per-frame") == arg) {
+      int64_t motions = sl_arg_parse_int_checked(arg);
+      if (motions <= 0 || motions > std::numeric_limits<int>::max()) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "'";
+        return EXIT_FAILURE;
+      }
+      ctx.pointer_motions_per_frame = motions;
+      ctx.coalesce_pointer_motion = true;
+    } else if (strstr(arg, "--stylus-max-rate") == arg) {
+      int64_t rate = sl_arg_parse_int_checked(arg);
+      if (rate <= 0 || rate > std::numeric_limits<int>::max()) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "'";
+        return EXIT_FAILURE;
+      }
+      ctx.stylus_max_rate = rate;
+    } else if (strstr(arg, "--hidden-frame-interval") == arg) {
+      int64_t interval = sl_arg_parse_int_checked(arg);
+      if (interval <= 0 || interval > std::numeric_limits<int>::max()) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "'";
+        return EXIT_FAILURE;
+      }
+      ctx.hidden_frame_interval_ms = interval;
+    } else if (strstr(arg, "--damage-rect-limit") == arg) {
+      int64_t limit = sl_arg_parse_int_checked(arg);
+      if (limit <= 0 || limit > std::numeric_limits<int>::max()) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "'";
+        return EXIT_FAILURE;
+      }
+      ctx.damage_rect_limit = limit;
+    } else if (strstr(arg, "--async-commit") == arg) {
+      async_commit = true;
+    } else if (strstr(arg, "--zero-copy-shm-threshold") == arg) {
+      int64_t threshold = sl_arg_parse_int_checked(arg);
+      if (threshold < 0) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "': " << threshold
+                   << " (expected non-negative integer)";
+        return EXIT_FAILURE;
+      }
+      ctx.zero_copy_shm_threshold = threshold;
+    } else if (strstr(arg, "--zero-copy-shm") == arg) {
+      ctx.zero_copy_shm = true;
+    } else if (strstr(arg, "--prefault-buffers") == arg) {
+      ctx.prefault_output_buffers = true;
+    } else if (strstr(arg, "--huge-page-buffers") == arg) {
+      ctx.huge_page_output_buffers = true;
+    } else if (strstr(arg, "--adaptive-output-buffers") == arg) {
+      ctx.adaptive_output_buffers = true;
+    } else if (strstr(arg, "--batch-sends") == arg) {
+      batch_sends = true;
+    } else if (strstr(arg, "--stream-pipes") == arg) {
+      stream_pipes = true;
+    } else if (strstr(arg, "--drain-receives") == arg) {
+      drain_receives = true;
+    } else if (strstr(arg, "--shm-ring") == arg) {
+      shm_ring_device = sl_arg_value(arg);
+    } else if (strstr(arg, "--io-uring") == arg) {
+      ctx.use_io_uring = true;
+    } else if (strstr(arg, "--warm-pool") == arg) {
+      warm_pool_size = sl_arg_parse_int_checked(arg);
+      if (warm_pool_size < 0) {
+        LOG(FATAL) << "invalid value for arg '" << arg << "'";
+        return EXIT_FAILURE;
+      }
+    } else if (strstr(arg, "--warm-handoff-fd") == arg) {
+      warm_handoff_fd = atoi(sl_arg_value(arg));
+    } else if (strstr(arg, "--client-threads") == arg) {
+      client_threads = true;
+    } else if (strcmp(arg, "--client-thread") == 0) {
+      ctx.client_thread = true;
     } else if (arg[0] == '-') {
       if (strcmp(arg, "--") == 0) {
         ctx.runprog = &argv[i + 1];
@@ -4256,6 +5599,13 @@ int real_main(int argc, char** argv) {
     ctx.vm_id = vm_id;
   }
 
+  // Signal dispositions are shared by the whole process, so client threads
+  // leave them to the thread that started them.
+  if (!ctx.client_thread) {
+    // Ignore SIGUSR1 (used for trace dumping) in all child processes.
+    signal(SIGUSR1, SIG_IGN);
+  }
+
   if (ctx.application_id && ctx.vm_id) {
     LOG(WARNING) << "--application-id overrides --vm-identifier";
   }
@@ -4264,16 +5614,43 @@ int real_main(int argc, char** argv) {
   }
 
   if (parent) {
-    return sl_run_parent(argc, argv, &ctx, socket_name, peer_cmd_prefix);
+    if (client_threads && peer_cmd_prefix) {
+      LOG(WARNING) << "--client-threads can't run clients under "
+                      "--peer-cmd-prefix, starting child processes instead";
+      client_threads = false;
+    }
+    if (client_threads && warm_pool_size) {
+      LOG(WARNING) << "--warm-pool has no effect with --client-threads";
+    }
+    return sl_run_parent(argc, argv, &ctx, socket_name, peer_cmd_prefix,
+                         warm_pool_size, client_threads);
   }
 
-  if (client_fd == -1) {
+  // Starting programs or Xwayland sets the environment and handles SIGCHLD
+  // for the whole process, which is the parent's to do.
+  if (ctx.client_thread && (ctx.runprog || ctx.xwayland)) {
+    LOG(ERROR) << "client threads only serve the client they are handed";
+    close(client_fd);
+    return EXIT_FAILURE;
+  }
+
+  if (client_fd == -1 && warm_handoff_fd == -1) {
     if (!ctx.runprog || !ctx.runprog[0]) {
       sl_print_usage();
       return EXIT_FAILURE;
     }
   }
 
+  if (lazy_xwayland && xdisplay < 0) {
+    LOG(WARNING) << "--lazy-xwayland needs --x-display, starting Xwayland "
+                    "right away";
+    lazy_xwayland = false;
+  }
+  if (xwayland_idle_timeout && !lazy_xwayland) {
+    LOG(WARNING) << "--xwayland-idle-timeout has no effect without "
+                    "--lazy-xwayland";
+  }
+
   if (ctx.xwayland) {
     assert(client_fd == -1);
 
@@ -4333,8 +5710,23 @@ int real_main(int argc, char** argv) {
     }
   }
 
+  // Pick the damage copy kernel up front rather than on the first commit.
+  LOG(VERBOSE) << "using "
+               << sl_copy_kernel_name(sl_copy_active_kernel())
+               << " damage copy kernel";
+  // Threads inherit the scheduling of the thread that starts them, so this
+  // comes before any worker thread is started.
+  if (sched_requested) {
+    std::string sched = sl_sched_apply(sched_config);
+    LOG(INFO) << "scheduling: " << sched;
+    ScopeTimer::Annotate("sched", sched);
+  }
+  if (copy_threads > 0)
+    ctx.copy_pool = new CopyWorkerPool(copy_threads, copy_threshold);
+
   // Handle broken pipes without signals that kill the entire process.
-  signal(SIGPIPE, SIG_IGN);
+  if (!ctx.client_thread)
+    signal(SIGPIPE, SIG_IGN);
 
   wl_event_loop* event_loop = nullptr;
   {
@@ -4345,7 +5737,10 @@ int real_main(int argc, char** argv) {
 
     WaylandChannel* wayland_channel = nullptr;
     if (!noop_driver) {
-      wayland_channel = sl_create_wayland_channel(use_virtgpu_channel);
+      wayland_channel =
+          sl_create_wayland_channel(use_virtgpu_channel, batch_sends,
+                                    stream_pipes, drain_receives,
+                                    shm_ring_device);
       if (!wayland_channel) {
         LOG(FATAL) << "failed to initialize wayland channel.";
         return EXIT_FAILURE;
@@ -4361,6 +5756,9 @@ int real_main(int argc, char** argv) {
     if (!event_loop) {
       return EXIT_FAILURE;
     }
+
+    if (async_commit)
+      sl_context_init_commit_pipeline(&ctx, event_loop);
   }
 
   {
@@ -4394,14 +5792,15 @@ int real_main(int argc, char** argv) {
   wl_array_init(&ctx.dpi);
   if (dpi) {
     char* str = strdup(dpi);
-    char* token = strtok(str, ",");  // NOLINT(runtime/threadsafe_fn)
+    char* saveptr;
+    char* token = strtok_r(str, ",", &saveptr);
     int* p;
 
     while (token) {
       p = static_cast<int*>(wl_array_add(&ctx.dpi, sizeof *p));
       assert(p);
       *p = MAX(MIN_DPI, MIN(atoi(token), MAX_DPI));
-      token = strtok(nullptr, ",");  // NOLINT(runtime/threadsafe_fn)
+      token = strtok_r(nullptr, ",", &saveptr);
     }
     free(str);
   }
@@ -4441,12 +5840,24 @@ int real_main(int argc, char** argv) {
         wl_event_loop_add_fd(event_loop, wl_display_get_fd(ctx.display),
                              WL_EVENT_READABLE, sl_handle_event, &ctx));
 
-    wl_registry_add_listener(wl_display_get_registry(ctx.display),
-                             &sl_registry_listener, &ctx);
+    ctx.registry = wl_display_get_registry(ctx.display);
+    wl_registry_add_listener(ctx.registry, &sl_registry_listener, &ctx);
+  }
+
+  // A warm child gets as far as it can without the client, then waits for
+  // the parent to hand one over.
+  if (warm_handoff_fd != -1) {
+    ScopeTimer timer("warm wait");
+    client_fd = sl_wait_for_client(&ctx, event_loop, warm_handoff_fd);
+    if (client_fd < 0)
+      return EXIT_SUCCESS;
   }
 
   {
     ScopeTimer timer("client create");
+    // Peers are handed an existing client, and share the capture flag with
+    // every other peer.
+    bool peer = client_fd != -1;
     if (ctx.runprog || ctx.xwayland) {
       // Wayland connection from client.
       int rv = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv);
@@ -4454,6 +5865,18 @@ int real_main(int argc, char** argv) {
       client_fd = sv[0];
     }
 
+    if (capture_filename) {
+      std::string path = capture_filename;
+      if (peer)
+        path += "." + std::to_string(getpid());
+      ctx.capture = sl_capture_open(path.c_str(), capture_file_contents);
+      if (!ctx.capture)
+        return EXIT_FAILURE;
+      client_fd = sl_capture_proxy_client(ctx.capture, event_loop, client_fd);
+      if (client_fd < 0)
+        return EXIT_FAILURE;
+    }
+
     ctx.client = wl_client_create(ctx.host_display, client_fd);
   }
 
@@ -4470,10 +5893,40 @@ int real_main(int argc, char** argv) {
       ctx.sigchld_event_source.reset(wl_event_loop_add_signal(
           event_loop, SIGCHLD, sl_handle_sigchld, &ctx));
 
-      if (ctx.xwayland) {
+      bool listening = false;
+      if (ctx.xwayland && lazy_xwayland) {
+        struct sl_lazy_xwayland* lazy = new sl_lazy_xwayland();
+        lazy->ctx = &ctx;
+        lazy->event_loop = event_loop;
+        lazy->argc = argc;
+        lazy->argv = argv;
+        lazy->first_forwarded_arg = first_forwarded_arg;
+        lazy->wayland_socket_fd = sv[1];
+        lazy->xwayland_cmd_prefix = xwayland_cmd_prefix;
+        lazy->xwayland_path = xwayland_path;
+        lazy->xdisplay = xdisplay;
+        lazy->xauth_path = xauth_path;
+        lazy->xfont_path = xfont_path;
+        lazy->xwayland_gl_driver_path = xwayland_gl_driver_path;
+        lazy->glamor = glamor;
+        lazy->idle_timeout = xwayland_idle_timeout;
+        lazy->listen_fds[0] = x_listen_fds[0];
+        lazy->listen_fds[1] = x_listen_fds[1];
+
+        listening = sl_listen_for_x11_clients(lazy, x_listen_fds[0] >= 0);
+        if (!listening) {
+          LOG(ERROR) << "starting Xwayland right away";
+          delete lazy;
+        }
+      }
+
+      if (listening) {
+        // Handed to Xwayland once it starts.
+        sv[1] = -1;
+      } else if (ctx.xwayland) {
         sl_spawn_xwayland(&ctx, event_loop, sv[1], xwayland_cmd_prefix,
                           xwayland_path, xdisplay, xauth_path, xfont_path,
-                          xwayland_gl_driver_path, glamor);
+                          xwayland_gl_driver_path, glamor, nullptr, 0);
       } else {
         pid = fork();
         errno_assert(pid != -1);
@@ -4486,19 +5939,25 @@ int real_main(int argc, char** argv) {
         }
         ctx.child_pid = pid;
       }
-      close(sv[1]);
+      if (sv[1] >= 0)
+        close(sv[1]);
     }
   }
   // Attempt to enable tracing.  This could be called earlier but would rather
   // spawn all children first.
   const bool tracing_needed = ctx.trace_filename || ctx.trace_system;
   if (tracing_needed) {
-    initialize_tracing(ctx.trace_filename, ctx.trace_system);
-    enable_tracing(!ctx.trace_system);
+    // Client threads share the process' tracing.
+    static std::once_flag tracing_initialized;
+    std::call_once(tracing_initialized, [&ctx]() {
+      initialize_tracing(ctx.trace_filename, ctx.trace_system);
+      enable_tracing(!ctx.trace_system);
+    });
   }
 
-  // Trigger trace and timing log dumps when USR1 signals are received
-  if (tracing_needed || ctx.timing) {
+  // Trigger trace and timing log dumps when USR1 signals are received. A
+  // signal goes to one thread only, so client threads don't listen for it.
+  if ((tracing_needed || ctx.timing) && !ctx.client_thread) {
     ctx.sigusr1_event_source.reset(
         wl_event_loop_add_signal(event_loop, SIGUSR1, sl_handle_sigusr1, &ctx));
   }
@@ -4508,19 +5967,34 @@ int real_main(int argc, char** argv) {
     ctx.timing->RecordStartTime();
   }
 
+  if (metrics_socket && !sl_metrics_listen(&ctx, metrics_socket))
+    return EXIT_FAILURE;
+
   if (stats_summary != nullptr || stats_log != nullptr) {
     ctx.frame_stats.reset(new FrameStats(stats_summary, stats_log));
-    ctx.stats_timer_event_source.reset(
-        wl_event_loop_add_timer(event_loop, sl_handle_stats_timer, &ctx));
-    wl_event_source_timer_update(ctx.stats_timer_event_source.get(),
-                                 ctx.stats_timer_delay);
+    sl_schedule_stats(&ctx);
+  }
+
+#ifdef QUIRKS_SUPPORT
+  // Reload the quirks config files as they change.
+  if (quirks_paths) {
+    int quirks_fd = ctx.quirks.Watch();
+    if (quirks_fd >= 0) {
+      ctx.quirks_event_source.reset(
+          wl_event_loop_add_fd(event_loop, quirks_fd, WL_EVENT_READABLE,
+                               sl_handle_quirks_event, &ctx));
+    }
   }
+#endif
 
-  wl_client_add_destroy_listener(ctx.client, &client_destroy_listener);
+  ctx.client_destroy_listener.notify = sl_client_destroy_notify;
+  wl_client_add_destroy_listener(ctx.client, &ctx.client_destroy_listener);
 
   LOG(VERBOSE) << "starting main loop";
-  while (true) {
-    wl_display_flush_clients(ctx.host_display);
+  int64_t loop_wake_ns = 0;
+  int status = EXIT_SUCCESS;
+  while (!ctx.client_destroyed) {
+    sl_flush_clients(&ctx);
     if (ctx.connection) {
       if (ctx.needs_set_input_focus) {
         sl_set_input_focus(&ctx, ctx.host_focus_window);
@@ -4528,15 +6002,48 @@ int real_main(int argc, char** argv) {
       }
       xcb_flush(ctx.connection);
     }
-    if (wl_display_flush(ctx.display) < 0)
-      return EXIT_FAILURE;
+    // Whatever doesn't fit in the host connection is flushed once it's
+    // writable again.
+    if (sl_context_flush_host(&ctx) < 0 && errno != EAGAIN) {
+      status = EXIT_FAILURE;
+      break;
+    }
+    // Requests forwarded while dispatching may still be queued in the
+    // channel with --batch-sends.
+    if (ctx.channel && ctx.channel->flush() < 0) {
+      status = EXIT_FAILURE;
+      break;
+    }
+    TRACE_COUNTER("other", "host_flushes", ctx.host_flushes);
+    ctx.host_flushes = 0;
+
+    // With --metrics-socket, waiting for events is kept apart from
+    // dispatching them, so that the time each wakeup takes can be measured.
+    int timeout = -1;
+    if (ctx.metrics_event_source) {
+      struct pollfd loop_poll = {};
+
+      wl_event_loop_dispatch_idle(event_loop);
+      if (loop_wake_ns) {
+        sl_metrics_record_loop_iteration(&ctx.metrics,
+                                         sl_monotonic_time_ns() - loop_wake_ns);
+      }
+      loop_poll.fd = wl_event_loop_get_fd(event_loop);
+      loop_poll.events = POLLIN;
+      poll(&loop_poll, 1, -1);
+      loop_wake_ns = sl_monotonic_time_ns();
+      timeout = 0;
+    }
 
-    if (wl_event_loop_dispatch(event_loop, -1) == -1) {
+    if (wl_event_loop_dispatch(event_loop, timeout) == -1) {
       // Ignore EINTR or sommelier will exit when attached by strace or gdb.
-      if (errno != EINTR)
-        return EXIT_FAILURE;
+      if (errno != EINTR) {
+        status = EXIT_FAILURE;
+        break;
+      }
     }
   }
 
-  return EXIT_SUCCESS;
+  sl_context_release(&ctx);
+  return status;
 }  // NOLINT(readability/fn_size)
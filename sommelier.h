@@ -6,14 +6,24 @@
 #define VM_TOOLS_SOMMELIER_SOMMELIER_H_
 
 #include <limits.h>
+#ifdef GAMEPAD_SUPPORT
+#include <linux/input.h>
+#endif
 #include <linux/types.h>
 #include <sys/types.h>
+#include <functional>
+#include <memory>
+#include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include <wayland-server.h>
 #include <wayland-util.h>
 #include <xcb/xcb.h>
 #include <xkbcommon/xkbcommon.h>
 
+#include "compositor/sommelier-copy.h"  // NOLINT(build/include_directory)
+#include "compositor/sommelier-linux-drm-syncobj.h"  // NOLINT(build/include_directory)
 #include "compositor/sommelier-mmap.h"  // NOLINT(build/include_directory)
 #include "sommelier-ctx.h"              // NOLINT(build/include_directory)
 #include "sommelier-global.h"           // NOLINT(build/include_directory)
@@ -76,6 +86,10 @@ void sl_registry_handler(void* data,
                          uint32_t version);
 void sl_registry_remover(void* data, struct wl_registry* registry, uint32_t id);
 
+// Frees the host globals, the proxies bound to them and the windows |ctx|
+// tracks, for sl_context_release(). Clients must be gone by then.
+void sl_release_globals(struct sl_context* ctx);
+
 // We require a host compositor supporting at least this wl_compositor version.
 constexpr uint32_t kMinHostWlCompositorVersion =
     WL_SURFACE_SET_BUFFER_SCALE_SINCE_VERSION;
@@ -119,6 +133,30 @@ struct sl_host_pointer {
   uint32_t time;
   wl_fixed_t axis_delta[2];
   int32_t axis_discrete[2];
+
+  // --coalesce-pointer-motion holds motion back until the end of its frame,
+  // and whole frames of motion for longer to cap the rate. Only the latest
+  // position is kept, relative motion is summed up.
+  bool coalesce_motion = false;
+  bool motion_pending = false;
+  uint32_t motion_time = 0;
+  wl_fixed_t motion_x = 0;
+  wl_fixed_t motion_y = 0;
+  bool relative_motion_pending = false;
+  // The frame of the held motion still has to be sent.
+  bool frame_pending = false;
+  // Events besides motion are part of the current frame.
+  bool frame_has_other_events = false;
+  int64_t last_motion_forwarded_ns = 0;
+  std::unique_ptr<struct wl_event_source> motion_timer;
+  // sl_host_relative_pointer::link of the relative pointers of this pointer.
+  struct wl_list relative_pointers;
+  // The cursor last forwarded to the host, so that setting it again isn't.
+  bool cursor_forwarded = false;
+  uint32_t cursor_serial = 0;
+  WeakResourcePtr<sl_host_surface> cursor_surface;
+  int32_t cursor_hotspot_x = 0;
+  int32_t cursor_hotspot_y = 0;
 };
 
 struct sl_relative_pointer_manager {
@@ -142,10 +180,40 @@ struct sl_fractional_scale {
 };
 
 struct sl_host_callback {
+  struct sl_context* ctx;
   struct wl_resource* resource;
+  // Null while held back in sl_host_surface::deferred_callbacks instead.
   struct wl_callback* proxy;
+  struct wl_list link;
+  WeakResourcePtr<sl_host_surface> surface;
+  // When held back after the host fired it, the time the host gave and
+  // when that was.
+  uint32_t host_time;
+  int64_t held_since_ns;
+};
+
+// A request of the client held back behind a commit waiting for its
+// acquire point, see sl_host_surface_queue_request().
+struct sl_held_request {
+  // What the request is for, or null once the client has destroyed it.
+  struct wl_resource* resource;
+  struct wl_listener resource_destroy_listener;
+  std::unique_ptr<std::function<void()>> request;
+
+  ~sl_held_request();
 };
 
+// Damage of one commit from the client, as it gave it with
+// wl_surface.damage and wl_surface.damage_buffer.
+struct sl_damage {
+  pixman_region32_t surface;
+  pixman_region32_t buffer;
+};
+
+// How many commits of damage a surface remembers. Output buffers last
+// copied into longer ago than this are copied into in full.
+#define SL_DAMAGE_HISTORY_SIZE 8
+
 struct sl_host_surface {
   struct sl_context* ctx;
   struct wl_resource* resource;
@@ -170,6 +238,17 @@ struct sl_host_surface {
   struct sl_mmap* contents_shm_mmap;
   bool contents_shaped;
   pixman_region32_t contents_shape;
+  // Damage in host surface coordinates for the next commit to the host,
+  // forwarded as few rectangles as is reasonable then.
+  pixman_region32_t pending_damage;
+  // Damage for the commit the client is building, and that of its latest
+  // commits, indexed by |damage_seq| modulo SL_DAMAGE_HISTORY_SIZE. Each
+  // output buffer remembers which commit it was last brought up to date
+  // with, so what it needs copying is worked out when it's used instead
+  // of every buffer accumulating every rectangle.
+  struct sl_damage client_damage;
+  struct sl_damage damage_history[SL_DAMAGE_HISTORY_SIZE];
+  uint64_t damage_seq = 0;
   int has_role;
   int has_output;
   int has_own_scale;
@@ -182,6 +261,80 @@ struct sl_host_surface {
   struct wl_list busy_buffers;
   struct sl_window* window = nullptr;
   WeakResourcePtr<sl_host_output> output;
+  // Observed time between commits, for --pointer-motions-per-frame, and
+  // when the latest was, also for --buffer-idle-timeout.
+  int64_t last_commit_ns = 0;
+  int64_t commit_interval_ns = 0;
+  // The copies of the commit being handled, kept so that committing doesn't
+  // allocate once this has grown to fit.
+  std::vector<sl_copy_job> copy_jobs;
+  // Set while the client has a wp_linux_drm_syncobj_surface_v1 for this
+  // surface.
+  struct sl_drm_syncobj_surface* syncobj_surface = nullptr;
+  // The format/modifier pairs of the scanout tranches in the host's latest
+  // surface feedback.
+  std::vector<std::pair<uint32_t, uint64_t>> scanout_formats;
+  // Whether the attached buffer could be scanned out by the host as it is.
+  bool attached_scanout_compatible = false;
+  // Set from wl_surface.attach until the commit that applies it.
+  bool attach_pending = false;
+  // Set from any request changing the pending state until the commit that
+  // applies it. Much of that state is forwarded to the proxy right away.
+  bool state_pending = false;
+  // Frame callbacks held back, while the window is hidden with
+  // --hidden-frame-interval or to pace it to its max_fps quirk, and the
+  // timer that fires them.
+  struct wl_list deferred_callbacks;
+  std::unique_ptr<struct wl_event_source> deferred_frame_timer;
+  // The earliest time the next frame callback goes out at with max_fps.
+  int64_t next_frame_ns = 0;
+  // The latest client buffer while the window is hidden, which isn't copied
+  // until the window is shown.
+  struct sl_mmap* hidden_contents = nullptr;
+  // Set once the surface is used as a cursor. Its copied contents are only
+  // attached to the host at commit, and not at all if they hash the same as
+  // the image in |cursor_buffer| the host already has.
+  bool is_cursor = false;
+  bool cursor_attach_pending = false;
+  int32_t cursor_attach_x = 0;
+  int32_t cursor_attach_y = 0;
+  struct sl_output_buffer* cursor_buffer = nullptr;
+  uint64_t cursor_hash = 0;
+  // What copying into shm and dmabuf output buffers, indexed by whether
+  // it's a dmabuf, has cost including the syncs around it, in ns per MiB.
+  // 0 until measured. For --adaptive-output-buffers.
+  int64_t output_copy_cost[2] = {};
+  // Commits since the kind of output buffer not in use was last tried, and
+  // the kind tried next.
+  uint32_t output_probe_commits = 0;
+  bool output_probe_dmabuf = false;
+  // Set while the surface is a synchronized subsurface. The host applies its
+  // commits with its parent's, so they're held until the parent commits and
+  // then all go out together before it. A held commit takes in the pending
+  // state when it goes out, so any request changing that state for the next
+  // commit applies the held one first. Commits held in a row with nothing
+  // in between are merged. |sync_link| is in the parent's |sync_children|
+  // while a commit is held.
+  WeakResourcePtr<sl_host_surface> sync_parent;
+  bool sync_commit_pending = false;
+  struct wl_list sync_link;
+  struct wl_list sync_children;
+  // Fences and subsurface commits the next commit of the proxy waits for.
+  // A commit while any are left is deferred until they're done, without
+  // holding other surfaces back. A request changing the pending state waits
+  // for a deferred commit to go out first.
+  int commit_blockers = 0;
+  bool commit_deferred = false;
+  // A synchronized subsurface's deferred commit holds its parent's back, so
+  // that the host still applies them together. |deferred_link| is in the
+  // parent's |deferred_children| until it goes out.
+  struct sl_host_surface* deferred_parent = nullptr;
+  struct wl_list deferred_link;
+  struct wl_list deferred_children;
+  // Requests changing the pending state while a commit is held back for its
+  // acquire point, handled in order once it's applied. Nothing else waits
+  // for the point.
+  std::vector<std::unique_ptr<struct sl_held_request>> held_requests;
 };
 MAP_STRUCTS(wl_surface, sl_host_surface);
 
@@ -189,6 +342,9 @@ struct sl_host_region {
   struct sl_context* ctx;
   struct wl_resource* resource;
   struct wl_region* proxy;
+  // What the proxy holds, copied for the requests that use the region but
+  // are held back, see sl_host_surface::held_requests.
+  pixman_region32_t region;
 };
 MAP_STRUCTS(wl_region, sl_host_region);
 
@@ -202,12 +358,33 @@ struct sl_host_buffer {
   uint32_t shm_format;
   struct sl_sync_point* sync_point;
   bool is_drm;
-};
-
-struct sl_data_source_send_request {
+  // The format and modifier of dmabuf buffers.
+  uint32_t drm_format;
+  uint64_t modifier;
+  // Identifies the dmabuf, if any, for the plane 0 fixup cache.
+  dev_t dmabuf_dev = 0;
+  ino_t dmabuf_ino = 0;
+  // Release points of the commits the buffer is still busy with.
+  std::vector<sl_drm_syncobj_point> release_points;
+};
+
+// A transfer of the X11 clipboard to a Wayland client. Each runs through a
+// property of its own on |ctx->selection_window|, so that several can be in
+// flight at once.
+struct sl_selection_send {
+  struct sl_context* ctx;
   int fd;
+  std::string mime_type;
+  // Interns |mime_type|, unless |target| was cached already.
   xcb_intern_atom_cookie_t cookie;
   struct sl_data_source* data_source;
+  // Target requested, and the property it is delivered in once started.
+  xcb_atom_t target;
+  xcb_atom_t property;
+  int incremental;
+  xcb_get_property_reply_t* property_reply;
+  int property_offset;
+  std::unique_ptr<struct wl_event_source> event_source;
   struct wl_list link;
 };
 
@@ -239,6 +416,22 @@ struct sl_xdg_output_manager {
   struct zxdg_output_manager_v1* internal;
 };
 
+// The wl_output state forwarded to a client.
+struct sl_output_state {
+  int x;
+  int physical_width;
+  int physical_height;
+  int subpixel;
+  std::string make;
+  std::string model;
+  int transform;
+  uint32_t flags;
+  int width;
+  int height;
+  int refresh;
+  int scale;
+};
+
 struct sl_host_output {
   struct sl_context* ctx;
   struct wl_resource* resource;
@@ -249,6 +442,13 @@ struct sl_host_output {
   // Whether or not this output has been modified and updated information needs
   // to be forwarded.
   bool needs_update;
+  // Whether the host is between sending changes to this output and the
+  // wl_output.done that completes them. The output isn't forwarded then, so
+  // that clients never see half of a change.
+  bool changes_pending;
+  // What the client was last sent, if anything.
+  bool has_sent_state;
+  struct sl_output_state sent_state;
 
   // Position in host's global logical space
   int x;
@@ -338,10 +538,10 @@ struct sl_host_seat {
 };
 MAP_STRUCTS(wl_seat, sl_host_seat);
 
-struct sl_accelerator {
-  uint32_t modifiers;
-  xkb_keysym_t symbol;
-};
+// Identifies an accelerator by its modifiers and lowercase key symbol.
+inline uint64_t sl_accelerator_key(uint32_t modifiers, xkb_keysym_t symbol) {
+  return static_cast<uint64_t>(modifiers) << 32 | symbol;
+}
 
 struct sl_keyboard_extension {
   struct sl_context* ctx;
@@ -362,6 +562,8 @@ struct sl_data_offer {
   struct wl_data_offer* internal;
   struct wl_array atoms;    // Contains xcb_atom_t
   struct wl_array cookies;  // Contains xcb_intern_atom_cookie_t
+  // The MIME type each of |cookies| interns.
+  std::vector<std::string> cookie_names;
 };
 
 struct sl_text_input_manager {
@@ -448,9 +650,13 @@ struct sl_linux_dmabuf {
   uint32_t version;
   struct sl_global* host_drm_global;
   struct sl_global* host_linux_dmabuf_global;
+  struct sl_global* host_drm_syncobj_global;
 
-  // binding (version 2) is only used for wl_shm copy-on-commit
-  struct zwp_linux_dmabuf_v1* proxy_v2;
+  // Sommelier's own binding (version 2 or later), used for wl_shm
+  // copy-on-commit and zero-copy shm.
+  struct zwp_linux_dmabuf_v1* internal;
+  // The host's default feedback on |internal|, at version 4.
+  struct sl_linux_dmabuf_host_feedback* host_feedback;
 };
 
 struct sl_linux_explicit_synchronization {
@@ -463,7 +669,6 @@ struct sl_fractional_scale_manager {
   struct sl_context* ctx;
   uint32_t id;
   struct sl_global* host_fractional_scale_manager_global;
-  struct wp_fractional_scale_manager_v1* internal;
 };
 
 struct sl_global {
@@ -483,6 +688,7 @@ struct sl_host_registry {
 };
 
 typedef void (*sl_sync_func_t)(struct sl_context* ctx,
+                               struct sl_host_surface* host,
                                struct sl_sync_point* sync_point);
 
 struct sl_sync_point {
@@ -514,6 +720,16 @@ struct sl_host_gamepad {
   uint32_t product_id;
   uint32_t version;
   const InputMapping* input_mapping;
+  // Events of the current frame, written to |uinput_dev| in one go when the
+  // frame ends.
+  std::vector<struct input_event> pending_events;
+  // Host timestamp of the first event in |pending_events|.
+  uint32_t pending_time;
+  // Smallest difference seen between our clock and the host timestamps, in
+  // milliseconds and modulo 2^32 like the timestamps. The clocks are not
+  // shared with the host, so latency is measured against this.
+  uint32_t min_clock_offset_ms;
+  bool has_clock_offset;
 };
 #endif
 
@@ -523,6 +739,19 @@ struct sl_idle_inhibit_manager {
   struct sl_global* host_global;
 };
 
+struct sl_presentation {
+  struct sl_context* ctx;
+  uint32_t id;
+  struct sl_global* host_global;
+  // Estimated difference between our CLOCK_MONOTONIC and the host's
+  // presentation clock, and the smallest seen in the current window of
+  // presented events.
+  int64_t clock_offset_ns;
+  bool has_clock_offset;
+  int64_t window_offset_ns;
+  uint32_t window_samples;
+};
+
 struct sl_host_buffer* sl_create_host_buffer(struct sl_context* ctx,
                                              struct wl_client* client,
                                              uint32_t id,
@@ -568,6 +797,10 @@ void sl_output_update_output_x(struct sl_context* ctx);
 // Forwards all the available information of an output to the client.
 void sl_output_send_host_output_state(struct sl_host_output* host);
 
+// Forwards the information of every output that has changed and isn't in the
+// middle of a change from the host.
+void sl_output_send_updates(struct sl_context* ctx);
+
 struct sl_global* sl_output_global_create(struct sl_output* output);
 
 struct sl_global* sl_seat_global_create(struct sl_seat* seat);
@@ -575,6 +808,9 @@ struct sl_global* sl_seat_global_create(struct sl_seat* seat);
 struct sl_global* sl_relative_pointer_manager_global_create(
     struct sl_context* ctx);
 
+// Sends the relative motion held back for the relative pointers of |host|.
+void sl_relative_pointer_forward_held_motion(struct sl_host_pointer* host);
+
 struct sl_global* sl_data_device_manager_global_create(struct sl_context* ctx);
 
 struct sl_global* sl_viewporter_global_create(struct sl_context* ctx);
@@ -607,6 +843,18 @@ struct sl_global* sl_fractional_scale_manager_global_create(
 
 struct sl_global* sl_idle_inhibit_manager_global_create(struct sl_context* ctx);
 
+struct sl_global* sl_presentation_global_create(struct sl_context* ctx);
+
+// Translates |host_ns| from the host's presentation clock to our
+// CLOCK_MONOTONIC, refining the estimated clock offset with the given sample
+// of our clock taken as the host's event arrived.
+int64_t sl_presentation_guest_time_ns(struct sl_presentation* presentation,
+                                      int64_t host_ns,
+                                      int64_t now_ns);
+
+// Returns nullptr if the DRM device has no timeline syncobjs to import.
+struct sl_global* sl_drm_syncobj_manager_global_create(struct sl_context* ctx);
+
 void sl_set_display_implementation(struct sl_context* ctx,
                                    struct wl_client* client);
 
@@ -619,6 +867,25 @@ void sl_host_seat_removed(struct sl_host_seat* host);
 void sl_restack_windows(struct sl_context* ctx, uint32_t focus_resource_id);
 
 void sl_roundtrip(struct sl_context* ctx);
+// Restacks the windows so that the one of |focus_resource_id| is on top,
+// like sl_restack_windows(), and holds back what's sent to the X client
+// after it until Xwayland has handled the restack. Unlike a round trip,
+// this doesn't wait.
+void sl_restack_windows_for_input(struct sl_context* ctx,
+                                  uint32_t focus_resource_id);
+// Flushes what's queued for clients, except for the X client while input
+// is held back for a restack.
+void sl_flush_clients(struct sl_context* ctx);
+// Has the --stats-summary and --stats-log stats output in --stats-timer,
+// and then every --stats-timer for as long as surfaces keep committing.
+void sl_schedule_stats(struct sl_context* ctx);
+
+// Returns the cached name of |atom|, or nullptr.
+const std::string* sl_lookup_cached_atom_name(struct sl_context* ctx,
+                                              xcb_atom_t atom);
+// Asks the X server for the name of |atom| without waiting for the reply.
+// The name is cached once it arrives.
+void sl_request_atom_name(struct sl_context* ctx, xcb_atom_t atom);
 
 struct sl_window* sl_lookup_window(struct sl_context* ctx, xcb_window_t id);
 int sl_is_our_window(struct sl_context* ctx, xcb_window_t id);
@@ -636,6 +903,8 @@ void sl_handle_configure_request(struct sl_context* ctx,
                                  xcb_configure_request_event_t* event);
 void sl_handle_property_notify(struct sl_context* ctx,
                                xcb_property_notify_event_t* event);
+// Frees and removes the events of |events| that a later one in it supersedes.
+void sl_coalesce_x_events(std::vector<xcb_generic_event_t*>& events);
 void sl_create_window(struct sl_context* ctx,
                       xcb_window_t id,
                       int x,
@@ -649,6 +918,56 @@ void sl_handle_focus_in(struct sl_context* ctx, xcb_focus_in_event_t* event);
 
 void sl_host_surface_commit(struct wl_client* client,
                             struct wl_resource* resource);
+// Sends on the deferred commit of |host|, waiting for what it's blocked on
+// if need be, and applies the commit held for it while it's a synchronized
+// subsurface or waits for its acquire point, if there is one, without
+// waiting for the point. Due before each request changing its pending
+// state that sl_host_surface_hold_request() didn't hold.
+void sl_host_surface_apply_held_commit(struct sl_host_surface* host);
+// Whether requests changing the pending state of |host| have to wait for a
+// commit held back for an acquire point that hasn't signaled. One whose
+// point has is applied.
+bool sl_host_surface_holds_requests(struct sl_host_surface* host);
+// Runs |request| once the commit held back for |host| is applied, unless
+// the client destroys |resource| before. Only while it holds requests.
+void sl_host_surface_queue_request(struct sl_host_surface* host,
+                                   struct wl_resource* resource,
+                                   std::function<void()> request);
+// Holds the request |handler| is handling for |resource| back, if it has to
+// wait for a commit of |host| as above, and has it handled again once that
+// commit is applied. Returns true if it's held.
+template <auto handler, typename... Args>
+bool sl_host_surface_hold_request(struct sl_host_surface* host,
+                                  struct wl_client* client,
+                                  struct wl_resource* resource,
+                                  Args... args) {
+  if (!sl_host_surface_holds_requests(host))
+    return false;
+  sl_host_surface_queue_request(
+      host, resource, [=] { handler(client, resource, args...); });
+  return true;
+}
+// Applies every commit held back for |host|'s acquire points and the
+// requests held behind them without waiting any longer, for when an object
+// they're for goes.
+void sl_host_surface_flush_held_requests(struct sl_host_surface* host);
+// Waits for everything the deferred commit of |host| is blocked on, which
+// sends it. Due before role state is sent for |host| outside the requests
+// of its client.
+void sl_host_surface_finish_deferred_commit(struct sl_host_surface* host);
+// Sends the host the damage of |host| held back since its last commit. Due
+// before each commit of its proxy.
+void sl_host_surface_flush_damage(struct sl_host_surface* host);
+// Commits the proxy of |host| with its damage, or defers that until
+// nothing blocks its commits any more.
+void sl_host_surface_commit_proxy(struct sl_host_surface* host);
+// Blocks and unblocks the commits of |host| to the host, see
+// sl_host_surface::commit_blockers.
+void sl_host_surface_block_commit(struct sl_host_surface* host);
+void sl_host_surface_unblock_commit(struct sl_host_surface* host);
+// Forwards what was held back while the window of |host| was hidden, once
+// it no longer is.
+void sl_host_surface_release_hidden(struct sl_host_surface* host);
 
 #ifdef GAMEPAD_SUPPORT
 void sl_gaming_seat_add_listener(struct sl_context* ctx);
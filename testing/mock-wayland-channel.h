@@ -43,6 +43,7 @@ class MockWaylandChannel : public WaylandChannel {
               send,
               (const struct WaylandSendReceive& send),
               (override));
+  MOCK_METHOD(int32_t, flush, (), (override));
   MOCK_METHOD(
       int32_t,
       handle_channel_event,
@@ -50,6 +51,13 @@ class MockWaylandChannel : public WaylandChannel {
        struct WaylandSendReceive& receive,     // NOLINT(runtime/references)
        int& out_read_pipe),                    // NOLINT(runtime/references)
       (override));
+  MOCK_METHOD(
+      int32_t,
+      release_receive,
+      (struct WaylandSendReceive & receive),  // NOLINT(runtime/references)
+      (override));
+  MOCK_METHOD(bool, has_pending_event, (), (override));
+  MOCK_METHOD(size_t, max_receive_batch, (), (override));
 
   MOCK_METHOD(int32_t,
               allocate,
@@ -57,7 +65,27 @@ class MockWaylandChannel : public WaylandChannel {
                struct WaylandBufferCreateOutput&
                    create_output),  // NOLINT(runtime/references)
               (override));
+  MOCK_METHOD(void,
+              free_buffer,
+              (const struct WaylandBufferCreateInfo& create_info,
+               const struct WaylandBufferCreateOutput& create_output),
+              (override));
+  MOCK_METHOD(int32_t,
+              prefetch_allocation,
+              (const struct WaylandBufferCreateInfo& create_info,
+               int& out_fence_fd),  // NOLINT(runtime/references)
+              (override));
+  MOCK_METHOD(int32_t,
+              handle_fence,
+              (int fence_fd, int& out_fence_fd),  // NOLINT(runtime/references)
+              (override));
   MOCK_METHOD(int32_t, sync, (int dmabuf_fd, uint64_t flags), (override));
+  MOCK_METHOD(int32_t,
+              import_shm,
+              (int shm_fd,
+               size_t size,
+               int& out_dmabuf_fd),  // NOLINT(runtime/references)
+              (override));
   MOCK_METHOD(int32_t,
               handle_pipe,
               (int read_fd,
@@ -0,0 +1,104 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "sommelier-perf-counters.h"  // NOLINT(build/include_directory)
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <atomic>
+#include <new>
+
+// Sanitizers bring their own malloc and operator new, which mustn't be
+// replaced, so nothing is counted in their builds.
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer) || \
+    __has_feature(thread_sanitizer)
+#define SL_SANITIZED_MALLOC 1
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define SL_SANITIZED_MALLOC 1
+#endif
+
+namespace {
+
+std::atomic<uint64_t> allocations;
+
+}  // namespace
+
+#if !defined(SL_SANITIZED_MALLOC)
+#if defined(__GLIBC__)
+extern "C" {
+
+// The bounds of this binary's code, from the linker.
+extern const char __ehdr_start;
+extern const char etext;
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+// Only calls made from this binary are counted, since libwayland and pixman
+// allocating on every message is out of sommelier's hands.
+static inline void sl_count_malloc(const void* caller) {
+  if (caller >= &__ehdr_start && caller < &etext)
+    allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* malloc(size_t size) {
+  sl_count_malloc(__builtin_return_address(0));
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  sl_count_malloc(__builtin_return_address(0));
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  sl_count_malloc(__builtin_return_address(0));
+  return __libc_realloc(ptr, size);
+}
+
+}  // extern "C"
+#define sl_uncounted_malloc __libc_malloc
+#else
+#define sl_uncounted_malloc malloc
+#endif
+
+// Every C++ allocation counts, wherever it comes from, so that those made
+// inside libstdc++ on sommelier's behalf aren't missed.
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void* ptr = sl_uncounted_malloc(size ? size : 1);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  free(ptr);
+}
+#endif  // !defined(SL_SANITIZED_MALLOC)
+
+namespace vm_tools {
+namespace sommelier {
+
+uint64_t PerfAllocationCount() {
+  return allocations.load(std::memory_order_relaxed);
+}
+
+int64_t PerfCpuTimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+}  // namespace sommelier
+}  // namespace vm_tools
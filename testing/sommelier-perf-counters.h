@@ -0,0 +1,31 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_TESTING_SOMMELIER_PERF_COUNTERS_H_
+#define VM_TOOLS_SOMMELIER_TESTING_SOMMELIER_PERF_COUNTERS_H_
+
+#include <stdint.h>
+
+// What a piece of work costs, for the tests, the benchmarks and the
+// fuzzer's performance mode to measure the same way.
+//
+// Linking sommelier-perf-counters.cc replaces the global operator new and,
+// with glibc, malloc, calloc and realloc. Sanitizer builds keep their own,
+// and count no allocations.
+
+namespace vm_tools {
+namespace sommelier {
+
+// Heap allocations made so far: every operator new, and the malloc, calloc
+// and realloc calls made by code in the binary itself. Those made inside
+// shared libraries like libwayland and pixman aren't included.
+uint64_t PerfAllocationCount();
+
+// CPU time used by all threads of the process so far.
+int64_t PerfCpuTimeNs();
+
+}  // namespace sommelier
+}  // namespace vm_tools
+
+#endif  // VM_TOOLS_SOMMELIER_TESTING_SOMMELIER_PERF_COUNTERS_H_
@@ -30,6 +30,8 @@ MAP_STRUCT_TO_LISTENER(xdg_wm_base*, xdg_wm_base_listener);
 MAP_STRUCT_TO_LISTENER(xdg_surface*, xdg_surface_listener);
 MAP_STRUCT_TO_LISTENER(xdg_toplevel*, xdg_toplevel_listener);
 MAP_STRUCT_TO_LISTENER(wl_output*, wl_output_listener);
+MAP_STRUCT_TO_LISTENER(wl_pointer*, wl_pointer_listener);
+MAP_STRUCT_TO_LISTENER(wl_keyboard*, wl_keyboard_listener);
 MAP_STRUCT_TO_LISTENER(wl_callback*, wl_callback_listener);
 MAP_STRUCT_TO_LISTENER(wl_registry*, wl_registry_listener);
 MAP_STRUCT_TO_LISTENER(wl_surface*, wl_surface_listener);
@@ -39,6 +41,8 @@ MAP_STRUCT_TO_LISTENER(zxdg_output_v1*, zxdg_output_v1_listener);
 MAP_STRUCT_TO_LISTENER(zcr_gaming_seat_v2*, zcr_gaming_seat_v2_listener);
 MAP_STRUCT_TO_LISTENER(zcr_gamepad_v2*, zcr_gamepad_v2_listener);
 MAP_STRUCT_TO_LISTENER(zwp_linux_dmabuf_v1*, zwp_linux_dmabuf_v1_listener);
+MAP_STRUCT_TO_LISTENER(zwp_linux_dmabuf_feedback_v1*,
+                       zwp_linux_dmabuf_feedback_v1_listener);
 
 namespace vm_tools {
 namespace sommelier {
@@ -76,7 +76,7 @@ class X11TestBase : public WaylandTestBase {
     sl_window* window = CreateWindowWithoutRole();
 
     // Pretend we created a frame window too
-    window->frame_id = xcb.generate_id(ctx.connection);
+    sl_window_set_frame_id(window, xcb.generate_id(ctx.connection));
 
     window->host_surface_id = SurfaceId(xwayland->CreateSurface());
     sl_window_update(window);
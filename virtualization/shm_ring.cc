@@ -0,0 +1,111 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "shm_ring.h"  // NOLINT(build/include_directory)
+
+#include <errno.h>
+
+#include <cstring>
+
+uint32_t ShmRing::record_bytes(uint32_t size) {
+  return (sizeof(struct ShmRingRecord) + size + SHM_RING_ALIGNMENT - 1) &
+         ~(SHM_RING_ALIGNMENT - 1);
+}
+
+uint32_t ShmRing::max_payload() const {
+  return size_ / 2 - sizeof(struct ShmRingRecord);
+}
+
+bool ShmRing::write(const void* payload,
+                    uint32_t size,
+                    uint32_t inner_seq,
+                    bool& was_empty) {
+  if (size > max_payload())
+    return false;
+
+  uint32_t tail = __atomic_load_n(&control_->tail, __ATOMIC_ACQUIRE);
+  uint32_t used = head_ - tail;
+  // A consumer ahead of us is broken; treat the ring as full.
+  if (used > size_)
+    return false;
+
+  uint32_t offset = head_ & (size_ - 1);
+  uint32_t contiguous = size_ - offset;
+  uint32_t bytes = record_bytes(size);
+  uint32_t padding = bytes > contiguous ? contiguous : 0;
+  if (padding + bytes > size_ - used)
+    return false;
+
+  uint32_t head = head_;
+  struct ShmRingRecord* record;
+  if (padding) {
+    record = reinterpret_cast<struct ShmRingRecord*>(data_ + offset);
+    record->size = SHM_RING_PADDING;
+    record->inner_seq = 0;
+    head += padding;
+    offset = 0;
+  }
+
+  record = reinterpret_cast<struct ShmRingRecord*>(data_ + offset);
+  record->size = size;
+  record->inner_seq = inner_seq;
+  memcpy(record + 1, payload, size);
+  head += bytes;
+  __atomic_store_n(&control_->head, head, __ATOMIC_RELEASE);
+
+  // Pairs with the fence in `pop`: either the consumer sees the new head
+  // before it goes to sleep, or we see that it had caught up.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  was_empty = __atomic_load_n(&control_->tail, __ATOMIC_RELAXED) == head_;
+  head_ = head;
+  return true;
+}
+
+int32_t ShmRing::peek(const uint8_t*& payload,
+                      uint32_t& size,
+                      uint32_t& inner_seq) {
+  uint32_t head = __atomic_load_n(&control_->head, __ATOMIC_ACQUIRE);
+
+  payload = nullptr;
+  while (head != tail_) {
+    uint32_t available = head - tail_;
+    uint32_t offset = tail_ & (size_ - 1);
+    uint32_t contiguous = size_ - offset;
+    if (available > size_ || available < sizeof(struct ShmRingRecord))
+      return -EINVAL;
+
+    const struct ShmRingRecord* record =
+        reinterpret_cast<const struct ShmRingRecord*>(data_ + offset);
+    size = record->size;
+    if (size == SHM_RING_PADDING) {
+      if (available < contiguous)
+        return -EINVAL;
+
+      tail_ += contiguous;
+      __atomic_store_n(&control_->tail, tail_, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    uint32_t bytes = record_bytes(size);
+    if (size > max_payload() || bytes > contiguous || bytes > available)
+      return -EINVAL;
+
+    peeked_bytes_ = bytes;
+    inner_seq = record->inner_seq;
+    payload = reinterpret_cast<const uint8_t*>(record + 1);
+    break;
+  }
+
+  return 0;
+}
+
+void ShmRing::pop() {
+  tail_ += peeked_bytes_;
+  peeked_bytes_ = 0;
+  __atomic_store_n(&control_->tail, tail_, __ATOMIC_RELEASE);
+
+  // Pairs with the fence in `write`, so a record published while we caught
+  // up is either seen by the next `peek` or gets us notified.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
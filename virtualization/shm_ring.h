@@ -0,0 +1,111 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef VM_TOOLS_SOMMELIER_VIRTUALIZATION_SHM_RING_H_
+#define VM_TOOLS_SOMMELIER_VIRTUALIZATION_SHM_RING_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// Layout of the memory region shared with the host by `ShmRingChannel`:
+//
+//   ShmRingRegionHeader
+//   ShmRingControl          guest to host
+//   ShmRingControl          host to guest
+//   uint8_t[ring_size]      guest to host data
+//   uint8_t[ring_size]      host to guest data
+//
+// The host fills in the header before the guest maps the region.
+#define SHM_RING_MAGIC 0x53524e47  // "SRNG"
+#define SHM_RING_VERSION 1
+
+// Header records are 8 byte aligned, as are the payloads that follow them.
+#define SHM_RING_ALIGNMENT 8
+
+// `ShmRingRecord.size` of the filler a record which wouldn't fit before the
+// end of the data is put behind, so that records never wrap around.
+#define SHM_RING_PADDING 0xffffffff
+
+struct ShmRingRegionHeader {
+  uint32_t magic;
+  uint32_t version;
+  // ivshmem peer id of the host, for ringing its doorbell.
+  uint32_t host_peer;
+  // Size of each data area in bytes.  A power of two.
+  uint32_t ring_size;
+  uint8_t pad[48];
+};
+
+// One direction of the ring pair.  A single producer appends records at
+// `head` and a single consumer takes them off at `tail`.  Both only ever
+// increase, wrapping around at 2^32, and index the data modulo its size.
+// They live on separate cache lines so the two sides don't contend.
+struct ShmRingControl {
+  uint32_t head;
+  uint8_t pad0[60];
+  uint32_t tail;
+  uint8_t pad1[60];
+};
+
+struct ShmRingRecord {
+  // Payload size in bytes, or SHM_RING_PADDING.
+  uint32_t size;
+  // How many messages the producer sent through its fallback channel before
+  // this record.  The consumer must handle all of those first.
+  uint32_t inner_seq;
+};
+
+// Lock-free single producer, single consumer view of one ring direction.
+// Either side may run in another VM, so nothing read from shared memory is
+// trusted.
+class ShmRing {
+ public:
+  ShmRing() = default;
+  // `size` must be a power of two.
+  ShmRing(struct ShmRingControl* control, uint8_t* data, uint32_t size)
+      : control_(control),
+        data_(data),
+        size_(size),
+        head_(control->head),
+        tail_(control->tail) {}
+
+  // Largest payload `write` accepts.  Half the ring, so that a record always
+  // fits once the consumer catches up, however the ring is wrapped.
+  uint32_t max_payload() const;
+
+  // Producer side.  Appends a record holding `payload`.  Returns false if the
+  // ring doesn't have room for it right now.  On success, `was_empty`
+  // tells whether the consumer had already taken everything before it, in
+  // which case it may be asleep and needs to be notified.
+  bool write(const void* payload,
+             uint32_t size,
+             uint32_t inner_seq,
+             bool& was_empty);
+
+  // Consumer side.  Sets `payload`, `size` and `inner_seq` from the oldest
+  // record, or `payload` to nullptr if the ring is empty.  The payload stays
+  // valid until `pop`.  Returns 0 on success, or -EINVAL if the producer
+  // corrupted the ring.
+  int32_t peek(const uint8_t*& payload, uint32_t& size, uint32_t& inner_seq);
+
+  // Consumer side.  Takes the record returned by the last `peek` off the
+  // ring.
+  void pop();
+
+ private:
+  static uint32_t record_bytes(uint32_t size);
+
+  struct ShmRingControl* control_ = nullptr;
+  uint8_t* data_ = nullptr;
+  uint32_t size_ = 0;
+  // Private copies of the indices each side owns, since the other side can
+  // write anything to the shared ones.
+  uint32_t head_ = 0;
+  uint32_t tail_ = 0;
+  // Bytes the record returned by `peek` takes up, kept out of shared memory
+  // so the producer can't change it under us.
+  uint32_t peeked_bytes_ = 0;
+};
+
+#endif  // VM_TOOLS_SOMMELIER_VIRTUALIZATION_SHM_RING_H_
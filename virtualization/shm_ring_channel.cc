@@ -0,0 +1,324 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "../sommelier-logging.h"  // NOLINT(build/include_directory)
+#include "../sommelier-tracing.h"  // NOLINT(build/include_directory)
+#include "wayland_channel.h"       // NOLINT(build/include_directory)
+
+// Offset of the doorbell in the ivshmem registers.  Writing
+// (peer << 16) | vector to it interrupts `peer`.
+#define IVSHMEM_DOORBELL 12
+
+// Largest ring the host may ask for, so region sizes can't overflow.
+#define MAX_RING_SIZE (1u << 30)
+
+ShmRingChannel::~ShmRingChannel() {
+  if (region_ != MAP_FAILED)
+    munmap(region_, region_size_);
+
+  if (registers_ != MAP_FAILED)
+    munmap(registers_, sysconf(_SC_PAGESIZE));
+
+  if (device_fd_ >= 0)
+    close(device_fd_);
+
+  delete inner_;
+}
+
+WaylandChannel* ShmRingChannel::release_inner() {
+  WaylandChannel* inner = inner_;
+  inner_ = nullptr;
+  return inner;
+}
+
+int32_t ShmRingChannel::init() {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  struct ShmRingRegionHeader header;
+
+  device_fd_ = open(device_, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (device_fd_ < 0)
+    return -errno;
+
+  // UIO selects map N with an offset of N pages.
+  registers_ = mmap(nullptr, page_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    device_fd_, 0);
+  if (registers_ == MAP_FAILED)
+    return -errno;
+
+  void* header_addr =
+      mmap(nullptr, page_size, PROT_READ, MAP_SHARED, device_fd_, page_size);
+  if (header_addr == MAP_FAILED)
+    return -errno;
+
+  memcpy(&header, header_addr, sizeof(header));
+  munmap(header_addr, page_size);
+
+  if (header.magic != SHM_RING_MAGIC || header.version != SHM_RING_VERSION) {
+    LOG(ERROR) << "unsupported shared memory ring region";
+    return -EINVAL;
+  }
+
+  uint32_t ring_size = header.ring_size;
+  if (ring_size == 0 || ring_size > MAX_RING_SIZE ||
+      (ring_size & (ring_size - 1)) != 0) {
+    LOG(ERROR) << "invalid shared memory ring size " << ring_size;
+    return -EINVAL;
+  }
+
+  region_size_ = sizeof(struct ShmRingRegionHeader) +
+                 2 * sizeof(struct ShmRingControl) + 2 * size_t{ring_size};
+  region_ = mmap(nullptr, region_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 device_fd_, page_size);
+  if (region_ == MAP_FAILED)
+    return -errno;
+
+  uint8_t* base = reinterpret_cast<uint8_t*>(region_);
+  struct ShmRingControl* controls = reinterpret_cast<struct ShmRingControl*>(
+      base + sizeof(struct ShmRingRegionHeader));
+  uint8_t* data = reinterpret_cast<uint8_t*>(controls + 2);
+
+  send_ring_ = ShmRing(&controls[0], data, ring_size);
+  receive_ring_ = ShmRing(&controls[1], data + ring_size, ring_size);
+  host_peer_ = header.host_peer;
+
+  // Anything `inner` can send must fit in a ring record as well.
+  if (send_ring_.max_payload() < inner_->max_send_size()) {
+    LOG(ERROR) << "shared memory ring too small: " << ring_size;
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+bool ShmRingChannel::supports_dmabuf() {
+  return inner_->supports_dmabuf();
+}
+
+int32_t ShmRingChannel::create_context(int& out_channel_fd) {
+  struct epoll_event event = {};
+  int32_t ret;
+
+  ret = inner_->create_context(inner_fd_);
+  if (ret)
+    return ret;
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0)
+    return -errno;
+
+  event.events = EPOLLIN;
+  event.data.fd = inner_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, inner_fd_, &event))
+    return -errno;
+
+  event.data.fd = device_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, device_fd_, &event))
+    return -errno;
+
+  out_channel_fd = epoll_fd_;
+  return 0;
+}
+
+int32_t ShmRingChannel::create_pipe(int& out_pipe_fd) {
+  return inner_->create_pipe(out_pipe_fd);
+}
+
+int32_t ShmRingChannel::send(const struct WaylandSendReceive& send) {
+  bool was_empty;
+
+  if (send.num_fds == 0 && send.data_size > 0 &&
+      send_ring_.write(send.data, send.data_size, inner_sent_, was_empty)) {
+    if (was_empty)
+      ring_doorbell();
+    traffic_.messages_sent++;
+    traffic_.bytes_sent += send.data_size;
+    TRACE_COUNTER("other", "shm_ring_messages_sent", traffic_.messages_sent);
+    TRACE_COUNTER("other", "shm_ring_bytes_sent", traffic_.bytes_sent);
+    return 0;
+  }
+
+  // Messages with fds, and anything the ring has no room for right now, go
+  // through `inner`.  Records written after this one wait for it on the
+  // host.
+  struct WaylandSendReceive inner_send = send;
+  inner_send.channel_fd = inner_fd_;
+  int32_t ret = inner_->send(inner_send);
+  if (ret)
+    return ret;
+
+  inner_sent_++;
+  return 0;
+}
+
+int32_t ShmRingChannel::flush() {
+  return inner_->flush();
+}
+
+bool ShmRingChannel::ring_receive_ready(int32_t& ret) {
+  const uint8_t* payload;
+  uint32_t size;
+  uint32_t inner_seq;
+
+  ret = receive_ring_.peek(payload, size, inner_seq);
+  if (ret || !payload)
+    return false;
+
+  // Sequence numbers wrap, so compare the difference.
+  return static_cast<int32_t>(inner_seq - inner_received_) <= 0;
+}
+
+void ShmRingChannel::ring_doorbell() {
+  volatile uint32_t* doorbell = reinterpret_cast<volatile uint32_t*>(
+      reinterpret_cast<uint8_t*>(registers_) + IVSHMEM_DOORBELL);
+  *doorbell = host_peer_ << 16;
+}
+
+void ShmRingChannel::ack_interrupt() {
+  uint32_t count;
+
+  // Reading the interrupt count acknowledges it, and writing 1 unmasks the
+  // interrupt again where UIO needs that.  Both fail harmlessly otherwise.
+  if (read(device_fd_, &count, sizeof(count)) == sizeof(count)) {
+    uint32_t unmask = 1;
+    if (write(device_fd_, &unmask, sizeof(unmask)) < 0 && errno != ENOSYS)
+      LOG(VERBOSE) << "failed to unmask ring interrupt: " << strerror(errno);
+  }
+}
+
+int32_t ShmRingChannel::handle_channel_event(
+    enum WaylandChannelEvent& event_type,
+    struct WaylandSendReceive& receive,
+    int& out_read_pipe) {
+  struct pollfd inner_poll = {};
+  int32_t ret;
+
+  event_type = WaylandChannelEvent::None;
+
+  // The host may have published records without waking us up, and rings the
+  // doorbell before we get here if it did, so only ack once the ring runs
+  // dry and then look again.
+  bool ready = ring_receive_ready(ret);
+  if (!ready && !ret) {
+    ack_interrupt();
+    ready = ring_receive_ready(ret);
+  }
+  if (ret)
+    return ret;
+
+  if (ready) {
+    const uint8_t* payload;
+    uint32_t size;
+    uint32_t inner_seq;
+
+    receive_ring_.peek(payload, size, inner_seq);
+    receive.data = const_cast<uint8_t*>(payload);
+    receive.data_size = size;
+    ring_receive_held_ = true;
+    event_type = WaylandChannelEvent::Receive;
+    traffic_.messages_received++;
+    traffic_.bytes_received += size;
+    TRACE_COUNTER("other", "shm_ring_messages_received",
+                  traffic_.messages_received);
+    TRACE_COUNTER("other", "shm_ring_bytes_received", traffic_.bytes_received);
+    return 0;
+  }
+
+  // `inner` only needs to hear about a wakeup once it has handled what it
+  // queued, since it doesn't ask its host for more until then.
+  if (!inner_->has_pending_event()) {
+    inner_poll.fd = inner_fd_;
+    inner_poll.events = POLLIN;
+    if (poll(&inner_poll, 1, 0) <= 0)
+      return 0;
+    ret = inner_->handle_channel_wakeup();
+    if (ret)
+      return ret;
+  }
+
+  struct WaylandSendReceive inner_receive = receive;
+  inner_receive.channel_fd = inner_fd_;
+  ret = inner_->handle_channel_event(event_type, inner_receive, out_read_pipe);
+  inner_receive.channel_fd = receive.channel_fd;
+  receive = inner_receive;
+  if (ret)
+    return ret;
+
+  if (event_type == WaylandChannelEvent::Receive ||
+      event_type == WaylandChannelEvent::ReceiveAndProxy) {
+    inner_received_++;
+    ring_receive_held_ = false;
+  }
+
+  return 0;
+}
+
+int32_t ShmRingChannel::release_receive(struct WaylandSendReceive& receive) {
+  if (!ring_receive_held_)
+    return inner_->release_receive(receive);
+
+  receive_ring_.pop();
+  ring_receive_held_ = false;
+  receive.data = nullptr;
+  return 0;
+}
+
+bool ShmRingChannel::has_pending_event() {
+  int32_t ret;
+
+  // A corrupt ring is reported by the next `handle_channel_event`.
+  return ring_receive_ready(ret) || ret || inner_->has_pending_event();
+}
+
+size_t ShmRingChannel::max_receive_batch() {
+  // Ring records are lent out until released, one at a time.
+  return 1;
+}
+
+int32_t ShmRingChannel::allocate(
+    const struct WaylandBufferCreateInfo& create_info,
+    struct WaylandBufferCreateOutput& create_output) {
+  return inner_->allocate(create_info, create_output);
+}
+
+void ShmRingChannel::free_buffer(
+    const struct WaylandBufferCreateInfo& create_info,
+    const struct WaylandBufferCreateOutput& create_output) {
+  inner_->free_buffer(create_info, create_output);
+}
+
+int32_t ShmRingChannel::prefetch_allocation(
+    const struct WaylandBufferCreateInfo& create_info, int& out_fence_fd) {
+  return inner_->prefetch_allocation(create_info, out_fence_fd);
+}
+
+int32_t ShmRingChannel::handle_fence(int fence_fd, int& out_fence_fd) {
+  return inner_->handle_fence(fence_fd, out_fence_fd);
+}
+
+int32_t ShmRingChannel::sync(int dmabuf_fd, uint64_t flags) {
+  return inner_->sync(dmabuf_fd, flags);
+}
+
+int32_t ShmRingChannel::import_shm(int shm_fd,
+                                   size_t size,
+                                   int& out_dmabuf_fd) {
+  return inner_->import_shm(shm_fd, size, out_dmabuf_fd);
+}
+
+int32_t ShmRingChannel::handle_pipe(int read_fd, bool readable, bool& hang_up) {
+  return inner_->handle_pipe(read_fd, readable, hang_up);
+}
+
+size_t ShmRingChannel::max_send_size() {
+  return inner_->max_send_size();
+}
@@ -0,0 +1,146 @@
+// Copyright 2024 The ChromiumOS Authors
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "shm_ring.h"  // NOLINT(build/include_directory)
+
+#include <errno.h>
+#include <gtest/gtest.h>
+#include <stdint.h>
+
+#include <cstring>
+#include <vector>
+
+namespace vm_tools {
+namespace sommelier {
+
+namespace {
+
+const uint32_t kRingSize = 256;
+
+class ShmRingTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    control_ = {};
+    data_.assign(kRingSize, 0);
+    producer_ = ShmRing(&control_, data_.data(), kRingSize);
+    consumer_ = ShmRing(&control_, data_.data(), kRingSize);
+  }
+
+ protected:
+  bool Write(const std::vector<uint8_t>& payload, uint32_t inner_seq = 0) {
+    bool was_empty;
+    return producer_.write(payload.data(), payload.size(), inner_seq,
+                           was_empty);
+  }
+
+  // Pops the oldest record, expecting it to hold `expected`.
+  void ExpectRead(const std::vector<uint8_t>& expected) {
+    const uint8_t* payload;
+    uint32_t size;
+    uint32_t inner_seq;
+
+    ASSERT_EQ(consumer_.peek(payload, size, inner_seq), 0);
+    ASSERT_NE(payload, nullptr);
+    ASSERT_EQ(size, expected.size());
+    EXPECT_EQ(memcmp(payload, expected.data(), size), 0);
+    consumer_.pop();
+  }
+
+  struct ShmRingControl control_;
+  std::vector<uint8_t> data_;
+  ShmRing producer_;
+  ShmRing consumer_;
+};
+
+}  // namespace
+
+TEST_F(ShmRingTest, ReadsRecordsInOrder) {
+  const uint8_t* payload;
+  uint32_t size;
+  uint32_t inner_seq;
+
+  EXPECT_TRUE(Write({1, 2, 3}, 0));
+  EXPECT_TRUE(Write({4}, 7));
+
+  ASSERT_EQ(consumer_.peek(payload, size, inner_seq), 0);
+  EXPECT_EQ(inner_seq, 0u);
+  ExpectRead({1, 2, 3});
+  ASSERT_EQ(consumer_.peek(payload, size, inner_seq), 0);
+  EXPECT_EQ(inner_seq, 7u);
+  ExpectRead({4});
+
+  ASSERT_EQ(consumer_.peek(payload, size, inner_seq), 0);
+  EXPECT_EQ(payload, nullptr);
+}
+
+TEST_F(ShmRingTest, NotifiesOnlyWhenConsumerCaughtUp) {
+  uint8_t byte = 0;
+  bool was_empty;
+
+  EXPECT_TRUE(producer_.write(&byte, 1, 0, was_empty));
+  EXPECT_TRUE(was_empty);
+  EXPECT_TRUE(producer_.write(&byte, 1, 0, was_empty));
+  EXPECT_FALSE(was_empty);
+
+  ExpectRead({0});
+  EXPECT_TRUE(producer_.write(&byte, 1, 0, was_empty));
+  EXPECT_FALSE(was_empty);
+
+  ExpectRead({0});
+  ExpectRead({0});
+  EXPECT_TRUE(producer_.write(&byte, 1, 0, was_empty));
+  EXPECT_TRUE(was_empty);
+}
+
+TEST_F(ShmRingTest, RefusesWritesWhenFull) {
+  std::vector<uint8_t> payload(producer_.max_payload(), 0xab);
+
+  EXPECT_FALSE(Write(std::vector<uint8_t>(producer_.max_payload() + 1)));
+  EXPECT_TRUE(Write(payload));
+  EXPECT_TRUE(Write(payload));
+  EXPECT_FALSE(Write({1}));
+
+  ExpectRead(payload);
+  EXPECT_TRUE(Write({1}));
+}
+
+TEST_F(ShmRingTest, RecordsNeverWrapAround) {
+  // Leave 16 bytes before the end of the data, too few for the last record.
+  std::vector<uint8_t> large(112, 1);
+  std::vector<uint8_t> small(50, 2);
+
+  EXPECT_TRUE(Write(large));
+  ExpectRead(large);
+  EXPECT_TRUE(Write(large));
+  ExpectRead(large);
+  EXPECT_TRUE(Write(small));
+  // It went behind padding at the start of the data.
+  EXPECT_EQ(control_.head, kRingSize + 64);
+  ExpectRead(small);
+
+  // Both sides keep going across the end of the data many times over.
+  for (int i = 0; i < 100; ++i) {
+    std::vector<uint8_t> payload(1 + (i * 37) % 100, i);
+    EXPECT_TRUE(Write(payload));
+    ExpectRead(payload);
+  }
+}
+
+TEST_F(ShmRingTest, RejectsCorruptRecords) {
+  const uint8_t* payload;
+  uint32_t size;
+  uint32_t inner_seq;
+
+  EXPECT_TRUE(Write({1, 2, 3}));
+  reinterpret_cast<struct ShmRingRecord*>(data_.data())->size = kRingSize;
+  EXPECT_EQ(consumer_.peek(payload, size, inner_seq), -EINVAL);
+
+  // A head that ran ahead of the data is corrupt too.
+  SetUp();
+  control_.head = kRingSize + 8;
+  EXPECT_EQ(consumer_.peek(payload, size, inner_seq), -EINVAL);
+}
+
+}  // namespace sommelier
+}  // namespace vm_tools
@@ -5,18 +5,24 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <gbm.h>
+#include <linux/udmabuf.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
 #include <algorithm>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <iterator>
 
 #include "../sommelier-logging.h"           // NOLINT(build/include_directory)
+#include "../sommelier-tracing.h"           // NOLINT(build/include_directory)
 #include "linux-headers/virtgpu_drm.h"      // NOLINT(build/include_directory)
 #include "virtgpu_cross_domain_protocol.h"  // NOLINT(build/include_directory)
 #include "wayland_channel.h"                // NOLINT(build/include_directory)
@@ -42,6 +48,28 @@
 #define MAX_WRITE_SIZE \
   (DEFAULT_BUFFER_SIZE - sizeof(struct CrossDomainReadWrite))
 
+// Message slots in the channel ring, when the host supports more than one.
+#define CHANNEL_RING_SLOTS 16
+
+// With --stream-pipes, a readable pipe is read this many
+// CROSS_DOMAIN_CMD_WRITE commands' worth at a time, and given this capacity.
+#define PIPE_STREAM_WRITES 16
+#define PIPE_STREAM_CAPACITY (1024 * 1024)
+
+// Queued sends are submitted early rather than growing the batch past this.
+#define MAX_SEND_BATCH_SIZE (16 * DEFAULT_BUFFER_SIZE)
+
+// Host memory kept in freed blobs for reuse, before the oldest are released.
+#define MAX_RECYCLED_BLOB_BYTES (64 * 1024 * 1024)
+
+// The files `fd_analysis` remembers at most.  Client buffers aren't freed
+// through the channel, so the cache starts over rather than grow with every
+// buffer a client ever sent.
+#define MAX_CACHED_IDENTIFIERS 256
+
+// Assumes a gbm-like API on the host
+#define IMAGE_REQUIREMENTS_FLAGS (GBM_BO_USE_LINEAR | GBM_BO_USE_SCANOUT)
+
 struct virtgpu_param {
   uint64_t param;
   const char* name;
@@ -117,11 +145,17 @@ int32_t fstat_pipe(int fd, uint32_t& inode) {
 }
 
 VirtGpuChannel::~VirtGpuChannel() {
+  if (async_fence_fd_ >= 0)
+    close(async_fence_fd_);
+
+  for (const auto& blob : recycled_blobs_)
+    close(blob.output.fd);
+
   if (query_ring_addr_ != MAP_FAILED)
     munmap(query_ring_addr_, PAGE_SIZE);
 
   if (channel_ring_addr_ != MAP_FAILED)
-    munmap(channel_ring_addr_, PAGE_SIZE);
+    munmap(channel_ring_addr_, channel_ring_size_);
 
   // An unwritten rule for the DRM subsystem is a valid GEM valid must be
   // non-zero.  Checkout drm_gem_handle_create_tail in the kernel.
@@ -193,6 +227,12 @@ int32_t VirtGpuChannel::init() {
   if (cross_domain_caps.supports_dmabuf)
     supports_dmabuf_ = true;
 
+  if (cross_domain_caps.supports_multi_slot_ring)
+    supports_multi_slot_ring_ = true;
+
+  if (cross_domain_caps.supports_sync)
+    supports_sync_ = true;
+
   supports_wayland = cross_domain_caps.supported_channels &
                      (1 << CROSS_DOMAIN_CHANNEL_TYPE_WAYLAND);
 
@@ -208,14 +248,15 @@ bool VirtGpuChannel::supports_dmabuf() {
   return supports_dmabuf_;
 }
 
-int32_t VirtGpuChannel::create_ring(uint32_t& out_handle,
+int32_t VirtGpuChannel::create_ring(size_t size,
+                                    uint32_t& out_handle,
                                     uint32_t& out_res_id,
                                     void*& out_addr) {
   int32_t ret = 0;
   struct drm_virtgpu_resource_create_blob drm_rc_blob = {};
   struct drm_virtgpu_map map = {};
 
-  drm_rc_blob.size = PAGE_SIZE;
+  drm_rc_blob.size = size;
   drm_rc_blob.blob_mem = VIRTGPU_BLOB_MEM_GUEST;
   drm_rc_blob.blob_flags = VIRTGPU_BLOB_FLAG_USE_MAPPABLE;
 
@@ -238,8 +279,8 @@ int32_t VirtGpuChannel::create_ring(uint32_t& out_handle,
     return ret;
   }
 
-  out_addr = mmap(nullptr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
-                  virtgpu_, map.offset);
+  out_addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, virtgpu_,
+                  map.offset);
 
   if (out_addr == MAP_FAILED) {
     LOG(ERROR) << "mmap failed with " << strerror(errno);
@@ -277,13 +318,24 @@ int32_t VirtGpuChannel::create_context(int& out_channel_fd) {
   }
 
   // Create a shared ring buffer to read metadata queries.
-  ret = create_ring(query_ring_handle_, query_ring_res_id, query_ring_addr_);
+  ret = create_ring(PAGE_SIZE, query_ring_handle_, query_ring_res_id,
+                    query_ring_addr_);
   if (ret)
     return ret;
 
-  // Create a shared ring buffer to read channel responses
-  ret = create_ring(channel_ring_handle_, channel_ring_res_id,
-                    channel_ring_addr_);
+  // Create a shared ring buffer to read channel responses.  Hosts that can
+  // queue several responses get a header and a ring of slots, so one wakeup
+  // can drain all of them.
+  channel_ring_size_ = PAGE_SIZE;
+  if (supports_multi_slot_ring_) {
+    channel_ring_slots_ = CHANNEL_RING_SLOTS;
+    channel_ring_size_ =
+        (channel_ring_slots_ + 1) * CROSS_DOMAIN_RING_SLOT_SIZE;
+    channel_ring_size_ =
+        (channel_ring_size_ + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+  }
+  ret = create_ring(channel_ring_size_, channel_ring_handle_,
+                    channel_ring_res_id, channel_ring_addr_);
   if (ret)
     return ret;
 
@@ -293,6 +345,17 @@ int32_t VirtGpuChannel::create_context(int& out_channel_fd) {
   cmd_init.query_ring_id = query_ring_res_id;
   cmd_init.channel_ring_id = channel_ring_res_id;
   cmd_init.channel_type = CROSS_DOMAIN_CHANNEL_TYPE_WAYLAND;
+  if (channel_ring_slots_) {
+    struct CrossDomainRingHeader* ring_hdr =
+        reinterpret_cast<struct CrossDomainRingHeader*>(channel_ring_addr_);
+    ring_hdr->head = 0;
+    ring_hdr->tail = 0;
+    cmd_init.channel_ring_slots = channel_ring_slots_;
+  } else {
+    // Older hosts only know the original command.
+    cmd_init.hdr.cmd_size =
+        offsetof(struct CrossDomainInit, channel_ring_slots);
+  }
   ret = submit_cmd(reinterpret_cast<uint32_t*>(&cmd_init),
                    cmd_init.hdr.cmd_size, CROSS_DOMAIN_RING_NONE, 0, false);
   if (ret < 0)
@@ -353,6 +416,25 @@ int32_t VirtGpuChannel::send(const struct WaylandSendReceive& send) {
     cmd_send->num_identifiers++;
   }
 
+  traffic_.messages_sent++;
+  traffic_.bytes_sent += send.data_size;
+  TRACE_COUNTER("other", "virtgpu_messages_sent", traffic_.messages_sent);
+  TRACE_COUNTER("other", "virtgpu_bytes_sent", traffic_.bytes_sent);
+
+  // Sends carrying fds go out right away, since the caller closes the fds
+  // once this returns. Everything else waits for flush() so that a burst of
+  // small sends costs one execbuffer.
+  if (batch_sends_ && !cmd_send->num_identifiers) {
+    if (send_batch_.size() + cmd_send->hdr.cmd_size > MAX_SEND_BATCH_SIZE) {
+      ret = flush();
+      if (ret < 0)
+        return ret;
+    }
+    send_batch_.insert(send_batch_.end(), cmd_buffer,
+                       cmd_buffer + cmd_send->hdr.cmd_size);
+    return 0;
+  }
+
   ret = submit_cmd(reinterpret_cast<uint32_t*>(cmd_send),
                    cmd_send->hdr.cmd_size, CROSS_DOMAIN_RING_NONE, 0, false);
   if (ret < 0)
@@ -361,13 +443,25 @@ int32_t VirtGpuChannel::send(const struct WaylandSendReceive& send) {
   return 0;
 }
 
-int32_t VirtGpuChannel::handle_channel_event(
-    enum WaylandChannelEvent& event_type,
-    struct WaylandSendReceive& receive,
-    int& out_read_pipe) {
+int32_t VirtGpuChannel::flush() {
+  std::vector<uint8_t> batch;
   int32_t ret;
-  struct CrossDomainHeader* cmd_hdr =
-      (struct CrossDomainHeader*)channel_ring_addr_;
+
+  if (send_batch_.empty())
+    return 0;
+
+  // submit_cmd() flushes the queue itself, so hand it an empty one.
+  batch.swap(send_batch_);
+  ret = submit_cmd(reinterpret_cast<uint32_t*>(batch.data()), batch.size(),
+                   CROSS_DOMAIN_RING_NONE, 0, false);
+
+  // Keep the allocation for the next batch.
+  batch.clear();
+  send_batch_.swap(batch);
+  return ret;
+}
+
+int32_t VirtGpuChannel::handle_channel_wakeup() {
   ssize_t bytes_read;
   struct drm_event dummy_event;
 
@@ -381,27 +475,102 @@ int32_t VirtGpuChannel::handle_channel_event(
     LOG(ERROR) << "invalid event type";
     return -EINVAL;
   }
+  channel_poll_pending_ = false;
+
+  // The messages the poll signaled for may all have been drained already,
+  // in which case nothing else starts polling again.
+  if (channel_ring_slots_ && !has_pending_event())
+    return channel_poll();
+  return 0;
+}
+
+int32_t VirtGpuChannel::handle_channel_event(
+    enum WaylandChannelEvent& event_type,
+    struct WaylandSendReceive& receive,
+    int& out_read_pipe) {
+  int32_t ret;
+
+  // Everything the wakeup was for may have been drained already.
+  event_type = WaylandChannelEvent::None;
+  if (channel_ring_slots_ && !has_pending_event())
+    return 0;
+
+  uint8_t* message = channel_message();
+  struct CrossDomainHeader* cmd_hdr = (struct CrossDomainHeader*)message;
 
   if (cmd_hdr->cmd == CROSS_DOMAIN_CMD_RECEIVE) {
     event_type = WaylandChannelEvent::Receive;
-    ret = handle_receive(event_type, receive, out_read_pipe);
+    ret = handle_receive(message, event_type, receive, out_read_pipe);
     if (ret)
       return ret;
+
+    traffic_.messages_received++;
+    traffic_.bytes_received += receive.data_size;
+    TRACE_COUNTER("other", "virtgpu_messages_received",
+                  traffic_.messages_received);
+    TRACE_COUNTER("other", "virtgpu_bytes_received", traffic_.bytes_received);
+
+    // The data is lent straight out of the channel ring, so the message is
+    // only consumed, letting the host overwrite it, in release_receive().
+    return 0;
   } else if (cmd_hdr->cmd == CROSS_DOMAIN_CMD_READ) {
     event_type = WaylandChannelEvent::Read;
-    ret = handle_read();
+    ret = handle_read(message);
     if (ret)
       return ret;
   } else {
     return -EINVAL;
   }
 
-  // Start polling again
-  ret = channel_poll();
-  if (ret < 0)
-    return ret;
+  return consume_channel_message();
+}
 
-  return 0;
+int32_t VirtGpuChannel::release_receive(struct WaylandSendReceive& receive) {
+  receive.data = nullptr;
+  return consume_channel_message();
+}
+
+bool VirtGpuChannel::has_pending_event() {
+  if (!channel_ring_slots_)
+    return false;
+
+  struct CrossDomainRingHeader* ring_hdr =
+      reinterpret_cast<struct CrossDomainRingHeader*>(channel_ring_addr_);
+  // Pairs with the host's release of the head once a slot is written.
+  return __atomic_load_n(&ring_hdr->head, __ATOMIC_ACQUIRE) !=
+         channel_ring_tail_;
+}
+
+size_t VirtGpuChannel::max_receive_batch() {
+  // Each receive is lent out of the ring until it is consumed.
+  return 1;
+}
+
+uint8_t* VirtGpuChannel::channel_message() {
+  uint8_t* ring = reinterpret_cast<uint8_t*>(channel_ring_addr_);
+  if (!channel_ring_slots_)
+    return ring;
+
+  uint32_t slot = channel_ring_tail_ % channel_ring_slots_;
+  return ring + (slot + 1) * CROSS_DOMAIN_RING_SLOT_SIZE;
+}
+
+int32_t VirtGpuChannel::consume_channel_message() {
+  if (channel_ring_slots_) {
+    struct CrossDomainRingHeader* ring_hdr =
+        reinterpret_cast<struct CrossDomainRingHeader*>(channel_ring_addr_);
+    // The host may reuse the slot as soon as it sees the new tail.
+    __atomic_store_n(&ring_hdr->tail, ++channel_ring_tail_, __ATOMIC_RELEASE);
+
+    // Only poll once everything queued so far has been handled, and the
+    // last poll's event was read. The host signals right away if more
+    // arrived in the meantime.
+    if (has_pending_event() || channel_poll_pending_)
+      return 0;
+  }
+
+  // Start polling again
+  return channel_poll();
 }
 
 int32_t VirtGpuChannel::allocate(
@@ -409,6 +578,17 @@ int32_t VirtGpuChannel::allocate(
     struct WaylandBufferCreateOutput& create_output) {
   int32_t ret;
   uint64_t blob_id;
+  struct ImageKey key = image_key(create_info);
+
+  // Most recently freed first, as it's the likeliest to still be resident.
+  for (auto it = recycled_blobs_.rbegin(); it != recycled_blobs_.rend(); ++it) {
+    if (it->key == key) {
+      create_output = it->output;
+      recycled_blob_bytes_ -= it->output.host_size;
+      recycled_blobs_.erase(std::next(it).base());
+      return 0;
+    }
+  }
 
   ret = image_query(create_info, create_output, blob_id);
   if (ret < 0) {
@@ -419,8 +599,127 @@ int32_t VirtGpuChannel::allocate(
   return create_host_blob(blob_id, create_output.host_size, create_output.fd);
 }
 
+void VirtGpuChannel::free_buffer(
+    const struct WaylandBufferCreateInfo& create_info,
+    const struct WaylandBufferCreateOutput& create_output) {
+  if (create_output.fd < 0)
+    return;
+
+  if (create_output.host_size > MAX_RECYCLED_BLOB_BYTES) {
+    forget_fd_identifier(create_output.fd);
+    close(create_output.fd);
+    return;
+  }
+
+  struct RecycledBlob blob = {};
+  blob.key = image_key(create_info);
+  blob.output = create_output;
+  recycled_blobs_.push_back(blob);
+  recycled_blob_bytes_ += create_output.host_size;
+
+  while (recycled_blob_bytes_ > MAX_RECYCLED_BLOB_BYTES) {
+    recycled_blob_bytes_ -= recycled_blobs_.front().output.host_size;
+    forget_fd_identifier(recycled_blobs_.front().output.fd);
+    close(recycled_blobs_.front().output.fd);
+    recycled_blobs_.erase(recycled_blobs_.begin());
+  }
+}
+
 int32_t VirtGpuChannel::sync(int dmabuf_fd, uint64_t flags) {
-  // Unimplemented for now, but just need CROSS_DOMAIN_CMD_SYNC.
+  int32_t ret;
+  uint32_t gem_handle;
+  struct drm_virtgpu_resource_info drm_res_info = {};
+  struct CrossDomainSync cmd_sync = {};
+
+  // Hosts without CROSS_DOMAIN_CMD_SYNC keep blobs coherent by themselves.
+  if (!supports_sync_)
+    return 0;
+
+  ret = drmPrimeFDToHandle(virtgpu_, dmabuf_fd, &gem_handle);
+  if (ret) {
+    LOG(ERROR) << "drmPrimeFDToHandle failed with " << strerror(errno);
+    return -errno;
+  }
+
+  drm_res_info.bo_handle = gem_handle;
+  ret = drmIoctl(virtgpu_, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &drm_res_info);
+  close_gem_handle(gem_handle);
+  if (ret) {
+    LOG(ERROR) << "resource info failed";
+    return -EINVAL;
+  }
+
+  cmd_sync.hdr.cmd = CROSS_DOMAIN_CMD_SYNC;
+  cmd_sync.hdr.cmd_size = sizeof(struct CrossDomainSync);
+  cmd_sync.identifier = drm_res_info.res_handle;
+  cmd_sync.flags = static_cast<uint32_t>(flags);
+
+  // Whatever hands the buffer to the host next is submitted after this, and
+  // the host keeps the order, so there's no need to wait.
+  return submit_cmd(reinterpret_cast<uint32_t*>(&cmd_sync),
+                    cmd_sync.hdr.cmd_size, CROSS_DOMAIN_RING_NONE, 0, false);
+}
+
+int32_t VirtGpuChannel::import_shm(int shm_fd,
+                                   size_t size,
+                                   int& out_dmabuf_fd) {
+  int32_t ret;
+  int udmabuf;
+  int dmabuf_fd;
+  int seals;
+  uint32_t gem_handle;
+  struct udmabuf_create create = {};
+  struct drm_virtgpu_resource_info drm_res_info = {};
+
+  // udmabuf only wraps whole pages.
+  if (size == 0 || size % PAGE_SIZE)
+    return -EINVAL;
+
+  // udmabuf requires the memfd to be sealed against shrinking, which wl_shm
+  // forbids anyway.  This fails for files that aren't memfds, or memfds that
+  // were created without MFD_ALLOW_SEALING.
+  seals = fcntl(shm_fd, F_GET_SEALS);
+  if (seals < 0)
+    return -errno;
+  if (!(seals & F_SEAL_SHRINK) &&
+      fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+    return -errno;
+
+  udmabuf = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+  if (udmabuf < 0)
+    return -errno;
+
+  create.memfd = shm_fd;
+  create.flags = UDMABUF_FLAGS_CLOEXEC;
+  create.offset = 0;
+  create.size = size;
+  dmabuf_fd = ioctl(udmabuf, UDMABUF_CREATE, &create);
+  ret = -errno;
+  close(udmabuf);
+  if (dmabuf_fd < 0) {
+    LOG(ERROR) << "UDMABUF_CREATE failed with " << strerror(-ret);
+    return ret;
+  }
+
+  // Importing into virtgpu makes the pages a guest blob resource, which is
+  // what send() hands to the host.  Check that here so callers can fall back
+  // to copying rather than failing at send time.
+  ret = drmPrimeFDToHandle(virtgpu_, dmabuf_fd, &gem_handle);
+  if (ret) {
+    close(dmabuf_fd);
+    return -EOPNOTSUPP;
+  }
+
+  drm_res_info.bo_handle = gem_handle;
+  ret = drmIoctl(virtgpu_, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &drm_res_info);
+  close_gem_handle(gem_handle);
+  if (ret) {
+    LOG(ERROR) << "resource info failed";
+    close(dmabuf_fd);
+    return -EOPNOTSUPP;
+  }
+
+  out_dmabuf_fd = dmabuf_fd;
   return 0;
 }
 
@@ -428,7 +727,6 @@ int32_t VirtGpuChannel::handle_pipe(int read_fd, bool readable, bool& hang_up) {
   uint8_t cmd_buffer[DEFAULT_BUFFER_SIZE];
   ssize_t bytes_read;
   int ret;
-  size_t index;
 
   struct CrossDomainReadWrite* cmd_write =
       (struct CrossDomainReadWrite*)cmd_buffer;
@@ -441,10 +739,13 @@ int32_t VirtGpuChannel::handle_pipe(int read_fd, bool readable, bool& hang_up) {
   cmd_write->identifier = 0xffffffff;
 
   ret = pipe_lookup(CROSS_DOMAIN_ID_TYPE_WRITE_PIPE, cmd_write->identifier,
-                    read_fd, index);
+                    read_fd);
   if (ret < 0)
     return -EINVAL;
 
+  if (stream_pipes_)
+    return stream_pipe(read_fd, cmd_write->identifier, readable, hang_up);
+
   if (readable) {
     bytes_read = read(read_fd, write_data, MAX_WRITE_SIZE);
     if (bytes_read > 0) {
@@ -471,24 +772,108 @@ int32_t VirtGpuChannel::handle_pipe(int read_fd, bool readable, bool& hang_up) {
   if (ret < 0)
     return ret;
 
+  pipe_bytes_sent_ += cmd_write->opaque_data_size;
+  TRACE_COUNTER("other", "pipe_bytes_sent", pipe_bytes_sent_);
+
   if (hang_up) {
     close(read_fd);
-    std::swap(pipe_cache_[index], pipe_cache_.back());
-    pipe_cache_.pop_back();
+    remove_pipe(cmd_write->identifier);
   }
 
   return 0;
 }
 
-int32_t VirtGpuChannel::submit_cmd(uint32_t* cmd,
+int32_t VirtGpuChannel::stream_pipe(int read_fd,
+                                    uint32_t identifier,
+                                    bool readable,
+                                    bool& hang_up) {
+  TRACE_EVENT("other", "VirtGpuChannel::stream_pipe");
+  struct iovec iov[PIPE_STREAM_WRITES];
+  ssize_t bytes_read = 0;
+  size_t num_cmds;
+  size_t size = 0;
+  int32_t ret;
+
+  // Every command gets a DEFAULT_BUFFER_SIZE slot and its data is read
+  // straight into it, so full commands are back to back.
+  pipe_stream_buffer_.resize(PIPE_STREAM_WRITES * DEFAULT_BUFFER_SIZE);
+  if (readable) {
+    for (size_t i = 0; i < PIPE_STREAM_WRITES; i++) {
+      size_t offset =
+          i * DEFAULT_BUFFER_SIZE + sizeof(struct CrossDomainReadWrite);
+      iov[i].iov_base = &pipe_stream_buffer_[offset];
+      iov[i].iov_len = MAX_WRITE_SIZE;
+    }
+
+    bytes_read = readv(read_fd, iov, PIPE_STREAM_WRITES);
+    if (bytes_read < 0)
+      return -EINVAL;
+  }
+
+  // A short read only means the client hasn't written more yet, unless it
+  // has hung up already and the read drained the pipe.
+  size_t requested = PIPE_STREAM_WRITES * MAX_WRITE_SIZE;
+  hang_up = bytes_read == 0 ||
+            (hang_up && static_cast<size_t>(bytes_read) < requested);
+
+  // A hang up without data still needs a command to tell the host.
+  num_cmds = std::max<size_t>(1, (bytes_read + MAX_WRITE_SIZE - 1) /
+                                     MAX_WRITE_SIZE);
+  for (size_t i = 0; i < num_cmds; i++) {
+    struct CrossDomainReadWrite* cmd_write =
+        reinterpret_cast<struct CrossDomainReadWrite*>(
+            &pipe_stream_buffer_[i * DEFAULT_BUFFER_SIZE]);
+
+    memset(cmd_write, 0, sizeof(struct CrossDomainReadWrite));
+    cmd_write->hdr.cmd = CROSS_DOMAIN_CMD_WRITE;
+    cmd_write->identifier = identifier;
+    cmd_write->opaque_data_size =
+        std::min<size_t>(MAX_WRITE_SIZE, bytes_read - i * MAX_WRITE_SIZE);
+    cmd_write->hdr.cmd_size =
+        sizeof(struct CrossDomainReadWrite) + cmd_write->opaque_data_size;
+    cmd_write->hang_up = hang_up && i == num_cmds - 1;
+    size = i * DEFAULT_BUFFER_SIZE + cmd_write->hdr.cmd_size;
+
+    if (!batch_sends_) {
+      ret = submit_cmd(reinterpret_cast<uint32_t*>(cmd_write),
+                       cmd_write->hdr.cmd_size, CROSS_DOMAIN_RING_NONE, 0,
+                       false);
+      if (ret < 0)
+        return ret;
+    }
+  }
+
+  if (batch_sends_) {
+    ret = submit_cmd(reinterpret_cast<uint32_t*>(pipe_stream_buffer_.data()),
+                     size, CROSS_DOMAIN_RING_NONE, 0, false);
+    if (ret < 0)
+      return ret;
+  }
+
+  pipe_bytes_sent_ += bytes_read;
+  TRACE_COUNTER("other", "pipe_bytes_sent", pipe_bytes_sent_);
+
+  if (hang_up) {
+    close(read_fd);
+    remove_pipe(identifier);
+  }
+
+  return 0;
+}
+
+int32_t VirtGpuChannel::execbuffer(uint32_t* cmd,
                                    uint32_t size,
                                    uint32_t ring_idx,
                                    uint32_t ring_handle,
-                                   bool wait) {
+                                   int* out_fence_fd) {
   int32_t ret;
-  struct drm_virtgpu_3d_wait wait_3d = {};
   struct drm_virtgpu_execbuffer exec = {};
 
+  // Nothing may overtake sends that are still queued.
+  ret = flush();
+  if (ret < 0)
+    return ret;
+
   exec.command = (uint64_t)&cmd[0];
   exec.size = size;
   if (ring_idx != CROSS_DOMAIN_RING_NONE) {
@@ -501,6 +886,10 @@ int32_t VirtGpuChannel::submit_cmd(uint32_t* cmd,
     exec.num_bo_handles = 1;
   }
 
+  exec.fence_fd = -1;
+  if (out_fence_fd)
+    exec.flags |= VIRTGPU_EXECBUF_FENCE_FD_OUT;
+
   ret = drmIoctl(virtgpu_, DRM_IOCTL_VIRTGPU_EXECBUFFER, &exec);
   if (ret < 0) {
     LOG(ERROR) << "DRM_IOCTL_VIRTGPU_EXECBUFFER failed with "
@@ -508,6 +897,24 @@ int32_t VirtGpuChannel::submit_cmd(uint32_t* cmd,
     return -EINVAL;
   }
 
+  if (out_fence_fd)
+    *out_fence_fd = exec.fence_fd;
+
+  return 0;
+}
+
+int32_t VirtGpuChannel::submit_cmd(uint32_t* cmd,
+                                   uint32_t size,
+                                   uint32_t ring_idx,
+                                   uint32_t ring_handle,
+                                   bool wait) {
+  int32_t ret;
+  struct drm_virtgpu_3d_wait wait_3d = {};
+
+  ret = execbuffer(cmd, size, ring_idx, ring_handle, nullptr);
+  if (ret < 0)
+    return ret;
+
   // This is the most traditional way to wait for virtgpu to be finished.  We
   // submit a list of handles to the GPU, and wait for the GPU to be done
   // processing them.  In our case, the handle is the shared ring buffer between
@@ -530,44 +937,110 @@ int32_t VirtGpuChannel::submit_cmd(uint32_t* cmd,
   return 0;
 }
 
+int32_t VirtGpuChannel::submit_cmd_async(uint32_t* cmd,
+                                         uint32_t size,
+                                         uint32_t ring_idx,
+                                         uint32_t ring_handle,
+                                         std::function<void()> done,
+                                         int& out_fence_fd) {
+  int32_t ret;
+
+  ret = execbuffer(cmd, size, ring_idx, ring_handle, &out_fence_fd);
+  if (ret < 0)
+    return ret;
+
+  async_fence_fd_ = out_fence_fd;
+  async_done_ = std::move(done);
+  return 0;
+}
+
+void VirtGpuChannel::complete_async() {
+  struct pollfd fence = {};
+
+  if (!async_done_)
+    return;
+
+  fence.fd = async_fence_fd_;
+  fence.events = POLLIN;
+  while (poll(&fence, 1, -1) < 0 && errno == EINTR) {
+  }
+
+  std::function<void()> done = std::move(async_done_);
+  async_done_ = nullptr;
+  done();
+}
+
+// Dma-bufs the host won't scan out are left out of scanout memory.
+static uint32_t image_requirements_flags(
+    const struct WaylandBufferCreateInfo& input) {
+  if (input.dmabuf && !input.scanout)
+    return IMAGE_REQUIREMENTS_FLAGS & ~GBM_BO_USE_SCANOUT;
+  return IMAGE_REQUIREMENTS_FLAGS;
+}
+
+VirtGpuChannel::ImageKey VirtGpuChannel::image_key(
+    const struct WaylandBufferCreateInfo& input) {
+  return {input.width, input.height, input.drm_format,
+          image_requirements_flags(input)};
+}
+
+static void init_image_query(const struct WaylandBufferCreateInfo& input,
+                             struct CrossDomainGetImageRequirements& cmd) {
+  cmd.hdr.cmd = CROSS_DOMAIN_CMD_GET_IMAGE_REQUIREMENTS;
+  cmd.hdr.cmd_size = sizeof(struct CrossDomainGetImageRequirements);
+
+  cmd.width = input.width;
+  cmd.height = input.height;
+  cmd.drm_format = input.drm_format;
+  cmd.flags = image_requirements_flags(input);
+}
+
 int32_t VirtGpuChannel::image_query(const struct WaylandBufferCreateInfo& input,
                                     struct WaylandBufferCreateOutput& output,
                                     uint64_t& blob_id) {
   int32_t ret = 0;
-  uint32_t* addr = reinterpret_cast<uint32_t*>(query_ring_addr_);
   struct CrossDomainGetImageRequirements cmd_get_reqs = {};
-  struct BufferDescription new_desc = {};
 
   // Sommelier is single threaded, so no need for locking.
-  for (const auto& desc : description_cache_) {
-    if (desc.input.width == input.width && desc.input.height == input.height &&
-        desc.input.drm_format == input.drm_format) {
-      memcpy(&output, &desc.output, sizeof(struct WaylandBufferCreateOutput));
-      blob_id = (uint64_t)desc.blob_id;
-      return 0;
-    }
+  auto cached = description_cache_.find(image_key(input));
+  if (cached == description_cache_.end()) {
+    // The query ring holds one answer at a time, so one still in flight has
+    // to be read out before it gets overwritten.  It may be this one.
+    complete_async();
+    cached = description_cache_.find(image_key(input));
   }
 
-  cmd_get_reqs.hdr.cmd = CROSS_DOMAIN_CMD_GET_IMAGE_REQUIREMENTS;
-  cmd_get_reqs.hdr.cmd_size = sizeof(struct CrossDomainGetImageRequirements);
+  if (cached == description_cache_.end()) {
+    init_image_query(input, cmd_get_reqs);
+    ret = submit_cmd(reinterpret_cast<uint32_t*>(&cmd_get_reqs),
+                     cmd_get_reqs.hdr.cmd_size, CROSS_DOMAIN_QUERY_RING,
+                     query_ring_handle_, true);
+    if (ret < 0)
+      return ret;
 
-  cmd_get_reqs.width = input.width;
-  cmd_get_reqs.height = input.height;
-  cmd_get_reqs.drm_format = input.drm_format;
+    ret = cache_image_requirements(input);
+    if (ret < 0)
+      return ret;
 
-  // Assumes a gbm-like API on the host
-  cmd_get_reqs.flags = GBM_BO_USE_LINEAR | GBM_BO_USE_SCANOUT;
+    cached = description_cache_.find(image_key(input));
+  }
 
-  ret = submit_cmd(reinterpret_cast<uint32_t*>(&cmd_get_reqs),
-                   cmd_get_reqs.hdr.cmd_size, CROSS_DOMAIN_QUERY_RING,
-                   query_ring_handle_, true);
-  if (ret < 0)
-    return ret;
+  memcpy(&output, &cached->second.output,
+         sizeof(struct WaylandBufferCreateOutput));
+  blob_id = (uint64_t)cached->second.blob_id;
+  return 0;
+}
+
+int32_t VirtGpuChannel::cache_image_requirements(
+    const struct WaylandBufferCreateInfo& input) {
+  uint32_t* addr = reinterpret_cast<uint32_t*>(query_ring_addr_);
+  struct BufferDescription new_desc = {};
 
   new_desc.output.fd = -1;
   memcpy(&new_desc.input, &input, sizeof(struct WaylandBufferCreateInfo));
   memcpy(&new_desc.output.strides, &addr[0], 4 * sizeof(uint32_t));
   memcpy(&new_desc.output.offsets, &addr[4], 4 * sizeof(uint32_t));
+  memcpy(&new_desc.output.modifier, &addr[8], sizeof(uint64_t));
   memcpy(&new_desc.output.host_size, &addr[10], sizeof(uint64_t));
   memcpy(&new_desc.blob_id, &addr[12], sizeof(uint32_t));
 
@@ -579,15 +1052,81 @@ int32_t VirtGpuChannel::image_query(const struct WaylandBufferCreateInfo& input,
     }
   }
 
-  memcpy(&output.strides, &new_desc.output.strides, 4 * sizeof(uint32_t));
-  memcpy(&output.offsets, &new_desc.output.offsets, 4 * sizeof(uint32_t));
-  output.host_size = new_desc.output.host_size;
-  blob_id = (uint64_t)new_desc.blob_id;
+  description_cache_.emplace(image_key(input), new_desc);
+  return 0;
+}
+
+int32_t VirtGpuChannel::start_next_query(int& out_fence_fd) {
+  int32_t ret;
+
+  out_fence_fd = -1;
+  while (!pending_queries_.empty()) {
+    struct CrossDomainGetImageRequirements cmd_get_reqs = {};
+
+    // `allocate` may have asked for it in the meantime.
+    if (description_cache_.count(image_key(pending_queries_.front()))) {
+      pending_queries_.pop_front();
+      continue;
+    }
+
+    init_image_query(pending_queries_.front(), cmd_get_reqs);
+    ret = submit_cmd_async(
+        reinterpret_cast<uint32_t*>(&cmd_get_reqs), cmd_get_reqs.hdr.cmd_size,
+        CROSS_DOMAIN_QUERY_RING, query_ring_handle_,
+        [this]() {
+          cache_image_requirements(pending_queries_.front());
+          pending_queries_.pop_front();
+        },
+        out_fence_fd);
+    if (ret < 0)
+      pending_queries_.pop_front();
+    return ret;
+  }
 
-  description_cache_.push_back(new_desc);
   return 0;
 }
 
+int32_t VirtGpuChannel::prefetch_allocation(
+    const struct WaylandBufferCreateInfo& create_info,
+    int& out_fence_fd) {
+  struct ImageKey key = image_key(create_info);
+
+  out_fence_fd = -1;
+  if (description_cache_.count(key))
+    return 0;
+
+  for (const auto& queued : pending_queries_) {
+    if (image_key(queued) == key)
+      return 0;
+  }
+
+  pending_queries_.push_back(create_info);
+  if (async_fence_fd_ >= 0)
+    return 0;
+
+  return start_next_query(out_fence_fd);
+}
+
+int32_t VirtGpuChannel::handle_fence(int fence_fd, int& out_fence_fd) {
+  out_fence_fd = -1;
+  if (fence_fd < 0 || fence_fd != async_fence_fd_)
+    return -EINVAL;
+
+  complete_async();
+  close(async_fence_fd_);
+  async_fence_fd_ = -1;
+
+  return start_next_query(out_fence_fd);
+}
+
+size_t VirtGpuChannel::ImageKeyHash::operator()(const ImageKey& key) const {
+  size_t hash = key.width;
+  hash = hash * 31 + key.height;
+  hash = hash * 31 + key.drm_format;
+  hash = hash * 31 + key.flags;
+  return hash;
+}
+
 int32_t VirtGpuChannel::close_gem_handle(uint32_t gem_handle) {
   int32_t ret;
   struct drm_gem_close gem_close = {};
@@ -617,6 +1156,7 @@ int32_t VirtGpuChannel::channel_poll() {
   if (ret < 0)
     return ret;
 
+  channel_poll_pending_ = true;
   return 0;
 }
 
@@ -669,13 +1209,47 @@ int32_t VirtGpuChannel::create_fd(uint32_t identifier,
   }
 }
 
+size_t VirtGpuChannel::FdIdentityHash::operator()(
+    const FdIdentity& identity) const {
+  return identity.dev * 31 + identity.ino;
+}
+
 int32_t VirtGpuChannel::fd_analysis(int fd,
                                     uint32_t& identifier,
                                     uint32_t& identifier_type) {
   int32_t ret = 0;
+  struct stat statbuf = {};
+
+  ret = fstat(fd, &statbuf);
+  if (ret) {
+    LOG(ERROR) << "fstat failed: " << strerror(errno);
+    return -errno;
+  }
+
+  // Dmabufs and pipes get inode numbers of their own, from a counter that
+  // takes billions of files to come back around.
+  struct FdIdentity identity = {static_cast<uint64_t>(statbuf.st_dev),
+                                static_cast<uint64_t>(statbuf.st_ino)};
+  auto cached = identifier_cache_.find(identity);
+  if (cached != identifier_cache_.end()) {
+    identifier = cached->second.identifier;
+    identifier_type = cached->second.identifier_type;
+    return 0;
+  }
+
   uint32_t gem_handle;
-  ret = drmPrimeFDToHandle(virtgpu_, fd, &gem_handle);
-  if (ret == 0) {
+  if (S_ISFIFO(statbuf.st_mode)) {
+    // fstat + S_ISFIFO(..) will return true for both anonymous and named
+    // pipes.  Only the ones proxied through the channel can be sent.
+    auto pipe = std::find_if(pipes_.begin(), pipes_.end(), [&](auto& entry) {
+      return entry.second.inode == static_cast<uint32_t>(statbuf.st_ino);
+    });
+    if (pipe == pipes_.end())
+      return -EINVAL;
+
+    identifier = pipe->second.identifier;
+    identifier_type = pipe->second.identifier_type;
+  } else if (drmPrimeFDToHandle(virtgpu_, fd, &gem_handle) == 0) {
     struct drm_virtgpu_resource_info drm_res_info = {};
     drm_res_info.bo_handle = gem_handle;
 
@@ -689,26 +1263,27 @@ int32_t VirtGpuChannel::fd_analysis(int fd,
     identifier = drm_res_info.res_handle;
     identifier_type = CROSS_DOMAIN_ID_TYPE_VIRTGPU_BLOB;
   } else {
-    // If it's not a blob, the only other option is a pipe.  Check to confirm.
-    uint32_t inode;
-    ret = fstat_pipe(fd, inode);
-    if (ret)
-      return ret;
-
-    for (const auto& pipe_desc : pipe_cache_) {
-      if (pipe_desc.inode == inode) {
-        identifier = pipe_desc.identifier;
-        identifier_type = pipe_desc.identifier_type;
-        return 0;
-      }
-    }
-
+    // If it's not a blob, the only other option is a pipe.
+    LOG(ERROR) << "expected anonymous pipe";
     return -EINVAL;
   }
 
+  if (identifier_cache_.size() >= MAX_CACHED_IDENTIFIERS)
+    identifier_cache_.clear();
+  identifier_cache_[identity] = {identifier, identifier_type};
   return 0;
 }
 
+void VirtGpuChannel::forget_fd_identifier(int fd) {
+  struct stat statbuf = {};
+
+  if (identifier_cache_.empty() || fstat(fd, &statbuf))
+    return;
+
+  identifier_cache_.erase({static_cast<uint64_t>(statbuf.st_dev),
+                           static_cast<uint64_t>(statbuf.st_ino)});
+}
+
 int32_t VirtGpuChannel::create_pipe_internal(int& out_pipe_fd,
                                              uint32_t identifier,
                                              uint32_t identifier_type) {
@@ -737,29 +1312,37 @@ int32_t VirtGpuChannel::create_pipe_internal(int& out_pipe_fd,
   if (ret < 0)
     return ret;
 
+  // Lets the client get ahead of the host, rather than blocking on every
+  // chunk in flight.  Failing just leaves the default capacity.
+  if (stream_pipes_)
+    fcntl(fds[0], F_SETPIPE_SZ, PIPE_STREAM_CAPACITY);
+
   pipe_desc.read_fd = fds[0];
   pipe_desc.write_fd = fds[1];
   pipe_desc.identifier = identifier;
   pipe_desc.identifier_type = identifier_type;
-  pipe_cache_.push_back(pipe_desc);
+  pipes_[identifier] = pipe_desc;
 
-  if (return_read_pipe)
+  if (return_read_pipe) {
     out_pipe_fd = fds[0];
-  else
+    pipe_identifiers_[fds[1]] = identifier;
+  } else {
     out_pipe_fd = fds[1];
+    pipe_identifiers_[fds[0]] = identifier;
+  }
 
   return 0;
 }
 
-int32_t VirtGpuChannel::handle_receive(enum WaylandChannelEvent& event_type,
+int32_t VirtGpuChannel::handle_receive(uint8_t* message,
+                                       enum WaylandChannelEvent& event_type,
                                        struct WaylandSendReceive& receive,
                                        int& out_read_pipe) {
   int ret;
   struct CrossDomainSendReceive* cmd_receive =
-      (struct CrossDomainSendReceive*)channel_ring_addr_;
+      (struct CrossDomainSendReceive*)message;
 
-  uint8_t* recv_data = reinterpret_cast<uint8_t*>(channel_ring_addr_) +
-                       sizeof(struct CrossDomainSendReceive);
+  uint8_t* recv_data = message + sizeof(struct CrossDomainSendReceive);
 
   for (uint32_t i = 0; i < CROSS_DOMAIN_MAX_IDENTIFIERS; i++) {
     if (i < cmd_receive->num_identifiers) {
@@ -772,13 +1355,12 @@ int32_t VirtGpuChannel::handle_receive(enum WaylandChannelEvent& event_type,
       receive.num_fds++;
 
       if (cmd_receive->identifier_types[i] == CROSS_DOMAIN_ID_TYPE_WRITE_PIPE) {
-        size_t index;
         int ret = 0;
         if (out_read_pipe >= 0)
           return -EINVAL;
 
         ret = pipe_lookup(cmd_receive->identifier_types[i],
-                          cmd_receive->identifiers[i], out_read_pipe, index);
+                          cmd_receive->identifiers[i], out_read_pipe);
         if (ret < 0)
           return -EINVAL;
 
@@ -789,32 +1371,24 @@ int32_t VirtGpuChannel::handle_receive(enum WaylandChannelEvent& event_type,
     }
   }
 
-  if (cmd_receive->opaque_data_size > 0) {
-    receive.data =
-        reinterpret_cast<uint8_t*>(calloc(1, cmd_receive->opaque_data_size));
-    if (!receive.data)
-      return -ENOMEM;
-
-    memcpy(receive.data, recv_data, cmd_receive->opaque_data_size);
-  }
+  if (cmd_receive->opaque_data_size > 0)
+    receive.data = recv_data;
 
   receive.data_size = cmd_receive->opaque_data_size;
   return 0;
 }
 
-int32_t VirtGpuChannel::handle_read() {
+int32_t VirtGpuChannel::handle_read(uint8_t* message) {
   int write_fd = -1;
   int ret = 0;
   ssize_t bytes_written;
-  size_t index;
   struct CrossDomainReadWrite* cmd_read =
-      (struct CrossDomainReadWrite*)channel_ring_addr_;
+      (struct CrossDomainReadWrite*)message;
 
-  uint8_t* read_data = reinterpret_cast<uint8_t*>(channel_ring_addr_) +
-                       sizeof(struct CrossDomainReadWrite);
+  uint8_t* read_data = message + sizeof(struct CrossDomainReadWrite);
 
   ret = pipe_lookup(CROSS_DOMAIN_ID_TYPE_READ_PIPE, cmd_read->identifier,
-                    write_fd, index);
+                    write_fd);
   if (ret < 0)
     return -EINVAL;
 
@@ -825,10 +1399,12 @@ int32_t VirtGpuChannel::handle_read() {
     return -EINVAL;
   }
 
+  pipe_bytes_received_ += bytes_written;
+  TRACE_COUNTER("other", "pipe_bytes_received", pipe_bytes_received_);
+
   if (cmd_read->hang_up) {
     close(write_fd);
-    std::swap(pipe_cache_[index], pipe_cache_.back());
-    pipe_cache_.pop_back();
+    remove_pipe(cmd_read->identifier);
   }
 
   return 0;
@@ -836,37 +1412,55 @@ int32_t VirtGpuChannel::handle_read() {
 
 int32_t VirtGpuChannel::pipe_lookup(uint32_t identifier_type,
                                     uint32_t& identifier,
-                                    int& fd,
-                                    size_t& index) {
-  index = 0;
-  for (const auto& pipe_desc : pipe_cache_) {
-    if (pipe_desc.identifier == identifier) {
-      // The host and guest are proxying the read operation, need to write to
-      // internally owned file descriptor.
-      if (identifier_type == CROSS_DOMAIN_ID_TYPE_READ_PIPE) {
-        fd = pipe_desc.write_fd;
-        return 0;
-      }
+                                    int& fd) {
+  auto pipe = pipes_.find(identifier);
+  if (pipe == pipes_.end()) {
+    auto owner = pipe_identifiers_.find(fd);
+    if (owner == pipe_identifiers_.end())
+      return -EINVAL;
 
-      // The host and guest are proxying the write operation, need to read from
-      // internally owned file descriptor.
-      if (identifier_type == CROSS_DOMAIN_ID_TYPE_WRITE_PIPE) {
-        fd = pipe_desc.read_fd;
-        return 0;
-      }
-    }
+    identifier = owner->second;
+    return 0;
+  }
 
-    if (fd == pipe_desc.read_fd || fd == pipe_desc.write_fd) {
-      identifier = pipe_desc.identifier;
-      return 0;
-    }
+  // The host and guest are proxying the read operation, need to write to
+  // internally owned file descriptor.
+  if (identifier_type == CROSS_DOMAIN_ID_TYPE_READ_PIPE) {
+    fd = pipe->second.write_fd;
+    return 0;
+  }
 
-    index++;
+  // The host and guest are proxying the write operation, need to read from
+  // internally owned file descriptor.
+  if (identifier_type == CROSS_DOMAIN_ID_TYPE_WRITE_PIPE) {
+    fd = pipe->second.read_fd;
+    return 0;
   }
 
   return -EINVAL;
 }
 
+void VirtGpuChannel::remove_pipe(uint32_t identifier) {
+  auto pipe = pipes_.find(identifier);
+  if (pipe == pipes_.end())
+    return;
+
+  if (pipe->second.identifier_type == CROSS_DOMAIN_ID_TYPE_READ_PIPE)
+    pipe_identifiers_.erase(pipe->second.write_fd);
+  else
+    pipe_identifiers_.erase(pipe->second.read_fd);
+  pipes_.erase(pipe);
+
+  for (auto it = identifier_cache_.begin(); it != identifier_cache_.end();) {
+    if (it->second.identifier_type != CROSS_DOMAIN_ID_TYPE_VIRTGPU_BLOB &&
+        it->second.identifier == identifier) {
+      it = identifier_cache_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
 size_t VirtGpuChannel::max_send_size() {
   return MAX_SEND_SIZE;
 }
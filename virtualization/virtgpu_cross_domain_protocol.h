@@ -15,6 +15,7 @@
 #define CROSS_DOMAIN_CMD_RECEIVE 5
 #define CROSS_DOMAIN_CMD_READ 6
 #define CROSS_DOMAIN_CMD_WRITE 7
+#define CROSS_DOMAIN_CMD_SYNC 8
 
 // Channel types (must match rutabaga channel types)
 #define CROSS_DOMAIN_CHANNEL_TYPE_WAYLAND 0x0001
@@ -50,11 +51,30 @@
 // Read pipe IDs start at this value.
 #define CROSS_DOMAIN_PIPE_READ_START 0x80000000
 
+// Size of each message slot in a multi-slot channel ring.  The ring starts
+// with a CrossDomainRingHeader padded to one slot, followed by the slots.
+#define CROSS_DOMAIN_RING_SLOT_SIZE 4096
+
 struct CrossDomainCapabilities {
   uint32_t version;
   uint32_t supported_channels;
   uint32_t supports_dmabuf;
   uint32_t supports_external_gpu_memory;
+  // Non-zero if the host can queue several messages in the channel ring.
+  // Older hosts don't report this field, so it reads as zero.
+  uint32_t supports_multi_slot_ring;
+  // Non-zero if the host handles CROSS_DOMAIN_CMD_SYNC.  Hosts that don't
+  // keep blobs coherent with guest CPU access by themselves.
+  uint32_t supports_sync;
+};
+
+// Head of a multi-slot channel ring.  Both counters only ever increase and
+// wrap at 2^32; slot `n` lives at index `n % channel_ring_slots`.  The host
+// only signals the channel ring fence in response to CROSS_DOMAIN_CMD_POLL,
+// and does so right away if head != tail.
+struct CrossDomainRingHeader {
+  uint32_t head;  // Messages written so far, advanced by the host.
+  uint32_t tail;  // Messages consumed so far, advanced by the guest.
 };
 
 struct CrossDomainImageRequirements {
@@ -80,6 +100,10 @@ struct CrossDomainInit {
   uint32_t query_ring_id;
   uint32_t channel_ring_id;
   uint32_t channel_type;
+  // Number of slots in the channel ring, or zero for the original single
+  // message ring.  Only sent, extending the command, if the host reports
+  // supports_multi_slot_ring.
+  uint32_t channel_ring_slots;
 };
 
 struct CrossDomainGetImageRequirements {
@@ -112,4 +136,13 @@ struct CrossDomainReadWrite {
   uint32_t pad;
 };
 
+// Brackets guest CPU access to a blob, like DMA_BUF_IOCTL_SYNC.  The host
+// handles it in order with the commands that follow, so the guest doesn't
+// wait for it.
+struct CrossDomainSync {
+  struct CrossDomainHeader hdr;
+  uint32_t identifier;  // Blob resource id.
+  uint32_t flags;       // DMA_BUF_SYNC_* flags.
+};
+
 #endif  // VM_TOOLS_SOMMELIER_VIRTUALIZATION_VIRTGPU_CROSS_DOMAIN_PROTOCOL_H_
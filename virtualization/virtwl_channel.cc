@@ -4,6 +4,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -14,6 +15,7 @@
 #include <cstring>
 
 #include "../sommelier-logging.h"  // NOLINT(build/include_directory)
+#include "../sommelier-tracing.h"  // NOLINT(build/include_directory)
 #include "linux-headers/virtwl.h"  // NOLINT(build/include_directory)
 #include "wayland_channel.h"       // NOLINT(build/include_directory)
 
@@ -118,6 +120,15 @@ int32_t VirtWaylandChannel::send(const struct WaylandSendReceive& send) {
   if (ret)
     return -errno;
 
+  traffic_.messages_sent++;
+  traffic_.bytes_sent += send.data_size;
+  TRACE_COUNTER("other", "virtwl_messages_sent", traffic_.messages_sent);
+  TRACE_COUNTER("other", "virtwl_bytes_sent", traffic_.bytes_sent);
+  return 0;
+}
+
+int32_t VirtWaylandChannel::flush() {
+  // Every send goes straight to the host.
   return 0;
 }
 
@@ -126,11 +137,21 @@ int32_t VirtWaylandChannel::handle_channel_event(
     struct WaylandSendReceive& receive,
     int& out_read_pipe) {
   int ret;
-  uint8_t ioctl_buffer[DEFAULT_BUFFER_SIZE];
-
-  struct virtwl_ioctl_txn* txn = (struct virtwl_ioctl_txn*)ioctl_buffer;
-  size_t max_recv_size = sizeof(ioctl_buffer) - sizeof(struct virtwl_ioctl_txn);
-  void* recv_data = &txn->data;
+  struct virtwl_ioctl_txn* txn;
+  size_t max_recv_size = DEFAULT_BUFFER_SIZE - sizeof(struct virtwl_ioctl_txn);
+  void* recv_data;
+
+  // Receive in place, and lend the data out of the slot, so receiving
+  // doesn't allocate.
+  if (held_receives_ == max_receive_batch())
+    return -ENOBUFS;
+
+  receive_buffer_.resize(max_receive_batch() * DEFAULT_BUFFER_SIZE);
+  txn = reinterpret_cast<struct virtwl_ioctl_txn*>(
+      &receive_buffer_[held_receives_ * DEFAULT_BUFFER_SIZE]);
+  recv_data = &txn->data;
+  if (drain_receives_)
+    drain_fd_ = receive.channel_fd;
 
   txn->len = max_recv_size;
   ret = ioctl(receive.channel_fd, VIRTWL_IOCTL_RECV, txn);
@@ -146,19 +167,47 @@ int32_t VirtWaylandChannel::handle_channel_event(
     }
   }
 
-  if (txn->len > 0) {
-    receive.data = reinterpret_cast<uint8_t*>(calloc(1, txn->len));
-    if (!receive.data)
-      return -ENOMEM;
-
-    memcpy(receive.data, recv_data, txn->len);
-  }
+  if (txn->len > 0)
+    receive.data = reinterpret_cast<uint8_t*>(recv_data);
+  held_receives_++;
 
   receive.data_size = txn->len;
   event_type = WaylandChannelEvent::Receive;
+
+  traffic_.messages_received++;
+  traffic_.bytes_received += txn->len;
+  TRACE_COUNTER("other", "virtwl_messages_received",
+                traffic_.messages_received);
+  TRACE_COUNTER("other", "virtwl_bytes_received", traffic_.bytes_received);
+  return 0;
+}
+
+int32_t VirtWaylandChannel::release_receive(
+    struct WaylandSendReceive& receive) {
+  // Receives are released together, so the slots are all free again once
+  // the last one is.
+  if (held_receives_ > 0)
+    held_receives_--;
+  receive.data = nullptr;
   return 0;
 }
 
+bool VirtWaylandChannel::has_pending_event() {
+  struct pollfd pending = {};
+
+  // Otherwise every receive has its own wakeup.
+  if (!drain_receives_ || drain_fd_ < 0)
+    return false;
+
+  pending.fd = drain_fd_;
+  pending.events = POLLIN;
+  return poll(&pending, 1, 0) > 0 && (pending.revents & POLLIN);
+}
+
+size_t VirtWaylandChannel::max_receive_batch() {
+  return drain_receives_ ? WAYLAND_MAX_RECEIVE_BATCH : 1;
+}
+
 int32_t VirtWaylandChannel::allocate(
     const struct WaylandBufferCreateInfo& create_info,
     struct WaylandBufferCreateOutput& create_output) {
@@ -202,6 +251,25 @@ int32_t VirtWaylandChannel::allocate(
   return 0;
 }
 
+void VirtWaylandChannel::free_buffer(
+    const struct WaylandBufferCreateInfo& create_info,
+    const struct WaylandBufferCreateOutput& create_output) {
+  if (create_output.fd >= 0)
+    close(create_output.fd);
+}
+
+int32_t VirtWaylandChannel::prefetch_allocation(
+    const struct WaylandBufferCreateInfo& create_info, int& out_fence_fd) {
+  // Allocations don't wait on the host for anything worth prefetching.
+  out_fence_fd = -1;
+  return 0;
+}
+
+int32_t VirtWaylandChannel::handle_fence(int fence_fd, int& out_fence_fd) {
+  out_fence_fd = -1;
+  return -EINVAL;
+}
+
 int32_t VirtWaylandChannel::sync(int dmabuf_fd, uint64_t flags) {
   struct virtwl_ioctl_dmabuf_sync sync = {};
   int ret;
@@ -214,6 +282,13 @@ int32_t VirtWaylandChannel::sync(int dmabuf_fd, uint64_t flags) {
   return 0;
 }
 
+int32_t VirtWaylandChannel::import_shm(int shm_fd,
+                                       size_t size,
+                                       int& out_dmabuf_fd) {
+  // virtwl can only send its own allocations to the host.
+  return -EOPNOTSUPP;
+}
+
 int32_t VirtWaylandChannel::handle_pipe(int read_fd,
                                         bool readable,
                                         bool& hang_up) {
@@ -5,9 +5,13 @@
 #define VM_TOOLS_SOMMELIER_VIRTUALIZATION_WAYLAND_CHANNEL_H_
 
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <sys/mman.h>
+#include <unordered_map>
 #include <vector>
 
+#include "shm_ring.h"
 #include "virtgpu_cross_domain_protocol.h"
 
 /*
@@ -19,6 +23,9 @@
 // Default buffer size based on the size of a typical page.
 #define DEFAULT_BUFFER_SIZE 4096
 
+// Most receives a channel may have handed out before they are released.
+#define WAYLAND_MAX_RECEIVE_BATCH 32
+
 struct WaylandSendReceive {
   int channel_fd;
 
@@ -35,6 +42,15 @@ enum WaylandChannelEvent {
   Read,
 };
 
+// Running totals of the messages a channel carried, for its counter tracks.
+// Tracing shows their rate of change as throughput.
+struct WaylandChannelTraffic {
+  uint64_t messages_sent;
+  uint64_t bytes_sent;
+  uint64_t messages_received;
+  uint64_t bytes_received;
+};
+
 struct WaylandBufferCreateInfo {
   /*
    * If true, create a dmabuf on the host.  If not, create a shared memory
@@ -47,15 +63,22 @@ struct WaylandBufferCreateInfo {
   /*
    * dma-buf parameters.  The allocation is done by host minigbm and used when
    * crosvm is built with the "wl-dmabuf" feature and virtgpu 3d is not
-   * enabled.  The modifier is not present, because we only want to allocate
-   * linear zero-copy buffers in this case.  The modifier makes sense when
-   * virtgpu 3d is enabled, but in that case guest Mesa gbm (backed by Virgl)
-   * allocates the resource, not sommelier.
+   * enabled.  The modifier is not present, because sommelier writes these
+   * buffers with the CPU, so they are always linear.  The modifier makes
+   * sense when virtgpu 3d is enabled, but in that case guest Mesa gbm (backed
+   * by Virgl) allocates the resource, not sommelier.
    */
   uint32_t width;
   uint32_t height;
   uint32_t drm_format;
 
+  /*
+   * Whether the host may scan the dma-buf out directly, so that it's placed
+   * where the display engine can read it.  Allocating for scanout the host
+   * never does only constrains the allocation.
+   */
+  bool scanout;
+
   /*
    * Shared memory region parameters.  The allocation is done by memfd(..) on
    * the host.
@@ -73,6 +96,9 @@ struct WaylandBufferCreateOutput {
   uint32_t offsets[4];
   uint32_t strides[4];
   uint64_t host_size;
+  // The layout the host allocator chose for a dma-buf, DRM_FORMAT_MOD_LINEAR
+  // unless it says otherwise.
+  uint64_t modifier;
 };
 
 class WaylandChannel {
@@ -115,6 +141,21 @@ class WaylandChannel {
   // in `send.data`.
   virtual int32_t send(const struct WaylandSendReceive& send) = 0;
 
+  // Submits anything `send` queued rather than sending right away.  Called
+  // before the event loop goes back to sleep, so nothing is held back for
+  // longer than one iteration.
+  //
+  // Returns 0 on success.  Returns -errno on failure.
+  virtual int32_t flush() = 0;
+
+  // Called once each time the channel file descriptor polls readable, before
+  // `handle_channel_event`.  Channels that are woken up through the fd
+  // consume the wakeup here, so that events drained through
+  // `has_pending_event` never take the place of the next one.
+  //
+  // Returns 0 on success.  Returns -errno on failure.
+  virtual int32_t handle_channel_wakeup() { return 0; }
+
   // Handles a poll event on the channel file descriptor.
   //
   // Returns 0 on success.  Returns -errno on failure.  On success, the type of
@@ -129,9 +170,9 @@ class WaylandChannel {
   // in addition to forwarding the data given by `receive`.  The `handle_pipe`
   // function must be called the case of `out_read_pipe` event.
   //
-  // In both above cases, if the returned `receive.data_size` is than greater
-  // zero, then the caller takes ownership of `receive.data` and must free(..)
-  // the memory when appropriate.
+  // In both above cases, the caller must call `release_receive` once it is
+  // done with `receive.data`.  The data may be lent straight out of memory the
+  // channel shares with the host, so it must not be freed or kept around.
   //
   // If `event_type` is WaylandChannelEvent::Read, then both `out_read_pipe` and
   // `receive` are meaningless. The implementation handles the event internally.
@@ -139,6 +180,23 @@ class WaylandChannel {
                                        struct WaylandSendReceive& receive,
                                        int& out_read_pipe) = 0;
 
+  // Releases `receive.data` from a WaylandChannelEvent::Receive or
+  // ReceiveAndProxy event.  The channel may not receive anything more from
+  // the host until then.
+  //
+  // Returns 0 on success.  Returns -errno on failure.
+  virtual int32_t release_receive(struct WaylandSendReceive& receive) = 0;
+
+  // Returns true if the host queued more events than the one just handled,
+  // in which case `handle_channel_event` should be called again right away:
+  // the channel fd won't poll readable for them.
+  virtual bool has_pending_event() = 0;
+
+  // Returns how many receives `handle_channel_event` may hand out before
+  // `release_receive` is called on them, at most WAYLAND_MAX_RECEIVE_BATCH.
+  // The caller can gather that many and forward them together.
+  virtual size_t max_receive_batch() = 0;
+
   // Allocates a shared memory resource or dma-buf on the host.  Maps it into
   // the guest.  The intended use case for this function is sharing resources
   // with the host compositor when virtgpu 3d is not enabled.
@@ -147,10 +205,47 @@ class WaylandChannel {
   virtual int32_t allocate(const struct WaylandBufferCreateInfo& create_info,
                            struct WaylandBufferCreateOutput& create_output) = 0;
 
+  // Hands back a buffer from `allocate` once nothing uses it anymore, taking
+  // ownership of `create_output.fd`.  The channel may give the buffer out
+  // again from a later `allocate` with the same `create_info` rather than
+  // going to the host, so its contents are undefined when it comes back.
+  virtual void free_buffer(
+      const struct WaylandBufferCreateInfo& create_info,
+      const struct WaylandBufferCreateOutput& create_output) = 0;
+
+  // Starts asking the host what `allocate` needs to know about `create_info`,
+  // without waiting for the answer, so that a later `allocate` for the same
+  // buffer doesn't block on the host.
+  //
+  // Returns 0 on success.  If the host was asked, `out_fence_fd` is a fence
+  // the caller must poll and hand to `handle_fence` once it is readable.
+  // Otherwise it is -1: the answer is already known, it is queued behind a
+  // fence the caller already has, or the channel doesn't need to ask.  The
+  // caller does not take ownership of `out_fence_fd`.
+  virtual int32_t prefetch_allocation(
+      const struct WaylandBufferCreateInfo& create_info,
+      int& out_fence_fd) = 0;
+
+  // Completes the work `fence_fd`, given by `prefetch_allocation` or an
+  // earlier `handle_fence`, signalled, and closes it.  If more work was
+  // queued behind it, `out_fence_fd` is the next fence to poll, otherwise -1.
+  //
+  // Returns 0 on success.  Returns -errno on failure.
+  virtual int32_t handle_fence(int fence_fd, int& out_fence_fd) = 0;
+
   // Synchronizes accesses to previously created host dma-buf.
   // Returns 0 on success.  Returns -errno on failure.
   virtual int32_t sync(int dmabuf_fd, uint64_t flags) = 0;
 
+  // Wraps the first `size` bytes of the guest shared memory file `shm_fd`
+  // (a wl_shm pool) in a dma-buf the host can import directly, so that
+  // buffers in the pool can be forwarded without copying.
+  //
+  // Returns 0 on success, and the dma-buf in `out_dmabuf_fd`.  Returns
+  // -EOPNOTSUPP if the channel can't share guest memory, and -errno on any
+  // other failure.  Callers fall back to copying in either case.
+  virtual int32_t import_shm(int shm_fd, size_t size, int& out_dmabuf_fd) = 0;
+
   // Reads from the specified `read_fd` and forwards to the host if `readable`
   // is true.  Closes the `read_fd` and the proxied write fd on the host if
   // `hang_up` is true and all the data has been read.
@@ -166,7 +261,16 @@ class WaylandChannel {
 
 class VirtWaylandChannel : public WaylandChannel {
  public:
-  VirtWaylandChannel() : virtwl_{-1}, supports_dmabuf_(false) {}
+  // If `drain_receives` is true, every message the host has queued is
+  // received straight into a reusable buffer, so that the caller can
+  // forward them all per wakeup.
+  explicit VirtWaylandChannel(bool drain_receives = false)
+      : virtwl_{-1},
+        supports_dmabuf_(false),
+        drain_receives_(drain_receives),
+        drain_fd_{-1},
+        held_receives_{},
+        traffic_{} {}
   ~VirtWaylandChannel() override;
 
   int32_t init() override;
@@ -174,14 +278,25 @@ class VirtWaylandChannel : public WaylandChannel {
   int32_t create_context(int& out_channel_fd) override;
   int32_t create_pipe(int& out_pipe_fd) override;
   int32_t send(const struct WaylandSendReceive& send) override;
+  int32_t flush() override;
   int32_t handle_channel_event(enum WaylandChannelEvent& event_type,
                                struct WaylandSendReceive& receive,
                                int& out_read_pipe) override;
+  int32_t release_receive(struct WaylandSendReceive& receive) override;
+  bool has_pending_event() override;
+  size_t max_receive_batch() override;
 
   int32_t allocate(const struct WaylandBufferCreateInfo& create_info,
                    struct WaylandBufferCreateOutput& create_output) override;
+  void free_buffer(
+      const struct WaylandBufferCreateInfo& create_info,
+      const struct WaylandBufferCreateOutput& create_output) override;
+  int32_t prefetch_allocation(const struct WaylandBufferCreateInfo& create_info,
+                              int& out_fence_fd) override;
+  int32_t handle_fence(int fence_fd, int& out_fence_fd) override;
 
   int32_t sync(int dmabuf_fd, uint64_t flags) override;
+  int32_t import_shm(int shm_fd, size_t size, int& out_dmabuf_fd) override;
   int32_t handle_pipe(int read_fd, bool readable, bool& hang_up) override;
   size_t max_send_size() override;
 
@@ -189,18 +304,47 @@ class VirtWaylandChannel : public WaylandChannel {
   // virtwl device file descriptor
   int32_t virtwl_;
   bool supports_dmabuf_;
+
+  bool drain_receives_;
+  // Channel fd last received from, polled by `has_pending_event`.
+  int drain_fd_;
+  // One transaction slot per receive in a batch, the first `held_receives_`
+  // of which are lent out until released.
+  std::vector<uint8_t> receive_buffer_;
+  size_t held_receives_;
+  struct WaylandChannelTraffic traffic_;
 };
 
 class VirtGpuChannel : public WaylandChannel {
  public:
-  VirtGpuChannel()
+  // If `batch_sends` is true, sends without fds are queued and submitted to
+  // the host together in one execbuffer by `flush`, which needs a host that
+  // accepts several cross-domain commands per execbuffer.
+  //
+  // If `stream_pipes` is true, proxied pipes get a larger capacity and are
+  // read many CROSS_DOMAIN_CMD_WRITE commands' worth at a time, which are
+  // submitted in one execbuffer if `batch_sends` is true too.
+  explicit VirtGpuChannel(bool batch_sends = false, bool stream_pipes = false)
       : virtgpu_{-1},
         query_ring_addr_{MAP_FAILED},
         query_ring_handle_{},
         channel_ring_addr_{MAP_FAILED},
         channel_ring_handle_{},
+        channel_ring_size_{},
+        channel_ring_slots_{},
+        channel_ring_tail_{},
+        channel_poll_pending_(false),
         supports_dmabuf_(false),
-        read_pipe_id_{CROSS_DOMAIN_PIPE_READ_START} {}
+        supports_multi_slot_ring_(false),
+        supports_sync_(false),
+        read_pipe_id_{CROSS_DOMAIN_PIPE_READ_START},
+        recycled_blob_bytes_{},
+        batch_sends_(batch_sends),
+        async_fence_fd_{-1},
+        stream_pipes_(stream_pipes),
+        pipe_bytes_sent_{},
+        pipe_bytes_received_{},
+        traffic_{} {}
   ~VirtGpuChannel() override;
 
   int32_t init() override;
@@ -208,14 +352,26 @@ class VirtGpuChannel : public WaylandChannel {
   int32_t create_context(int& out_channel_fd) override;
   int32_t create_pipe(int& out_pipe_fd) override;
   int32_t send(const struct WaylandSendReceive& send) override;
+  int32_t flush() override;
+  int32_t handle_channel_wakeup() override;
   int32_t handle_channel_event(enum WaylandChannelEvent& event_type,
                                struct WaylandSendReceive& receive,
                                int& out_read_pipe) override;
+  int32_t release_receive(struct WaylandSendReceive& receive) override;
+  bool has_pending_event() override;
+  size_t max_receive_batch() override;
 
   int32_t allocate(const struct WaylandBufferCreateInfo& create_info,
                    struct WaylandBufferCreateOutput& create_output) override;
+  void free_buffer(
+      const struct WaylandBufferCreateInfo& create_info,
+      const struct WaylandBufferCreateOutput& create_output) override;
+  int32_t prefetch_allocation(const struct WaylandBufferCreateInfo& create_info,
+                              int& out_fence_fd) override;
+  int32_t handle_fence(int fence_fd, int& out_fence_fd) override;
 
   int32_t sync(int dmabuf_fd, uint64_t flags) override;
+  int32_t import_shm(int shm_fd, size_t size, int& out_dmabuf_fd) override;
   int32_t handle_pipe(int read_fd, bool readable, bool& hang_up) override;
   size_t max_send_size() override;
 
@@ -230,6 +386,29 @@ class VirtGpuChannel : public WaylandChannel {
     uint32_t blob_id;
   };
 
+  // What the host's image requirements depend on.
+  struct ImageKey {
+    uint32_t width;
+    uint32_t height;
+    uint32_t drm_format;
+    uint32_t flags;
+
+    bool operator==(const ImageKey& other) const {
+      return width == other.width && height == other.height &&
+             drm_format == other.drm_format && flags == other.flags;
+    }
+  };
+
+  struct ImageKeyHash {
+    size_t operator()(const ImageKey& key) const;
+  };
+
+  // A host blob `free_buffer` kept around for `allocate` to hand out again.
+  struct RecycledBlob {
+    struct ImageKey key;
+    struct WaylandBufferCreateOutput output;
+  };
+
   /*
    * Provides the read end and write end of a pipe, along with the inode (a
    * guest unique identifier) and host descriptor id;
@@ -242,20 +421,66 @@ class VirtGpuChannel : public WaylandChannel {
     uint32_t identifier;
   };
 
+  // What identifies the file an fd refers to, whichever fd it is.
+  struct FdIdentity {
+    uint64_t dev;
+    uint64_t ino;
+
+    bool operator==(const FdIdentity& other) const {
+      return dev == other.dev && ino == other.ino;
+    }
+  };
+
+  struct FdIdentityHash {
+    size_t operator()(const FdIdentity& identity) const;
+  };
+
+  // What `fd_analysis` found an fd to be.
+  struct FdIdentifier {
+    uint32_t identifier;
+    uint32_t identifier_type;
+  };
+
   int32_t image_query(const struct WaylandBufferCreateInfo& input,
                       struct WaylandBufferCreateOutput& output,
                       uint64_t& blob_id);
+  static struct ImageKey image_key(const struct WaylandBufferCreateInfo& input);
+  // Caches the image requirements for `input` the host left in the query ring.
+  int32_t cache_image_requirements(const struct WaylandBufferCreateInfo& input);
+  // Submits the first of `pending_queries_` that isn't cached yet.
+  int32_t start_next_query(int& out_fence_fd);
 
   int32_t submit_cmd(uint32_t* cmd,
                      uint32_t size,
                      uint32_t ring_idx,
                      uint32_t ring_handle,
                      bool wait);
+  int32_t execbuffer(uint32_t* cmd,
+                     uint32_t size,
+                     uint32_t ring_idx,
+                     uint32_t ring_handle,
+                     int* out_fence_fd);
+  // Like `submit_cmd`, but instead of waiting, returns a fence in
+  // `out_fence_fd` that signals once the host is done.  `done` must be
+  // called then, through `complete_async`.  One command at most may be in
+  // flight this way.
+  int32_t submit_cmd_async(uint32_t* cmd,
+                           uint32_t size,
+                           uint32_t ring_idx,
+                           uint32_t ring_handle,
+                           std::function<void()> done,
+                           int& out_fence_fd);
+  // Waits for the command `submit_cmd_async` has in flight, if any, and
+  // calls its `done`.  Its fence stays open for `handle_fence` to close.
+  void complete_async();
   int32_t channel_poll();
   int32_t close_gem_handle(uint32_t gem_handle);
   int32_t create_host_blob(uint64_t blob_id, uint64_t size, int& out_fd);
 
   int32_t fd_analysis(int fd, uint32_t& identifier, uint32_t& identifier_type);
+  // Drops what `fd_analysis` remembers about the file of `fd`, before the
+  // channel closes its last fd of it.
+  void forget_fd_identifier(int fd);
 
   int32_t create_fd(uint32_t identifier,
                     uint32_t identifier_type,
@@ -266,18 +491,30 @@ class VirtGpuChannel : public WaylandChannel {
                                uint32_t identifier,
                                uint32_t identifier_type);
 
-  int32_t handle_receive(enum WaylandChannelEvent& event_type,
+  int32_t handle_receive(uint8_t* message,
+                         enum WaylandChannelEvent& event_type,
                          struct WaylandSendReceive& receive,
                          int& out_read_pipe);
 
-  int32_t handle_read();
-
-  int32_t pipe_lookup(uint32_t identifier_type,
-                      uint32_t& identifier,
-                      int& fd,
-                      size_t& index);
-
-  int32_t create_ring(uint32_t& out_handle,
+  int32_t handle_read(uint8_t* message);
+
+  // Returns the message at the tail of the channel ring.
+  uint8_t* channel_message();
+  // Marks the message at the tail of the channel ring as consumed, and polls
+  // for more once the ring has been drained.
+  int32_t consume_channel_message();
+
+  int32_t pipe_lookup(uint32_t identifier_type, uint32_t& identifier, int& fd);
+  // Forgets the pipe, after its own end has been closed.
+  void remove_pipe(uint32_t identifier);
+  // `handle_pipe` for --stream-pipes.
+  int32_t stream_pipe(int read_fd,
+                      uint32_t identifier,
+                      bool readable,
+                      bool& hang_up);
+
+  int32_t create_ring(size_t size,
+                      uint32_t& out_handle,
                       uint32_t& out_res_id,
                       void*& out_addr);
 
@@ -288,14 +525,144 @@ class VirtGpuChannel : public WaylandChannel {
 
   void* channel_ring_addr_;
   uint32_t channel_ring_handle_;
+  size_t channel_ring_size_;
+  // Message slots in the channel ring, or 0 if it holds a single message.
+  uint32_t channel_ring_slots_;
+  // Guest copy of CrossDomainRingHeader::tail.
+  uint32_t channel_ring_tail_;
+  // A poll was submitted and its fence event hasn't been read yet.  No
+  // other poll is submitted until it is, so every event read answers one.
+  bool channel_poll_pending_;
 
   bool supports_dmabuf_;
+  bool supports_multi_slot_ring_;
+  bool supports_sync_;
   // Largest client-allocated ID so far, starts at 0x80000000
   // to avoid conflicts with the host.
   uint32_t read_pipe_id_;
 
-  std::vector<BufferDescription> description_cache_;
-  std::vector<PipeDescription> pipe_cache_;
+  std::unordered_map<ImageKey, BufferDescription, ImageKeyHash>
+      description_cache_;
+  // Oldest first.  Their host sizes add up to `recycled_blob_bytes_`.
+  std::vector<RecycledBlob> recycled_blobs_;
+  uint64_t recycled_blob_bytes_;
+  // Proxied pipes by identifier, and the identifier of the end of each pipe
+  // the channel keeps for itself.
+  std::unordered_map<uint32_t, PipeDescription> pipes_;
+  std::unordered_map<int, uint32_t> pipe_identifiers_;
+  // What `fd_analysis` found for the files sent so far, so that sending the
+  // same buffer again costs an fstat instead of two ioctls.
+  std::unordered_map<FdIdentity, FdIdentifier, FdIdentityHash>
+      identifier_cache_;
+
+  bool batch_sends_;
+  // CROSS_DOMAIN_CMD_SEND commands queued by `send`, back to back.
+  std::vector<uint8_t> send_batch_;
+
+  // Fence of the command `submit_cmd_async` has in flight, or -1, and what
+  // to call once it signals.  `async_done_` is empty once called.
+  int async_fence_fd_;
+  std::function<void()> async_done_;
+  // Image requirements `prefetch_allocation` still has to ask for.  The
+  // first is in flight while `async_fence_fd_` is valid.
+  std::deque<struct WaylandBufferCreateInfo> pending_queries_;
+
+  bool stream_pipes_;
+  // CROSS_DOMAIN_CMD_WRITE commands `stream_pipe` reads into.
+  std::vector<uint8_t> pipe_stream_buffer_;
+  // Bytes proxied to and from the host through pipes, for tracing.
+  uint64_t pipe_bytes_sent_;
+  uint64_t pipe_bytes_received_;
+  struct WaylandChannelTraffic traffic_;
+};
+
+// Sends and receives messages without fds through a ring pair in memory
+// shared with the host, given by an ivshmem-doorbell device, so that they
+// cost no ioctl (and thus no VM exit) unless the other side has to be woken
+// up.  Everything else, including messages with fds, goes through `inner`.
+//
+// Each ring record carries how many messages went through `inner` before it,
+// which is what keeps the two paths in order on either end.
+class ShmRingChannel : public WaylandChannel {
+ public:
+  // Takes ownership of `inner`, which must already be initialized.  `device`
+  // is the UIO device node of the ivshmem-doorbell device.
+  ShmRingChannel(WaylandChannel* inner, const char* device)
+      : inner_(inner),
+        device_(device),
+        device_fd_{-1},
+        registers_{MAP_FAILED},
+        region_{MAP_FAILED},
+        region_size_{},
+        host_peer_{},
+        inner_fd_{-1},
+        epoll_fd_{-1},
+        inner_sent_{},
+        inner_received_{},
+        ring_receive_held_(false),
+        traffic_{} {}
+  ~ShmRingChannel() override;
+
+  // Gives `inner` back, e.g. to carry on without the rings if `init` failed.
+  WaylandChannel* release_inner();
+
+  int32_t init() override;
+  bool supports_dmabuf() override;
+  int32_t create_context(int& out_channel_fd) override;
+  int32_t create_pipe(int& out_pipe_fd) override;
+  int32_t send(const struct WaylandSendReceive& send) override;
+  int32_t flush() override;
+  int32_t handle_channel_event(enum WaylandChannelEvent& event_type,
+                               struct WaylandSendReceive& receive,
+                               int& out_read_pipe) override;
+  int32_t release_receive(struct WaylandSendReceive& receive) override;
+  bool has_pending_event() override;
+  size_t max_receive_batch() override;
+
+  int32_t allocate(const struct WaylandBufferCreateInfo& create_info,
+                   struct WaylandBufferCreateOutput& create_output) override;
+  void free_buffer(
+      const struct WaylandBufferCreateInfo& create_info,
+      const struct WaylandBufferCreateOutput& create_output) override;
+  int32_t prefetch_allocation(const struct WaylandBufferCreateInfo& create_info,
+                              int& out_fence_fd) override;
+  int32_t handle_fence(int fence_fd, int& out_fence_fd) override;
+
+  int32_t sync(int dmabuf_fd, uint64_t flags) override;
+  int32_t import_shm(int shm_fd, size_t size, int& out_dmabuf_fd) override;
+  int32_t handle_pipe(int read_fd, bool readable, bool& hang_up) override;
+  size_t max_send_size() override;
+
+ private:
+  // Returns true if the oldest record on the receive ring may be handed out,
+  // i.e. every `inner` message the host sent before it has been received.
+  // Sets `ret` if the ring is corrupt.
+  bool ring_receive_ready(int32_t& ret);
+  void ring_doorbell();
+  void ack_interrupt();
+
+  WaylandChannel* inner_;
+  const char* device_;
+  int device_fd_;
+  // ivshmem registers and the shared region, UIO maps 0 and 1.
+  void* registers_;
+  void* region_;
+  size_t region_size_;
+  uint32_t host_peer_;
+
+  ShmRing send_ring_;
+  ShmRing receive_ring_;
+
+  // `inner` context fd, polled together with `device_fd_` by `epoll_fd_`.
+  int inner_fd_;
+  int epoll_fd_;
+  // Messages sent and received through `inner`, for ordering ring records.
+  uint32_t inner_sent_;
+  uint32_t inner_received_;
+  // Whether the receive handed out last came from the ring.
+  bool ring_receive_held_;
+  // Only what went through the rings, `inner` counts the rest.
+  struct WaylandChannelTraffic traffic_;
 };
 
 int open_virtgpu(char** drm_device);
@@ -127,6 +127,10 @@ xcb_get_geometry_reply_t* FakeXcbShim::get_geometry_reply(
   return {};
 }
 
+void FakeXcbShim::discard_reply(xcb_connection_t* c, unsigned int sequence) {
+  ADD_FAILURE() << "unimplemented";
+}
+
 xcb_get_property_cookie_t FakeXcbShim::get_property(xcb_connection_t* c,
                                                     uint8_t _delete,
                                                     xcb_window_t window,
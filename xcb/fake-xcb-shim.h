@@ -98,6 +98,7 @@ class FakeXcbShim : public XcbShim {
       xcb_connection_t* c,
       xcb_get_geometry_cookie_t cookie,
       xcb_generic_error_t** e) override;
+  void discard_reply(xcb_connection_t* c, unsigned int sequence) override;
   xcb_get_property_cookie_t get_property(xcb_connection_t* c,
                                          uint8_t _delete,
                                          xcb_window_t window,
@@ -99,6 +99,11 @@ class MockXcbShim : public XcbShim {
                xcb_generic_error_t** e),
               (override));
 
+  MOCK_METHOD(void,
+              discard_reply,
+              (xcb_connection_t * c, unsigned int sequence),
+              (override));
+
   MOCK_METHOD(xcb_get_property_cookie_t,
               get_property,
               (xcb_connection_t * c,
@@ -6,6 +6,15 @@
 #define VM_TOOLS_SOMMELIER_XCB_XCB_SHIM_H_
 
 #include <xcb/xcb.h>
+#include <xcb/xproto.h>
+
+// Tests replace the shim with mocks, which needs its methods to be virtual.
+// Builds without tests can have the calls go straight to xcb instead.
+#ifdef DIRECT_SHIMS
+#define XCB_SHIM_VIRTUAL
+#else
+#define XCB_SHIM_VIRTUAL virtual
+#endif
 
 class XcbShim {
  public:
@@ -13,73 +22,205 @@ class XcbShim {
   XcbShim(XcbShim&&) = delete;
   XcbShim& operator=(XcbShim&&) = delete;
 
-  virtual ~XcbShim() = default;
-
-  virtual xcb_connection_t* connect(const char* displayname, int* screenp);
-  virtual uint32_t generate_id(xcb_connection_t* c);
-  virtual xcb_void_cookie_t create_window(xcb_connection_t* c,
-                                          uint8_t depth,
-                                          xcb_window_t wid,
-                                          xcb_window_t parent,
-                                          int16_t x,
-                                          int16_t y,
-                                          uint16_t width,
-                                          uint16_t height,
-                                          uint16_t border_width,
-                                          uint16_t _class,
-                                          xcb_visualid_t visual,
-                                          uint32_t value_mask,
-                                          const void* value_list);
-  virtual xcb_void_cookie_t reparent_window(xcb_connection_t* c,
-                                            xcb_window_t window,
-                                            xcb_window_t parent,
-                                            int16_t x,
-                                            int16_t y);
-  virtual xcb_void_cookie_t map_window(xcb_connection_t* c,
-                                       xcb_window_t window);
-  virtual xcb_void_cookie_t configure_window(xcb_connection_t* c,
-                                             xcb_window_t window,
-                                             uint16_t value_mask,
-                                             const void* value_list);
-  virtual xcb_void_cookie_t change_property(xcb_connection_t* c,
-                                            uint8_t mode,
-                                            xcb_window_t window,
-                                            xcb_atom_t property,
-                                            xcb_atom_t type,
-                                            uint8_t format,
-                                            uint32_t data_len,
-                                            const void* data);
-  virtual xcb_void_cookie_t send_event(xcb_connection_t* c,
-                                       uint8_t propagate,
-                                       xcb_window_t destination,
-                                       uint32_t event_mask,
-                                       const char* event);
-  virtual xcb_void_cookie_t change_window_attributes(xcb_connection_t* c,
+  XCB_SHIM_VIRTUAL ~XcbShim() = default;
+
+  XCB_SHIM_VIRTUAL xcb_connection_t* connect(
+      const char* displayname, int* screenp);
+  XCB_SHIM_VIRTUAL uint32_t generate_id(xcb_connection_t* c);
+  XCB_SHIM_VIRTUAL xcb_void_cookie_t create_window(xcb_connection_t* c,
+                                                   uint8_t depth,
+                                                   xcb_window_t wid,
+                                                   xcb_window_t parent,
+                                                   int16_t x,
+                                                   int16_t y,
+                                                   uint16_t width,
+                                                   uint16_t height,
+                                                   uint16_t border_width,
+                                                   uint16_t _class,
+                                                   xcb_visualid_t visual,
+                                                   uint32_t value_mask,
+                                                   const void* value_list);
+  XCB_SHIM_VIRTUAL xcb_void_cookie_t reparent_window(xcb_connection_t* c,
+                                                     xcb_window_t window,
+                                                     xcb_window_t parent,
+                                                     int16_t x,
+                                                     int16_t y);
+  XCB_SHIM_VIRTUAL xcb_void_cookie_t map_window(xcb_connection_t* c,
+                                                xcb_window_t window);
+  XCB_SHIM_VIRTUAL xcb_void_cookie_t configure_window(xcb_connection_t* c,
+                                                      xcb_window_t window,
+                                                      uint16_t value_mask,
+                                                      const void* value_list);
+  XCB_SHIM_VIRTUAL xcb_void_cookie_t change_property(xcb_connection_t* c,
+                                                     uint8_t mode,
                                                      xcb_window_t window,
-                                                     uint32_t value_mask,
-                                                     const void* value_list);
-  virtual xcb_get_geometry_cookie_t get_geometry(xcb_connection_t* c,
-                                                 xcb_drawable_t drawable);
-  virtual xcb_get_geometry_reply_t* get_geometry_reply(
+                                                     xcb_atom_t property,
+                                                     xcb_atom_t type,
+                                                     uint8_t format,
+                                                     uint32_t data_len,
+                                                     const void* data);
+  XCB_SHIM_VIRTUAL xcb_void_cookie_t send_event(xcb_connection_t* c,
+                                                uint8_t propagate,
+                                                xcb_window_t destination,
+                                                uint32_t event_mask,
+                                                const char* event);
+  XCB_SHIM_VIRTUAL xcb_void_cookie_t change_window_attributes(
+      xcb_connection_t* c,
+      xcb_window_t window,
+      uint32_t value_mask,
+      const void* value_list);
+  XCB_SHIM_VIRTUAL xcb_get_geometry_cookie_t get_geometry(
+      xcb_connection_t* c, xcb_drawable_t drawable);
+  XCB_SHIM_VIRTUAL xcb_get_geometry_reply_t* get_geometry_reply(
       xcb_connection_t* c,
       xcb_get_geometry_cookie_t cookie,
       xcb_generic_error_t** e);
-  virtual xcb_get_property_cookie_t get_property(xcb_connection_t* c,
-                                                 uint8_t _delete,
-                                                 xcb_window_t window,
-                                                 xcb_atom_t property,
-                                                 xcb_atom_t type,
-                                                 uint32_t long_offset,
-                                                 uint32_t long_length);
-  virtual xcb_get_property_reply_t* get_property_reply(
+  XCB_SHIM_VIRTUAL void discard_reply(xcb_connection_t* c,
+                                      unsigned int sequence);
+  XCB_SHIM_VIRTUAL xcb_get_property_cookie_t get_property(xcb_connection_t* c,
+                                                          uint8_t _delete,
+                                                          xcb_window_t window,
+                                                          xcb_atom_t property,
+                                                          xcb_atom_t type,
+                                                          uint32_t long_offset,
+                                                          uint32_t long_length);
+  XCB_SHIM_VIRTUAL xcb_get_property_reply_t* get_property_reply(
       xcb_connection_t* c,
       xcb_get_property_cookie_t cookie,
       xcb_generic_error_t** e);
-  virtual void* get_property_value(const xcb_get_property_reply_t* r);
-  virtual int get_property_value_length(const xcb_get_property_reply_t* r);
+  XCB_SHIM_VIRTUAL void* get_property_value(const xcb_get_property_reply_t* r);
+  XCB_SHIM_VIRTUAL int get_property_value_length(
+      const xcb_get_property_reply_t* r);
 };
 
+inline xcb_connection_t* XcbShim::connect(
+    const char* displayname, int* screenp) {
+  return xcb_connect(displayname, screenp);
+}
+
+inline uint32_t XcbShim::generate_id(xcb_connection_t* c) {
+  return xcb_generate_id(c);
+}
+
+inline xcb_void_cookie_t XcbShim::create_window(xcb_connection_t* c,
+                                                uint8_t depth,
+                                                xcb_window_t wid,
+                                                xcb_window_t parent,
+                                                int16_t x,
+                                                int16_t y,
+                                                uint16_t width,
+                                                uint16_t height,
+                                                uint16_t border_width,
+                                                uint16_t _class,
+                                                xcb_visualid_t visual,
+                                                uint32_t value_mask,
+                                                const void* value_list) {
+  return xcb_create_window(c, depth, wid, parent, x, y, width, height,
+                           border_width, _class, visual, value_mask,
+                           value_list);
+}
+
+inline xcb_void_cookie_t XcbShim::reparent_window(xcb_connection_t* c,
+                                                  xcb_window_t window,
+                                                  xcb_window_t parent,
+                                                  int16_t x,
+                                                  int16_t y) {
+  return xcb_reparent_window(c, window, parent, x, y);
+}
+
+inline xcb_void_cookie_t XcbShim::map_window(xcb_connection_t* c,
+                                             xcb_window_t window) {
+  return xcb_map_window(c, window);
+}
+
+inline xcb_void_cookie_t XcbShim::configure_window(xcb_connection_t* c,
+                                                   xcb_window_t window,
+                                                   uint16_t value_mask,
+                                                   const void* value_list) {
+  return xcb_configure_window(c, window, value_mask, value_list);
+}
+
+inline xcb_void_cookie_t XcbShim::change_property(xcb_connection_t* c,
+                                                  uint8_t mode,
+                                                  xcb_window_t window,
+                                                  xcb_atom_t property,
+                                                  xcb_atom_t type,
+                                                  uint8_t format,
+                                                  uint32_t data_len,
+                                                  const void* data) {
+  return xcb_change_property(c, mode, window, property, type, format, data_len,
+                             data);
+}
+
+inline xcb_void_cookie_t XcbShim::send_event(xcb_connection_t* c,
+                                             uint8_t propagate,
+                                             xcb_window_t destination,
+                                             uint32_t event_mask,
+                                             const char* event) {
+  return xcb_send_event(c, propagate, destination, event_mask, event);
+}
+
+inline xcb_void_cookie_t XcbShim::change_window_attributes(
+    xcb_connection_t* c,
+    xcb_window_t window,
+    uint32_t value_mask,
+    const void* value_list) {
+  return xcb_change_window_attributes(c, window, value_mask, value_list);
+}
+
+inline xcb_get_geometry_cookie_t XcbShim::get_geometry(
+    xcb_connection_t* c, xcb_drawable_t drawable) {
+  return xcb_get_geometry(c, drawable);
+}
+
+inline xcb_get_geometry_reply_t* XcbShim::get_geometry_reply(
+    xcb_connection_t* c,
+    xcb_get_geometry_cookie_t cookie,
+    xcb_generic_error_t** e) {
+  return xcb_get_geometry_reply(c, cookie, e);
+}
+
+inline void XcbShim::discard_reply(xcb_connection_t* c, unsigned int sequence) {
+  xcb_discard_reply(c, sequence);
+}
+
+inline xcb_get_property_cookie_t XcbShim::get_property(xcb_connection_t* c,
+                                                       uint8_t _delete,
+                                                       xcb_window_t window,
+                                                       xcb_atom_t property,
+                                                       xcb_atom_t type,
+                                                       uint32_t long_offset,
+                                                       uint32_t long_length) {
+  return xcb_get_property(c, _delete, window, property, type, long_offset,
+                          long_length);
+}
+
+inline xcb_get_property_reply_t* XcbShim::get_property_reply(
+    xcb_connection_t* c,
+    xcb_get_property_cookie_t cookie,
+    xcb_generic_error_t** e) {
+  return xcb_get_property_reply(c, cookie, e);
+}
+
+inline void* XcbShim::get_property_value(const xcb_get_property_reply_t* r) {
+  return xcb_get_property_value(r);
+}
+
+inline int XcbShim::get_property_value_length(
+    const xcb_get_property_reply_t* r) {
+  return xcb_get_property_value_length(r);
+}
+
+#ifdef DIRECT_SHIMS
+// Direct shims have no state, so one shared instance serves every caller
+// and there is nothing to set.
+inline XcbShim* xcb() {
+  static XcbShim shim;
+  return &shim;
+}
+#else
 XcbShim* xcb();
 void set_xcb_shim(XcbShim* shim);
+#endif
 
 #endif  // VM_TOOLS_SOMMELIER_XCB_XCB_SHIM_H_